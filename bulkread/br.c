@@ -200,6 +200,10 @@ int main(int argc, char **argv)
     }
   }
 
+  /* ask for raw data, servers which do not know about it just fail the request */
+  append_string_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?binary-encoding");
+  append_string_katcl(l, KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCL_BINARY_NAME);
+
   append_string_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?bulkread");
   
   flags = (((offset == 0) && (bytes == 0)) ? KATCP_FLAG_LAST : 0) | KATCP_FLAG_STRING;
@@ -275,6 +279,7 @@ int main(int argc, char **argv)
                   return 2;
                 }
                 buffer = tmp;
+                bufsize = bufwant;
                 bufwant = arg_buffer_katcl(l, 1, buffer, bufsize);
               }
               if(bufwant <= 0){
@@ -322,6 +327,14 @@ int main(int argc, char **argv)
                 fprintf(stderr, "%s: error: unable to acquire bulkread status code\n", app);
                 return 2;
               }
+            } else if(!strcmp("!binary-encoding", ptr)){
+              ptr = arg_string_katcl(l, 1);
+              if(ptr && !strcmp(KATCP_OK, ptr)){
+                ptr = arg_string_katcl(l, 2);
+                if(ptr && !strcmp(KATCL_BINARY_NAME, ptr)){
+                  binary_katcl(l, 1);
+                }
+              } /* else server only escapes, which we handle anyway */
             } else {
               fprintf(stderr, "%s: warning: unexpected reply %s\n", app, ptr);
             }
@@ -12,6 +12,7 @@
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
 
 #include <sys/select.h>
 #include <sys/time.h>
@@ -27,6 +28,8 @@
 #define FMT_HEX    2
 #define FMT_BIN    3
 
+#define WINDOW     8
+
 void usage(char *app)
 {
   printf("usage: %s [options] command [args]\n", app);
@@ -45,10 +48,12 @@ void usage(char *app)
   printf("-i                 toggle printing of inform messages\n");
   printf("-m                 munge replies into log messages (requires -k)\n");
   printf("-n                 suppress version information emitted on connect\n");
+  printf("-f file            batch mode: read requests from file (- for stdin) over one connection\n");
+  printf("-w count           batch mode: number of requests to keep in flight (default %d)\n", WINDOW);
 
   printf("return codes:\n");
   printf("0     command completed successfully\n");
-  printf("1     command failed\n");
+  printf("1     command failed (in batch mode: at least one request failed)\n");
   printf("2     other errors\n");
 
   printf("environment variables:\n");
@@ -57,6 +62,8 @@ void usage(char *app)
   printf("notes:\n");
   printf("  command and parameters have to be given as separate arguments\n");
   printf("  hex and auto mode will convert parameters starting with 0x from hex to binary\n");
+  printf("  batch input holds one katcp request per line, for example ?watchdog\n");
+  printf("  batch replies are matched by name, output is in order if the server answers in order\n");
 }
 
 #define BUFFER 1024
@@ -248,12 +255,349 @@ int load_arg(struct katcl_line *l, char *arg, int fmt, int flags)
   }
 }
 
+int display_inform(char *cmd, int info, int show)
+{
+  if(info == 0){
+    return 0;
+  }
+
+  if(show == 0){
+    if(!strcmp(KATCP_VERSION_CONNECT_INFORM, cmd)){
+      return 0;
+    }
+    if(!strcmp(KATCP_VERSION_INFORM, cmd)){
+      return 0;
+    }
+    if(!strcmp(KATCP_BUILD_STATE_INFORM, cmd)){
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+int display_message(char *app, struct katcl_line *l, struct katcl_line *k, char *cmd, char *parm, int fmt, int pos, int munge)
+{
+  char *extra;
+  int i, max;
+
+#ifdef DEBUG
+  fprintf(stderr, "need to display\n");
+#endif
+
+  if(k){
+    if(munge && parm && (cmd[0] == KATCP_REPLY)){
+      if(!strcmp(parm, KATCP_OK)){
+        sync_message_katcl(k, KATCP_LEVEL_DEBUG, cmd + 1, KATCP_OK);
+      } else {
+        extra = arg_string_katcl(l, 2);
+        sync_message_katcl(k, KATCP_LEVEL_WARN, cmd + 1, "%s (%s)", parm, extra ? extra : "no extra information");
+      } 
+    } else {
+      relay_katcl(l, k);
+    }
+    return 0;
+  } 
+
+  max = arg_count_katcl(l);
+  if(pos < 0){
+    for(i = 0; i < max; i++){
+      if(print_arg(l, i, fmt) < 0){
+        fprintf(stderr, "%s: failed to print argument %d\n", app, i);
+        return -1;
+      }
+      fputc(((i + 1) == max) ? '\n' : ' ' , stdout);
+    }
+  } else {
+    if(pos < max){
+      i = pos;
+      if(print_arg(l, i, fmt) < 0){
+        fprintf(stderr, "%s: failed to print argument %d\n", app, i);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*********************************************************************/
+/* batch mode: many requests over one connection *********************/
+
+struct batch{
+  char *b_app;
+  char *b_label;
+
+  struct katcl_line *b_line;
+  struct katcl_line *b_log;
+  struct katcl_line *b_input;
+
+  int b_fmt;
+  int b_pos;
+  int b_info;
+  int b_reply;
+  int b_show;
+  int b_munge;
+  int b_verbose;
+  int b_timeout;
+
+  char **b_pending;
+  unsigned int b_window;
+  unsigned int b_count;
+
+  unsigned int b_sent;
+  unsigned int b_failed;
+
+  int b_eof;
+};
+
+static int submit_batch(struct batch *b)
+{
+  struct katcl_line *l;
+  char *cmd, *ptr;
+  int i, max, flags;
+
+  l = b->b_line;
+
+  cmd = arg_string_katcl(b->b_input, 0);
+  if(cmd == NULL){
+    return 0;
+  }
+
+  if(cmd[0] == KATCP_REQUEST){
+    ptr = strdup(cmd + 1);
+    if(ptr == NULL){
+      return -1;
+    }
+    b->b_pending[b->b_count] = ptr;
+    b->b_count++;
+    b->b_sent++;
+  }
+
+  switch(b->b_fmt){
+    case FMT_HEX  :
+    case FMT_AUTO :
+      max = arg_count_katcl(b->b_input);
+      flags = (max > 1) ? KATCP_FLAG_FIRST : (KATCP_FLAG_FIRST | KATCP_FLAG_LAST);
+      if(append_string_katcl(l, flags, cmd) < 0){
+        return -1;
+      }
+      for(i = 1; i < max; i++){
+        ptr = arg_string_katcl(b->b_input, i);
+        flags = ((i + 1) < max) ? 0 : KATCP_FLAG_LAST;
+        if(load_arg(l, ptr ? ptr : "", b->b_fmt, flags) < 0){
+          return -1;
+        }
+      }
+      return 0;
+    default :
+      return relay_katcl(b->b_input, l);
+  }
+}
+
+/* a reply completes the oldest outstanding request of the same name */
+
+static int complete_batch(struct batch *b, char *name, char *parm)
+{
+  unsigned int i;
+
+  for(i = 0; (i < b->b_count) && strcmp(b->b_pending[i], name); i++);
+
+  if(i >= b->b_count){
+    return -1;
+  }
+
+  free(b->b_pending[i]);
+  b->b_count--;
+  for(; i < b->b_count; i++){
+    b->b_pending[i] = b->b_pending[i + 1];
+  }
+
+  if((parm == NULL) || strcmp(parm, KATCP_OK)){
+    b->b_failed++;
+  }
+
+  return 0;
+}
+
+int run_batch(struct batch *b)
+{
+  struct katcl_line *l, *k;
+  char *cmd, *parm;
+  int fd, in, max, result, display;
+  fd_set fsr, fsw;
+  struct timeval tv;
+
+  l = b->b_line;
+  k = b->b_log;
+
+  fd = fileno_katcl(l);
+  in = fileno_katcl(b->b_input);
+
+  b->b_pending = malloc(sizeof(char *) * b->b_window);
+  if(b->b_pending == NULL){
+    fprintf(stderr, "%s: unable to allocate space for %u pending requests\n", b->b_app, b->b_window);
+    return 2;
+  }
+
+  for(;;){
+
+    /* top up the window from whatever input has already been read */
+    while((b->b_count < b->b_window) && (have_katcl(b->b_input) > 0)){
+      if(submit_batch(b) < 0){
+        if(k){
+          sync_message_katcl(k, KATCP_LEVEL_ERROR, b->b_label, "unable to queue request %u", b->b_sent + 1);
+        }
+        fprintf(stderr, "%s: unable to queue request %u\n", b->b_app, b->b_sent + 1);
+        return 2;
+      }
+    }
+
+    if(b->b_eof && (b->b_count == 0) && !flushing_katcl(l)){
+      break;
+    }
+
+    FD_ZERO(&fsr);
+    FD_ZERO(&fsw);
+
+    FD_SET(fd, &fsr);
+    max = fd;
+
+    if((b->b_eof == 0) && (b->b_count < b->b_window)){
+      FD_SET(in, &fsr);
+      if(in > max){
+        max = in;
+      }
+    }
+
+    if(flushing_katcl(l)){
+      FD_SET(fd, &fsw);
+    }
+
+    tv.tv_sec  = b->b_timeout;
+    tv.tv_usec = 0;
+
+    /* only time out if we are waiting on the server */
+    result = select(max + 1, &fsr, &fsw, NULL, ((b->b_count > 0) || flushing_katcl(l)) ? &tv : NULL);
+    switch(result){
+      case -1 :
+        switch(errno){
+          case EAGAIN :
+          case EINTR  :
+            continue; /* WARNING */
+          default  :
+            if(k){
+              sync_message_katcl(k, KATCP_LEVEL_ERROR, b->b_label, "select failed: %s", strerror(errno));
+            }
+            return 2;
+        }
+        break;
+      case  0 :
+        if(k){
+          sync_message_katcl(k, KATCP_LEVEL_ERROR, b->b_label, "%u outstanding requests timed out after %d seconds", b->b_count, b->b_timeout);
+        } 
+        if(b->b_verbose){
+          fprintf(stderr, "%s: no io activity within %d seconds\n", b->b_app, b->b_timeout);
+        }
+        return 2;
+    }
+
+    if(FD_ISSET(fd, &fsw)){
+      result = write_katcl(l);
+      if(result < 0){
+        if(k){
+          sync_message_katcl(k, KATCP_LEVEL_ERROR, b->b_label, "write failed: %s", strerror(error_katcl(l)));
+        } 
+        fprintf(stderr, "%s: write failed: %s\n", b->b_app, strerror(error_katcl(l)));
+        return 2;
+      }
+    }
+
+    if(FD_ISSET(in, &fsr)){
+      result = read_katcl(b->b_input);
+      if(result){
+        if(result < 0){
+          fprintf(stderr, "%s: unable to read requests: %s\n", b->b_app, strerror(error_katcl(b->b_input)));
+          return 2;
+        }
+        b->b_eof = 1;
+      }
+    }
+
+    if(FD_ISSET(fd, &fsr)){
+      result = read_katcl(l);
+      if(result){
+        if(k){
+          sync_message_katcl(k, KATCP_LEVEL_ERROR, b->b_label, "read failed: %s", (result < 0) ? strerror(error_katcl(l)) : "connection terminated");
+        } 
+        fprintf(stderr, "%s: read failed: %s\n", b->b_app, (result < 0) ? strerror(error_katcl(l)) : "connection terminated");
+        return 2;
+      }
+    }
+
+    while(have_katcl(l) > 0){
+      cmd = arg_string_katcl(l, 0);
+      if(cmd == NULL){
+        continue;
+      }
+
+      display = 0;
+      parm = NULL;
+
+      switch(cmd[0]){
+        case KATCP_INFORM : 
+          display = display_inform(cmd, b->b_info, b->b_show);
+          break;
+        case KATCP_REPLY : 
+          display = b->b_reply;
+          parm = arg_string_katcl(l, 1);
+          if(complete_batch(b, cmd + 1, parm) < 0){
+            if(k){
+              sync_message_katcl(k, KATCP_LEVEL_WARN, b->b_label, "encountered unexpected reply %s", cmd);
+            } 
+            fprintf(stderr, "%s: warning: encountered unexpected reply <%s>\n", b->b_app, cmd);
+          }
+          break;
+        case KATCP_REQUEST : 
+          if(k){
+            sync_message_katcl(k, KATCP_LEVEL_WARN, b->b_label, "encountered unanswerable request %s", cmd);
+          } 
+          fprintf(stderr, "%s: warning: encountered an unanswerable request <%s>\n", b->b_app, cmd);
+          break;
+        default :
+          if(k){
+            sync_message_katcl(k, KATCP_LEVEL_WARN, b->b_label, "read malformed message %s", cmd);
+          } 
+          fprintf(stderr, "%s: read malformed message <%s>\n", b->b_app, cmd);
+          break;
+      }
+
+      if(display){
+        if(display_message(b->b_app, l, k, cmd, parm, b->b_fmt, b->b_pos, b->b_munge) < 0){
+          return 2;
+        }
+      }
+    }
+  }
+
+  if(b->b_verbose > 1){
+    fprintf(stderr, "%s: %u of %u requests failed\n", b->b_app, b->b_failed, b->b_sent);
+  }
+
+  if(k && b->b_failed){
+    sync_message_katcl(k, KATCP_LEVEL_WARN, b->b_label, "%u of %u requests failed", b->b_failed, b->b_sent);
+  }
+
+  return (b->b_failed > 0) ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
-  char *app, *server, *match, *parm, *tmp, *cmd, *extra, *label;
-  int i, j, c, fd;
-  int verbose, result, status, base, run, info, reply, display, max, prefix, timeout, fmt, pos, flags, munge, show;
+  char *app, *server, *match, *parm, *tmp, *cmd, *label, *batch;
+  int i, j, c, fd, in;
+  int verbose, result, status, base, run, info, reply, display, prefix, timeout, fmt, pos, flags, munge, show, window;
   struct katcl_line *l, *k;
+  struct batch bx;
   fd_set fsr, fsw;
   struct timeval tv;
 
@@ -277,6 +621,8 @@ int main(int argc, char **argv)
   munge = 0;
   show = 1;
   parm = NULL;
+  batch = NULL;
+  window = WINDOW;
 
   while (i < argc) {
     if (argv[i][0] == '-') {
@@ -334,10 +680,12 @@ int main(int argc, char **argv)
           j++;
           break;
 
+        case 'f' :
         case 'l' :
         case 's' :
         case 't' :
         case 'p' :
+        case 'w' :
 
           j++;
           if (argv[i][j] == '\0') {
@@ -350,6 +698,9 @@ int main(int argc, char **argv)
           }
 
           switch(c){
+            case 'f' :
+              batch = argv[i] + j;
+              break;
             case 'l' :
               label = argv[i] + j;
               break;
@@ -366,6 +717,13 @@ int main(int argc, char **argv)
                 return 2;
               }
               break;
+            case 'w' :
+              window = atoi(argv[i] + j);
+              if(window <= 0){
+                fprintf(stderr, "%s: window needs to be positive, not %d\n", app, window);
+                return 2;
+              }
+              break;
           }
 
           i++;
@@ -395,7 +753,12 @@ int main(int argc, char **argv)
     }
   }
 
-  if(base < 0){
+  if(batch && (base >= 0)){
+    fprintf(stderr, "%s: batch mode takes its requests from %s, not the command line\n", app, batch);
+    return 2;
+  }
+
+  if((base < 0) && (batch == NULL)){
     if(k){
       sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "no command given");
     }
@@ -430,6 +793,66 @@ int main(int argc, char **argv)
     return 2;
   }
 
+  if(batch){
+    if(strcmp(batch, "-")){
+      in = open(batch, O_RDONLY);
+      if(in < 0){
+        fprintf(stderr, "%s: unable to open %s: %s\n", app, batch, strerror(errno));
+        return 2;
+      }
+    } else {
+      in = STDIN_FILENO;
+    }
+
+    bx.b_app = app;
+    bx.b_label = label;
+    bx.b_line = l;
+    bx.b_log = k;
+    bx.b_input = create_katcl(in);
+    if(bx.b_input == NULL){
+      fprintf(stderr, "%s: unable to create katcp parser for requests\n", app);
+      return 2;
+    }
+
+    bx.b_fmt = fmt;
+    bx.b_pos = pos;
+    bx.b_info = info;
+    bx.b_reply = reply;
+    bx.b_show = show;
+    bx.b_munge = munge;
+    bx.b_verbose = verbose;
+    bx.b_timeout = timeout;
+
+    bx.b_pending = NULL;
+    bx.b_window = window;
+    bx.b_count = 0;
+
+    bx.b_sent = 0;
+    bx.b_failed = 0;
+
+    bx.b_eof = 0;
+
+    status = run_batch(&bx);
+
+    while(bx.b_count > 0){
+      bx.b_count--;
+      free(bx.b_pending[bx.b_count]);
+    }
+    if(bx.b_pending){
+      free(bx.b_pending);
+    }
+
+    destroy_katcl(bx.b_input, (in == STDIN_FILENO) ? 0 : 1);
+
+    destroy_katcl(l, 1);
+    if(k){
+      while(write_katcl(k) == 0);
+      destroy_katcl(k, 0);
+    }
+
+    return status;
+  }
+
   i = base;
   match = NULL;
   flags = ((i + 1) < argc) ? KATCP_FLAG_FIRST : (KATCP_FLAG_FIRST | KATCP_FLAG_LAST);
@@ -544,19 +967,7 @@ int main(int argc, char **argv)
         display = 0;
       	switch(cmd[0]){
           case KATCP_INFORM : 
-            display = info;
-            if(show == 0){
-              if(!strcmp(KATCP_VERSION_CONNECT_INFORM, cmd)){
-                display = 0;
-              }
-              if(!strcmp(KATCP_VERSION_INFORM, cmd)){
-                display = 0;
-              }
-              if(!strcmp(KATCP_BUILD_STATE_INFORM, cmd)){
-                display = 0;
-              }
-            }
-
+            display = display_inform(cmd, info, show);
             break;
           case KATCP_REPLY : 
             display = reply;
@@ -589,39 +1000,8 @@ int main(int argc, char **argv)
             break;
         }
         if(display){
-#ifdef DEBUG
-          fprintf(stderr, "need to display\n");
-#endif
-          if(k){
-            if(munge && parm && (cmd[0] == KATCP_REPLY)){
-              if(!strcmp(parm, KATCP_OK)){
-                sync_message_katcl(k, KATCP_LEVEL_DEBUG, cmd + 1, KATCP_OK);
-              } else {
-                extra = arg_string_katcl(l, 2);
-                sync_message_katcl(k, KATCP_LEVEL_WARN, cmd + 1, "%s (%s)", parm, extra ? extra : "no extra information");
-              } 
-            } else {
-              relay_katcl(l, k);
-            }
-          } else {
-            max = arg_count_katcl(l);
-            if(pos < 0){
-              for(i = 0; i < max; i++){
-                if(print_arg(l, i, fmt) < 0){
-                  fprintf(stderr, "%s: failed to print argument %d\n", app, i);
-                  return 2;
-                }
-                fputc(((i + 1) == max) ? '\n' : ' ' , stdout);
-              }
-            } else {
-              if(pos < max){
-                i = pos;
-                if(print_arg(l, i, fmt) < 0){
-                  fprintf(stderr, "%s: failed to print argument %d\n", app, i);
-                  return 2;
-                }
-              }
-            }
+          if(display_message(app, l, k, cmd, parm, fmt, pos, munge) < 0){
+            return 2;
           }
         }
       }
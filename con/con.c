@@ -26,6 +26,12 @@
 #define BUFFER 1024
 #define TIMEOUT   4
 
+#define CON_BACKLOG   512  /* stop reading children while this many messages wait to go out */
+
+#define CHILD_PENDING   0
+#define CHILD_RUNNING   1
+#define CHILD_DONE      2
+
 #define RX_SETUP 1 
 #define RX_UP    2 
 #define RX_OK    0
@@ -36,6 +42,14 @@ struct child{
   pid_t c_pid;
   struct katcl_line *c_line;
   int c_status;
+
+  int c_state;
+  unsigned int c_index;
+  char *c_command;
+
+  /* informs held back until the child completes, only used with -b */
+  struct katcl_parse **c_held;
+  unsigned int c_held_count;
 };
 
 struct state{
@@ -43,6 +57,12 @@ struct state{
   unsigned int s_count;
   unsigned int s_finished;
 
+  unsigned int s_next;
+  unsigned int s_running;
+  unsigned int s_limit;  /* 0 means no limit */
+  int s_buffered;
+  int s_verbose;
+
   struct katcl_line *s_up;
   int s_code;
 };
@@ -64,6 +84,8 @@ static void handle_child(int signal)
 
 void destroy_child(struct child *c)
 {
+  unsigned int i;
+
   if(c == NULL){
     return;
   }
@@ -78,11 +100,54 @@ void destroy_child(struct child *c)
     c->c_line = NULL;
   }
 
+  if(c->c_held){
+    for(i = 0; i < c->c_held_count; i++){
+      destroy_parse_katcl(c->c_held[i]);
+    }
+    free(c->c_held);
+    c->c_held = NULL;
+  }
+  c->c_held_count = 0;
+
+  if(c->c_command){
+    free(c->c_command);
+    c->c_command = NULL;
+  }
+
   c->c_status = (-1);
 
   free(c);
 }
 
+struct child *create_child(char *command, unsigned int index)
+{
+  struct child *c;
+
+  c = malloc(sizeof(struct child));
+  if(c == NULL){
+    return NULL;
+  }
+
+  c->c_pid = 0;
+  c->c_line = NULL;
+  c->c_status = 0;
+
+  c->c_state = CHILD_PENDING;
+  c->c_index = index;
+  c->c_command = NULL;
+
+  c->c_held = NULL;
+  c->c_held_count = 0;
+
+  c->c_command = strdup(command);
+  if(c->c_command == NULL){
+    destroy_child(c);
+    return NULL;
+  }
+
+  return c;
+}
+
 /*********************************************************************/
 
 void destroy_state(struct state *s)
@@ -108,6 +173,8 @@ void destroy_state(struct state *s)
   }
   s->s_count = 0;
   s->s_finished = 0;
+  s->s_next = 0;
+  s->s_running = 0;
   s->s_code = 0;
 
   free(s);
@@ -127,6 +194,12 @@ struct state *create_state(int fd)
   s->s_finished = 0;
   s->s_code = 0;
 
+  s->s_next = 0;
+  s->s_running = 0;
+  s->s_limit = 0;
+  s->s_buffered = 0;
+  s->s_verbose = 1;
+
   s->s_up = create_katcl(fd);
   if(s->s_up == NULL){
     destroy_state(s);
@@ -138,14 +211,10 @@ struct state *create_state(int fd)
 
 /*********************************************************************/
 
-int launch_child(struct state *s, char **vector)
+int queue_child(struct state *s, char *command)
 {
-  int fds[2], fd;
-  pid_t pid;
   struct child **tmp;
   struct child *c;
-  struct katcl_line *k;
-  unsigned int i;
 
   tmp = realloc(s->s_vector, sizeof(struct child *) * (s->s_count + 1));
   if(tmp == NULL){
@@ -154,18 +223,68 @@ int launch_child(struct state *s, char **vector)
 
   s->s_vector = tmp;
 
-  c = malloc(sizeof(struct child));
+  c = create_child(command, s->s_count);
   if(c == NULL){
     return -1;
   }
 
-  c->c_pid = 0;
-  c->c_line = NULL;
-  c->c_status = 0;
+  s->s_vector[s->s_count] = c;
+  s->s_count++;
+
+  return 0;
+}
+
+int load_children(struct state *s, char *name)
+{
+  FILE *fp;
+  char line[BUFFER], *ptr;
+  unsigned int len;
+
+  if(strcmp(name, "-")){
+    fp = fopen(name, "r");
+    if(fp == NULL){
+      sync_message_katcl(s->s_up, KATCP_LEVEL_ERROR, KCPCON_NAME, "unable to open %s: %s", name, strerror(errno));
+      return -1;
+    }
+  } else {
+    fp = stdin;
+  }
+
+  /* one command per line, blank lines and # comments skipped */
+  while(fgets(line, BUFFER, fp)){
+    len = strlen(line);
+    while((len > 0) && isspace(line[len - 1])){
+      line[--len] = '\0';
+    }
+    for(ptr = line; isspace(*ptr); ptr++);
+    if((*ptr == '\0') || (*ptr == '#')){
+      continue;
+    }
+    if(queue_child(s, ptr) < 0){
+      if(fp != stdin){
+        fclose(fp);
+      }
+      return -1;
+    }
+  }
+
+  if(fp != stdin){
+    fclose(fp);
+  }
+
+  return 0;
+}
+
+int launch_child(struct state *s, struct child *c, char **vector)
+{
+  int fds[2], fd;
+  pid_t pid;
+  struct katcl_line *k;
+  unsigned int i;
+  sigset_t mask;
 
   if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0){
     sync_message_katcl(s->s_up, KATCP_LEVEL_ERROR, KCPCON_NAME, "unable to allocate socketpair: %s", strerror(errno));
-    destroy_child(c);
     return -1;
   }
 
@@ -174,7 +293,6 @@ int launch_child(struct state *s, char **vector)
     sync_message_katcl(s->s_up, KATCP_LEVEL_ERROR, KCPCON_NAME, "unable to fork: %s", strerror(errno));
     close(fds[0]);
     close(fds[1]);
-    destroy_child(c);
     return -1;
   }
 
@@ -186,12 +304,10 @@ int launch_child(struct state *s, char **vector)
 
     c->c_line = create_katcl(fds[1]);
     if(c->c_line == NULL){
-      destroy_child(c);
+      close(fds[1]);
+      sync_message_katcl(s->s_up, KATCP_LEVEL_ERROR, KCPCON_NAME, "unable to allocate line for job %u", pid);
     }
 
-    s->s_vector[s->s_count] = c;
-    s->s_count++;
-
     return 0;
   }
 
@@ -199,6 +315,11 @@ int launch_child(struct state *s, char **vector)
 
   close(fds[1]);
 
+  /* the parent keeps SIGCHLD blocked outside pselect, which exec would inherit */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
   fd = fds[0];
 
   k = create_katcl(fd);
@@ -224,13 +345,14 @@ int launch_child(struct state *s, char **vector)
   return -1;
 }
 
-int string_launch_child(struct state *s, char *string)
+int string_launch_child(struct state *s, struct child *c)
 {
   char **vector, **tmp;
-  char *t;
+  char *t, *string;
   unsigned int i, v, j, d, ws;
   int run;
 
+  string = c->c_command;
   vector = NULL;
   j = 0; 
   i = 0;
@@ -288,7 +410,7 @@ int string_launch_child(struct state *s, char *string)
 #ifdef DEBUG
   fprintf(stderr, "have vector <%s ...> of %u entries\n", vector[0], v);
 #endif
-    run = launch_child(s, vector);
+    run = launch_child(s, c, vector);
   }
 
   if(vector){
@@ -306,12 +428,125 @@ int string_launch_child(struct state *s, char *string)
 
 /*******************************************************************************/
 
+static int hold_child(struct child *c, struct katcl_parse *p)
+{
+  struct katcl_parse **tmp;
+
+  tmp = realloc(c->c_held, sizeof(struct katcl_parse *) * (c->c_held_count + 1));
+  if(tmp == NULL){
+    return -1;
+  }
+  c->c_held = tmp;
+
+  c->c_held[c->c_held_count] = copy_parse_katcl(p);
+  if(c->c_held[c->c_held_count] == NULL){
+    return -1;
+  }
+
+  c->c_held_count++;
+
+  return 0;
+}
+
+void complete_child(struct state *s, struct child *c)
+{
+  unsigned int i;
+
+  /* only done once both the output has ended and the process has been reaped */
+  if((c->c_state != CHILD_RUNNING) || c->c_line || (c->c_pid > 0)){
+    return;
+  }
+
+  c->c_state = CHILD_DONE;
+
+  s->s_running--;
+  s->s_finished++;
+
+  for(i = 0; i < c->c_held_count; i++){
+    append_parse_katcl(s->s_up, c->c_held[i]);
+    destroy_parse_katcl(c->c_held[i]);
+  }
+  c->c_held_count = 0;
+
+  if(c->c_status > s->s_code){
+    s->s_code = c->c_status;
+  }
+
+  if(s->s_verbose > 0){
+    append_string_katcl(s->s_up, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#" KCPCON_NAME "-result");
+    append_unsigned_long_katcl(s->s_up,             KATCP_FLAG_ULONG,  c->c_index);
+    append_unsigned_long_katcl(s->s_up,             KATCP_FLAG_ULONG,  c->c_status);
+    append_string_katcl(s->s_up,  KATCP_FLAG_LAST | KATCP_FLAG_STRING, c->c_command);
+  }
+}
+
+void start_children(struct state *s)
+{
+  struct child *c;
+
+  while((s->s_next < s->s_count) && ((s->s_limit == 0) || (s->s_running < s->s_limit))){
+    c = s->s_vector[s->s_next];
+    s->s_next++;
+
+#ifdef DEBUG
+    fprintf(stderr, "about to start <%s>\n", c->c_command);
+#endif
+
+    c->c_state = CHILD_RUNNING;
+    s->s_running++;
+
+    if(string_launch_child(s, c) < 0){
+      sync_message_katcl(s->s_up, KATCP_LEVEL_ERROR, KCPCON_NAME, "unable to start <%s>", c->c_command);
+      c->c_status = 4;
+      complete_child(s, c);
+    }
+  }
+}
+
+void reap_children(struct state *s)
+{
+  struct child *cx;
+  unsigned int i;
+  int status, result;
+  pid_t pid;
+
+  while((pid = waitpid(WAIT_ANY, &status, WNOHANG)) > 0){
+    for(i = 0; i < s->s_count; i++){
+      cx = s->s_vector[i];
+      if(cx->c_pid == pid){
+
+        if (WIFEXITED(status)) {
+          result = WEXITSTATUS(status);
+          log_message_katcl(s->s_up, KATCP_LEVEL_DEBUG, KCPCON_NAME, "subordinate job[%u] %u exited with code %d", i, cx->c_pid, result);
+          cx->c_status = (result > 4) ? 4 : result;
+        } else if (WIFSIGNALED(status)) {
+          result = WTERMSIG(status);
+          log_message_katcl(s->s_up, KATCP_LEVEL_WARN, KCPCON_NAME, "subordinate job[%u] %u killed by signal %d", i, cx->c_pid, result);
+          cx->c_status = 4;
+        } else {
+          log_message_katcl(s->s_up, KATCP_LEVEL_WARN, KCPCON_NAME, "subordinate job[%u] %u return unexpected status %d", i, cx->c_pid, status);
+          cx->c_status = 4;
+        }
+
+        cx->c_pid = (-1);
+
+        complete_child(s, cx);
+      }
+    }
+  }
+}
+
+/*******************************************************************************/
+
 void usage(char *app)
 {
   printf("usage: %s [flags] [command-string]*\n", app);
   printf("-h                 this help\n");
   printf("-v                 increase verbosity\n");
   printf("-q                 run quietly\n");
+  printf("-j count           run at most count commands at once\n");
+  printf("-b                 hold back output of a command until it completes\n");
+  printf("-f file            read further commands from file, one per line (- for stdin)\n");
 #if 0
   printf("-k                 emit katcp log messages\n");
   printf("-r                 toggle printing of reply messages\n");
@@ -326,6 +561,7 @@ void usage(char *app)
 
   printf("notes:\n");
   printf("  command and parameters have to be given as single quoted strings\n");
+  printf("  each completed command is reported as #%s-result index code command\n", KCPCON_NAME);
 }
 
 int main(int argc, char **argv)
@@ -333,36 +569,16 @@ int main(int argc, char **argv)
   struct state *ss;
   struct child *cx;
   fd_set fsr, fsw;
-  char *cmd;
-  int i, j, c, mfd, fd, verbose, result, status;
+  char *cmd, *file;
+  int i, j, c, mfd, fd, result, backlog;
   sigset_t mask_current, mask_previous;
   struct sigaction action_current, action_previous;
-  pid_t pid;
 
   ss = create_state(STDOUT_FILENO);
   if(ss == NULL){
     return 4;
   }
 
-#if 0
-  char *app, *parm, *cmd, *copy, *ptr, *servers;
-  int verbose, result, status, base, info, reply, timeout, pos, flags, show;
-  int xmit, code;
-  unsigned int len;
-  
-  info = 1;
-  reply = 1;
-  i = j = 1;
-  app = argv[0];
-  base = (-1);
-  timeout = 5;
-  pos = (-1);
-  k = NULL;
-  show = 1;
-  parm = NULL;
-#endif
-
-  verbose = 1;
   i = j = 1;
 
   while (i < argc) {
@@ -375,13 +591,40 @@ int main(int argc, char **argv)
           return 0;
 
         case 'v' : 
-          verbose++;
+          ss->s_verbose++;
           j++;
           break;
         case 'q' : 
-          verbose = 0;
+          ss->s_verbose = 0;
           j++;
           break;
+        case 'b' : 
+          ss->s_buffered = 1;
+          j++;
+          break;
+
+        case 'j' :
+        case 'f' :
+          j++;
+          if(argv[i][j] == '\0'){
+            j = 0;
+            i++;
+          }
+          if(i >= argc){
+            sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, KCPCON_NAME, "option -%c requires a parameter", c);
+            return 2;
+          }
+          if(c == 'j'){
+            ss->s_limit = atoi(argv[i] + j);
+          } else {
+            file = argv[i] + j;
+            if(load_children(ss, file) < 0){
+              return 4;
+            }
+          }
+          i++;
+          j = 1;
+          break;
 
         case '-' :
           j++;
@@ -396,11 +639,8 @@ int main(int argc, char **argv)
           return 2;
       }
     } else {
-#ifdef DEBUG
-      fprintf(stderr, "about to start <%s>\n", argv[i]);
-#endif
-      if(string_launch_child(ss, argv[i]) < 0){
-        sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, KCPCON_NAME, "unable to start <%s>", argv[i]);
+      if(queue_child(ss, argv[i]) < 0){
+        sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, KCPCON_NAME, "unable to queue <%s>", argv[i]);
         return 4;
       }
       i++;
@@ -424,6 +664,17 @@ int main(int argc, char **argv)
 
   for(ss->s_finished = 0; ss->s_finished < ss->s_count;){
 
+    /* the position of this logic is rather intricate: reap before any slots are refilled */
+    if(got_child_signal){
+      got_child_signal = 0;
+      reap_children(ss);
+    }
+
+    start_children(ss);
+
+    if(ss->s_finished >= ss->s_count){
+      break;
+    }
 
     mfd = 0;
 
@@ -435,15 +686,20 @@ int main(int argc, char **argv)
       FD_SET(mfd, &fsw);
     }
 
-    for(i = 0; i < ss->s_count; i++){
-      cx = ss->s_vector[i];
-      if(cx->c_line){
-        fd = fileno_katcl(cx->c_line);
-        if(fd > mfd){
-          mfd = fd;
-        }
-        FD_SET(fd, &fsr);
-      } 
+    /* when the output falls behind, let the children block on their sockets */
+    backlog = (queued_katcl(ss->s_up) >= CON_BACKLOG) ? 1 : 0;
+
+    if(backlog == 0){
+      for(i = 0; i < ss->s_count; i++){
+        cx = ss->s_vector[i];
+        if(cx->c_line){
+          fd = fileno_katcl(cx->c_line);
+          if(fd > mfd){
+            mfd = fd;
+          }
+          FD_SET(fd, &fsr);
+        } 
+      }
     }
 
     result = pselect(mfd + 1, &fsr, &fsw, NULL, NULL, &mask_current);
@@ -473,6 +729,10 @@ int main(int argc, char **argv)
       result = write_katcl(ss->s_up);
     }
 
+    if(backlog){
+      continue;
+    }
+
     for(i = 0; i < ss->s_count; i++){
       cx = ss->s_vector[i];
       if(cx->c_line){
@@ -490,11 +750,12 @@ int main(int argc, char **argv)
             }
             destroy_katcl(cx->c_line, 1);
             cx->c_line = NULL;
-            ss->s_finished++;
+            complete_child(ss, cx);
             continue; /* WARNING */
           }
         }
 
+        /* katcl only hands out whole lines, so output of different children never interleaves */
         while(have_katcl(cx->c_line) > 0){ /* compute */
           cmd = arg_string_katcl(cx->c_line, 0);
           if(cmd){
@@ -511,44 +772,19 @@ int main(int argc, char **argv)
                 if(!strcmp(KATCP_BUILD_STATE_INFORM, cmd)){
                 }
 #endif
-                relay_katcl(cx->c_line, ss->s_up);
+                if(ss->s_buffered){
+                  if(hold_child(cx, ready_katcl(cx->c_line)) < 0){
+                    sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, KCPCON_NAME, "unable to hold output of job %u", cx->c_pid);
+                  }
+                } else {
+                  relay_katcl(cx->c_line, ss->s_up);
+                }
                 break;
             }
           }
         }
       }
     }
-
-    /* the position of this logic is rather intricate */
-    if(got_child_signal){
-      got_child_signal = 0;
-      while((pid = waitpid(WAIT_ANY, &status, WNOHANG)) > 0){
-        for(i = 0; i < ss->s_count; i++){
-          cx = ss->s_vector[i];
-          if(cx->c_pid == pid){
-
-            if (WIFEXITED(status)) {
-              result = WEXITSTATUS(status);
-              log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, KCPCON_NAME, "subordinate job[%u] %u exited with code %d", i, cx->c_pid, result);
-              cx->c_status = (result > 4) ? 4 : result;
-            } else if (WIFSIGNALED(status)) {
-              result = WTERMSIG(status);
-              log_message_katcl(ss->s_up, KATCP_LEVEL_WARN, KCPCON_NAME, "subordinate job[%u] %u killed by signal %d", i, cx->c_pid, result);
-              cx->c_status = 4;
-            } else {
-              log_message_katcl(ss->s_up, KATCP_LEVEL_WARN, KCPCON_NAME, "subordinate job[%u] %u return unexpected status %d", i, cx->c_pid, status);
-              cx->c_status = 4;
-            }
-
-            if(cx->c_status > ss->s_code){
-              ss->s_code = cx->c_status;
-            }
-
-            cx->c_pid = (-1);
-          }
-        }
-      }
-    }
   }
 
   /* force drain */
@@ -10,6 +10,7 @@
 #include <sysexits.h>
 
 #include <sys/select.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -27,8 +28,31 @@
 #define UDP_MAX_PACKET 		9728
 
 #define UDP_MAGIC                   0xDEADBEEF
+
+#define DMON_WINDOW                 16    /* requests in flight */
+#define DMON_WINDOW_MAX           4096    /* well inside the 16 bit sequence space */
+#define DMON_TIMEOUT               250    /* ms before a request is sent again */
+#define DMON_TRIES                  10
+#define DMON_STRIDE                  4
+
+#define DMON_REQUEST_IDLE            0
+#define DMON_REQUEST_SENT            1
+#define DMON_REQUEST_DONE            2
+#define DMON_REQUEST_FAILED          3
 /************************************************************/
 
+struct udp_request
+{
+  uint32_t r_address;
+  uint32_t r_value;
+  uint32_t r_result;
+  uint16_t r_sequence;
+  int r_state;
+  int r_error;
+  unsigned int r_tries;
+  struct timeval r_sent;
+};
+
 
 
 struct udp_state
@@ -37,6 +61,24 @@ struct udp_state
 	unsigned int u_fd;
 	unsigned int u_sequence;/* NOTE: 16 bits */
   unsigned int u_rw;/*read:1, write:0*/
+
+  struct sockaddr_in u_peer;
+
+  struct udp_request *u_vector;
+  unsigned int u_count;
+  unsigned int u_next;
+
+  /* indices of the requests in flight, at most u_window of them */
+  unsigned int *u_active;
+  unsigned int u_used;
+  unsigned int u_window;
+
+  unsigned int u_timeout;
+  unsigned int u_tries;
+
+  unsigned int u_done;
+  unsigned int u_failed;
+  unsigned int u_resent;
 };
 
 struct udp_message
@@ -62,6 +104,16 @@ void destroy_udp(struct katcp_dispatch *d, struct udp_state *ud)
 		ud->u_fd = (-1);
 	}
 
+  if(ud->u_vector){
+    free(ud->u_vector);
+    ud->u_vector = NULL;
+  }
+
+  if(ud->u_active){
+    free(ud->u_active);
+    ud->u_active = NULL;
+  }
+
 	free(ud);
 }
 
@@ -79,6 +131,23 @@ struct udp_state *create_udp(struct katcp_dispatch *d)
   ud->u_sequence = 42;
   ud->u_rw = 0;
 
+  memset(&(ud->u_peer), 0, sizeof(struct sockaddr_in));
+
+  ud->u_vector = NULL;
+  ud->u_count = 0;
+  ud->u_next = 0;
+
+  ud->u_active = NULL;
+  ud->u_used = 0;
+  ud->u_window = DMON_WINDOW;
+
+  ud->u_timeout = DMON_TIMEOUT;
+  ud->u_tries = DMON_TRIES;
+
+  ud->u_done = 0;
+  ud->u_failed = 0;
+  ud->u_resent = 0;
+
 	return ud;
 }
 
@@ -118,44 +187,128 @@ int connect_udp(struct katcp_dispatch *d, struct udp_state *ud, int port)
 }
 #endif
 /*****************************************************************************/
-int send_udp(struct katcp_dispatch *d, struct udp_state *ud, char *ip_addr, int port, uint32_t address, uint32_t length)
+
+static int add_request_udp(struct udp_state *ud, uint32_t address, uint32_t value)
+{
+  struct udp_request *tmp, *r;
+
+  tmp = realloc(ud->u_vector, sizeof(struct udp_request) * (ud->u_count + 1));
+  if(tmp == NULL){
+    return -1;
+  }
+  ud->u_vector = tmp;
+
+  r = &(ud->u_vector[ud->u_count]);
+
+  r->r_address = address;
+  r->r_value = value;
+  r->r_result = 0;
+  r->r_sequence = 0;
+  r->r_state = DMON_REQUEST_IDLE;
+  r->r_error = 0;
+  r->r_tries = 0;
+  r->r_sent.tv_sec = 0;
+  r->r_sent.tv_usec = 0;
+
+  ud->u_count++;
+
+  return 0;
+}
+
+static int load_requests_udp(struct udp_state *ud, char *name, unsigned int count, unsigned int stride)
+{
+  FILE *fp;
+  char line[256], *ptr, *end;
+  uint32_t address, value;
+  unsigned int k;
+
+  if(strcmp(name, "-")){
+    fp = fopen(name, "r");
+    if(fp == NULL){
+      return -1;
+    }
+  } else {
+    fp = stdin;
+  }
+
+  /* one "address [value]" per line, in hex, # starts a comment */
+  while(fgets(line, sizeof(line), fp)){
+    ptr = line + strspn(line, " \t");
+    if((*ptr == '#') || (*ptr == '\n') || (*ptr == '\0')){
+      continue;
+    }
+    address = strtoul(ptr, &end, 16);
+    if(end == ptr){
+      continue;
+    }
+    value = strtoul(end, NULL, 16);
+    for(k = 0; k < count; k++){
+      if(add_request_udp(ud, address + (k * stride), value) < 0){
+        if(fp != stdin){
+          fclose(fp);
+        }
+        return -1;
+      }
+    }
+  }
+
+  if(fp != stdin){
+    fclose(fp);
+  }
+
+  return 0;
+}
+
+static void retire_request_udp(struct udp_state *ud, unsigned int slot)
+{
+  /* order of the active set does not matter, fill the gap with the last one */
+  ud->u_used--;
+  ud->u_active[slot] = ud->u_active[ud->u_used];
+}
+
+int send_udp(struct katcp_dispatch *d, struct udp_state *ud, struct udp_request *r)
 {
 	struct udp_message buffer, *uv;
 	int wr;
-	struct sockaddr_in sa;
-
-	/* Prepare UDP socket */
-	memset(&sa, 0, sizeof sa);
-	sa.sin_family = AF_INET;
-	sa.sin_addr.s_addr = inet_addr(ip_addr);
-	sa.sin_port = htons(port);
 
 	uv = &buffer;
 
-  ud->u_sequence = 0xffff & (ud->u_sequence + 1);
-	uv->u_sequence = htons(ud->u_sequence);
+  /* a retransmit keeps its sequence number, so a late reply still matches */
+  if(r->r_state == DMON_REQUEST_IDLE){
+    ud->u_sequence = 0xffff & (ud->u_sequence + 1);
+    r->r_sequence = ud->u_sequence;
+  }
+
+	uv->u_sequence = htons(r->r_sequence);
 
-  
-  uv->u_addr_errcode  = ((address & 0x7FFFFFFF) | (ud->u_rw << 31));
+  uv->u_addr_errcode  = ((r->r_address & 0x7FFFFFFF) | (ud->u_rw << 31));
 	uv->u_addr_errcode  = htonl(uv->u_addr_errcode);
 
-  uv->u_data_length   = (length & 0xFFFFFFFF);
+  uv->u_data_length   = (r->r_value & 0xFFFFFFFF);
   uv->u_data_length	  = htonl(uv->u_data_length);
 
-  wr = sendto(ud->u_fd, uv, sizeof(buffer), 0,(struct sockaddr *)&sa, sizeof(struct sockaddr_in));
+  gettimeofday(&(r->r_sent), NULL);
+  r->r_state = DMON_REQUEST_SENT;
+  r->r_tries++;
+
+  wr = sendto(ud->u_fd, uv, sizeof(buffer), 0, (struct sockaddr *)&(ud->u_peer), sizeof(struct sockaddr_in));
   if(wr < 0){
     switch(errno){
       case EAGAIN :
       case EINTR  :
-        fprintf(stderr, "unable to send request, ERR:\n");
+      case ENOBUFS :
+        /* treat as lost, the retransmit timer will pick it up */
         return 0;
       default :
         log_message_katcp(d, KATCP_LEVEL_ERROR, DMON_MODULE_NAME, "unable to send request: %s", strerror(errno));
-        fprintf(stderr, "unable to send request: \n");
-        break;
+        fprintf(stderr, "unable to send request: %s\n", strerror(errno));
+        return -1;
     }
   }
-    fprintf(stderr, "send udp ok:\n ");
+
+#ifdef DEBUG
+  fprintf(stderr, "sent sequence %u for address 0x%08x (try %u)\n", r->r_sequence, r->r_address, r->r_tries);
+#endif
 
 	return 0;
 }
@@ -163,53 +316,157 @@ int send_udp(struct katcp_dispatch *d, struct udp_state *ud, char *ip_addr, int
 int rcv_udp(struct katcp_dispatch *d, struct udp_state *ud)
 {
 	struct udp_message buffer, *uv;
-  int rr;
+  struct udp_request *r;
+  unsigned int i, errcode;
+  int rr, count;
 
 	uv = &buffer;
-  fprintf(stderr, "receive udp start:\n ");
-
-	rr = recvfrom(ud->u_fd, uv, sizeof(buffer), 0, NULL, NULL);
-	if(rr < 0){
-		switch(errno){
-			case EAGAIN :
-			case EINTR  :
-				return 0;
-			default :
-				log_message_katcp(d, KATCP_LEVEL_ERROR, DMON_MODULE_NAME, "udp receive failed with %s", strerror(errno));
-				close(ud->u_fd);
-				ud->u_fd = (-1);
-				return 0;
-		}
-	}
+  count = 0;
+
+  /* drain everything queued, a window of replies tends to arrive together */
+  for(;;){
+    rr = recvfrom(ud->u_fd, uv, sizeof(buffer), MSG_DONTWAIT, NULL, NULL);
+    if(rr < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          return count;
+        default :
+          log_message_katcp(d, KATCP_LEVEL_ERROR, DMON_MODULE_NAME, "udp receive failed with %s", strerror(errno));
+          fprintf(stderr, "udp receive failed with %s\n", strerror(errno));
+          return -1;
+      }
+    }
 
-  uv->u_sequence    = ntohs(uv->u_sequence);
-  uv->u_addr_errcode  = ntohl(uv->u_addr_errcode);
-  if(ud->u_rw){
+    if(rr < sizeof(buffer)){
+#ifdef DEBUG
+      fprintf(stderr, "ignoring runt reply of %d bytes\n", rr);
+#endif
+      continue;
+    }
+
+    uv->u_sequence    = ntohs(uv->u_sequence);
+    uv->u_addr_errcode  = ntohl(uv->u_addr_errcode);
     uv->u_data_length = ntohl(uv->u_data_length);
+
+    for(i = 0; (i < ud->u_used) && (ud->u_vector[ud->u_active[i]].r_sequence != uv->u_sequence); i++);
+
+    if(i >= ud->u_used){
+      /* duplicate reply to a retransmit, or something stale */
+#ifdef DEBUG
+      fprintf(stderr, "no request outstanding for sequence %u\n", uv->u_sequence);
+#endif
+      continue;
+    }
+
+    r = &(ud->u_vector[ud->u_active[i]]);
+    retire_request_udp(ud, i);
+
+    errcode = ((0xFF000000 & uv->u_addr_errcode) >> 24);
+    if(errcode != 0){
+      log_message_katcp(d, KATCP_LEVEL_WARN, DMON_MODULE_NAME, "udp request for 0x%08x failed with error code %u", r->r_address, errcode);
+      r->r_error = errcode;
+      r->r_state = DMON_REQUEST_FAILED;
+      ud->u_failed++;
+    } else {
+      if(ud->u_rw){
+        r->r_result = uv->u_data_length;
+      }
+      r->r_state = DMON_REQUEST_DONE;
+      ud->u_done++;
+    }
+
+    count++;
+
+#ifdef DEBUG
+    fprintf(stderr, "reply for sequence %u, data 0x%08x\n", uv->u_sequence, uv->u_data_length);
+#endif
   }
+}
 
-  log_message_katcp(d, KATCP_LEVEL_TRACE, DMON_MODULE_NAME, "udp reply with sequence number %d", uv->u_sequence);
-    fprintf(stderr, "udp reply with sequence number %d\n", uv->u_sequence);
+static int fill_udp(struct katcp_dispatch *d, struct udp_state *ud)
+{
+  while((ud->u_used < ud->u_window) && (ud->u_next < ud->u_count)){
+    if(send_udp(d, ud, &(ud->u_vector[ud->u_next])) < 0){
+      return -1;
+    }
+    ud->u_active[ud->u_used] = ud->u_next;
+    ud->u_used++;
+    ud->u_next++;
+  }
 
-  uv->u_addr_errcode  = ((0xFF000000 & uv->u_addr_errcode) >> 24);
+  return 0;
+}
 
-  if(uv->u_addr_errcode != 0){
-    log_message_katcp(d, KATCP_LEVEL_WARN, DMON_MODULE_NAME, "udp receive: something is not right, error code: %d", uv->u_addr_errcode);
-    fprintf(stderr,"udp receive: something is not right, error code: %d", uv->u_addr_errcode);  
-    return -1;
+static int expire_udp(struct katcp_dispatch *d, struct udp_state *ud, struct timeval *delay)
+{
+  struct timeval now, interval, deadline, left;
+  struct udp_request *r;
+  unsigned int i;
+
+  gettimeofday(&now, NULL);
+
+  interval.tv_sec = ud->u_timeout / 1000;
+  interval.tv_usec = (ud->u_timeout % 1000) * 1000;
+
+  *delay = interval;
+
+  i = 0;
+  while(i < ud->u_used){
+    r = &(ud->u_vector[ud->u_active[i]]);
+    add_time_katcp(&deadline, &(r->r_sent), &interval);
+
+    if(cmp_time_katcp(&deadline, &now) > 0){
+      sub_time_katcp(&left, &deadline, &now);
+      if(cmp_time_katcp(&left, delay) < 0){
+        *delay = left;
+      }
+      i++;
+      continue;
+    }
+
+    if(r->r_tries >= ud->u_tries){
+      log_message_katcp(d, KATCP_LEVEL_WARN, DMON_MODULE_NAME, "no reply for 0x%08x after %u tries", r->r_address, r->r_tries);
+      r->r_state = DMON_REQUEST_FAILED;
+      ud->u_failed++;
+      retire_request_udp(ud, i);
+      continue;
+    }
+
+    if(send_udp(d, ud, r) < 0){
+      return -1;
+    }
+    ud->u_resent++;
+
+    /* just sent, so its deadline is a full interval away */
+    i++;
   }
 
-  if(uv->u_sequence != ud->u_sequence){
-    log_message_katcp(d, KATCP_LEVEL_WARN, DMON_MODULE_NAME, "udp received sequence number %d not %d", uv->u_sequence, ud->u_sequence);
-    fprintf(stderr,"udp received sequence number %d not %d", uv->u_sequence, ud->u_sequence);  
+  return 0;
+}
+
+static int option_value(int argc, char **argv, int *ip, int *jp, char **value)
+{
+  int i, j;
+
+  i = *ip;
+  j = *jp + 1;
+
+  if(argv[i][j] == '\0'){
+    j = 0;
+    i++;
+  }
+  if(i >= argc){
+    fprintf(stderr, "%s: option -%c requires a parameter\n", argv[0], argv[*ip][*jp]);
     return -1;
   }
 
-  if(ud->u_rw){
-    log_message_katcp(d, KATCP_LEVEL_TRACE, DMON_MODULE_NAME, "udp data 0x%x", uv->u_data_length);
-    fprintf(stderr,"udp data 0x%08x\n", uv->u_data_length);
-  }
-	return 0;
+  *value = argv[i] + j;
+
+  *ip = i + 1;
+  *jp = 1;
+
+  return 0;
 }
 
 /*****************************************************************************/
@@ -218,20 +475,23 @@ int main(int argc, char **argv)
 {
   struct udp_state *ud;
   struct katcp_dispatch *d;
-  unsigned int result;
-  struct timeval now;
+  struct udp_request *r;
+  struct timeval delay;
   fd_set fsr;
-  char *ip_addr = NULL;
+  char *ip_addr = NULL, *file = NULL, *value;
   uint32_t address, length;
-  int i, j, c, pos;
-  int wait, nooftries;
+  unsigned int k, count, stride, window, timeout, tries;
+  int i, j, c, pos, result;
   int port = 0;
-int rw_flag = 0;
+  int rw_flag = 0;
 
   i = j = 1;
   pos = 0;
-  wait = 0;
-  nooftries = 10;
+  count = 1;
+  stride = DMON_STRIDE;
+  window = DMON_WINDOW;
+  timeout = DMON_TIMEOUT;
+  tries = DMON_TRIES;
 
   while (i < argc) {
     if (argv[i][0] == '-') {
@@ -245,41 +505,38 @@ int rw_flag = 0;
           j++;
           break;
         case 'h' :
-          fprintf(stderr, "usage: %s -R [-i ipaddress] [-p port] address length\n", argv[0]);
+          fprintf(stderr, "usage: %s [-R] -i ipaddress -p port [-w window] [-t timeout-ms] [-r tries] [-n count] [-s stride] [-f file|-] [address value ...]\n", argv[0]);
+          fprintf(stderr, "-R reads, otherwise value is written to address\n");
+          fprintf(stderr, "-n issues count requests per address, stride bytes apart\n");
+          fprintf(stderr, "-f reads \"address [value]\" lines from a file\n");
+          fprintf(stderr, "up to window requests are in flight at once (default %u)\n", DMON_WINDOW);
           return 0;
           break;
         case 'i' : 
-          j++;
-          if(argv[i][j] == '\0'){
-            j = 0;
-            i++;
-          }
-          if(i >= argc){
-            fprintf(stderr, "%s: option -%c requires a parameter\n", argv[0], c);
-          }
-          ip_addr = argv[i] + j;	
-          i++;
-          j = 1;
-          break;
         case 'p' : 
-          j++;
-          if(argv[i][j] == '\0'){
-            j = 0;
-            i++;
+        case 'w' : 
+        case 't' : 
+        case 'r' : 
+        case 'n' : 
+        case 's' : 
+        case 'f' : 
+          if(option_value(argc, argv, &i, &j, &value) < 0){
+            return 2;
           }
-          if(i >= argc){
-            fprintf(stderr, "%s: option -%c requires a parameter\n", argv[0], c);
+          switch(c){
+            case 'i' : ip_addr = value;                       break;
+            case 'p' : port = atoi(value);                     break;
+            case 'w' : window = strtoul(value, NULL, 0);       break;
+            case 't' : timeout = strtoul(value, NULL, 0);      break;
+            case 'r' : tries = strtoul(value, NULL, 0);        break;
+            case 'n' : count = strtoul(value, NULL, 0);        break;
+            case 's' : stride = strtoul(value, NULL, 0);       break;
+            case 'f' : file = value;                           break;
           }
-          port = atoi(argv[i] + j);	
-#if DEBUG
-          fprintf(stderr, "port number is %d\n", port);
-#endif
-          i++;
-          j = 1;
           break;
         case 'R' : 
           rw_flag = 1;	
-          i++;
+          j++;
           break;
         default:
           fprintf(stderr, "%s: unknown option -%c\n", argv[0], argv[i][j]);
@@ -290,6 +547,22 @@ int rw_flag = 0;
       i = argc;
     }
   }
+
+  if((ip_addr == NULL) || (port <= 0)){
+    fprintf(stderr, "%s: need an ip address and port, see -h\n", argv[0]);
+    return 2;
+  }
+
+  if((window < 1) || (window > DMON_WINDOW_MAX) || (tries < 1) || (timeout < 1) || (count < 1)){
+    fprintf(stderr, "%s: window needs to be within 1 to %u, tries, timeout and count above 0\n", argv[0], DMON_WINDOW_MAX);
+    return 2;
+  }
+
+  if((file == NULL) && ((pos <= 0) || ((argc - pos) % 2))){
+    fprintf(stderr, "%s: need address value pairs or a file, see -h\n", argv[0]);
+    return 2;
+  }
+
   d = setup_katcp(STDOUT_FILENO);
   if(d == NULL){
     fprintf(stderr, "setup katcp failed\n");
@@ -303,59 +576,133 @@ int rw_flag = 0;
     write_katcp(d);
     return EX_OSERR;
   }
-#if 0
-  if(connect_udp(d, ud, port) < 0){
-    fprintf(stderr, "connect udp failed\n");
-    log_message_katcp(d, KATCP_LEVEL_ERROR, DMON_MODULE_NAME, "unable to bind udp");
-    return EX_OSERR;
+
+  ud->u_rw = rw_flag;
+  ud->u_window = window;
+  ud->u_timeout = timeout;
+  ud->u_tries = tries;
+
+  ud->u_peer.sin_family = AF_INET;
+  ud->u_peer.sin_addr.s_addr = inet_addr(ip_addr);
+  ud->u_peer.sin_port = htons(port);
+
+  if(file){
+    if(load_requests_udp(ud, file, count, stride) < 0){
+      fprintf(stderr, "unable to load requests from %s: %s\n", file, strerror(errno));
+      destroy_udp(d, ud);
+      shutdown_katcp(d);
+      return EX_OSERR;
+    }
   }
+
+  if(pos > 0){
+    for(; (pos + 1) < argc; pos += 2){
+      address = strtoul(argv[pos], NULL, 16); 
+      length  = strtoul(argv[pos + 1], NULL, 16);
+#if DEBUG
+      fprintf(stderr, "address[%x] and value[%x]\n", address, length);
 #endif
+      for(k = 0; k < count; k++){
+        if(add_request_udp(ud, address + (k * stride), length) < 0){
+          fprintf(stderr, "unable to allocate request\n");
+          destroy_udp(d, ud);
+          shutdown_katcp(d);
+          return EX_OSERR;
+        }
+      }
+    }
+  }
+
+  ud->u_active = malloc(sizeof(unsigned int) * ud->u_window);
+  if(ud->u_active == NULL){
+    fprintf(stderr, "unable to allocate window\n");
+    destroy_udp(d, ud);
+    shutdown_katcp(d);
+    return EX_OSERR;
+  }
+
   ud->u_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  if(ud->u_fd < 0){
-    fprintf(stderr, "unable to create udp socket:\n ");
+  if((int)(ud->u_fd) < 0){
+    fprintf(stderr, "unable to create udp socket: %s\n", strerror(errno));
     log_message_katcp(d, KATCP_LEVEL_ERROR, DMON_MODULE_NAME, "unable to create udp socket: %s", strerror(errno));
-    return -1;
+    destroy_udp(d, ud);
+    shutdown_katcp(d);
+    return EX_OSERR;
   }
-  ud->u_rw = rw_flag;
+
+  result = 0;
 
   for(;;){
+    if(fill_udp(d, ud) < 0){
+      result = -1;
+      break;
+    }
 
-    FD_ZERO(&fsr);
+    if(ud->u_used == 0){
+      break;
+    }
 
-    FD_SET(ud->u_fd, &fsr);
-    address = strtol(argv[pos], NULL, 16); 
-    length  = strtol(argv[pos + 1], NULL, 16);
+    if(expire_udp(d, ud, &delay) < 0){
+      result = -1;
+      break;
+    }
 
-#if DEBUG
-    printf("pos:%d, address[%x] and length[%x]\n", pos, address, length);
-#endif
+    /* expiry may have retired the last requests in flight */
+    if(ud->u_used == 0){
+      continue;
+    }
 
-    send_udp(d, ud, ip_addr, port, address, length);
+    FD_ZERO(&fsr);
+    FD_SET(ud->u_fd, &fsr);
 
-    now.tv_sec =  10;
-    now.tv_usec = 0;
-    result = select(ud->u_fd + 1, &fsr, NULL, NULL, &now);
-    if(result == 0){
-      /* Resend again after timeout */
-      printf("Resending udp again\n");
-      send_udp(d, ud, ip_addr, port, address, length);
+    if(select(ud->u_fd + 1, &fsr, NULL, NULL, &delay) < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      fprintf(stderr, "select failed: %s\n", strerror(errno));
+      result = -1;
+      break;
     }
 
-    for(wait = 0; wait < nooftries; wait++){
+    if(FD_ISSET(ud->u_fd, &fsr)){
+      if(rcv_udp(d, ud) < 0){
+        result = -1;
+        break;
+      }
+    }
+  }
 
-      if(FD_ISSET(ud->u_fd, &fsr)){
-        result = rcv_udp(d, ud);
-        if(!result){
-          return EX_OK;
+  for(k = 0; k < ud->u_count; k++){
+    r = &(ud->u_vector[k]);
+    switch(r->r_state){
+      case DMON_REQUEST_DONE :
+        if(ud->u_rw){
+          printf("%08x %08x\n", r->r_address, r->r_result);
         }
-      }
+        break;
+      case DMON_REQUEST_FAILED :
+        if(r->r_error){
+          fprintf(stderr, "request for 0x%08x failed with error code %d\n", r->r_address, r->r_error);
+        } else {
+          fprintf(stderr, "request for 0x%08x failed after %u tries\n", r->r_address, r->r_tries);
+        }
+        break;
     }
-    return EX_OSERR;
+  }
 
+#ifdef DEBUG
+  fprintf(stderr, "%u requests, %u done, %u failed, %u resent\n", ud->u_count, ud->u_done, ud->u_failed, ud->u_resent);
+#endif
+
+  if(ud->u_failed > 0){
+    result = -1;
   }
 
+  /* shutdown_katcp closes stdout, results have to be out before then */
+  fflush(stdout);
+
   destroy_udp(d, ud);
   shutdown_katcp(d);
 
-  return EX_OK;
+  return (result < 0) ? EX_OSERR : EX_OK;
 }
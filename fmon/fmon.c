@@ -24,6 +24,7 @@
 #include <katcp.h>
 #include <katcl.h>
 #include <katpriv.h>
+#include <netc.h>
 
 /* largest board id */
 
@@ -36,6 +37,11 @@
 
 #define FMON_XENG_THRESHOLD    15 /* number of times we see an error */
 
+/* registers read in one round trip at the start of each cycle */
+
+#define FMON_PREFETCH_MAX     (1 + (3 * FMON_MAX_INPUTS) + (5 * FMON_MAX_CROSSES))
+#define FMON_PREFETCH_NAME     32
+
 /* sensors of which a board only has one, if at all */
 
 #define FMON_SENSOR_LRU     0
@@ -97,6 +103,9 @@
 
 #define FMON_INIT_PERIOD    100000
 
+#define FMON_BACKOFF_MIN      1000
+#define FMON_BACKOFF_MAX     16000
+
 /* misc */
 
 #define FMON_GOOD_DSP_CLOCK 200000000
@@ -186,6 +195,9 @@ struct fmon_sensor{
   double s_fvalue;
   int s_status;
   int s_new;
+  int s_dirty;           /* changed since last emitted */
+  struct timeval s_stamp; /* when the current value was observed */
+  struct timeval s_sent;  /* when last emitted */
   int s_min;
   int s_max;
   double s_fmin;
@@ -201,6 +213,13 @@ struct fmon_input{
   int n_rf_enabled;
 };
 
+struct fmon_prefetch
+{
+  char p_name[FMON_PREFETCH_NAME];
+  uint32_t p_value;
+  int p_status; /* 0 valid, 1 refused by server, -1 not collected */
+};
+
 struct fmon_state
 {
   int f_verbose;
@@ -247,6 +266,18 @@ struct fmon_state
   unsigned long f_xp_errors[FMON_MAX_CROSSES];
 
   int f_x_threshold;
+
+  struct timeval f_next;  /* when this board is due to be polled again */
+  struct timeval f_retry; /* no reconnect attempts before this */
+  unsigned int f_backoff;
+
+  unsigned int f_heartbeat; /* ms after which unchanged sensors are republished, 0 never */
+  char *f_build;
+
+  int f_readv; /* server supports ?readv: -1 unknown, 0 no, 1 yes */
+  unsigned int f_prefetch_count;
+  unsigned int f_prefetch_pending;
+  struct fmon_prefetch f_prefetch[FMON_PREFETCH_MAX];
 };
 
 /*************************************************************************/
@@ -256,6 +287,9 @@ int update_sensor_status_fmon(struct fmon_state *f, struct fmon_sensor *s, unsig
 
 void set_lru_fmon(struct fmon_state *f, int value, unsigned int status);
 
+void mark_sensor_fmon(struct fmon_sensor *s);
+void emit_sensors_fmon(struct fmon_state *f);
+
 #if 0
 int list_all_sensors_fmon(struct fmon_state *f);
 int list_board_sensors_fmon(struct fmon_state *f);
@@ -353,9 +387,11 @@ void destroy_fmon(struct fmon_state *f)
     s->s_new = 1;
   }
 
-  if(f->f_report){
-    destroy_katcl(f->f_report, 0);
-    f->f_report = NULL;
+  f->f_report = NULL;
+
+  if(f->f_build){
+    free(f->f_build);
+    f->f_build = NULL;
   }
 
   if(f->f_server){
@@ -414,16 +450,43 @@ int populate_sensor_fmon(struct fmon_sensor *s, struct fmon_sensor_template *t,
 
   s->s_logging = t->t_logging;
 
+  s->s_dirty = 0;
+  s->s_stamp.tv_sec = 0;
+  s->s_stamp.tv_usec = 0;
+  s->s_sent.tv_sec = 0;
+  s->s_sent.tv_usec = 0;
+
   return 0;
 }
 
-struct fmon_state *create_fmon(char *server, int verbose, unsigned int timeout, int reprobe, int fixed)
+/* when one process watches several boards, their board level sensors need to be told apart */
+
+int qualify_sensor_fmon(struct fmon_sensor *s, char *prefix)
+{
+  char *tmp;
+  int len;
+
+  len = strlen(prefix) + strlen(s->s_name) + 2;
+
+  tmp = malloc(len);
+  if(tmp == NULL){
+    return -1;
+  }
+
+  snprintf(tmp, len, "%s.%s", prefix, s->s_name);
+
+  free(s->s_name);
+  s->s_name = tmp;
+
+  return 0;
+}
+
+struct fmon_state *create_fmon(char *server, struct katcl_line *report, char *prefix, int verbose, unsigned int timeout, unsigned int heartbeat, int reprobe, int fixed)
 {
   struct fmon_state *f;
   struct fmon_sensor *s;
   struct fmon_input *n;
   int i, j;
-  int flags;
 
   f = malloc(sizeof(struct fmon_state));
   if(f == NULL){
@@ -467,6 +530,19 @@ struct fmon_state *create_fmon(char *server, int verbose, unsigned int timeout,
   f->f_fs = 0;
   f->f_xs = 0;
 
+  f->f_readv = (-1);
+  f->f_prefetch_count = 0;
+  f->f_prefetch_pending = 0;
+
+  f->f_heartbeat = heartbeat;
+  f->f_build = NULL;
+
+  f->f_next.tv_sec = 0;
+  f->f_next.tv_usec = 0;
+  f->f_retry.tv_sec = 0;
+  f->f_retry.tv_usec = 0;
+  f->f_backoff = 0;
+
   for(i = 0; i < FMON_BOARD_SENSORS; i++){
     s = &(f->f_sensors[i]);
     s->s_type = (-1);
@@ -508,18 +584,15 @@ struct fmon_state *create_fmon(char *server, int verbose, unsigned int timeout,
       destroy_fmon(f);
       return NULL;
     }
-  }
 
-  flags = fcntl(STDOUT_FILENO, F_GETFL, NULL);
-  if(flags >= 0){
-    flags = fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK);
+    if(prefix && (qualify_sensor_fmon(s, prefix) < 0)){
+      destroy_fmon(f);
+      return NULL;
+    }
   }
 
-  f->f_report = create_katcl(STDOUT_FILENO);
-  if(f->f_report == NULL){
-    destroy_fmon(f);
-    return NULL;
-  }
+  /* shared by all boards, owned by the caller */
+  f->f_report = report;
 
   return f;
 }
@@ -568,7 +641,7 @@ struct fmon_sensor *find_sensor_fmon(struct fmon_state *f, char *name)
     }
   }
 
-  for(i = 0; FMON_MAX_INPUTS; i++){
+  for(i = 0; i < FMON_MAX_INPUTS; i++){
     n = &(f->f_inputs[i]);
     for(j = 0; j < FMON_INPUT_SENSORS; j++){
       s = &(n->n_sensors[j]);
@@ -592,35 +665,45 @@ int check_parent(struct fmon_state *f)
   return 0;
 }
 
-int catchup_fmon(struct fmon_state *f, unsigned int interval)
+int catchup_fmon(struct fmon_state **set, unsigned int count, struct katcl_line *report)
 {
   struct timeval delta, target;
+  struct fmon_sensor *s;
   fd_set fsr, fsw;
   int fd, result;
+  unsigned int i;
   char *request, *label, *strategy;
 
-  delta.tv_sec = interval / 1000;
-  delta.tv_usec = (interval % 1000) * 1000;
+  if(count == 0){
+    return -1;
+  }
+
+  /* sleep until the next board is due */
+  target = set[0]->f_next;
+  for(i = 1; i < count; i++){
+    if(cmp_time_katcp(&(set[i]->f_next), &target) < 0){
+      target = set[i]->f_next;
+    }
+  }
 
-  add_time_katcp(&target, &(f->f_start), &delta);
-  fd = fileno_katcl(f->f_report);
+  fd = fileno_katcl(report);
   if(fd < 0){
     return -1;
   }
   
-  gettimeofday(&(f->f_done), NULL);
+  gettimeofday(&(set[0]->f_done), NULL);
 
-  while(cmp_time_katcp(&(f->f_done), &target) <= 0){
+  while(cmp_time_katcp(&(set[0]->f_done), &target) <= 0){
 
     FD_ZERO(&fsr);
     FD_ZERO(&fsw);
 
     FD_SET(fd, &fsr);
-    if(flushing_katcl(f->f_report)){
+    if(flushing_katcl(report)){
       FD_SET(fd, &fsw);
     }
 
-    sub_time_katcp(&delta, &target, &(f->f_done));
+    sub_time_katcp(&delta, &target, &(set[0]->f_done));
 
     result = select(fd + 1, &fsr, &fsw, NULL, &delta);
 
@@ -636,27 +719,30 @@ int catchup_fmon(struct fmon_state *f, unsigned int interval)
 
     if(result > 0){
       if(FD_ISSET(fd, &fsr)){
-        result = read_katcl(f->f_report);
+        result = read_katcl(report);
         if(result){
           return -1;
         }
 
-        while(have_katcl(f->f_report) > 0){
-          if(arg_request_katcl(f->f_report)){
-            request = arg_string_katcl(f->f_report, 0);
+        while(have_katcl(report) > 0){
+          if(arg_request_katcl(report)){
+            request = arg_string_katcl(report, 0);
             if(request){
-              log_message_katcl(f->f_report, KATCP_LEVEL_INFO, f->f_server, "got %s request", request);
+              log_message_katcl(report, KATCP_LEVEL_INFO, set[0]->f_server, "got %s request", request);
               if(!strcmp(request, "?sensor-sampling")){
                 result = 0;
-                label = arg_string_katcl(f->f_report, 1);
-                strategy = arg_string_katcl(f->f_report, 2);
+                label = arg_string_katcl(report, 1);
+                strategy = arg_string_katcl(report, 2);
                 if(label && strategy){
-                  if(!strcmp(strategy, "event") && (find_sensor_fmon(f, label) != NULL)){
+                  for(i = 0, s = NULL; (i < count) && (s == NULL); i++){
+                    s = find_sensor_fmon(set[i], label);
+                  }
+                  if(!strcmp(strategy, "event") && (s != NULL)){
                     result = 1;
                   }
                 }
-                append_string_katcl(f->f_report, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!sensor-sampling");
-                append_string_katcl(f->f_report, KATCP_FLAG_LAST  | KATCP_FLAG_STRING, result ? KATCP_OK : KATCP_FAIL);
+                append_string_katcl(report, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!sensor-sampling");
+                append_string_katcl(report, KATCP_FLAG_LAST  | KATCP_FLAG_STRING, result ? KATCP_OK : KATCP_FAIL);
               }
             }
           }
@@ -665,13 +751,13 @@ int catchup_fmon(struct fmon_state *f, unsigned int interval)
       }
 
       if(FD_ISSET(fd, &fsw)){
-        if(write_katcl(f->f_report) < 0){
+        if(write_katcl(report) < 0){
           return -1;
         }
       }
     }
 
-    gettimeofday(&(f->f_done), NULL);
+    gettimeofday(&(set[0]->f_done), NULL);
   }
 
   return 0;
@@ -706,6 +792,8 @@ void drop_connection_fmon(struct fmon_state *f)
     }
   }
 
+  emit_sensors_fmon(f);
+
 #if 0
   while(flushing_katcl(f->f_report)){
     if(write_katcl(f->f_report) != 0){
@@ -723,6 +811,10 @@ void drop_connection_fmon(struct fmon_state *f)
   f->f_xs = 0;
   f->f_board = (-1);
 
+  f->f_readv = (-1);
+  f->f_prefetch_count = 0;
+  f->f_prefetch_pending = 0;
+
   if(f->f_symbolic){
     free(f->f_symbolic);
     f->f_symbolic = NULL;
@@ -793,9 +885,34 @@ int resume_connection_fmon(struct fmon_state *f)
 }
 #endif
 
-int maintain_fmon(struct fmon_state *f)
+void backoff_fmon(struct fmon_state *f)
 {
   struct timeval now, delta;
+
+  if(f->f_backoff < FMON_BACKOFF_MIN){
+    f->f_backoff = FMON_BACKOFF_MIN;
+  } else if(f->f_backoff < FMON_BACKOFF_MAX){
+    f->f_backoff *= 2;
+    if(f->f_backoff > FMON_BACKOFF_MAX){
+      f->f_backoff = FMON_BACKOFF_MAX;
+    }
+  }
+
+  gettimeofday(&now, NULL);
+
+  delta.tv_sec = f->f_backoff / 1000;
+  delta.tv_usec = (f->f_backoff % 1000) * 1000;
+
+  add_time_katcp(&(f->f_retry), &now, &delta);
+
+#ifdef DEBUG
+  fprintf(stderr, "maintain: next attempt to reach %s in %ums\n", f->f_server, f->f_backoff);
+#endif
+}
+
+int maintain_fmon(struct fmon_state *f)
+{
+  struct timeval now;
   int state;
 
 #define STATE_CONNECT   0
@@ -811,9 +928,12 @@ int maintain_fmon(struct fmon_state *f)
     return f->f_line ? 0 : (-1);
   }
 
-  f->f_maintaining = 1;
-
   if(f->f_line == NULL){
+    /* a board which is down should not hold up the others, only retry once the backoff has expired */
+    gettimeofday(&now, NULL);
+    if(cmp_time_katcp(&(f->f_retry), &now) > 0){
+      return -1;
+    }
     state = STATE_CONNECT;
   } else {
     state = STATE_DONE;
@@ -829,51 +949,36 @@ int maintain_fmon(struct fmon_state *f)
     }
   }
 
-  for(;;){
-    switch(state){
-      case STATE_CONNECT : 
-        f->f_line = create_name_rpc_katcl(f->f_server);
-        if(f->f_line == NULL){
-          log_message_katcl(f->f_report, KATCP_LEVEL_TRACE, f->f_server, "connect to %s failed: %s", f->f_server, strerror(errno));
-          /* state = STATE_CONNECT */
-          break;
-        } /* fall */
-        state = STATE_PROBE;
-      case STATE_PROBE : 
-        if(probe_fmon(f) < 0){
-          destroy_rpc_katcl(f->f_line);
-          f->f_line = NULL;
-          state = STATE_CONNECT; /* try again */
-          break;
-        } /* fall */
-        state = STATE_DONE; /* superfluous, but symmetrical */
-        f->f_grace = 0; /* start counter on done transition */
-      case STATE_DONE :
-        set_lru_fmon(f, 1, KATCP_STATUS_NOMINAL);
-        f->f_maintaining = 0;
-        return 0;
-    }
-
-    gettimeofday(&now, NULL);
-
-    if(cmp_time_katcp(&(f->f_when), &now) <= 0){
+  f->f_maintaining = 1;
 
-      set_lru_fmon(f, 0, KATCP_STATUS_ERROR);
-      f->f_grace = 0; /* unclear if needed ... */
+  switch(state){
+    case STATE_CONNECT : 
+      f->f_line = create_extended_rpc_katcl(f->f_server, NETC_ASYNC);
+      if(f->f_line == NULL){
+        log_message_katcl(f->f_report, KATCP_LEVEL_TRACE, f->f_server, "connect to %s failed: %s", f->f_server, strerror(errno));
+        break;
+      } /* fall */
+    case STATE_PROBE : 
+      if(probe_fmon(f) < 0){
+        destroy_rpc_katcl(f->f_line);
+        f->f_line = NULL;
+        break;
+      } /* fall */
+      f->f_grace = 0; /* start counter on done transition */
+      f->f_backoff = 0;
+    case STATE_DONE :
+      set_lru_fmon(f, 1, KATCP_STATUS_NOMINAL);
       f->f_maintaining = 0;
-      return -1;
-    }
+      return 0;
+  }
 
-    sub_time_katcp(&delta, &(f->f_when), &now);
-    if(delta.tv_sec > 0){
-      delta.tv_sec = 1;
-      delta.tv_usec = 0;
-    }
+  backoff_fmon(f);
 
-    select(0, NULL, NULL, NULL, &delta);
-  }
+  set_lru_fmon(f, 0, KATCP_STATUS_ERROR);
+  f->f_grace = 0; /* unclear if needed ... */
+  f->f_maintaining = 0;
 
-  /* return 0; */
+  return -1;
 }
 
 /* basic io routines ***************************************************************/
@@ -908,6 +1013,16 @@ int relay_build_state_fmon(struct fmon_state *f)
     return -1;
   }
 
+  /* the parent already knows, don't repeat it */
+  if(f->f_build && !strcmp(f->f_build, parm)){
+    return 0;
+  }
+
+  if(f->f_build){
+    free(f->f_build);
+  }
+  f->f_build = strdup(parm);
+
   append_string_katcl(f->f_report, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, KATCP_VERSION_CONNECT_INFORM);
   append_buffer_katcl(f->f_report,                    KATCP_FLAG_STRING, parm, delta);
   append_string_katcl(f->f_report,  KATCP_FLAG_LAST | KATCP_FLAG_STRING, version);
@@ -954,12 +1069,34 @@ int collect_io_fmon(struct fmon_state *f)
   return 0;
 }
 
+struct fmon_prefetch *find_prefetch_fmon(struct fmon_state *f, char *name)
+{
+  unsigned int i;
+
+  for(i = 0; i < f->f_prefetch_count; i++){
+    if(!strcmp(f->f_prefetch[i].p_name, name)){
+      return &(f->f_prefetch[i]);
+    }
+  }
+
+  return NULL;
+}
+
 int read_word_fmon(struct fmon_state *f, char *name, uint32_t *value)
 {
   int result[4], r, status, i;
   int expect[4] = { 6, 0, 2, 2 };
   uint32_t tmp;
   char *code;
+  struct fmon_prefetch *p;
+
+  p = find_prefetch_fmon(f, name);
+  if(p && (p->p_status >= 0)){
+    if(p->p_status == 0){
+      *value = p->p_value;
+    }
+    return p->p_status;
+  }
 
   if(maintain_fmon(f) < 0){
     return -1;
@@ -1015,6 +1152,13 @@ int write_word_fmon(struct fmon_state *f, char *name, uint32_t value)
   int result[4], r, i;
   int expect[4] = { 7, 0, 2, 5 };
   uint32_t tmp;
+  struct fmon_prefetch *p;
+
+  /* a later read has to see what we wrote */
+  p = find_prefetch_fmon(f, name);
+  if(p){
+    p->p_status = (-1);
+  }
 
   if(maintain_fmon(f) < 0){
     return -1;
@@ -1050,6 +1194,352 @@ int write_word_fmon(struct fmon_state *f, char *name, uint32_t value)
   return 0;
 }
 
+/* prefetch: fetch the registers of a cycle in one round trip ***************/
+
+static void add_prefetch_fmon(struct fmon_state *f, char *format, int number)
+{
+  struct fmon_prefetch *p;
+
+  if(f->f_prefetch_count >= FMON_PREFETCH_MAX){
+    return;
+  }
+
+  p = &(f->f_prefetch[f->f_prefetch_count]);
+
+  snprintf(p->p_name, FMON_PREFETCH_NAME - 1, format, number);
+  p->p_name[FMON_PREFETCH_NAME - 1] = '\0';
+  p->p_value = 0;
+  p->p_status = (-1);
+
+  f->f_prefetch_count++;
+}
+
+static void abort_prefetch_fmon(struct fmon_state *f)
+{
+  f->f_prefetch_count = 0;
+  f->f_prefetch_pending = 0;
+
+  drop_connection_fmon(f);
+}
+
+static int detect_readv_fmon(struct fmon_state *f)
+{
+  int r;
+
+  if(append_string_katcl(f->f_line, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?help") < 0){
+    return -1;
+  }
+  if(append_string_katcl(f->f_line, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "readv") < 0){
+    return -1;
+  }
+
+  r = collect_io_fmon(f);
+  if(r < 0){
+    return -1;
+  }
+
+  f->f_readv = (r == 0) ? 1 : 0;
+
+#ifdef DEBUG
+  fprintf(stderr, "prefetch: server %s batch reads\n", f->f_readv ? "supports" : "lacks");
+#endif
+
+  return 0;
+}
+
+static int issue_prefetch_fmon(struct fmon_state *f)
+{
+  unsigned int i;
+  int flags;
+
+  f->f_prefetch_count = 0;
+  f->f_prefetch_pending = 0;
+
+  if(f->f_line == NULL){
+    return -1;
+  }
+
+  if(f->f_fs > 0){
+    add_prefetch_fmon(f, "clk_frequency", 0);
+  }
+
+  for(i = 0; i < f->f_fs; i++){
+    add_prefetch_fmon(f, "fstatus%d", i);
+    add_prefetch_fmon(f, "adc_sum_sq%d", i);
+    add_prefetch_fmon(f, "adc_ctrl%d", i);
+  }
+
+  for(i = 0; i < f->f_xs; i++){
+    add_prefetch_fmon(f, "vacc_err_cnt%d", i);
+    add_prefetch_fmon(f, "pkt_reord_err%d", i);
+  }
+
+  for(i = 0; i < f->f_xp_count; i++){
+    add_prefetch_fmon(f, "gbe_tx_err_cnt%d", i);
+    add_prefetch_fmon(f, "gbe_rx_err_cnt%d", i);
+    add_prefetch_fmon(f, "rx_err_cnt%d", i);
+  }
+
+  if(f->f_prefetch_count == 0){
+    return 0;
+  }
+
+  if(f->f_readv < 0){
+    if(detect_readv_fmon(f) < 0){
+      abort_prefetch_fmon(f);
+      return -1;
+    }
+  }
+
+  if(f->f_readv > 0){
+    if(append_string_katcl(f->f_line, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?readv") < 0){
+      abort_prefetch_fmon(f);
+      return -1;
+    }
+
+    for(i = 0; i < f->f_prefetch_count; i++){
+      flags = KATCP_FLAG_STRING | (((i + 1) == f->f_prefetch_count) ? KATCP_FLAG_LAST : 0);
+      if(append_string_katcl(f->f_line, flags, f->f_prefetch[i].p_name) < 0){
+        abort_prefetch_fmon(f);
+        return -1;
+      }
+    }
+
+    f->f_prefetch_pending = 1;
+
+    return 0;
+  }
+
+  /* queue all requests, replies come back in the same order */
+  for(i = 0; i < f->f_prefetch_count; i++){
+    if((append_string_katcl(f->f_line,                           KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?read") < 0) ||
+       (append_string_katcl(f->f_line,                           KATCP_FLAG_STRING, f->f_prefetch[i].p_name) < 0) ||
+       (append_unsigned_long_katcl(f->f_line,                    KATCP_FLAG_ULONG,  0) < 0) ||
+       (append_unsigned_long_katcl(f->f_line,  KATCP_FLAG_LAST | KATCP_FLAG_ULONG,  4) < 0)){
+      abort_prefetch_fmon(f);
+      return -1;
+    }
+  }
+
+  f->f_prefetch_pending = f->f_prefetch_count;
+
+  return 0;
+}
+
+static int absorb_batch_fmon(struct fmon_state *f)
+{
+  unsigned int i;
+  uint32_t tmp;
+  char *ptr;
+
+  ptr = arg_string_katcl(f->f_line, 0);
+  if((ptr == NULL) || strcmp(ptr, "!readv")){
+    return -1;
+  }
+
+  f->f_prefetch_pending = 0;
+
+  ptr = arg_string_katcl(f->f_line, 1);
+  if((ptr == NULL) || strcmp(ptr, KATCP_OK)){
+    /* a batch fails as a whole, eg if one register is missing. Fall back to individual reads for this connection */
+    f->f_readv = 0;
+    return 0;
+  }
+
+  if(arg_count_katcl(f->f_line) < (f->f_prefetch_count + 2)){
+    return -1;
+  }
+
+  for(i = 0; i < f->f_prefetch_count; i++){
+    /* registers narrower than a word come back short, a plain read would have been refused */
+    if(arg_buffer_katcl(f->f_line, i + 2, &tmp, 4) != 4){
+      f->f_prefetch[i].p_status = 1;
+      continue;
+    }
+    f->f_prefetch[i].p_value = ntohl(tmp);
+    f->f_prefetch[i].p_status = 0;
+  }
+
+  return 0;
+}
+
+static int absorb_read_fmon(struct fmon_state *f)
+{
+  struct fmon_prefetch *p;
+  uint32_t tmp;
+  char *ptr;
+
+  ptr = arg_string_katcl(f->f_line, 0);
+  if((ptr == NULL) || strcmp(ptr, "!read")){
+#ifdef DEBUG
+    fprintf(stderr, "prefetch: expected read reply, got %s\n", ptr ? ptr : "nothing");
+#endif
+    return -1;
+  }
+
+  p = &(f->f_prefetch[f->f_prefetch_count - f->f_prefetch_pending]);
+  f->f_prefetch_pending--;
+
+  ptr = arg_string_katcl(f->f_line, 1);
+  if((ptr == NULL) || strcmp(ptr, KATCP_OK)){
+    p->p_status = 1;
+    return 0;
+  }
+
+  if(arg_buffer_katcl(f->f_line, 2, &tmp, 4) != 4){
+    return -1;
+  }
+
+  p->p_value = ntohl(tmp);
+  p->p_status = 0;
+
+  return 0;
+}
+
+/* consume whatever replies have been parsed, returns 1 while more are outstanding */
+
+static int absorb_prefetch_fmon(struct fmon_state *f)
+{
+  int r;
+  char *ptr;
+
+  while(f->f_prefetch_pending > 0){
+    r = have_katcl(f->f_line);
+    if(r < 0){
+      return -1;
+    }
+    if(r == 0){
+      return 1;
+    }
+
+    if(!arg_reply_katcl(f->f_line)){
+      ptr = arg_string_katcl(f->f_line, 0);
+      if(ptr && !strcmp("#build-state", ptr)){
+        relay_build_state_fmon(f);
+      }
+      continue;
+    }
+
+    r = (f->f_readv > 0) ? absorb_batch_fmon(f) : absorb_read_fmon(f);
+    if(r < 0){
+      return -1;
+    }
+  }
+
+  gettimeofday(&(f->f_io), NULL);
+  f->f_something++;
+
+  return 0;
+}
+
+/* send the requests for all boards in the set, then collect the replies as
+ * they arrive, so that a sweep of the array takes about one round trip */
+
+int prefetch_set_fmon(struct fmon_state **set, unsigned int count)
+{
+  struct fmon_state *f;
+  struct timeval now, delta, *soonest;
+  fd_set fsr, fsw;
+  unsigned int i, busy;
+  int fd, max, result;
+
+  for(i = 0; i < count; i++){
+    issue_prefetch_fmon(set[i]);
+  }
+
+  for(;;){
+    FD_ZERO(&fsr);
+    FD_ZERO(&fsw);
+
+    max = (-1);
+    busy = 0;
+    soonest = NULL;
+
+    gettimeofday(&now, NULL);
+
+    for(i = 0; i < count; i++){
+      f = set[i];
+      if((f->f_line == NULL) || (f->f_prefetch_pending == 0)){
+        continue;
+      }
+
+      result = absorb_prefetch_fmon(f);
+      if(result <= 0){
+        if(result < 0){
+          abort_prefetch_fmon(f);
+        }
+        continue;
+      }
+
+      if(cmp_time_katcp(&(f->f_when), &now) <= 0){
+#ifdef DEBUG
+        fprintf(stderr, "prefetch: %s did not answer in time\n", f->f_server);
+#endif
+        abort_prefetch_fmon(f);
+        continue;
+      }
+
+      fd = fileno_katcl(f->f_line);
+      FD_SET(fd, &fsr);
+      if(flushing_katcl(f->f_line)){
+        FD_SET(fd, &fsw);
+      }
+      if(fd > max){
+        max = fd;
+      }
+
+      if((soonest == NULL) || (cmp_time_katcp(&(f->f_when), soonest) < 0)){
+        soonest = &(f->f_when);
+      }
+
+      busy++;
+    }
+
+    if(busy == 0){
+      return 0;
+    }
+
+    sub_time_katcp(&delta, soonest, &now);
+
+    result = select(max + 1, &fsr, &fsw, NULL, &delta);
+    if(result < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          continue;
+        default :
+          return -1;
+      }
+    }
+
+    if(result == 0){
+      continue; /* expiry gets noticed above */
+    }
+
+    for(i = 0; i < count; i++){
+      f = set[i];
+      if((f->f_line == NULL) || (f->f_prefetch_pending == 0)){
+        continue;
+      }
+
+      fd = fileno_katcl(f->f_line);
+
+      if(FD_ISSET(fd, &fsw)){
+        if(write_katcl(f->f_line) < 0){
+          abort_prefetch_fmon(f);
+          continue;
+        }
+      }
+
+      if(FD_ISSET(fd, &fsr)){
+        if(read_katcl(f->f_line)){
+          abort_prefetch_fmon(f);
+        }
+      }
+    }
+  }
+}
+
 /* routines to display sensors **********************************************/
 
 #if 0
@@ -1151,14 +1641,12 @@ int print_sensor_list_fmon(struct fmon_state *f, struct fmon_sensor *s)
 
 int print_sensor_status_fmon(struct fmon_state *f, struct fmon_sensor *s)
 {
-  struct timeval now;
   unsigned int milli;
 
-  gettimeofday(&now, NULL);
-  milli = now.tv_usec / 1000;
+  milli = s->s_stamp.tv_usec / 1000;
 
   append_string_katcl(f->f_report, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#sensor-status");
-  append_args_katcl(f->f_report, KATCP_FLAG_STRING, "%lu%03d", now.tv_sec, milli);
+  append_args_katcl(f->f_report, KATCP_FLAG_STRING, "%lu%03d", s->s_stamp.tv_sec, milli);
   append_string_katcl(f->f_report, KATCP_FLAG_STRING, "1");
   append_string_katcl(f->f_report, KATCP_FLAG_STRING, s->s_name);
   append_string_katcl(f->f_report, KATCP_FLAG_STRING, name_status_sensor_katcl(s->s_status));
@@ -1176,6 +1664,63 @@ int print_sensor_status_fmon(struct fmon_state *f, struct fmon_sensor *s)
   return 0;
 }
 
+/* sensor changes are only noted while polling, and go out together once a board has been checked */
+
+void mark_sensor_fmon(struct fmon_sensor *s)
+{
+  s->s_dirty = 1;
+  gettimeofday(&(s->s_stamp), NULL);
+}
+
+static void emit_sensor_fmon(struct fmon_state *f, struct fmon_sensor *s, struct timeval *now)
+{
+  struct timeval delta;
+
+  if((s->s_name == NULL) || (s->s_type < 0)){
+    return;
+  }
+
+  if(s->s_dirty == 0){
+    if((f->f_heartbeat == 0) || s->s_new){
+      return;
+    }
+
+    sub_time_katcp(&delta, now, &(s->s_sent));
+    if(((delta.tv_sec * 1000) + (delta.tv_usec / 1000)) < f->f_heartbeat){
+      return;
+    }
+
+    s->s_stamp = *now;
+  }
+
+  if(s->s_new){
+    s->s_new = 0;
+    print_sensor_list_fmon(f, s);
+  }
+  print_sensor_status_fmon(f, s);
+
+  s->s_dirty = 0;
+  s->s_sent = *now;
+}
+
+void emit_sensors_fmon(struct fmon_state *f)
+{
+  struct timeval now;
+  int i, j;
+
+  gettimeofday(&now, NULL);
+
+  for(i = 0; i < FMON_BOARD_SENSORS; i++){
+    emit_sensor_fmon(f, &(f->f_sensors[i]), &now);
+  }
+
+  for(i = 0; i < FMON_MAX_INPUTS; i++){
+    for(j = 0; j < FMON_INPUT_SENSORS; j++){
+      emit_sensor_fmon(f, &(f->f_inputs[i].n_sensors[j]), &now);
+    }
+  }
+}
+
 /****************************************************************************/
 
 int make_labels_fmon(struct fmon_state *f)
@@ -1501,11 +2046,7 @@ int update_sensor_status_fmon(struct fmon_state *f, struct fmon_sensor *s, unsig
 
     s->s_status = status;
 
-    if(s->s_new){
-      s->s_new = 0;
-      print_sensor_list_fmon(f, s);
-    }
-    print_sensor_status_fmon(f, s);
+    mark_sensor_fmon(s);
   }
 
   return 0;
@@ -1548,11 +2089,7 @@ int update_sensor_fmon(struct fmon_state *f, struct fmon_sensor *s, int value, u
   }
 
   if(change){
-    if(s->s_new){
-      s->s_new = 0;
-      print_sensor_list_fmon(f, s);
-    }
-    print_sensor_status_fmon(f, s);
+    mark_sensor_fmon(s);
   }
 
   return 0;
@@ -1580,11 +2117,7 @@ int update_sensor_double_fmon(struct fmon_state *f, struct fmon_sensor *s, doubl
   }
 
   if(change){
-    if(s->s_new){
-      s->s_new = 0;
-      print_sensor_list_fmon(f, s);
-    }
-    print_sensor_status_fmon(f, s);
+    mark_sensor_fmon(s);
   }
 
   return 0;
@@ -1597,6 +2130,7 @@ void set_lru_fmon(struct fmon_state *f, int value, unsigned int status)
   sensor_lru = &(f->f_sensors[FMON_SENSOR_LRU]);
 
   update_sensor_fmon(f, sensor_lru, value, status);
+  emit_sensors_fmon(f);
 
   while(write_katcl(f->f_report) == 0);
 #if 0
@@ -2055,7 +2589,7 @@ int check_basic_xengine_fmon(struct fmon_state *f)
 
 void usage(char *app)
 {
-  printf("usage: %s [-t timeout] [-s server] [-h] [-r] [-l] [-v] [-q] [-b id] [server [id]]\n", app);
+  printf("usage: %s [-t timeout] [-u heartbeat] [-s server] [-h] [-r] [-l] [-v] [-q] [-b id] [server [id]]\n", app);
   printf("\n");
 
   printf("-h                this help\n");
@@ -2063,10 +2597,11 @@ void usage(char *app)
   printf("-q                operate quietly\n");
   printf("-b                fix board number rather than autodetect\n");
 
-  printf("-s server:port    select the server to contact\n");
+  printf("-s server:port    select the server to contact, repeat to monitor several boards\n");
   printf("-t milliseconds   command timeout in ms\n");
   printf("-i milliseconds   interval between polls in ms\n");
   printf("-r count          reprobe count in poll intervals\n");
+  printf("-u milliseconds   republish unchanged sensors at this interval (default never)\n");
 
   printf("\n");
   printf("return codes:\n");
@@ -2077,25 +2612,67 @@ void usage(char *app)
   printf("3                 other permanent failures\n");
 }
 
+static int add_server_fmon(char ***servers, unsigned int *count, char *server)
+{
+  char **tmp;
+
+  tmp = realloc(*servers, sizeof(char *) * (*count + 1));
+  if(tmp == NULL){
+    return -1;
+  }
+
+  tmp[*count] = server;
+
+  *servers = tmp;
+  (*count)++;
+
+  return 0;
+}
+
+static char *make_prefix_fmon(char *server)
+{
+  char *prefix, *ptr;
+
+  prefix = strdup(server);
+  if(prefix == NULL){
+    return NULL;
+  }
+
+  /* keep the port, several servers may share a host, but not as a colon */
+  ptr = strchr(prefix, ':');
+  if(ptr){
+    *ptr = '-';
+  }
+
+  return prefix;
+}
+
 int main(int argc, char **argv)
 {
-  int i, j, c, g;
-  char *app, *server;
-  int verbose, interval, reprobe;
-  struct fmon_state *f;
-  unsigned int timeout;
+  int i, j, c, g, r;
+  char *app, *server, *prefix;
+  int verbose, interval, reprobe, flags;
+  struct fmon_state *f, **set, **due;
+  unsigned int timeout, heartbeat, count, pending, k;
   struct sigaction sag;
   unsigned int fixed;
+  struct katcl_line *report;
+  struct timeval now, delta;
+  char **servers;
 
   verbose = 1;
   i = j = 1;
   g = 0;
   app = "fmon";
   timeout = 0;
+  heartbeat = 0;
   interval = 0;
   reprobe = (-1);
   fixed = (-1);
 
+  servers = NULL;
+  count = 0;
+
   if(strncmp(argv[0], "roach", 5) == 0){
     server = argv[0];
   } else {
@@ -2142,6 +2719,7 @@ int main(int argc, char **argv)
         case 's' :
         case 'i' :
         case 'r' :
+        case 'u' :
 #if 0        
         case 'e' :
 #endif
@@ -2158,7 +2736,10 @@ int main(int argc, char **argv)
 
           switch(c){
             case 's' :
-              server = argv[i] + j;
+              if(add_server_fmon(&servers, &count, argv[i] + j) < 0){
+                fprintf(stderr, "%s: unable to add server %s\n", app, argv[i] + j);
+                return 2;
+              }
               break;
             case 't' :
               timeout = atoi(argv[i] + j);
@@ -2175,6 +2756,9 @@ int main(int argc, char **argv)
             case 'r' :
               reprobe = atoi(argv[i] + j);
               break;
+            case 'u' :
+              heartbeat = atoi(argv[i] + j);
+              break;
             case 'b' :
               fixed = atoi(argv[i] + j);
               break;
@@ -2199,7 +2783,10 @@ int main(int argc, char **argv)
     } else {
       switch(g){
         case 0 :
-          server = argv[i];
+          if(add_server_fmon(&servers, &count, argv[i]) < 0){
+            fprintf(stderr, "%s: unable to add server %s\n", app, argv[i]);
+            return 2;
+          }
           break;
         case 1 :
           fixed = atoi(argv[i]);
@@ -2213,14 +2800,18 @@ int main(int argc, char **argv)
     }
   }
 
-  if(reprobe < 0){
-    if(strncmp(server, "roach", 5)){
-      reprobe = 0;
-    } else {
-      reprobe = 1;
+  if(count == 0){
+    if(add_server_fmon(&servers, &count, server) < 0){
+      fprintf(stderr, "%s: unable to add server %s\n", app, server);
+      return 2;
     }
   }
 
+  if((count > 1) && (((int)fixed) >= 0)){
+    fprintf(stderr, "%s: a fixed board number only makes sense for a single server\n", app);
+    return 2;
+  }
+
   sag.sa_handler = handle_signal;
   sigemptyset(&(sag.sa_mask));
   sag.sa_flags = SA_RESTART;
@@ -2236,57 +2827,126 @@ int main(int argc, char **argv)
     timeout = FMON_DEFAULT_TIMEOUT;
   }
 
-  f = create_fmon(server, verbose, timeout, reprobe, fixed);
-  if(f == NULL){
-    fprintf(stderr, "%s: unable to allocate monitoring state\n", app);
+  flags = fcntl(STDOUT_FILENO, F_GETFL, NULL);
+  if(flags >= 0){
+    flags = fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK);
+  }
+
+  report = create_katcl(STDOUT_FILENO);
+  if(report == NULL){
+    fprintf(stderr, "%s: unable to allocate report line\n", app);
+    return 2;
+  }
+
+  set = malloc(sizeof(struct fmon_state *) * count);
+  due = malloc(sizeof(struct fmon_state *) * count);
+  if((set == NULL) || (due == NULL)){
+    fprintf(stderr, "%s: unable to allocate monitoring set\n", app);
     return 2;
   }
 
-  /* we rely on the side effect to flush out the sensor list detail too */
-  sync_message_katcl(f->f_report, KATCP_LEVEL_INFO, server, "starting monitoring routines");
+  for(k = 0; k < count; k++){
+    if(reprobe < 0){
+      r = strncmp(servers[k], "roach", 5) ? 0 : 1;
+    } else {
+      r = reprobe;
+    }
+
+    prefix = NULL;
+    if(count > 1){
+      prefix = make_prefix_fmon(servers[k]);
+      if(prefix == NULL){
+        fprintf(stderr, "%s: unable to allocate sensor prefix for %s\n", app, servers[k]);
+        return 2;
+      }
+    }
+
+    set[k] = create_fmon(servers[k], report, prefix, verbose, timeout, heartbeat, r, fixed);
+    if(prefix){
+      free(prefix);
+    }
+    if(set[k] == NULL){
+      fprintf(stderr, "%s: unable to allocate monitoring state for %s\n", app, servers[k]);
+      return 2;
+    }
+
+    /* we rely on the side effect to flush out the sensor list detail too */
+    sync_message_katcl(report, KATCP_LEVEL_INFO, servers[k], "starting monitoring routines");
 
 #ifdef DEBUG
-  fprintf(stderr, "server %s, reprobe %d\n", f->f_server, f->f_reprobe);
+    fprintf(stderr, "server %s, reprobe %d\n", set[k]->f_server, set[k]->f_reprobe);
 #endif
+  }
 
+  delta.tv_sec = interval / 1000;
+  delta.tv_usec = (interval % 1000) * 1000;
 
   for(run = 1; run > 0; ){
-    set_timeout_fmon(f, timeout);
 
-    maintain_fmon(f); /* might have to check return code, but if we do we skip checks which set sensors to unknown on failure ?  */
+    gettimeofday(&now, NULL);
+
+    pending = 0;
+    for(k = 0; k < count; k++){
+      f = set[k];
+      if(cmp_time_katcp(&(f->f_next), &now) <= 0){
+        set_timeout_fmon(f, timeout);
+        add_time_katcp(&(f->f_next), &(f->f_start), &delta);
+
+        maintain_fmon(f); /* might have to check return code, but if we do we skip checks which set sensors to unknown on failure ?  */
 
-    check_clock_fengine_fmon(f);
-    check_inputs_fengine_fmon(f);
+        due[pending++] = f;
+      }
+    }
 
-    check_basic_xengine_fmon(f);
+    /* on failure the checks below fall back to individual reads */
+    prefetch_set_fmon(due, pending);
 
-    check_watchdog_fmon(f); /* only gets done if nothing else happened */
+    for(k = 0; k < pending; k++){
+      f = due[k];
 
-    if(catchup_fmon(f, interval) < 0){
-      run = 0;
+      check_clock_fengine_fmon(f);
+      check_inputs_fengine_fmon(f);
+
+      check_basic_xengine_fmon(f);
+
+      check_watchdog_fmon(f); /* only gets done if nothing else happened */
+
+      emit_sensors_fmon(f);
+
+      if(f->f_grace <= FMON_INIT_PERIOD){
+        f->f_grace += interval;
+      }
     }
 
-    if(check_parent(f) < 0){
+    if(catchup_fmon(set, count, report) < 0){
       run = 0;
     }
 
-    if(f->f_grace <= FMON_INIT_PERIOD){
-      f->f_grace += interval;
+    if(check_parent(set[0]) < 0){
+      run = 0;
     }
   }
 
-  sync_message_katcl(f->f_report, KATCP_LEVEL_INFO, f->f_server, "%s sensor monitoring logic for %s", (run < 0) ? "restarting" : "stopping", f->f_server);
+  for(k = 0; k < count; k++){
+    sync_message_katcl(report, KATCP_LEVEL_INFO, set[k]->f_server, "%s sensor monitoring logic for %s", (run < 0) ? "restarting" : "stopping", set[k]->f_server);
+  }
 
   if(run < 0){
     execvp(argv[0], argv);
 
-    sync_message_katcl(f->f_report, KATCP_LEVEL_WARN, f->f_server, "unable to restart %s: %s", argv[0], strerror(errno));
+    sync_message_katcl(report, KATCP_LEVEL_WARN, app, "unable to restart %s: %s", argv[0], strerror(errno));
     return 2;
   }
 
-  if(f){
-    destroy_fmon(f);
+  for(k = 0; k < count; k++){
+    destroy_fmon(set[k]);
   }
 
+  free(set);
+  free(due);
+  free(servers);
+
+  destroy_katcl(report, 0);
+
   return 0;
 }
@@ -41,6 +41,7 @@ struct katcp_arb *create_arb_katcp(struct katcp_dispatch *d, char *name, int fd,
   }
 
   a->a_fd = fd;
+  forget_poll_katcp(s, fd);
 
   a->a_mode = mode & (KATCP_ARB_READ | KATCP_ARB_WRITE);
   a->a_run = run;
@@ -203,16 +204,10 @@ void load_arb_katcp(struct katcp_dispatch *d)
 
     if(a->a_fd >= 0){
       if(a->a_mode & KATCP_ARB_READ){
-        FD_SET(a->a_fd, &(s->s_read));
+        want_poll_katcp(s, a->a_fd, KATCP_POLL_READ);
       } 
       if(a->a_mode & KATCP_ARB_WRITE){
-        FD_SET(a->a_fd, &(s->s_write));
-      }
-
-      if(a->a_mode & (KATCP_ARB_WRITE | KATCP_ARB_READ)){
-        if(a->a_fd > s->s_max){ 
-          s->s_max = a->a_fd;
-        }
+        want_poll_katcp(s, a->a_fd, KATCP_POLL_WRITE);
       }
     }
   }
@@ -243,10 +238,10 @@ int run_arb_katcp(struct katcp_dispatch *d)
 
       mode = 0;
 
-      if(FD_ISSET(fd, &(s->s_read))){
+      if(ready_poll_katcp(s, fd, KATCP_POLL_READ)){
         mode = KATCP_ARB_READ;
       }
-      if(FD_ISSET(fd, &(s->s_write))){
+      if(ready_poll_katcp(s, fd, KATCP_POLL_WRITE)){
         mode = KATCP_ARB_WRITE;
       }
 
@@ -0,0 +1,851 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* asynchronous client requests: many tagged requests can be outstanding
+ * on a single line, each completes through its own callback, with a
+ * status code and the reply accessible through the arg_*_katcl calls.
+ * Untagged informs are dispatched by name. The logic does not block,
+ * callers add fileno_async_katcl to their own poll set, use
+ * flushing_async_katcl and timeout_async_katcl to decide what to wait
+ * for, and then invoke run_async_katcl. Tools happy to block may use
+ * complete_async_katcl instead */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+#include "katcl.h"
+#include "katpriv.h"
+#include "katcp.h"
+
+struct katcl_async *create_async_katcl(struct katcl_line *l)
+{
+  struct katcl_async *a;
+
+  if(l == NULL){
+    return NULL;
+  }
+
+  a = malloc(sizeof(struct katcl_async));
+  if(a == NULL){
+    return NULL;
+  }
+
+  a->a_line = l;
+
+  a->a_requests = NULL;
+  a->a_pending = 0;
+  a->a_size = 0;
+
+  a->a_informs = NULL;
+  a->a_count = 0;
+
+  a->a_tag = 1;
+  a->a_sequence = 0;
+  a->a_lost = 0;
+
+  return a;
+}
+
+static void fail_all_async_katcl(struct katcl_async *a, int status)
+{
+  struct katcl_async_request r;
+
+  /* callbacks may issue new requests, so always take the last one */
+  while(a->a_pending > 0){
+    a->a_pending--;
+    r = a->a_requests[a->a_pending];
+    if(r.r_name){
+      free(r.r_name);
+    }
+    if(r.r_call){
+      (*(r.r_call))(a->a_line, status, r.r_data);
+    }
+  }
+}
+
+void destroy_async_katcl(struct katcl_async *a)
+{
+  unsigned int i;
+
+  if(a == NULL){
+    return;
+  }
+
+  /* stop callbacks from starting anything new */
+  a->a_lost = 1;
+
+  fail_all_async_katcl(a, KATCL_ASYNC_LOST);
+
+  if(a->a_requests){
+    free(a->a_requests);
+    a->a_requests = NULL;
+  }
+  a->a_size = 0;
+
+  for(i = 0; i < a->a_count; i++){
+    if(a->a_informs[i].i_name){
+      free(a->a_informs[i].i_name);
+    }
+  }
+
+  if(a->a_informs){
+    free(a->a_informs);
+    a->a_informs = NULL;
+  }
+  a->a_count = 0;
+
+  /* the line belongs to the caller */
+  a->a_line = NULL;
+
+  free(a);
+}
+
+struct katcl_line *line_async_katcl(struct katcl_async *a)
+{
+  return a->a_line;
+}
+
+/****************************************************************************/
+
+static int locate_request_async_katcl(struct katcl_async *a, int tag)
+{
+  unsigned int i;
+
+  for(i = 0; i < a->a_pending; i++){
+    if(a->a_requests[i].r_tag == tag){
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static int locate_untagged_async_katcl(struct katcl_async *a, char *name)
+{
+  /* peers which do not understand tags reply in order, so pick the oldest request of that name */
+  unsigned int i;
+  int found;
+
+  found = (-1);
+
+  for(i = 0; i < a->a_pending; i++){
+    if(!strcmp(a->a_requests[i].r_name, name)){
+      if((found < 0) || (a->a_requests[i].r_sequence < a->a_requests[found].r_sequence)){
+        found = i;
+      }
+    }
+  }
+
+  return found;
+}
+
+static void remove_request_async_katcl(struct katcl_async *a, unsigned int index, struct katcl_async_request *r)
+{
+  *r = a->a_requests[index];
+
+  a->a_pending--;
+  if(index < a->a_pending){
+    a->a_requests[index] = a->a_requests[a->a_pending];
+  }
+}
+
+static int next_tag_async_katcl(struct katcl_async *a)
+{
+  int tag;
+
+  do{
+    tag = a->a_tag;
+    a->a_tag = (a->a_tag >= KATCL_ASYNC_TAG_MAX) ? 1 : (a->a_tag + 1);
+  } while(locate_request_async_katcl(a, tag) >= 0);
+
+  return tag;
+}
+
+int append_parse_async_katcl(struct katcl_async *a, unsigned int timeout, void (*call)(struct katcl_line *l, int status, void *data), void *data, struct katcl_parse *p)
+{
+  /* timeout in milliseconds, zero waits indefinitely. Returns the tag of the request */
+  struct katcl_async_request *r, *tmp;
+  struct katcl_parse *px;
+  struct timeval now, delta;
+  unsigned int i, count;
+  char *name;
+  int tag, result;
+
+  if(a->a_lost){
+    return -1;
+  }
+
+  if((p == NULL) || (is_request_parse_katcl(p) == 0)){
+    return -1;
+  }
+
+  /* every outstanding request needs a distinct tag */
+  if(a->a_pending >= KATCL_ASYNC_TAG_MAX){
+    return -1;
+  }
+
+  name = get_string_parse_katcl(p, 0);
+  if(name == NULL){
+    return -1;
+  }
+
+  if(a->a_pending >= a->a_size){
+    tmp = realloc(a->a_requests, sizeof(struct katcl_async_request) * (a->a_size + KATCL_ARGS_INC));
+    if(tmp == NULL){
+      return -1;
+    }
+    a->a_requests = tmp;
+    a->a_size += KATCL_ARGS_INC;
+  }
+
+  r = &(a->a_requests[a->a_pending]);
+
+  r->r_name = strdup(name + 1);
+  if(r->r_name == NULL){
+    return -1;
+  }
+
+  tag = next_tag_async_katcl(a);
+
+  /* copy so that the caller's parse stays untagged, see also append_tagged_katcl */
+  px = create_referenced_parse_katcl();
+  if(px == NULL){
+    free(r->r_name);
+    return -1;
+  }
+
+  count = get_count_parse_katcl(p);
+
+  result = 0;
+  for(i = 0; (i < count) && (result >= 0); i++){
+    result = add_parameter_parse_katcl(px, ((i == 0) ? KATCP_FLAG_FIRST : 0) | (((i + 1) == count) ? KATCP_FLAG_LAST : 0), p, i);
+    if((i == 0) && (result >= 0)){
+      result = name_tag_parse_katcl(px, tag);
+    }
+  }
+
+  if(result >= 0){
+    result = append_parse_katcl(a->a_line, px);
+  }
+
+  destroy_parse_katcl(px);
+
+  if(result < 0){
+    free(r->r_name);
+    return -1;
+  }
+
+  r->r_tag = tag;
+  r->r_sequence = a->a_sequence++;
+  r->r_call = call;
+  r->r_data = data;
+
+  if(timeout > 0){
+    gettimeofday(&now, NULL);
+    delta.tv_sec = timeout / 1000;
+    delta.tv_usec = (timeout % 1000) * 1000;
+    add_time_katcp(&(r->r_until), &now, &delta);
+    r->r_timed = 1;
+  } else {
+    r->r_timed = 0;
+  }
+
+  a->a_pending++;
+
+  return tag;
+}
+
+int vsend_async_katcl(struct katcl_async *a, unsigned int timeout, void (*call)(struct katcl_line *l, int status, void *data), void *data, va_list args)
+{
+  struct katcl_parse *p;
+  int flags, result, check;
+  char *string;
+  void *buffer;
+  unsigned long value;
+  int len;
+#ifdef KATCP_USE_FLOATS
+  double dvalue;
+#endif
+
+  p = create_referenced_parse_katcl();
+  if(p == NULL){
+    return -1;
+  }
+
+  check = KATCP_FLAG_FIRST;
+
+  /* same argument conventions as vsend_katcl */
+  do{
+    flags = va_arg(args, int);
+    if((check & flags) != check){
+      destroy_parse_katcl(p);
+      return -1;
+    }
+    check = 0;
+
+    switch(flags & KATCP_TYPE_FLAGS){
+      case KATCP_FLAG_STRING :
+        string = va_arg(args, char *);
+        result = add_string_parse_katcl(p, flags & KATCP_ORDER_FLAGS, string);
+        break;
+      case KATCP_FLAG_SLONG :
+        value = va_arg(args, unsigned long);
+        result = add_signed_long_parse_katcl(p, flags & KATCP_ORDER_FLAGS, value);
+        break;
+      case KATCP_FLAG_ULONG :
+        value = va_arg(args, unsigned long);
+        result = add_unsigned_long_parse_katcl(p, flags & KATCP_ORDER_FLAGS, value);
+        break;
+      case KATCP_FLAG_XLONG :
+        value = va_arg(args, unsigned long);
+        result = add_hex_long_parse_katcl(p, flags & KATCP_ORDER_FLAGS, value);
+        break;
+      case KATCP_FLAG_BUFFER :
+        buffer = va_arg(args, void *);
+        len = va_arg(args, int);
+        result = add_buffer_parse_katcl(p, flags & KATCP_ORDER_FLAGS, buffer, len);
+        break;
+#ifdef KATCP_USE_FLOATS
+      case KATCP_FLAG_DOUBLE :
+        dvalue = va_arg(args, double);
+        result = add_double_parse_katcl(p, flags & KATCP_ORDER_FLAGS, dvalue);
+        break;
+#endif
+      default :
+        result = (-1);
+        break;
+    }
+
+    if(result < 0){
+      destroy_parse_katcl(p);
+      return -1;
+    }
+
+  } while(!(flags & KATCP_FLAG_LAST));
+
+  result = append_parse_async_katcl(a, timeout, call, data, p);
+
+  destroy_parse_katcl(p);
+
+  return result;
+}
+
+int send_async_katcl(struct katcl_async *a, unsigned int timeout, void (*call)(struct katcl_line *l, int status, void *data), void *data, ...)
+{
+  int result;
+  va_list args;
+
+  va_start(args, data);
+  result = vsend_async_katcl(a, timeout, call, data, args);
+  va_end(args);
+
+  return result;
+}
+
+int cancel_async_katcl(struct katcl_async *a, int tag)
+{
+  /* forgets the request without invoking its callback, a later reply is discarded */
+  struct katcl_async_request r;
+  int index;
+
+  index = locate_request_async_katcl(a, tag);
+  if(index < 0){
+    return -1;
+  }
+
+  remove_request_async_katcl(a, index, &r);
+  free(r.r_name);
+
+  return 0;
+}
+
+int pending_async_katcl(struct katcl_async *a, int tag)
+{
+  /* a negative tag counts all outstanding requests */
+
+  if(tag < 0){
+    return a->a_pending;
+  }
+
+  return (locate_request_async_katcl(a, tag) >= 0) ? 1 : 0;
+}
+
+/****************************************************************************/
+
+int inform_async_katcl(struct katcl_async *a, char *name, void (*call)(struct katcl_line *l, void *data), void *data)
+{
+  /* a null name catches untagged informs not otherwise handled, a null call removes the handler */
+  struct katcl_async_inform *tmp;
+  unsigned int i;
+  char *copy;
+  int len;
+
+  if(name){
+    len = strlen(name);
+    if(len <= 0){
+      return -1;
+    }
+    copy = malloc(len + 2);
+    if(copy == NULL){
+      return -1;
+    }
+    if(name[0] == KATCP_INFORM){
+      strcpy(copy, name);
+    } else {
+      copy[0] = KATCP_INFORM;
+      strcpy(copy + 1, name);
+    }
+  } else {
+    copy = NULL;
+  }
+
+  for(i = 0; i < a->a_count; i++){
+    if((copy == NULL) ? (a->a_informs[i].i_name == NULL) : ((a->a_informs[i].i_name != NULL) && !strcmp(a->a_informs[i].i_name, copy))){
+      break;
+    }
+  }
+
+  if(call == NULL){
+    if(copy){
+      free(copy);
+    }
+    if(i >= a->a_count){
+      return -1;
+    }
+    if(a->a_informs[i].i_name){
+      free(a->a_informs[i].i_name);
+    }
+    a->a_count--;
+    if(i < a->a_count){
+      a->a_informs[i] = a->a_informs[a->a_count];
+    }
+    return 0;
+  }
+
+  if(i < a->a_count){ /* replace existing handler */
+    if(copy){
+      free(copy);
+    }
+    a->a_informs[i].i_call = call;
+    a->a_informs[i].i_data = data;
+    return 0;
+  }
+
+  tmp = realloc(a->a_informs, sizeof(struct katcl_async_inform) * (a->a_count + 1));
+  if(tmp == NULL){
+    if(copy){
+      free(copy);
+    }
+    return -1;
+  }
+  a->a_informs = tmp;
+
+  a->a_informs[a->a_count].i_name = copy;
+  a->a_informs[a->a_count].i_call = call;
+  a->a_informs[a->a_count].i_data = data;
+  a->a_count++;
+
+  return 0;
+}
+
+static void dispatch_inform_async_katcl(struct katcl_async *a, char *name)
+{
+  struct katcl_async_inform *fallback;
+  unsigned int i;
+
+  fallback = NULL;
+
+  for(i = 0; i < a->a_count; i++){
+    if(a->a_informs[i].i_name == NULL){
+      fallback = &(a->a_informs[i]);
+    } else if(!strcmp(a->a_informs[i].i_name, name)){
+      (*(a->a_informs[i].i_call))(a->a_line, a->a_informs[i].i_data);
+      return;
+    }
+  }
+
+  if(fallback){
+    (*(fallback->i_call))(a->a_line, fallback->i_data);
+  }
+}
+
+static void dispatch_async_katcl(struct katcl_async *a)
+{
+  struct katcl_async_request r;
+  char *name, *code;
+  int index, tag;
+
+  name = arg_string_katcl(a->a_line, 0);
+  if(name == NULL){
+    return;
+  }
+
+  tag = arg_tag_katcl(a->a_line);
+
+  switch(name[0]){
+    case KATCP_REPLY :
+      index = (tag >= 0) ? locate_request_async_katcl(a, tag) : locate_untagged_async_katcl(a, name + 1);
+      if(index < 0){
+#ifdef DEBUG
+        fprintf(stderr, "async: discarding unmatched reply %s[%d]\n", name, tag);
+#endif
+        return;
+      }
+
+      remove_request_async_katcl(a, index, &r);
+      free(r.r_name);
+
+      code = arg_string_katcl(a->a_line, 1);
+      if(r.r_call){
+        (*(r.r_call))(a->a_line, (code && !strcmp(code, KATCP_OK)) ? KATCL_ASYNC_OK : KATCL_ASYNC_FAIL, r.r_data);
+      }
+      return;
+
+    case KATCP_INFORM :
+      if(tag >= 0){
+        index = locate_request_async_katcl(a, tag);
+        if(index >= 0){
+          r = a->a_requests[index];
+          if(r.r_call){
+            (*(r.r_call))(a->a_line, KATCL_ASYNC_INFORM, r.r_data);
+          }
+          return;
+        }
+      }
+
+      dispatch_inform_async_katcl(a, name);
+      return;
+
+    default :
+#ifdef DEBUG
+      fprintf(stderr, "async: ignoring request %s from server\n", name);
+#endif
+      return;
+  }
+}
+
+static void expire_async_katcl(struct katcl_async *a)
+{
+  struct katcl_async_request r;
+  struct timeval now;
+  unsigned int i;
+
+  gettimeofday(&now, NULL);
+
+  i = 0;
+  while(i < a->a_pending){
+    if(a->a_requests[i].r_timed && (cmp_time_katcp(&(a->a_requests[i].r_until), &now) <= 0)){
+      remove_request_async_katcl(a, i, &r);
+      free(r.r_name);
+      if(r.r_call){
+        (*(r.r_call))(a->a_line, KATCL_ASYNC_TIMEOUT, r.r_data);
+      }
+      /* the callback may have added or removed requests, start again */
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+}
+
+/****************************************************************************/
+
+int fileno_async_katcl(struct katcl_async *a)
+{
+  return fileno_katcl(a->a_line);
+}
+
+int flushing_async_katcl(struct katcl_async *a)
+{
+  return flushing_katcl(a->a_line);
+}
+
+int timeout_async_katcl(struct katcl_async *a, struct timeval *delta)
+{
+  /* returns 1 and the time until the earliest deadline, or 0 if nothing can time out */
+  struct timeval now, *soonest;
+  unsigned int i;
+
+  soonest = NULL;
+
+  for(i = 0; i < a->a_pending; i++){
+    if(a->a_requests[i].r_timed){
+      if((soonest == NULL) || (cmp_time_katcp(&(a->a_requests[i].r_until), soonest) < 0)){
+        soonest = &(a->a_requests[i].r_until);
+      }
+    }
+  }
+
+  if(soonest == NULL){
+    return 0;
+  }
+
+  gettimeofday(&now, NULL);
+
+  if(cmp_time_katcp(soonest, &now) > 0){
+    sub_time_katcp(delta, soonest, &now);
+  } else {
+    delta->tv_sec = 0;
+    delta->tv_usec = 0;
+  }
+
+  return 1;
+}
+
+int run_async_katcl(struct katcl_async *a, int readable, int writable)
+{
+  /* returns the number of outstanding requests, or -1 once the connection is unusable */
+  int result;
+
+  if(a->a_lost){
+    return -1;
+  }
+
+  if(writable){
+    if(write_katcl(a->a_line) < 0){
+      a->a_lost = 1;
+    }
+  }
+
+  if(readable && (a->a_lost == 0)){
+    result = read_katcl(a->a_line);
+    if(result){
+#ifdef DEBUG
+      fprintf(stderr, "async: read failed: %s\n", (result < 0) ? strerror(error_katcl(a->a_line)) : "connection terminated");
+#endif
+      a->a_lost = 1;
+    }
+  }
+
+  /* a lost connection may still have delivered complete messages */
+  while((result = have_katcl(a->a_line)) > 0){
+    dispatch_async_katcl(a);
+  }
+
+  if(result < 0){
+    a->a_lost = 1;
+  }
+
+  if(a->a_lost){
+    fail_all_async_katcl(a, KATCL_ASYNC_LOST);
+    return -1;
+  }
+
+  expire_async_katcl(a);
+
+  return a->a_pending;
+}
+
+int complete_async_katcl(struct katcl_async *a, struct timeval *until)
+{
+  /* blocks until nothing is outstanding or until passes, returns what is still outstanding */
+  fd_set fsr, fsw;
+  struct timeval tv, now, left, *wait;
+  int result, fd, timed;
+
+  fd = fileno_async_katcl(a);
+
+  for(;;){
+
+    result = run_async_katcl(a, 0, 0);
+    if(result <= 0){
+      return result;
+    }
+
+    FD_ZERO(&fsr);
+    FD_ZERO(&fsw);
+
+    FD_SET(fd, &fsr);
+    if(flushing_async_katcl(a)){
+      FD_SET(fd, &fsw);
+    }
+
+    timed = timeout_async_katcl(a, &tv);
+
+    if(until){
+      gettimeofday(&now, NULL);
+      if(cmp_time_katcp(&now, until) >= 0){
+        return a->a_pending;
+      }
+      sub_time_katcp(&left, until, &now);
+      if((timed == 0) || (cmp_time_katcp(&left, &tv) < 0)){
+        tv = left;
+        timed = 1;
+      }
+    }
+
+    wait = timed ? &tv : NULL;
+
+    result = select(fd + 1, &fsr, &fsw, NULL, wait);
+    if(result < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          continue;
+        default  :
+          return -1;
+      }
+    }
+
+    if(result == 0){
+      continue; /* deadlines are checked at the start of the loop */
+    }
+
+    if(run_async_katcl(a, FD_ISSET(fd, &fsr), FD_ISSET(fd, &fsw)) < 0){
+      return -1;
+    }
+  }
+}
+
+#ifdef UNIT_TEST_ASYNC
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+static int results[4];
+
+static void reply_test(struct katcl_line *l, int status, void *data)
+{
+  int *slot;
+
+  slot = data;
+
+  if(status == KATCL_ASYNC_INFORM){
+    printf("test: inform %s for request %d\n", arg_string_katcl(l, 0), (int)(slot - results));
+    return;
+  }
+
+  printf("test: request %d completed with status %d\n", (int)(slot - results), status);
+  *slot = status;
+}
+
+static void note_test(struct katcl_line *l, void *data)
+{
+  int *count;
+
+  count = data;
+  (*count)++;
+
+  printf("test: untagged inform %s %s\n", arg_string_katcl(l, 0), arg_string_katcl(l, 1));
+}
+
+int main()
+{
+  struct katcl_async *a;
+  struct katcl_line *lc, *ls;
+  struct timeval now, delta, until;
+  int fds[2], tags[4], i, seen, notes;
+  char name[32];
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0){
+    fprintf(stderr, "test: unable to create socket pair\n");
+    return 1;
+  }
+
+  lc = create_katcl(fds[0]);
+  ls = create_katcl(fds[1]);
+  a = create_async_katcl(lc);
+  if((lc == NULL) || (ls == NULL) || (a == NULL)){
+    fprintf(stderr, "test: unable to set up lines\n");
+    return 1;
+  }
+
+  notes = 0;
+  inform_async_katcl(a, "note", &note_test, &notes);
+
+  for(i = 0; i < 4; i++){
+    results[i] = 99;
+  }
+
+  tags[0] = send_async_katcl(a, 1000, &reply_test, &results[0], KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?alpha", KATCP_FLAG_LAST | KATCP_FLAG_ULONG, 1UL);
+  tags[1] = send_async_katcl(a, 1000, &reply_test, &results[1], KATCP_FLAG_FIRST | KATCP_FLAG_LAST | KATCP_FLAG_STRING, "?beta");
+  tags[2] = send_async_katcl(a, 100, &reply_test, &results[2], KATCP_FLAG_FIRST | KATCP_FLAG_LAST | KATCP_FLAG_STRING, "?gamma");
+  tags[3] = send_async_katcl(a, 1000, &reply_test, &results[3], KATCP_FLAG_FIRST | KATCP_FLAG_LAST | KATCP_FLAG_STRING, "?delta");
+
+  for(i = 0; i < 4; i++){
+    if(tags[i] < 0){
+      fprintf(stderr, "test: send %d failed\n", i);
+      return 1;
+    }
+  }
+
+  if(cancel_async_katcl(a, tags[3]) < 0){
+    fprintf(stderr, "test: unable to cancel request\n");
+    return 1;
+  }
+
+  while(flushing_async_katcl(a)){
+    run_async_katcl(a, 0, 1);
+  }
+
+  /* play server: answer beta first, alpha with a failure, ignore gamma, answer delta too late */
+  seen = 0;
+  while(seen < 4){
+    if(read_katcl(ls)){
+      fprintf(stderr, "test: server read failed\n");
+      return 1;
+    }
+    while(have_katcl(ls) > 0){
+      printf("test: server received %s[%d]\n", arg_string_katcl(ls, 0), arg_tag_katcl(ls));
+      seen++;
+    }
+  }
+
+  snprintf(name, sizeof(name), "#beta[%d]", tags[1]);
+  send_katcl(ls, KATCP_FLAG_FIRST | KATCP_FLAG_LAST | KATCP_FLAG_STRING, name);
+  send_katcl(ls, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#note", KATCP_FLAG_LAST | KATCP_FLAG_STRING, "hello");
+
+  tag_katcl(ls, tags[1]);
+  send_katcl(ls, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!beta", KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCP_OK);
+  tag_katcl(ls, tags[0]);
+  send_katcl(ls, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!alpha", KATCP_FLAG_STRING, KATCP_FAIL, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "because");
+  tag_katcl(ls, tags[3]);
+  send_katcl(ls, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "!delta", KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCP_OK);
+  tag_katcl(ls, -1);
+
+  while(flushing_katcl(ls)){
+    write_katcl(ls);
+  }
+
+  gettimeofday(&now, NULL);
+  delta.tv_sec = 2;
+  delta.tv_usec = 0;
+  add_time_katcp(&until, &now, &delta);
+
+  if(complete_async_katcl(a, &until) != 0){
+    fprintf(stderr, "test: requests still outstanding\n");
+    return 1;
+  }
+
+  if((results[0] != KATCL_ASYNC_FAIL) || (results[1] != KATCL_ASYNC_OK) || (results[2] != KATCL_ASYNC_TIMEOUT) || (results[3] != 99) || (notes != 1)){
+    fprintf(stderr, "test: unexpected results %d %d %d %d, notes %d\n", results[0], results[1], results[2], results[3], notes);
+    return 1;
+  }
+
+  tags[0] = send_async_katcl(a, 0, &reply_test, &results[0], KATCP_FLAG_FIRST | KATCP_FLAG_LAST | KATCP_FLAG_STRING, "?epsilon");
+  destroy_katcl(ls, 1);
+
+  if(complete_async_katcl(a, NULL) >= 0 || (results[0] != KATCL_ASYNC_LOST)){
+    fprintf(stderr, "test: expected request to be lost\n");
+    return 1;
+  }
+
+  destroy_async_katcl(a);
+  destroy_katcl(lc, 1);
+
+  printf("test: ok\n");
+
+  return 0;
+}
+
+#endif
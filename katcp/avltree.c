@@ -17,35 +17,154 @@
 #include "katcp.h"
 #include "avltree.h"
 
+/* an arena hands out memory from large chunks and only gives it back
+ * when the tree is destroyed. Useful for tables which are loaded in
+ * bulk and discarded as a whole, like the register map of a gateware
+ * image. Nodes removed individually keep their space until then */
+
+#define AVL_ARENA_ALIGN 16
+
+struct avl_chunk {
+  struct avl_chunk *c_next;
+  unsigned int c_used;
+  unsigned int c_size;
+};
+
+struct avl_arena {
+  struct avl_chunk *a_chunks; /* head is the one being filled */
+  unsigned int a_chunk;
+};
+
+static unsigned int header_arena_avltree()
+{
+  return (sizeof(struct avl_chunk) + AVL_ARENA_ALIGN - 1) & ~(AVL_ARENA_ALIGN - 1);
+}
+
+static void destroy_arena_avltree(struct avl_arena *a)
+{
+  struct avl_chunk *c;
+
+  while (a->a_chunks){
+    c = a->a_chunks;
+    a->a_chunks = c->c_next;
+    free_memory_katcp(KATCP_MEMORY_AVLTREE, c, header_arena_avltree() + c->c_size);
+  }
+
+  free_memory_katcp(KATCP_MEMORY_AVLTREE, a, sizeof(struct avl_arena));
+}
+
+static void *get_arena_avltree(struct avl_arena *a, unsigned int size)
+{
+  struct avl_chunk *c;
+  unsigned int header, want;
+  char *ptr;
+
+  header = header_arena_avltree();
+  size = (size + AVL_ARENA_ALIGN - 1) & ~(AVL_ARENA_ALIGN - 1);
+
+  c = a->a_chunks;
+  if ((c == NULL) || ((c->c_size - c->c_used) < size)){
+    want = (size > a->a_chunk) ? size : a->a_chunk;
+
+    c = malloc_memory_katcp(KATCP_MEMORY_AVLTREE, header + want);
+    if (c == NULL)
+      return NULL;
+
+    c->c_used = 0;
+    c->c_size = want;
+
+    if (a->a_chunks && (size > a->a_chunk)){
+      /* oversized request, keep filling the current chunk */
+      c->c_next = a->a_chunks->c_next;
+      a->a_chunks->c_next = c;
+    } else {
+      c->c_next = a->a_chunks;
+      a->a_chunks = c;
+    }
+  }
+
+  ptr = ((char *)c) + header + c->c_used;
+  c->c_used += size;
+
+  return ptr;
+}
+
 struct avl_tree *create_avltree()
 {
   struct avl_tree *t;
 
-  t = malloc(sizeof(struct avl_tree));
+  t = malloc_memory_katcp(KATCP_MEMORY_AVLTREE, sizeof(struct avl_tree));
   if (t == NULL)
     return NULL;
 
   t->t_root = NULL;
+  t->t_arena = NULL;
 
   return t;
 }
 
-struct avl_node *create_node_avltree(char *key, void *data)
+struct avl_tree *create_arena_avltree(unsigned int chunk)
 {
-  struct avl_node *n;
+  struct avl_tree *t;
+  struct avl_arena *a;
 
-  if (key == NULL)
+  t = create_avltree();
+  if (t == NULL)
     return NULL;
 
-  n = malloc(sizeof(struct avl_node));
-  
-  if (n == NULL)
+  a = malloc_memory_katcp(KATCP_MEMORY_AVLTREE, sizeof(struct avl_arena));
+  if (a == NULL){
+    free_memory_katcp(KATCP_MEMORY_AVLTREE, t, sizeof(struct avl_tree));
     return NULL;
+  }
+
+  a->a_chunks = NULL;
+  a->a_chunk = (chunk > 0) ? chunk : AVL_ARENA_CHUNK;
+
+  t->t_arena = a;
 
-  n->n_key = strdup(key);
-  if (n->n_key == NULL) {
-    free(n);
+  return t;
+}
+
+void *alloc_arena_avltree(struct avl_tree *t, unsigned int size)
+{
+  /* caller data which goes away with the tree, pass a null free function when destroying it */
+
+  if ((t == NULL) || (t->t_arena == NULL))
     return NULL;
+
+  return get_arena_avltree(t->t_arena, size);
+}
+
+static struct avl_node *make_node_avltree(struct avl_arena *a, char *key, void *data)
+{
+  struct avl_node *n;
+  unsigned int len;
+
+  if (key == NULL)
+    return NULL;
+
+  if (a){
+    /* key directly after its node, one bump for both */
+    len = strlen(key) + 1;
+    n = get_arena_avltree(a, sizeof(struct avl_node) + len);
+    if (n == NULL)
+      return NULL;
+
+    n->n_key = (char *)(n + 1);
+    memcpy(n->n_key, key, len);
+    n->n_flags = AVL_NODE_ARENA;
+  } else {
+    n = malloc_memory_katcp(KATCP_MEMORY_AVLTREE, sizeof(struct avl_node));
+    if (n == NULL)
+      return NULL;
+
+    n->n_key = strdup_memory_katcp(KATCP_MEMORY_AVLTREE, key);
+    if (n->n_key == NULL) {
+      free_memory_katcp(KATCP_MEMORY_AVLTREE, n, sizeof(struct avl_node));
+      return NULL;
+    }
+    n->n_flags = 0;
   }
   
   n->n_parent  = NULL;
@@ -57,6 +176,11 @@ struct avl_node *create_node_avltree(char *key, void *data)
   return n;
 }
 
+struct avl_node *create_node_avltree(char *key, void *data)
+{
+  return make_node_avltree(NULL, key, data);
+}
+
 char *get_node_name_avltree(struct avl_node *n)
 {
   return (n != NULL) ? n->n_key : NULL;
@@ -228,6 +352,122 @@ void *walk_data_inorder_avltree(struct avl_node *n)
   return c->n_data;
 }
 
+/* ordered access using the parent pointers: no stack, no static state,
+ * so scans may be nested or abandoned halfway. A prefix scan starts at
+ * the lower bound of the prefix and stops at the first key which does
+ * not match, costing O(log n + k). Inserting or deleting nodes other
+ * than the one just returned is fine, deleting the next one is not */
+
+struct avl_node *first_avltree(struct avl_tree *t)
+{
+  struct avl_node *c;
+
+  if ((t == NULL) || (t->t_root == NULL))
+    return NULL;
+
+  for (c = t->t_root; c->n_left != NULL; c = c->n_left);
+
+  return c;
+}
+
+struct avl_node *next_avltree(struct avl_node *n)
+{
+  struct avl_node *c;
+
+  if (n == NULL)
+    return NULL;
+
+  if (n->n_right != NULL){
+    for (c = n->n_right; c->n_left != NULL; c = c->n_left);
+    return c;
+  }
+
+  /* climb until we arrive from a left child */
+  c = n;
+  while ((c->n_parent != NULL) && (c->n_parent->n_right == c)){
+    c = c->n_parent;
+  }
+
+  return c->n_parent;
+}
+
+struct avl_node *lower_bound_avltree(struct avl_tree *t, char *key)
+{
+  struct avl_node *c, *best;
+  int cmp;
+
+  if (t == NULL)
+    return NULL;
+
+  if (key == NULL)
+    return first_avltree(t);
+
+  best = NULL;
+  c = t->t_root;
+
+  while (c != NULL){
+    cmp = strcmp(key, c->n_key);
+    if (cmp == 0){
+      return c;
+    } else if (cmp < 0){
+      best = c;
+      c = c->n_left;
+    } else {
+      c = c->n_right;
+    }
+  }
+
+  return best;
+}
+
+void start_iterator_avltree(struct avl_tree *t, struct avl_iterator *it, char *prefix)
+{
+  it->i_prefix = prefix;
+  it->i_length = prefix ? strlen(prefix) : 0;
+
+  it->i_next = lower_bound_avltree(t, prefix);
+}
+
+struct avl_node *next_iterator_avltree(struct avl_iterator *it)
+{
+  struct avl_node *c;
+
+  c = it->i_next;
+  if (c == NULL)
+    return NULL;
+
+  if ((it->i_length > 0) && strncmp(c->n_key, it->i_prefix, it->i_length)){
+    /* sorted, so nothing further along matches either */
+    it->i_next = NULL;
+    return NULL;
+  }
+
+  it->i_next = next_avltree(c);
+
+  return c;
+}
+
+int collect_prefix_avltree(struct avl_tree *t, char *prefix, struct avl_node **vector, unsigned int size)
+{
+  struct avl_iterator it;
+  struct avl_node *c;
+  unsigned int count;
+
+  /* returns the number of matches, which may exceed size, only size of them are stored */
+
+  count = 0;
+
+  start_iterator_avltree(t, &it, prefix);
+  while ((c = next_iterator_avltree(&it)) != NULL){
+    if (count < size){
+      vector[count] = c;
+    }
+    count++;
+  }
+
+  return count;
+}
+
 void print_inorder_avltree(struct katcp_dispatch *d, struct avl_node *n, void (*fn_print)(struct katcp_dispatch *d, char *key, void *data), int flags)
 {
   struct avl_node *c;
@@ -751,7 +991,6 @@ void free_node_avltree(struct avl_node *n, void (*d_free)(void *))
   if (n->n_left != NULL) { n->n_left = NULL; }
   if (n->n_right != NULL) { n->n_right = NULL; }
   n->n_balance = 0;
-  if (n->n_key != NULL) { free(n->n_key); n->n_key = NULL; }
 #if 1 
   if (n->n_data != NULL && d_free != NULL) { 
     //free(n->n_data); 
@@ -759,7 +998,12 @@ void free_node_avltree(struct avl_node *n, void (*d_free)(void *))
     n->n_data = NULL; 
   }
 #endif
-  if (n != NULL) { free(n); n = NULL; }
+  if (n->n_flags & AVL_NODE_ARENA) {
+    /* space is recovered when the tree goes */
+    return;
+  }
+  if (n->n_key != NULL) { free_string_memory_katcp(KATCP_MEMORY_AVLTREE, n->n_key); n->n_key = NULL; }
+  if (n != NULL) { free_memory_katcp(KATCP_MEMORY_AVLTREE, n, sizeof(struct avl_node)); n = NULL; }
 }
   
 int del_node_avltree(struct avl_tree *t, struct avl_node *n, void (*d_free)(void*))
@@ -1087,7 +1331,6 @@ void destroy_avltree(struct avl_tree *t, void (*d_free)(void *))
             c->n_right = NULL;
         } 
 
-        if (dn->n_key) { free(dn->n_key); dn->n_key = NULL; }
 #if 1
         if (dn->n_data && d_free) { 
           //free(dn->n_data); 
@@ -1097,7 +1340,10 @@ void destroy_avltree(struct avl_tree *t, void (*d_free)(void *))
 #endif
         dn->n_parent = NULL;
 
-        free(dn);
+        if ((dn->n_flags & AVL_NODE_ARENA) == 0){
+          if (dn->n_key) { free_string_memory_katcp(KATCP_MEMORY_AVLTREE, dn->n_key); dn->n_key = NULL; }
+          free_memory_katcp(KATCP_MEMORY_AVLTREE, dn, sizeof(struct avl_node));
+        }
 
 #if DEBUG >1
         fprintf(stderr,"avl_tree: done\n");
@@ -1107,8 +1353,12 @@ void destroy_avltree(struct avl_tree *t, void (*d_free)(void *))
     }
   }
 
-  if (t != NULL)
-    free(t);
+  if (t->t_arena){
+    destroy_arena_avltree(t->t_arena);
+    t->t_arena = NULL;
+  }
+
+  free_memory_katcp(KATCP_MEMORY_AVLTREE, t, sizeof(struct avl_tree));
 }
 
 char *gen_id_avltree(char *prefix)
@@ -1149,7 +1399,10 @@ int store_named_node_avltree(struct avl_tree *t, char *key, void *data)
 {
   struct avl_node *n;
 
-  n = create_node_avltree(key, data);
+  if (t == NULL)
+    return -1;
+
+  n = make_node_avltree(t->t_arena, key, data);
   if (n == NULL)
     return -1;
 
@@ -20,8 +20,15 @@ extern "C" {
 #define WALK_PUSH       1
 #define WALK_POP        2
 
+#define AVL_NODE_ARENA  0x1   /* node and key live in the arena of their tree */
+
+#define AVL_ARENA_CHUNK 16384 /* default arena growth, in bytes */
+
+struct avl_arena;
+
 struct avl_tree {
   struct avl_node *t_root;
+  struct avl_arena *t_arena; /* optional: nodes, keys and caller data, released in one go */
 };
 
 struct avl_node {
@@ -29,12 +36,20 @@ struct avl_node {
   struct avl_node *n_left;
   struct avl_node *n_right;
   int n_balance;
+  unsigned int n_flags;
   
   char *n_key;
   
   void *n_data;
 };
 
+/*ordered scan, optionally restricted to keys starting with a prefix*/
+struct avl_iterator {
+  struct avl_node *i_next;
+  char *i_prefix;
+  unsigned int i_length;
+};
+
 /*this can be used as a set of nodes*/
 struct avl_node_list {
   struct avl_node **l_n;
@@ -42,6 +57,8 @@ struct avl_node_list {
 };
 
 struct avl_tree *create_avltree();
+struct avl_tree *create_arena_avltree(unsigned int chunk);
+void *alloc_arena_avltree(struct avl_tree *t, unsigned int size);
 struct avl_node *create_node_avltree(char *key, void *data);
 int add_node_avltree(struct avl_tree *t, struct avl_node *n);
 int del_node_avltree(struct avl_tree *t, struct avl_node *n, void (*d_free)(void *));
@@ -54,6 +71,14 @@ void destroy_avltree(struct avl_tree *t, void (*d_free)(void *));
 struct avl_node *walk_inorder_avltree(struct avl_node *n);
 void *walk_data_inorder_avltree(struct avl_node *n);
 
+struct avl_node *first_avltree(struct avl_tree *t);
+struct avl_node *next_avltree(struct avl_node *n);
+struct avl_node *lower_bound_avltree(struct avl_tree *t, char *key);
+
+void start_iterator_avltree(struct avl_tree *t, struct avl_iterator *it, char *prefix);
+struct avl_node *next_iterator_avltree(struct avl_iterator *it);
+int collect_prefix_avltree(struct avl_tree *t, char *prefix, struct avl_node **vector, unsigned int size);
+
 /*node api*/
 
 char *get_node_name_avltree(struct avl_node *n);
@@ -0,0 +1,640 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* microbenchmarks for the hot paths of the library, built by
+ * make -f Makefile.test bench. Inputs come from a fixed seed so runs
+ * are comparable, each line reports time and heap calls per operation.
+ * Optional arguments select benchmarks by name prefix */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "katcp.h"
+#include "katcl.h"
+#include "katpriv.h"
+#include "avltree.h"
+
+#define BENCH_INPUT   (48 * 1024) /* rendered wire data parsed per pass, fits the receive buffer */
+#define BENCH_BATCH           32  /* messages queued before a write */
+#define BENCH_DEPTH           64  /* queue depth for push pop runs */
+
+/* count heap calls by interposing on the libc allocator ****************/
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long bench_allocs = 0;
+
+void *malloc(size_t size)
+{
+  bench_allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+  bench_allocs++;
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  bench_allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+/* timing and reporting *************************************************/
+
+static struct timespec bench_began;
+static unsigned long bench_allocs_began;
+
+static unsigned int bench_seed = 1;
+
+static unsigned int random_bench(void)
+{
+  /* own generator, so that inputs don't depend on the libc */
+  bench_seed = (bench_seed * 1103515245) + 12345;
+  return (bench_seed >> 16) & 0x7fff;
+}
+
+static void begin_bench(void)
+{
+  bench_allocs_began = bench_allocs;
+  clock_gettime(CLOCK_MONOTONIC, &bench_began);
+}
+
+static void end_bench(char *name, unsigned int size, unsigned long ops)
+{
+  struct timespec now;
+  unsigned long allocs;
+  double ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  allocs = bench_allocs - bench_allocs_began;
+
+  ns = ((now.tv_sec - bench_began.tv_sec) * 1000000000.0) + (now.tv_nsec - bench_began.tv_nsec);
+
+  if(ops == 0){
+    ops = 1;
+  }
+
+  printf("%-24s %8u %10lu %12.1f %10.3f\n", name, size, ops, ns / ops, (double)allocs / ops);
+  fflush(stdout);
+}
+
+static int nonblock_bench(int fd)
+{
+  int flags;
+
+  flags = fcntl(fd, F_GETFL, 0);
+  if(flags < 0){
+    return -1;
+  }
+
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void drain_bench(int fd)
+{
+  char buffer[4096];
+
+  while(read(fd, buffer, sizeof(buffer)) > 0);
+}
+
+/* parse_katcl **********************************************************/
+
+static void fill_text_bench(struct katcl_line *l)
+{
+  append_string_katcl(l, KATCP_FLAG_FIRST, "#sensor-status");
+  append_unsigned_long_katcl(l, 0, 1300000000UL + random_bench());
+  append_string_katcl(l, 0, "1");
+  append_string_katcl(l, 0, "raw.temp.ambient");
+  append_string_katcl(l, 0, "nominal");
+  append_unsigned_long_katcl(l, KATCP_FLAG_LAST, random_bench());
+}
+
+static void fill_binary_bench(struct katcl_line *l)
+{
+  unsigned char buffer[256];
+  unsigned int i;
+
+  for(i = 0; i < sizeof(buffer); i++){
+    buffer[i] = random_bench() & 0xff;
+  }
+
+  append_string_katcl(l, KATCP_FLAG_FIRST, "!read");
+  append_string_katcl(l, 0, "ok");
+  append_buffer_katcl(l, KATCP_FLAG_LAST, buffer, sizeof(buffer));
+}
+
+/* let a line render messages to the wire format, as a peer would send them */
+
+static int render_bench(char *buffer, unsigned int size, int binary, void (*fill)(struct katcl_line *l), unsigned int *messages)
+{
+  struct katcl_line *l;
+  int fds[2], rr;
+  unsigned int have;
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0){
+    return -1;
+  }
+
+  l = create_katcl(fds[0]);
+  if(l == NULL){
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  binary_katcl(l, binary);
+
+  have = 0;
+  *messages = 0;
+
+  while(have < size - 4096){
+    (*fill)(l);
+    (*messages)++;
+    while(flushing_katcl(l)){
+      if(write_katcl(l) < 0){
+        break;
+      }
+    }
+    rr = read(fds[1], buffer + have, size - have);
+    if(rr <= 0){
+      break;
+    }
+    have += rr;
+  }
+
+  destroy_katcl(l, 1);
+  close(fds[1]);
+
+  return have;
+}
+
+static int parse_bench(char *name, unsigned int passes, int binary)
+{
+  struct katcl_line *l;
+  char *input;
+  unsigned int i, messages, total;
+  int fds[2], len;
+
+  input = malloc(KATCL_INPUT_SIZE);
+  if(input == NULL){
+    return -1;
+  }
+
+  len = render_bench(input, BENCH_INPUT, binary, binary ? &fill_binary_bench : &fill_text_bench, &messages);
+  if(len <= 0){
+    free(input);
+    return -1;
+  }
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0){
+    free(input);
+    return -1;
+  }
+
+  l = create_katcl(fds[0]);
+  if(l == NULL){
+    free(input);
+    return -1;
+  }
+
+  binary_katcl(l, binary);
+
+  /* one read on an empty socket allocates the receive buffer */
+  nonblock_bench(fds[0]);
+  read_katcl(l);
+
+  total = 0;
+
+  begin_bench();
+
+  for(i = 0; i < passes; i++){
+    memcpy(l->l_input, input, len);
+    l->l_ihead = 0;
+    l->l_itail = len;
+
+    while(have_katcl(l) > 0){
+      total++;
+    }
+  }
+
+  end_bench(name, len, total);
+
+  if(total != (passes * messages)){
+    fprintf(stderr, "%s: parsed %u messages, expected %u\n", name, total, passes * messages);
+  }
+
+  destroy_katcl(l, 1);
+  close(fds[1]);
+  free(input);
+
+  return 0;
+}
+
+static int parse_text_bench(char *name, unsigned int size)
+{
+  return parse_bench(name, size, 0);
+}
+
+static int parse_binary_bench(char *name, unsigned int size)
+{
+  return parse_bench(name, size, 1);
+}
+
+/* write_katcl **********************************************************/
+
+static int write_bench(char *name, unsigned int size)
+{
+  struct katcl_line *l;
+  unsigned int i;
+  int fds[2];
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0){
+    return -1;
+  }
+
+  nonblock_bench(fds[0]);
+  nonblock_bench(fds[1]);
+
+  l = create_katcl(fds[0]);
+  if(l == NULL){
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  begin_bench();
+
+  for(i = 0; i < size; i++){
+    fill_text_bench(l);
+    if((i % BENCH_BATCH) == (BENCH_BATCH - 1)){
+      while(flushing_katcl(l)){
+        if(write_katcl(l) < 0){
+          break;
+        }
+        drain_bench(fds[1]);
+      }
+    }
+  }
+
+  while(flushing_katcl(l)){
+    if(write_katcl(l) < 0){
+      break;
+    }
+    drain_bench(fds[1]);
+  }
+
+  end_bench(name, BENCH_BATCH, size);
+
+  destroy_katcl(l, 1);
+  close(fds[1]);
+
+  return 0;
+}
+
+/* queue and gueue ******************************************************/
+
+static int queue_bench(char *name, unsigned int size)
+{
+  struct katcl_queue *q;
+  struct katcl_parse *p, *px;
+  unsigned int i, j;
+
+  q = create_queue_katcl();
+  p = create_referenced_parse_katcl(); /* ours, so the pops don't release it */
+  if((q == NULL) || (p == NULL)){
+    return -1;
+  }
+
+  add_string_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_LAST, "#bench");
+
+  begin_bench();
+
+  for(i = 0; i < size; i++){
+    for(j = 0; j < BENCH_DEPTH; j++){
+      add_tail_queue_katcl(q, p);
+    }
+    for(j = 0; j < BENCH_DEPTH; j++){
+      px = remove_head_queue_katcl(q);
+      destroy_parse_katcl(px);
+    }
+  }
+
+  end_bench(name, BENCH_DEPTH, size * BENCH_DEPTH);
+
+  destroy_parse_katcl(p);
+  destroy_queue_katcl(q);
+
+  return 0;
+}
+
+static int gueue_bench(char *name, unsigned int size)
+{
+  struct katcl_gueue *g;
+  unsigned int i, j;
+  int items[BENCH_DEPTH];
+
+  g = create_gueue_katcl(NULL);
+  if(g == NULL){
+    return -1;
+  }
+
+  begin_bench();
+
+  for(i = 0; i < size; i++){
+    for(j = 0; j < BENCH_DEPTH; j++){
+      add_tail_gueue_katcl(g, &(items[j]));
+    }
+    for(j = 0; j < BENCH_DEPTH; j++){
+      remove_head_gueue_katcl(g);
+    }
+  }
+
+  end_bench(name, BENCH_DEPTH, size * BENCH_DEPTH);
+
+  destroy_gueue_katcl(g);
+
+  return 0;
+}
+
+/* avltree **************************************************************/
+
+static char **keys_bench(unsigned int size)
+{
+  char **keys, *tmp;
+  unsigned int i, j;
+
+  keys = malloc(sizeof(char *) * size);
+  if(keys == NULL){
+    return NULL;
+  }
+
+  for(i = 0; i < size; i++){
+    keys[i] = malloc(16);
+    if(keys[i] == NULL){
+      return NULL;
+    }
+    snprintf(keys[i], 16, "bench.%08x", i);
+  }
+
+  /* insertion in random order */
+  for(i = size; i > 1; i--){
+    j = ((random_bench() << 15) | random_bench()) % i;
+    tmp = keys[i - 1];
+    keys[i - 1] = keys[j];
+    keys[j] = tmp;
+  }
+
+  return keys;
+}
+
+static int avl_bench(char *name, unsigned int size)
+{
+  struct avl_tree *t;
+  char **keys, label[32];
+  unsigned int i, found;
+
+  keys = keys_bench(size);
+  if(keys == NULL){
+    return -1;
+  }
+
+  t = create_avltree();
+  if(t == NULL){
+    return -1;
+  }
+
+  snprintf(label, sizeof(label), "%s-insert", name);
+  begin_bench();
+  for(i = 0; i < size; i++){
+    store_named_node_avltree(t, keys[i], keys[i]);
+  }
+  end_bench(label, size, size);
+
+  found = 0;
+  snprintf(label, sizeof(label), "%s-find", name);
+  begin_bench();
+  for(i = 0; i < size; i++){
+    if(find_data_avltree(t, keys[(i * 7919) % size])){
+      found++;
+    }
+  }
+  end_bench(label, size, size);
+
+  if(found != size){
+    fprintf(stderr, "%s: found %u of %u keys\n", name, found, size);
+  }
+
+  snprintf(label, sizeof(label), "%s-delete", name);
+  begin_bench();
+  for(i = 0; i < size; i++){
+    del_name_node_avltree(t, keys[size - i - 1], NULL);
+  }
+  end_bench(label, size, size);
+
+  destroy_avltree(t, NULL);
+
+  for(i = 0; i < size; i++){
+    free(keys[i]);
+  }
+  free(keys);
+
+  return 0;
+}
+
+/* run_timers_katcp *****************************************************/
+
+static int count_timer_bench(struct katcp_dispatch *d, void *data)
+{
+  unsigned int *slot;
+
+  slot = data;
+  (*slot)++;
+
+  return 0;
+}
+
+static int timer_bench(char *name, unsigned int size)
+{
+  struct katcp_dispatch *d;
+  struct timespec interval;
+  struct timeval tv;
+  unsigned int *slots, i, rounds, total, expected;
+
+  d = startup_katcp();
+  slots = malloc(sizeof(unsigned int) * size);
+  if((d == NULL) || (slots == NULL)){
+    return -1;
+  }
+
+  memset(slots, 0, sizeof(unsigned int) * size);
+
+  rounds = (size < 100000) ? (100000 / size) : 1;
+  expected = rounds * size;
+
+  begin_bench();
+
+  for(i = 0; i < expected; i++){
+    /* spread deadlines a little, so the heap has some work to do */
+    tv.tv_sec = 0;
+    tv.tv_usec = random_bench() % 8;
+    register_in_tv_katcp(d, &tv, &count_timer_bench, &(slots[i % size]));
+    if((i % size) == (size - 1)){
+      usleep(10);
+      while(run_timers_katcp(d, &interval) == 0);
+    }
+  }
+
+  end_bench(name, size, expected);
+
+  total = 0;
+  for(i = 0; i < size; i++){
+    total += slots[i];
+  }
+  if(total != expected){
+    fprintf(stderr, "%s: %u of %u timers fired\n", name, total, expected);
+  }
+
+  shutdown_katcp(d);
+  free(slots);
+
+  return 0;
+}
+
+/* sensor propagation ***************************************************/
+
+static int extract_bench(struct katcp_dispatch *d, struct katcp_sensor *sn)
+{
+  struct katcp_integer_acquire *ia;
+  struct katcp_integer_sensor *is;
+
+  is = sn->s_more;
+  ia = sn->s_acquire->a_more;
+
+  is->is_current = ia->ia_current;
+  set_status_sensor_katcp(sn, KATCP_STATUS_NOMINAL);
+
+  return 0;
+}
+
+static int sensor_bench(char *name, unsigned int size)
+{
+  struct katcp_dispatch *d;
+  struct katcp_acquire *a;
+  char label[32];
+  unsigned int i, updates;
+
+  d = startup_katcp();
+  if(d == NULL){
+    return -1;
+  }
+
+  a = setup_integer_acquire_katcp(d, NULL, NULL, NULL);
+  if(a == NULL){
+    return -1;
+  }
+
+  for(i = 0; i < size; i++){
+    snprintf(label, sizeof(label), "bench.sensor.%u", i);
+    if(register_multi_integer_sensor_katcp(d, 0, label, "benchmark sensor", "none", INT_MIN, INT_MAX, a, &extract_bench, NULL) < 0){
+      fprintf(stderr, "%s: unable to register sensor %s\n", name, label);
+      return -1;
+    }
+  }
+
+  updates = 1000000 / size;
+
+  begin_bench();
+
+  for(i = 0; i < updates; i++){
+    set_integer_acquire_katcp(d, a, i);
+  }
+
+  end_bench(name, size, updates);
+
+  shutdown_katcp(d);
+
+  return 0;
+}
+
+/**********************************************************************/
+
+struct bench_case
+{
+  char *c_name;
+  int (*c_run)(char *name, unsigned int size);
+  unsigned int c_size;
+};
+
+static struct bench_case cases_bench[] = {
+  { "parse-text",     &parse_text_bench,    200 },
+  { "parse-binary",   &parse_binary_bench,  200 },
+  { "write",          &write_bench,      200000 },
+  { "queue",          &queue_bench,       20000 },
+  { "gueue",          &gueue_bench,       20000 },
+  { "avl",            &avl_bench,          1000 },
+  { "avl",            &avl_bench,         10000 },
+  { "avl",            &avl_bench,        100000 },
+  { "avl",            &avl_bench,       1000000 },
+  { "timers",         &timer_bench,        1000 },
+  { "timers",         &timer_bench,      100000 },
+  { "sensor-fanout",  &sensor_bench,          1 },
+  { "sensor-fanout",  &sensor_bench,         16 },
+  { "sensor-fanout",  &sensor_bench,        256 },
+  { NULL, NULL, 0 }
+};
+
+static int selected_bench(char *name, int argc, char **argv)
+{
+  int i;
+
+  if(argc <= 1){
+    return 1;
+  }
+
+  for(i = 1; i < argc; i++){
+    if(strncmp(name, argv[i], strlen(argv[i])) == 0){
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct bench_case *c;
+  int result;
+
+  result = 0;
+
+  printf("%-24s %8s %10s %12s %10s\n", "benchmark", "size", "ops", "ns/op", "allocs/op");
+
+  for(c = cases_bench; c->c_name; c++){
+    if(!selected_bench(c->c_name, argc, argv)){
+      continue;
+    }
+
+    bench_seed = 1;
+
+    if((*(c->c_run))(c->c_name, c->c_size) < 0){
+      fprintf(stderr, "%s: unable to run benchmark\n", c->c_name);
+      result = 1;
+    }
+  }
+
+  return result;
+}
@@ -188,18 +188,16 @@ void print_dict_type_katcp(struct katcp_dispatch *d, char *key, void *data)
   fprintf(stderr, "dict: <%s>\n", dt->d_key);
 #endif
   
-  while ((n = walk_inorder_avltree(dt->d_avl->t_root)) != NULL){
-    
-    if (n != NULL){
-      
-      to = n->n_data;
-      if (to != NULL && to->o_type != NULL && to->o_type->t_print != NULL){
-        append_string_katcp(d, KATCP_FLAG_FIRST  | KATCP_FLAG_STRING, "#key:");
-        append_args_katcp  (d, KATCP_FLAG_STRING | KATCP_FLAG_LAST , "%s", n->n_key);
+  /* print callbacks may walk trees of their own, so no static walk state here */
+  for (n = first_avltree(dt->d_avl); n != NULL; n = next_avltree(n)){
       
-        (*(to->o_type->t_print))(d, n->n_key, to->o_data);
+    to = n->n_data;
+    if (to != NULL && to->o_type != NULL && to->o_type->t_print != NULL){
+      append_string_katcp(d, KATCP_FLAG_FIRST  | KATCP_FLAG_STRING, "#key:");
+      append_args_katcp  (d, KATCP_FLAG_STRING | KATCP_FLAG_LAST , "%s", n->n_key);
+    
+      (*(to->o_type->t_print))(d, n->n_key, to->o_data);
 
-      }
     }
   }
 
@@ -466,6 +464,8 @@ void destroy_dbase_type_katcp(void *data)
       free(db->d_key);
     if (db->d_schema)
       free(db->d_schema);
+    if (db->d_tags)
+      free(db->d_tags);
     free(db);
   }
 }
@@ -486,6 +486,13 @@ struct katcp_dbase *create_dbase_type_katcp(char *key, char *schema_key, struct
     return NULL;
   
   db = malloc(sizeof(struct katcp_dbase));
+  if (db == NULL)
+    return NULL;
+
+  db->d_values    = NULL;
+  db->d_schema    = NULL;
+  db->d_tags      = NULL;
+  db->d_tag_count = 0;
   
   db->d_key   = strdup(key);
   if (db->d_key == NULL){
@@ -574,40 +581,118 @@ int store_dbase_katcp(struct katcp_dispatch *d, char **params)
 
 
 
+static int has_tag_dbase_katcp(struct katcp_dbase *db, struct katcp_tag *t)
+{
+  unsigned int i;
+
+  for (i=0; i<db->d_tag_count; i++){
+    if (db->d_tags[i] == t)
+      return 1;
+  }
+
+  return 0;
+}
+
 int tag_dbase_katcp(struct katcp_dispatch *d, struct katcp_dbase *db, struct katcp_stack *tags)
 {
-  struct katcp_tag *t;
+  struct katcp_tag *t, **vector;
   struct katcp_type *tagtype, *dbtype;
+  unsigned int i, j, count;
   
   if (db == NULL )//|| tags == NULL)
     return -1;
 
-  if (tags == NULL){
-#ifdef DEBUG
-    fprintf(stderr, "dbase: tags are null skipping\n");
-#endif
-    return 0;
-  }
-
   tagtype = find_name_type_katcp(d, KATCP_TYPE_TAG);
   dbtype  = find_name_type_katcp(d, KATCP_TYPE_DBASE); 
   
   if (tagtype == NULL || dbtype == NULL)
     return -1;
 
-  while ((t = pop_data_type_stack_katcp(tags, tagtype)) != NULL){
-    
-    if (tag_data_katcp(d, t, db, dbtype) < 0){
+  /* an entry has the tags of its latest set, the sets of the tags are kept to match */
+
+  vector = NULL;
+  count = 0;
+
+  if (tags != NULL && sizeof_stack_katcp(tags) > 0){
+    vector = malloc(sizeof(struct katcp_tag *) * sizeof_stack_katcp(tags));
+    if (vector == NULL)
+      return -1;
+
+    while ((t = pop_data_type_stack_katcp(tags, tagtype)) != NULL){
+      for (j=0; j<count && vector[j] != t; j++);
+      if (j >= count){
+        vector[count] = t;
+        count++;
+      }
+    }
+  }
+
+  for (i=0; i<db->d_tag_count; i++){
+    for (j=0; j<count && vector[j] != db->d_tags[i]; j++);
+    if (j >= count)
+      untag_data_katcp(db->d_tags[i], db);
+  }
+
+  for (i=0, j=0; i<count; i++){
+    t = vector[i];
+    if (has_tag_dbase_katcp(db, t) || (tag_data_katcp(d, t, db, dbtype) == 0)){
+      vector[j] = t;
+      j++;
+    } else {
 #if DEBUG > 1
       fprintf(stderr, "dbase: cannot tag db:<%s> with <%s>\n", db->d_key, t->t_name);
 #endif
     }
-
   }
 
+  if (db->d_tags)
+    free(db->d_tags);
+
+  db->d_tags = vector;
+  db->d_tag_count = j;
+
   return 0;
 }
 
+static struct katcp_tag *schema_index_dbase_katcp(struct katcp_dispatch *d, char *schema, int create)
+{
+  struct katcp_type *st;
+
+  /* entries by schema, a set just like the one of a tag */
+
+  if (schema == NULL)
+    return NULL;
+
+  st = find_name_type_katcp(d, KATCP_TYPE_SCHEMA);
+  if (st == NULL)
+    return NULL;
+
+  return search_type_katcp(d, st, schema, create ? create_tag_katcp(schema, 0) : NULL);
+}
+
+static int enter_schema_dbase_katcp(struct katcp_dispatch *d, struct katcp_dbase *db)
+{
+  struct katcp_tag *t;
+
+  if (db->d_schema == NULL)
+    return 0;
+
+  t = schema_index_dbase_katcp(d, db->d_schema, 1);
+  if (t == NULL)
+    return -1;
+
+  return tag_data_katcp(d, t, db, find_name_type_katcp(d, KATCP_TYPE_DBASE));
+}
+
+static void leave_schema_dbase_katcp(struct katcp_dispatch *d, struct katcp_dbase *db)
+{
+  struct katcp_tag *t;
+
+  t = schema_index_dbase_katcp(d, db->d_schema, 0);
+  if (t != NULL)
+    untag_data_katcp(t, db);
+}
+
 int store_kv_dbase_katcp(struct katcp_dispatch *d, char *key, char *schema, struct katcp_stack *values, struct katcp_stack *tags)
 {
   struct katcp_dbase *db;
@@ -622,6 +707,9 @@ int store_kv_dbase_katcp(struct katcp_dispatch *d, char *key, char *schema, stru
   if (store_data_type_katcp(d, KATCP_TYPE_DBASE, KATCP_DEP_BASE, key, db, &print_dbase_type_katcp, &destroy_dbase_type_katcp, NULL, NULL, &parse_dbase_type_katcp, &getkey_dbase_type_katcp) < 0)
     return -1;
 
+  if (enter_schema_dbase_katcp(d, db) < 0)
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to index %s by schema %s", key, schema);
+
   return tag_dbase_katcp(d, db, tags);
 }
 
@@ -631,6 +719,8 @@ int replace_dbase_values_katcp(struct katcp_dispatch *d, struct katcp_dbase *db,
     return -1;
   
   destroy_stack_katcp(db->d_values);
+
+  leave_schema_dbase_katcp(d, db);
   if (db->d_schema)
     free(db->d_schema);
 
@@ -641,6 +731,9 @@ int replace_dbase_values_katcp(struct katcp_dispatch *d, struct katcp_dbase *db,
   
   db->d_values = values;
 
+  if (enter_schema_dbase_katcp(d, db) < 0)
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to index %s by schema %s", db->d_key, schema);
+
   stamp_dbase_type_katcp(db);
   
   return tag_dbase_katcp(d, db, tags);
@@ -749,6 +842,11 @@ int set_dbase_katcp(struct katcp_dispatch *d, struct katcl_parse *p)
 
   destroy_stack_katcp(tags);
 
+  db = search_named_type_katcp(d, KATCP_TYPE_DBASE, key, NULL);
+  if (db != NULL && append_journal_dbase_katcp(d, p, &(db->d_stamped)) < 0){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "%s stored but not persisted", key);
+  }
+
   return 0;
 #undef STATE_PRE
 #undef STATE_SCHEMA
@@ -770,6 +868,9 @@ struct katcl_parse *get_dbase_katcp(struct katcp_dispatch *d, struct katcl_parse
   key = get_string_parse_katcl(p, 1);
   if (key == NULL)
     return NULL;
+
+  if (fault_dbase_katcp(d, key) < 0)
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to restore %s from journal", key);
   
   db = search_named_type_katcp(d, KATCP_TYPE_DBASE, key, NULL);
   if (db == NULL) 
@@ -895,6 +996,58 @@ int set_dbase_cmd_katcp(struct katcp_dispatch *d, int argc)
   return KATCP_RESULT_OK;
 }
 
+int del_dbase_katcp(struct katcp_dispatch *d, char *key)
+{
+  struct katcp_dbase *db;
+  unsigned int i;
+
+  if (key == NULL)
+    return -1;
+
+  fault_dbase_katcp(d, key);
+
+  db = search_named_type_katcp(d, KATCP_TYPE_DBASE, key, NULL);
+  if (db == NULL)
+    return -1;
+
+  /* out of the indices before the entry goes */
+  leave_schema_dbase_katcp(d, db);
+  for (i=0; i<db->d_tag_count; i++){
+    untag_data_katcp(db->d_tags[i], db);
+  }
+  db->d_tag_count = 0;
+
+  return del_data_type_katcp(d, KATCP_TYPE_DBASE, key);
+}
+
+int delete_dbase_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcl_parse *p;
+  struct timeval now;
+  char *key;
+
+  if (argc != 2){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "usage");
+    return KATCP_RESULT_FAIL;
+  }
+
+  p = arg_parse_katcp(d);
+  key = arg_string_katcp(d, 1);
+  if (p == NULL || key == NULL)
+    return KATCP_RESULT_FAIL;
+
+  if (del_dbase_katcp(d, key) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no entry %s in database", key);
+    return KATCP_RESULT_FAIL;
+  }
+
+  gettimeofday(&now, NULL);
+  if (append_journal_dbase_katcp(d, p, &now) < 0)
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "%s deleted but not persisted", key);
+
+  return KATCP_RESULT_OK;
+}
+
 int dict_cmd_katcp(struct katcp_dispatch *d, int argc)
 {
   struct katcl_parse *p;
@@ -1100,6 +1253,30 @@ int tag_data_katcp(struct katcp_dispatch *d, struct katcp_tag *t, void *data, st
   return 0;
 }
 
+int untag_data_katcp(struct katcp_tag *t, void *data)
+{
+  struct katcp_tobject key, *to;
+  void *val;
+
+  if (t == NULL)
+    return -1;
+
+  key.o_data = data;
+
+  val = tfind((void *) &key, &(t->t_tobject_root), &compare_tobject_katcp);
+  if (val == NULL)
+    return -1;
+
+  to = *(struct katcp_tobject **) val;
+
+  tdelete((void *) &key, &(t->t_tobject_root), &compare_tobject_katcp);
+  destroy_tobject_katcp(to);
+
+  t->t_tobject_count--;
+
+  return 0;
+}
+
 static struct katcp_tobject **__tobjs;
 static int __tcount;
 
@@ -1139,6 +1316,9 @@ int search_katcp(struct katcp_dispatch *d, struct katcl_parse *p)
   t = NULL;
 
   gettimeofday(&ts, NULL);
+
+  /* tags are only known once an entry is loaded */
+  fault_all_dbase_katcp(d);
   
   count = get_count_parse_katcl(p);
   tagtype = find_name_type_katcp(d, KATCP_TYPE_TAG);
@@ -1366,4 +1546,112 @@ int search_cmd_katcp(struct katcp_dispatch *d, int argc)
   return KATCP_RESULT_OK;
 }
 
+int query_dbase_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+#define QUERY_TAG     "tag="
+#define QUERY_SCHEMA  "schema="
+  struct katcp_tag **want, *t, *smallest;
+  struct katcp_tobject *to;
+  struct katcp_type *dbtype;
+  struct katcp_dbase *db;
+  char *arg, *schema;
+  int i, j, count, total, match;
 
+  /* walk only the smallest of the sets named, check the rest against each entry */
+
+  if (argc < 2){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "usage");
+    return KATCP_RESULT_FAIL;
+  }
+
+  fault_all_dbase_katcp(d);
+
+  dbtype = find_name_type_katcp(d, KATCP_TYPE_DBASE);
+  if (dbtype == NULL)
+    return KATCP_RESULT_FAIL;
+
+  want = malloc(sizeof(struct katcp_tag *) * argc);
+  if (want == NULL)
+    return KATCP_RESULT_FAIL;
+
+  count    = 0;
+  schema   = NULL;
+  smallest = NULL;
+  match    = 1;
+
+  for (i=1; i<argc; i++){
+    arg = arg_string_katcp(d, i);
+    if (arg == NULL){
+      free(want);
+      return KATCP_RESULT_FAIL;
+    }
+
+    if (strncmp(arg, QUERY_TAG, strlen(QUERY_TAG)) == 0){
+      t = get_key_data_type_katcp(d, KATCP_TYPE_TAG, arg + strlen(QUERY_TAG));
+      if (t != NULL){
+        want[count] = t;
+        count++;
+      }
+    } else if ((strncmp(arg, QUERY_SCHEMA, strlen(QUERY_SCHEMA)) == 0) && (schema == NULL)){
+      schema = arg + strlen(QUERY_SCHEMA);
+      t = schema_index_dbase_katcp(d, schema, 0);
+    } else {
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to use query term %s, expected %s... or a single %s...", arg, QUERY_TAG, QUERY_SCHEMA);
+      free(want);
+      return KATCP_RESULT_FAIL;
+    }
+
+    if (t == NULL){
+      /* an unknown tag or schema has no entries */
+      match = 0;
+    } else if (smallest == NULL || get_count_tag_katcp(t) < get_count_tag_katcp(smallest)){
+      smallest = t;
+    }
+  }
+
+  total = 0;
+
+  if (match && smallest != NULL && get_count_tag_katcp(smallest) > 0){
+    __tobjs = malloc(sizeof(struct katcp_tobject *) * get_count_tag_katcp(smallest));
+    __tcount = 0;
+
+    if (__tobjs == NULL){
+      free(want);
+      return KATCP_RESULT_FAIL;
+    }
+
+    twalk(smallest->t_tobject_root, &__collect_from_tag);
+
+    for (i=0; i<__tcount; i++){
+      to = __tobjs[i];
+      if (to->o_type != dbtype)
+        continue;
+
+      db = to->o_data;
+
+      if (schema != NULL && (db->d_schema == NULL || strcmp(db->d_schema, schema) != 0))
+        continue;
+
+      for (j=0; j<count && has_tag_dbase_katcp(db, want[j]); j++);
+      if (j < count)
+        continue;
+
+      print_dbase_type_katcp(d, db->d_key, db);
+      total++;
+    }
+
+    free(__tobjs);
+    __tobjs  = NULL;
+    __tcount = 0;
+  }
+
+  free(want);
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, total);
+
+  return KATCP_RESULT_OWN;
+#undef QUERY_TAG
+#undef QUERY_SCHEMA
+}
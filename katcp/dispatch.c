@@ -31,10 +31,17 @@ int help_cmd_katcp(struct katcp_dispatch *d, int argc);
 int halt_cmd_katcp(struct katcp_dispatch *d, int argc);
 int restart_cmd_katcp(struct katcp_dispatch *d, int argc);
 int log_level_cmd_katcp(struct katcp_dispatch *d, int argc);
+int log_ring_cmd_katcp(struct katcp_dispatch *d, int argc);
+#ifdef KATCP_TRACE
+int trace_cmd_katcp(struct katcp_dispatch *d, int argc);
+#endif
+int log_flood_cmd_katcp(struct katcp_dispatch *d, int argc);
 int log_default_cmd_katcp(struct katcp_dispatch *d, int argc);
 int log_local_cmd_katcp(struct katcp_dispatch *d, int argc);
 int log_record_cmd_katcp(struct katcp_dispatch *d, int argc);
 int watchdog_cmd_katcp(struct katcp_dispatch *d, int argc);
+int binary_encoding_cmd_katcp(struct katcp_dispatch *d, int argc);
+int command_stats_cmd_katcp(struct katcp_dispatch *d, int argc);
 
 /************ paranoia checks ***********************************/
 
@@ -74,11 +81,14 @@ static struct katcp_dispatch *setup_internal_katcp(int fd)
   d->d_line = create_katcl(fd);
 
   d->d_current = NULL;
+  d->d_stats = NULL;
   d->d_ready = 0;
 
   d->d_run = 1;
   d->d_exit = KATCP_EXIT_ABORT;
   d->d_pause = 0;
+  d->d_wake = 1;
+  d->d_visit = 0;
 
   d->d_level = KATCP_LEVEL_INFO;
 
@@ -94,6 +104,12 @@ static struct katcp_dispatch *setup_internal_katcp(int fd)
   d->d_notices = NULL;
   d->d_count = 0;
 
+  d->d_held = NULL;
+  d->d_holding = 0;
+  d->d_hold_limit = KATCP_HOLD_LIMIT;
+  d->d_active = NULL;
+  d->d_full = 0;
+
   d->d_end = NULL;
 
   d->d_clone = (-1);
@@ -136,11 +152,20 @@ struct katcp_dispatch *setup_katcp(int fd)
   register_katcp(d, "?log-limit",         "sets the minimum reported log priority for the current connection (?log-local [priority])", &log_local_cmd_katcp);
   register_katcp(d, "?log-default",       "sets the minimum reported log priority for all new connections (?log-default [priority])", &log_default_cmd_katcp);
   register_katcp(d, "?log-record",        "generate a log entry (?log-record [priority] message)", &log_record_cmd_katcp);
+  register_katcp(d, "?log-flood",         "display or set the rate at which a single log statement may emit messages (?log-flood [rate [burst]])", &log_flood_cmd_katcp);
+  register_katcp(d, "?log-ring",          "keep or display recent log messages regardless of connection levels (?log-ring [count [priority]])", &log_ring_cmd_katcp);
   register_katcp(d, "?watchdog",          "pings the system (?watchdog)", &watchdog_cmd_katcp);
+  register_katcp(d, "?binary-encoding",   "select encoding of binary arguments on this connection (?binary-encoding [length|none])", &binary_encoding_cmd_katcp);
+  register_katcp(d, "?command-stats",     "display request call counts and latencies (?command-stats [command])", &command_stats_cmd_katcp);
+#ifdef KATCP_TRACE
+  register_katcp(d, "?trace",             "record and report hot path trace points (?trace [on [size]|off|clear|dump [chrome|binary path]])", &trace_cmd_katcp);
+#endif
 
   register_katcp(d, "?sensor-list",       "lists available sensors (?sensor-list [sensor])", &sensor_list_cmd_katcp);
-  register_katcp(d, "?sensor-sampling",   "configure sensor (?sensor-sampling sensor [strategy [parameter]])", &sensor_sampling_cmd_katcp);
+  register_katcp(d, "?sensor-sampling",   "configure sensors (?sensor-sampling sensor[,sensor]*|/regex/ [strategy [parameter]*])", &sensor_sampling_cmd_katcp);
   register_katcp(d, "?sensor-value",      "query a sensor (?sensor-value sensor)", &sensor_value_cmd_katcp);
+  register_katcp(d, "?sensor-value-since", "query sensors changed after a sequence number (?sensor-value-since [sequence])", &sensor_value_since_cmd_katcp);
+  register_katcp(d, "?sensor-history",    "display recent changes of a sensor (?sensor-history sensor [start [end [count]]])", &sensor_history_cmd_katcp);
 
   register_katcp(d, "?sensor-limit",      "adjust sensor limits (?sensor-limit [sensor] [min|max] value)", &sensor_limit_cmd_katcp);
 
@@ -194,6 +219,7 @@ struct katcp_dispatch *clone_katcp(struct katcp_dispatch *cd)
   s = d->d_shared;
   if(s){
     d->d_level = s->s_default;
+    lower_log_floor_katcp(s, d->d_level);
   } else {
     d->d_level = cd->d_level;
   }
@@ -220,7 +246,7 @@ void shutdown_cmd_katcp(struct katcp_cmd *c)
 {
   if(c){
     if(c->c_name){
-      free(c->c_name);
+      release_name_katcm(c->c_name);
       c->c_name = NULL;
     }
 
@@ -241,6 +267,8 @@ void shutdown_katcp(struct katcp_dispatch *d)
 
   destroy_nonsensors_katcp(d);
 
+  release_held_katcp(d);
+
   disown_notices_katcp(d);
 
   shutdown_shared_katcp(d);
@@ -251,6 +279,7 @@ void shutdown_katcp(struct katcp_dispatch *d)
   }
 
   d->d_current = NULL;
+  d->d_stats = NULL;
 
   free(d);
 }
@@ -527,6 +556,238 @@ pid_t spawn_child_katcp(struct katcp_dispatch *d, char *name, int (*run)(void *d
  * sensors can happen over intervals, when values change, etc 
  */
 
+/* command index: named commands are also hashed into buckets, kept in
+ * the same relative order as the list so that the first match (latest
+ * registration) wins as before. Mode is checked while walking a bucket,
+ * there are only ever a few entries of the same name, so a mode change
+ * needs no rebuild. Wildcards keep their own chain, only tried on a miss
+ */
+
+#define KATCP_CMD_SLOTS 64 /* smallest table, always a power of two */
+
+static int index_commands_katcp(struct katcp_shared *s, unsigned int slots)
+{
+  struct katcp_cmd **table, **tail, *c;
+  unsigned int i, h;
+
+  table = malloc(sizeof(struct katcp_cmd *) * slots);
+  if(table == NULL){
+    return -1;
+  }
+
+  for(i = 0; i < slots; i++){
+    table[i] = NULL;
+  }
+
+  s->s_wild = NULL;
+  s->s_named = 0;
+
+  /* walk list in order, appending, so buckets preserve precedence */
+  for(c = s->s_commands; c; c = c->c_next){
+    if(c->c_flags & KATCP_CMD_WILDCARD){
+      tail = &(s->s_wild);
+    } else {
+      h = hash_interned_katcm(c->c_name) & (slots - 1);
+      tail = &(table[h]);
+      s->s_named++;
+    }
+    while(*tail){
+      tail = &((*tail)->c_hash);
+    }
+    c->c_hash = NULL;
+    *tail = c;
+  }
+
+  if(s->s_table){
+    free(s->s_table);
+  }
+
+  s->s_table = table;
+  s->s_slots = slots;
+
+  return 0;
+}
+
+static void insert_command_katcp(struct katcp_shared *s, struct katcp_cmd *c)
+{
+  struct katcp_cmd **tail;
+  unsigned int h;
+
+  if((s->s_table == NULL) || (s->s_named >= s->s_slots)){
+    if(index_commands_katcp(s, (s->s_slots > 0) ? (s->s_slots * 2) : KATCP_CMD_SLOTS) == 0){
+      return; /* rebuild included c */
+    }
+    if(s->s_table == NULL){
+      return; /* lookup falls back to the list */
+    }
+  }
+
+  if(c->c_flags & KATCP_CMD_WILDCARD){
+    tail = &(s->s_wild);
+    while(*tail){
+      tail = &((*tail)->c_hash);
+    }
+    c->c_hash = NULL;
+    *tail = c;
+  } else {
+    /* list prepends named commands, so do the same here */
+    h = hash_interned_katcm(c->c_name) & (s->s_slots - 1);
+    c->c_hash = s->s_table[h];
+    s->s_table[h] = c;
+    s->s_named++;
+  }
+}
+
+static void remove_command_katcp(struct katcp_shared *s, struct katcp_cmd *c)
+{
+  struct katcp_cmd **prv;
+
+  if(s->s_table == NULL){
+    return;
+  }
+
+  if(c->c_flags & KATCP_CMD_WILDCARD){
+    prv = &(s->s_wild);
+  } else {
+    prv = &(s->s_table[hash_interned_katcm(c->c_name) & (s->s_slots - 1)]);
+  }
+
+  while(*prv){
+    if(*prv == c){
+      *prv = c->c_hash;
+      c->c_hash = NULL;
+      if(!(c->c_flags & KATCP_CMD_WILDCARD)){
+        s->s_named--;
+      }
+      return;
+    }
+    prv = &((*prv)->c_hash);
+  }
+}
+
+static struct katcp_cmd *locate_command_katcp(struct katcp_shared *s, char *str)
+{
+  struct katcp_cmd *search;
+  char *key;
+
+  /* names are interned, a name not known at all can only match a wildcard */
+  key = find_name_katcm(str);
+
+  if(s->s_table == NULL){ /* no index, scan as we used to */
+    for(search = s->s_commands; search; search = search->c_next){
+      if(((search->c_mode == 0) || (search->c_mode == s->s_mode)) && ((search->c_flags & KATCP_CMD_WILDCARD) || (search->c_name == key))){
+        return search;
+      }
+    }
+    return NULL;
+  }
+
+  if(key){
+    for(search = s->s_table[hash_interned_katcm(key) & (s->s_slots - 1)]; search; search = search->c_hash){
+#ifdef DEBUG
+      fprintf(stderr, "dispatch: checking %s against %s\n", str, search->c_name);
+#endif
+      if(((search->c_mode == 0) || (search->c_mode == s->s_mode)) && (search->c_name == key)){
+        return search;
+      }
+    }
+  }
+
+  for(search = s->s_wild; search; search = search->c_hash){
+    if((search->c_mode == 0) || (search->c_mode == s->s_mode)){
+      return search;
+    }
+  }
+
+  return NULL;
+}
+
+/************ request statistics **********************************/
+
+void clear_stats_katcp(struct katcp_stats *t)
+{
+  unsigned int i;
+
+  t->t_calls = 0;
+  t->t_errors = 0;
+  t->t_total = 0;
+
+  for(i = 0; i < KATCP_STATS_BUCKETS; i++){
+    t->t_bucket[i] = 0;
+  }
+}
+
+void count_stats_katcp(struct katcp_stats *t, unsigned long us, int result)
+{
+  unsigned int i;
+
+  t->t_total += us;
+
+  /* a yielding handler is called again, only count the request once it completes */
+  if(result == KATCP_RESULT_YIELD){
+    return;
+  }
+
+  t->t_calls++;
+  if(result < 0){
+    t->t_errors++;
+  }
+
+  for(i = 0; (us >= 2) && (i < (KATCP_STATS_BUCKETS - 1)); i++){
+    us = us >> 1;
+  }
+
+  t->t_bucket[i]++;
+}
+
+unsigned long record_stats_katcp(struct katcp_stats *t, struct timeval *start, int result)
+{
+  struct timeval now, delta;
+  unsigned long us;
+
+  monotonic_time_katcp(&now);
+
+  sub_time_katcp(&delta, &now, start); /* zero if start is in the future */
+
+  us = (delta.tv_sec * 1000000UL) + delta.tv_usec;
+
+  count_stats_katcp(t, us, result);
+
+  return us;
+}
+
+void print_stats_katcp(struct katcp_dispatch *d, char *name, struct katcp_stats *t)
+{
+  unsigned int i;
+
+  prepend_inform_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, name);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, t->t_calls);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, t->t_errors);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, t->t_total);
+
+  for(i = 0; i < KATCP_STATS_BUCKETS; i++){
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | (((i + 1) < KATCP_STATS_BUCKETS) ? 0 : KATCP_FLAG_LAST), t->t_bucket[i]);
+  }
+}
+
+static void forget_stats_katcp(struct katcp_shared *s, struct katcp_stats *t)
+{
+  unsigned int i;
+
+  /* a yielding client may still refer to a command being removed */
+
+  if(s->s_template && (s->s_template->d_stats == t)){
+    s->s_template->d_stats = NULL;
+  }
+
+  for(i = 0; i < s->s_used; i++){
+    if(s->s_clients[i]->d_stats == t){
+      s->s_clients[i]->d_stats = NULL;
+    }
+  }
+}
+
 int deregister_command_katcp(struct katcp_dispatch *d, char *match)
 {
   struct katcp_cmd *c, *prv, *nxt;
@@ -580,6 +841,9 @@ int deregister_command_katcp(struct katcp_dispatch *d, char *match)
       } else {
         s->s_commands = nxt;
       }
+      remove_command_katcp(s, c);
+      invalidate_cache_katcp(s, KATCP_CACHE_HELP);
+      forget_stats_katcp(s, &(c->c_stats));
       shutdown_cmd_katcp(c);
       if(ptr != match){
         free(ptr);
@@ -650,6 +914,7 @@ int update_command_katcp(struct katcp_dispatch *d, char *match, int flags)
   while(c){
     if((c->c_name != NULL) && (strcmp(c->c_name, ptr) == 0)){
       c->c_flags = (c->c_flags & ~KATCP_CMD_HIDDEN) | (flags & KATCP_CMD_HIDDEN);
+      invalidate_cache_katcp(s, KATCP_CACHE_HELP);
       if(ptr != match){
         free(ptr);
       }
@@ -671,6 +936,7 @@ int register_flag_mode_katcp(struct katcp_dispatch *d, char *match, char *help,
 {
   struct katcp_cmd *c, *nxt;
   struct katcp_shared *s;
+  char *tmp;
   
   if((d == NULL) || (d->d_shared == NULL)){
     return -1;
@@ -695,8 +961,10 @@ int register_flag_mode_katcp(struct katcp_dispatch *d, char *match, char *help,
   c->c_help = NULL;
   c->c_call = NULL;
   c->c_next = NULL;
+  c->c_hash = NULL;
   c->c_mode = 0;
   c->c_flags = KATCP_CMD_HIDDEN;
+  clear_stats_katcp(&(c->c_stats));
 
   if(match == NULL){
     flags |= KATCP_CMD_WILDCARD;
@@ -707,13 +975,15 @@ int register_flag_mode_katcp(struct katcp_dispatch *d, char *match, char *help,
       case KATCP_REQUEST :
       case KATCP_REPLY   :
       case KATCP_INFORM   :
-        c->c_name = strdup(match);
+        c->c_name = intern_name_katcm(match);
         break;
       default :
-        c->c_name = malloc(strlen(match + 2));
-        if(c->c_name){
-          c->c_name[0] = KATCP_REQUEST;
-          strcpy(c->c_name + 1, match);
+        tmp = malloc(strlen(match) + 2);
+        if(tmp){
+          tmp[0] = KATCP_REQUEST;
+          strcpy(tmp + 1, match);
+          c->c_name = intern_name_katcm(tmp);
+          free(tmp);
         }
         break;
     }
@@ -755,6 +1025,9 @@ int register_flag_mode_katcp(struct katcp_dispatch *d, char *match, char *help,
     s->s_commands = c;
   }
 
+  insert_command_katcp(s, c);
+  invalidate_cache_katcp(s, KATCP_CACHE_HELP);
+
   return 0;
 }
 
@@ -848,6 +1121,8 @@ int lookup_katcp(struct katcp_dispatch *d)
 
   str = arg_string_katcl(d->d_line, 0);
 
+  TRACE_KATCP(KATCP_TRACE_RECEIVED, arg_count_katcl(d->d_line), str);
+
 #ifdef KATCP_LOG_REQUESTS
   px = ready_katcl(d->d_line);
   if(px){
@@ -857,20 +1132,17 @@ int lookup_katcp(struct katcp_dispatch *d)
   }
 #endif
 
-  for(search = d->d_shared->s_commands; search; search = search->c_next){
+  search = locate_command_katcp(s, str);
+  if(search){
 #ifdef DEBUG
-    fprintf(stderr, "dispatch: checking %s against %s\n", str, search->c_name);
+    fprintf(stderr, "dispatch: found match for <%s>\n", str);
 #endif
-    if(((search->c_mode == 0) || (search->c_mode == d->d_shared->s_mode)) && ((search->c_flags & KATCP_CMD_WILDCARD) || (!strcmp(search->c_name, str)))){
-#ifdef DEBUG
-      fprintf(stderr, "dispatch: found match for <%s>\n", str);
-#endif
-      d->d_current = search->c_call;
-      if(s->s_prehook){
-        (*(s->s_prehook))(d, arg_count_katcl(d->d_line));
-      }
-      return 1; /* found */
+    d->d_current = search->c_call;
+    d->d_stats = &(search->c_stats);
+    if(s->s_prehook){
+      (*(s->s_prehook))(d, arg_count_katcl(d->d_line));
     }
+    return 1; /* found */
   }
   
   return 1; /* not found, d->d_current == NULL */
@@ -879,8 +1151,10 @@ int lookup_katcp(struct katcp_dispatch *d)
 
 int call_katcp(struct katcp_dispatch *d)
 {
-  int r, n;
+  int r, n, tag;
+  unsigned int before;
   struct katcp_shared *s;
+  struct timeval start;
   char *str;
 
 #ifdef KATCP_STDERR_ERRORS
@@ -901,8 +1175,22 @@ int call_katcp(struct katcp_dispatch *d)
   n = arg_count_katcl(d->d_line);
   r = KATCP_RESULT_FAIL;
 
+  /* replies to a tagged request carry its tag */
+  tag = arg_tag_katcl(d->d_line);
+  tag_katcl(d->d_line, tag);
+
+  before = d->d_count;
+
   if(d->d_current){
+    monotonic_time_katcp(&start);
+
+    TRACE_KATCP(KATCP_TRACE_DISPATCH, n, str);
     r = (*(d->d_current))(d, n);
+    TRACE_KATCP(KATCP_TRACE_COMPLETE, r, str);
+
+    if(d->d_stats){
+      record_stats_katcp(d->d_stats, &start, r);
+    }
 
 #ifdef DEBUG
     fprintf(stderr, "call: dispatch function returned %d\n", r);
@@ -916,12 +1204,15 @@ int call_katcp(struct katcp_dispatch *d)
         (*(s->s_posthook))(d, n);
       }
       d->d_current = NULL;
+      d->d_stats = NULL;
     }
     if(r == KATCP_RESULT_PAUSE){
       if(d->d_count <= 0){
         log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "request %s is pausing task %p without having notices pending", str, d);
       }
-      d->d_pause = 1;
+      if((tag < 0) || (hold_request_katcp(d, before) < 0)){
+        d->d_pause = 1;
+      }
     }
   } else { /* force a fail for unknown commands */
 #ifdef KATCP_STDERR_ERRORS
@@ -950,6 +1241,8 @@ int call_katcp(struct katcp_dispatch *d)
     }
   }
 
+  tag_katcl(d->d_line, -1);
+
   d->d_ready = 0;
 
   return r;
@@ -974,7 +1267,10 @@ int dispatch_katcp(struct katcp_dispatch *d)
 #if DEBUG > 1
     fprintf(stderr, "dispatch: calling\n");
 #endif
-    call_katcp(d);
+    if(call_katcp(d) == KATCP_RESULT_YIELD){
+      /* give the main loop a chance to do io, we get called again on the next round */
+      return 0;
+    }
   }
 
 #if DEBUG > 1
@@ -1084,7 +1380,13 @@ int error_katcp(struct katcp_dispatch *d)
 
 void resume_katcp(struct katcp_dispatch *d)
 {
+  if(d->d_active){ /* only completes the tagged request being run, see hold.c */
+    d->d_active->h_done = 1;
+    return;
+  }
+
   d->d_pause = 0;
+  d->d_wake = 1; /* may have buffered requests, which io readiness will not report */
 }
 
 int exited_katcp(struct katcp_dispatch *d)
@@ -1157,6 +1459,8 @@ void reset_katcp(struct katcp_dispatch *d, int fd)
 
   destroy_nonsensors_katcp(d);
 
+  release_held_katcp(d);
+
   disown_notices_katcp(d);
 
   if(d->d_end){
@@ -1167,17 +1471,23 @@ void reset_katcp(struct katcp_dispatch *d, int fd)
   d->d_run = 1;
   d->d_exit = KATCP_EXIT_ABORT; /* assume the worst */
   d->d_pause = 0;
+  d->d_wake = 1;
 
   s = d->d_shared;
   if(s == NULL){
     d->d_level = KATCP_LEVEL_INFO; /* fallback, should not happen */
   } else {
     d->d_level = s->s_default;
+    lower_log_floor_katcp(s, d->d_level);
+    d->d_hold_limit = s->s_hold_limit;
   }
 
 
   if(d->d_line){
     exchange_katcl(d->d_line, fd);
+    if(s){
+      limit_katcl(d->d_line, s->s_limit_policy, s->s_limit_high, s->s_limit_low);
+    }
   }
 }
 
@@ -1188,6 +1498,7 @@ int help_cmd_katcp(struct katcp_dispatch *d, int argc)
   struct katcp_cmd *c;
   unsigned long count;
   char *match;
+  int start, result;
 
   if(d->d_shared == NULL){
     return KATCP_RESULT_FAIL;
@@ -1202,7 +1513,21 @@ int help_cmd_katcp(struct katcp_dispatch *d, int argc)
 
   log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "printing available commands for mode %d", d->d_shared->s_mode);
 
-  for(c = d->d_shared->s_commands; c; c = c->c_next){
+  start = (-1);
+  if(match == NULL){
+    result = serve_cache_katcp(d, KATCP_CACHE_HELP);
+    if(result >= 0){
+      count = result;
+      c = NULL; /* skip the walk below */
+    } else {
+      start = start_cache_katcp(d);
+      c = d->d_shared->s_commands;
+    }
+  } else {
+    c = d->d_shared->s_commands;
+  }
+
+  for(; c; c = c->c_next){
     if((c->c_mode == 0) || (d->d_shared->s_mode == c->c_mode)){
       if((c->c_name) && (
           ((match != NULL) && (!strcmp(c->c_name + 1, match))) || /* print matching command for this mode, no matter if hidden or not */
@@ -1218,6 +1543,10 @@ int help_cmd_katcp(struct katcp_dispatch *d, int argc)
     }
   }
 
+  if(start >= 0){
+    fill_cache_katcp(d, KATCP_CACHE_HELP, start, count);
+  }
+
   if(count > 0){
     prepend_reply_katcp(d);
     append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
@@ -1263,6 +1592,83 @@ int watchdog_cmd_katcp(struct katcp_dispatch *d, int argc)
   return KATCP_RESULT_OK;
 }
 
+int binary_encoding_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  char *requested;
+  int enable;
+
+  if(d->d_line == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc > 1){
+    requested = arg_string_katcp(d, 1);
+    if(requested == NULL){
+      return KATCP_RESULT_FAIL;
+    }
+
+    if(!strcmp(requested, KATCL_BINARY_NAME)){
+      enable = 1;
+    } else if(!strcmp(requested, "none")){
+      enable = 0;
+    } else {
+      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unknown binary encoding %s", requested);
+      extra_response_katcp(d, KATCP_RESULT_INVALID, "encoding");
+      return KATCP_RESULT_OWN;
+    }
+
+    /* only affects arguments flagged binary, so the reply itself reads the same either way */
+    binary_katcl(d->d_line, enable);
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, binary_katcl(d->d_line, -1) ? KATCL_BINARY_NAME : "none");
+
+  return KATCP_RESULT_OWN;
+}
+
+int command_stats_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_cmd *c;
+  unsigned long count;
+  char *match;
+
+  if(d->d_shared == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  count = 0;
+  match = (argc <= 1) ? NULL : arg_string_katcp(d, 1);
+
+  if(match && ((match[0] == KATCP_REQUEST) || (match[0] == KATCP_INFORM))){
+    match++;
+  }
+
+  /* fields: name calls errors total-us, then a histogram of calls taking under 2, 4, 8, ... us */
+
+  for(c = d->d_shared->s_commands; c; c = c->c_next){
+    if(c->c_name && (
+        ((match != NULL) && (!strcmp(c->c_name + 1, match))) ||
+        ((match == NULL) && (c->c_stats.t_calls > 0))
+    )){
+      print_stats_katcp(d, c->c_name + 1, &(c->c_stats));
+      count++;
+    }
+  }
+
+  if((match != NULL) && (count == 0)){
+    extra_response_katcp(d, KATCP_RESULT_INVALID, "request");
+    return KATCP_RESULT_OWN;
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, count);
+
+  return KATCP_RESULT_OWN;
+}
+
 int name_log_level_katcp(struct katcp_dispatch *d, char *name)
 {
   int level;
@@ -1277,6 +1683,7 @@ int name_log_level_katcp(struct katcp_dispatch *d, char *name)
   }
 
   d->d_level = level;
+  lower_log_floor_katcp(d->d_shared, level);
 
 #ifdef DEBUG
   fprintf(stderr, "log: set log level to %s (%d)\n", name, level);
@@ -1292,6 +1699,7 @@ int log_level_katcp(struct katcp_dispatch *d, unsigned int level)
   }
 
   d->d_level = level;
+  lower_log_floor_katcp(d->d_shared, level);
 
   return d->d_level;
 }
@@ -1329,6 +1737,7 @@ int log_level_generic_katcp(struct katcp_dispatch *d, int argc, int global)
         switch(global){
           case 0 :
             d->d_level = code;
+            lower_log_floor_katcp(s, code);
             break;
           case 1 : 
             s->s_default = code;
@@ -1341,6 +1750,7 @@ int log_level_generic_katcp(struct katcp_dispatch *d, int argc, int global)
               }
             }
             s->s_default = code;
+            lower_log_floor_katcp(s, code);
             break;
         }
       }
@@ -1431,10 +1841,22 @@ int log_record_cmd_katcp(struct katcp_dispatch *d, int argc)
 
 /**************************************************************/
 
+static int append_untagged_katcp(struct katcl_line *l, struct katcl_parse *p)
+{
+  /* broadcasts stay untagged, even for a client with a tagged request running */
+  int previous, result;
+
+  previous = tag_katcl(l, -1);
+  result = append_parse_katcl(l, p);
+  tag_katcl(l, previous);
+
+  return result;
+}
+
 int broadcast_inform_katcp(struct katcp_dispatch *d, char *name, char *arg)
 {
   struct katcp_shared *s;
-  int result, sum, i;
+  int result, sum, i, previous;
 
   sane_katcp(d);
 
@@ -1447,7 +1869,9 @@ int broadcast_inform_katcp(struct katcp_dispatch *d, char *name, char *arg)
   for(i = 0; i < s->s_used; i++){
     d = s->s_clients[i];
     if(d->d_line){
+      previous = tag_katcl(d->d_line, -1);
       result = basic_inform_katcp(d, name, arg);
+      tag_katcl(d->d_line, previous);
       if(result < 0){
         return -1;
       }
@@ -1507,7 +1931,7 @@ int log_relay_katcp(struct katcp_dispatch *d, struct katcl_parse *p)
     for(i = 0; i < s->s_used; i++){
       d = s->s_clients[i];
       if(code >= d->d_level){
-        sum = append_parse_katcl(d->d_line, p);
+        sum = append_untagged_katcp(d->d_line, p);
         if(result < 0){
           sum = result;
         } else {
@@ -1519,22 +1943,106 @@ int log_relay_katcp(struct katcp_dispatch *d, struct katcl_parse *p)
     }
   } else {
     if(code >= d->d_level){
-      result = append_parse_katcl(d->d_line, p);
+      result = append_untagged_katcp(d->d_line, p);
     }
   }
 
   return result;
 }
 
-static int check_log_message_katcp(struct katcl_line *l, int sum, unsigned int limit, unsigned int level, char *name, char *fmt, va_list args)
+void lower_log_floor_katcp(struct katcp_shared *s, unsigned int level)
+{
+  /* has to be called wherever a log level might be lowered, raising is caught at the next broadcast */
+
+  if((s != NULL) && (level < s->s_log_floor)){
+    s->s_log_floor = level;
+  }
+}
+
+static struct katcl_parse *make_log_message_katcp(unsigned int level, char *name, struct timeval *now, char *fmt, va_list args)
+{
+  struct katcl_parse *p;
+  char *logstring;
+  int result[5];
+
+  logstring = log_to_string_katcl(level);
+  if(logstring == NULL){
+#ifdef KATCP_CONSISTENCY_CHECKS
+    fprintf(stderr, "log: using unknown log level %d in log function call\n", level);
+    abort();
+#endif
+    return NULL;
+  }
+
+  p = create_referenced_parse_katcl();
+  /* our reference, each queue takes its own */
+  if(p == NULL){
+    return NULL;
+  }
+
+  result[0] = add_string_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, KATCP_LOG_INFORM);
+  result[1] = add_string_parse_katcl(p, KATCP_FLAG_STRING, logstring);
+#if KATCP_PROTOCOL_MAJOR_VERSION >= 5   
+  result[2] = add_args_parse_katcl(p, KATCP_FLAG_STRING, "%lu.%03d", now->tv_sec, (int)(now->tv_usec / 1000));
+#else 
+  result[2] = add_args_parse_katcl(p, KATCP_FLAG_STRING, "%lu%03d", now->tv_sec, (int)(now->tv_usec / 1000));
+#endif
+  result[3] = add_string_parse_katcl(p, KATCP_FLAG_STRING, name);
+  result[4] = add_vargs_parse_katcl(p, KATCP_FLAG_STRING | KATCP_FLAG_LAST, fmt, args);
+
+  if((result[0] < 0) || (result[1] < 0) || (result[2] < 0) || (result[3] < 0) || (result[4] < 0)){
+    destroy_parse_katcl(p);
+    return NULL;
+  }
+
+  return p;
+}
+
+static void ring_log_message_katcp(struct katcp_log_ring *r, unsigned int level, char *name, struct timeval *now, char *fmt, va_list args)
+{
+  struct katcp_log_record *lr;
+  va_list copy;
+
+  lr = &(r->r_vector[r->r_head]);
+
+  lr->r_when = *now;
+  lr->r_level = level;
+
+  strncpy(lr->r_name, name, KATCP_LOG_RING_NAME - 1);
+  lr->r_name[KATCP_LOG_RING_NAME - 1] = '\0';
+
+  /* long messages are truncated, good enough for a post mortem */
+  va_copy(copy, args);
+  vsnprintf(lr->r_text, KATCP_LOG_RING_TEXT, fmt, copy);
+  va_end(copy);
+
+  r->r_head = (r->r_head + 1) % r->r_size;
+  if(r->r_count < r->r_size){
+    r->r_count++;
+  }
+}
+
+static int check_log_message_katcp(struct katcl_line *l, int sum, unsigned int limit, unsigned int level, unsigned int *floor, struct katcl_parse *p)
 {
   int result;
 
+  if(limit < *floor){
+    *floor = limit;
+  }
+
   if(level < limit){
-    return 0;
+    return sum;
   }
 
-  result = vlog_message_katcl(l, level, name, fmt, args);
+  if(l == NULL){
+    return sum;
+  }
+
+  if(p == NULL){
+    return -1;
+  }
+
+  result = append_untagged_katcp(l, p);
   if(sum < 0){
     return sum;
   }
@@ -1545,48 +2053,36 @@ static int check_log_message_katcp(struct katcl_line *l, int sum, unsigned int l
   return sum + result;
 }
 
-int log_message_katcp(struct katcp_dispatch *d, unsigned int priority, char *name, char *fmt, ...)
+static int deliver_log_message_katcp(struct katcp_dispatch *d, unsigned int priority, char *prefix, char *fmt, va_list args)
 {
-  va_list args;
-  int sum;
-  unsigned int level, i, j;
+  int sum, everywhere;
+  unsigned int level, i, j, floor;
   struct katcp_shared *s;
-  struct katcp_entry *e;
-  char *prefix;
   struct katcp_group *gx;
   struct katcp_flat *fx;
+  struct katcl_parse *p;
+  struct timeval now;
 
   level = priority & KATCP_MASK_LEVELS;
   sum = 0;
 
-  sane_katcp(d);
-
   s = d->d_shared;
-  if(s == NULL){
-#ifdef KATCP_STDERR_ERRORS
-    fprintf(stderr, "log: no shared state available\n");
-#endif
-    return -1;
-  }
 
-  if(name){
-    prefix = name;
-  } else {
-    e = &(s->s_vector[s->s_mode]);
-    if(e->e_name){
-      prefix = e->e_name;
-    } else {
-      /* WARNING: not the most elegant option ... */
-      prefix = KATCP_CODEBASE_NAME;
-    }
+  gettimeofday(&now, NULL);
+
+  /* formatted once, the same parse is queued on every connection which wants it */
+  p = make_log_message_katcp(level, prefix, &now, fmt, args);
+  if(s->s_log_ring && (level >= s->s_log_ring->r_level)){
+    ring_log_message_katcp(s->s_log_ring, level, prefix, &now, fmt, args);
   }
 
+  floor = KATCP_LEVEL_OFF;
+  everywhere = 0;
+
   if(priority & KATCP_LEVEL_LOCAL){ 
     fx = this_flat_katcp(d);
     if(fx){
-      va_start(args, fmt);
-      sum = check_log_message_katcp(fx->f_line, sum, fx->f_log_level, level, prefix, fmt, args);
-      va_end(args);
+      sum = check_log_message_katcp(fx->f_line, sum, fx->f_log_level, level, &floor, p);
     }
   } else if(priority & KATCP_LEVEL_GROUP){ /* within the same group */
     gx = this_group_katcp(d);
@@ -1594,22 +2090,19 @@ int log_message_katcp(struct katcp_dispatch *d, unsigned int priority, char *nam
       for(i = 0; i < gx->g_count; i++){
         fx = gx->g_flats[i];
         if(fx){
-          va_start(args, fmt);
-          sum = check_log_message_katcp(fx->f_line, sum, fx->f_log_level, level, prefix, fmt, args);
-          va_end(args);
+          sum = check_log_message_katcp(fx->f_line, sum, fx->f_log_level, level, &floor, p);
         }
       }
     }
   } else { /* message goes everywhere */
+    everywhere = 1;
     if(s->s_groups){
       for(j = 0; j < s->s_members; j++){
         gx = s->s_groups[j];
         for(i = 0; i < gx->g_count; i++){
           fx = gx->g_flats[i];
           if(fx){
-            va_start(args, fmt);
-            sum = check_log_message_katcp(fx->f_line, sum, fx->f_log_level, level, prefix, fmt, args);
-            va_end(args);
+            sum = check_log_message_katcp(fx->f_line, sum, fx->f_log_level, level, &floor, p);
           }
         }
       }
@@ -1629,19 +2122,417 @@ int log_message_katcp(struct katcp_dispatch *d, unsigned int priority, char *nam
   if(s){
     for(i = 0; i < s->s_used; i++){
       d = s->s_clients[i];
-      va_start(args, fmt);
-      sum = check_log_message_katcp(d->d_line, sum, d->d_level, level, prefix, fmt, args);
-      va_end(args);
+      sum = check_log_message_katcp(d->d_line, sum, d->d_level, level, &floor, p);
     }
   } else {
-    va_start(args, fmt);
-    sum = check_log_message_katcp(d->d_line, sum, d->d_level, level, prefix, fmt, args);
-    va_end(args);
+    sum = check_log_message_katcp(d->d_line, sum, d->d_level, level, &floor, p);
+  }
+
+  /* having visited everyone, we know the real floor */
+  if(everywhere){
+    s = d->d_shared;
+    if(s->s_log_ring && (s->s_log_ring->r_level < floor)){
+      floor = s->s_log_ring->r_level;
+    }
+    s->s_log_floor = floor;
+  }
+
+  if(p){
+    destroy_parse_katcl(p);
   }
  
   return sum;
 }
 
+static int summarise_log_site_katcp(struct katcp_dispatch *d, struct katcp_log_site *ls, ...)
+{
+  va_list args;
+  int result;
+
+  /* bypasses the limits, at most one of these per site and flush interval */
+
+  va_start(args, ls);
+  result = deliver_log_message_katcp(d, ls->l_level, ls->l_name, "last message repeated %lu times (%s)", args);
+  va_end(args);
+
+  ls->l_suppressed = 0;
+
+  return result;
+}
+
+static int flush_log_sites_katcp(struct katcp_dispatch *d, void *data)
+{
+  struct katcp_shared *s;
+  struct katcp_log_site *ls;
+  unsigned int i, count;
+
+  s = d->d_shared;
+  count = 0;
+
+  for(i = 0; i < KATCP_LOG_SITES; i++){
+    ls = &(s->s_log_sites[i]);
+    if(ls->l_suppressed > 0){
+      summarise_log_site_katcp(d, ls, ls->l_suppressed, ls->l_fmt);
+      count++;
+    }
+  }
+
+  if(count > 0){
+    return 0;
+  }
+
+  /* all quiet, stop until the next flood */
+  s->s_log_flushing = 0;
+
+  return -1;
+}
+
+static int limit_log_message_katcp(struct katcp_dispatch *d, struct katcp_shared *s, unsigned int level, char *name, char *fmt)
+{
+  struct katcp_log_site *ls;
+  struct timeval now, delta;
+  unsigned long cap, refill;
+  unsigned int index;
+
+  /* token bucket per call site, returns zero if the message is to be dropped */
+
+  index = ((((unsigned long) fmt) >> 3) ^ (((unsigned long) name) >> 3) ^ level) % KATCP_LOG_SITES;
+  ls = &(s->s_log_sites[index]);
+
+  monotonic_time_katcp(&now);
+  cap = s->s_log_burst * 1000UL;
+
+  if((ls->l_fmt != fmt) || (ls->l_name != name) || (ls->l_level != level)){
+    if(ls->l_suppressed > 0){ /* evicting a site, report what it still owes */
+      summarise_log_site_katcp(d, ls, ls->l_suppressed, ls->l_fmt);
+    }
+    ls->l_fmt = fmt;
+    ls->l_name = name;
+    ls->l_level = level;
+    ls->l_tokens = cap;
+  } else {
+    sub_time_katcp(&delta, &now, &(ls->l_when));
+    if(delta.tv_sec >= (s->s_log_burst / s->s_log_rate) + 1){
+      ls->l_tokens = cap;
+    } else {
+      refill = ((delta.tv_sec * 1000UL) + (delta.tv_usec / 1000)) * s->s_log_rate;
+      ls->l_tokens = ((ls->l_tokens + refill) > cap) ? cap : (ls->l_tokens + refill);
+    }
+  }
+
+  ls->l_when = now;
+
+  if(ls->l_tokens < 1000){
+    if(ls->l_suppressed == 0){
+      if(s->s_log_flushing == 0){
+        s->s_log_flushing = 1;
+        if(register_every_ms_katcp(d, KATCP_LOG_FLUSH, &flush_log_sites_katcp, s->s_log_sites) < 0){
+          s->s_log_flushing = 0;
+        }
+      }
+    }
+    ls->l_suppressed++;
+    return 0;
+  }
+
+  ls->l_tokens -= 1000;
+
+  if(ls->l_suppressed > 0){ /* flood has subsided */
+    summarise_log_site_katcp(d, ls, ls->l_suppressed, ls->l_fmt);
+  }
+
+  return 1;
+}
+
+int log_message_katcp(struct katcp_dispatch *d, unsigned int priority, char *name, char *fmt, ...)
+{
+  va_list args;
+  int sum;
+  unsigned int level;
+  struct katcp_shared *s;
+  struct katcp_entry *e;
+  char *prefix;
+
+  level = priority & KATCP_MASK_LEVELS;
+
+  sane_katcp(d);
+
+  s = d->d_shared;
+  if(s == NULL){
+#ifdef KATCP_STDERR_ERRORS
+    fprintf(stderr, "log: no shared state available\n");
+#endif
+    return -1;
+  }
+
+  /* nobody wants it, skip before any formatting, the common case for trace and debug */
+  if(level < s->s_log_floor){
+    return 0;
+  }
+
+  if(name){
+    prefix = name;
+  } else {
+    e = &(s->s_vector[s->s_mode]);
+    if(e->e_name){
+      prefix = e->e_name;
+    } else {
+      /* WARNING: not the most elegant option ... */
+      prefix = KATCP_CODEBASE_NAME;
+    }
+  }
+
+  /* only broadcasts are limited, local and group messages answer someone */
+  if((s->s_log_rate > 0) && ((priority & (KATCP_LEVEL_LOCAL | KATCP_LEVEL_GROUP)) == 0)){
+    if(limit_log_message_katcp(d, s, level, prefix, fmt) == 0){
+      return 0;
+    }
+  }
+
+  va_start(args, fmt);
+  sum = deliver_log_message_katcp(d, priority, prefix, fmt, args);
+  va_end(args);
+
+  return sum;
+}
+
+int ring_log_katcp(struct katcp_dispatch *d, unsigned int size, unsigned int level)
+{
+  struct katcp_shared *s;
+  struct katcp_log_ring *r;
+
+  s = d->d_shared;
+  if(s == NULL){
+    return -1;
+  }
+
+  if(s->s_log_ring){
+    r = s->s_log_ring;
+    free(r->r_vector);
+    free(r);
+    s->s_log_ring = NULL;
+  }
+
+  if(size == 0){
+    return 0;
+  }
+
+  r = malloc(sizeof(struct katcp_log_ring));
+  if(r == NULL){
+    return -1;
+  }
+
+  r->r_vector = malloc(sizeof(struct katcp_log_record) * size);
+  if(r->r_vector == NULL){
+    free(r);
+    return -1;
+  }
+
+  r->r_size = size;
+  r->r_head = 0;
+  r->r_count = 0;
+  r->r_level = level;
+
+  s->s_log_ring = r;
+
+  lower_log_floor_katcp(s, level);
+
+  return 0;
+}
+
+int log_flood_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_shared *s;
+  unsigned int rate, burst;
+  char *ptr;
+
+  s = d->d_shared;
+  if(s == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc > 1){
+    ptr = arg_string_katcp(d, 1);
+    if(ptr == NULL){
+      return KATCP_RESULT_FAIL;
+    }
+    rate = atoi(ptr);
+
+    burst = (s->s_log_burst > rate) ? s->s_log_burst : rate;
+    if(argc > 2){
+      ptr = arg_string_katcp(d, 2);
+      if(ptr == NULL){
+        return KATCP_RESULT_FAIL;
+      }
+      burst = atoi(ptr);
+    }
+
+    if((rate > 0) && (burst == 0)){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "a burst of at least one message is needed");
+      return KATCP_RESULT_INVALID;
+    }
+
+    s->s_log_rate = rate;
+    s->s_log_burst = burst;
+  }
+
+  if(s->s_log_rate > 0){
+    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "each log statement may emit %u messages per second after a burst of %u", s->s_log_rate, s->s_log_burst);
+  } else {
+    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "log statements are not rate limited");
+  }
+
+  return KATCP_RESULT_OK;
+}
+
+int log_ring_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_shared *s;
+  struct katcp_log_ring *r;
+  struct katcp_log_record *lr;
+  unsigned int i, size;
+  int level;
+  char *ptr;
+
+  s = d->d_shared;
+  if(s == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc > 1){
+    ptr = arg_string_katcp(d, 1);
+    if(ptr == NULL){
+      return KATCP_RESULT_FAIL;
+    }
+    size = atoi(ptr);
+
+    level = KATCP_LEVEL_DEBUG;
+    if(argc > 2){
+      ptr = arg_string_katcp(d, 2);
+      level = ptr ? log_to_code_katcl(ptr) : (-1);
+      if(level < 0){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown log level %s", ptr ? ptr : "");
+        return extra_response_katcp(d, KATCP_RESULT_INVALID, "level");
+      }
+    }
+
+    if(ring_log_katcp(d, size, level) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to keep %u log records", size);
+      return KATCP_RESULT_FAIL;
+    }
+
+    return KATCP_RESULT_OK;
+  }
+
+  r = s->s_log_ring;
+  if(r == NULL){
+    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "recent log messages are not kept");
+    return KATCP_RESULT_OK;
+  }
+
+  /* oldest first */
+  for(i = 0; i < r->r_count; i++){
+    lr = &(r->r_vector[(r->r_head + r->r_size - r->r_count + i) % r->r_size]);
+
+    prepend_inform_katcp(d);
+    append_string_katcp(d, KATCP_FLAG_STRING, log_to_string_katcl(lr->r_level));
+    append_args_katcp(d, KATCP_FLAG_STRING, "%lu.%03d", lr->r_when.tv_sec, (int)(lr->r_when.tv_usec / 1000));
+    append_string_katcp(d, KATCP_FLAG_STRING, lr->r_name);
+    append_string_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_STRING, lr->r_text);
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, r->r_count);
+
+  return KATCP_RESULT_OWN;
+}
+
+#ifdef KATCP_TRACE
+int trace_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_trace_entry *te;
+  unsigned long i, first, count;
+  unsigned int size;
+  char *ptr, *format, *path;
+  long saved;
+  int was;
+
+  if(argc > 1){
+    ptr = arg_string_katcp(d, 1);
+    if(ptr == NULL){
+      return KATCP_RESULT_FAIL;
+    }
+
+    if(!strcmp(ptr, "on")){
+      if((argc > 2) || (size_trace_katcp() == 0)){
+        size = (argc > 2) ? arg_unsigned_long_katcp(d, 2) : KATCP_TRACE_SIZE;
+        if((size == 0) || (resize_trace_katcp(size) < 0)){
+          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate a trace ring of %u events", size);
+          return KATCP_RESULT_FAIL;
+        }
+      }
+      trace_enabled_katcp = 1;
+    } else if(!strcmp(ptr, "off")){
+      trace_enabled_katcp = 0;
+    } else if(!strcmp(ptr, "clear")){
+      clear_trace_katcp();
+    } else if(!strcmp(ptr, "dump")){
+      if(size_trace_katcp() == 0){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no trace ring allocated");
+        return KATCP_RESULT_FAIL;
+      }
+
+      if(argc > 2){
+        format = arg_string_katcp(d, 2);
+        path = arg_string_katcp(d, 3);
+        if((format == NULL) || (path == NULL) || (strcmp(format, "chrome") && strcmp(format, "binary"))){
+          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "file dumps need a format (chrome or binary) and a path");
+          return KATCP_RESULT_INVALID;
+        }
+        saved = save_trace_katcp(format, path);
+        if(saved < 0){
+          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to write trace to %s", path);
+          return KATCP_RESULT_FAIL;
+        }
+        log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "wrote %ld trace events to %s", saved, path);
+      } else {
+        /* stop recording while we report, our own flushes would otherwise overwrite the ring */
+        was = trace_enabled_katcp;
+        trace_enabled_katcp = 0;
+
+        count = held_trace_katcp(&first);
+        for(i = 0; i < count; i++){
+          te = entry_trace_katcp(first + i);
+          prepend_inform_katcp(d);
+          append_args_katcp(d, KATCP_FLAG_STRING, "%llu.%09llu", te->e_when / 1000000000ULL, te->e_when % 1000000000ULL);
+          append_string_katcp(d, KATCP_FLAG_STRING, name_trace_katcp(te->e_event));
+          append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | (te->e_tag[0] ? 0 : KATCP_FLAG_LAST), te->e_value);
+          if(te->e_tag[0]){
+            append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, te->e_tag);
+          }
+        }
+
+        trace_enabled_katcp = was;
+      }
+    } else {
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown trace operation %s", ptr);
+      return KATCP_RESULT_INVALID;
+    }
+  }
+
+  count = held_trace_katcp(&first);
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_string_katcp(d, KATCP_FLAG_STRING, trace_enabled_katcp ? "on" : "off");
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, count);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, size_trace_katcp());
+
+  return KATCP_RESULT_OWN;
+}
+#endif
+
 int extra_response_katcp(struct katcp_dispatch *d, int code, char *fmt, ...)
 {
   va_list args;
@@ -1944,7 +2835,7 @@ static int prepend_generic_katcp(struct katcp_dispatch *d, int reply)
   char *message, *string;
   int result;
 
-  message = arg_string_katcl(d->d_line, 0);
+  message = arg_string_katcp(d, 0);
   if((message == NULL) || (message[0] != KATCP_REQUEST)){
 #ifdef KATCP_STDERR_ERRORS
     fprintf(stderr, "prepend: arg0 is unavailable (%p)\n", message);
@@ -2077,6 +2968,10 @@ int append_vargs_katcp(struct katcp_dispatch *d, int flags, char *fmt, va_list a
   /* not copying vargs at works on my platform, but not on */
   /* all of them, so not sure how much copying is really needed */
 
+  if(this_flat_katcp(d)){
+    return append_vargs_flat_katcp(d, flags, fmt, args);
+  }
+
   va_copy(copy, args);
   result = append_vargs_katcl(d->d_line, flags, fmt, copy);
   va_end(copy);
@@ -2092,7 +2987,11 @@ int append_args_katcp(struct katcp_dispatch *d, int flags, char *fmt, ...)
   sane_katcp(d);
 
   va_start(args, fmt);
-  result = append_vargs_katcl(d->d_line, flags, fmt, args);
+  if(this_flat_katcp(d)){
+    result = append_vargs_flat_katcp(d, flags, fmt, args);
+  } else {
+    result = append_vargs_katcl(d->d_line, flags, fmt, args);
+  }
   va_end(args);
 
   return result;
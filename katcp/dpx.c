@@ -29,6 +29,8 @@
 #define KATCP_MAP_FLAG_HIDDEN   0x1
 #define KATCP_MAP_FLAG_GREEDY   0x2
 
+#define KATCP_MAP_CACHE          32 /* recent lookups remembered per map, power of two */
+
 #if 0
 #define KATCP_MAP_FLAG_REQUEST  0x10
 #define KATCP_MAP_FLAG_INFORM   0x20
@@ -54,6 +56,7 @@ struct katcp_cmd_item{
   unsigned int i_flags; 
   char *i_data;
   void (*i_clear)(void *data);
+  struct katcp_stats i_stats;
 };
 
 #include <avltree.h>
@@ -64,6 +67,7 @@ struct katcp_cmd_map{
   unsigned int m_refs;
   struct avl_tree *m_tree;
   struct katcp_cmd_item *m_fallback;
+  struct katcp_cmd_item *m_cache[KATCP_MAP_CACHE]; /* hashed by name, in front of the tree */
 };
 
 /********************************************************************/
@@ -107,7 +111,7 @@ void destroy_group_katcp(struct katcp_dispatch *d, struct katcp_group *g)
   }
 
   if(g->g_name){
-    free(g->g_name);
+    free_string_memory_katcp(KATCP_MEMORY_DUPLEX, g->g_name);
     g->g_name = NULL;
   }
 
@@ -132,7 +136,7 @@ void destroy_group_katcp(struct katcp_dispatch *d, struct katcp_group *g)
     }
   }
 
-  free(g);
+  free_memory_katcp(KATCP_MEMORY_DUPLEX, g, sizeof(struct katcp_group));
 }
 
 void destroy_groups_katcp(struct katcp_dispatch *d)
@@ -164,7 +168,7 @@ struct katcp_group *create_group_katcp(struct katcp_dispatch *d, char *name)
 
   s = d->d_shared;
 
-  g = malloc(sizeof(struct katcp_group));
+  g = malloc_memory_katcp(KATCP_MEMORY_DUPLEX, sizeof(struct katcp_group));
   if(g == NULL){
     return NULL;
   }
@@ -193,7 +197,7 @@ struct katcp_group *create_group_katcp(struct katcp_dispatch *d, char *name)
   /* s_fallback not set here, set up in default_ */
 
   if(name){
-    g->g_name = strdup(name);
+    g->g_name = strdup_memory_katcp(KATCP_MEMORY_DUPLEX, name);
     if(g->g_name == NULL){
       destroy_group_katcp(d, g);
       return NULL;
@@ -281,12 +285,12 @@ void destroy_cmd_item(struct katcp_cmd_item *i)
   }
 
   if(i->i_name){
-    free(i->i_name);
+    free_string_memory_katcp(KATCP_MEMORY_DUPLEX, i->i_name);
     i->i_name = NULL;
   }
 
   if(i->i_help){
-    free(i->i_help);
+    free_string_memory_katcp(KATCP_MEMORY_DUPLEX, i->i_help);
     i->i_help = NULL;
   }
 
@@ -300,7 +304,7 @@ void destroy_cmd_item(struct katcp_cmd_item *i)
 
   i->i_data = NULL;
 
-  free(i);
+  free_memory_katcp(KATCP_MEMORY_DUPLEX, i, sizeof(struct katcp_cmd_item));
 }
 
 void destroy_cmd_item_void(void *v)
@@ -328,10 +332,23 @@ void print_help_cmd_item(struct katcp_dispatch *d, char *key, void *v)
 
 }
 
+void print_stats_cmd_item(struct katcp_dispatch *d, char *key, void *v)
+{
+  struct katcp_cmd_item *i;
+
+  i = v;
+
+  if(i->i_stats.t_calls <= 0){
+    return;
+  }
+
+  print_stats_katcp(d, i->i_name, &(i->i_stats));
+}
+
 struct katcp_cmd_item *create_cmd_item(char *name, char *help, unsigned int flags, int (*call)(struct katcp_dispatch *d, int argc), void *data, void (*clear)(void *data)){
   struct katcp_cmd_item *i;
 
-  i = malloc(sizeof(struct katcp_cmd_item));
+  i = malloc_memory_katcp(KATCP_MEMORY_DUPLEX, sizeof(struct katcp_cmd_item));
   if(i == NULL){
     return NULL;
   }
@@ -345,8 +362,10 @@ struct katcp_cmd_item *create_cmd_item(char *name, char *help, unsigned int flag
   i->i_data = NULL;
   i->i_clear = NULL;
 
+  clear_stats_katcp(&(i->i_stats));
+
   if(name){
-    i->i_name = strdup(name);
+    i->i_name = strdup_memory_katcp(KATCP_MEMORY_DUPLEX, name);
     if(i->i_name == NULL){
       destroy_cmd_item(i);
       return NULL;
@@ -354,7 +373,7 @@ struct katcp_cmd_item *create_cmd_item(char *name, char *help, unsigned int flag
   }
 
   if(help){
-    i->i_help = strdup(help);
+    i->i_help = strdup_memory_katcp(KATCP_MEMORY_DUPLEX, help);
     if(i->i_help == NULL){
       destroy_cmd_item(i);
       return NULL;
@@ -398,11 +417,11 @@ void destroy_cmd_map(struct katcp_cmd_map *m)
   }
 
   if(m->m_name){
-    free(m->m_name);
+    free_string_memory_katcp(KATCP_MEMORY_DUPLEX, m->m_name);
     m->m_name = NULL;
   }
 
-  free(m);
+  free_memory_katcp(KATCP_MEMORY_DUPLEX, m, sizeof(struct katcp_cmd_map));
 }
 
 void hold_cmd_map(struct katcp_cmd_map *m)
@@ -416,8 +435,9 @@ void hold_cmd_map(struct katcp_cmd_map *m)
 struct katcp_cmd_map *create_cmd_map(char *name)
 {
   struct katcp_cmd_map *m;
+  unsigned int i;
 
-  m = malloc(sizeof(struct katcp_cmd_map));
+  m = malloc_memory_katcp(KATCP_MEMORY_DUPLEX, sizeof(struct katcp_cmd_map));
   if(m == NULL){
     return NULL;
   }
@@ -431,6 +451,10 @@ struct katcp_cmd_map *create_cmd_map(char *name)
   m->m_tree = NULL;
   m->m_fallback = NULL;
 
+  for(i = 0; i < KATCP_MAP_CACHE; i++){
+    m->m_cache[i] = NULL;
+  }
+
   m->m_tree = create_avltree();
   if(m->m_tree == NULL){
     destroy_cmd_map(m);
@@ -438,7 +462,7 @@ struct katcp_cmd_map *create_cmd_map(char *name)
   }
 
   if(name){
-    m->m_name = strdup(name);
+    m->m_name = strdup_memory_katcp(KATCP_MEMORY_DUPLEX, name);
     if(m->m_name == NULL){
       destroy_cmd_map(m);
       return NULL;
@@ -497,10 +521,33 @@ int add_cmd_map(struct katcp_cmd_map *m, char *name, char *help, int (*call)(str
   return add_full_cmd_map(m, name, help, 0, call, NULL, NULL);
 }
 
+static struct katcp_cmd_item *search_cmd_map(struct katcp_cmd_map *m, char *name, unsigned int hash)
+{
+  struct katcp_cmd_item *i;
+  unsigned int slot;
+
+  /* items are never removed from a live map, so a cached entry stays valid until the map goes */
+
+  slot = hash & (KATCP_MAP_CACHE - 1);
+
+  i = m->m_cache[slot];
+  if(i && (strcmp(i->i_name, name) == 0)){
+    return i;
+  }
+
+  i = find_data_avltree(m->m_tree, name);
+  if(i){
+    m->m_cache[slot] = i;
+  }
+
+  return i;
+}
+
 struct katcp_cmd_item *locate_cmd_item(struct katcp_flat *f, struct katcl_parse *p)
 {
   struct katcp_cmd_item *i;
-  struct katcp_cmd_map *m;
+  struct katcp_cmd_map *mf, *mg;
+  unsigned int hash;
   char *str;
 
   str = get_string_parse_katcl(p, 0);
@@ -508,21 +555,44 @@ struct katcp_cmd_item *locate_cmd_item(struct katcp_flat *f, struct katcl_parse
     return NULL;
   }
 
-  if(str[0] == '\0'){
+  if((str[0] == '\0') || (str[1] == '\0')){
     return NULL;
   }
 
-#if 1
-  /* map not initialised */
-  return NULL;
+  if((f->f_current_map < 0) || (f->f_current_map >= KATCP_SIZE_MAP)){
+#ifdef KATCP_CONSISTENCY_CHECKS
+    fprintf(stderr, "logic failure: locating command %s without a valid map set\n", str);
+    abort();
 #endif
+    return NULL;
+  }
 
-  i = find_data_avltree(m->m_tree, str + 1);
-  if(i){
-    return i;
+  /* commands specific to a flat are found first, the rest come from its group */
+
+  mf = f->f_maps[f->f_current_map];
+  mg = f->f_group ? f->f_group->g_maps[f->f_current_map] : NULL;
+
+  hash = hash_name_katcm(str + 1);
+
+  if(mf){
+    i = search_cmd_map(mf, str + 1, hash);
+    if(i){
+      return i;
+    }
+  }
+
+  if(mg && (mg != mf)){
+    i = search_cmd_map(mg, str + 1, hash);
+    if(i){
+      return i;
+    }
   }
 
-  return m->m_fallback;
+  if(mf && mf->m_fallback){
+    return mf->m_fallback;
+  }
+
+  return mg ? mg->m_fallback : NULL;
 }
 
 /* duplex setup *****************************************************/
@@ -639,7 +709,7 @@ static void deallocate_flat_katcp(struct katcp_dispatch *d, struct katcp_flat *f
   }
 
   if(f->f_name){
-    free(f->f_name);
+    free_string_memory_katcp(KATCP_MEMORY_DUPLEX, f->f_name);
     f->f_name = NULL;
   }
 
@@ -693,7 +763,7 @@ static void deallocate_flat_katcp(struct katcp_dispatch *d, struct katcp_flat *f
 
   f->f_magic = 0;
 
-  free(f);
+  free_memory_katcp(KATCP_MEMORY_DUPLEX, f, sizeof(struct katcp_flat));
 }
 
 static void destroy_flat_katcp(struct katcp_dispatch *d, struct katcp_flat *f)
@@ -742,6 +812,7 @@ int process_parse_flat_katcp(struct katcp_dispatch *d, struct katcp_flat *fx)
   struct katcp_response_handler *rh;
   struct katcp_cmd_map *mx;
   struct katcp_cmd_item *ix;
+  struct timeval start;
   char *str;
 
   sane_flat_katcp(fx);
@@ -805,12 +876,16 @@ int process_parse_flat_katcp(struct katcp_dispatch *d, struct katcp_flat *fx)
 
       log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "attempting to match %s to %s tree", str + 1, (fx->f_current_direction == KATCP_DIRECTION_INNER) ? "internal" : "remote");
 
-      ix = find_data_avltree(mx->m_tree, str + 1);
+      ix = locate_cmd_item(fx, fx->f_rx);
       if(ix && ix->i_call){
         if((overridden == 0) || (ix->i_flags & KATCP_MAP_FLAG_GREEDY)){
 
+          monotonic_time_katcp(&start);
+
           result = (*(ix->i_call))(d, argc);
 
+          record_stats_katcp(&(ix->i_stats), &start, result);
+
           log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "%s callback invocation returns %d", (fx->f_current_direction == KATCP_DIRECTION_INNER) ? "internal" : "remote", result);
 
 #if 0
@@ -899,6 +974,14 @@ int wake_endpoint_peer_flat_katcp(struct katcp_dispatch *d, struct katcp_endpoin
     fx->f_current_direction = KATCP_DIRECTION_INNER;
   }
 
+  if((fx->f_current_direction == KATCP_DIRECTION_REMOTE) && fx->f_remote && busy_endpoint_katcp(d, fx->f_remote)){
+    /* earlier output, eg the reply of a resumed request, still has to go out ahead of anything a new request writes directly */
+    if(is_request_parse_katcl(parse_of_endpoint_katcp(d, msg))){
+      fx->f_current_direction = KATCP_DIRECTION_INVALID;
+      return KATCP_RESULT_YIELD;
+    }
+  }
+
   fx->f_rx = parse_of_endpoint_katcp(d, msg);
   if(fx->f_rx == NULL){
     /* won't do anything with a message which doesn't have a payload */
@@ -963,6 +1046,8 @@ int wake_endpoint_peer_flat_katcp(struct katcp_dispatch *d, struct katcp_endpoin
 
   result = process_parse_flat_katcp(d, fx);
 
+  fx->f_rx = NULL;
+
   return result;
 }
 
@@ -1056,7 +1141,7 @@ struct katcp_flat *create_flat_katcp(struct katcp_dispatch *d, int fd, int up, c
 
   gx->g_flats = tmp;
 
-  f = malloc(sizeof(struct katcp_flat));
+  f = malloc_memory_katcp(KATCP_MEMORY_DUPLEX, sizeof(struct katcp_flat));
   if(f == NULL){
     return NULL;
   }
@@ -1072,6 +1157,7 @@ struct katcp_flat *create_flat_katcp(struct katcp_dispatch *d, int fd, int up, c
   f->f_exit_code = 0; /* WARNING: should technically be a fail, to catch cases where it isn't set at exit time */
 
   f->f_log_level = s->s_default;
+  lower_log_floor_katcp(s, f->f_log_level);
 
   f->f_peer = NULL;
   f->f_remote = NULL;
@@ -1102,8 +1188,12 @@ struct katcp_flat *create_flat_katcp(struct katcp_dispatch *d, int fd, int up, c
 
   f->f_group = NULL;
 
+  f->f_deficit = 0;
+  f->f_throttle = 0;
+  f->f_throttled = 0;
+
   if(name){
-    f->f_name = strdup(name);
+    f->f_name = strdup_memory_katcp(KATCP_MEMORY_DUPLEX, name);
     if(f->f_name == NULL){
       destroy_flat_katcp(d, f);
       return NULL;
@@ -1123,6 +1213,8 @@ struct katcp_flat *create_flat_katcp(struct katcp_dispatch *d, int fd, int up, c
     return NULL;
   }
 
+  forget_poll_katcp(d->d_shared, fd);
+
   f->f_line = create_katcl(fd);
   if(f->f_line == NULL){
     destroy_flat_katcp(d, f);
@@ -1758,10 +1850,41 @@ int append_parse_flat_katcp(struct katcp_dispatch *d, struct katcl_parse *p)
   return finish_append_flat_katcp(d, KATCP_FLAG_LAST, 0);
 }
 
-#if 0
 int append_vargs_flat_katcp(struct katcp_dispatch *d, int flags, char *fmt, va_list args)
+{
+  struct katcl_parse *px;
+  struct katcp_flat *fx;
+  int result;
+  va_list copy;
+
+  fx = require_flat_katcp(d);
+  if(fx == NULL){
+    return -1;
+  }
+
+  px = prepare_append_flat_katcp(fx, flags);
+  if(px == NULL){
+    return -1;
+  }
+
+  va_copy(copy, args);
+  result = add_vargs_parse_katcl(px, flags, fmt, copy);
+  va_end(copy);
+
+  return finish_append_flat_katcp(d, flags, result);
+}
+
 int append_args_flat_katcp(struct katcp_dispatch *d, int flags, char *fmt, ...)
-#endif
+{
+  va_list args;
+  int result;
+
+  va_start(args, fmt);
+  result = append_vargs_flat_katcp(d, flags, fmt, args);
+  va_end(args);
+
+  return result;
+}
 
 /**************************************************************************/
 /* mainloop related logic *************************************************/
@@ -1805,25 +1928,21 @@ int load_flat_katcp(struct katcp_dispatch *d)
           break;
 
         case FLAT_STATE_CONNECTING : 
-          FD_SET(fd, &(s->s_write));
-          if(fd > s->s_max){
-            s->s_max = fd;
-          }
+          want_poll_katcp(s, fd, KATCP_POLL_WRITE);
           break;
 
         case FLAT_STATE_UP : 
-          FD_SET(fd, &(s->s_read));
-          if(fd > s->s_max){
-            s->s_max = fd;
+          if(f->f_throttle){
+            /* still has input left over, let tcp push back on the sender */
+            mark_busy_katcp(d);
+          } else {
+            want_poll_katcp(s, fd, KATCP_POLL_READ);
           }
           /* WARNING: fall */
 
         case FLAT_STATE_DRAIN :
           if(flushing_katcl(f->f_line)){
-            FD_SET(fd, &(s->s_write));
-            if(fd > s->s_max){
-              s->s_max = fd;
-            }
+            want_poll_katcp(s, fd, KATCP_POLL_WRITE);
             break;
           } 
 
@@ -1870,7 +1989,7 @@ int run_flat_katcp(struct katcp_dispatch *d)
   struct katcp_shared *s;
   struct katcl_parse *px;
   struct katcp_group *gx;
-  unsigned int i, j, len;
+  unsigned int i, j, len, before, burst;
   int fd, result, code, acknowledge;
 
   s = d->d_shared;
@@ -1886,7 +2005,7 @@ int run_flat_katcp(struct katcp_dispatch *d)
 
       fd = fileno_katcl(fx->f_line);
 
-      if(FD_ISSET(fd, &(s->s_write))){
+      if(ready_poll_katcp(s, fd, KATCP_POLL_WRITE)){
         /* resume connect */
         if(fx->f_state == FLAT_STATE_CONNECTING){
           result = getsockopt(fd, SOL_SOCKET, SO_ERROR, &code, &len);
@@ -1913,42 +2032,70 @@ int run_flat_katcp(struct katcp_dispatch *d)
         }
       }
 
-      if(FD_ISSET(fd, &(s->s_read))){
+      if(ready_poll_katcp(s, fd, KATCP_POLL_READ)){
         /* acquire data */
         if(read_katcl(fx->f_line) < 0){
           fx->f_state = FLAT_STATE_DEAD;
         }
-        /* load all data into request queue, all processing happens in the endpoint */
-        while((result = parse_katcl(fx->f_line)) > 0){
-          px = ready_katcl(fx->f_line);
+      } else if(fx->f_throttle == 0){
+        continue;
+      }
+
+      /* deficit round robin: each iteration a connection gets a quantum of input bytes to parse, and carries over what it overspends */
+      fx->f_deficit += s->s_flat_quantum;
+      burst = 0;
+
+      /* load data into request queue, all processing happens in the endpoint */
+      while((fx->f_deficit > 0) && (burst < s->s_flat_burst)){
+        before = buffered_katcl(fx->f_line);
+        if((result = parse_katcl(fx->f_line)) <= 0){
+          break;
+        }
+        burst++;
+        fx->f_deficit -= (long)(before - buffered_katcl(fx->f_line));
+
+        px = ready_katcl(fx->f_line);
 #ifdef KATCP_CONSISTENCY_CHECKS
-          if(px == NULL){
-            fprintf(stderr, "flat: logic problem - parse claims data, but ready returns none\n");
-            abort();
-          }
+        if(px == NULL){
+          fprintf(stderr, "flat: logic problem - parse claims data, but ready returns none\n");
+          abort();
+        }
 #endif
-          if(is_request_parse_katcl(px)){
-            acknowledge = 1;
-          } else {
-            acknowledge = 0;
-          }
+        if(is_request_parse_katcl(px)){
+          acknowledge = 1;
+        } else {
+          acknowledge = 0;
+        }
 
-          log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "sending network message to endpoint %p", fx->f_peer);
+        log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "sending network message to endpoint %p", fx->f_peer);
 
-          if(send_message_endpoint_katcp(d, fx->f_remote, fx->f_peer, px, acknowledge) < 0){
-            log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to enqueue remote message");
-            break;
+        if(send_message_endpoint_katcp(d, fx->f_remote, fx->f_peer, px, acknowledge) < 0){
+          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to enqueue remote message");
+          break;
 
-            /* TODO: this should trigger a shutdown of this connection, being unable to send ourselves a message */
+          /* TODO: this should trigger a shutdown of this connection, being unable to send ourselves a message */
 
-          }
+        }
 
-          show_endpoint_katcp(d, "peer", KATCP_LEVEL_TRACE, fx->f_peer);
+        show_endpoint_katcp(d, "peer", KATCP_LEVEL_TRACE, fx->f_peer);
 
-          /* TODO: check the size of the queue, give up if it has grown to unreasonable */
+        /* TODO: check the size of the queue, give up if it has grown to unreasonable */
 
-          clear_katcl(fx->f_line);
+        clear_katcl(fx->f_line);
+      }
+
+      if((fx->f_state == FLAT_STATE_UP) && (buffered_katcl(fx->f_line) > 0) && ((fx->f_deficit <= 0) || (burst >= s->s_flat_burst))){
+        /* out of budget: resume parsing next iteration, without reading more in the meantime */
+        if(fx->f_deficit > (long)(s->s_flat_quantum)){
+          fx->f_deficit = s->s_flat_quantum; /* many small messages, limited by the burst */
         }
+        fx->f_throttled++;
+        fx->f_throttle = 1;
+        mark_busy_katcp(d);
+      } else {
+        /* an idle connection does not get to save up credit */
+        fx->f_throttle = 0;
+        fx->f_deficit = 0;
       }
 
     }
@@ -1964,7 +2111,7 @@ int accept_flat_katcp(struct katcp_dispatch *d, struct katcp_arb *a, unsigned in
 #define LABEL_BUFFER 32
   int fd, nfd;
   unsigned int len;
-  struct sockaddr_in sa;
+  struct sockaddr_storage sa;
   struct katcp_flat *f;
   struct katcp_group *gx;
   char label[LABEL_BUFFER];
@@ -1977,7 +2124,7 @@ int accept_flat_katcp(struct katcp_dispatch *d, struct katcp_arb *a, unsigned in
     return 0;
   }
 
-  len = sizeof(struct sockaddr_in);
+  len = sizeof(struct sockaddr_storage);
   nfd = accept(fd, (struct sockaddr *) &sa, &len);
 
   if(nfd < 0){
@@ -1997,8 +2144,7 @@ int accept_flat_katcp(struct katcp_dispatch *d, struct katcp_arb *a, unsigned in
     opts = fcntl(nfd, F_SETFL, opts | O_NONBLOCK);
   }
 
-  snprintf(label, LABEL_BUFFER, "%s:%d", inet_ntoa(sa.sin_addr), ntohs(sa.sin_port));
-  label[LABEL_BUFFER - 1] = '\0';
+  net_label(label, LABEL_BUFFER, (struct sockaddr *) &sa, nfd);
 
   log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "accepted new connection from %s via %s", label, name_arb_katcp(d, a));
 
@@ -2119,9 +2265,38 @@ int list_duplex_cmd_katcp(struct katcp_dispatch *d, int argc)
       }
       log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "%s has log level %d", fx->f_name, fx->f_log_level);
       log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "%s is part of group %p", fx->f_name, fx->f_group);
+      log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "%s ran out of input budget in %lu iterations%s", fx->f_name, fx->f_throttled, fx->f_throttle ? ", currently throttled" : "");
+    }
+  }
+
+  return KATCP_RESULT_OK;
+}
+
+int budget_duplex_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_shared *s;
+  unsigned int burst, quantum;
+
+  s = d->d_shared;
+
+  if(argc > 1){
+    if(argc < 3){
+      return extra_response_katcp(d, KATCP_RESULT_INVALID, "usage");
     }
+
+    burst = arg_unsigned_long_katcp(d, 1);
+    quantum = arg_unsigned_long_katcp(d, 2);
+
+    if((burst == 0) || (quantum == 0)){
+      return extra_response_katcp(d, KATCP_RESULT_INVALID, "budgets need to be nonzero");
+    }
+
+    s->s_flat_burst = burst;
+    s->s_flat_quantum = quantum;
   }
 
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "each connection may parse %u messages or %u bytes per iteration", s->s_flat_burst, s->s_flat_quantum);
+
   return KATCP_RESULT_OK;
 }
 
@@ -2183,6 +2358,45 @@ int help_group_cmd_katcp(struct katcp_dispatch *d, int argc)
   return KATCP_RESULT_OK;
 }
 
+int command_stats_group_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_flat *fx;
+  struct katcp_cmd_item *i;
+  struct katcp_cmd_map *mx;
+  char *name;
+
+  fx = require_flat_katcp(d);
+  if(fx == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "command stats group called outside expected path");
+    return KATCP_RESULT_FAIL;
+  }
+
+  mx = map_of_flat_katcp(fx);
+  if(mx == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no map to be found for client %s", fx->f_name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  name = arg_string_katcp(d, 1);
+  if(name == NULL){
+    if(mx->m_tree){
+      print_inorder_avltree(d, mx->m_tree->t_root, &print_stats_cmd_item, 0);
+    }
+  } else {
+    if(name[0] == KATCP_REQUEST){
+      name++;
+    }
+    i = find_data_avltree(mx->m_tree, name);
+    if(i == NULL){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no match for %s found", name);
+      return KATCP_RESULT_FAIL;
+    }
+    print_stats_katcp(d, i->i_name, &(i->i_stats));
+  }
+
+  return KATCP_RESULT_OK;
+}
+
 int watchdog_group_cmd_katcp(struct katcp_dispatch *d, int argc)
 {
   log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "fielding %s ping request", is_inner_flat_katcp(d) ? "internal" : "remote");
@@ -2208,11 +2422,12 @@ int complete_relay_watchdog_group_cmd_katcp(struct katcp_dispatch *d, int argc)
     return extra_response_katcp(d, KATCP_RESULT_INVALID, "usage");
   }
 
-  if(strcmp(code, KATCP_OK)){
-    return KATCP_RESULT_FAIL;
+  /* the reply belongs to the paused relay-watchdog request, complete that one */
+  if(resume_endpoint_katcp(d, peer_of_flat_katcp(d, fx), strcmp(code, KATCP_OK) ? KATCP_RESULT_FAIL : KATCP_RESULT_OK, NULL) < 0){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "no paused relay request to complete");
   }
 
-  return KATCP_RESULT_OK;
+  return KATCP_RESULT_OWN;
 }
 
 int relay_watchdog_group_cmd_katcp(struct katcp_dispatch *d, int argc)
@@ -2268,13 +2483,9 @@ int relay_watchdog_group_cmd_katcp(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
-  /* WARNING: broken - will currently not resume, despite returning an ok ... */
+  /* completion logic resumes us once the reply arrives */
 
-#if 1
   return KATCP_RESULT_PAUSE;
-#else
-  return KATCP_RESULT_OK;
-#endif
 }
 
 /*********************************************************************************/
@@ -2283,15 +2494,13 @@ int complete_relay_generic_group_cmd_katcp(struct katcp_dispatch *d, int argc)
 {
   struct katcp_flat *fx;
   struct katcl_parse *px;
-  char *cmd;
+  char *cmd, *code;
 
-#ifdef KATCP_CONSISTENCY_CHECKS
   fx = require_flat_katcp(d);
   if(fx == NULL){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "could not retrive current session detail");
     return extra_response_katcp(d, KATCP_RESULT_FAIL, "cmd not run within a session");
   }
-#endif
 
   cmd = arg_string_katcp(d, 0);
   if(cmd == NULL){
@@ -2309,10 +2518,14 @@ int complete_relay_generic_group_cmd_katcp(struct katcp_dispatch *d, int argc)
   append_parse_katcp(d, px);
 
   if(is_reply_parse_katcl(px)){
-    return KATCP_RESULT_OWN;
+    code = arg_string_katcp(d, 1);
+    if(resume_endpoint_katcp(d, peer_of_flat_katcp(d, fx), (code && !strcmp(code, KATCP_OK)) ? KATCP_RESULT_OK : KATCP_RESULT_FAIL, NULL) < 0){
+      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "no paused relay request to complete");
+    }
   }
 
-  return KATCP_RESULT_PAUSE;
+  /* informs are consumed here too, the relay request stays paused */
+  return KATCP_RESULT_OWN;
 }
 
 int relay_generic_group_cmd_katcp(struct katcp_dispatch *d, int argc)
@@ -2390,13 +2603,323 @@ int relay_generic_group_cmd_katcp(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
-  /* WARNING: broken - will currently not resume, despite returning an ok ... */
+  /* completion logic resumes us once the reply arrives */
+
+  return KATCP_RESULT_PAUSE;
+}
+
+/* scatter a request to all members of a group, gather the replies **/
+
+#define KATCP_GATHER_DEADLINE  5000 /* ms to wait for all members to reply */
+
+struct katcp_gather_member{
+  struct katcp_endpoint *m_endpoint;
+  char *m_name;
+  int m_pending;
+};
+
+struct katcp_gather{
+  struct katcp_endpoint *g_endpoint; /* receives the replies */
+  struct katcp_endpoint *g_origin;   /* paused with the relay-group request */
+  struct katcp_endpoint *g_remote;   /* where status informs go */
+
+  struct katcp_gather_member *g_members;
+  unsigned int g_count;
+  unsigned int g_pending;
+  unsigned int g_failed;
+};
+
+static void destroy_gather_katcp(struct katcp_dispatch *d, struct katcp_gather *gx)
+{
+  unsigned int i;
+
+  for(i = 0; i < gx->g_count; i++){
+    if(gx->g_members[i].m_endpoint){
+      forget_endpoint_katcp(d, gx->g_members[i].m_endpoint);
+      gx->g_members[i].m_endpoint = NULL;
+    }
+    if(gx->g_members[i].m_name){
+      free(gx->g_members[i].m_name);
+      gx->g_members[i].m_name = NULL;
+    }
+  }
+
+  if(gx->g_members){
+    free(gx->g_members);
+    gx->g_members = NULL;
+  }
+  gx->g_count = 0;
+
+  if(gx->g_origin){
+    forget_endpoint_katcp(d, gx->g_origin);
+    gx->g_origin = NULL;
+  }
+
+  if(gx->g_remote){
+    forget_endpoint_katcp(d, gx->g_remote);
+    gx->g_remote = NULL;
+  }
+
+  if(gx->g_endpoint){
+    /* late replies get collected once released */
+    release_endpoint_katcp(d, gx->g_endpoint);
+    gx->g_endpoint = NULL;
+  }
+
+  free(gx);
+}
+
+static void status_gather_katcp(struct katcp_dispatch *d, struct katcp_gather *gx, struct katcp_gather_member *mx, char *code, char *extra)
+{
+  struct katcl_parse *px;
+
+  px = create_parse_katcl();
+  if(px == NULL){
+    return;
+  }
+
+  add_string_parse_katcl(px, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#relay-group");
+  add_string_parse_katcl(px, KATCP_FLAG_STRING, mx->m_name);
+  add_string_parse_katcl(px, KATCP_FLAG_STRING | (extra ? 0 : KATCP_FLAG_LAST), code);
+  if(extra){
+    add_string_parse_katcl(px, KATCP_FLAG_LAST | KATCP_FLAG_STRING, extra);
+  }
+
+  if(send_message_endpoint_katcp(d, gx->g_endpoint, gx->g_remote, px, 0) < 0){
+    destroy_parse_katcl(px);
+  }
+}
+
+static void finish_gather_katcp(struct katcp_dispatch *d, struct katcp_gather *gx)
+{
+  struct katcp_gather_member *mx;
+  unsigned int i;
+
+  discharge_timer_katcp(d, gx);
+
+  for(i = 0; i < gx->g_count; i++){
+    mx = &(gx->g_members[i]);
+    if(mx->m_pending){
+      mx->m_pending = 0;
+      gx->g_failed++;
+      status_gather_katcp(d, gx, mx, KATCP_FAIL, "deadline");
+    }
+  }
+  gx->g_pending = 0;
+
+  if(gx->g_failed > 0){
+    resume_endpoint_katcp(d, gx->g_origin, KATCP_RESULT_FAIL, "%u of %u members did not succeed", gx->g_failed, gx->g_count);
+  } else {
+    resume_endpoint_katcp(d, gx->g_origin, KATCP_RESULT_OK, "%u", gx->g_count);
+  }
+
+  destroy_gather_katcp(d, gx);
+}
+
+static int deadline_gather_katcp(struct katcp_dispatch *d, void *data)
+{
+  struct katcp_gather *gx;
+
+  gx = data;
+
+  log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "only %u of %u members replied by the relay deadline", gx->g_count - gx->g_pending, gx->g_count);
+
+  finish_gather_katcp(d, gx);
+
+  return 0;
+}
+
+static int wake_gather_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep, struct katcp_message *msg, void *data)
+{
+  struct katcp_gather *gx;
+  struct katcp_gather_member *mx;
+  struct katcp_endpoint *source;
+  struct katcl_parse *px;
+  char *code, *extra;
+  unsigned int i;
+
+  gx = data;
+
+  px = parse_of_endpoint_katcp(d, msg);
+  if((px == NULL) || !is_reply_parse_katcl(px)){
+    /* members may emit informs while working, only the reply counts */
+    return KATCP_RESULT_OWN;
+  }
+
+  source = source_endpoint_katcp(d, msg);
+
+  for(i = 0; (i < gx->g_count) && (gx->g_members[i].m_endpoint != source); i++);
+  if(i >= gx->g_count){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "relay received a reply from a non-member");
+    return KATCP_RESULT_OWN;
+  }
+
+  mx = &(gx->g_members[i]);
+  if(mx->m_pending == 0){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "relay received duplicate reply from %s", mx->m_name);
+    return KATCP_RESULT_OWN;
+  }
+
+  code = get_string_parse_katcl(px, 1);
+  extra = get_string_parse_katcl(px, 2);
+
+  mx->m_pending = 0;
+  gx->g_pending--;
+  if((code == NULL) || strcmp(code, KATCP_OK)){
+    gx->g_failed++;
+  }
+
+  status_gather_katcp(d, gx, mx, code ? code : KATCP_FAIL, extra);
+
+  if(gx->g_pending == 0){
+    finish_gather_katcp(d, gx);
+  }
+
+  return KATCP_RESULT_OWN;
+}
+
+int relay_group_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_flat *fx, *fy;
+  struct katcp_group *gy;
+  struct katcp_gather *gx;
+  struct katcp_gather_member *mx;
+  struct katcp_endpoint **targets;
+  struct katcl_parse *px, *po;
+  struct timeval tv;
+  char *group, *cmd;
+  unsigned int i;
+
+  if(argc < 3){
+    return extra_response_katcp(d, KATCP_RESULT_INVALID, "usage");
+  }
+
+  group = arg_string_katcp(d, 1);
+  cmd = arg_string_katcp(d, 2);
+  if((group == NULL) || (cmd == NULL)){
+    return extra_response_katcp(d, KATCP_RESULT_INVALID, "usage");
+  }
+
+  fx = require_flat_katcp(d);
+  if(fx == NULL){
+    return extra_response_katcp(d, KATCP_RESULT_FAIL, "cmd not run within a session");
+  }
+
+  gy = find_group_katcp(d, group);
+  if(gy == NULL){
+    return extra_response_katcp(d, KATCP_RESULT_FAIL, "no group %s", group);
+  }
+
+  po = arg_parse_katcp(d);
+  if(po == NULL){
+    return extra_response_katcp(d, KATCP_RESULT_FAIL, "internal");
+  }
+
+  px = create_parse_katcl();
+  if(px == NULL){
+    return extra_response_katcp(d, KATCP_RESULT_FAIL, "allocation");
+  }
+
+  /* request name and parameters as given to us */
+  if(cmd[0] == KATCP_REQUEST){
+    add_string_parse_katcl(px, KATCP_FLAG_FIRST | ((argc > 3) ? 0 : KATCP_FLAG_LAST) | KATCP_FLAG_STRING, cmd);
+  } else {
+    add_args_parse_katcl(px, KATCP_FLAG_FIRST | ((argc > 3) ? 0 : KATCP_FLAG_LAST) | KATCP_FLAG_STRING, "%c%s", KATCP_REQUEST, cmd);
+  }
+  for(i = 3; i < argc; i++){
+    add_parameter_parse_katcl(px, (i + 1 < argc) ? 0 : KATCP_FLAG_LAST, po, i);
+  }
+
+  gx = malloc(sizeof(struct katcp_gather));
+  targets = malloc(sizeof(struct katcp_endpoint *) * (gy->g_count + 1));
+  if((gx == NULL) || (targets == NULL)){
+    if(gx){
+      free(gx);
+    }
+    if(targets){
+      free(targets);
+    }
+    destroy_parse_katcl(px);
+    return extra_response_katcp(d, KATCP_RESULT_FAIL, "allocation");
+  }
+
+  gx->g_endpoint = NULL;
+  gx->g_origin = NULL;
+  gx->g_remote = NULL;
+  gx->g_count = 0;
+  gx->g_pending = 0;
+  gx->g_failed = 0;
+
+  gx->g_members = malloc(sizeof(struct katcp_gather_member) * (gy->g_count + 1));
+  if(gx->g_members == NULL){
+    free(targets);
+    destroy_gather_katcp(d, gx);
+    destroy_parse_katcl(px);
+    return extra_response_katcp(d, KATCP_RESULT_FAIL, "allocation");
+  }
+
+  for(i = 0; i < gy->g_count; i++){
+    fy = gy->g_flats[i];
+    if((fy == fx) || (fy->f_state != FLAT_STATE_UP) || (fy->f_peer == NULL)){
+      continue;
+    }
+
+    mx = &(gx->g_members[gx->g_count]);
+
+    mx->m_name = strdup(fy->f_name ? fy->f_name : "anonymous");
+    if(mx->m_name == NULL){
+      continue;
+    }
+    mx->m_endpoint = fy->f_peer;
+    reference_endpoint_katcp(d, mx->m_endpoint);
+    mx->m_pending = 1;
+
+    targets[gx->g_count] = fy->f_peer;
+    gx->g_count++;
+  }
+
+  if(gx->g_count == 0){
+    free(targets);
+    destroy_gather_katcp(d, gx);
+    destroy_parse_katcl(px);
+    return extra_response_katcp(d, KATCP_RESULT_FAIL, "no members to relay to");
+  }
+
+  gx->g_endpoint = create_endpoint_katcp(d, &wake_gather_katcp, NULL, gx);
+  if(gx->g_endpoint == NULL){
+    free(targets);
+    destroy_gather_katcp(d, gx);
+    destroy_parse_katcl(px);
+    return extra_response_katcp(d, KATCP_RESULT_FAIL, "allocation");
+  }
+
+  gx->g_origin = fx->f_peer;
+  reference_endpoint_katcp(d, gx->g_origin);
+  gx->g_remote = fx->f_remote;
+  reference_endpoint_katcp(d, gx->g_remote);
+
+  /* one parse for all of them, each member gets its own acknowledged message */
+  if(multicast_message_endpoint_katcp(d, gx->g_endpoint, targets, gx->g_count, px, 1) < 0){
+    free(targets);
+    destroy_gather_katcp(d, gx);
+    destroy_parse_katcl(px);
+    return extra_response_katcp(d, KATCP_RESULT_FAIL, "unable to relay");
+  }
+
+  free(targets);
+
+  gx->g_pending = gx->g_count;
+
+  component_time_katcp(&tv, KATCP_GATHER_DEADLINE);
+  if(register_in_tv_katcp(d, &tv, &deadline_gather_katcp, gx) < 0){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to set relay deadline, will wait for all replies");
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "relayed %s to %u members of group %s", cmd, gx->g_count, group);
+
+  /* resumed once all members have replied, or at the deadline */
 
-#if 1
   return KATCP_RESULT_PAUSE;
-#else
-  return KATCP_RESULT_OK;
-#endif
 }
 
 /* uses previously defined commands *********************************/
@@ -2426,9 +2949,12 @@ int setup_default_group(struct katcp_dispatch *d, char *name)
 
     add_full_cmd_map(m, "help", "display help messages (?help [command])", 0, &help_group_cmd_katcp, NULL, NULL);
     add_full_cmd_map(m, "watchdog", "pings the system (?watchdog)", 0, &watchdog_group_cmd_katcp, NULL, NULL);
+    add_full_cmd_map(m, "command-stats", "display request call counts and latencies (?command-stats [command])", 0, &command_stats_group_cmd_katcp, NULL, NULL);
     add_full_cmd_map(m, "relay-watchdog", "ping a peer within the same process (?relay-watchdog peer)", 0, &relay_watchdog_group_cmd_katcp, NULL, NULL);
     add_full_cmd_map(m, "relay", "issue a request to a peer within the same process (?relay peer cmd)", 0, &relay_generic_group_cmd_katcp, NULL, NULL);
+    add_full_cmd_map(m, "relay-group", "issue a request to all other members of a group and gather their replies (?relay-group group cmd [args])", 0, &relay_group_cmd_katcp, NULL, NULL);
     add_full_cmd_map(m, "list-duplex", "display active connection detail (?list-duplex)", 0, &list_duplex_cmd_katcp, NULL, NULL);
+    add_full_cmd_map(m, "budget-duplex", "display or set the input parsed per connection and loop iteration (?budget-duplex [messages bytes])", 0, &budget_duplex_cmd_katcp, NULL, NULL);
   } else {
     m = gx->g_maps[KATCP_MAP_REMOTE_REQUEST];
   }
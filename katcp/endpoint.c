@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdlib.h>
+#include <stdarg.h>
 
 #include <unistd.h>
 
@@ -14,11 +15,19 @@
 #include <katpriv.h>
 #include <katcl.h>
 
-#define ENDPOINT_PRECEDENCE_LOW    0
-#define ENDPOINT_PRECEDENCE_HIGH   0
+/* each type of message gets its own fifo in the queue */
+#define ENDPOINT_LEVEL_REQUEST     0
+#define ENDPOINT_LEVEL_INFORM      1
+#define ENDPOINT_LEVEL_REPLY       2
+
+/* while a request is paused only informs and replies get through */
+#define ENDPOINT_PRECEDENCE_LOW    ENDPOINT_LEVEL_REQUEST
+#define ENDPOINT_PRECEDENCE_HIGH   ENDPOINT_LEVEL_INFORM
 
 #define KATCP_MESSAGE_WACK    0x1 /* wants a reply, even if other side has gone away */
 
+#define ENDPOINT_SPARE_MESSAGES  128 /* destroyed messages kept for reuse */
+
 #define ENDPOINT_FLAG_MALLOCED 0x1
 #define ENDPOINT_FLAG_UP    0x2
 
@@ -59,13 +68,24 @@ static void precedence_endpoint_katcp(struct katcp_dispatch *d, struct katcp_end
 
 static struct katcp_message *create_message_katcp(struct katcp_dispatch *d, struct katcp_endpoint *from, struct katcp_endpoint *to, struct katcl_parse *px, int acknowledged)
 {
+  struct katcp_shared *s;
   struct katcp_message *msg;
 
-  msg = malloc(sizeof(struct katcp_message));
-  if(msg == NULL){
-    return NULL;
+  s = d->d_shared;
+
+  if(s->s_spare){
+    msg = s->s_spare;
+    s->s_spare = msg->m_next;
+    s->s_spares--;
+  } else {
+    msg = malloc(sizeof(struct katcp_message));
+    if(msg == NULL){
+      return NULL;
+    }
   }
 
+  msg->m_next = NULL;
+
   msg->m_flags = 0;
   if(acknowledged){
 #ifdef KATCP_CONSISTENCY_CHECKS
@@ -91,6 +111,7 @@ static struct katcp_message *create_message_katcp(struct katcp_dispatch *d, stru
   msg->m_to    = to;
   reference_endpoint_katcp(d, to);
 
+  /* only a reference, many messages may share the same parse */
   msg->m_parse = copy_parse_katcl(px);
   if(msg->m_parse == NULL){
     destroy_message_katcp(d, msg);
@@ -120,11 +141,16 @@ static int queue_message_katcp(struct katcp_dispatch *d, struct katcp_message *m
     return -1;
   }
 
+  /* the destination may already have been visited in this pass */
+  mark_busy_katcp(d);
+
   return 0;
 }
 
 static void destroy_message_katcp(struct katcp_dispatch *d, struct katcp_message *msg)
 {
+  struct katcp_shared *s;
+
   if(msg == NULL){
 #ifdef KATCP_CONSISTENCY_CHECKS
     fprintf(stderr, "endpoint: attempting to destroy null message\n");
@@ -155,7 +181,33 @@ static void destroy_message_katcp(struct katcp_dispatch *d, struct katcp_message
     msg->m_to = NULL;
   }
 
-  free(msg);
+  msg->m_flags = 0;
+
+  s = d->d_shared;
+
+  if(s->s_spares < ENDPOINT_SPARE_MESSAGES){
+    msg->m_next = s->s_spare;
+    s->s_spare = msg;
+    s->s_spares++;
+  } else {
+    free(msg);
+  }
+}
+
+static void release_spare_messages_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_shared *s;
+  struct katcp_message *msg;
+
+  s = d->d_shared;
+
+  while(s->s_spare){
+    msg = s->s_spare;
+    s->s_spare = msg->m_next;
+    free(msg);
+  }
+
+  s->s_spares = 0;
 }
 
 /* message sending api function ***********************************************/
@@ -190,6 +242,45 @@ int send_message_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint
   return 0;
 }
 
+int multicast_message_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *from, struct katcp_endpoint **to, unsigned int count, struct katcl_parse *px, int acknowledged)
+{
+  /* the same parse goes to all the targets, each only costs a message, returns the number queued */
+  /* as for a single send, an unreferenced parse ends up owned by the messages */
+  struct katcp_message *msg;
+  unsigned int i, sent;
+
+  sent = 0;
+
+  for(i = 0; i < count; i++){
+    if(to[i] == NULL){
+      continue;
+    }
+
+    msg = create_message_katcp(d, from, to[i], px, acknowledged);
+    if(msg == NULL){
+      continue;
+    }
+
+    if(queue_message_katcp(d, msg) < 0){
+#ifdef DEBUG
+      fprintf(stderr, "multicast: unable to queue message %p\n", msg);
+#endif
+      /* not going anywhere, so nobody is waiting for an acknowledgement */
+      msg->m_flags &= ~KATCP_MESSAGE_WACK;
+      destroy_message_katcp(d, msg);
+      continue;
+    }
+
+    sent++;
+  }
+
+  if((sent > 0) && (from != NULL) && is_reply_parse_katcl(px)){
+    precedence_endpoint_katcp(d, from, ENDPOINT_PRECEDENCE_LOW);
+  }
+
+  return (sent > 0) ? (int)sent : (-1);
+}
+
 struct katcl_parse *parse_of_endpoint_katcp(struct katcp_dispatch *d, struct katcp_message *msg)
 {
   /* TODO: awkwardly named function name */
@@ -255,15 +346,19 @@ static unsigned int compute_precedence_endpoint(void *datum)
   msg = datum;
 
   if(msg->m_parse == NULL){
-    return ENDPOINT_PRECEDENCE_HIGH;    
+    return ENDPOINT_LEVEL_REPLY;    
   }
   
   if(is_request_parse_katcl(msg->m_parse)){
     /* requests are low priority, handle existing work before attempting new */
-    return ENDPOINT_PRECEDENCE_LOW;
+    return ENDPOINT_LEVEL_REQUEST;
+  }
+
+  if(is_inform_parse_katcl(msg->m_parse)){
+    return ENDPOINT_LEVEL_INFORM;
   }
 
-  return ENDPOINT_PRECEDENCE_HIGH;
+  return ENDPOINT_LEVEL_REPLY;
 }
 
 int init_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep, int (*wake)(struct katcp_dispatch *d, struct katcp_endpoint *ep, struct katcp_message *msg, void *data), void (*release)(struct katcp_dispatch *d, void *data), void *data)
@@ -382,6 +477,7 @@ void forget_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep)
 int vturnaround_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep, struct katcp_message *msg, int code, char *fmt, va_list args)
 {
   /* WARNING: msg should be removed from previous queues beforehand */
+  struct katcp_endpoint *sender;
   int result;
 
   result = 0;
@@ -407,7 +503,7 @@ int vturnaround_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *
 
     /* return to sender */
 
-    msg->m_parse = turnaround_extra_parse_katcl(msg->m_parse, code, fmt, args);
+    msg->m_parse = vturnaround_extra_parse_katcl(msg->m_parse, code, fmt, args);
     if(msg->m_parse == NULL){
 #ifdef KATCP_CONSISTENCY_CHECKS
       fprintf(stderr, "endpoint: unable to turnaround parse message\n");
@@ -416,9 +512,10 @@ int vturnaround_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *
       result = (-1);
     }
 
-    forget_endpoint_katcp(d, msg->m_to);
-    msg->m_to = msg->m_from;
-    msg->m_from = NULL;
+    /* swap over, the reply comes from the endpoint which handled the request, references stay as they are */
+    sender = msg->m_from;
+    msg->m_from = msg->m_to;
+    msg->m_to = sender;
 
 #ifdef DEBUG
     fprintf(stderr, "turnaround: about to send reply (code=%d) to %p\n", code, msg->m_to);
@@ -486,6 +583,67 @@ int answer_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep, s
   return send_message_endpoint_katcp(d, msg->m_to, msg->m_from, px, 0);
 }
 
+int resume_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep, int code, char *fmt, ...)
+{
+  /* completes the request which paused this endpoint, nothing older can be left in the queue */
+  struct katcp_message *msg;
+  va_list args;
+
+  sane_endpoint_katcp(ep);
+
+  if((ep->e_flags & ENDPOINT_FLAG_UP) == 0){
+    /* release takes care of anything left over */
+    return -1;
+  }
+
+  if(ep->e_precedence == ENDPOINT_PRECEDENCE_LOW){
+#ifdef KATCP_CONSISTENCY_CHECKS
+    fprintf(stderr, "endpoint: no paused request on endpoint %p to resume\n", ep);
+#endif
+    return -1;
+  }
+
+  msg = get_head_gueue_katcl(ep->e_queue);
+  if((msg == NULL) || (msg->m_parse == NULL) || (!is_request_parse_katcl(msg->m_parse))){
+#ifdef KATCP_CONSISTENCY_CHECKS
+    fprintf(stderr, "endpoint: logic problem: head of paused endpoint %p is not a request\n", ep);
+    abort();
+#endif
+    return -1;
+  }
+
+  if(remove_datum_gueue_katcl(ep->e_queue, msg) == NULL){
+#ifdef KATCP_CONSISTENCY_CHECKS
+    fprintf(stderr, "endpoint: major corruption in queue: unable to remove %p\n", msg);
+    abort();
+#endif
+    return -1;
+  }
+
+  va_start(args, fmt);
+  vturnaround_endpoint_katcp(d, ep, msg, code, fmt, args);
+  va_end(args);
+
+  precedence_endpoint_katcp(d, ep, ENDPOINT_PRECEDENCE_LOW);
+
+  /* requests which queued up behind the paused one can run again */
+  mark_busy_katcp(d);
+
+  return 0;
+}
+
+int busy_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep)
+{
+  /* nonzero if there are messages which the endpoint would process now */
+  sane_endpoint_katcp(ep);
+
+  if(size_gueue_katcl(ep->e_queue) == 0){
+    return 0;
+  }
+
+  return (get_precedence_head_gueue_katcl(ep->e_queue, ep->e_precedence) != NULL) ? 1 : 0;
+}
+
 struct katcp_endpoint *source_endpoint_katcp(struct katcp_dispatch *d, struct katcp_message *msg)
 {
   if(msg == NULL){
@@ -514,8 +672,6 @@ static void precedence_endpoint_katcp(struct katcp_dispatch *d, struct katcp_end
 
 void release_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep)
 {
-  struct katcp_message *msg;
-
   sane_endpoint_katcp(ep);
 
   if(ep->e_flags & ENDPOINT_FLAG_UP){
@@ -536,16 +692,16 @@ void release_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep)
   ep->e_release = NULL;
   ep->e_data = NULL;
 
-  while((msg = remove_head_gueue_katcl(ep->e_queue)) != NULL){
-    turnaround_endpoint_katcp(d, ep, msg, KATCP_RESULT_FAIL, "handler detached");
-  }
+  /* do actual cleanup in global run_endpoints, also safe if called from our own wake callback */
 
-  /* do actual cleanup in global run_endpoints */
+  mark_busy_katcp(d);
 }
 
 void release_endpoints_katcp(struct katcp_dispatch *d)
 {
   struct katcp_shared *s;
+  struct katcp_endpoint *ep;
+  int count;
 
   s = d->d_shared;
 
@@ -561,7 +717,19 @@ void release_endpoints_katcp(struct katcp_dispatch *d)
 #endif
 
   /* WARNING: assume that previous routines have cleaned up, collect all unowned endpoints */
-  run_endpoints_katcp(d);
+  /* failing queued messages may free up references to endpoints seen earlier, so go around until stuck */
+  do{
+    count = 0;
+    for(ep = s->s_endpoints; ep; ep = ep->e_next){
+      count++;
+    }
+    run_endpoints_katcp(d);
+    for(ep = s->s_endpoints; ep; ep = ep->e_next){
+      count--;
+    }
+  } while(s->s_endpoints && (count > 0));
+
+  release_spare_messages_katcp(d);
 
 #ifdef KATCP_CONSISTENCY_CHECKS
   if(s->s_endpoints){
@@ -574,7 +742,7 @@ void run_endpoints_katcp(struct katcp_dispatch *d)
 {
   struct katcp_endpoint *ep, *ex, *en;
   struct katcp_shared *s;
-  struct katcp_message *msg, *msx;
+  struct katcp_message *msg;
   int result;
 
   s = d->d_shared;
@@ -607,9 +775,10 @@ void run_endpoints_katcp(struct katcp_dispatch *d)
               abort();
 #endif
             }
-            destroy_message_katcp(d, msg);
+            /* all comms done internal to wake callback, including any acknowledgement */
+            msg->m_flags &= ~KATCP_MESSAGE_WACK;
 
-            /* all comms done internal to wake callback */
+            destroy_message_katcp(d, msg);
 
             break;
           case KATCP_RESULT_OK :
@@ -650,16 +819,21 @@ void run_endpoints_katcp(struct katcp_dispatch *d)
             break;
         }
 
-        msx = get_precedence_head_gueue_katcl(ep->e_queue, ep->e_precedence);
-        if(msx){
-          mark_busy_katcp(d);
-        }
+        /* more work queued, or output written to a line which load has already looked at */
+        mark_busy_katcp(d);
 
       }
     }
 
-    if(ep->e_flags & ENDPOINT_FLAG_UP){
-      /* still something to do */
+    if((ep->e_flags & ENDPOINT_FLAG_UP) == 0){
+      /* released, return whatever is left to its senders */
+      while((msg = remove_head_gueue_katcl(ep->e_queue)) != NULL){
+        turnaround_endpoint_katcp(d, ep, msg, KATCP_RESULT_FAIL, "handler detached");
+      }
+    }
+
+    if((ep->e_flags & ENDPOINT_FLAG_UP) || (ep->e_refcount > 0)){
+      /* still something to do, or messages elsewhere still refer to it */
       ex = ep;
       ep = ep->e_next;
     } else {
@@ -21,21 +21,37 @@
 #include "katpriv.h"
 #include "netc.h"
 
-/* Pathetic attempt at a generic queue */
+/* Generic queue: entries are kept in one fifo per precedence level, each
+ * entry stamped with an insertion sequence number. Looking up the oldest
+ * entry of at least some precedence only has to compare the level heads,
+ * and removing an entry which is the head of its level is constant time.
+ * The precedence function is evaluated once, as the entry is added.
+ * Values beyond the top level are treated as the top level */
+
+#define KATCL_GUEUE_LEVELS   3  /* eg reply / request / inform */
+#define KATCL_GUEUE_INITIAL  4  /* slots of a level when first used, doubled thereafter */
+
+struct katcl_glevel
+{
+  void         **v_queue; /* elements */
+  unsigned long *v_order; /* insertion sequence of each element */
+  unsigned int   v_size;  /* size of this level */
+  unsigned int   v_head;  /* current position */
+  unsigned int   v_count; /* No of entries */
+};
 
 struct katcl_gueue
 {
-  void       **g_queue; /* elements */
-  unsigned int g_size;  /* size of queue */
-  unsigned int g_head;  /* current position */
-  unsigned int g_count; /* No of entries */
+  struct katcl_glevel g_levels[KATCL_GUEUE_LEVELS];
+  unsigned int g_used;     /* number of levels, one without a precedence function */
+  unsigned int g_count;    /* No of entries over all levels */
+  unsigned long g_sequence;
 
   void (*g_release)(void *datum);  /* the cleanup function */
 
-  /* this may actually one day be a proper priority queue, here just the 
-   * feeble attempts: g_precedence is a user function which computes a metric
-   * of the stored item, can be used to retrieve an which is at the head of the
-   * queue but also has a precendence of greater or equal the given value */
+  /* g_precedence is a user function which computes a metric of the stored
+   * item, used to retrieve the oldest item which also has a precendence
+   * greater or equal the given value */
 
   unsigned int (*g_precedence)(void *datum); 
 };
@@ -43,17 +59,27 @@ struct katcl_gueue
 struct katcl_gueue *create_precedence_gueue_katcl(void (*release)(void *datum), unsigned int (*precedence)(void *datum))
 {
   struct katcl_gueue *g;
+  struct katcl_glevel *v;
+  unsigned int i;
 
   g = malloc(sizeof(struct katcl_gueue));
   if(g == NULL){
     fprintf(stderr, "generic queue: unable to allocate state\n");
     return NULL;
   }
-  g->g_queue = NULL;
 
-  g->g_head = 0;
+  for(i = 0; i < KATCL_GUEUE_LEVELS; i++){
+    v = &(g->g_levels[i]);
+    v->v_queue = NULL;
+    v->v_order = NULL;
+    v->v_size = 0;
+    v->v_head = 0;
+    v->v_count = 0;
+  }
+
+  g->g_used = precedence ? KATCL_GUEUE_LEVELS : 1;
   g->g_count = 0;
-  g->g_size = 0;
+  g->g_sequence = 0;
 
   g->g_release = release;
   g->g_precedence = precedence;
@@ -66,26 +92,44 @@ struct katcl_gueue *create_gueue_katcl(void (*release)(void *datum))
   return create_precedence_gueue_katcl(release, NULL);
 }
 
-void destroy_gueue_katcl(struct katcl_gueue *g)
+static void release_level_gueue_katcl(struct katcl_gueue *g, struct katcl_glevel *v)
 {
   unsigned int i, j;
 
-  for(j = 0; j < g->g_count; j++){
-    i = (g->g_head + j) % g->g_size;
+  for(j = 0; j < v->v_count; j++){
+    i = (v->v_head + j) % v->v_size;
     if(g->g_release){
-      (*(g->g_release))(g->g_queue[i]);
+      (*(g->g_release))(v->v_queue[i]);
     }
-    g->g_queue[i] = NULL;
+    v->v_queue[i] = NULL;
   }
 
-  if(g->g_queue){
-    free(g->g_queue);
-    g->g_queue = NULL;
+  v->v_head = 0;
+  v->v_count = 0;
+}
+
+void destroy_gueue_katcl(struct katcl_gueue *g)
+{
+  struct katcl_glevel *v;
+  unsigned int i;
+
+  for(i = 0; i < g->g_used; i++){
+    v = &(g->g_levels[i]);
+
+    release_level_gueue_katcl(g, v);
+
+    if(v->v_queue){
+      free(v->v_queue);
+      v->v_queue = NULL;
+    }
+    if(v->v_order){
+      free(v->v_order);
+      v->v_order = NULL;
+    }
+    v->v_size = 0;
   }
 
   g->g_count = 0;
-  g->g_size = 0;
-  g->g_head = 0;
 
   g->g_release = NULL;
 
@@ -94,7 +138,7 @@ void destroy_gueue_katcl(struct katcl_gueue *g)
 
 void clear_gueue_katcl(struct katcl_gueue *g)
 {
-  unsigned int i, j;
+  unsigned int i;
 
 #ifdef KATCP_CONSISTENCY_CHECKS
   if(g == NULL){
@@ -103,12 +147,8 @@ void clear_gueue_katcl(struct katcl_gueue *g)
   }
 #endif
 
-  for(j = 0; j < g->g_count; j++){
-    i = (g->g_head + j) % g->g_size;
-    if(g->g_release){
-      (*(g->g_release))(g->g_queue[i]);
-    }
-    g->g_queue[i] = NULL;
+  for(i = 0; i < g->g_used; i++){
+    release_level_gueue_katcl(g, &(g->g_levels[i]));
   }
 
   g->g_count = 0;
@@ -116,10 +156,59 @@ void clear_gueue_katcl(struct katcl_gueue *g)
 
 /* logic to manage the queue ****************************************************/
 
+static int grow_level_gueue_katcl(struct katcl_glevel *v)
+{
+  void **queue;
+  unsigned long *order;
+  unsigned int size, i, j;
+
+  size = (v->v_size > 0) ? (v->v_size * 2) : KATCL_GUEUE_INITIAL;
+
+#if DEBUG > 1
+  fprintf(stderr, "generic queue: size=%u, count=%u - increasing level to %u\n", v->v_size, v->v_count, size);
+#endif
+
+  queue = malloc(sizeof(void *) * size);
+  order = malloc(sizeof(unsigned long) * size);
+  if((queue == NULL) || (order == NULL)){
+    if(queue){
+      free(queue);
+    }
+    if(order){
+      free(order);
+    }
+    return -1;
+  }
+
+  /* unwrap while copying, so that the head is at zero */
+  for(j = 0; j < v->v_count; j++){
+    i = (v->v_head + j) % v->v_size;
+    queue[j] = v->v_queue[i];
+    order[j] = v->v_order[i];
+  }
+  for(j = v->v_count; j < size; j++){
+    queue[j] = NULL;
+  }
+
+  if(v->v_queue){
+    free(v->v_queue);
+  }
+  if(v->v_order){
+    free(v->v_order);
+  }
+
+  v->v_queue = queue;
+  v->v_order = order;
+  v->v_size = size;
+  v->v_head = 0;
+
+  return 0;
+}
+
 int add_tail_gueue_katcl(struct katcl_gueue *g, void *datum)
 {
-  void **tmp;
-  unsigned int index;
+  struct katcl_glevel *v;
+  unsigned int level, index;
 
   if(datum == NULL){
     return -1;
@@ -129,42 +218,38 @@ int add_tail_gueue_katcl(struct katcl_gueue *g, void *datum)
   fprintf(stderr, "generic queue: adding %p with queue %p of size %d\n", datum, g, g->g_count);
 #endif
 
-  if(g->g_count >= g->g_size){
+  level = 0;
+  if(g->g_precedence){
+    level = (*(g->g_precedence))(datum);
+    if(level >= g->g_used){
+      level = g->g_used - 1;
+    }
+  }
 
-#if DEBUG > 1
-    fprintf(stderr, "generic queue: size=%d, count=%d - increasing queue\n", g->g_size, g->g_count);
-#endif
+  v = &(g->g_levels[level]);
 
+  if(v->v_count >= v->v_size){
 #ifdef KATCP_CONSISTENCY_CHECKS
-    if(g->g_size < g->g_count){
-      fprintf(stderr, "generic queue: warning: detected rapid size increase of queue, probably a corruption\n");
+    if(v->v_size < v->v_count){
+      fprintf(stderr, "generic queue: warning: more elements %u than slots %u, probably a corruption\n", v->v_count, v->v_size);
       abort();
     }
 #endif
-    tmp = realloc(g->g_queue, sizeof(void *) * (g->g_size + 1));
-
-    if(tmp == NULL){
+    if(grow_level_gueue_katcl(v) < 0){
       return -1;
     }
-    g->g_queue = tmp;
-
-    if(g->g_head > 0){
-      g->g_queue[g->g_size] = g->g_queue[0];
-      if(g->g_head > 1){
-        memmove(&(g->g_queue[0]), &(g->g_queue[1]), sizeof(void *) * (g->g_head - 1));
-      }
-      g->g_queue[g->g_head - 1] = NULL;
-    }
-
-    g->g_size = g->g_size + 1;
   } 
-  index = (g->g_head + g->g_count) % g->g_size;
+
+  index = (v->v_head + v->v_count) % v->v_size;
 
 #if DEBUG > 1
-  fprintf(stderr, "generic queue: %p add[%d]=%p\n", g, index, datum);
+  fprintf(stderr, "generic queue: %p add[%u][%u]=%p\n", g, level, index, datum);
 #endif
 
-  g->g_queue[index] = datum;
+  v->v_queue[index] = datum;
+  v->v_order[index] = g->g_sequence++;
+  v->v_count++;
+
   g->g_count++;
 
   return 0;
@@ -172,37 +257,115 @@ int add_tail_gueue_katcl(struct katcl_gueue *g, void *datum)
 
 /*************************************************************************/
 
-void *get_from_head_gueue_katcl(struct katcl_gueue *g, unsigned int position)
+static int older_gueue_katcl(unsigned long a, unsigned long b)
+{
+  /* sequence numbers may wrap */
+  return ((long)(a - b)) < 0;
+}
+
+static int oldest_level_gueue_katcl(struct katcl_gueue *g, unsigned int from)
 {
-  unsigned int wrap;
+  struct katcl_glevel *v;
+  unsigned int i;
+  int best;
 
-  if((g->g_count == 0) || (g->g_size == 0) || (g->g_count > g->g_size)){
-    return NULL;
+  best = (-1);
+
+  for(i = from; i < g->g_used; i++){
+    v = &(g->g_levels[i]);
+    if(v->v_count > 0){
+      if((best < 0) || older_gueue_katcl(v->v_order[v->v_head], g->g_levels[best].v_order[g->g_levels[best].v_head])){
+        best = i;
+      }
+    }
   }
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if(g->g_size < g->g_count){
-    fprintf(stderr, "generic queue: more elements %u than slots %u\n", g->g_count, g->g_size);
-    abort();
+  return best;
+}
+
+static int locate_position_gueue_katcl(struct katcl_gueue *g, unsigned int position, unsigned int *offset)
+{
+  /* merge the levels by sequence number, returns the level and the offset within it */
+  unsigned int cursor[KATCL_GUEUE_LEVELS];
+  struct katcl_glevel *v;
+  unsigned int i, j;
+  int best;
+
+  if(position >= g->g_count){
+    return -1;
+  }
+
+  if(g->g_used == 1){
+    *offset = position;
+    return 0;
   }
+
+  for(i = 0; i < g->g_used; i++){
+    cursor[i] = 0;
+  }
+
+  for(j = 0; ; j++){
+    best = (-1);
+    for(i = 0; i < g->g_used; i++){
+      v = &(g->g_levels[i]);
+      if(cursor[i] < v->v_count){
+        if((best < 0) || older_gueue_katcl(v->v_order[(v->v_head + cursor[i]) % v->v_size], g->g_levels[best].v_order[(g->g_levels[best].v_head + cursor[best]) % g->g_levels[best].v_size])){
+          best = i;
+        }
+      }
+    }
+
+#ifdef KATCP_CONSISTENCY_CHECKS
+    if(best < 0){
+      fprintf(stderr, "generic queue: levels hold fewer than %u elements\n", g->g_count);
+      abort();
+    }
 #endif
 
-  if(position < g->g_count){
-    wrap = ((g->g_head + position) % g->g_size);
-    return g->g_queue[wrap];
-  } else {
+    if(j == position){
+      *offset = cursor[best];
+      return best;
+    }
+
+    cursor[best]++;
+  }
+}
+
+void *get_from_head_gueue_katcl(struct katcl_gueue *g, unsigned int position)
+{
+  struct katcl_glevel *v;
+  unsigned int offset;
+  int level;
+
+  level = locate_position_gueue_katcl(g, position, &offset);
+  if(level < 0){
     return NULL;
   }
+
+  v = &(g->g_levels[level]);
+
+  return v->v_queue[(v->v_head + offset) % v->v_size];
 }
 
 void *get_head_gueue_katcl(struct katcl_gueue *g)
 {
-  return (g->g_count > 0) ? g->g_queue[g->g_head] : NULL;
+  struct katcl_glevel *v;
+  int level;
+
+  level = oldest_level_gueue_katcl(g, 0);
+  if(level < 0){
+    return NULL;
+  }
+
+  v = &(g->g_levels[level]);
+
+  return v->v_queue[v->v_head];
 }
 
 void *get_precedence_head_gueue_katcl(struct katcl_gueue *g, unsigned int precedence)
 {
-  unsigned int value, i, j;
+  struct katcl_glevel *v;
+  int level;
 
   if(g->g_precedence == NULL){
 #ifdef DEBUG
@@ -211,176 +374,129 @@ void *get_precedence_head_gueue_katcl(struct katcl_gueue *g, unsigned int preced
     return get_head_gueue_katcl(g);
   }
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if((g->g_count == 0) || (g->g_size == 0) || (g->g_count > g->g_size)){
-#ifdef DEBUG
-    fprintf(stderr, "generic queue: reasonability test on get failed (count=%u, size=%u)\n", g->g_count, g->g_size);
-#endif
-    return NULL;
+  if(precedence >= g->g_used){
+    precedence = g->g_used - 1;
   }
-#endif
 
-  for(j = 0; j < g->g_count; j++){
-    i = (g->g_head + j) % g->g_size;
-    value =  (*(g->g_precedence))(g->g_queue[i]);
+  level = oldest_level_gueue_katcl(g, precedence);
+  if(level < 0){
 #ifdef DEBUG
-    fprintf(stderr, "generic queue: %p->%u, looking for at least %u\n", g->g_queue[i], value, precedence);
+    fprintf(stderr, "generic queue: no match found, need precedence %u, searched %u\n", precedence, g->g_count);
 #endif
-    if(value >= precedence){
-      return g->g_queue[i];
-    }
+    return NULL;
   }
 
-#ifdef DEBUG
-  fprintf(stderr, "generic queue: no match found, need precedence %u, searched %u\n", precedence, g->g_count);
-#endif
+  v = &(g->g_levels[level]);
 
-  return NULL;
+  return v->v_queue[v->v_head];
 }
 
 /*************************************************************************/
 
-static void *remove_index_gueue_katcl(struct katcl_gueue *g, unsigned int index)
+static void *remove_offset_gueue_katcl(struct katcl_gueue *g, unsigned int level, unsigned int offset)
 {
-  unsigned int end;
+  struct katcl_glevel *v;
+  unsigned int i, j, k;
   void *datum;
 
-  if(g->g_count <= 0){
-#ifdef DEBUG
-    fprintf(stderr, "generic queue: nothing to remove\n");
-#endif
-    return NULL;
-  }
+  v = &(g->g_levels[level]);
 
 #ifdef KATCP_CONSISTENCY_CHECKS
-  if(index >= g->g_size){
-    fprintf(stderr, "generic queue: index %u out of range %u\n", index, g->g_size);
+  if(offset >= v->v_count){
+    fprintf(stderr, "generic queue: offset %u out of range %u at level %u\n", offset, v->v_count, level);
     abort();
   }
-  if(g->g_queue[index] == NULL){
-    fprintf(stderr, "generic queue: index %u (head=%u,count=%u) already null\n", index, g->g_head, g->g_count);
-    abort();
-  }
-#endif
-
-#if DEBUG
-  fprintf(stderr, "generic queue: del[%u]=%p\n", index, g->g_queue[index]);
 #endif
 
-  datum = g->g_queue[index];
-  g->g_queue[index] = NULL;
-
-  if(index == g->g_head){
-    /* hopefully the common, simple case - remove from head */
-    g->g_head = (g->g_head + 1) % g->g_size;
-    g->g_count--;
-
-#if DEBUG 
-    fprintf(stderr, "generic gueue: removed %p from %p\n", datum, g);
-#endif
-
-    return datum;
-  }
+  i = (v->v_head + offset) % v->v_size;
+  datum = v->v_queue[i];
 
-  if(index > g->g_head){ /* index ahead of head, move head toward index */
-    memmove(&(g->g_queue[g->g_head + 1]), &(g->g_queue[g->g_head]), (index - g->g_head) * sizeof(void *));
-    g->g_queue[g->g_head] = NULL;
-    g->g_head = (g->g_head + 1) % g->g_size;
-    g->g_count--;
-#if DEBUG 
-    fprintf(stderr, "generic queue: removed %p from %p, head advanced to %u\n", datum, g, g->g_head);
-#endif
-    return datum; /* WARNING: done here */
-  }
-
-  /* else index < g->g_head, move tail back */
-
-  /* now move back end by one, to overwrite position at index */
-  end = (g->g_head + g->g_count - 1) % g->g_size; /* WARNING: relies on count+head never being zero, hence earlier test */
 #ifdef KATCP_CONSISTENCY_CHECKS
-  if(index > end){
-    fprintf(stderr, "generic queue: logic problem: attempting to remove %u, queue only valid from head=%u to head+count=%u+%u-1=%u", index, g->g_head, g->g_head, g->g_count, end);
+  if(datum == NULL){
+    fprintf(stderr, "generic queue: index %u (head=%u,count=%u) already null\n", i, v->v_head, v->v_count);
     abort();
   }
 #endif
 
-  if(index < end){
-    memmove(&(g->g_queue[index]), &(g->g_queue[index + 1]), (end - index) * sizeof(void *));
-  } /* else index is end, no copy needed  */
+#if DEBUG
+  fprintf(stderr, "generic queue: del[%u][%u]=%p\n", level, i, datum);
+#endif
 
-  fprintf(stderr, "generic queue: removed %p from %p, tail reduced from %u\n", datum, g, end);
+  /* close the gap from the head side, normally the entry is at or near the head */
+  for(j = offset; j > 0; j--){
+    k = (v->v_head + j) % v->v_size;
+    i = (v->v_head + j - 1) % v->v_size;
+    v->v_queue[k] = v->v_queue[i];
+    v->v_order[k] = v->v_order[i];
+  }
 
-  g->g_queue[end] = NULL;
-  g->g_count--;
+  v->v_queue[v->v_head] = NULL;
+  v->v_head = (v->v_head + 1) % v->v_size;
+  v->v_count--;
 
-#if DEBUG > 1
-  fprintf(stderr, "generic queue: removed %p from %p\n", datum, g);
-#endif
+  g->g_count--;
 
   return datum;
 }
 
 void *remove_from_head_gueue_katcl(struct katcl_gueue *g, unsigned int position)
 {
-  unsigned int index;
+  unsigned int offset;
+  int level;
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if((g->g_count == 0) || (g->g_size == 0) || (g->g_count > g->g_size)){
-    return NULL;
-  }
-#endif
-
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if(g->g_size < g->g_count){
-    fprintf(stderr, "generic queue: more elements %u than slots %u\n", g->g_count, g->g_size);
-    abort();
-  }
+#ifdef DEBUG
+  fprintf(stderr, "generic queue: removing position %u from head (used=%u)\n", position, g->g_count);
 #endif
 
-  if(position >= g->g_count){
+  level = locate_position_gueue_katcl(g, position, &offset);
+  if(level < 0){
     return NULL;
   }
 
-#ifdef DEBUG
-  fprintf(stderr, "generic queue: removing position %u from head (used=%u/size=%u)\n", position, g->g_count, g->g_size);
-#endif
-
-  index = (g->g_head + position) % g->g_size;
-
-  return remove_index_gueue_katcl(g, index);
+  return remove_offset_gueue_katcl(g, level, offset);
 }
 
 void *remove_datum_gueue_katcl(struct katcl_gueue *g, void *datum)
 {
+  struct katcl_glevel *v;
   unsigned int i, j;
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if((g->g_count == 0) || (g->g_size == 0) || (g->g_count > g->g_size)){
-    return NULL;
-  }
-#endif
-
-  for(j = 0; j < g->g_count; j++){
-    i = (g->g_head + j) % g->g_size;
-    if(g->g_queue[i] == datum){
-      break;
+  /* usually the datum was just looked up as the head of its level */
+  for(i = 0; i < g->g_used; i++){
+    v = &(g->g_levels[i]);
+    if((v->v_count > 0) && (v->v_queue[v->v_head] == datum)){
+      return remove_offset_gueue_katcl(g, i, 0);
     }
   }
 
-  if(j >= g->g_count){
-    return NULL;
-  }
-
+  for(i = 0; i < g->g_used; i++){
+    v = &(g->g_levels[i]);
+    for(j = 1; j < v->v_count; j++){
+      if(v->v_queue[(v->v_head + j) % v->v_size] == datum){
 #ifdef DEBUG
-  fprintf(stderr, "generic queue: removing position %u from head (used=%u/size=%u)\n", i, g->g_count, g->g_size);
+        fprintf(stderr, "generic queue: removing offset %u of level %u (used=%u)\n", j, i, g->g_count);
 #endif
+        return remove_offset_gueue_katcl(g, i, j);
+      }
+    }
+  }
 
-  return remove_index_gueue_katcl(g, i);
+  return NULL;
 }
 
 void *remove_head_gueue_katcl(struct katcl_gueue *g)
 {
-  return remove_index_gueue_katcl(g, g->g_head);
+  int level;
+
+  level = oldest_level_gueue_katcl(g, 0);
+  if(level < 0){
+#ifdef DEBUG
+    fprintf(stderr, "generic queue: nothing to remove\n");
+#endif
+    return NULL;
+  }
+
+  return remove_offset_gueue_katcl(g, level, 0);
 }
 
 /**************************************************************************************/
@@ -395,34 +511,52 @@ unsigned int size_gueue_katcl(struct katcl_gueue *g)
 #if defined(DEBUG) || defined(UNIT_TEST_GENERIC_QUEUE)
 void dump_gueue(struct katcl_gueue *g, FILE *fp)
 {
-  unsigned int i, k;
+  struct katcl_glevel *v;
+  unsigned int i, k, level, total;
 
-  fprintf(fp, "generic queue %p (%d):", g, g->g_size);
-  for(i = 0; i < g->g_size; i++){
-    if(g->g_queue[i]){
-      fprintf(fp, " <%p>", g->g_queue[i]);
-    } else {
-      fprintf(fp, " [%d]", i);
+  total = 0;
+
+  for(level = 0; level < g->g_used; level++){
+    v = &(g->g_levels[level]);
+
+    fprintf(fp, "generic queue %p level %u (%u):", g, level, v->v_size);
+    for(i = 0; i < v->v_size; i++){
+      if(v->v_queue[i]){
+        fprintf(fp, " <%p>", v->v_queue[i]);
+      } else {
+        fprintf(fp, " [%u]", i);
+      }
     }
-  }
-  fprintf(fp, "\n");
+    fprintf(fp, "\n");
 
-  for(k = g->g_head, i = 0; i < g->g_count; i++, k = (k + 1) % g->g_size){
-    if(g->g_queue[k] == NULL){
-      fprintf(stderr, "generic gueue: error: null field at %d\n", k);
-      abort();
+    for(k = v->v_head, i = 0; i < v->v_count; i++, k = (k + 1) % v->v_size){
+      if(v->v_queue[k] == NULL){
+        fprintf(stderr, "generic gueue: error: null field at %u of level %u\n", k, level);
+        abort();
+      }
+      if((i > 0) && older_gueue_katcl(v->v_order[k], v->v_order[(k + v->v_size - 1) % v->v_size])){
+        fprintf(stderr, "generic gueue: error: field at %u of level %u out of order\n", k, level);
+        abort();
+      }
     }
-  }
 
-  while(i < g->g_size){
+    while(i < v->v_size){
 
-    if(g->g_queue[k] != NULL){
-      fprintf(stderr, "generic gueue: error: used field at %d\n", k);
-      abort();
+      if(v->v_queue[k] != NULL){
+        fprintf(stderr, "generic gueue: error: used field at %u of level %u\n", k, level);
+        abort();
+      }
+
+      k = (k + 1) % v->v_size;
+      i++;
     }
 
-    k = (k + 1) % g->g_size;
-    i++;
+    total += v->v_count;
+  }
+
+  if(total != g->g_count){
+    fprintf(stderr, "generic gueue: error: levels hold %u, expected %u\n", total, g->g_count);
+    abort();
   }
 }
 
@@ -440,6 +574,13 @@ void dump_gueue(struct katcl_gueue *g, FILE *fp)
 #define CHANCE_HEAD_REMOVE    3
 #define CHANCE_POS_REMOVE     7
 
+#define PRECEDENCE_COUNT     30
+
+static unsigned int modulo_precedence(void *datum)
+{
+  return (*(unsigned int *)datum) % 3;
+}
+
 int main(int argc, char **argv)
 {
   struct katcl_gueue *g;
@@ -530,6 +671,63 @@ int main(int argc, char **argv)
     dump_gueue(g, stderr);
   }
 
+  destroy_gueue_katcl(g);
+
+  g = create_precedence_gueue_katcl(free, &modulo_precedence);
+  if(g == NULL){
+    fprintf(stderr, "unable to create precedence gueue\n");
+    return 1;
+  }
+
+  for(i = 0; i < PRECEDENCE_COUNT; i++){
+    a = malloc(sizeof(unsigned int));
+    if(a == NULL){
+      return 1;
+    }
+    *a = i;
+    add_tail_gueue_katcl(g, a);
+  }
+  dump_gueue(g, stderr);
+
+  b = get_precedence_head_gueue_katcl(g, 2);
+  if((b == NULL) || (*b != 2) || (remove_datum_gueue_katcl(g, b) != b)){
+    fprintf(stderr, "test: precedence problem: expected 2 at precedence 2\n");
+    abort();
+  }
+  free(b);
+
+  b = get_from_head_gueue_katcl(g, 3);
+  if((b == NULL) || (*b != 4)){
+    fprintf(stderr, "test: precedence problem: expected 4 at position 3\n");
+    abort();
+  }
+
+  b = remove_from_head_gueue_katcl(g, 1);
+  if((b == NULL) || (*b != 1)){
+    fprintf(stderr, "test: precedence problem: expected to remove 1 at position 1\n");
+    abort();
+  }
+  free(b);
+
+  b = get_precedence_head_gueue_katcl(g, 1);
+  if((b == NULL) || (*b != 4)){
+    fprintf(stderr, "test: precedence problem: expected 4 at precedence 1\n");
+    abort();
+  }
+  dump_gueue(g, stderr);
+
+  for(remove = 0; (b = remove_head_gueue_katcl(g)) != NULL; remove = *b + 1, free(b)){
+    if(*b < remove){
+      fprintf(stderr, "test: precedence problem: removed %u after %u\n", *b, remove - 1);
+      abort();
+    }
+  }
+
+  if(size_gueue_katcl(g) != 0){
+    fprintf(stderr, "test: precedence problem: %u left over\n", size_gueue_katcl(g));
+    abort();
+  }
+
   destroy_gueue_katcl(g);
   
   fprintf(stderr, "test: done\n");
@@ -0,0 +1,267 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* event loop health: the core loop marks the end of each of its
+ * phases, the time since the previous mark is charged to that phase.
+ * Once per iteration the per phase totals go into histograms, and
+ * once per window the fraction of time spent outside the wait and the
+ * worst timer lateness are made available as sensors. The per subsystem
+ * memory accounting of memory.c is reported from here too
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/time.h>
+
+#include "katpriv.h"
+#include "katcl.h"
+#include "katcp.h"
+
+static char *phase_names_katcp[KATCP_PHASES] = { "wait", "timers", "load", "flats", "endpoints", "clients", "jobs", "notices", "arbs", "sensors" };
+
+int loop_stats_cmd_katcp(struct katcp_dispatch *d, int argc);
+
+static int memory_tags_katcp[KATCP_MEMORY_TAGS];
+
+static double get_busy_health_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
+{
+  struct katcp_health *h;
+
+  h = get_local_acquire_katcp(d, a);
+
+  return h->h_fraction;
+}
+
+static double get_lag_health_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
+{
+  struct katcp_health *h;
+
+  h = get_local_acquire_katcp(d, a);
+
+  return h->h_late;
+}
+
+int start_health_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_shared *s;
+  struct katcp_health *h;
+  unsigned int i;
+
+  s = d->d_shared;
+  if(s == NULL){
+    return -1;
+  }
+
+  h = &(s->s_health);
+
+  if(h->h_ready){
+    return 0;
+  }
+
+  for(i = 0; i < KATCP_PHASES; i++){
+    h->h_pass[i] = 0;
+    clear_stats_katcp(&(h->h_phases[i]));
+  }
+  clear_stats_katcp(&(h->h_lag));
+
+  monotonic_time_katcp(&(h->h_mark));
+  h->h_window = h->h_mark;
+
+  h->h_busy = 0;
+  h->h_idle = 0;
+  h->h_worst = 0;
+
+  h->h_fraction = 0.0;
+  h->h_late = 0.0;
+
+  h->h_ready = 1;
+
+  if(declare_double_sensor_katcp(d, 0, "loop.busy-fraction", "fraction of time the event loop spent working rather than waiting", "none", &get_busy_health_katcp, h, NULL, 0.0, 0.8, 0.0, 0.95, NULL) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create loop busy sensor");
+    return -1;
+  }
+
+  if(declare_double_sensor_katcp(d, 0, "loop.lag", "worst lateness of a timer", "seconds", &get_lag_health_katcp, h, NULL, 0.0, 0.1, 0.0, 1.0, NULL) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create loop lag sensor");
+    return -1;
+  }
+
+  register_flag_mode_katcp(d, "?loop-stats", "display event loop phase timings (?loop-stats)", &loop_stats_cmd_katcp, 0, 0);
+  register_flag_mode_katcp(d, "?memory-stats", "display memory use by subsystem, optionally as sensors (?memory-stats [sensors])", &memory_stats_cmd_katcp, 0, 0);
+
+  return 0;
+}
+
+void mark_phase_katcp(struct katcp_shared *s, unsigned int phase)
+{
+  struct katcp_health *h;
+  struct timeval now, delta;
+
+  h = &(s->s_health);
+  if(h->h_ready == 0){
+    return;
+  }
+
+#ifdef KATCP_CONSISTENCY_CHECKS
+  if(phase >= KATCP_PHASES){
+    fprintf(stderr, "health: invalid phase %u\n", phase);
+    abort();
+  }
+#endif
+
+  monotonic_time_katcp(&now);
+  sub_time_katcp(&delta, &now, &(h->h_mark));
+
+  h->h_pass[phase] += (delta.tv_sec * 1000000UL) + delta.tv_usec;
+  h->h_mark = now;
+}
+
+void finish_pass_katcp(struct katcp_shared *s)
+{
+  struct katcp_health *h;
+  struct timeval delta;
+  unsigned long total;
+  unsigned int i;
+
+  h = &(s->s_health);
+  if(h->h_ready == 0){
+    return;
+  }
+
+  for(i = 0; i < KATCP_PHASES; i++){
+    count_stats_katcp(&(h->h_phases[i]), h->h_pass[i], KATCP_RESULT_OK);
+    if(i == KATCP_PHASE_WAIT){
+      h->h_idle += h->h_pass[i];
+    } else {
+      h->h_busy += h->h_pass[i];
+    }
+    h->h_pass[i] = 0;
+  }
+
+  sub_time_katcp(&delta, &(h->h_mark), &(h->h_window));
+  if(delta.tv_sec < KATCP_HEALTH_WINDOW){
+    return;
+  }
+
+  total = h->h_busy + h->h_idle;
+  h->h_fraction = (total > 0) ? ((double)(h->h_busy) / (double)total) : 0.0;
+  h->h_late = (double)(h->h_worst) / 1000000.0;
+
+  h->h_window = h->h_mark;
+  h->h_busy = 0;
+  h->h_idle = 0;
+  h->h_worst = 0;
+}
+
+int loop_stats_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_shared *s;
+  struct katcp_health *h;
+  unsigned int i;
+
+  s = d->d_shared;
+  if(s == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  h = &(s->s_health);
+
+  /* same fields as command-stats, one line per phase of each loop iteration */
+
+  for(i = 0; i < KATCP_PHASES; i++){
+    print_stats_katcp(d, phase_names_katcp[i], &(h->h_phases[i]));
+  }
+
+  /* here the histogram is of how late timers ran */
+  print_stats_katcp(d, "timer-lag", &(h->h_lag));
+
+  return KATCP_RESULT_OK;
+}
+
+static int get_memory_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
+{
+  int *tag;
+  long bytes;
+
+  tag = get_local_acquire_katcp(d, a);
+
+  if(stats_memory_katcp(*tag, NULL, &bytes, NULL, NULL, NULL) < 0){
+    return 0;
+  }
+
+  return (bytes > INT_MAX) ? INT_MAX : bytes;
+}
+
+static int sensors_memory_katcp(struct katcp_dispatch *d)
+{
+  char buffer[KATCP_NAME_LENGTH];
+  char *name;
+  int i;
+
+  for(i = 0; i < KATCP_MEMORY_TAGS; i++){
+    if(stats_memory_katcp(i, &name, NULL, NULL, NULL, NULL) < 0){
+      continue;
+    }
+
+    snprintf(buffer, KATCP_NAME_LENGTH, "memory.%s", name);
+    buffer[KATCP_NAME_LENGTH - 1] = '\0';
+
+    if(find_sensor_katcp(d, buffer)){
+      continue; /* asked for before */
+    }
+
+    memory_tags_katcp[i] = i;
+
+    if(declare_integer_sensor_katcp(d, 0, buffer, "bytes currently allocated by this subsystem", "bytes", &get_memory_katcp, &(memory_tags_katcp[i]), NULL, 0, INT_MAX, 0, INT_MAX, NULL) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create memory sensor %s", buffer);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int memory_stats_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  char *name, *ptr;
+  long bytes, peak, objects;
+  unsigned long allocs;
+  unsigned int count;
+  int i;
+
+  if(argc > 1){
+    ptr = arg_string_katcp(d, 1);
+    if((ptr == NULL) || strcmp(ptr, "sensors")){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown memory-stats option %s", ptr ? ptr : "<null>");
+      return KATCP_RESULT_INVALID;
+    }
+    if(sensors_memory_katcp(d) < 0){
+      return KATCP_RESULT_FAIL;
+    }
+  }
+
+  count = 0;
+
+  for(i = 0; i < KATCP_MEMORY_TAGS; i++){
+    if(stats_memory_katcp(i, &name, &bytes, &peak, &objects, &allocs) < 0){
+      continue;
+    }
+
+    prepend_inform_katcp(d);
+    append_string_katcp(d, KATCP_FLAG_STRING, name);
+    append_signed_long_katcp(d, KATCP_FLAG_SLONG, bytes);
+    append_signed_long_katcp(d, KATCP_FLAG_SLONG, peak);
+    append_signed_long_katcp(d, KATCP_FLAG_SLONG, objects);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, allocs);
+
+    count++;
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, count);
+
+  return KATCP_RESULT_OWN;
+}
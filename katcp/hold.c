@@ -0,0 +1,419 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* concurrent tagged requests: a request carrying a tag which pauses
+ * does not stop its client, instead its message and the notices it
+ * subscribed to are held. When one of those notices runs for the
+ * client, the held message stands in as the current one, so that the
+ * usual arg and reply functions work, and a resume completes only
+ * that request. Replies carry the tag, so they may go out of order.
+ * Once the client holds its limit of such requests, it pauses until
+ * one of them completes. Untagged requests pause the client as before
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "katpriv.h"
+#include "katcl.h"
+#include "katcp.h"
+
+static void destroy_held_katcp(struct katcp_held *h)
+{
+  if(h->h_request){
+    destroy_parse_katcl(h->h_request);
+    h->h_request = NULL;
+  }
+
+  if(h->h_notices){
+    free(h->h_notices);
+    h->h_notices = NULL;
+  }
+
+  free(h);
+}
+
+int hold_request_katcp(struct katcp_dispatch *d, unsigned int before)
+{
+  struct katcp_held *h, **tmp;
+  struct katcl_parse *p;
+  unsigned int i;
+
+  /* notices added by the request are the ones past before, removals move later entries into earlier gaps, never the other way */
+
+  if((d->d_hold_limit == 0) || (before >= d->d_count)){
+    return -1;
+  }
+
+  p = ready_katcl(d->d_line);
+  if((p == NULL) || (get_tag_parse_katcl(p) < 0)){
+    return -1;
+  }
+
+  tmp = realloc(d->d_held, sizeof(struct katcp_held *) * (d->d_holding + 1));
+  if(tmp == NULL){
+    return -1;
+  }
+  d->d_held = tmp;
+
+  h = malloc(sizeof(struct katcp_held));
+  if(h == NULL){
+    return -1;
+  }
+
+  h->h_count = d->d_count - before;
+  h->h_notices = malloc(sizeof(struct katcp_notice *) * h->h_count);
+  if(h->h_notices == NULL){
+    free(h);
+    return -1;
+  }
+
+  for(i = 0; i < h->h_count; i++){
+    h->h_notices[i] = d->d_notices[before + i];
+  }
+
+  h->h_request = copy_parse_katcl(p);
+  h->h_done = 0;
+  h->h_saved = NULL;
+  h->h_tag = (-1);
+
+  d->d_held[d->d_holding] = h;
+  d->d_holding++;
+
+  if(d->d_holding >= d->d_hold_limit){
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "client holds %u tagged requests, not reading more until one completes", d->d_holding);
+    d->d_pause = 1;
+    d->d_full = 1;
+  }
+
+  return 0;
+}
+
+struct katcp_held *enter_held_katcp(struct katcp_dispatch *d, struct katcp_notice *n)
+{
+  struct katcp_held *h;
+  unsigned int i, j;
+
+  if(d->d_holding == 0){
+    return NULL;
+  }
+
+  for(i = 0; i < d->d_holding; i++){
+    h = d->d_held[i];
+    for(j = 0; j < h->h_count; j++){
+      if(h->h_notices[j] == n){
+
+        h->h_saved = swap_ready_katcl(d->d_line, h->h_request);
+        h->h_tag = tag_katcl(d->d_line, get_tag_parse_katcl(h->h_request));
+
+        d->d_active = h;
+
+        return h;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+void leave_held_katcp(struct katcp_dispatch *d, struct katcp_held *h, struct katcp_notice *n, int result)
+{
+  unsigned int i;
+
+  if(h == NULL){
+    return;
+  }
+
+  swap_ready_katcl(d->d_line, h->h_saved);
+  tag_katcl(d->d_line, h->h_tag);
+
+  h->h_saved = NULL;
+  d->d_active = NULL;
+
+  if(result <= 0){ /* callback has detached, notice may go away */
+    for(i = 0; i < h->h_count; i++){
+      if(h->h_notices[i] == n){
+        h->h_count--;
+        h->h_notices[i] = h->h_notices[h->h_count];
+        break;
+      }
+    }
+    if((h->h_count == 0) && (h->h_done == 0)){
+      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "tagged request %s no longer waits on anything, yet has not completed", get_string_parse_katcl(h->h_request, 0));
+      h->h_done = 1;
+    }
+  }
+
+  if(h->h_done == 0){
+    return;
+  }
+
+  for(i = 0; (i < d->d_holding) && (d->d_held[i] != h); i++);
+
+#ifdef KATCP_CONSISTENCY_CHECKS
+  if(i >= d->d_holding){
+    fprintf(stderr, "hold: held request %p not found in dispatch %p\n", h, d);
+    abort();
+  }
+#endif
+
+  d->d_holding--;
+  if(i < d->d_holding){
+    d->d_held[i] = d->d_held[d->d_holding];
+  }
+
+  destroy_held_katcp(h);
+
+  if(d->d_full && (d->d_holding < d->d_hold_limit)){
+    d->d_full = 0;
+    resume_katcp(d);
+  }
+}
+
+void release_held_katcp(struct katcp_dispatch *d)
+{
+  unsigned int i;
+
+  for(i = 0; i < d->d_holding; i++){
+    destroy_held_katcp(d->d_held[i]);
+  }
+
+  if(d->d_held){
+    free(d->d_held);
+    d->d_held = NULL;
+  }
+
+  d->d_holding = 0;
+  d->d_active = NULL;
+  d->d_full = 0;
+}
+
+#ifdef UNIT_TEST_HOLD
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "netc.h"
+
+#define TEST_SLOW   "slow"
+#define TEST_BROAD  "#everyone"
+
+static pid_t server_test;
+
+static int sleep_work_test(void *data)
+{
+  usleep((*(unsigned int *)data) * 1000);
+
+  return 0;
+}
+
+static int slow_done_test(struct katcp_dispatch *d, int status, void *data)
+{
+  free(data);
+
+  if(d == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  send_katcp(d, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#" TEST_SLOW, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "end");
+
+  return KATCP_RESULT_OK;
+}
+
+static int slow_cmd_test(struct katcp_dispatch *d, int argc)
+{
+  unsigned int *delay;
+
+  delay = malloc(sizeof(unsigned int));
+  if(delay == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  *delay = arg_unsigned_long_katcp(d, 1);
+
+  send_katcp(d, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#" TEST_SLOW, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "begin");
+
+  /* neither of these answer the request, so may not carry its tag */
+  broadcast_inform_katcp(d, TEST_BROAD, "hello");
+  log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "sleeping for %ums", *delay);
+
+  return offload_katcp(d, &sleep_work_test, &slow_done_test, delay);
+}
+
+static int serve_test(int port)
+{
+  struct katcp_dispatch *d;
+
+  d = startup_katcp();
+  if(d == NULL){
+    return 1;
+  }
+
+  register_katcp(d, "?" TEST_SLOW, "sleep in a worker (?slow milliseconds)", &slow_cmd_test);
+
+  start_workers_katcp(d, 2);
+
+  run_config_server_katcp(d, NULL, 4, "localhost", port);
+
+  shutdown_katcp(d);
+
+  return 0;
+}
+
+static int stop_test(int code)
+{
+  int status;
+
+  kill(server_test, SIGTERM);
+  waitpid(server_test, &status, 0);
+
+  return code;
+}
+
+static void timeout_test(int signal)
+{
+  fprintf(stderr, "hold: timed out waiting for replies\n");
+  kill(server_test, SIGTERM);
+  _exit(1);
+}
+
+static int expect_tag_test(char *name, int tag, int want)
+{
+  if(tag != want){
+    fprintf(stderr, "hold: %s carries tag %d, expected %d\n", name, tag, want);
+    return -1;
+  }
+
+  return 0;
+}
+
+int main()
+{
+  struct katcl_line *l;
+  int port, fd, tag, i, replies, helps, expect;
+  int begun[3], ended[3];
+  char *name, *arg;
+  unsigned int order[2];
+
+  port = 20000 + (getpid() % 20000);
+
+  server_test = fork();
+  if(server_test < 0){
+    fprintf(stderr, "hold: unable to fork\n");
+    return 1;
+  }
+
+  if(server_test == 0){
+    return serve_test(port);
+  }
+
+  /* a tag going missing leaves us waiting for a reply */
+  signal(SIGALRM, &timeout_test);
+  alarm(20);
+
+  fd = (-1);
+  for(i = 0; (i < 50) && (fd < 0); i++){
+    usleep(100000);
+    fd = net_connect("localhost", port, 0);
+  }
+
+  if(fd < 0){
+    fprintf(stderr, "hold: unable to connect to test server on port %d\n", port);
+    return stop_test(1);
+  }
+
+  l = create_katcl(fd);
+  if(l == NULL){
+    return stop_test(1);
+  }
+
+  /* the first takes longer, so the two overlap and finish out of order */
+  send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?" TEST_SLOW "[1]", KATCP_FLAG_LAST | KATCP_FLAG_ULONG, 400UL);
+  send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "?" TEST_SLOW "[2]", KATCP_FLAG_LAST | KATCP_FLAG_ULONG, 50UL);
+
+  /* the help listing gets cached, a tagged one may not end up there */
+  send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_LAST | KATCP_FLAG_STRING, "?help[3]");
+  send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_LAST | KATCP_FLAG_STRING, "?help");
+  send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_LAST | KATCP_FLAG_STRING, "?help[4]");
+  send_katcl(l, KATCP_FLAG_FIRST | KATCP_FLAG_LAST | KATCP_FLAG_STRING, "?help");
+
+  while(flushing_katcl(l)){
+    write_katcl(l);
+  }
+
+  for(i = 0; i < 3; i++){
+    begun[i] = 0;
+    ended[i] = 0;
+  }
+
+  replies = 0;
+  helps = 0;
+  expect = 3;
+
+  while((replies < 2) || (helps < 4)){
+    while(have_katcl(l) <= 0){
+      if(read_katcl(l)){
+        fprintf(stderr, "hold: server went away\n");
+        return stop_test(1);
+      }
+    }
+
+    name = arg_string_katcl(l, 0);
+    tag = arg_tag_katcl(l);
+    if(name == NULL){
+      return stop_test(1);
+    }
+
+    if(!strcmp(name, "#" TEST_SLOW)){
+      arg = arg_string_katcl(l, 1);
+      if((tag < 1) || (tag > 2) || (arg == NULL)){
+        fprintf(stderr, "hold: inform %s %s carries tag %d\n", name, arg ? arg : "", tag);
+        return stop_test(1);
+      }
+      if(!strcmp(arg, "begin")){
+        begun[tag]++;
+      } else {
+        ended[tag]++;
+      }
+    } else if(!strcmp(name, "!" TEST_SLOW)){
+      if((tag < 1) || (tag > 2) || (begun[tag] != 1) || (ended[tag] != 1)){
+        fprintf(stderr, "hold: reply to %d without its own informs\n", tag);
+        return stop_test(1);
+      }
+      order[replies++] = tag;
+    } else if(!strcmp(name, "#help")){
+      if(expect_tag_test(name, tag, expect) < 0){
+        return stop_test(1);
+      }
+    } else if(!strcmp(name, "!help")){
+      if(expect_tag_test(name, tag, expect) < 0){
+        return stop_test(1);
+      }
+      helps++;
+      expect = (helps == 2) ? 4 : (-1);
+    } else if(!strcmp(name, TEST_BROAD) || !strcmp(name, KATCP_LOG_INFORM)){
+      if(expect_tag_test(name, tag, -1) < 0){
+        return stop_test(1);
+      }
+    }
+  }
+
+#ifdef KATCP_THREADS
+  if((order[0] != 2) || (order[1] != 1)){
+    fprintf(stderr, "hold: expected replies out of order, got %d then %d\n", order[0], order[1]);
+    return stop_test(1);
+  }
+#endif
+
+  destroy_katcl(l, 1);
+
+  stop_test(0);
+
+  printf("hold test: ok\n");
+
+  return 0;
+}
+
+#endif
@@ -17,14 +17,22 @@
 #include <sys/socket.h>
 
 #include <unistd.h>
+#include <spawn.h>
 
 #include "katcp.h"
 #include "katcl.h"
 #include "katpriv.h"
 #include "netc.h"
 
+#define KATCP_CLIENT_VARIABLE "KATCP_CLIENT"
+
+extern char **environ;
+
 #define JOB_MAGIC 0x21525110
 
+#define KATCP_JOB_IDLE 30 /* seconds an unused shared connection stays open */
+#define KATCP_JOB_TAG_MAX 999999 /* tags wrap around, far more than can be outstanding */
+
 #if 0
 #define JOB_MAY_REQUEST 0x01
 #define JOB_MAY_WRITE   0x02
@@ -285,6 +293,10 @@ static void delete_job_katcp(struct katcp_dispatch *d, struct katcp_job *j)
     j->j_map = NULL;
   }
 
+  if(j->j_refs >= 0){
+    discharge_timer_katcp(d, j); /* idle check */
+  }
+
   j->j_halt = NULL;
   j->j_count = 0;
 
@@ -648,6 +660,9 @@ struct katcp_job *create_job_katcp(struct katcp_dispatch *d, struct katcp_url *n
   j->j_sendr = 0;
   j->j_recvr = 0;
 
+  j->j_window = 1;
+  j->j_tag = 0;
+
   j->j_line = NULL;
 
   j->j_queue = NULL;
@@ -657,6 +672,8 @@ struct katcp_job *create_job_katcp(struct katcp_dispatch *d, struct katcp_url *n
 
   j->j_map = NULL;
 
+  j->j_refs = (-1);
+
   j->j_url = name;
   if(j->j_url == NULL){
     delete_job_katcp(d, j);
@@ -707,12 +724,15 @@ struct katcp_job *create_job_katcp(struct katcp_dispatch *d, struct katcp_url *n
 
   /* WARNING: do line clone last, so that fd isn't closed on failure */
   if(fd >= 0){
+    forget_poll_katcp(s, fd);
     j->j_line = create_katcl(fd);
     if(j->j_line == NULL){
       j->j_url = NULL;
       delete_job_katcp(d, j);
       return NULL;
     }
+    /* most of what a job emits is relayed to clients */
+    pass_katcl(j->j_line, 1);
   }
 
   /* after this point we are not permitted to fail :*) */
@@ -798,6 +818,8 @@ int ended_jobs_katcp(struct katcp_dispatch *d)
 
   s = d->d_shared;
 
+  halt_pools_katcp(d); /* otherwise members get restarted */
+
   for(i = 0; i < s->s_number; i++){
     j = s->s_tasks[i];
 
@@ -811,21 +833,90 @@ int ended_jobs_katcp(struct katcp_dispatch *d)
   return (s->s_number > 0) ? 0 : 1;
 }
 
+static struct katcl_parse *tag_request_job_katcp(struct katcp_job *j, struct katcl_parse *p)
+{
+  struct katcl_parse *px;
+  unsigned int i, count;
+  char *cmd;
+
+  cmd = get_string_parse_katcl(p, 0);
+  count = get_count_parse_katcl(p);
+  if((cmd == NULL) || (count == 0)){
+    return NULL;
+  }
+
+  px = create_parse_katcl();
+  if(px == NULL){
+    return NULL;
+  }
+
+  j->j_tag++;
+  if(j->j_tag > KATCP_JOB_TAG_MAX){
+    j->j_tag = 1;
+  }
+
+  if(add_args_parse_katcl(px, KATCP_FLAG_FIRST | ((count == 1) ? KATCP_FLAG_LAST : 0), "%s[%u]", cmd, j->j_tag) < 0){
+    destroy_parse_katcl(px);
+    return NULL;
+  }
+
+  for(i = 1; i < count; i++){
+    if(add_parameter_parse_katcl(px, ((i + 1) == count) ? KATCP_FLAG_LAST : 0, p, i) < 0){
+      destroy_parse_katcl(px);
+      return NULL;
+    }
+  }
+
+  set_tag_parse_katcl(px, j->j_tag);
+
+  return px;
+}
+
+static void fail_index_job_katcp(struct katcp_dispatch *d, struct katcp_job *j, unsigned int index, char *reason)
+{
+  struct katcp_notice *n;
+  struct katcl_parse *p, *px;
+
+  n = j->j_queue[index];
+
+  p = remove_parse_notice_katcp(d, n);
+  if(p){
+    px = turnaround_extra_parse_katcl(p, KATCP_RESULT_FAIL, reason);
+    if(px){ 
+      p = NULL;
+      /* WARNING: turnaround invalidates p */
+      if(set_parse_notice_katcp(d, n, px) < 0){
+        destroy_parse_katcl(px);
+      }
+    } else {
+      destroy_parse_katcl(p);
+    }
+  }
+
+  n = remove_index_job(d, j, index);
+  if(n){
+    trigger_notice_katcp(d, n);
+    release_notice_katcp(d, n);
+  }
+}
+
 int issue_request_job_katcp(struct katcp_dispatch *d, struct katcp_job *j)
 {
   struct katcp_notice *n;
   struct katcl_parse *p, *px;
+  unsigned int index;
+  int result;
 
 #ifdef DEBUG
-  fprintf(stderr, "issue: checking if job needs to issue a request (count=%d)\n", j->j_count);
+  fprintf(stderr, "issue: checking if job needs to issue a request (count=%d, sent=%d, window=%u)\n", j->j_count, j->j_sendr, j->j_window);
 #endif
 
   if(j->j_count <= 0){
     return 0; /* nothing to do */
   }
 
-  if(j->j_sendr > 0){
-    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "not sending request, another one already in queue");
+  if(j->j_sendr >= j->j_window){
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "not sending request, %d already outstanding", j->j_sendr);
     return 0; /* still waiting for a reply */
   }
 
@@ -844,53 +935,103 @@ int issue_request_job_katcp(struct katcp_dispatch *d, struct katcp_job *j)
   }
 #endif
 
-  n = j->j_queue[j->j_head];
-  if(n == NULL){
+  result = 0;
+
+  /* the first j_sendr entries of the queue have been sent, issue the ones after them */
+
+  while((j->j_sendr < j->j_count) && (j->j_sendr < j->j_window)){
+
+    index = (j->j_head + j->j_sendr) % j->j_size;
+
+    n = j->j_queue[index];
+    if(n == NULL){
 #ifdef DEBUG
-    fprintf(stderr, "issue: logic problem: nothing in queue, but woken up\n");
+      fprintf(stderr, "issue: logic problem: nothing in queue, but woken up\n");
 #endif
-    log_message_katcp(d, KATCP_LEVEL_FATAL, NULL, "queue of %u elements is empty at %u", j->j_count, j->j_head);
-    return -1;
-  }
+      log_message_katcp(d, KATCP_LEVEL_FATAL, NULL, "queue of %u elements is empty at %u", j->j_count, index);
+      return -1;
+    }
+
+    p = get_parse_notice_katcp(d, n);
+    if(p == NULL){
+      n = remove_index_job(d, j, index);
+      if(n){
+        trigger_notice_katcp(d, n);
+        release_notice_katcp(d, n);
+      }
+      result = -1;
+      continue;
+    }
 
-  p = get_parse_notice_katcp(d, n);
-  if(p){
 #ifdef DEBUG
     fprintf(stderr, "issue: got parse %p from notice %p (%s)\n", p, n, n->n_name);
 #endif
-    if(append_parse_katcl(j->j_line, p) >= 0){
-      j->j_sendr++;
-      return 0;
-    }
-
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to append request message to job");
 
-    p = remove_parse_notice_katcp(d, n);
-    if(p){
-      px = turnaround_extra_parse_katcl(p, KATCP_RESULT_FAIL, "allocation");
-      if(px){ 
-        p = NULL;
-        /* WARNING: turnaround invalidates p */
-        if(set_parse_notice_katcp(d, n, px) < 0){
+    if(j->j_window > 1){ /* several in flight, tag them so that replies can be told apart */
+      px = tag_request_job_katcp(j, p);
+      if((px == NULL) || (set_parse_notice_katcp(d, n, px) < 0)){
+        if(px){
           destroy_parse_katcl(px);
         }
-      } else {
-        destroy_parse_katcl(p);
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to tag request message to job");
+        fail_index_job_katcp(d, j, index, "allocation");
+        result = -1;
+        continue;
       }
+      p = px;
+    }
+
+    if(append_parse_katcl(j->j_line, p) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to append request message to job");
+      fail_index_job_katcp(d, j, index, "allocation");
+      result = -1;
+      continue;
     }
+
+    j->j_sendr++;
   }
 
-  n = remove_head_job(d, j);
-  if(n){
-    trigger_notice_katcp(d, n);
-    release_notice_katcp(d, n);
+  return result;
+}
+
+static int match_reply_job_katcp(struct katcp_dispatch *d, struct katcp_job *j, struct katcl_parse *p)
+{
+  struct katcl_parse *px;
+  unsigned int i, index;
+  int tag;
+
+  tag = get_tag_parse_katcl(p);
+  if(tag < 0){ /* untagged peers answer in order */
+    return j->j_head;
   }
 
-  /* TODO: try next item if this one fails */
+  for(i = 0; i < j->j_sendr; i++){
+    index = (j->j_head + i) % j->j_size;
+    px = get_parse_notice_katcp(d, j->j_queue[index]);
+    if(px && (get_tag_parse_katcl(px) == tag)){
+      return index;
+    }
+  }
 
   return -1;
 }
 
+int window_job_katcp(struct katcp_dispatch *d, struct katcp_job *j, unsigned int window)
+{
+  sane_job_katcp(j);
+
+  if(window < 1){
+    return -1;
+  }
+
+  /* requests already sent keep their form, a smaller window only takes effect as they are answered */
+  j->j_window = window;
+
+  issue_request_job_katcp(d, j);
+
+  return 0;
+}
+
 int match_inform_job_katcp(struct katcp_dispatch *d, struct katcp_job *j, char *match, int (*call)(struct katcp_dispatch *d, struct katcp_notice *n, void *data), void *data)
 {
   struct katcp_notice *n;
@@ -1061,7 +1202,7 @@ static int fail_request_job_katcp(struct katcp_dispatch *d, struct katcp_job *j,
 
 static int field_job_katcp(struct katcp_dispatch *d, struct katcp_job *j)
 {
-  int result;
+  int result, k;
   char *cmd;
   struct katcp_notice *n;
   struct katcl_parse *p;
@@ -1115,7 +1256,13 @@ static int field_job_katcp(struct katcp_dispatch *d, struct katcp_job *j)
           return -1;
         }
 
-        n = remove_head_job(d, j);
+        k = match_reply_job_katcp(d, j, p);
+        if(k < 0){
+          log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "ignoring reply %s with unknown tag %d", cmd, get_tag_parse_katcl(p));
+          break;
+        }
+
+        n = remove_index_job(d, j, k);
         if(n == NULL){
           /* as long as there are references, notices should not go away */
           log_message_katcp(d, KATCP_LEVEL_FATAL, NULL, "no outstanding notice despite waiting for a reply");
@@ -1243,6 +1390,8 @@ static int field_job_katcp(struct katcp_dispatch *d, struct katcp_job *j)
       return -1;
     }
 
+    TRACE_KATCP(KATCP_TRACE_RELAY, arg_count_katcl(j->j_line), cmd);
+
 #ifdef DEBUG
     fprintf(stderr, "job: processing message starting with <%s %s ...>\n", cmd, arg_string_katcl(j->j_line, 1));
 
@@ -1422,22 +1571,19 @@ int load_jobs_katcp(struct katcp_dispatch *d)
 
       switch(j->j_state){
         case JOB_STATE_PRE   :  
-          FD_SET(fd, &(s->s_write));
+          want_poll_katcp(s, fd, KATCP_POLL_WRITE);
           break;
         case JOB_STATE_UP    :
-          FD_SET(fd, &(s->s_read));
+          want_poll_katcp(s, fd, KATCP_POLL_READ);
           /* FALL */
         case JOB_STATE_POST :  
         case JOB_STATE_DRAIN :  
           if(flushing_katcl(j->j_line)){
-            FD_SET(fd, &(s->s_write));
+            want_poll_katcp(s, fd, KATCP_POLL_WRITE);
           }
           break;
         /* case JOB_STATE_DONE : */
       }
-      if(fd > s->s_max){ /* WARNING: what if no fd gets added ? */
-        s->s_max = fd;
-      }
     }
 
 #if 0
@@ -1445,13 +1591,13 @@ int load_jobs_katcp(struct katcp_dispatch *d)
       fd = fileno_katcl(j->j_line);
       if(fd >= 0){
         if(j->j_state & JOB_MAY_READ){
-          FD_SET(fd, &(s->s_read));
+          want_poll_katcp(s, fd, KATCP_POLL_READ);
         }
         if((j->j_state & JOB_MAY_WRITE) && flushing_katcl(j->j_line)){
-          FD_SET(fd, &(s->s_write));
+          want_poll_katcp(s, fd, KATCP_POLL_WRITE);
         }
         if(j->j_state & JOB_PRE_CONNECT){
-          FD_SET(fd, &(s->s_write));
+          want_poll_katcp(s, fd, KATCP_POLL_WRITE);
         }
       }
     }
@@ -1498,7 +1644,7 @@ int run_jobs_katcp(struct katcp_dispatch *d)
 
     switch(j->j_state){ /* async connect completes */
       case JOB_STATE_PRE : 
-        if(FD_ISSET(fd, &(s->s_write))){
+        if(ready_poll_katcp(s, fd, KATCP_POLL_WRITE)){
           len = sizeof(int);
           result = getsockopt(fd, SOL_SOCKET, SO_ERROR, &code, &len);
           if(result == 0){
@@ -1522,7 +1668,7 @@ int run_jobs_katcp(struct katcp_dispatch *d)
 
     switch(j->j_state){ /* read */
       case JOB_STATE_UP : 
-        if(FD_ISSET(fd, &(s->s_read))){
+        if(ready_poll_katcp(s, fd, KATCP_POLL_READ)){
           result = read_katcl(j->j_line);
 #ifdef DEBUG
           fprintf(stderr, "job: read from job returns %d\n", result);
@@ -1575,7 +1721,7 @@ int run_jobs_katcp(struct katcp_dispatch *d)
       case JOB_STATE_UP :
       case JOB_STATE_POST :
       case JOB_STATE_DRAIN :
-        if(FD_ISSET(fd, &(s->s_write))){
+        if(ready_poll_katcp(s, fd, KATCP_POLL_WRITE)){
           result = write_katcl(j->j_line);
 
           if(result < 0){
@@ -1744,13 +1890,85 @@ struct katcp_job *process_create_job_katcp(struct katcp_dispatch *d, struct katc
 }
 #endif
 
+/* spawn an executable with the given descriptor as its standard input and output. Uses posix_spawn, so vfork semantics, which avoids copying the page tables of a large server just to exec ****/
+
+static pid_t spawn_process_job_katcp(struct katcp_shared *s, char *cmd, char **argv, int fd, char *client)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attributes;
+  sigset_t defaults;
+  char **vector, *label;
+  unsigned int i, count;
+  int len, result;
+  pid_t pid;
+
+  for(count = 0; environ[count]; count++);
+
+  vector = malloc(sizeof(char *) * (count + 2));
+  if(vector == NULL){
+    return -1;
+  }
+
+  len = strlen(KATCP_CLIENT_VARIABLE) + strlen(client) + 2;
+  label = malloc(len);
+  if(label == NULL){
+    free(vector);
+    return -1;
+  }
+  snprintf(label, len, "%s=%s", KATCP_CLIENT_VARIABLE, client);
+
+  len = strlen(KATCP_CLIENT_VARIABLE);
+
+  /* what setenv in the child used to do, just without touching our own environment */
+  vector[0] = label;
+  count = 1;
+  for(i = 0; environ[i]; i++){
+    if(strncmp(environ[i], KATCP_CLIENT_VARIABLE, len) || (environ[i][len] != '=')){
+      vector[count++] = environ[i];
+    }
+  }
+  vector[count] = NULL;
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attributes);
+
+  posix_spawn_file_actions_adddup2(&actions, fd, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, fd, STDOUT_FILENO);
+  if((fd != STDIN_FILENO) && (fd != STDOUT_FILENO)){
+    posix_spawn_file_actions_addclose(&actions, fd);
+  }
+
+  /* child starts with the mask we had before blocking SIGCHLD for the loop */
+  if(s && s->s_restore_signals){
+    posix_spawnattr_setsigmask(&attributes, &(s->s_mask_previous));
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGCHLD);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  }
+
+  result = posix_spawnp(&pid, cmd, &actions, &attributes, argv, vector);
+
+  posix_spawnattr_destroy(&attributes);
+  posix_spawn_file_actions_destroy(&actions);
+
+  free(label);
+  free(vector);
+
+  if(result != 0){
+    errno = result;
+    return -1;
+  }
+
+  return pid;
+}
+
 struct katcp_job *process_relay_create_job_katcp(struct katcp_dispatch *d, struct katcp_url *file, char **argv, struct katcp_notice *halt, struct katcp_notice *relay)
 {
   int fds[2];
   pid_t pid;
   char *ptr;
-  int copies, len;
-  struct katcl_line *xl;
+  int len;
   struct katcp_job *j;
   char *client;
 
@@ -1758,88 +1976,52 @@ struct katcp_job *process_relay_create_job_katcp(struct katcp_dispatch *d, struc
     return NULL;
   }
 
-  /* WARNING: if we every destroy logic in child after fork, client content needs to be duplicated */
   if(d && (d->d_name[0] != '\0')){
     client = d->d_name;
   } else {
     client = "unknown";
   }
 
-  pid = fork();
+  /* our end must not leak into the child */
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+  pid = spawn_process_job_katcp(d ? d->d_shared : NULL, file->u_cmd, argv, fds[0], client);
+  close(fds[0]);
+
   if(pid < 0){
-    close(fds[0]);
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to run command %s (%s)", file->u_cmd, strerror(errno));
     close(fds[1]);
     return NULL;
   }
 
-  if(pid > 0){
-    close(fds[0]);
-    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
-
-    j = create_job_katcp(d, file, pid, fds[1], 0, halt);
-    if(j == NULL){
-      log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "unable to allocate job logic so terminating child process");
-      kill(pid, SIGTERM);
-      close(fds[1]);
+  j = create_job_katcp(d, file, pid, fds[1], 0, halt);
+  if(j == NULL){
+    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "unable to allocate job logic so terminating child process");
+    kill(pid, SIGTERM);
+    close(fds[1]);
 #if 0
-      /* convention: on sucess we assume responsibility for all pointers we are given, on failure we are not responsibly for anything. A failure should be equivalnet to the call never happening */
-      destroy_kurl_katcp(file);
+    /* convention: on sucess we assume responsibility for all pointers we are given, on failure we are not responsibly for anything. A failure should be equivalnet to the call never happening */
+    destroy_kurl_katcp(file);
 #endif
-      return NULL;
-    }
-
-    /* construct a #inform from the command given, register it triggering given relay */
-    if(relay && file->u_cmd){
-      len = strlen(file->u_cmd) + 2;
-      ptr = malloc(len);
-      if(ptr){
-        snprintf(ptr, len, "%c%s", KATCP_INFORM, file->u_cmd);
-        ptr[len - 1] = '\0';
-
-        if(match_notice_job_katcp(d, j, ptr, relay) < 0){
-          log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to register command relay for job %s", j->j_url->u_str ? j->j_url->u_str : "<anonymous>");
-        }
-        free(ptr);
-      }
-    }
-
-    return j;
+    return NULL;
   }
 
-  /* WARNING: now in child, do not call return, use exit */
-
-  setenv("KATCP_CLIENT", client, 1);
-
-  xl = create_katcl(fds[0]);
-
-  close(fds[1]);
+  /* construct a #inform from the command given, register it triggering given relay */
+  if(relay && file->u_cmd){
+    len = strlen(file->u_cmd) + 2;
+    ptr = malloc(len);
+    if(ptr){
+      snprintf(ptr, len, "%c%s", KATCP_INFORM, file->u_cmd);
+      ptr[len - 1] = '\0';
 
-  copies = 0;
-  if(fds[0] != STDOUT_FILENO){
-    if(dup2(fds[0], STDOUT_FILENO) != STDOUT_FILENO){
-      sync_message_katcl(xl, KATCP_LEVEL_ERROR, NULL, "unable to set up standard output for child process %u (%s)", getpid(), strerror(errno)); 
-      exit(EX_OSERR);
-    }
-    copies++;
-  }
-  if(fds[0] != STDIN_FILENO){
-    if(dup2(fds[0], STDIN_FILENO) != STDIN_FILENO){
-      sync_message_katcl(xl, KATCP_LEVEL_ERROR, NULL, "unable to set up standard input for child process %u (%s)", getpid(), strerror(errno)); 
-      exit(EX_OSERR);
+      if(match_notice_job_katcp(d, j, ptr, relay) < 0){
+        log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to register command relay for job %s", j->j_url->u_str ? j->j_url->u_str : "<anonymous>");
+      }
+      free(ptr);
     }
-    copies++;
-  }
-  if(copies >= 2){
-    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
   }
 
-  execvp(file->u_cmd, argv);
-  sync_message_katcl(xl, KATCP_LEVEL_ERROR, NULL, "unable to run command %s (%s)", file->u_cmd, strerror(errno)); 
-
-  destroy_katcl(xl, 0);
-
-  exit(EX_OSERR);
-  return NULL;
+  return j;
 }
 
 struct katcp_job *network_name_connect_job_katcp(struct katcp_dispatch *d, char *host, int port, struct katcp_notice *halt)
@@ -1864,10 +2046,14 @@ struct katcp_job *network_connect_job_katcp(struct katcp_dispatch *d, struct kat
   struct katcp_job *j;
   int fd;
 
-  fd = net_connect(url->u_host, url->u_port, NETC_ASYNC | NETC_TCP_KEEP_ALIVE);
+  if(url->u_scheme && (strcasecmp(url->u_scheme, "unix") == 0)){
+    fd = net_connect(url->u_str, 0, NETC_ASYNC);
+  } else {
+    fd = net_connect(url->u_host, url->u_port, NETC_ASYNC | NETC_TCP_KEEP_ALIVE);
+  }
 
   if (fd < 0){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to connect to %s:%d: %s", url->u_host, url->u_port, strerror(errno));
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to connect to %s: %s", url->u_str, strerror(errno));
     return NULL;
   }
   
@@ -1883,6 +2069,129 @@ struct katcp_job *network_connect_job_katcp(struct katcp_dispatch *d, struct kat
   return j;
 }
 
+/* shared network jobs: one connection per host and port, counted, closed once unused for a while ****/
+
+static int idle_network_job_katcp(struct katcp_dispatch *d, void *data)
+{
+  struct katcp_job *j;
+
+  j = data;
+
+  sane_job_katcp(j);
+
+  if(j->j_refs > 0){
+    return -1;
+  }
+
+  if(j->j_count > 0){
+    return 0; /* still draining requests, look again later */
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "closing idle connection to %s", j->j_url->u_str);
+
+  zap_job_katcp(d, j);
+
+  return -1;
+}
+
+struct katcp_job *acquire_network_job_katcp(struct katcp_dispatch *d, struct katcp_url *url)
+{
+  struct katcp_shared *s;
+  struct katcp_notice *n;
+  struct katcp_job *j;
+  unsigned int i;
+
+  s = d->d_shared;
+
+  for(i = 0; i < s->s_number; i++){
+    j = s->s_tasks[i];
+
+    if((j->j_refs < 0) || (j->j_url->u_host == NULL) || (url->u_host == NULL)){
+      continue;
+    }
+
+    if((j->j_state != JOB_STATE_PRE) && (j->j_state != JOB_STATE_UP)){
+      continue; /* on its way out */
+    }
+
+    if((j->j_url->u_port == url->u_port) && !strcmp(j->j_url->u_host, url->u_host)){
+      if(j->j_refs == 0){
+        discharge_timer_katcp(d, j);
+      }
+      j->j_refs++;
+      log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "reusing connection to %s, now held %d times", j->j_url->u_str, j->j_refs);
+      return j;
+    }
+  }
+
+  /* holders subscribe to the halt notice to learn of a disconnect */
+  n = create_notice_katcp(d, NULL, 0);
+  if(n == NULL){
+    return NULL;
+  }
+
+  j = network_connect_job_katcp(d, url, n);
+  if(j == NULL){
+    return NULL;
+  }
+
+  j->j_refs = 1;
+
+  return j;
+}
+
+struct katcp_job *acquire_network_name_job_katcp(struct katcp_dispatch *d, char *host, int port)
+{
+  struct katcp_url *u;
+  struct katcp_job *j;
+
+  u = create_kurl_katcp("katcp", host, port, "/");
+  if(u == NULL){
+    return NULL;
+  }
+
+  j = acquire_network_job_katcp(d, u);
+  if((j == NULL) || (j->j_url != u)){
+    /* only the job of a new connection keeps the url */
+    destroy_kurl_katcp(u);
+  }
+
+  return j;
+}
+
+int release_network_job_katcp(struct katcp_dispatch *d, struct katcp_job *j)
+{
+  struct timeval tv;
+
+  sane_job_katcp(j);
+
+  if(j->j_refs <= 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "releasing job %s which is not held", j->j_url->u_str);
+    return -1;
+  }
+
+  j->j_refs--;
+  if(j->j_refs > 0){
+    return 0;
+  }
+
+  tv.tv_sec = KATCP_JOB_IDLE;
+  tv.tv_usec = 0;
+
+  if(register_every_tv_katcp(d, &tv, &idle_network_job_katcp, j) < 0){
+    zap_job_katcp(d, j);
+  }
+
+  return 0;
+}
+
+struct katcp_notice *halt_notice_job_katcp(struct katcp_job *j)
+{
+  sane_job_katcp(j);
+
+  return j->j_halt;
+}
+
 /***********************************************************************************/
 
 #define KATCP_JOB_UNLOCK   0x1
@@ -2188,9 +2497,9 @@ int job_cmd_katcp(struct katcp_dispatch *d, int argc)
         (j->j_pid == 0) ? "is not a subprocess" : "is a subprocess");
 #endif
 
-        log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "job on %s (%p) with %d notices in queue, %d sent requests, %d received requests, pid %d and state %d", 
+        log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "job on %s (%p) with %d notices in queue, %d sent requests (window %u), %d received requests, pid %d, state %d and %d holders", 
         j->j_url->u_str, j, j->j_count,
-        j->j_sendr, j->j_recvr, j->j_pid, j->j_state);
+        j->j_sendr, j->j_window, j->j_recvr, j->j_pid, j->j_state, j->j_refs);
         log_map_katcp(d, j->j_url->u_str, j->j_map);
       }
       log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "%d jobs", s->s_number);
@@ -2338,6 +2647,70 @@ int job_cmd_katcp(struct katcp_dispatch *d, int argc)
 
       return KATCP_RESULT_OK;
 
+    } else if(!strcmp(name, "share")){ 
+      host = arg_string_katcp(d, 2);
+      if(host == NULL){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a uri to connect to");
+        return KATCP_RESULT_FAIL;
+      }
+
+      url = create_kurl_from_string_katcp(host);
+      if(url == NULL){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to parse name uri try katcp://host:port");
+        return KATCP_RESULT_FAIL;
+      }
+
+      j = acquire_network_job_katcp(d, url);
+      if((j == NULL) || (j->j_url != url)){
+        destroy_kurl_katcp(url);
+      }
+      if(j == NULL){
+        return KATCP_RESULT_FAIL;
+      }
+
+      log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "connection to %s held %d times", j->j_url->u_str, j->j_refs);
+
+      return KATCP_RESULT_OK;
+
+    } else if(!strcmp(name, "release")){ 
+      label = arg_string_katcp(d, 2);
+      if(label == NULL){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a job label to release");
+        return KATCP_RESULT_FAIL;
+      }
+
+      j = find_job_katcp(d, label);
+      if(j == NULL){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to find job labelled %s", label);
+        return KATCP_RESULT_FAIL;
+      }
+
+      if(release_network_job_katcp(d, j) < 0){
+        return KATCP_RESULT_FAIL;
+      }
+
+      return KATCP_RESULT_OK;
+
+    } else if(!strcmp(name, "window")){ 
+      label = arg_string_katcp(d, 2);
+      if((label == NULL) || (argc < 4)){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a job label and a number of outstanding requests");
+        return KATCP_RESULT_FAIL;
+      }
+
+      j = find_job_katcp(d, label);
+      if(j == NULL){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to find job labelled %s", label);
+        return KATCP_RESULT_FAIL;
+      }
+
+      if(window_job_katcp(d, j, arg_unsigned_long_katcp(d, 3)) < 0){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "window needs to be at least one request");
+        return KATCP_RESULT_FAIL;
+      }
+
+      return KATCP_RESULT_OK;
+
     } else if(!strcmp(name, "watchdog")){
 
       label = arg_string_katcp(d, 2);
@@ -0,0 +1,758 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* persistent dbase: once a journal is open, every successful set is
+ * appended to it as a record holding the stamp and the arguments of
+ * the set (key, schema, values and tags). Opening an existing journal
+ * maps it and only indexes it by key, an entry is decoded and stored
+ * the first time it is looked up, so a restart does not have to
+ * rebuild the database before it can answer. Searches by tag need
+ * everything, so load the rest. A delete is recorded as a record
+ * holding only the key. Once superseded records outnumber the
+ * live ones, the journal is rewritten with only the latest record of
+ * each key. Records are in host byte order: a journal is a local
+ * cache, not an interchange format. Appends are not synced, a torn
+ * record at the end is dropped on the next open
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "katpriv.h"
+#include "katcl.h"
+#include "katcp.h"
+#include "avltree.h"
+
+#define JOURNAL_MAGIC     0x4b434a31 /* KCJ1 */
+#define JOURNAL_HEADER    8          /* magic and record count hint */
+#define JOURNAL_RECORD    8          /* length and checksum before each payload */
+#define JOURNAL_COMPACT   1024       /* superseded records tolerated regardless of live count */
+#define JOURNAL_ARGS      64         /* most arguments of a set we decode */
+
+struct katcp_journal_slot{
+  unsigned long s_offset;  /* of latest record for this key */
+  unsigned int s_length;   /* of its payload */
+  int s_resident;          /* decoded already, or set since */
+};
+
+struct katcp_journal{
+  char *j_path;
+  int j_fd;
+
+  char *j_map;             /* the file as it was when opened */
+  unsigned long j_mapped;
+
+  unsigned long j_size;    /* where the next record goes */
+
+  struct avl_tree *j_index;
+  unsigned long j_live;
+  unsigned long j_dead;
+  unsigned long j_pending; /* indexed but not yet decoded */
+
+  int j_replaying;
+};
+
+static uint32_t checksum_journal_katcp(char *buffer, unsigned int length)
+{
+  uint32_t h;
+  unsigned int i;
+
+  h = 2166136261U;
+  for(i = 0; i < length; i++){
+    h ^= (unsigned char)(buffer[i]);
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+static void unmap_journal_katcp(struct katcp_journal *j)
+{
+  if(j->j_map){
+    munmap(j->j_map, j->j_mapped);
+    j->j_map = NULL;
+  }
+  j->j_mapped = 0;
+}
+
+static void destroy_journal_katcp(struct katcp_journal *j)
+{
+  if(j == NULL){
+    return;
+  }
+
+  unmap_journal_katcp(j);
+
+  if(j->j_fd >= 0){
+    close(j->j_fd);
+    j->j_fd = (-1);
+  }
+
+  if(j->j_index){
+    destroy_avltree(j->j_index, NULL); /* slots live in the arena */
+    j->j_index = NULL;
+  }
+
+  if(j->j_path){
+    free(j->j_path);
+    j->j_path = NULL;
+  }
+
+  free(j);
+}
+
+/* records ****************************************************************/
+
+static char *encode_journal_katcp(struct katcl_parse *p, struct timeval *tv, unsigned int *length)
+{
+  unsigned int i, count, total, len;
+  char *buffer, *ptr, *str;
+  uint32_t value;
+
+  /* payload: seconds, microseconds, argument count, then length prefixed arguments, name of the set excluded */
+
+  count = get_count_parse_katcl(p);
+  if(count < 2){
+    return NULL;
+  }
+
+  total = 3 * sizeof(uint32_t);
+  for(i = 1; i < count; i++){
+    str = get_string_parse_katcl(p, i);
+    total += sizeof(uint32_t) + (str ? strlen(str) : 0);
+  }
+
+  buffer = malloc(JOURNAL_RECORD + total);
+  if(buffer == NULL){
+    return NULL;
+  }
+
+  ptr = buffer + JOURNAL_RECORD;
+
+  value = tv->tv_sec;
+  memcpy(ptr, &value, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+
+  value = tv->tv_usec;
+  memcpy(ptr, &value, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+
+  value = count - 1;
+  memcpy(ptr, &value, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+
+  for(i = 1; i < count; i++){
+    str = get_string_parse_katcl(p, i);
+    len = str ? strlen(str) : 0;
+
+    value = len;
+    memcpy(ptr, &value, sizeof(uint32_t));
+    ptr += sizeof(uint32_t);
+
+    if(len > 0){
+      memcpy(ptr, str, len);
+      ptr += len;
+    }
+  }
+
+  value = total;
+  memcpy(buffer, &value, sizeof(uint32_t));
+
+  value = checksum_journal_katcp(buffer + JOURNAL_RECORD, total);
+  memcpy(buffer + sizeof(uint32_t), &value, sizeof(uint32_t));
+
+  *length = total;
+
+  return buffer;
+}
+
+static int check_journal_katcp(char *payload, unsigned int length, char **key, unsigned int *klen)
+{
+  uint32_t count, len;
+  unsigned int used, i;
+
+  /* walk a payload, return the argument count and key of the record, or -1 if it is malformed */
+
+  if(length < (4 * sizeof(uint32_t))){
+    return -1;
+  }
+
+  memcpy(&count, payload + (2 * sizeof(uint32_t)), sizeof(uint32_t));
+  if((count == 0) || (count > JOURNAL_ARGS)){
+    return -1;
+  }
+
+  used = 3 * sizeof(uint32_t);
+
+  for(i = 0; i < count; i++){
+    if((used + sizeof(uint32_t)) > length){
+      return -1;
+    }
+    memcpy(&len, payload + used, sizeof(uint32_t));
+    used += sizeof(uint32_t);
+
+    if((used + len) > length){
+      return -1;
+    }
+
+    if(i == 0){
+      *key = payload + used;
+      *klen = len;
+    }
+
+    used += len;
+  }
+
+  return (used == length) ? count : -1;
+}
+
+static int read_journal_katcp(struct katcp_journal *j, unsigned long offset, unsigned int length, char **payload, char **allocated)
+{
+  char *buffer;
+  int rr;
+
+  /* records from the time of opening are in the map, later ones have to be read */
+
+  *allocated = NULL;
+
+  if(j->j_map && ((offset + length) <= j->j_mapped)){
+    *payload = j->j_map + offset;
+    return 0;
+  }
+
+  buffer = malloc(length);
+  if(buffer == NULL){
+    return -1;
+  }
+
+  rr = pread(j->j_fd, buffer, length, offset);
+  if((rr < 0) || (rr != length)){
+    free(buffer);
+    return -1;
+  }
+
+  *payload = buffer;
+  *allocated = buffer;
+
+  return 0;
+}
+
+static struct katcp_journal_slot *index_journal_katcp(struct katcp_journal *j, char *key, unsigned long offset, unsigned int length, int resident)
+{
+  struct katcp_journal_slot *js;
+  struct avl_node *n;
+
+  n = find_name_node_avltree(j->j_index, key);
+  if(n){
+    js = get_node_data_avltree(n);
+    if(js->s_resident == 0){
+      j->j_pending--;
+    }
+    j->j_dead++;
+  } else {
+    js = alloc_arena_avltree(j->j_index, sizeof(struct katcp_journal_slot));
+    if(js == NULL){
+      return NULL;
+    }
+    if(store_named_node_avltree(j->j_index, key, js) < 0){
+      return NULL;
+    }
+    j->j_live++;
+  }
+
+  js->s_offset = offset;
+  js->s_length = length;
+  js->s_resident = resident;
+
+  if(resident == 0){
+    j->j_pending++;
+  }
+
+  return js;
+}
+
+static void forget_journal_katcp(struct katcp_journal *j, char *key)
+{
+  struct katcp_journal_slot *js;
+  struct avl_node *n;
+
+  j->j_dead++; /* the delete record itself */
+
+  n = find_name_node_avltree(j->j_index, key);
+  if(n == NULL){
+    return;
+  }
+
+  js = get_node_data_avltree(n);
+  if(js->s_resident == 0){
+    j->j_pending--;
+  }
+
+  del_node_avltree(j->j_index, n, NULL); /* slot stays in the arena */
+
+  j->j_live--;
+  j->j_dead++;
+}
+
+static int scan_journal_katcp(struct katcp_dispatch *d, struct katcp_journal *j)
+{
+  unsigned long offset;
+  uint32_t length, sum;
+  char *key, *copy;
+  unsigned int klen;
+  int count;
+
+  offset = JOURNAL_HEADER;
+
+  while((offset + JOURNAL_RECORD) <= j->j_mapped){
+    memcpy(&length, j->j_map + offset, sizeof(uint32_t));
+    memcpy(&sum, j->j_map + offset + sizeof(uint32_t), sizeof(uint32_t));
+
+    if((offset + JOURNAL_RECORD + length) > j->j_mapped){
+      break;
+    }
+
+    if(checksum_journal_katcp(j->j_map + offset + JOURNAL_RECORD, length) != sum){
+      break;
+    }
+
+    count = check_journal_katcp(j->j_map + offset + JOURNAL_RECORD, length, &key, &klen);
+    if(count < 0){
+      break;
+    }
+
+    copy = malloc(klen + 1);
+    if(copy == NULL){
+      return -1;
+    }
+    memcpy(copy, key, klen);
+    copy[klen] = '\0';
+
+    if(count == 1){
+      forget_journal_katcp(j, copy);
+    } else if(index_journal_katcp(j, copy, offset + JOURNAL_RECORD, length, 0) == NULL){
+      free(copy);
+      return -1;
+    }
+
+    free(copy);
+
+    offset += JOURNAL_RECORD + length;
+  }
+
+  if(offset < j->j_mapped){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "discarding %lu bytes of damaged or incomplete records at the end of journal %s", j->j_mapped - offset, j->j_path);
+    if(ftruncate(j->j_fd, offset) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to truncate journal %s: %s", j->j_path, strerror(errno));
+      return -1;
+    }
+  }
+
+  j->j_size = offset;
+
+  return 0;
+}
+
+static int map_journal_katcp(struct katcp_dispatch *d, struct katcp_journal *j)
+{
+  struct stat st;
+  uint32_t magic;
+
+  if(fstat(j->j_fd, &st) < 0){
+    return -1;
+  }
+
+  if(st.st_size < JOURNAL_HEADER){
+    /* new or empty file, start with a header */
+    magic = JOURNAL_MAGIC;
+    if(ftruncate(j->j_fd, 0) < 0){
+      return -1;
+    }
+    if((pwrite(j->j_fd, &magic, sizeof(uint32_t), 0) != sizeof(uint32_t)) || (ftruncate(j->j_fd, JOURNAL_HEADER) < 0)){
+      return -1;
+    }
+    j->j_size = JOURNAL_HEADER;
+    return 0;
+  }
+
+  j->j_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, j->j_fd, 0);
+  if(j->j_map == MAP_FAILED){
+    j->j_map = NULL;
+    return -1;
+  }
+  j->j_mapped = st.st_size;
+
+  memcpy(&magic, j->j_map, sizeof(uint32_t));
+  if(magic != JOURNAL_MAGIC){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "%s does not look like a journal", j->j_path);
+    return -1;
+  }
+
+  return scan_journal_katcp(d, j);
+}
+
+/* replay *****************************************************************/
+
+static int decode_journal_katcp(struct katcp_dispatch *d, struct katcp_journal *j, struct katcp_journal_slot *js)
+{
+  struct katcl_parse *p;
+  struct katcp_dbase *db;
+  struct timeval tv;
+  char *payload, *allocated, *key;
+  uint32_t value, count, len;
+  unsigned int used, i;
+  int result;
+
+  if(read_journal_katcp(j, js->s_offset, js->s_length, &payload, &allocated) < 0){
+    return -1;
+  }
+
+  result = -1;
+  key = NULL;
+
+  p = create_parse_katcl();
+  if(p == NULL){
+    free(allocated);
+    return -1;
+  }
+
+  memcpy(&value, payload, sizeof(uint32_t));
+  tv.tv_sec = value;
+  memcpy(&value, payload + sizeof(uint32_t), sizeof(uint32_t));
+  tv.tv_usec = value;
+  memcpy(&count, payload + (2 * sizeof(uint32_t)), sizeof(uint32_t));
+
+  used = 3 * sizeof(uint32_t);
+
+  if(add_string_parse_katcl(p, KATCP_FLAG_STRING | KATCP_FLAG_FIRST, KATCP_SET_REQUEST) >= 0){
+    for(i = 0; i < count; i++){
+      memcpy(&len, payload + used, sizeof(uint32_t));
+      used += sizeof(uint32_t);
+      if(add_buffer_parse_katcl(p, KATCP_FLAG_BUFFER | ((i + 1 == count) ? KATCP_FLAG_LAST : 0), payload + used, len) < 0){
+        break;
+      }
+      used += len;
+    }
+    if(i >= count){
+      result = 0;
+    }
+  }
+
+  /* set sees this as a new store, without appending it again */
+  js->s_resident = 1;
+  j->j_pending--;
+
+  if(result == 0){
+    j->j_replaying = 1;
+    result = set_dbase_katcp(d, p);
+    j->j_replaying = 0;
+
+    key = get_string_parse_katcl(p, 1);
+    if(key){
+      db = search_named_type_katcp(d, KATCP_TYPE_DBASE, key, NULL);
+      if(db){
+        db->d_stamped = tv;
+      }
+    }
+  }
+
+  destroy_parse_katcl(p);
+  if(allocated){
+    free(allocated);
+  }
+
+  return result;
+}
+
+int fault_dbase_katcp(struct katcp_dispatch *d, char *key)
+{
+  struct katcp_shared *s;
+  struct katcp_journal *j;
+  struct katcp_journal_slot *js;
+
+  s = d->d_shared;
+  j = s->s_journal;
+
+  if((j == NULL) || (j->j_pending == 0) || (key == NULL)){
+    return 0;
+  }
+
+  js = find_data_avltree(j->j_index, key);
+  if((js == NULL) || js->s_resident){
+    return 0;
+  }
+
+  return decode_journal_katcp(d, j, js);
+}
+
+int fault_all_dbase_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_shared *s;
+  struct katcp_journal *j;
+  struct katcp_journal_slot *js;
+  struct avl_node *n;
+  int result;
+
+  s = d->d_shared;
+  j = s->s_journal;
+
+  if((j == NULL) || (j->j_pending == 0)){
+    return 0;
+  }
+
+  result = 0;
+
+  for(n = first_avltree(j->j_index); (n != NULL) && (j->j_pending > 0); n = next_avltree(n)){
+    js = get_node_data_avltree(n);
+    if(js->s_resident == 0){
+      if(decode_journal_katcp(d, j, js) < 0){
+        log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to restore %s from journal", get_node_name_avltree(n));
+        result = (-1);
+      }
+    }
+  }
+
+  return result;
+}
+
+/* compaction *************************************************************/
+
+static int compact_journal_katcp(struct katcp_dispatch *d, struct katcp_journal *j)
+{
+  struct katcp_journal_slot *js;
+  struct avl_node *n;
+  char *payload, *allocated, *name;
+  unsigned long offset;
+  uint32_t header[2];
+  int fd, result;
+  unsigned int len;
+
+  len = strlen(j->j_path);
+  name = malloc(len + 5);
+  if(name == NULL){
+    return -1;
+  }
+  sprintf(name, "%s.new", j->j_path);
+
+  fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create %s: %s", name, strerror(errno));
+    free(name);
+    return -1;
+  }
+
+  header[0] = JOURNAL_MAGIC;
+  header[1] = j->j_live;
+
+  result = (write(fd, header, JOURNAL_HEADER) == JOURNAL_HEADER) ? 0 : (-1);
+  offset = JOURNAL_HEADER;
+
+  /* first pass copies, offsets are only updated once the new file is in place */
+
+  for(n = first_avltree(j->j_index); (n != NULL) && (result == 0); n = next_avltree(n)){
+    js = get_node_data_avltree(n);
+    if(read_journal_katcp(j, js->s_offset - JOURNAL_RECORD, js->s_length + JOURNAL_RECORD, &payload, &allocated) < 0){
+      result = (-1);
+    } else {
+      if(write(fd, payload, js->s_length + JOURNAL_RECORD) != (js->s_length + JOURNAL_RECORD)){
+        result = (-1);
+      }
+      if(allocated){
+        free(allocated);
+      }
+    }
+    offset += js->s_length + JOURNAL_RECORD;
+  }
+
+  if((result < 0) || (fsync(fd) < 0) || (rename(name, j->j_path) < 0)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to compact journal %s: %s", j->j_path, strerror(errno));
+    close(fd);
+    unlink(name);
+    free(name);
+    return -1;
+  }
+
+  free(name);
+
+  offset = JOURNAL_HEADER;
+  for(n = first_avltree(j->j_index); n != NULL; n = next_avltree(n)){
+    js = get_node_data_avltree(n);
+    js->s_offset = offset + JOURNAL_RECORD;
+    offset += js->s_length + JOURNAL_RECORD;
+  }
+
+  unmap_journal_katcp(j);
+  close(j->j_fd);
+  j->j_fd = fd;
+
+  j->j_size = offset;
+  j->j_dead = 0;
+
+  /* remap, so that pending entries still come from memory */
+  j->j_map = mmap(NULL, offset, PROT_READ, MAP_SHARED, fd, 0);
+  if(j->j_map == MAP_FAILED){
+    j->j_map = NULL;
+  } else {
+    j->j_mapped = offset;
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "compacted journal %s to %lu records in %lu bytes", j->j_path, j->j_live, offset);
+
+  return 0;
+}
+
+/* api ********************************************************************/
+
+int append_journal_dbase_katcp(struct katcp_dispatch *d, struct katcl_parse *p, struct timeval *tv)
+{
+  struct katcp_shared *s;
+  struct katcp_journal *j;
+  char *buffer, *key;
+  unsigned int length;
+  int wr;
+
+  s = d->d_shared;
+  j = s->s_journal;
+
+  if((j == NULL) || j->j_replaying){
+    return 0;
+  }
+
+  key = get_string_parse_katcl(p, 1);
+  if(key == NULL){
+    return -1;
+  }
+
+  buffer = encode_journal_katcp(p, tv, &length);
+  if(buffer == NULL){
+    return -1;
+  }
+
+  wr = pwrite(j->j_fd, buffer, length + JOURNAL_RECORD, j->j_size);
+  free(buffer);
+
+  if(wr != (length + JOURNAL_RECORD)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to append to journal %s: %s", j->j_path, (wr < 0) ? strerror(errno) : "short write");
+    /* a partial record is dropped at the next open, next append overwrites it */
+    return -1;
+  }
+
+  if(get_count_parse_katcl(p) <= 2){
+    forget_journal_katcp(j, key);
+  } else if(index_journal_katcp(j, key, j->j_size + JOURNAL_RECORD, length, 1) == NULL){
+    return -1;
+  }
+
+  j->j_size += length + JOURNAL_RECORD;
+
+  if((j->j_dead > JOURNAL_COMPACT) && (j->j_dead > j->j_live)){
+    compact_journal_katcp(d, j);
+  }
+
+  return 0;
+}
+
+int open_journal_dbase_katcp(struct katcp_dispatch *d, char *path)
+{
+  struct katcp_shared *s;
+  struct katcp_journal *j;
+
+  s = d->d_shared;
+
+  if(s->s_journal){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "journal %s already open", s->s_journal->j_path);
+    return -1;
+  }
+
+  j = malloc(sizeof(struct katcp_journal));
+  if(j == NULL){
+    return -1;
+  }
+
+  j->j_path = NULL;
+  j->j_fd = (-1);
+  j->j_map = NULL;
+  j->j_mapped = 0;
+  j->j_size = 0;
+  j->j_index = NULL;
+  j->j_live = 0;
+  j->j_dead = 0;
+  j->j_pending = 0;
+  j->j_replaying = 0;
+
+  j->j_path = strdup(path);
+  j->j_index = create_arena_avltree(0);
+  if((j->j_path == NULL) || (j->j_index == NULL)){
+    destroy_journal_katcp(j);
+    return -1;
+  }
+
+  j->j_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(j->j_fd < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to open journal %s: %s", path, strerror(errno));
+    destroy_journal_katcp(j);
+    return -1;
+  }
+
+  if(map_journal_katcp(d, j) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to load journal %s", path);
+    destroy_journal_katcp(j);
+    return -1;
+  }
+
+  s->s_journal = j;
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "journal %s has %lu keys, %lu superseded records", path, j->j_live, j->j_dead);
+
+  return 0;
+}
+
+void close_journal_dbase_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_shared *s;
+
+  s = d->d_shared;
+  if((s == NULL) || (s->s_journal == NULL)){
+    return;
+  }
+
+  destroy_journal_katcp(s->s_journal);
+  s->s_journal = NULL;
+}
+
+int journal_dbase_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_shared *s;
+  struct katcp_journal *j;
+  char *path;
+
+  s = d->d_shared;
+
+  if(argc > 1){
+    path = arg_string_katcp(d, 1);
+    if(path == NULL){
+      return KATCP_RESULT_FAIL;
+    }
+    if(open_journal_dbase_katcp(d, path) < 0){
+      return KATCP_RESULT_FAIL;
+    }
+  }
+
+  j = s->s_journal;
+  if(j == NULL){
+    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "database is not persisted");
+    return KATCP_RESULT_OK;
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "journal %s of %lu bytes has %lu keys, %lu not yet loaded, and %lu superseded records", j->j_path, j->j_size, j->j_live, j->j_pending, j->j_dead);
+
+  return KATCP_RESULT_OK;
+}
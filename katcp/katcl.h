@@ -71,6 +71,26 @@ int relay_katcl(struct katcl_line *lx, struct katcl_line *ly);
 int flushing_katcl(struct katcl_line *l);
 int write_katcl(struct katcl_line *l);
 
+#define KATCL_LIMIT_NONE        0  /* queue grows without bound */
+#define KATCL_LIMIT_LATEST      1  /* keep only latest pending status of each sensor */
+#define KATCL_LIMIT_DROP        2  /* discard informs */
+#define KATCL_LIMIT_DISCONNECT  3  /* give up on the connection */
+
+int limit_katcl(struct katcl_line *l, int policy, unsigned int high, unsigned int low);
+int overflowed_katcl(struct katcl_line *l);
+unsigned int queued_katcl(struct katcl_line *l);
+unsigned int buffered_katcl(struct katcl_line *l);
+unsigned long shed_katcl(struct katcl_line *l);
+int limit_to_code_katcl(char *name);
+char *limit_to_string_katcl(int code);
+
+#define KATCL_BINARY_NAME "length" /* value for the binary-encoding request */
+
+int binary_katcl(struct katcl_line *l, int enable);
+int pass_katcl(struct katcl_line *l, int enable); /* for lines mostly relayed elsewhere */
+int tag_katcl(struct katcl_line *l, int tag); /* replies and informs appended from now on carry the tag */
+int cork_katcl(struct katcl_line *l, int enable); /* group informs into full segments, on by default */
+
 int fileno_katcl(struct katcl_line *l);
 int problem_katcl(struct katcl_line *l);
 
@@ -112,6 +132,34 @@ int send_rpc_katcl(struct katcl_line *l, unsigned int timeout, ...);
 int finished_request_katcl(struct katcl_line *l, struct timeval *until);
 #endif
 
+/* client side asynchronous requests, many in flight on one line */
+
+#define KATCL_ASYNC_OK         0  /* reply ok */
+#define KATCL_ASYNC_FAIL       1  /* reply other than ok */
+#define KATCL_ASYNC_INFORM     2  /* inform carrying the request tag, reply still to come */
+#define KATCL_ASYNC_TIMEOUT  (-1) /* no reply in time, a late one is discarded */
+#define KATCL_ASYNC_LOST     (-2) /* connection failed or handle destroyed */
+
+struct katcl_async;
+
+struct katcl_async *create_async_katcl(struct katcl_line *l);
+void destroy_async_katcl(struct katcl_async *a);
+struct katcl_line *line_async_katcl(struct katcl_async *a);
+
+int send_async_katcl(struct katcl_async *a, unsigned int timeout, void (*call)(struct katcl_line *l, int status, void *data), void *data, ...);
+int vsend_async_katcl(struct katcl_async *a, unsigned int timeout, void (*call)(struct katcl_line *l, int status, void *data), void *data, va_list args);
+int append_parse_async_katcl(struct katcl_async *a, unsigned int timeout, void (*call)(struct katcl_line *l, int status, void *data), void *data, struct katcl_parse *p);
+int cancel_async_katcl(struct katcl_async *a, int tag);
+int pending_async_katcl(struct katcl_async *a, int tag);
+
+int inform_async_katcl(struct katcl_async *a, char *name, void (*call)(struct katcl_line *l, void *data), void *data);
+
+int fileno_async_katcl(struct katcl_async *a);
+int flushing_async_katcl(struct katcl_async *a);
+int timeout_async_katcl(struct katcl_async *a, struct timeval *delta);
+int run_async_katcl(struct katcl_async *a, int readable, int writable);
+int complete_async_katcl(struct katcl_async *a, struct timeval *until);
+
 /* more byte bit ops */
 
 int make_bb_katcl(struct katcl_byte_bit *bb, unsigned long byte, unsigned long bit);
@@ -32,6 +32,7 @@ struct katcp_message;
 
 #define KATCP_LIBRARY_LABEL     "katcp-library"
 #define KATCP_PROTOCOL_LABEL    "katcp-protocol"
+#define KATCP_BINARY_LABEL      "katcp-binary"
 
 #define KATCP_REQUEST '?' 
 #define KATCP_REPLY   '!' 
@@ -96,6 +97,7 @@ struct katcp_message;
 #define KATCP_SET_REQUEST     "?set"
 #define KATCP_GET_REQUEST     "?get"
 #define KATCP_SEARCH_REQUEST  "?search"
+#define KATCP_WATCHDOG_REQUEST "?watchdog"
 
 #define KATCP_LOG_INFORM               "#log"
 #if KATCP_PROTOCOL_MAJOR_VERSION >= 5   
@@ -191,6 +193,9 @@ int run_multi_server_katcp(struct katcp_dispatch *d, int count, char *host, int
 int run_config_server_katcp(struct katcp_dispatch *dl, char *file, int count, char *host, int port);
 int run_pipe_server_katcp(struct katcp_dispatch *dl, char *file, int pfd);
 
+/* count given to the server functions is the initial table size, which grows on demand up to this limit */
+int max_clients_katcp(struct katcp_dispatch *d, unsigned int limit);
+
 void mark_busy_katcp(struct katcp_dispatch *d);
 
 /******************* io functions ****************/
@@ -282,7 +287,8 @@ int exiting_katcp(struct katcp_dispatch *d); /* run cleanup functions once */
 #define KATCP_STRATEGY_EVENT   2
 #define KATCP_STRATEGY_DIFF    3
 #define KATCP_STRATEGY_FORCED  4
-#define KATCP_STRATEGIES_COUNT 5
+#define KATCP_STRATEGY_RATE    5
+#define KATCP_STRATEGIES_COUNT 6
 
 #define KATCP_STATUS_UNKNOWN   0
 #define KATCP_STATUS_NOMINAL   1
@@ -313,6 +319,8 @@ struct katcp_sensor *find_sensor_katcp(struct katcp_dispatch *d, char *name);
 int set_status_sensor_katcp(struct katcp_sensor *sn, int status);
 int set_status_group_sensor_katcp(struct katcp_dispatch *d, char *prefix, int status);
 
+int history_sensor_katcp(struct katcp_dispatch *d, char *name, unsigned int size);
+
 void *get_local_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a);
 void generic_release_local_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a);
 
@@ -424,6 +432,7 @@ int discharge_timer_katcp(struct katcp_dispatch *d, void *data);
 int unwarp_timers_katcp(struct katcp_dispatch *d);
 int register_every_ms_katcp(struct katcp_dispatch *d, unsigned int milli, int (*call)(struct katcp_dispatch *d, void *data), void *data);
 int register_every_tv_katcp(struct katcp_dispatch *d, struct timeval *tv, int (*call)(struct katcp_dispatch *d, void *data), void *data);
+int register_tick_tv_katcp(struct katcp_dispatch *d, struct timeval *tv, int (*call)(struct katcp_dispatch *d, void *data), void *data);
 int register_at_tv_katcp(struct katcp_dispatch *d, struct timeval *tv, int (*call)(struct katcp_dispatch *d, void *data), void *data);
 int register_in_tv_katcp(struct katcp_dispatch *d, struct timeval *tv, int (*call)(struct katcp_dispatch *d, void *data), void *data);
 
@@ -509,6 +518,15 @@ struct katcp_job *process_name_create_job_katcp(struct katcp_dispatch *d, char *
 struct katcp_job *network_connect_job_katcp(struct katcp_dispatch *d, struct katcp_url *url, struct katcp_notice *halt);
 struct katcp_job *network_name_connect_job_katcp(struct katcp_dispatch *d, char *host, int port, struct katcp_notice *halt);
 
+/* shared connections per host and port, the halt notice reports a disconnect to all holders */
+struct katcp_job *acquire_network_job_katcp(struct katcp_dispatch *d, struct katcp_url *url);
+struct katcp_job *acquire_network_name_job_katcp(struct katcp_dispatch *d, char *host, int port);
+int release_network_job_katcp(struct katcp_dispatch *d, struct katcp_job *j);
+struct katcp_notice *halt_notice_job_katcp(struct katcp_job *j);
+
+/* more than one outstanding request tags them, untagged replies are matched in order */
+int window_job_katcp(struct katcp_dispatch *d, struct katcp_job *j, unsigned int window);
+
 struct katcp_job *find_job_katcp(struct katcp_dispatch *d, char *name);
 struct katcp_job *find_containing_job_katcp(struct katcp_dispatch *d, char *name);
 int zap_job_katcp(struct katcp_dispatch *d, struct katcp_job *j);
@@ -561,6 +579,23 @@ void *data_arb_katcp(struct katcp_dispatch *d, struct katcp_arb *a);
 char *name_arb_katcp(struct katcp_dispatch *d, struct katcp_arb *a);
 int fileno_arb_katcp(struct katcp_dispatch *d, struct katcp_arb *a);
 
+/* worker threads: work runs in a thread and may not touch katcp state, done runs in the loop and gets a NULL dispatch if the client has gone. Offload returns a value to be returned by a command handler */
+
+int start_workers_katcp(struct katcp_dispatch *d, unsigned int count);
+void stop_workers_katcp(struct katcp_dispatch *d);
+int offload_katcp(struct katcp_dispatch *d, int (*work)(void *data), int (*done)(struct katcp_dispatch *d, int status, void *data), void *data);
+
+/* sensor updates from other threads: start and stop in the loop, post from anywhere. Booleans and discretes use the integer post, when may be NULL for now */
+
+struct katcp_poster;
+
+struct katcp_poster *start_poster_katcp(struct katcp_dispatch *d, unsigned int size);
+void stop_poster_katcp(struct katcp_dispatch *d);
+int post_integer_acquire_katcp(struct katcp_poster *p, struct katcp_acquire *a, int value, struct timeval *when);
+#ifdef KATCP_USE_FLOATS
+int post_double_acquire_katcp(struct katcp_poster *p, struct katcp_acquire *a, double value, struct timeval *when);
+#endif
+
 
 /*katcp_type functions*/
 
@@ -638,6 +673,11 @@ int set_dbase_katcp(struct katcp_dispatch *d, struct katcl_parse *p);
 struct katcl_parse *get_dbase_katcp(struct katcp_dispatch *d, struct katcl_parse *p);
 int get_value_count_dbase_katcp(struct katcp_dbase *db);
 struct katcp_stack *get_value_stack_dbase_katcp(struct katcp_dbase *db);
+int del_dbase_katcp(struct katcp_dispatch *d, char *key);
+int delete_dbase_cmd_katcp(struct katcp_dispatch *d, int argc);
+int query_dbase_cmd_katcp(struct katcp_dispatch *d, int argc);
+int open_journal_dbase_katcp(struct katcp_dispatch *d, char *path);
+int journal_dbase_cmd_katcp(struct katcp_dispatch *d, int argc);
 
 int dict_katcp(struct katcp_dispatch *d, struct katcl_parse *p);
 int dict_cmd_katcp(struct katcp_dispatch *d, int argc);
@@ -647,6 +687,7 @@ int dict_cmd_katcp(struct katcp_dispatch *d, int argc);
 struct katcp_tag;
 
 int tag_data_katcp(struct katcp_dispatch *d, struct katcp_tag *t, void *data, struct katcp_type *type);
+int untag_data_katcp(struct katcp_tag *t, void *data);
 
 int search_cmd_katcp(struct katcp_dispatch *d, int argc);
 
@@ -669,13 +710,36 @@ int append_double_flat_katcp(struct katcp_dispatch *d, int flags, double v);
 int append_buffer_flat_katcp(struct katcp_dispatch *d, int flags, void *buffer, int len);
 int append_parameter_flat_katcp(struct katcp_dispatch *d, int flags, struct katcl_parse *p, unsigned int index);
 int append_parse_flat_katcp(struct katcp_dispatch *d, struct katcl_parse *p);
+int append_vargs_flat_katcp(struct katcp_dispatch *d, int flags, char *fmt, va_list args);
+int append_args_flat_katcp(struct katcp_dispatch *d, int flags, char *fmt, ...);
 
 /* endpoints */
 
 int send_message_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *from, struct katcp_endpoint *to, struct katcl_parse *px, int acknowledged);
+int multicast_message_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *from, struct katcp_endpoint **to, unsigned int count, struct katcl_parse *px, int acknowledged);
 struct katcl_parse *parse_of_endpoint_katcp(struct katcp_dispatch *d, struct katcp_message *msg);
 struct katcp_endpoint *source_endpoint_katcp(struct katcp_dispatch *d, struct katcp_message *msg);
 
+/* memory accounting, the size given to free and realloc has to match the one allocated */
+
+#define KATCP_MEMORY_PARSE      0
+#define KATCP_MEMORY_QUEUE      1
+#define KATCP_MEMORY_SENSOR     2
+#define KATCP_MEMORY_NOTICE     3
+#define KATCP_MEMORY_AVLTREE    4
+#define KATCP_MEMORY_DUPLEX     5
+#define KATCP_MEMORY_NAME       6
+#define KATCP_MEMORY_TAGS      16 /* library subsystems and those claimed with tag_memory_katcp */
+
+int tag_memory_katcp(char *name);
+void *malloc_memory_katcp(int tag, size_t size);
+void *realloc_memory_katcp(int tag, void *ptr, size_t before, size_t after);
+char *strdup_memory_katcp(int tag, char *string);
+void free_memory_katcp(int tag, void *ptr, size_t size);
+void free_string_memory_katcp(int tag, char *string);
+int stats_memory_katcp(int tag, char **name, long *bytes, long *peak, long *objects, unsigned long *allocs);
+int memory_stats_cmd_katcp(struct katcp_dispatch *d, int argc);
+
 #ifdef __cplusplus
 }
 #endif
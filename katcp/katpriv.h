@@ -6,6 +6,7 @@
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -14,9 +15,22 @@ extern "C" {
 #define KATCP_NAME_LENGTH     64
 
 #define KATCL_IO_SIZE       4096  /* block we want to write out */
-#define KATCL_BUFFER_INC     512  /* amount by which we resize read */
+#define KATCL_IO_VECTOR       64  /* pieces gathered into a single write */
+#define KATCL_IO_DIRECT       64  /* unescaped arguments at least this long are not copied */
+#define KATCL_BUFFER_INC     512  /* minimum amount by which we resize a parse */
+#define KATCL_INPUT_SIZE   65536  /* receive buffer, shared by many messages */
+#define KATCP_LIMIT_HIGH    1000  /* queued messages per client if no limit given */
+#define KATCP_HOLD_LIMIT       8  /* tagged requests per client which may wait on notices at once */
+#define KATCP_CLIENT_CEILING 1024 /* client table growth limit if none set with max_clients_katcp */
+#define KATCP_ACCEPT_BATCH    16  /* connections accepted per loop iteration */
+#define KATCP_FLAT_QUANTUM 16384  /* input bytes a duplex connection may parse per loop iteration */
+#define KATCP_FLAT_BURST      64  /* messages a duplex connection may parse per loop iteration */
 #define KATCL_ARGS_INC         8  /* grow the vector by this amount */
 
+#define KATCL_POOL_CLASSES     4  /* recycled parses, by buffer size 256, 1k, 4k, 16k */
+#define KATCL_POOL_SMALLEST  256  /* buffer limit of first class, each next one is 4x */
+#define KATCL_POOL_DEPTH      32  /* parses held per class */
+
 #define KATCL_PARSE_FRESH      0  /* newly allocated or cleared */
 #define KATCL_PARSE_COMMAND    1  /* parsing first argument */
 #define KATCL_PARSE_WHITESPACE 2  /* parsing between arguments */
@@ -25,6 +39,11 @@ extern "C" {
 #define KATCL_PARSE_ESCAPE     5  /* parsing escape sequence */
 #define KATCL_PARSE_FAKE       6  /* generated manually, not parsed */
 #define KATCL_PARSE_DONE       7  /* a complete message */
+#define KATCL_PARSE_LENGTH     8  /* parsing length of a binary argument */
+#define KATCL_PARSE_BINARY     9  /* collecting raw bytes of a binary argument */
+
+#define KATCL_ARG_BINARY       3  /* a_escape value: raw data, length prefixed if line allows it */
+#define KATCL_BINARY_LIMIT (1024 * 1024 * 64) /* largest length prefix accepted */
 
 
 #define KATCL_ALIGN_NONE       0x0
@@ -64,6 +83,12 @@ struct katcl_parse{
   unsigned int p_count;
   unsigned int p_got;
 
+  char *p_wire;            /* serialized form, built once for shared messages */
+  unsigned int p_wire_size;
+  unsigned int p_wire_len;  /* zero if not yet serialized */
+
+  unsigned int p_binary;    /* length prefix, then bytes of binary argument still to come */
+
   int p_refs;
   int p_tag;
 };
@@ -73,31 +98,127 @@ struct katcl_line{
 
   struct katcl_parse *l_ready;
   struct katcl_parse *l_next;
+  struct katcl_parse *l_spare; /* cleared parse, reused as next */
+
+  char *l_input;          /* receive buffer, filled by a single read */
+  unsigned int l_ihead;   /* start of data not yet handed to a parse */
+  unsigned int l_itail;   /* end of received data */
 
   struct katcl_parse *l_stage;
 
-  char l_buffer[KATCL_IO_SIZE];
-  unsigned int l_pending;
+  char l_buffer[KATCL_IO_SIZE]; /* staging for escaped data and separators */
+  unsigned int l_used;    /* amount of staging in use */
+  unsigned int l_pending; /* bytes described by vector, not yet written */
   unsigned int l_arg;  /* argument */
   unsigned int l_offset; /* offset into argument */
 
+  struct iovec l_vector[KATCL_IO_VECTOR];
+  unsigned int l_vhead;   /* first vector entry not yet written */
+  unsigned int l_vcount;  /* entries in vector */
+  unsigned int l_described; /* queued parses completely in vector */
+
   struct katcl_queue *l_queue;
 
   int l_error;
   int l_sendable;
+
+  int l_policy;           /* what to do once queue reaches l_high */
+  unsigned int l_high;
+  unsigned int l_low;
+  int l_congested;        /* set at high, cleared once back at low */
+  unsigned long l_shed;   /* messages dropped or replaced */
+
+  int l_binary;           /* peer accepts length prefixed binary arguments */
+  int l_pass;             /* keep messages as received, so that relaying them is a copy */
+  int l_tag;              /* added to the name of replies and informs, negative for none */
+  int l_cork;             /* send with MSG_MORE while more queued messages follow */
+};
+
+#define KATCL_ASYNC_TAG_MAX 999999 /* tags wrap around after this */
+
+struct katcl_async_request{
+  int r_tag;
+  char *r_name;           /* without the leading ?, to match untagged replies */
+  unsigned long r_sequence;
+  int r_timed;
+  struct timeval r_until;
+  void (*r_call)(struct katcl_line *l, int status, void *data);
+  void *r_data;
+};
+
+struct katcl_async_inform{
+  char *i_name;           /* includes the leading #, NULL catches the rest */
+  void (*i_call)(struct katcl_line *l, void *data);
+  void *i_data;
+};
+
+struct katcl_async{
+  struct katcl_line *a_line;
+
+  struct katcl_async_request *a_requests;
+  unsigned int a_pending;
+  unsigned int a_size;
+
+  struct katcl_async_inform *a_informs;
+  unsigned int a_count;
+
+  int a_tag;
+  unsigned long a_sequence;
+  int a_lost;
 };
 
 /******************************************************************************/
 
 struct katcp_dispatch;
 
+#define KATCP_STATS_BUCKETS 20
+
+struct katcp_stats{
+  unsigned long t_calls;
+  unsigned long t_errors;
+  unsigned long t_total;  /* microseconds spent in the handler */
+  unsigned long t_bucket[KATCP_STATS_BUCKETS]; /* bucket i counts calls under 2^(i+1) us, last one open ended */
+};
+
+#define KATCP_PHASE_WAIT       0
+#define KATCP_PHASE_TIMERS     1
+#define KATCP_PHASE_LOAD       2
+#define KATCP_PHASE_FLATS      3
+#define KATCP_PHASE_ENDPOINTS  4
+#define KATCP_PHASE_CLIENTS    5
+#define KATCP_PHASE_JOBS       6
+#define KATCP_PHASE_NOTICES    7
+#define KATCP_PHASE_ARBS       8
+#define KATCP_PHASE_SENSORS    9
+#define KATCP_PHASES          10
+
+#define KATCP_HEALTH_WINDOW    1 /* seconds over which the sensors are computed */
+
+struct katcp_health{
+  int h_ready;                  /* only measured once the core loop is prepared */
+  struct timeval h_mark;        /* end of the previous phase */
+  unsigned long h_pass[KATCP_PHASES]; /* microseconds in this loop iteration */
+  struct katcp_stats h_phases[KATCP_PHASES];
+  struct katcp_stats h_lag;     /* lateness of timers */
+
+  struct timeval h_window;      /* start of the current window */
+  unsigned long h_busy;         /* totals within the window */
+  unsigned long h_idle;
+  unsigned long h_worst;
+
+  double h_fraction;            /* results for the previous window */
+  double h_late;
+};
+
 struct katcp_cmd{
   char *c_name;
   char *c_help;
   int (*c_call)(struct katcp_dispatch *d, int argc);
   struct katcp_cmd *c_next;
+  struct katcp_cmd *c_hash; /* next in bucket, or next wildcard */
   unsigned int c_mode;
   unsigned int c_flags;
+  struct katcp_stats c_stats;
 };
 
 /**********************************************************************/
@@ -152,33 +273,17 @@ struct katcp_acquire{
   void *a_local;
   void (*a_release)(struct katcp_dispatch *d, struct katcp_acquire *a);
 
-  void *a_more; /* could be a union */
-};
-
-struct katcp_sensor{
-  int s_magic;
-  int s_type;
-  char *s_name;
-  char *s_description;
-  char *s_units;
-
-  int s_preferred;
-
-  int s_status; /* WARNING, etc */
-  int s_mode; /* in what mode available */
-  struct timeval s_recent;
-#if 0
-  int s_running; /* have it do stuff */
+  void *a_more; /* points into a_store */
+  union{
+#ifdef KATCP_USE_FLOATS
+    struct katcp_double_acquire a_double;
 #endif
+    struct katcp_discrete_acquire a_discrete;
+    struct katcp_integer_acquire a_integer;
+  } a_store;
 
-  unsigned int s_refs;
-  struct katcp_nonsense **s_nonsense;
-
-  struct katcp_acquire *s_acquire;
-
-  int (*s_extract)(struct katcp_dispatch *d, struct katcp_sensor *sn);
-  int (*s_flush)(struct katcp_dispatch *d, struct katcp_sensor *sn);
-  void *s_more;
+  int a_dirty;              /* changed, on the shared list to be flushed */
+  struct timeval a_stamp;   /* when a posted value was measured, zero if unknown */
 };
 
 #ifdef KATCP_USE_FLOATS
@@ -213,17 +318,51 @@ struct katcp_discrete_sensor{
   char **ds_vector;
 };
 
-struct katcp_nonsense{
-  int n_magic;
-  struct katcp_dispatch *n_client;
-  struct katcp_sensor *n_sensor;
-  int n_strategy;
-  int n_status;
-  struct timeval n_period;
-  struct timeval n_next;
-  int n_manual;
+struct katcp_sensor{
+  int s_magic;
+  int s_type;
+  char *s_name;
+  char *s_description;
+  char *s_units;
+
+  int s_preferred;
+
+  int s_status; /* WARNING, etc */
+  int s_mode; /* in what mode available */
+  struct timeval s_recent;
+#if 0
+  int s_running; /* have it do stuff */
+#endif
+
+  unsigned int s_refs;
+  struct katcp_nonsense **s_nonsense;
+
+  struct katcp_acquire *s_acquire;
+
+  int (*s_extract)(struct katcp_dispatch *d, struct katcp_sensor *sn);
+  int (*s_flush)(struct katcp_dispatch *d, struct katcp_sensor *sn);
+  void *s_more; /* points into s_store */
+  union{
+#ifdef KATCP_USE_FLOATS
+    struct katcp_double_sensor s_double;
+#endif
+    struct katcp_discrete_sensor s_discrete;
+    struct katcp_integer_sensor s_integer;
+  } s_store;
+
+  struct katcp_sensor *s_chain; /* next in hash bin */
+
+  struct katcp_history *s_history; /* optional ring of recent changes */
 
-  void *n_more;
+  unsigned long s_changed; /* shared sequence number at last change */
+};
+
+struct katcp_history{
+  unsigned char *h_buffer;
+  unsigned int h_width; /* bytes per entry, depends on sensor type */
+  unsigned int h_size;  /* capacity in entries */
+  unsigned int h_count; /* entries in use */
+  unsigned int h_next;  /* slot written next */
 };
 
 #ifdef KATCP_USE_FLOATS
@@ -242,6 +381,30 @@ struct katcp_discrete_nonsense{
   unsigned int dn_previous;
 };
 
+struct katcp_nonsense{
+  int n_magic;
+  struct katcp_dispatch *n_client;
+  struct katcp_sensor *n_sensor;
+  int n_strategy;
+  int n_status;
+  struct timeval n_period;
+  struct timeval n_next;
+  int n_manual;
+
+  struct timeval n_shortest; /* event-rate bounds, n_next is the previous update */
+  struct timeval n_longest;
+  int n_deadband;
+
+  void *n_more; /* points into n_store */
+  union{
+#ifdef KATCP_USE_FLOATS
+    struct katcp_double_nonsense n_double;
+#endif
+    struct katcp_discrete_nonsense n_discrete;
+    struct katcp_integer_nonsense n_integer;
+  } n_store;
+};
+
 #if 0
 struct katcp_sensor_integer{
   int si_min;
@@ -339,6 +502,9 @@ struct katcp_job{
   int j_recvr;  /* number of requests received */
   int j_sendr; /* number of requests sent */
 
+  unsigned int j_window; /* number of requests which may be outstanding */
+  unsigned int j_tag; /* last tag issued, only used when window exceeds one */
+
   struct katcl_line *j_line;
 
   struct katcp_notice *j_halt;
@@ -349,6 +515,8 @@ struct katcp_job{
   unsigned int j_count; /* number of entries present */
 
   struct katcp_map *j_map;
+
+  int j_refs; /* holders of a shared network job, -1 if not shared */
 };
 #endif
 
@@ -362,10 +530,14 @@ struct katcp_job{
 struct katcp_time{
   int t_magic;
 
-  struct timeval t_when;
+  struct timeval t_when;     /* on the monotonic clock */
   struct timeval t_interval;
 
   int t_armed;
+  int t_index;               /* position in heap, -1 if not queued */
+  unsigned int t_pass;       /* run pass in which this timer last fired */
+
+  struct katcp_time *t_next; /* chain in table hashed on t_data */
 
   void *t_data;
   int (*t_call)(struct katcp_dispatch *d, void *data);
@@ -404,6 +576,10 @@ struct katcp_notice{
 #endif
   int n_changes;
 
+  unsigned int n_slot;           /* position in s_notices */
+  int n_due;                     /* on the list for the next run */
+  struct katcp_notice *n_chain;  /* next in hash bin */
+
 #if 0
   void *n_target;
   int (*n_release)(struct katcp_dispatch *d, struct katcp_notice *n, void *target);
@@ -514,6 +690,10 @@ struct katcp_flat{
 
   struct katcp_group *f_group;
 
+  long f_deficit;                /* input bytes still owed to us by the scheduler */
+  int f_throttle;                /* input left unparsed as the budget ran out */
+  unsigned long f_throttled;     /* iterations in which that happened */
+
   /* TODO: */
   
   /* notices, sensors */
@@ -523,10 +703,98 @@ struct katcp_flat{
 
 #define KATCP_FLAT_STACK 4
 
+#define KATCP_POLL_READ   0x1
+#define KATCP_POLL_WRITE  0x2
+
+struct katcp_poll{
+#ifdef KATCP_USE_EPOLL
+  int p_fd;                /* epoll instance */
+
+  unsigned char *p_want;   /* interest declared this round, indexed by fd */
+  unsigned char *p_have;   /* interest registered with kernel, indexed by fd */
+  unsigned char *p_ready;  /* readiness reported by last wait, indexed by fd */
+  unsigned int p_size;
+
+  int *p_list;             /* fds declared this round */
+  unsigned int p_count;
+
+  int *p_known;            /* fds registered with kernel */
+  unsigned int p_registered;
+
+  int *p_fired;            /* fds with nonzero p_ready entries */
+  unsigned int p_hits;
+
+  struct epoll_event *p_events;
+  unsigned int p_space;
+
+  unsigned int p_plain;    /* fds epoll can not handle, treated as always ready */
+#else
+  fd_set p_read, p_write;
+  int p_max;
+#endif
+};
+
+#define KATCP_LOG_RING_NAME  32
+#define KATCP_LOG_RING_TEXT 160
+
+struct katcp_log_record{
+  struct timeval r_when;
+  unsigned int r_level;
+  char r_name[KATCP_LOG_RING_NAME];
+  char r_text[KATCP_LOG_RING_TEXT];
+};
+
+struct katcp_log_ring{
+  struct katcp_log_record *r_vector;
+  unsigned int r_size;
+  unsigned int r_head;   /* next record to be overwritten */
+  unsigned int r_count;
+  unsigned int r_level;  /* kept regardless of what connections want */
+};
+
+#define KATCP_LOG_SITES      64  /* call sites tracked for flood suppression, direct mapped */
+#define KATCP_LOG_RATE       20  /* messages per second a call site may sustain */
+#define KATCP_LOG_BURST     100  /* messages a quiet call site may emit at once */
+#define KATCP_LOG_FLUSH    1000  /* ms between reports of suppressed messages */
+
+struct katcp_log_site{
+  char *l_fmt;   /* identify a call site by pointer, not content */
+  char *l_name;
+  unsigned int l_level;
+  struct timeval l_when;
+  unsigned long l_tokens; /* in thousandths of a message */
+  unsigned long l_suppressed;
+};
+
+#define KATCP_CACHE_HELP             0
+#define KATCP_CACHE_SENSOR_LIST      1
+#define KATCP_CACHE_VERSION_LIST     2
+#define KATCP_CACHE_VERSION_CONNECT  3
+#define KATCP_CACHE_KINDS            4
+
+struct katcp_cache{
+  struct katcl_parse **c_vector; /* informs held by reference, shared by every client listing them */
+  unsigned int c_count;
+  int c_mode;                    /* mode in which they were generated */
+  int c_valid;
+};
+
 struct katcp_shared{
   unsigned int s_magic;
   struct katcp_entry *s_vector;
   unsigned int s_default; /* default log level */
+  unsigned int s_log_floor; /* no connection wants messages below this, may be stale low, never high */
+  struct katcp_log_ring *s_log_ring; /* NULL unless recent messages are kept */
+
+  struct katcp_log_site s_log_sites[KATCP_LOG_SITES];
+  unsigned int s_log_rate;  /* zero disables flood suppression */
+  unsigned int s_log_burst;
+  int s_log_flushing;
+
+  int s_limit_policy; /* output queue limits applied to new clients */
+  unsigned int s_limit_high;
+  unsigned int s_limit_low;
+  unsigned int s_hold_limit; /* concurrent tagged requests allowed for new clients */
   unsigned int s_size;
 #if 0
   unsigned int s_modal;
@@ -536,6 +804,10 @@ struct katcp_shared{
   int (*s_posthook)(struct katcp_dispatch *d, int argc);
 
   struct katcp_cmd *s_commands;
+  struct katcp_cmd **s_table; /* commands hashed by name, same order as list */
+  unsigned int s_slots;
+  unsigned int s_named;
+  struct katcp_cmd *s_wild;   /* wildcard commands, in list order */
   struct katcp_sensor *s_mode_sensor;
   unsigned int s_mode;
   unsigned int s_flaky; /* mode transition failed, breaking the old one */
@@ -549,19 +821,37 @@ struct katcp_shared{
 
   unsigned int s_count;
   unsigned int s_used;
+  unsigned int s_ceiling; /* clients tables may grow up to this */
+
+  struct katcp_dispatch **s_owners; /* clients indexed by fd, refreshed at load */
+  unsigned int s_span;
+
+  struct katcp_dispatch **s_active; /* clients to be run this cycle */
+  unsigned int s_visits;
+  unsigned int s_seats;
 
   int s_lfd;
 
   struct katcp_job **s_tasks;
   unsigned int s_number;
 
+  struct katcp_pool **s_pools;  /* persistent subprocesses serving a request */
+  unsigned int s_pooled;
+
 #if 0
   struct katcp_process *s_table;
   int s_entries;
 #endif
 
-  struct katcp_time **s_queue;
+  struct katcp_time **s_queue;  /* binary heap ordered on t_when */
   unsigned int s_length;
+  unsigned int s_room;
+
+  struct katcp_time **s_timers; /* hashed on t_data */
+  unsigned int s_buckets;
+
+  struct katcp_time *s_due;     /* timer whose callback is running */
+  unsigned int s_pass;
 
   struct katcp_arb **s_extras;
   unsigned int s_total;
@@ -569,17 +859,29 @@ struct katcp_shared{
   struct katcp_notice **s_notices;
   unsigned int s_pending;
 
+  struct katcp_notice **s_titles;  /* named subset of s_notices, sorted */
+  unsigned int s_titled;
+  struct katcp_notice **s_lookup;  /* hashed by name, chained via n_chain */
+  unsigned int s_lookups;
+  struct katcp_notice **s_woken;   /* triggered or maybe unused, for run_notices */
+  unsigned int s_queued;
+
   unsigned int s_busy; /* more things to do, keep select short */
 
   struct katcp_group **s_groups;
   struct katcp_group *s_fallback;
   unsigned int s_members;
 
+  unsigned int s_flat_quantum; /* per iteration input budget of each duplex connection */
+  unsigned int s_flat_burst;
+
   struct katcp_flat **s_this;
   int s_level;
   unsigned int s_stories;
 
   struct katcp_endpoint *s_endpoints;
+  struct katcp_message *s_spare;   /* recycled messages, chained via m_next */
+  unsigned int s_spares;
 
 #if 0
   int s_version_major;
@@ -590,8 +892,17 @@ struct katcp_shared{
   char **s_build_state;
   int s_build_items;
 
-  struct katcp_sensor **s_sensors;
+  struct katcp_sensor **s_sensors; /* sorted by name */
   unsigned int s_tally;
+  struct katcp_sensor **s_index;   /* hashed by name, chained via s_chain */
+  unsigned int s_bins;
+
+  int s_coalesce;                  /* defer sensor updates to the end of the loop iteration */
+  struct katcp_acquire **s_dirty;
+  unsigned int s_stale;
+  unsigned int s_spots;
+
+  unsigned long s_sequence;        /* bumped for every sensor change */
 
   struct katcp_version **s_versions;
   unsigned int s_amount;
@@ -600,8 +911,15 @@ struct katcp_shared{
   struct sigaction s_action_current, s_action_previous;
   int s_restore_signals;
 
-  fd_set s_read, s_write;
-  int s_max;
+  struct katcp_poll *s_poll;
+
+  struct katcp_workers *s_workers; /* NULL unless threads have been started */
+  struct katcp_poster *s_poster;   /* NULL unless other threads post sensor updates */
+  struct katcp_journal *s_journal; /* NULL unless the database is persisted */
+
+  struct katcp_health s_health;
+
+  struct katcp_cache s_cache[KATCP_CACHE_KINDS];
   
   struct katcp_type **s_type;
   unsigned int s_type_count;
@@ -609,15 +927,27 @@ struct katcp_shared{
   time_t s_start;
 };
 
+struct katcp_held{
+  struct katcl_parse *h_request;
+  struct katcp_notice **h_notices;
+  unsigned int h_count;
+  int h_done;
+  struct katcl_parse *h_saved;
+  int h_tag;
+};
+
 struct katcp_dispatch{
   int d_level; /* log level */
   int d_ready;
   int d_run; /* 1 if up, -1 if shutting down, 0 if shut down */
   int d_exit; /* exit code, reason for shutting down */
   int d_pause; /* waiting for a notice */
+  int d_wake;  /* needs to be run even without io, eg resumed */
+  int d_visit; /* already on the active list */
   struct katcl_line *d_line;
 
   int (*d_current)(struct katcp_dispatch *d, int argc);
+  struct katcp_stats *d_stats; /* of the command in d_current */
 
   struct katcp_shared *d_shared;
 
@@ -627,6 +957,12 @@ struct katcp_dispatch{
   struct katcp_notice **d_notices;
   unsigned int d_count;
 
+  struct katcp_held **d_held; /* tagged requests waiting on notices, client keeps reading */
+  unsigned int d_holding;
+  unsigned int d_hold_limit;
+  struct katcp_held *d_active; /* the one whose notice is being run */
+  int d_full; /* paused because the hold limit was reached */
+
   struct katcp_notice *d_end;
 
   int d_clone;
@@ -666,9 +1002,16 @@ struct katcp_tobject {
   int o_man;
 };
 
+#define KATCP_STACK_SPARE    8 /* wrappers kept for reuse by each stack */
+#define KATCP_STACK_INITIAL  4 /* slots on first push, doubled as needed */
+
 struct katcp_stack {
   struct katcp_tobject **s_objs;
   int s_count;
+  int s_size;
+
+  struct katcp_tobject *s_spare[KATCP_STACK_SPARE];
+  int s_spare_count;
 };
 
 #ifdef KATCP_SUBPROCESS
@@ -685,6 +1028,7 @@ struct katcp_message{
   struct katcl_parse *m_parse;
   struct katcp_endpoint *m_from;
   struct katcp_endpoint *m_to;
+  struct katcp_message *m_next; /* only used while on the spare list */
 };
 
 struct katcp_endpoint{
@@ -723,18 +1067,37 @@ void exchange_katcl(struct katcl_line *l, int fd);
 
 int dispatch_cmd_katcp(struct katcp_dispatch *d, int argc);
 
+void clear_stats_katcp(struct katcp_stats *t);
+void count_stats_katcp(struct katcp_stats *t, unsigned long us, int result);
+unsigned long record_stats_katcp(struct katcp_stats *t, struct timeval *start, int result);
+void print_stats_katcp(struct katcp_dispatch *d, char *name, struct katcp_stats *t);
+
+int start_health_katcp(struct katcp_dispatch *d);
+void mark_phase_katcp(struct katcp_shared *s, unsigned int phase);
+
+int flush_acquires_katcp(struct katcp_dispatch *d);
+void finish_pass_katcp(struct katcp_shared *s);
+
 void component_time_katcp(struct timeval *result, unsigned int ms);
 int string_to_tv_katcp(struct timeval *tv, char *string);
 
 int sub_time_katcp(struct timeval *delta, struct timeval *alpha, struct timeval *beta);
 int add_time_katcp(struct timeval *sigma, struct timeval *alpha, struct timeval *beta);
 int cmp_time_katcp(struct timeval *alpha, struct timeval *beta);
+void monotonic_time_katcp(struct timeval *tv);
 
 
 int startup_shared_katcp(struct katcp_dispatch *d);
 void shutdown_shared_katcp(struct katcp_dispatch *d);
+
+int start_cache_katcp(struct katcp_dispatch *d);
+int fill_cache_katcp(struct katcp_dispatch *d, unsigned int kind, int start, unsigned int count);
+int serve_cache_katcp(struct katcp_dispatch *d, unsigned int kind);
+void invalidate_cache_katcp(struct katcp_shared *s, unsigned int kind);
+void destroy_caches_katcp(struct katcp_shared *s);
 int listen_shared_katcp(struct katcp_dispatch *d, char *host, int port);
 int allocate_clients_shared_katcp(struct katcp_dispatch *d, unsigned int count);
+int grow_clients_shared_katcp(struct katcp_dispatch *d, unsigned int count);
 int link_shared_katcp(struct katcp_dispatch *d, struct katcp_dispatch *cd);
 
 int load_shared_katcp(struct katcp_dispatch *d);
@@ -750,6 +1113,8 @@ int define_cmd_katcp(struct katcp_dispatch *d, int argc);
 int sensor_limit_cmd_katcp(struct katcp_dispatch *d, int argc);
 int sensor_value_cmd_katcp(struct katcp_dispatch *d, int argc);
 int sensor_list_cmd_katcp(struct katcp_dispatch *d, int argc);
+int sensor_history_cmd_katcp(struct katcp_dispatch *d, int argc);
+int sensor_value_since_cmd_katcp(struct katcp_dispatch *d, int argc);
 int sensor_sampling_cmd_katcp(struct katcp_dispatch *d, int argc);
 int sensor_dump_cmd_katcp(struct katcp_dispatch *d, int argc);
 int sensor_cmd_katcp(struct katcp_dispatch *d, int argc);
@@ -762,6 +1127,12 @@ int match_sensor_list_katcp(struct katcp_dispatch *d, struct katcp_notice *n, vo
 char *code_to_name_katcm(int code);
 char **copy_vector_katcm(char **vector, unsigned int size);
 void delete_vector_katcm(char **vector, unsigned int size);
+unsigned int hash_name_katcm(char *name);
+
+char *intern_name_katcm(char *name);
+char *find_name_katcm(char *name);
+void release_name_katcm(char *name);
+unsigned int hash_interned_katcm(char *name);
 
 /* timing support */
 int empty_timers_katcp(struct katcp_dispatch *d);
@@ -799,6 +1170,32 @@ int register_subprocess_cmd_katcp(struct katcp_dispatch *d, int argc);
 int submit_to_job_katcp(struct katcp_dispatch *d, struct katcp_job *j, struct katcl_parse *p, char *name, int (*call)(struct katcp_dispatch *d, struct katcp_notice *n, void *data), void *data);
 int notice_to_job_katcp(struct katcp_dispatch *d, struct katcp_job *j, struct katcp_notice *n);
 int ended_jobs_katcp(struct katcp_dispatch *d);
+int subprocess_resume_job_katcp(struct katcp_dispatch *d, struct katcp_notice *n, void *data);
+
+/* tagged requests which pause without stopping their client */
+int hold_request_katcp(struct katcp_dispatch *d, unsigned int before);
+struct katcp_held *enter_held_katcp(struct katcp_dispatch *d, struct katcp_notice *n);
+void leave_held_katcp(struct katcp_dispatch *d, struct katcp_held *h, struct katcp_notice *n, int result);
+void release_held_katcp(struct katcp_dispatch *d);
+
+/* subprocess pools */
+int pool_cmd_katcp(struct katcp_dispatch *d, int argc);
+void halt_pools_katcp(struct katcp_dispatch *d);
+int launch_pool_katcp(struct katcp_dispatch *d, char *name, unsigned int size, unsigned int recycle, char **vector);
+int submit_pool_katcp(struct katcp_dispatch *d, char *name, struct katcl_parse *px, int (*call)(struct katcp_dispatch *d, struct katcp_notice *n, void *data), void *data);
+void destroy_pools_katcp(struct katcp_dispatch *d);
+
+/* poller used by the core loop */
+int startup_poll_katcp(struct katcp_shared *s);
+void shutdown_poll_katcp(struct katcp_shared *s);
+void reset_poll_katcp(struct katcp_shared *s);
+int want_poll_katcp(struct katcp_shared *s, int fd, unsigned int mode);
+void drop_poll_katcp(struct katcp_shared *s, unsigned int mode);
+void forget_poll_katcp(struct katcp_shared *s, int fd);
+int wait_poll_katcp(struct katcp_shared *s, struct timespec *delta);
+int ready_poll_katcp(struct katcp_shared *s, int fd, unsigned int mode);
+void clear_ready_poll_katcp(struct katcp_shared *s);
+int fired_poll_katcp(struct katcp_shared *s, unsigned int *cursor);
 
 /* flat stuff */
 int run_flat_katcp(struct katcp_dispatch *d);
@@ -814,6 +1211,8 @@ struct katcl_parse *create_referenced_parse_katcl();
 void destroy_parse_katcl(struct katcl_parse *p);
 struct katcl_parse *reuse_parse_katcl(struct katcl_parse *p);
 struct katcl_parse *copy_parse_katcl(struct katcl_parse *p);
+void stats_pool_parse_katcl(unsigned int *held, unsigned long *hits, unsigned long *misses);
+void drain_pool_parse_katcl(void);
 struct katcl_parse *turnaround_parse_katcl(struct katcl_parse *p, int code);
 struct katcl_parse *turnaround_extra_parse_katcl(struct katcl_parse *p, int code, char *fmt, ...);
 struct katcl_parse *vturnaround_extra_parse_katcl(struct katcl_parse *p, int code, char *fmt, va_list args);
@@ -821,6 +1220,7 @@ struct katcl_parse *vturnaround_extra_parse_katcl(struct katcl_parse *p, int cod
 /* parse: adding fields */
 int add_plain_parse_katcl(struct katcl_parse *p, int flags, char *string);
 int add_string_parse_katcl(struct katcl_parse *p, int flags, char *buffer);
+int add_counted_parse_katcl(struct katcl_parse *p, int flags, char *buffer, unsigned int len);
 int add_unsigned_long_parse_katcl(struct katcl_parse *p, int flags, unsigned long v);
 int add_signed_long_parse_katcl(struct katcl_parse *p, int flags, unsigned long v);
 int add_hex_long_parse_katcl(struct katcl_parse *p, int flags, unsigned long v);
@@ -835,6 +1235,9 @@ int buffer_from_parse_katcl(struct katcl_parse *p, char *buffer, unsigned int le
 /* parse: extracting, testing fields */
 unsigned int get_count_parse_katcl(struct katcl_parse *p);
 int get_tag_parse_katcl(struct katcl_parse *p);
+void set_tag_parse_katcl(struct katcl_parse *p, int tag);
+int name_tag_parse_katcl(struct katcl_parse *p, int tag);
+struct katcl_parse *swap_ready_katcl(struct katcl_line *l, struct katcl_parse *p);
 
 int is_type_parse_katcl(struct katcl_parse *p, char type);
 int is_request_parse_katcl(struct katcl_parse *p);
@@ -851,6 +1254,7 @@ int get_bb_parse_katcl(struct katcl_parse *p, unsigned int index, struct katcl_b
 double get_double_parse_katcl(struct katcl_parse *p, unsigned int index);
 #endif
 unsigned int get_buffer_parse_katcl(struct katcl_parse *p, unsigned int index, void *buffer, unsigned int size);
+int wire_parse_katcl(struct katcl_parse *p, char **wire);
 
 /* parse: parsing from line */
 int parse_katcl(struct katcl_line *l);
@@ -884,6 +1288,7 @@ int add_tail_queue_katcl(struct katcl_queue *q, struct katcl_parse *p);
 struct katcl_parse *remove_index_queue_katcl(struct katcl_queue *q, unsigned int index);
 struct katcl_parse *remove_head_queue_katcl(struct katcl_queue *q);
 struct katcl_parse *get_head_queue_katcl(struct katcl_queue *q);
+struct katcl_parse *replace_index_queue_katcl(struct katcl_queue *q, unsigned int index, struct katcl_parse *p);
 void dump_queue_parse_katcp(struct katcl_queue *q, FILE *fp);
 
 /* map logic */
@@ -910,6 +1315,14 @@ int binary_search_type_list_katcp(struct katcp_type **ts, int t_size, char *str)
 
 int startup_services_katcp(struct katcp_dispatch *d);
 
+void lower_log_floor_katcp(struct katcp_shared *s, unsigned int level);
+int ring_log_katcp(struct katcp_dispatch *d, unsigned int size, unsigned int level);
+
+int fault_dbase_katcp(struct katcp_dispatch *d, char *key);
+int fault_all_dbase_katcp(struct katcp_dispatch *d);
+int append_journal_dbase_katcp(struct katcp_dispatch *d, struct katcl_parse *p, struct timeval *tv);
+void close_journal_dbase_katcp(struct katcp_dispatch *d);
+
 struct katcp_dict {
   char *d_key;
   struct avl_tree *d_avl; 
@@ -920,6 +1333,8 @@ struct katcp_dbase {
   char *d_schema;
   struct timeval d_stamped;
   struct katcp_stack *d_values;
+  struct katcp_tag **d_tags;  /* the tags whose sets hold this entry */
+  unsigned int d_tag_count;
 };
 
 struct katcp_tag {
@@ -958,13 +1373,64 @@ void run_endpoints_katcp(struct katcp_dispatch *d);
 void release_endpoints_katcp(struct katcp_dispatch *d);
 
 int answer_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep, struct katcl_parse *px);
+int resume_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep, int code, char *fmt, ...);
+int busy_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep);
 
 struct katcp_endpoint *create_endpoint_katcp(struct katcp_dispatch *d, int (*wake)(struct katcp_dispatch *d, struct katcp_endpoint *ep, struct katcp_message *msg, void *data), void (*release)(struct katcp_dispatch *d, void *data), void *data);
 void release_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep);
 
+void reference_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep);
+void forget_endpoint_katcp(struct katcp_dispatch *d, struct katcp_endpoint *ep);
+
 void show_endpoint_katcp(struct katcp_dispatch *d, char *prefix, int level, struct katcp_endpoint *ep);
 
 
+/* trace ************************************************************/
+
+#ifdef KATCP_TRACE
+
+#define KATCP_TRACE_LOOP            0
+#define KATCP_TRACE_RECEIVED        1
+#define KATCP_TRACE_DISPATCH        2
+#define KATCP_TRACE_COMPLETE        3
+#define KATCP_TRACE_NOTICE          4
+#define KATCP_TRACE_RELAY           5
+#define KATCP_TRACE_FLUSH           6
+#define KATCP_TRACE_TIMER           7
+#define KATCP_TRACE_TIMER_DONE      8
+#define KATCP_TRACE_REGISTER        9
+#define KATCP_TRACE_REGISTER_DONE  10
+#define KATCP_TRACE_EVENTS         11
+
+#define KATCP_TRACE_TAG            16
+#define KATCP_TRACE_SIZE        65536
+
+struct katcp_trace_entry{
+  unsigned long long e_when; /* monotonic ns */
+  unsigned int e_event;
+  unsigned int e_value;
+  char e_tag[KATCP_TRACE_TAG];
+};
+
+extern int trace_enabled_katcp;
+
+void record_trace_katcp(unsigned int event, unsigned int value, char *tag);
+int resize_trace_katcp(unsigned int size);
+unsigned int size_trace_katcp(void);
+void clear_trace_katcp(void);
+unsigned long held_trace_katcp(unsigned long *first);
+struct katcp_trace_entry *entry_trace_katcp(unsigned long index);
+char *name_trace_katcp(unsigned int event);
+long save_trace_katcp(char *format, char *path);
+
+#define TRACE_KATCP(e, v, t) do { if(trace_enabled_katcp) record_trace_katcp((e), (v), (t)); } while(0)
+
+#else
+
+#define TRACE_KATCP(e, v, t)
+
+#endif
+
 /******************************************/
 
 #define KATCL_PARSE_MAGIC 0xff7f1273
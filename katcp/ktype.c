@@ -34,6 +34,7 @@ void flush_type_katcp(struct katcp_type *t)
     fprintf(stderr, "%s: about to destroy type tree\n", __func__);
 #endif
     destroy_avltree(t->t_tree, t->t_free);
+    t->t_tree = NULL; /* recreated by the next store */
   }
 }
 
@@ -199,11 +199,13 @@ struct katcp_url *create_kurl_from_string_katcp(char *url)
               state = S_HOST;
             else if (strcasecmp(ku->u_scheme,"exec") == 0)
               state = S_CMD;
+            else if (strcasecmp(ku->u_scheme,"unix") == 0)
+              state = S_CMD; /* socket path ends up in u_cmd, as for exec */
             else if (strcasecmp(ku->u_scheme,"xport") == 0)
               state = S_HOST;
             else {
 #ifdef DEBUG
-              fprintf(stderr,"katcp_url: scheme is not of expected katcp, exec or xport");
+              fprintf(stderr,"katcp_url: scheme is not of expected katcp, exec, unix or xport");
 #endif
               destroy_kurl_katcp(ku);
               return NULL;
@@ -582,6 +584,13 @@ int main(int argc, char **argv){
 
   destroy_kurl_katcp(ku2);
 
+  ku = create_kurl_from_string_katcp("unix:///tmp/katcp.sock");
+  if((ku == NULL) || (ku->u_cmd == NULL) || strcmp(ku->u_cmd, "/tmp/katcp.sock")){
+    fprintf(stderr, "test: unable to parse unix url\n");
+    return 1;
+  }
+  destroy_kurl_katcp(ku);
+
   return 0;
 }
 #endif
@@ -9,11 +9,20 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "katpriv.h"
 #include "katcl.h"
@@ -64,6 +73,21 @@ static void sane_line_katcl(struct katcl_line *l)
 
 /****************************************************************/
 
+static void nodelay_katcl(struct katcl_line *l)
+{
+  /* when corking, the writer groups informs itself, so nagle would only delay the final reply */
+  int value;
+
+  if(l->l_fd < 0){
+    return;
+  }
+
+  value = l->l_cork ? 1 : 0;
+
+  /* fails harmlessly for pipes and unix sockets */
+  setsockopt(l->l_fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+}
+
 struct katcl_line *create_katcl(int fd)
 {
   struct katcl_line *l;
@@ -77,17 +101,38 @@ struct katcl_line *create_katcl(int fd)
 
   l->l_ready = NULL;
   l->l_next = NULL; 
+  l->l_spare = NULL;
   l->l_stage = NULL;
 
+  l->l_input = NULL;
+  l->l_ihead = 0;
+  l->l_itail = 0;
+
+  l->l_used = 0;
   l->l_pending = 0;
   l->l_arg = 0;
   l->l_offset = 0;
 
+  l->l_vhead = 0;
+  l->l_vcount = 0;
+  l->l_described = 0;
+
   l->l_queue = NULL;
 
   l->l_error = 0;
   l->l_sendable = 1;
 
+  l->l_policy = KATCL_LIMIT_NONE;
+  l->l_high = 0;
+  l->l_low = 0;
+  l->l_congested = 0;
+  l->l_shed = 0;
+
+  l->l_binary = 0;
+  l->l_pass = 0;
+  l->l_tag = (-1);
+  l->l_cork = 1;
+
   l->l_next = create_referenced_parse_katcl(); /* we require that next is always valid */
   if(l->l_next == NULL){
     destroy_katcl(l, 0);
@@ -100,6 +145,8 @@ struct katcl_line *create_katcl(int fd)
     return NULL;
   }
 
+  nodelay_katcl(l);
+
   return l;
 }
 
@@ -119,6 +166,17 @@ void destroy_katcl(struct katcl_line *l, int end)
     destroy_parse_katcl(l->l_next);
     l->l_next = NULL;
   }
+  if(l->l_spare){
+    destroy_parse_katcl(l->l_spare);
+    l->l_spare = NULL;
+  }
+
+  if(l->l_input){
+    free(l->l_input);
+    l->l_input = NULL;
+  }
+  l->l_ihead = 0;
+  l->l_itail = 0;
 
   /* out */
 
@@ -127,10 +185,15 @@ void destroy_katcl(struct katcl_line *l, int end)
     l->l_stage = NULL;
   }
 
+  l->l_used = 0;
   l->l_pending = 0;
   l->l_arg = 0;
   l->l_offset = 0;
 
+  l->l_vhead = 0;
+  l->l_vcount = 0;
+  l->l_described = 0;
+
   if(l->l_queue){
     destroy_queue_katcl(l->l_queue);
     l->l_queue = NULL;
@@ -169,19 +232,35 @@ void exchange_katcl(struct katcl_line *l, int fd)
     l->l_next = reuse_parse_katcl(l->l_next);
   }
 
+  l->l_ihead = 0;
+  l->l_itail = 0;
+
   if(l->l_stage){
     destroy_parse_katcl(l->l_stage);
     l->l_stage = NULL;
   }
 
+  l->l_used = 0;
   l->l_pending = 0;
   l->l_arg = 0;
   l->l_offset = 0;
 
+  l->l_vhead = 0;
+  l->l_vcount = 0;
+  l->l_described = 0;
+
   clear_queue_katcl(l->l_queue);
 
   l->l_error = 0;
   l->l_sendable = 1;
+
+  l->l_congested = 0;
+  l->l_shed = 0;
+
+  l->l_binary = 0; /* a new peer has to negotiate again */
+  l->l_tag = (-1);
+
+  nodelay_katcl(l);
 }
 
 int fileno_katcl(struct katcl_line *l)
@@ -209,8 +288,6 @@ int error_katcl(struct katcl_line *l)
 int read_katcl(struct katcl_line *l)
 {
   int rr;
-  char *ptr;
-  struct katcl_parse *p;
 
   sane_line_katcl(l);
 
@@ -218,30 +295,40 @@ int read_katcl(struct katcl_line *l)
   fprintf(stderr, "line: invoking read on line %p\n", l);
 #endif
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-  if(l->l_next == NULL){
-    fprintf(stderr, "line: logic failure, l_next should always be valid\n");
-    abort();
-  }
-#endif
-
-  p = l->l_next;
+  /* input goes into a receive buffer, parse_katcl later cuts messages out of it */
 
-  if(p->p_size <= p->p_have){
-    ptr = (char  *)realloc(p->p_buffer, p->p_size + KATCL_BUFFER_INC);
-    if(ptr == NULL){
+  if(l->l_input == NULL){
+    l->l_input = malloc(KATCL_INPUT_SIZE);
+    if(l->l_input == NULL){
 #ifdef DEBUG 
-      fprintf(stderr, "read: realloc to %d failed\n", p->p_size + KATCL_BUFFER_INC);
+      fprintf(stderr, "read: unable to allocate %d bytes of input buffer\n", KATCL_INPUT_SIZE);
 #endif
       l->l_error = ENOMEM;
       return -1;
     }
+    l->l_ihead = 0;
+    l->l_itail = 0;
+  }
+
+  if(l->l_ihead >= l->l_itail){
+    l->l_ihead = 0;
+    l->l_itail = 0;
+  } else if(l->l_ihead > 0){
+    if((l->l_itail >= KATCL_INPUT_SIZE) || (l->l_ihead >= (KATCL_INPUT_SIZE / 2))){
+      memmove(l->l_input, l->l_input + l->l_ihead, l->l_itail - l->l_ihead);
+      l->l_itail -= l->l_ihead;
+      l->l_ihead = 0;
+    }
+  }
 
-    p->p_buffer = ptr;
-    p->p_size += KATCL_BUFFER_INC;
+  if(l->l_itail >= KATCL_INPUT_SIZE){
+#if DEBUG > 1
+    fprintf(stderr, "read: input buffer full, waiting for messages to be parsed\n");
+#endif
+    return 0; /* caller has to parse what is there before we read more */
   }
 
-  rr = read(l->l_fd, p->p_buffer + p->p_have, p->p_size - p->p_have);
+  rr = read(l->l_fd, l->l_input + l->l_itail, KATCL_INPUT_SIZE - l->l_itail);
   if(rr < 0){
     switch(errno){
       case ECONNRESET : 
@@ -268,7 +355,7 @@ int read_katcl(struct katcl_line *l)
     return 1;
   }
 
-  p->p_have += rr;
+  l->l_itail += rr;
   return 0;
 }
 
@@ -286,7 +373,11 @@ void clear_katcl(struct katcl_line *l) /* discard a full line */
     return;
   }
 
-  destroy_parse_katcl(l->l_ready);
+  if((l->l_spare == NULL) && (l->l_ready->p_refs <= 1)){
+    l->l_spare = reuse_parse_katcl(l->l_ready); /* keep buffers around for next message */
+  } else {
+    destroy_parse_katcl(l->l_ready);
+  }
   l->l_ready = NULL;
 }
 
@@ -450,6 +541,252 @@ static struct katcl_parse *before_append_katcl(struct katcl_line *l, int flags)
   return l->l_stage;
 }
 
+/******************************************************************/
+
+static char *limit_names_katcl[] = { "none", "latest", "drop", "disconnect", NULL };
+
+int limit_to_code_katcl(char *name)
+{
+  int i;
+
+  if(name == NULL){
+    return -1;
+  }
+
+  for(i = 0; limit_names_katcl[i]; i++){
+    if(!strcmp(name, limit_names_katcl[i])){
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+char *limit_to_string_katcl(int code)
+{
+  if((code < KATCL_LIMIT_NONE) || (code > KATCL_LIMIT_DISCONNECT)){
+    return NULL;
+  }
+
+  return limit_names_katcl[code];
+}
+
+int limit_katcl(struct katcl_line *l, int policy, unsigned int high, unsigned int low)
+{
+  if((policy < KATCL_LIMIT_NONE) || (policy > KATCL_LIMIT_DISCONNECT)){
+    return -1;
+  }
+
+  if(low > high){
+    low = high;
+  }
+
+  l->l_policy = (high > 0) ? policy : KATCL_LIMIT_NONE;
+  l->l_high = high;
+  l->l_low = low;
+  l->l_congested = 0;
+
+  return 0;
+}
+
+int binary_katcl(struct katcl_line *l, int enable)
+{
+  int previous;
+
+  previous = l->l_binary;
+  if(enable >= 0){
+    l->l_binary = enable ? 1 : 0;
+  }
+
+  return previous;
+}
+
+int pass_katcl(struct katcl_line *l, int enable)
+{
+  int previous;
+
+  previous = l->l_pass;
+  if(enable >= 0){
+    l->l_pass = enable ? 1 : 0;
+  }
+
+  return previous;
+}
+
+int cork_katcl(struct katcl_line *l, int enable)
+{
+  int previous;
+
+  previous = l->l_cork;
+  if(enable >= 0){
+    l->l_cork = enable ? 1 : 0;
+    if(l->l_cork != previous){
+      nodelay_katcl(l);
+    }
+  }
+
+  return previous;
+}
+
+int tag_katcl(struct katcl_line *l, int tag)
+{
+  int previous;
+
+  previous = l->l_tag;
+  l->l_tag = (tag >= 0) ? tag : (-1);
+
+  return previous;
+}
+
+struct katcl_parse *swap_ready_katcl(struct katcl_line *l, struct katcl_parse *p)
+{
+  struct katcl_parse *previous;
+
+  /* lets the arg functions look at an earlier message, the caller has to swap back before the next parse */
+
+  previous = l->l_ready;
+  l->l_ready = p;
+
+  return previous;
+}
+
+int overflowed_katcl(struct katcl_line *l)
+{
+  return ((l->l_policy == KATCL_LIMIT_DISCONNECT) && l->l_congested) ? 1 : 0;
+}
+
+unsigned int queued_katcl(struct katcl_line *l)
+{
+  return size_queue_katcl(l->l_queue);
+}
+
+unsigned int buffered_katcl(struct katcl_line *l)
+{
+  /* received, but not yet taken by a parse */
+  if(l->l_input == NULL){
+    return 0;
+  }
+
+  return l->l_itail - l->l_ihead;
+}
+
+unsigned long shed_katcl(struct katcl_line *l)
+{
+  return l->l_shed;
+}
+
+static int same_sensor_katcl(struct katcl_parse *px, struct katcl_parse *py)
+{
+  char *name, *count, *other;
+
+  /* only single sensor status updates can be collapsed */
+
+  name = get_string_parse_katcl(px, 0);
+  if((name == NULL) || strcmp(name, KATCP_SENSOR_STATUS_INFORM)){
+    return 0;
+  }
+  count = get_string_parse_katcl(px, 2);
+  if((count == NULL) || strcmp(count, "1")){
+    return 0;
+  }
+
+  if(py == NULL){
+    return 1;
+  }
+
+  name = get_string_parse_katcl(py, 0);
+  if((name == NULL) || strcmp(name, KATCP_SENSOR_STATUS_INFORM)){
+    return 0;
+  }
+  count = get_string_parse_katcl(py, 2);
+  if((count == NULL) || strcmp(count, "1")){
+    return 0;
+  }
+
+  name = get_string_parse_katcl(px, 3);
+  other = get_string_parse_katcl(py, 3);
+  if((name == NULL) || (other == NULL)){
+    return 0;
+  }
+
+  return strcmp(name, other) ? 0 : 1;
+}
+
+static int limit_queue_katcl(struct katcl_line *l, struct katcl_parse *p)
+{
+  /* returns nonzero if p has been absorbed and should not be queued */
+  unsigned int size, i;
+  struct katcl_parse *px;
+  char *name;
+
+  if(l->l_policy == KATCL_LIMIT_NONE){
+    return 0;
+  }
+
+  size = size_queue_katcl(l->l_queue);
+
+  if(l->l_congested){
+    if(size <= l->l_low){
+      l->l_congested = 0;
+    }
+  } else {
+    if(size >= l->l_high){
+      l->l_congested = 1;
+    }
+  }
+
+  if(l->l_congested == 0){
+    return 0;
+  }
+
+  switch(l->l_policy){
+    case KATCL_LIMIT_LATEST :
+      if(!same_sensor_katcl(p, NULL)){
+        return 0;
+      }
+      /* skip over messages already handed to the writer */
+      i = l->l_described + (((l->l_arg > 0) || (l->l_offset > 0)) ? 1 : 0);
+      for(; i < size; i++){
+        px = get_index_queue_katcl(l->l_queue, i);
+        if(px && same_sensor_katcl(px, p)){
+          px = replace_index_queue_katcl(l->l_queue, i, p);
+          if(px == NULL){
+            return 0;
+          }
+          destroy_parse_katcl(px);
+          l->l_shed++;
+          return 1;
+        }
+      }
+      return 0;
+
+    case KATCL_LIMIT_DROP :
+      name = get_string_parse_katcl(p, 0);
+      if(name && (name[0] == KATCP_INFORM)){
+        l->l_shed++;
+        return 1;
+      }
+      return 0;
+
+    case KATCL_LIMIT_DISCONNECT :
+      l->l_error = ENOBUFS;
+      return 0;
+  }
+
+  return 0;
+}
+
+/* replies and informs to a tagged request carry its tag, callers clear
+ * the tag around broadcasts, which answer nobody in particular */
+static int wants_tag_katcl(struct katcl_line *l, struct katcl_parse *p)
+{
+  if(l->l_tag < 0){
+    return 0;
+  }
+
+  return is_reply_parse_katcl(p) || is_inform_parse_katcl(p);
+}
+
 static int after_append_katcl(struct katcl_line *l, int flags, int result)
 {
   if(result < 0){ /* things went wrong, throw away the entire line */
@@ -463,6 +800,14 @@ static int after_append_katcl(struct katcl_line *l, int flags, int result)
     return result;
   }
 
+  if((flags & KATCP_FLAG_FIRST) && l->l_stage && wants_tag_katcl(l, l->l_stage)){
+    if(name_tag_parse_katcl(l->l_stage, l->l_tag) < 0){
+      destroy_parse_katcl(l->l_stage);
+      l->l_stage = NULL;
+      return -1;
+    }
+  }
+
   if(!(flags & KATCP_FLAG_LAST)){
 #if DEBUG > 1
     fprintf(stderr, "after append: flag not last, not doing anything\n");
@@ -478,7 +823,9 @@ static int after_append_katcl(struct katcl_line *l, int flags, int result)
     return -1;
   }
 
-  add_tail_queue_katcl(l->l_queue, l->l_stage);
+  if(limit_queue_katcl(l, l->l_stage) == 0){
+    add_tail_queue_katcl(l->l_queue, l->l_stage);
+  }
   
   destroy_parse_katcl(l->l_stage);
   l->l_stage = NULL;
@@ -641,6 +988,39 @@ int append_parameter_katcl(struct katcl_line *l, int flags, struct katcl_parse *
   return after_append_katcl(l, flags, result);
 }
 
+static int append_tagged_katcl(struct katcl_line *l, struct katcl_parse *p)
+{
+  /* the parse may be queued elsewhere, so the tagged name goes into a copy */
+  struct katcl_parse *px;
+  unsigned int i, count;
+  int result;
+
+  count = get_count_parse_katcl(p);
+
+  px = create_referenced_parse_katcl();
+  if(px == NULL){
+    return -1;
+  }
+
+  result = 0;
+  for(i = 0; (i < count) && (result >= 0); i++){
+    result = add_parameter_parse_katcl(px, ((i == 0) ? KATCP_FLAG_FIRST : 0) | (((i + 1) == count) ? KATCP_FLAG_LAST : 0), p, i);
+    if((i == 0) && (result >= 0)){
+      result = name_tag_parse_katcl(px, l->l_tag);
+    }
+  }
+
+  if((result < 0) || limit_queue_katcl(l, px)){
+    destroy_parse_katcl(px);
+    return (result < 0) ? -1 : 0;
+  }
+
+  result = add_tail_queue_katcl(l->l_queue, px);
+  destroy_parse_katcl(px);
+
+  return result;
+}
+
 int append_parse_katcl(struct katcl_line *l, struct katcl_parse *p)
 {
   int result;
@@ -663,6 +1043,14 @@ int append_parse_katcl(struct katcl_line *l, struct katcl_parse *p)
   }
 #endif
 
+  if(wants_tag_katcl(l, p)){
+    return append_tagged_katcl(l, p);
+  }
+
+  if(limit_queue_katcl(l, p)){
+    return 0;
+  }
+
   result = add_tail_queue_katcl(l->l_queue, p);	
 
   return result;
@@ -777,15 +1165,90 @@ int relay_katcl(struct katcl_line *lx, struct katcl_line *ly)
 
 /***************************/
 
-static int escape_copy_katcl(char *dst, char *src, unsigned int want)
+/* count leading bytes which can go out as they are */
+
+#define ESCAPE_SWAR_ONES  0x0101010101010101ULL
+#define ESCAPE_SWAR_HIGHS 0x8080808080808080ULL
+#define escape_swar_match(w, c) (((w ^ (ESCAPE_SWAR_ONES * (c))) - ESCAPE_SWAR_ONES) & ~(w ^ (ESCAPE_SWAR_ONES * (c))) & ESCAPE_SWAR_HIGHS)
+
+static unsigned int escape_span_katcl(char *src, unsigned int len)
 {
-  /* returns amount actually consumed, assumes that dst has at least 2 + 2*want available */
-  int i, j;
+  unsigned int i;
+#ifdef __SSE2__
+  __m128i v, m;
+  int mask;
+#else
+  uint64_t w;
+#endif
+
+  i = 0;
+
+#ifdef __SSE2__
+  while((i + 16) <= len){
+    v = _mm_loadu_si128((__m128i *)(src + i));
+    m = _mm_or_si128(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(27)), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_setzero_si128()))),
+                     _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')), _mm_cmpeq_epi8(v, _mm_set1_epi8(' '))), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+    mask = _mm_movemask_epi8(m);
+    if(mask){
+      return i + __builtin_ctz(mask);
+    }
+    i += 16;
+  }
+#else
+  while((i + 8) <= len){
+    memcpy(&w, src + i, 8);
+    if(escape_swar_match(w, 27) | escape_swar_match(w, '\n') | escape_swar_match(w, '\r') | escape_swar_match(w, '\0') | escape_swar_match(w, '\\') | escape_swar_match(w, ' ') | escape_swar_match(w, '\t')){
+      break; /* locate it below */
+    }
+    i += 8;
+  }
+#endif
+
+  while(i < len){
+    switch(src[i]){
+      case  27  :
+      case '\n' :
+      case '\r' :
+      case '\0' :
+      case '\\' :
+      case ' '  :
+      case '\t' :
+        return i;
+    }
+    i++;
+  }
+
+  return i;
+}
+
+#undef escape_swar_match
+#undef ESCAPE_SWAR_HIGHS
+#undef ESCAPE_SWAR_ONES
+
+static unsigned int escape_copy_katcl(char *dst, unsigned int space, char *src, unsigned int want, unsigned int *used)
+{
+  /* escapes as much of src as fits into space, returns amount written, used reports amount consumed */
+  unsigned int i, j, run;
   char v;
 
+  i = 0;
   j = 0;
 
-  for(j = 0, i = 0; i < want; i++){
+  while(i < want){
+    run = escape_span_katcl(src + i, want - i);
+    if(run > (space - j)){
+      run = space - j;
+    }
+
+    memcpy(dst + j, src + i, run);
+    i += run;
+    j += run;
+
+    if((i >= want) || ((j + 2) > space)){
+      break;
+    }
+
     switch(src[i]){
       case  27  : v = 'e';  break;
       case '\n' : v = 'n';  break;
@@ -794,216 +1257,360 @@ static int escape_copy_katcl(char *dst, char *src, unsigned int want)
       case '\\' : v = '\\'; break;
       case ' '  : v = '_';  break; 
       case '\t' : v = 't';  break;
-      default   : 
-        dst[j++] = src[i];
-        continue; /* WARNING: restart loop */
+      default   : v = src[i]; break; /* not reached */
     }
     dst[j++] = '\\';
     dst[j++] = v;
+    i++;
   }
 
+  *used = i;
+
   return j;
 }
 
-#define WRITE_STATE_DONE   0
-#define WRITE_STATE_FILL   1
-#define WRITE_STATE_NEXT   2
-#define WRITE_STATE_SEND   3
+static void stage_vector_katcl(struct katcl_line *l, unsigned int len)
+{
+  /* describes len bytes just placed in the staging buffer, coalescing with previous entry if adjacent */
+  struct iovec *v;
+  char *ptr;
 
-int write_katcl(struct katcl_line *l)
+  ptr = l->l_buffer + l->l_used;
+
+  if(l->l_vcount > 0){
+    v = &(l->l_vector[l->l_vcount - 1]);
+    if(((char *)(v->iov_base) + v->iov_len) == ptr){
+      v->iov_len += len;
+      l->l_used += len;
+      l->l_pending += len;
+      return;
+    }
+  }
+
+  v = &(l->l_vector[l->l_vcount++]);
+  v->iov_base = ptr;
+  v->iov_len = len;
+
+  l->l_used += len;
+  l->l_pending += len;
+}
+
+static void direct_vector_katcl(struct katcl_line *l, char *ptr, unsigned int len)
+{
+  struct iovec *v;
+
+  v = &(l->l_vector[l->l_vcount++]);
+  v->iov_base = ptr;
+  v->iov_len = len;
+
+  l->l_pending += len;
+}
+
+static int serialize_parse_katcl(struct katcl_parse *p)
 {
-  int wr;
-  int state;
+  /* render a complete message once, so that every line holding it can write the same bytes */
+  unsigned int i, need, len, used;
+  struct katcl_larg *la;
+  char *tmp;
+
+  if(p->p_wire_len > 0){
+    return 0;
+  }
+
+  if((p->p_state != KATCL_PARSE_DONE) || (p->p_got == 0)){
+    return -1;
+  }
+
+  need = 1;
+  for(i = 0; i < p->p_got; i++){
+    la = &(p->p_args[i]);
+    need += ((la->a_end - la->a_begin) * 2) + 3; /* worst case escaping, null marker and separator */
+  }
+
+  if(need > p->p_wire_size){
+    tmp = realloc_memory_katcp(KATCP_MEMORY_PARSE, p->p_wire, p->p_wire_size, need);
+    if(tmp == NULL){
+      return -1;
+    }
+    p->p_wire = tmp;
+    p->p_wire_size = need;
+  }
+
+  len = 0;
+  for(i = 0; i < p->p_got; i++){
+    la = &(p->p_args[i]);
+
+    if(la->a_begin >= la->a_end){
+      p->p_wire[len++] = '\\';
+      p->p_wire[len++] = '@';
+    } else if(la->a_escape){
+      len += escape_copy_katcl(p->p_wire + len, need - len, p->p_buffer + la->a_begin, la->a_end - la->a_begin, &used);
+    } else {
+      memcpy(p->p_wire + len, p->p_buffer + la->a_begin, la->a_end - la->a_begin);
+      len += la->a_end - la->a_begin;
+    }
+
+    p->p_wire[len++] = ((i + 1) < p->p_got) ? ' ' : '\n';
+  }
+
+  p->p_wire_len = len;
+
+  return 0;
+}
+
+int wire_parse_katcl(struct katcl_parse *p, char **wire)
+{
+  /* for callers which gather output into their own buffers */
+  if(serialize_parse_katcl(p) < 0){
+    return -1;
+  }
+
+  *wire = p->p_wire;
+
+  return p->p_wire_len;
+}
+
+static void fill_vector_katcl(struct katcl_line *l)
+{
+  /* describe as much of the queue as fits, unescaped arguments are referenced in place, the rest is staged */
   unsigned int space, want, can, actual;
   struct katcl_parse *p;
   struct katcl_larg *la;
+  char *ptr;
 #define TMP_MARGIN 32
 
-  p = NULL;
+  while((l->l_vcount < KATCL_IO_VECTOR) && ((l->l_used + TMP_MARGIN) <= KATCL_IO_SIZE)){
 
-  for(state = WRITE_STATE_FILL; state != WRITE_STATE_DONE; ){
-#if DEBUG > 1
-    fprintf(stderr, "write: state=%d, parse=%p, arg=%u, offset=%u, pending=%u\n", state, p, l->l_arg, l->l_offset, l->l_pending);
+    p = get_index_queue_katcl(l->l_queue, l->l_described);
+    if(p == NULL){
+      return;
+    }
+
+#ifdef KATCP_CONSISTENCY_CHECKS
+    if(p->p_magic != KATCL_PARSE_MAGIC){
+      fprintf(stderr, "write: bad magic returned from get_index (%x, expected %x)\n", p->p_magic, KATCL_PARSE_MAGIC);
+      abort();
+    }
+    if(l->l_arg >= p->p_got){
+      fprintf(stderr, "write: logic problem: arg=%u >= got=%u\n", l->l_arg, p->p_got);
+      abort();
+    }
 #endif
-    switch(state){
 
-      case WRITE_STATE_FILL : 
+    if((l->l_arg == 0) && (l->l_offset == 0) && (l->l_binary == 0)){ /* at start of message, shared rendering is plain text only */
+      if((p->p_wire_len == 0) && (p->p_refs > 1)){ /* queued elsewhere too, worth rendering once */
+        serialize_parse_katcl(p);
+      }
+      if(p->p_wire_len > 0){
+        direct_vector_katcl(l, p->p_wire, p->p_wire_len);
+        l->l_described++;
+        continue;
+      }
+    }
 
-        p = get_head_queue_katcl(l->l_queue);
-        if(p == NULL){
-          state = (l->l_pending > 0) ? WRITE_STATE_SEND : WRITE_STATE_DONE;
-          continue; /* WARNING */
-        } 
+    la = &(p->p_args[l->l_arg]);
 
 #ifdef KATCP_CONSISTENCY_CHECKS
-        if(p->p_magic != KATCL_PARSE_MAGIC){
-          fprintf(stderr, "write: bad magic returned from get_head (%x, expected %x)\n", p->p_magic, KATCL_PARSE_MAGIC);
-          abort();
-        }
+    if((la->a_begin + l->l_offset) > la->a_end){
+      fprintf(stderr, "write: logic problem: offset=%u extends beyond argument %u (%u-%u)\n", l->l_offset, l->l_arg, la->a_begin, la->a_end);
+      abort();
+    }
 #endif
 
-        if((l->l_pending + TMP_MARGIN) > KATCL_IO_SIZE){
-          state = WRITE_STATE_SEND; /* drain if no margin */
-          continue; /* WARNING */
-        }
+    if((la->a_begin + l->l_offset) >= la->a_end){ /* done with this argument */
+      ptr = l->l_buffer + l->l_used;
+      actual = 0;
 
+      if(l->l_offset == 0){ /* special case - null arg */
 #ifdef KATCP_CONSISTENCY_CHECKS
-        if(l->l_arg >= p->p_got){
-          fprintf(stderr, "write: logic problem: arg=%u >= got=%u\n", l->l_arg, p->p_got);
+        if(l->l_arg == 0){
+          fprintf(stderr, "write: problem - arg0 is null\n");
           abort();
         }
 #endif
+        ptr[actual++] = '\\';
+        ptr[actual++] = '@';
+      }
+      if(la->a_escape <= 1){ /* mark things which were thought to need escaping, but did not appropriately */
+        la->a_escape = 0;
+      }
 
-        la = &(p->p_args[l->l_arg]);
+      l->l_arg++;
+      l->l_offset = 0;
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-        if((la->a_begin + l->l_offset) > la->a_end){
-          fprintf(stderr, "write: logic problem: offset=%u extends beyond argument %u (%u-%u)\n", l->l_offset, l->l_arg, la->a_begin, la->a_end);
-          abort();
-        }
+      if(l->l_arg < p->p_got){ /* more args */
+        ptr[actual++] = ' ';
+      } else {
+        ptr[actual++] = '\n';
+        l->l_arg = 0;
+        l->l_described++;
+#if DEBUG > 1
+        fprintf(stderr, "write: described parse %p (refs %d)\n", p, p->p_refs);
 #endif
+      }
 
-        if((la->a_begin + l->l_offset) >= la->a_end){ /* done ? */
-          if(l->l_offset == 0){ /* special case - null arg */
-#ifdef KATCP_CONSISTENCY_CHECKS
-            if(l->l_arg == 0){
-              fprintf(stderr, "write: problem - arg0 is null\n");
-              abort();
-            }
-#endif
-            strcpy(l->l_buffer + l->l_pending, "\\@");
-            l->l_pending += 2;
-          }
-          if(la->a_escape <= 1){ /* mark things which were thought to need escaping, but did not appropriately */
-            la->a_escape = 0;
-          }
+      stage_vector_katcl(l, actual);
+
+      continue;
+    }
 
-          l->l_arg++;
-          l->l_offset = 0;
-          state = WRITE_STATE_NEXT;
+    want = la->a_end - (la->a_begin + l->l_offset);
+    ptr = p->p_buffer + la->a_begin + l->l_offset;
+    space = KATCL_IO_SIZE - l->l_used;
 
-          continue;
+    if(l->l_binary && (la->a_escape == KATCL_ARG_BINARY) && (l->l_offset == 0)){ /* negotiated: length prefix, then raw bytes in place */
+      if((l->l_vcount + 2) > KATCL_IO_VECTOR){
+        return;
+      }
+      actual = snprintf(l->l_buffer + l->l_used, space, "\\=%u:", want);
+      stage_vector_katcl(l, actual);
+      direct_vector_katcl(l, ptr, want);
+      l->l_offset = want;
+      continue;
+    }
+
+    if(la->a_escape){
+      can = escape_span_katcl(ptr, want);
+      if(can >= KATCL_IO_DIRECT){ /* long run without special characters, reference it in place */
+        direct_vector_katcl(l, ptr, can);
+      } else {
+        actual = escape_copy_katcl(l->l_buffer + l->l_used, space, ptr, want, &can);
+        if((actual > can) && (la->a_escape == 1)){
+          la->a_escape = 2; /* record that we needed to escape */
         }
+        stage_vector_katcl(l, actual);
+      }
+    } else if(want >= KATCL_IO_DIRECT){
+      can = want;
+      direct_vector_katcl(l, ptr, can);
+    } else {
+      can = (space >= want) ? want : space;
+      memcpy(l->l_buffer + l->l_used, ptr, can);
+      stage_vector_katcl(l, can);
+    }
 
-        want = la->a_end - (la->a_begin + l->l_offset);
-        space = KATCL_IO_SIZE - (l->l_pending + 1);
+    l->l_offset += can;
+  }
+#undef TMP_MARGIN
+}
 
-#if DEBUG>1
-        fprintf(stderr, "write: arg[%u] has %u more, space is %u\n", l->l_arg, want, space);
-#endif
+static int more_katcl(struct katcl_line *l)
+{
+  /* cork while further queued messages will follow this vector, unless it ends in a reply */
+  struct katcl_parse *p;
 
-        if(la->a_escape){
-          can = ((space / 2) >= want) ? want : space / 2;
-          actual = escape_copy_katcl(l->l_buffer + l->l_pending, p->p_buffer + la->a_begin + l->l_offset, can);
-          if(actual > can){
-            la->a_escape = 2; /* record that we needed to escape */
-          }
-          l->l_pending += actual;
-        } else {
-          can = (space >= want) ? want : space;
-          memcpy(l->l_buffer + l->l_pending, p->p_buffer + la->a_begin + l->l_offset, can);
-          l->l_pending += can;
-        }
-        l->l_offset += can;
+  if(l->l_cork == 0){
+    return 0;
+  }
 
-        break;
+  if(size_queue_katcl(l->l_queue) <= l->l_described){
+    return 0;
+  }
 
-      case WRITE_STATE_NEXT : /* move onto next */
-        /* gets a proposed position, updates to next parse or end if needed, adding separators and tags */
+  if(l->l_described > 0){
+    p = get_index_queue_katcl(l->l_queue, l->l_described - 1);
+    if(p && is_reply_parse_katcl(p)){
+      return 0;
+    }
+  }
 
-        p = get_head_queue_katcl(l->l_queue);
-        if(p == NULL){
-          l->l_offset = 0;
-          l->l_arg = 0;
-          state = WRITE_STATE_SEND;
-          continue;
-        }
+  return 1;
+}
 
-#ifdef KATCP_CONSISTENCY_CHECKS
-        if(p->p_magic != KATCL_PARSE_MAGIC){
-          fprintf(stderr, "write: bad magic returned from get_head (%x, expected %x)\n", p->p_magic, KATCL_PARSE_MAGIC);
-          abort();
-        }
-#endif
+int write_katcl(struct katcl_line *l)
+{
+  int wr, flags;
+  unsigned int i;
+  struct katcl_parse *p;
+  struct iovec *v;
+  struct msghdr msg;
 
-        if(l->l_pending >= KATCL_IO_SIZE){
-          fprintf(stderr, "write: logic problem: pending=%u, no space left\n", l->l_pending);
-        }
-      
-        if((p->p_tag >= 0) && (l->l_arg == 1)){
-          /* !#$ : TODO: enter tag printing state */
-        }
+  if(overflowed_katcl(l)){
+    l->l_error = ENOBUFS;
+    return -1;
+  }
 
-        if(l->l_arg < p->p_got){ /* more args */
-          state = WRITE_STATE_FILL;
-          l->l_buffer[l->l_pending++] = ' ';
-          continue;
-        }
+  for(;;){
 
-        l->l_arg = 0;
-        l->l_buffer[l->l_pending++] = '\n';
+    if(l->l_vhead >= l->l_vcount){ /* vector drained, release what went out and refill */
 
+      for(i = 0; i < l->l_described; i++){
+        p = remove_head_queue_katcl(l->l_queue);
 #if DEBUG > 1
-        fprintf(stderr, "write: wrote out parse %p (refs %d)\n", p, p->p_refs);
+        fprintf(stderr, "write: wrote out parse %p (refs %d)\n", p, p ? p->p_refs : 0);
 #endif
-
-        p = remove_head_queue_katcl(l->l_queue);
         destroy_parse_katcl(p);
-        state = p ? WRITE_STATE_FILL : WRITE_STATE_SEND;
+      }
 
-        break;
+      l->l_described = 0;
+      l->l_vhead = 0;
+      l->l_vcount = 0;
+      l->l_used = 0;
+      l->l_pending = 0;
 
-      case WRITE_STATE_SEND : /* do io */
+      fill_vector_katcl(l);
 
-        p = get_head_queue_katcl(l->l_queue);
-        if(l->l_pending <= 0){ /* nothing more to write ? */
-          state = p ? WRITE_STATE_FILL : WRITE_STATE_DONE;
-          continue; /* WARNING: added later, attempt to remove write(,,0) cases */
-        }
+      if(l->l_vcount == 0){
+        /* done everything */
+        return 1;
+      }
+    }
+
+#if DEBUG > 1
+    fprintf(stderr, "write: vector=%u/%u, arg=%u, offset=%u, pending=%u\n", l->l_vhead, l->l_vcount, l->l_arg, l->l_offset, l->l_pending);
+#endif
 
-        if(l->l_sendable){
+    if(l->l_sendable){
+      memset(&msg, 0, sizeof(struct msghdr));
+      msg.msg_iov = l->l_vector + l->l_vhead;
+      msg.msg_iovlen = l->l_vcount - l->l_vhead;
+      flags = MSG_DONTWAIT;
 #ifdef MSG_NOSIGNAL
-          wr = send(l->l_fd, l->l_buffer, l->l_pending, MSG_DONTWAIT | MSG_NOSIGNAL);
-#else
-          wr = send(l->l_fd, l->l_buffer, l->l_pending, MSG_DONTWAIT);
+      flags |= MSG_NOSIGNAL;
 #endif
-        } else {
-          wr = write(l->l_fd, l->l_buffer, l->l_pending);
-        }
+#ifdef MSG_MORE
+      if(more_katcl(l)){
+        flags |= MSG_MORE;
+      }
+#endif
+      wr = sendmsg(l->l_fd, &msg, flags);
+    } else {
+      wr = writev(l->l_fd, l->l_vector + l->l_vhead, l->l_vcount - l->l_vhead);
+    }
 
-        if(wr < 0){
-          switch(errno){
-            case EAGAIN :
-            case EINTR  :
-              return 0; /* returns zero if still more to do */
-            case ENOTSOCK :
-              if(l->l_sendable > 0){
-                l->l_sendable = 0; /* try again, this time with write() not send() */
-                continue; /* WARNING, restart for();  */
-              }
-              /* WARNING: drop through */
-            default :
-              l->l_error = errno;
-              return -1;
+    if(wr < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          return 0; /* returns zero if still more to do */
+        case ENOTSOCK :
+          if(l->l_sendable > 0){
+            l->l_sendable = 0; /* try again, this time with writev() not sendmsg() */
+            continue; /* WARNING, restart for();  */
           }
-        }
+          /* WARNING: drop through */
+        default :
+          l->l_error = errno;
+          return -1;
+      }
+    }
 
-        if(wr > 0){
-          if(wr < l->l_pending){ /* a tad expensive, but we expect this to be rare */
-            memmove(l->l_buffer, l->l_buffer + wr, l->l_pending - wr);
-            l->l_pending -= wr;
-          } else {
-            l->l_pending = 0;
-          }
-        }
+    TRACE_KATCP(KATCP_TRACE_FLUSH, wr, NULL);
 
-        break;
+    l->l_pending -= wr;
+
+    while((wr > 0) && (l->l_vhead < l->l_vcount)){
+      v = &(l->l_vector[l->l_vhead]);
+      if(wr < v->iov_len){ /* partial write, resume within this entry */
+        v->iov_base = (char *)(v->iov_base) + wr;
+        v->iov_len -= wr;
+        wr = 0;
+      } else {
+        wr -= v->iov_len;
+        l->l_vhead++;
+      }
     }
   }
-
-  /* done everything */
-  return 1;
-#undef TMP_MARGIN
 }
 
 int flushing_katcl(struct katcl_line *l)
@@ -1205,6 +1812,10 @@ int main()
     fprintf(stderr, "line test: iteration %d\n", i);
 #endif
 
+    if(i == (TEST_RUNS / 2)){ /* echo peer is transparent, so second half round trips length prefixed arguments */
+      binary_katcl(l, 1);
+    }
+
     p = create_referenced_parse_katcl();
     if(p == NULL){
       fprintf(stderr, "unable to create parse instance %d\n", i);
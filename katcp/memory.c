@@ -0,0 +1,172 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* memory accounting: the larger consumers in the library (parses, queues,
+ * sensors, notices, trees, duplex state) allocate through these wrappers,
+ * which charge each allocation to a subsystem. Callers pass the size
+ * again when freeing or resizing, so nothing is stored alongside the
+ * allocation, and a block may be freed in a different file from the one
+ * which allocated it. Applications can claim further subsystems with
+ * tag_memory_katcp */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "katcp.h"
+
+struct katcp_memory_account{
+  char *m_name;
+  long m_bytes;
+  long m_peak;
+  long m_objects;
+  unsigned long m_allocs;
+};
+
+static struct katcp_memory_account memory_accounts_katcp[KATCP_MEMORY_TAGS] = {
+  [KATCP_MEMORY_PARSE]   = { "parse",   0, 0, 0, 0 },
+  [KATCP_MEMORY_QUEUE]   = { "queue",   0, 0, 0, 0 },
+  [KATCP_MEMORY_SENSOR]  = { "sensor",  0, 0, 0, 0 },
+  [KATCP_MEMORY_NOTICE]  = { "notice",  0, 0, 0, 0 },
+  [KATCP_MEMORY_AVLTREE] = { "avltree", 0, 0, 0, 0 },
+  [KATCP_MEMORY_DUPLEX]  = { "duplex",  0, 0, 0, 0 },
+  [KATCP_MEMORY_NAME]    = { "name",    0, 0, 0, 0 }
+};
+
+static void charge_memory_katcp(int tag, long bytes, long objects)
+{
+  struct katcp_memory_account *m;
+  long now;
+
+  if((tag < 0) || (tag >= KATCP_MEMORY_TAGS)){
+#ifdef KATCP_CONSISTENCY_CHECKS
+    fprintf(stderr, "memory: invalid accounting tag %d\n", tag);
+    abort();
+#endif
+    return;
+  }
+
+  m = &(memory_accounts_katcp[tag]);
+
+  /* workers may allocate parses too, keep the counters themselves exact */
+  now = __sync_add_and_fetch(&(m->m_bytes), bytes);
+  if(objects){
+    __sync_add_and_fetch(&(m->m_objects), objects);
+  }
+  if(bytes > 0){
+    __sync_add_and_fetch(&(m->m_allocs), 1);
+  }
+
+  if(now > m->m_peak){ /* may miss a concurrent peak, good enough */
+    m->m_peak = now;
+  }
+}
+
+int tag_memory_katcp(char *name)
+{
+  int i;
+
+  if(name == NULL){
+    return -1;
+  }
+
+  for(i = 0; i < KATCP_MEMORY_TAGS; i++){
+    if(memory_accounts_katcp[i].m_name == NULL){
+      memory_accounts_katcp[i].m_name = name;
+      return i;
+    }
+    if(!strcmp(memory_accounts_katcp[i].m_name, name)){
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+void *malloc_memory_katcp(int tag, size_t size)
+{
+  void *ptr;
+
+  ptr = malloc(size);
+  if(ptr){
+    charge_memory_katcp(tag, size, 1);
+  }
+
+  return ptr;
+}
+
+void *realloc_memory_katcp(int tag, void *ptr, size_t before, size_t after)
+{
+  void *tmp;
+
+  tmp = realloc(ptr, after);
+  if(tmp){
+    charge_memory_katcp(tag, (long)after - (long)before, (ptr == NULL) ? 1 : 0);
+  }
+
+  return tmp;
+}
+
+char *strdup_memory_katcp(int tag, char *string)
+{
+  char *copy;
+
+  copy = strdup(string);
+  if(copy){
+    charge_memory_katcp(tag, strlen(copy) + 1, 1);
+  }
+
+  return copy;
+}
+
+void free_memory_katcp(int tag, void *ptr, size_t size)
+{
+  if(ptr == NULL){
+    return;
+  }
+
+  charge_memory_katcp(tag, 0 - (long)size, -1);
+
+  free(ptr);
+}
+
+void free_string_memory_katcp(int tag, char *string)
+{
+  if(string == NULL){
+    return;
+  }
+
+  free_memory_katcp(tag, string, strlen(string) + 1);
+}
+
+int stats_memory_katcp(int tag, char **name, long *bytes, long *peak, long *objects, unsigned long *allocs)
+{
+  struct katcp_memory_account *m;
+
+  if((tag < 0) || (tag >= KATCP_MEMORY_TAGS)){
+    return -1;
+  }
+
+  m = &(memory_accounts_katcp[tag]);
+  if(m->m_name == NULL){
+    return -1;
+  }
+
+  if(name){
+    *name = m->m_name;
+  }
+  if(bytes){
+    *bytes = m->m_bytes;
+  }
+  if(peak){
+    *peak = m->m_peak;
+  }
+  if(objects){
+    *objects = m->m_objects;
+  }
+  if(allocs){
+    *allocs = m->m_allocs;
+  }
+
+  return 0;
+}
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 #include "katcp.h"
 #include "katpriv.h"
@@ -63,3 +64,208 @@ void delete_vector_katcm(char **vector, unsigned int size)
 
   free(vector);
 }
+
+unsigned int hash_name_katcm(char *name)
+{
+  unsigned int h;
+
+  h = 2166136261U; /* fnv-1a */
+  while(*name){
+    h = (h ^ ((unsigned char)*name)) * 16777619U;
+    name++;
+  }
+
+  return h;
+}
+
+/* interned names: sensor, command, notice and version names are held
+ * once per process, with a reference count. Two interned names are
+ * equal exactly if their pointers are, and the hash computed on entry
+ * is kept with the string, so indexes need not recompute it. To look
+ * something up, map the candidate with find_name_katcm first, a NULL
+ * result means that no table can contain it. Not thread safe, names
+ * are only created and looked up by the main loop */
+
+#define NAME_MAGIC 0x6e616d65
+#define NAME_BINS  64 /* initial size, doubles as names are added */
+
+struct katcm_name{
+#ifdef KATCP_CONSISTENCY_CHECKS
+  unsigned int n_magic;
+#endif
+  struct katcm_name *n_next;
+  unsigned int n_hash;
+  unsigned int n_refs;
+  char n_string[];
+};
+
+static struct katcm_name **name_table = NULL;
+static unsigned int name_bins = 0;
+static unsigned int name_count = 0;
+
+static struct katcm_name *container_name_katcm(char *name)
+{
+  struct katcm_name *n;
+
+  n = (struct katcm_name *)(name - offsetof(struct katcm_name, n_string));
+
+#ifdef KATCP_CONSISTENCY_CHECKS
+  if(n->n_magic != NAME_MAGIC){
+    fprintf(stderr, "name: %p (%s) was not interned\n", name, name);
+    abort();
+  }
+#endif
+
+  return n;
+}
+
+static struct katcm_name *locate_name_katcm(char *name, unsigned int hash)
+{
+  struct katcm_name *n;
+
+  if(name_table == NULL){
+    return NULL;
+  }
+
+  for(n = name_table[hash & (name_bins - 1)]; n; n = n->n_next){
+    if((n->n_hash == hash) && (strcmp(n->n_string, name) == 0)){
+      return n;
+    }
+  }
+
+  return NULL;
+}
+
+static void grow_names_katcm(void)
+{
+  struct katcm_name **table, *n, *next;
+  unsigned int bins, i, h;
+
+  bins = (name_bins > 0) ? (name_bins * 2) : NAME_BINS;
+
+  table = malloc_memory_katcp(KATCP_MEMORY_NAME, sizeof(struct katcm_name *) * bins);
+  if(table == NULL){
+    return; /* chains just get longer */
+  }
+
+  for(i = 0; i < bins; i++){
+    table[i] = NULL;
+  }
+
+  for(i = 0; i < name_bins; i++){
+    for(n = name_table[i]; n; n = next){
+      next = n->n_next;
+      h = n->n_hash & (bins - 1);
+      n->n_next = table[h];
+      table[h] = n;
+    }
+  }
+
+  if(name_table){
+    free_memory_katcp(KATCP_MEMORY_NAME, name_table, sizeof(struct katcm_name *) * name_bins);
+  }
+
+  name_table = table;
+  name_bins = bins;
+}
+
+char *intern_name_katcm(char *name)
+{
+  struct katcm_name *n;
+  unsigned int hash, len, h;
+
+  if(name == NULL){
+    return NULL;
+  }
+
+  hash = hash_name_katcm(name);
+
+  n = locate_name_katcm(name, hash);
+  if(n){
+    n->n_refs++;
+    return n->n_string;
+  }
+
+  if(name_count >= name_bins){
+    grow_names_katcm();
+    if(name_table == NULL){
+      return NULL;
+    }
+  }
+
+  len = strlen(name) + 1;
+
+  n = malloc_memory_katcp(KATCP_MEMORY_NAME, sizeof(struct katcm_name) + len);
+  if(n == NULL){
+    return NULL;
+  }
+
+#ifdef KATCP_CONSISTENCY_CHECKS
+  n->n_magic = NAME_MAGIC;
+#endif
+  n->n_hash = hash;
+  n->n_refs = 1;
+  memcpy(n->n_string, name, len);
+
+  h = hash & (name_bins - 1);
+  n->n_next = name_table[h];
+  name_table[h] = n;
+  name_count++;
+
+  return n->n_string;
+}
+
+char *find_name_katcm(char *name)
+{
+  struct katcm_name *n;
+
+  if(name == NULL){
+    return NULL;
+  }
+
+  n = locate_name_katcm(name, hash_name_katcm(name));
+
+  return n ? n->n_string : NULL;
+}
+
+void release_name_katcm(char *name)
+{
+  struct katcm_name *n, **prv;
+
+  if(name == NULL){
+    return;
+  }
+
+  n = container_name_katcm(name);
+
+  if(n->n_refs > 1){
+    n->n_refs--;
+    return;
+  }
+
+  for(prv = &(name_table[n->n_hash & (name_bins - 1)]); *prv; prv = &((*prv)->n_next)){
+    if(*prv == n){
+      *prv = n->n_next;
+      break;
+    }
+  }
+
+  name_count--;
+
+#ifdef KATCP_CONSISTENCY_CHECKS
+  n->n_magic = 0;
+#endif
+
+  free_memory_katcp(KATCP_MEMORY_NAME, n, sizeof(struct katcm_name) + strlen(n->n_string) + 1);
+
+  if((name_count == 0) && name_table){
+    free_memory_katcp(KATCP_MEMORY_NAME, name_table, sizeof(struct katcm_name *) * name_bins);
+    name_table = NULL;
+    name_bins = 0;
+  }
+}
+
+unsigned int hash_interned_katcm(char *name)
+{
+  return container_name_katcm(name)->n_hash;
+}
@@ -12,6 +12,7 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -19,6 +20,202 @@
 
 #include "netc.h"
 
+/* unix domain sockets, for clients on the same machine ********************/
+
+char *net_unix_path(char *name)
+{
+  /* returns the socket path of a unix:/path or unix:///path style name, NULL for tcp names */
+  char *ptr;
+  int len;
+
+  if(name == NULL){
+    return NULL;
+  }
+
+  len = strlen(NETC_UNIX_PREFIX);
+  if(strncmp(name, NETC_UNIX_PREFIX, len)){
+    return NULL;
+  }
+
+  ptr = name + len;
+  if((ptr[0] == '/') && (ptr[1] == '/')){
+    ptr += 2;
+  }
+
+  return ptr;
+}
+
+static int unix_address_netc(struct sockaddr_un *su, char *path, int flags)
+{
+  int len;
+
+  len = strlen(path);
+  if((len <= 0) || (len >= sizeof(su->sun_path))){
+    if(flags & NETC_VERBOSE_ERRORS) fprintf(stderr, "unix: unusable socket path <%s>\n", path);
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(su, 0, sizeof(struct sockaddr_un));
+  su->sun_family = AF_UNIX;
+  memcpy(su->sun_path, path, len + 1);
+
+  return 0;
+}
+
+static int unix_socket_netc(int flags)
+{
+  int fd;
+#ifndef SOCK_NONBLOCK
+  long opts;
+#endif
+
+  if(flags & NETC_ASYNC){
+#ifdef SOCK_NONBLOCK
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+#else
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd >= 0){
+      opts = fcntl(fd, F_GETFL, NULL);
+      if(opts >= 0){
+        fcntl(fd, F_SETFL, opts | O_NONBLOCK);
+      }
+    }
+#endif
+  } else {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  }
+
+  return fd;
+}
+
+static int unix_connect_netc(char *path, int flags)
+{
+  struct sockaddr_un su;
+  int fd, se;
+
+  if(unix_address_netc(&su, path, flags) < 0){
+    return -1;
+  }
+
+  fd = unix_socket_netc(flags);
+  if(fd < 0){
+    if(flags & NETC_VERBOSE_ERRORS){
+      se = errno;
+      fprintf(stderr, "connect: unable to allocate unix socket: %s\n", strerror(errno));
+      errno = se;
+    }
+    return -1;
+  }
+
+  if(flags & NETC_VERBOSE_STATS){
+    fprintf(stderr, "connect: connecting to %s\n", path);
+  }
+
+  if(connect(fd, (struct sockaddr *)(&su), sizeof(struct sockaddr_un))){
+    if(flags & NETC_ASYNC){
+      if((errno == EINPROGRESS) || (errno == EAGAIN)){
+        return fd;
+      }
+    }
+    se = errno;
+    close(fd);
+    if(flags & NETC_VERBOSE_ERRORS){
+      fprintf(stderr, "connect: connect to %s failed: %s\n", path, strerror(errno));
+    }
+    errno = se;
+    return -1;
+  }
+
+  if(flags & NETC_VERBOSE_STATS){
+    fprintf(stderr, "connect: established connection\n");
+  }
+
+  return fd;
+}
+
+static int unix_listen_netc(char *path, int flags)
+{
+  struct sockaddr_un su;
+  int fd, se, probe;
+
+  if(unix_address_netc(&su, path, flags) < 0){
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0){
+    if(flags & NETC_VERBOSE_ERRORS){
+      se = errno;
+      fprintf(stderr, "listen: unable to allocate unix socket: %s\n", strerror(errno));
+      errno = se;
+    }
+    return -1;
+  }
+
+  if(bind(fd, (struct sockaddr *)(&su), sizeof(struct sockaddr_un))){
+    se = errno;
+    if(se == EADDRINUSE){
+      /* a socket left behind by an earlier instance refuses connections, only then remove it */
+      probe = socket(AF_UNIX, SOCK_STREAM, 0);
+      if(probe >= 0){
+        if(connect(probe, (struct sockaddr *)(&su), sizeof(struct sockaddr_un)) && (errno == ECONNREFUSED)){
+          if(flags & NETC_VERBOSE_STATS) fprintf(stderr, "listen: removing stale socket %s\n", path);
+          unlink(path);
+        }
+        close(probe);
+      }
+      if(bind(fd, (struct sockaddr *)(&su), sizeof(struct sockaddr_un)) == 0){
+        se = 0;
+      } else {
+        se = errno;
+      }
+    }
+    if(se){
+      close(fd);
+      if(flags & NETC_VERBOSE_ERRORS) fprintf(stderr, "listen: bind to %s failed: %s\n", path, strerror(se));
+      errno = se;
+      return -1;
+    }
+  }
+
+  if(listen(fd, 3)){
+    se = errno;
+    close(fd);
+    if(flags & NETC_VERBOSE_ERRORS) fprintf(stderr, "listen: unable to listen on %s: %s\n", path, strerror(se));
+    errno = se;
+    return -1;
+  }
+
+  if(flags & NETC_VERBOSE_STATS){
+    fprintf(stderr, "listen: ready for connections on %s\n", path);
+  }
+
+  return fd;
+}
+
+int net_label(char *buffer, unsigned int size, struct sockaddr *sa, int fd)
+{
+  /* names an accepted connection, local peers are usually anonymous, so use the descriptor */
+  struct sockaddr_in *si;
+  int result;
+
+  if(sa->sa_family == AF_INET){
+    si = (struct sockaddr_in *) sa;
+    result = snprintf(buffer, size, "%s:%d", inet_ntoa(si->sin_addr), ntohs(si->sin_port));
+  } else {
+    result = snprintf(buffer, size, "%s%d", NETC_UNIX_PREFIX, fd);
+  }
+
+  if(size > 0){
+    buffer[size - 1] = '\0';
+  }
+
+  return result;
+}
+
+/* tcp **********************************************************************/
+
 int net_connect(char *name, int port, int flags)
 {
   /* WARNING: this function may call resolvers, and blocks for those */
@@ -32,6 +229,11 @@ int net_connect(char *name, int port, int flags)
   long opts;
 #endif
 
+  ptr = net_unix_path(name);
+  if(ptr){
+    return unix_connect_netc(ptr, flags);
+  }
+
   p = NETC_DEFAULT_PORT;
 
   ptr = strchr(name, ':');
@@ -180,6 +382,11 @@ int net_listen(char *name, int port, int flags)
   host = NULL;
   p = 0;
 
+  ptr = net_unix_path(name);
+  if(ptr){
+    return unix_listen_netc(ptr, flags);
+  }
+
   if(name){
     host = strdup(name);
     if(host == NULL){
@@ -12,9 +12,16 @@ extern "C" {
 
 #define NETC_DEFAULT_PORT   7147
 
+#define NETC_UNIX_PREFIX    "unix:" /* unix:/path or unix:///path names a local socket */
+
+struct sockaddr;
+
 int net_connect(char *name, int port, int flags);
 int net_listen(char *name, int port, int flags);
 
+char *net_unix_path(char *name);
+int net_label(char *buffer, unsigned int size, struct sockaddr *sa, int fd);
+
 #ifdef __cplusplus
 }
 #endif
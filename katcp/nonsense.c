@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <regex.h>
 
 #ifdef KATCP_USE_FLOATS
 #include <math.h>
@@ -11,6 +13,7 @@
 
 #include "katcp.h"
 #include "katpriv.h"
+#include "katcl.h"
 #include "netc.h"
 
 #define SENSOR_MAGIC   0x0005e507
@@ -21,6 +24,10 @@
 
 #define SENSOR_LIMIT_FUDGE            2500  /* minor fudge factor */
 
+#define SENSOR_SAMPLING_EXTRA             3  /* most strategy parameters, event-rate shortest longest deadband */
+
+#define SENSOR_BINS                     64  /* initial size of name hash, power of two */
+
 #define SENSOR_CHECK_NONE                0
 #define SENSOR_CHECK_SINGLE              1
 #define SENSOR_CHECK_FAST                2
@@ -29,6 +36,9 @@
 /**********************************************************************************************/
 
 static int run_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a, int forced);
+static int emit_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a);
+static void destroy_history_katcp(struct katcp_sensor *sn);
+static void record_history_katcp(struct katcp_sensor *sn, struct timeval *tv);
 
 /**********************************************************************************************/
 
@@ -122,7 +132,7 @@ static void destroy_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor *
 static void destroy_nonsense_katcp(struct katcp_dispatch *d, struct katcp_nonsense *ns);
 int generic_sensor_update_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn, char *name);
 
-static int configure_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn, int strategy, int manual, char *extra);
+static int configure_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn, int strategy, int manual, unsigned int count, char **extra);
 
 char *type_name_sensor_katcp(struct katcp_sensor *sn);
 
@@ -203,6 +213,37 @@ int status_check_katcp(struct katcp_nonsense *ns)
   return 1;
 }
 
+/* event-rate: a change goes out once n_shortest has passed since the
+ * previous update, and something goes out at least every n_longest. The
+ * sensor is sampled at least every n_period on the aligned ticks, so a
+ * change held back is caught by a later sample, as is the heartbeat. The
+ * type specific checks work out what counts as a change */
+
+static int rate_due_katcp(struct katcp_nonsense *ns, int changed)
+{
+  struct katcp_sensor *sn;
+  struct timeval now, when, slack;
+
+  sn = ns->n_sensor;
+
+  /* samples land on the ticks, allow for a little timer jitter */
+  slack.tv_sec = 0;
+  slack.tv_usec = SENSOR_LIMIT_FUDGE;
+  add_time_katcp(&now, &(sn->s_recent), &slack);
+
+  add_time_katcp(&when, &(ns->n_next), changed ? &(ns->n_shortest) : &(ns->n_longest));
+  if(cmp_time_katcp(&when, &now) > 0){
+    return 0;
+  }
+
+  ns->n_next.tv_sec = sn->s_recent.tv_sec;
+  ns->n_next.tv_usec = sn->s_recent.tv_usec;
+
+  ns->n_status = sn->s_status;
+
+  return 1;
+}
+
 /* double routines *******************************************************/
 
 #ifdef KATCP_USE_FLOATS
@@ -291,11 +332,7 @@ int create_acquire_double_katcp(struct katcp_dispatch *d, struct katcp_acquire *
     return -1;
   }
 
-  da = malloc(sizeof(struct katcp_double_acquire));
-  if(da == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes for acquire structure", sizeof(struct katcp_double_acquire));
-    return -1;
-  }
+  da = &(a->a_store.a_double);
 
   da->da_current = 0;
   da->da_get = NULL;
@@ -385,11 +422,7 @@ int create_sensor_double_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn
     return -1;
   }
 
-  ds = malloc(sizeof(struct katcp_double_sensor));
-  if(ds == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes for double sensor structure", sizeof(struct katcp_double_sensor));
-    return -1;
-  }
+  ds = &(sn->s_store.s_double);
 
   if(nom_min < nom_max){
     ds->ds_nominal_min = nom_min;
@@ -441,11 +474,7 @@ int create_nonsense_double_katcp(struct katcp_dispatch *d, struct katcp_nonsense
   }
 
   ds = sn->s_more;
-  dn = malloc(sizeof(struct katcp_double_nonsense));
-  if(dn == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes for double sensor structure", sizeof(struct katcp_double_nonsense));
-    return -1;
-  }
+  dn = &(ns->n_store.n_double);
 
   /* changed as per request from simon to always report initial value for event */
 #if 0
@@ -483,17 +512,17 @@ int append_type_double_katcp(struct katcp_dispatch *d, int flags, struct katcp_s
 
       results[0] = append_string_katcp(d, KATCP_FLAG_STRING | (flags & KATCP_FLAG_FIRST), name);
 
-      results[1] = append_double_katcp(d, KATCP_FLAG_SLONG,                             (long)(ds->ds_nominal_min));
-      results[2] = append_double_katcp(d, KATCP_FLAG_SLONG,                             (long)(ds->ds_nominal_max));
-      results[3] = append_double_katcp(d, KATCP_FLAG_SLONG,                             (long)(ds->ds_warning_min));
-      results[4] = append_double_katcp(d, KATCP_FLAG_SLONG | (flags & KATCP_FLAG_LAST), (long)(ds->ds_warning_max));
+      results[1] = append_double_katcp(d, KATCP_FLAG_DOUBLE,                             ds->ds_nominal_min);
+      results[2] = append_double_katcp(d, KATCP_FLAG_DOUBLE,                             ds->ds_nominal_max);
+      results[3] = append_double_katcp(d, KATCP_FLAG_DOUBLE,                             ds->ds_warning_min);
+      results[4] = append_double_katcp(d, KATCP_FLAG_DOUBLE | (flags & KATCP_FLAG_LAST), ds->ds_warning_max);
 
       return vector_sum(results, 5);
 
     case SENSOR_CHECK_SINGLE : /* only nominal range valid */
       results[0] = append_string_katcp(d, KATCP_FLAG_STRING | (flags & KATCP_FLAG_FIRST), name);
-      results[1] = append_double_katcp(d, KATCP_FLAG_SLONG, (long)(ds->ds_nominal_min));
-      results[2] = append_double_katcp(d, KATCP_FLAG_SLONG | (flags & KATCP_FLAG_LAST), (long)(ds->ds_nominal_max));
+      results[1] = append_double_katcp(d, KATCP_FLAG_DOUBLE, ds->ds_nominal_min);
+      results[2] = append_double_katcp(d, KATCP_FLAG_DOUBLE | (flags & KATCP_FLAG_LAST), ds->ds_nominal_max);
       return vector_sum(results, 3);
 
     case SENSOR_CHECK_NONE   : 
@@ -634,6 +663,40 @@ int diff_check_double_katcp(struct katcp_nonsense *ns)
   return 1;
 }
 
+int rate_check_double_katcp(struct katcp_nonsense *ns)
+{
+  struct katcp_sensor *sn;
+  struct katcp_double_sensor *ds;
+  struct katcp_double_nonsense *dn;
+  int changed;
+
+  sn = ns->n_sensor;
+
+#ifdef DEBUG
+  if((sn == NULL) || (sn->s_type != KATCP_SENSOR_FLOAT)){
+    fprintf(stderr, "major logic problem: rate double check not run on double\n");
+    abort();
+  }
+#endif
+
+  ds = sn->s_more;
+  dn = ns->n_more;
+
+  if(ns->n_deadband){
+    changed = (fabs(ds->ds_current - dn->dn_previous) >= dn->dn_delta);
+  } else {
+    changed = (ds->ds_current != dn->dn_previous);
+  }
+
+  if(rate_due_katcp(ns, changed || (sn->s_status != ns->n_status)) == 0){
+    return 0;
+  }
+
+  dn->dn_previous = ds->ds_current;
+
+  return 1;
+}
+
 int set_double_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a, double value)
 {
   int result;
@@ -692,11 +755,7 @@ int create_acquire_discrete_katcp(struct katcp_dispatch *d, struct katcp_acquire
     return -1;
   }
 
-  da = malloc(sizeof(struct katcp_discrete_acquire));
-  if(da == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes for acquire structure", sizeof(struct katcp_discrete_acquire));
-    return -1;
-  }
+  da = &(a->a_store.a_discrete);
 
   da->da_current = 0;
   da->da_get = NULL;
@@ -729,11 +788,7 @@ int create_nonsense_discrete_katcp(struct katcp_dispatch *d, struct katcp_nonsen
   }
 
   ds = sn->s_more;
-  dn = malloc(sizeof(struct katcp_discrete_nonsense));
-  if(dn == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes for discrete sensor structure", sizeof(struct katcp_discrete_nonsense));
-    return -1;
-  }
+  dn = &(ns->n_store.n_discrete);
 
   dn->dn_previous = ds->ds_current;
   ns->n_more = dn;
@@ -899,8 +954,6 @@ void destroy_sensor_discrete_katcp(struct katcp_dispatch *d, struct katcp_sensor
   ds->ds_vector = NULL;
   ds->ds_size = 0;
 
-  free(ds);
-
   sn->s_more = NULL;
 }
 
@@ -919,16 +972,11 @@ int create_sensor_vector_discrete_katcp(struct katcp_dispatch *d, struct katcp_s
     return -1;
   }
 
-  ds = malloc(sizeof(struct katcp_discrete_sensor));
-  if(ds == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes for discrete sensor structure", sizeof(struct katcp_discrete_sensor));
-    return -1;
-  }
+  ds = &(sn->s_store.s_discrete);
 
   ds->ds_vector = copy_vector_katcm(vector, size);
   if(ds->ds_vector == NULL){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d element vector", size);
-    free(ds);
     return -1;
   }
 
@@ -1000,6 +1048,7 @@ int expand_sensor_discrete_katcp(struct katcp_dispatch *d, struct katcp_sensor *
     ds->ds_vector[position] = copy;
   }
 
+  invalidate_cache_katcp(d->d_shared, KATCP_CACHE_SENSOR_LIST);
   broadcast_inform_katcp(d, KATCP_DEVICE_CHANGED_INFORM, "sensor-list");
 
   return 0;
@@ -1046,6 +1095,33 @@ int event_check_discrete_katcp(struct katcp_nonsense *ns)
   return 1;
 }
 
+int rate_check_discrete_katcp(struct katcp_nonsense *ns)
+{
+  struct katcp_sensor *sn;
+  struct katcp_discrete_sensor *ds;
+  struct katcp_discrete_nonsense *dn;
+
+  sn = ns->n_sensor;
+
+#ifdef DEBUG
+  if((sn == NULL) || (sn->s_type != KATCP_SENSOR_DISCRETE)){
+    fprintf(stderr, "major logic problem: rate discrete check not run on discrete\n");
+    abort();
+  }
+#endif
+
+  ds = sn->s_more;
+  dn = ns->n_more;
+
+  if(rate_due_katcp(ns, (dn->dn_previous != ds->ds_current) || (sn->s_status != ns->n_status)) == 0){
+    return 0;
+  }
+
+  dn->dn_previous = ds->ds_current;
+
+  return 1;
+}
+
 int set_discrete_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a, unsigned value)
 {
   int result;
@@ -1164,11 +1240,7 @@ int create_acquire_intbool_katcp(struct katcp_dispatch *d, struct katcp_acquire
     return -1;
   }
 
-  ia = malloc(sizeof(struct katcp_integer_acquire));
-  if(ia == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes for acquire structure", sizeof(struct katcp_integer_acquire));
-    return -1;
-  }
+  ia = &(a->a_store.a_integer);
 
   ia->ia_current = 0;
   ia->ia_get = NULL;
@@ -1257,11 +1329,7 @@ int create_sensor_integer_katcp(struct katcp_dispatch *d, struct katcp_sensor *s
     return -1;
   }
 
-  is = malloc(sizeof(struct katcp_integer_sensor));
-  if(is == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes for integer sensor structure", sizeof(struct katcp_integer_sensor));
-    return -1;
-  }
+  is = &(sn->s_store.s_integer);
 
   if(nom_min < nom_max){
     is->is_nominal_min = nom_min;
@@ -1314,11 +1382,7 @@ int create_nonsense_intbool_katcp(struct katcp_dispatch *d, struct katcp_nonsens
   }
 
   is = sn->s_more;
-  in = malloc(sizeof(struct katcp_integer_nonsense));
-  if(in == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes for integer sensor structure", sizeof(struct katcp_integer_nonsense));
-    return -1;
-  }
+  in = &(ns->n_store.n_integer);
 
   /* changed as per request from simon to always report initial value for event */
 #if 0
@@ -1479,6 +1543,40 @@ int event_check_intbool_katcp(struct katcp_nonsense *ns)
   return 1;
 }
 
+int rate_check_intbool_katcp(struct katcp_nonsense *ns)
+{
+  struct katcp_sensor *sn;
+  struct katcp_integer_sensor *is;
+  struct katcp_integer_nonsense *in;
+  int changed;
+
+  sn = ns->n_sensor;
+
+#ifdef DEBUG
+  if((sn == NULL) || ((sn->s_type != KATCP_SENSOR_INTEGER) && (sn->s_type != KATCP_SENSOR_BOOLEAN))){
+    fprintf(stderr, "major logic problem: rate intbool check not run on integer or boolean\n");
+    abort();
+  }
+#endif
+
+  is = sn->s_more;
+  in = ns->n_more;
+
+  if(ns->n_deadband){
+    changed = (abs(is->is_current - in->in_previous) >= in->in_delta);
+  } else {
+    changed = (is->is_current != in->in_previous);
+  }
+
+  if(rate_due_katcp(ns, changed || (sn->s_status != ns->n_status)) == 0){
+    return 0;
+  }
+
+  in->in_previous = is->is_current;
+
+  return 1;
+}
+
 /* integer specific logic *********************************************************************/
 
 int diff_check_integer_katcp(struct katcp_nonsense *ns)
@@ -1602,11 +1700,7 @@ int create_sensor_boolean_katcp(struct katcp_dispatch *d, struct katcp_sensor *s
     return -1;
   }
 
-  is = malloc(sizeof(struct katcp_integer_sensor));
-  if(is == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes for boolean sensor structure", sizeof(struct katcp_integer_sensor));
-    return -1;
-  }
+  is = &(sn->s_store.s_integer);
 
   is->is_current = 0;
   is->is_warning_min = 0;
@@ -1648,7 +1742,8 @@ static struct katcp_check_table type_lookup_table[] = {
         &period_check_katcp,
         &event_check_intbool_katcp,
         &diff_check_integer_katcp,
-        &force_check_katcp
+        &force_check_katcp,
+        &rate_check_intbool_katcp
       }
     }, 
   [KATCP_SENSOR_BOOLEAN] = 
@@ -1668,7 +1763,8 @@ static struct katcp_check_table type_lookup_table[] = {
         &period_check_katcp,
         &event_check_intbool_katcp,
          NULL, /* diff is a tautology, same as event */
-        &force_check_katcp
+        &force_check_katcp,
+        &rate_check_intbool_katcp
       }
     }, 
   [KATCP_SENSOR_DISCRETE] = /* currently unimplemented */
@@ -1688,7 +1784,8 @@ static struct katcp_check_table type_lookup_table[] = {
         &period_check_katcp,
         &event_check_discrete_katcp,
          NULL, /* we assume all set members are equally different */
-        &force_check_katcp
+        &force_check_katcp,
+        &rate_check_discrete_katcp
       }
     },
   [KATCP_SENSOR_LRU] = /* currently implemented */
@@ -1730,7 +1827,8 @@ static struct katcp_check_table type_lookup_table[] = {
         &period_check_katcp,
         &event_check_double_katcp,
         &diff_check_double_katcp,
-        &force_check_katcp
+        &force_check_katcp,
+        &rate_check_double_katcp
       }
     }
 #endif 
@@ -1781,6 +1879,17 @@ void destroy_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
   struct katcp_double_acquire *doa;
 #endif
   struct katcp_discrete_acquire *dsa;
+  struct katcp_shared *sh;
+
+  if(a->a_dirty){
+    sh = d->d_shared;
+    for(i = 0; (i < sh->s_stale) && (sh->s_dirty[i] != a); i++);
+    if(i < sh->s_stale){
+      sh->s_stale--;
+      sh->s_dirty[i] = sh->s_dirty[sh->s_stale];
+    }
+    a->a_dirty = 0;
+  }
 
   if(a->a_release){
     (*(a->a_release))(d, a);
@@ -1835,11 +1944,10 @@ void destroy_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
         log_message_katcp(d, KATCP_LEVEL_FATAL, NULL, "destroying unsupported sensor type %d", a->a_type);
         break;
     }
-    free(a->a_more);
     a->a_more = NULL;
   }
 
-  free(a);
+  free_memory_katcp(KATCP_MEMORY_SENSOR, a, sizeof(struct katcp_acquire));
 }
 
 /* create empty, unconnected acquire instance */
@@ -1871,7 +1979,7 @@ static struct katcp_acquire *extended_create_acquire_katcp(struct katcp_dispatch
     return NULL;
   }
 
-  a = malloc(sizeof(struct katcp_acquire));
+  a = malloc_memory_katcp(KATCP_MEMORY_SENSOR, sizeof(struct katcp_acquire));
   if(a == NULL){
     return NULL;
   }
@@ -1896,6 +2004,11 @@ static struct katcp_acquire *extended_create_acquire_katcp(struct katcp_dispatch
 
   a->a_more = NULL; 
 
+  a->a_dirty = 0;
+
+  a->a_stamp.tv_sec = 0;
+  a->a_stamp.tv_usec = 0;
+
   if((*(type_lookup_table[type].c_create_acquire))(d, a, type) < 0){
     destroy_acquire_katcp(d, a);
     return NULL;
@@ -2166,20 +2279,105 @@ static int run_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a,
     a->a_last.tv_usec = now.tv_usec;
   }
 
-  propagate_acquire_katcp(d, a);
+  if(forced){ /* the caller reverts the forced strategy right away */
+    emit_acquire_katcp(d, a);
+  } else {
+    propagate_acquire_katcp(d, a);
+  }
 
   return 0;
 }
 
-int propagate_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
+static struct katcl_parse *latest_update_katcp(struct katcp_dispatch *d)
+{
+  unsigned int size;
+  struct katcl_queue *q;
+
+  /* the update just generated is at the tail of the output queue, unless it has already gone out */
+
+  if(d->d_line == NULL){
+    return NULL;
+  }
+
+  q = d->d_line->l_queue;
+
+  size = size_queue_katcl(q);
+  if(size == 0){
+    return NULL;
+  }
+
+  return copy_parse_katcl(get_index_queue_katcl(q, size - 1));
+}
+
+static int shared_sensor_update_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn, char *name, struct katcl_parse **cache)
+{
+  /* generate the update once per sensor and hand the same message to every client */
+
+  if(*cache){
+    return append_parse_katcp(d, *cache);
+  }
+
+  if(generic_sensor_update_katcp(d, sn, name) < 0){
+    return -1;
+  }
+
+  if(this_flat_katcp(d)){ /* duplex output is not queued on the line */
+    return 0;
+  }
+
+  *cache = latest_update_katcp(d);
+
+  return 0;
+}
+
+static double current_sensor_katcp(struct katcp_sensor *sn)
 {
-  int j, i;
+  struct katcp_integer_sensor *is;
+  struct katcp_discrete_sensor *ds;
+#ifdef KATCP_USE_FLOATS
+  struct katcp_double_sensor *fs;
+#endif
+
+  /* all sensor values fit into a double, good enough to spot a change */
+
+  switch(sn->s_type){
+    case KATCP_SENSOR_INTEGER  :
+    case KATCP_SENSOR_BOOLEAN  :
+      is = sn->s_more;
+      return is ? is->is_current : 0.0;
+    case KATCP_SENSOR_DISCRETE :
+      ds = sn->s_more;
+      return ds ? ds->ds_current : 0.0;
+#ifdef KATCP_USE_FLOATS
+    case KATCP_SENSOR_FLOAT    :
+      fs = sn->s_more;
+      return fs ? fs->ds_current : 0.0;
+#endif
+    default :
+      return 0.0;
+  }
+}
+
+static int emit_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
+{
+  int j, i, previous, tag;
+  struct katcp_shared *s;
   struct katcp_sensor *sn;
   struct katcp_nonsense *ns;
   struct katcp_dispatch *dx;
+  struct katcl_parse *status, *value;
   struct timeval now;
+  double before;
 
-  gettimeofday(&now, NULL);
+  s = d->d_shared;
+
+  if(a->a_stamp.tv_sec){
+    now = a->a_stamp;
+    a->a_stamp.tv_sec = 0;
+    a->a_stamp.tv_usec = 0;
+  } else {
+    gettimeofday(&now, NULL);
+  }
 
   for(j = 0; j < a->a_count; j++){
 
@@ -2193,10 +2391,28 @@ int propagate_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
     }
 #endif
 
+    previous = sn->s_status;
+    before = current_sensor_katcp(sn);
+
     if((*(sn->s_extract))(d, sn) >= 0){ /* got a useful value */
 
+      sn->s_recent.tv_sec = now.tv_sec;
+      sn->s_recent.tv_usec = now.tv_usec;
+
+      if((previous != sn->s_status) || (before != current_sensor_katcp(sn))){
+        s->s_sequence++;
+        sn->s_changed = s->s_sequence;
+      }
+
+      if(sn->s_history){
+        record_history_katcp(sn, &now);
+      }
+
       log_message_katcp(d, KATCP_LEVEL_TRACE | KATCP_LEVEL_LOCAL, NULL, "checking %d clients of %s@%p", sn->s_refs, sn->s_name, sn);
 
+      status = NULL;
+      value = NULL;
+
       for(i = 0; i < sn->s_refs; i++){
         ns = sn->s_nonsense[i];
         sane_nonsense(ns);
@@ -2215,20 +2431,32 @@ int propagate_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
         }
 #endif
 
-        sn->s_recent.tv_sec = now.tv_sec;
-        sn->s_recent.tv_usec = now.tv_usec;
-
         log_message_katcp(d, KATCP_LEVEL_TRACE | KATCP_LEVEL_LOCAL, NULL, "calling check function %p (type %d, strategy %d)", type_lookup_table[sn->s_type].c_checks[ns->n_strategy], sn->s_type, ns->n_strategy);
 
         if(type_lookup_table[sn->s_type].c_checks[ns->n_strategy]){
           
           if((*(type_lookup_table[sn->s_type].c_checks[ns->n_strategy]))(ns)){
             log_message_katcp(d, KATCP_LEVEL_TRACE | KATCP_LEVEL_LOCAL, NULL, "strategy %d reports a match", ns->n_strategy);
-            /* TODO: needs work for having tags in katcp messages */
-            generic_sensor_update_katcp(dx, sn, (ns->n_strategy == KATCP_STRATEGY_FORCED) ? KATCP_SENSOR_VALUE_INFORM : KATCP_SENSOR_STATUS_INFORM);
+            /* subscriptions are asynchronous, never tagged, even if dx is running a tagged request */
+            tag = dx->d_line ? tag_katcl(dx->d_line, -1) : (-1);
+            if(ns->n_strategy == KATCP_STRATEGY_FORCED){
+              shared_sensor_update_katcp(dx, sn, KATCP_SENSOR_VALUE_INFORM, &value);
+            } else {
+              shared_sensor_update_katcp(dx, sn, KATCP_SENSOR_STATUS_INFORM, &status);
+            }
+            if(dx->d_line){
+              tag_katcl(dx->d_line, tag);
+            }
           }
         }
       }
+
+      if(status){
+        destroy_parse_katcl(status);
+      }
+      if(value){
+        destroy_parse_katcl(value);
+      }
     } else {
       log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "extract function for sensor %s failed", sn->s_name);
     }
@@ -2237,6 +2465,69 @@ int propagate_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
   return 0;
 }
 
+/* changes reported within a loop iteration are collected and only the
+ * latest value goes out once the iteration finishes, the strategy checks
+ * run then. Outside the core loop updates are generated immediately */
+
+int propagate_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
+{
+  struct katcp_shared *s;
+  struct katcp_acquire **tmp;
+  unsigned int size;
+
+  s = d->d_shared;
+
+  if((s == NULL) || (s->s_coalesce == 0)){
+    return emit_acquire_katcp(d, a);
+  }
+
+  if(a->a_dirty){
+    return 0; /* already due to go out */
+  }
+
+  if(s->s_stale >= s->s_spots){
+    size = (s->s_spots > 0) ? (s->s_spots * 2) : 16;
+    tmp = realloc(s->s_dirty, sizeof(struct katcp_acquire *) * size);
+    if(tmp == NULL){
+      return emit_acquire_katcp(d, a);
+    }
+    s->s_dirty = tmp;
+    s->s_spots = size;
+  }
+
+  s->s_dirty[s->s_stale] = a;
+  s->s_stale++;
+
+  a->a_dirty = 1;
+
+  return 0;
+}
+
+int flush_acquires_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_shared *s;
+  struct katcp_acquire *a;
+  unsigned int i;
+  int count;
+
+  s = d->d_shared;
+  if(s == NULL){
+    return -1;
+  }
+
+  count = s->s_stale;
+
+  for(i = 0; i < s->s_stale; i++){
+    a = s->s_dirty[i];
+    a->a_dirty = 0;
+    emit_acquire_katcp(d, a);
+  }
+
+  s->s_stale = 0;
+
+  return count;
+}
+
 void *get_local_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
 {
   if(a == NULL){
@@ -2272,33 +2563,151 @@ int is_up_acquire_katcp(struct katcp_dispatch *d, struct katcp_acquire *a)
 
 /*************************************************************************/
 
-static struct katcp_sensor *create_sensor_katcp(struct katcp_dispatch *d, char *name, char *description, char *units, int preferred, int type, int mode, int (*flush)(struct katcp_dispatch *d, struct katcp_sensor *sn))
+/* sensor index: s_sensors is kept sorted for prefix searches, s_index hashes names */
+
+static unsigned int lower_sensor_katcp(struct katcp_shared *s, char *name, unsigned int len)
 {
-  struct katcp_sensor *sn, **tmp;
-  struct katcp_shared *s;
+  unsigned int low, high, mid;
 
-  s = d->d_shared;
+  /* first position at which name (or its first len characters) could appear */
 
-  if(name == NULL){
-#ifdef KATCP_STDERR_ERRORS
-    fprintf(stderr, "sensor: require a sensor name\n");
-#endif
-    return NULL;
-  }
+  low = 0;
+  high = s->s_tally;
 
-  tmp = realloc(s->s_sensors, sizeof(struct katcp_sensor *) * (s->s_tally + 1));
-  if(tmp == NULL){
-#ifdef KATCP_STDERR_ERRORS
-    fprintf(stderr, "sensor: allocation of sensor vector at number %u failed", s->s_tally);
-#endif
-    return NULL;
+  while(low < high){
+    mid = low + ((high - low) / 2);
+    if(strncmp(s->s_sensors[mid]->s_name, name, len) < 0){
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
   }
-  s->s_sensors = tmp;
 
-  sn = malloc(sizeof(struct katcp_sensor));
-  if(sn == NULL){
-#ifdef KATCP_STDERR_ERRORS
-    fprintf(stderr, "sensor: unable to allocate sensor number %u", s->s_tally);
+  return low;
+}
+
+static int rehash_sensors_katcp(struct katcp_shared *s, unsigned int bins)
+{
+  struct katcp_sensor **table, *sn;
+  unsigned int i, h;
+
+  table = malloc_memory_katcp(KATCP_MEMORY_SENSOR, sizeof(struct katcp_sensor *) * bins);
+  if(table == NULL){
+    return -1;
+  }
+
+  for(i = 0; i < bins; i++){
+    table[i] = NULL;
+  }
+
+  /* insert in reverse so that duplicate names stay in sorted order within a bin */
+  for(i = s->s_tally; i > 0; i--){
+    sn = s->s_sensors[i - 1];
+    h = hash_interned_katcm(sn->s_name) & (bins - 1);
+    sn->s_chain = table[h];
+    table[h] = sn;
+  }
+
+  if(s->s_index){
+    free_memory_katcp(KATCP_MEMORY_SENSOR, s->s_index, sizeof(struct katcp_sensor *) * s->s_bins);
+  }
+
+  s->s_index = table;
+  s->s_bins = bins;
+
+  return 0;
+}
+
+static int insert_sensor_katcp(struct katcp_shared *s, struct katcp_sensor *sn)
+{
+  struct katcp_sensor **prv;
+  unsigned int i, h;
+
+  /* caller has made space in s_sensors, go after sensors of the same name */
+  for(i = lower_sensor_katcp(s, sn->s_name, UINT_MAX); (i < s->s_tally) && (s->s_sensors[i]->s_name == sn->s_name); i++);
+
+  memmove(&(s->s_sensors[i + 1]), &(s->s_sensors[i]), sizeof(struct katcp_sensor *) * (s->s_tally - i));
+  s->s_sensors[i] = sn;
+  s->s_tally++;
+
+  if(s->s_tally > s->s_bins){
+    if(rehash_sensors_katcp(s, (s->s_bins > 0) ? (s->s_bins * 2) : SENSOR_BINS) == 0){
+      return 0;
+    }
+    if(s->s_index == NULL){
+      s->s_tally--;
+      memmove(&(s->s_sensors[i]), &(s->s_sensors[i + 1]), sizeof(struct katcp_sensor *) * (s->s_tally - i));
+      return -1;
+    }
+    /* failure to grow only makes chains longer */
+  }
+
+  h = hash_interned_katcm(sn->s_name) & (s->s_bins - 1);
+  for(prv = &(s->s_index[h]); *prv && ((*prv)->s_name != sn->s_name); prv = &((*prv)->s_chain));
+  for(; *prv && ((*prv)->s_name == sn->s_name); prv = &((*prv)->s_chain));
+
+  sn->s_chain = *prv;
+  *prv = sn;
+
+  return 0;
+}
+
+static void remove_sensor_katcp(struct katcp_shared *s, struct katcp_sensor *sn)
+{
+  struct katcp_sensor **prv;
+  unsigned int i;
+
+  if(sn->s_name == NULL){
+    return; /* never got inserted */
+  }
+
+  for(i = lower_sensor_katcp(s, sn->s_name, UINT_MAX); (i < s->s_tally) && (s->s_sensors[i] != sn); i++);
+  if(i >= s->s_tally){
+    return;
+  }
+
+  s->s_tally--;
+  memmove(&(s->s_sensors[i]), &(s->s_sensors[i + 1]), sizeof(struct katcp_sensor *) * (s->s_tally - i));
+
+  if(s->s_index){
+    for(prv = &(s->s_index[hash_interned_katcm(sn->s_name) & (s->s_bins - 1)]); *prv; prv = &((*prv)->s_chain)){
+      if(*prv == sn){
+        *prv = sn->s_chain;
+        break;
+      }
+    }
+  }
+
+  sn->s_chain = NULL;
+}
+
+static struct katcp_sensor *create_sensor_katcp(struct katcp_dispatch *d, char *name, char *description, char *units, int preferred, int type, int mode, int (*flush)(struct katcp_dispatch *d, struct katcp_sensor *sn))
+{
+  struct katcp_sensor *sn, **tmp;
+  struct katcp_shared *s;
+
+  s = d->d_shared;
+
+  if(name == NULL){
+#ifdef KATCP_STDERR_ERRORS
+    fprintf(stderr, "sensor: require a sensor name\n");
+#endif
+    return NULL;
+  }
+
+  tmp = realloc(s->s_sensors, sizeof(struct katcp_sensor *) * (s->s_tally + 1));
+  if(tmp == NULL){
+#ifdef KATCP_STDERR_ERRORS
+    fprintf(stderr, "sensor: allocation of sensor vector at number %u failed", s->s_tally);
+#endif
+    return NULL;
+  }
+  s->s_sensors = tmp;
+
+  sn = malloc_memory_katcp(KATCP_MEMORY_SENSOR, sizeof(struct katcp_sensor));
+  if(sn == NULL){
+#ifdef KATCP_STDERR_ERRORS
+    fprintf(stderr, "sensor: unable to allocate sensor number %u", s->s_tally);
 #endif
     return NULL;
   }
@@ -2325,10 +2734,15 @@ static struct katcp_sensor *create_sensor_katcp(struct katcp_dispatch *d, char *
   sn->s_extract = NULL;
   sn->s_flush   = flush;
 
-  s->s_sensors[s->s_tally] = sn;
-  s->s_tally++;
+  sn->s_more = NULL;
+  sn->s_chain = NULL;
+  sn->s_history = NULL;
 
-  sn->s_name = strdup(name);
+  /* a new sensor counts as a change */
+  s->s_sequence++;
+  sn->s_changed = s->s_sequence;
+
+  sn->s_name = intern_name_katcm(name);
   if(sn->s_name == NULL){
 #ifdef KATCP_STDERR_ERRORS
     fprintf(stderr, "sensor: unable to duplicate name %s", name);
@@ -2337,8 +2751,15 @@ static struct katcp_sensor *create_sensor_katcp(struct katcp_dispatch *d, char *
     return NULL;
   }
 
+  if(insert_sensor_katcp(s, sn) < 0){
+    release_name_katcm(sn->s_name);
+    sn->s_name = NULL;
+    destroy_sensor_katcp(d, sn);
+    return NULL;
+  }
+
   if(description){
-    sn->s_description = strdup(description);
+    sn->s_description = strdup_memory_katcp(KATCP_MEMORY_SENSOR, description);
     if(sn->s_description == NULL){
 #ifdef KATCP_STDERR_ERRORS
     fprintf(stderr, "sensor: unable to duplicate sensor description \"%s\"", description);
@@ -2348,7 +2769,7 @@ static struct katcp_sensor *create_sensor_katcp(struct katcp_dispatch *d, char *
     }
   }
   if(units){
-    sn->s_units = strdup(units);
+    sn->s_units = strdup_memory_katcp(KATCP_MEMORY_SENSOR, units);
     if(sn->s_units == NULL){
 #ifdef KATCP_STDERR_ERRORS
     fprintf(stderr, "sensor: unable to duplicate senor units field %s", units);
@@ -2358,6 +2779,7 @@ static struct katcp_sensor *create_sensor_katcp(struct katcp_dispatch *d, char *
     }
   }
 
+  invalidate_cache_katcp(d->d_shared, KATCP_CACHE_SENSOR_LIST);
   broadcast_inform_katcp(d, KATCP_DEVICE_CHANGED_INFORM, "sensor-list");
 
   return sn;
@@ -2366,7 +2788,6 @@ static struct katcp_sensor *create_sensor_katcp(struct katcp_dispatch *d, char *
 static void destroy_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn)
 {
   struct katcp_shared *s;
-  int i;
 
   if(sn == NULL){
     return;
@@ -2392,33 +2813,28 @@ static void destroy_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor *
   /* remove timer */
   del_acquire_katcp(d, sn);
 
+  destroy_history_katcp(sn);
+
   /* remove sensor from shared */
-  i = 0;
-  while(i < s->s_tally){
-    if(s->s_sensors[i] == sn){
-      s->s_tally--;
-      if(i < s->s_tally){
-        s->s_sensors[i] = s->s_sensors[s->s_tally];
-      }
-    } else {
-      i++;
-    }
-  }
+  remove_sensor_katcp(s, sn);
+  invalidate_cache_katcp(s, KATCP_CACHE_SENSOR_LIST);
   if(s->s_tally <= 0){
     if(s->s_sensors){
       free(s->s_sensors);
       s->s_sensors = NULL;
     }
+    if(s->s_index){
+      free_memory_katcp(KATCP_MEMORY_SENSOR, s->s_index, sizeof(struct katcp_sensor *) * s->s_bins);
+      s->s_index = NULL;
+    }
+    s->s_bins = 0;
   }
 
   if((sn->s_type >= 0) && (sn->s_type < KATCP_SENSORS_COUNT)){
     if(type_lookup_table[sn->s_type].c_destroy_sensor){
       (*(type_lookup_table[sn->s_type].c_destroy_sensor))(d, sn);
     } else {
-      if(sn->s_more){
-        free(sn->s_more);
-        sn->s_more = NULL;
-      }
+      sn->s_more = NULL;
     }
   }
 
@@ -2426,19 +2842,19 @@ static void destroy_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor *
   sn->s_type = KATCP_SENSOR_INVALID;
 
   if(sn->s_name){
-    free(sn->s_name);
+    release_name_katcm(sn->s_name);
     sn->s_name = NULL;
   }
   if(sn->s_description){
-    free(sn->s_description);
+    free_string_memory_katcp(KATCP_MEMORY_SENSOR, sn->s_description);
     sn->s_description = NULL;
   }
   if(sn->s_units){
-    free(sn->s_units);
+    free_string_memory_katcp(KATCP_MEMORY_SENSOR, sn->s_units);
     sn->s_units = NULL;
   }
 
-  free(sn);
+  free_memory_katcp(KATCP_MEMORY_SENSOR, sn, sizeof(struct katcp_sensor));
 }
 
 static int reload_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor *sz)
@@ -2488,6 +2904,7 @@ static int reload_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor *sz
             if(polling == 0){
               break;
             } /* WARNING */
+          case KATCP_STRATEGY_RATE : /* sampled even without polling, for held back changes and heartbeats */
           case KATCP_STRATEGY_PERIOD   :
             if(periodics){
               if(cmp_time_katcp(&(a->a_current), &(ns->n_period)) > 0){
@@ -2530,12 +2947,13 @@ static int reload_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor *sz
     /* WARNING: complicated: test above checks that no timer is run, and if we have nonzero users which are not forced, then notify on change (pew) */
     if(a->a_users > forced){
       log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "acquire has %d users which are not forced as well as no periodic ones", a->a_users - forced);
-      propagate_acquire_katcp(d, a);
+      emit_acquire_katcp(d, a); /* the new subscriber wants its first value now */
     }
 
   } else { /* we need timers, replace old with new if necessary */
     a->a_periodics = periodics;
-    if(register_every_tv_katcp(d, &(a->a_current), &run_timer_acquire_katcp, a) < 0){
+    /* aligned, so that acquires sampled at the same rate run in the same pass and their updates go out together */
+    if(register_tick_tv_katcp(d, &(a->a_current), &run_timer_acquire_katcp, a) < 0){
       return -1;
     }
   }
@@ -2569,14 +2987,16 @@ static struct katcp_nonsense *match_nonsense_katcp(struct katcp_dispatch *d, str
   int i;
   struct katcp_nonsense *ns;
 
-  for(i = 0; i < d->d_size; i++){
-    ns = d->d_nonsense[i];
+  /* a sensor has few clients, a client may have many sensors, so search the sensor */
+
+  for(i = 0; i < sn->s_refs; i++){
+    ns = sn->s_nonsense[i];
     if(ns == NULL){
       fprintf(stderr, "nonsense: major logic failure - nonsensor entry is empty\n");
       abort();
     }
 
-    if(ns->n_sensor == sn){
+    if(ns->n_client == d){
       return ns;
     }
   }
@@ -2588,22 +3008,27 @@ struct katcp_sensor *find_sensor_katcp(struct katcp_dispatch *d, char *name)
 {
   struct katcp_shared *s;
   struct katcp_sensor *sn;
-  int i;
+  char *key;
 
   s = d->d_shared;
   if(s == NULL){
     abort();
   }
 
-  for(i = 0; i < s->s_tally; i++){
-    sn = s->s_sensors[i];
-    sane_sensor(sn);
+  if(s->s_index == NULL){
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "no sensors to match %s", name);
+    return NULL;
+  }
 
-    if(sn == NULL){
-      abort();
-    }
+  key = find_name_katcm(name);
+  if(key == NULL){ /* nothing anywhere has this name */
+    return NULL;
+  }
 
-    if(!strcmp(sn->s_name, name)){
+  for(sn = s->s_index[hash_interned_katcm(key) & (s->s_bins - 1)]; sn; sn = sn->s_chain){
+    sane_sensor(sn);
+
+    if(sn->s_name == key){
       if(sn->s_mode && (s->s_mode != sn->s_mode)){
         log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "sensor %s not available in current mode", name);
       } else {
@@ -2636,7 +3061,7 @@ void destroy_sensors_katcp(struct katcp_dispatch *d)
   s = d->d_shared;
 
   while(s->s_tally){
-    destroy_sensor_katcp(d, s->s_sensors[0]);
+    destroy_sensor_katcp(d, s->s_sensors[s->s_tally - 1]);
   }
 
 #ifdef DEBUG
@@ -2680,7 +3105,7 @@ static struct katcp_nonsense *create_nonsense_katcp(struct katcp_dispatch *d, st
   }
   sn->s_nonsense = tmp;
 
-  ns = malloc(sizeof(struct katcp_nonsense));
+  ns = malloc_memory_katcp(KATCP_MEMORY_SENSOR, sizeof(struct katcp_nonsense));
   if(ns == NULL){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate client state for sensor %s", sn->s_name);
     return NULL;
@@ -2711,12 +3136,18 @@ static struct katcp_nonsense *create_nonsense_katcp(struct katcp_dispatch *d, st
 
   ns->n_manual = 1;
 
+  ns->n_shortest.tv_sec = 0;
+  ns->n_shortest.tv_usec = 0;
+  ns->n_longest.tv_sec = 0;
+  ns->n_longest.tv_usec = 0;
+  ns->n_deadband = 0;
+
   ns->n_more = NULL;
 
   result = (*(type_lookup_table[sn->s_type].c_create_nonsense))(d, ns);
   if(result < 0){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate client type state for sensor %s", sn->s_name);
-    free(ns); /* WARNING: bit iffy */
+    free_memory_katcp(KATCP_MEMORY_SENSOR, ns, sizeof(struct katcp_nonsense)); /* WARNING: bit iffy */
     return NULL;
   }
 
@@ -2735,9 +3166,15 @@ static struct katcp_nonsense *find_nonsense_katcp(struct katcp_dispatch *d, char
   struct katcp_sensor *sn;
   struct katcp_nonsense *ns;
   struct katcp_shared *s;
+  char *key;
 
   s = d->d_shared;
 
+  key = find_name_katcm(name);
+  if(key == NULL){
+    return NULL;
+  }
+
   for(i = 0; i < d->d_size; i++){
     ns = d->d_nonsense[i];
     sane_nonsense(ns);
@@ -2751,7 +3188,7 @@ static struct katcp_nonsense *find_nonsense_katcp(struct katcp_dispatch *d, char
       abort();
     }
 
-    if(!strcmp(sn->s_name, name)){
+    if(sn->s_name == key){
       if(sn->s_mode && (s->s_mode != sn->s_mode)){
         log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "sensor %s not available in current mode", name);
       } else {
@@ -2818,12 +3255,9 @@ static void destroy_nonsense_katcp(struct katcp_dispatch *d, struct katcp_nonsen
     }
   }
 
-  /* MAYBE have a function to clean out type specific stuff */
-  if(ns->n_more){
-    free(ns->n_more);
-  }
+  ns->n_more = NULL;
 
-  free(ns);
+  free_memory_katcp(KATCP_MEMORY_SENSOR, ns, sizeof(struct katcp_nonsense));
 }
 
 void destroy_nonsensors_katcp(struct katcp_dispatch *d)
@@ -3071,7 +3505,7 @@ int register_discrete_sensor_katcp(struct katcp_dispatch *d, int mode, char *nam
 
 /* strategy information *********************************************/
 
-static char *sensor_strategy_table[KATCP_STRATEGIES_COUNT] = { "none", "period", "event", "differential", "forced" };
+static char *sensor_strategy_table[KATCP_STRATEGIES_COUNT] = { "none", "period", "event", "differential", "forced", "event-rate" };
 
 char *strategy_name_sensor_katcp(struct katcp_nonsense *ns)
 {
@@ -3216,6 +3650,304 @@ int generic_sensor_update_katcp(struct katcp_dispatch *d, struct katcp_sensor *s
   return append_sensor_value_katcp(d, KATCP_FLAG_LAST, sn);
 }
 
+/* sensor history *****************************************************/
+
+/* a sensor may keep a ring of its recent changes. Entries are packed:
+ * seconds, microseconds, status, and then the value, which is an int
+ * (the position for discrete sensors) or a double. An entry is only
+ * added if status or value differ from the previous one */
+
+#define HISTORY_SECONDS   0
+#define HISTORY_MICROS    4
+#define HISTORY_STATUS    8
+#define HISTORY_VALUE     9
+
+static unsigned int width_history_katcp(int type)
+{
+  switch(type){
+    case KATCP_SENSOR_INTEGER  :
+    case KATCP_SENSOR_BOOLEAN  :
+    case KATCP_SENSOR_DISCRETE :
+      return HISTORY_VALUE + sizeof(int);
+#ifdef KATCP_USE_FLOATS
+    case KATCP_SENSOR_FLOAT    :
+      return HISTORY_VALUE + sizeof(double);
+#endif
+    default :
+      return 0;
+  }
+}
+
+static void destroy_history_katcp(struct katcp_sensor *sn)
+{
+  struct katcp_history *h;
+
+  h = sn->s_history;
+  if(h == NULL){
+    return;
+  }
+
+  if(h->h_buffer){
+    free_memory_katcp(KATCP_MEMORY_SENSOR, h->h_buffer, h->h_width * h->h_size);
+    h->h_buffer = NULL;
+  }
+
+  free_memory_katcp(KATCP_MEMORY_SENSOR, h, sizeof(struct katcp_history));
+
+  sn->s_history = NULL;
+}
+
+int history_sensor_katcp(struct katcp_dispatch *d, char *name, unsigned int size)
+{
+  struct katcp_sensor *sn;
+  struct katcp_history *h;
+  unsigned int width;
+
+  sn = find_sensor_katcp(d, name);
+  if(sn == NULL){
+    return -1;
+  }
+
+  /* a resize starts afresh, size zero turns history off */
+  destroy_history_katcp(sn);
+
+  if(size == 0){
+    return 0;
+  }
+
+  width = width_history_katcp(sn->s_type);
+  if(width == 0){
+    return -1;
+  }
+
+  h = malloc_memory_katcp(KATCP_MEMORY_SENSOR, sizeof(struct katcp_history));
+  if(h == NULL){
+    return -1;
+  }
+
+  h->h_buffer = malloc_memory_katcp(KATCP_MEMORY_SENSOR, width * size);
+  if(h->h_buffer == NULL){
+    free_memory_katcp(KATCP_MEMORY_SENSOR, h, sizeof(struct katcp_history));
+    return -1;
+  }
+
+  h->h_width = width;
+  h->h_size = size;
+  h->h_count = 0;
+  h->h_next = 0;
+
+  sn->s_history = h;
+
+  return 0;
+}
+
+static void record_history_katcp(struct katcp_sensor *sn, struct timeval *tv)
+{
+  struct katcp_history *h;
+  struct katcp_integer_sensor *is;
+  struct katcp_discrete_sensor *ds;
+#ifdef KATCP_USE_FLOATS
+  struct katcp_double_sensor *fs;
+#endif
+  unsigned char entry[HISTORY_VALUE + sizeof(double)];
+  unsigned char *last;
+  uint32_t field;
+
+  h = sn->s_history;
+
+  switch(sn->s_type){
+    case KATCP_SENSOR_INTEGER  :
+    case KATCP_SENSOR_BOOLEAN  :
+      is = sn->s_more;
+      memcpy(entry + HISTORY_VALUE, &(is->is_current), sizeof(int));
+      break;
+    case KATCP_SENSOR_DISCRETE :
+      ds = sn->s_more;
+      memcpy(entry + HISTORY_VALUE, &(ds->ds_current), sizeof(int));
+      break;
+#ifdef KATCP_USE_FLOATS
+    case KATCP_SENSOR_FLOAT    :
+      fs = sn->s_more;
+      memcpy(entry + HISTORY_VALUE, &(fs->ds_current), sizeof(double));
+      break;
+#endif
+    default :
+      return;
+  }
+
+  entry[HISTORY_STATUS] = sn->s_status;
+
+  if(h->h_count > 0){
+    last = h->h_buffer + (((h->h_next + h->h_size - 1) % h->h_size) * h->h_width);
+    if(memcmp(last + HISTORY_STATUS, entry + HISTORY_STATUS, h->h_width - HISTORY_STATUS) == 0){
+      return;
+    }
+  }
+
+  field = tv->tv_sec;
+  memcpy(entry + HISTORY_SECONDS, &field, sizeof(uint32_t));
+  field = tv->tv_usec;
+  memcpy(entry + HISTORY_MICROS, &field, sizeof(uint32_t));
+
+  memcpy(h->h_buffer + (h->h_next * h->h_width), entry, h->h_width);
+
+  h->h_next = (h->h_next + 1) % h->h_size;
+  if(h->h_count < h->h_size){
+    h->h_count++;
+  }
+}
+
+static unsigned char *entry_history_katcp(struct katcp_history *h, unsigned int index, struct timeval *tv)
+{
+  unsigned char *entry;
+  uint32_t field;
+
+  /* index zero is the oldest entry */
+  entry = h->h_buffer + (((h->h_next + h->h_size - h->h_count + index) % h->h_size) * h->h_width);
+
+  memcpy(&field, entry + HISTORY_SECONDS, sizeof(uint32_t));
+  tv->tv_sec = field;
+  memcpy(&field, entry + HISTORY_MICROS, sizeof(uint32_t));
+  tv->tv_usec = field;
+
+  return entry;
+}
+
+static int print_history_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn, unsigned char *entry, struct timeval *tv)
+{
+  struct katcp_discrete_sensor *ds;
+  unsigned int status;
+  int value;
+#ifdef KATCP_USE_FLOATS
+  double real;
+#endif
+
+  status = entry[HISTORY_STATUS];
+  if(status >= KATCP_STATA_COUNT){
+    return -1;
+  }
+
+  prepend_inform_katcp(d);
+
+#if KATCP_PROTOCOL_MAJOR_VERSION >= 5
+  append_args_katcp(d, 0, "%lu.%03lu", tv->tv_sec, tv->tv_usec / 1000);
+#else 
+  append_args_katcp(d, 0, "%lu%03lu", tv->tv_sec, tv->tv_usec / 1000);
+#endif
+
+  append_string_katcp(d, KATCP_FLAG_STRING, "1");
+  append_string_katcp(d, KATCP_FLAG_STRING, sn->s_name);
+  append_string_katcp(d, KATCP_FLAG_STRING, sensor_status_table[status]);
+
+  switch(sn->s_type){
+    case KATCP_SENSOR_INTEGER  :
+    case KATCP_SENSOR_BOOLEAN  :
+      memcpy(&value, entry + HISTORY_VALUE, sizeof(int));
+      return append_signed_long_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_SLONG, value);
+    case KATCP_SENSOR_DISCRETE :
+      ds = sn->s_more;
+      memcpy(&value, entry + HISTORY_VALUE, sizeof(int));
+      if((value < 0) || (value >= ds->ds_size)){
+        return append_string_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "unknown");
+      }
+      return append_string_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_STRING, ds->ds_vector[value]);
+#ifdef KATCP_USE_FLOATS
+    case KATCP_SENSOR_FLOAT    :
+      memcpy(&real, entry + HISTORY_VALUE, sizeof(double));
+      return append_double_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_DOUBLE, real);
+#endif
+    default :
+      return append_string_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "unknown");
+  }
+}
+
+int sensor_history_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_sensor *sn;
+  struct katcp_history *h;
+  struct timeval start, end, tv;
+  unsigned char *entry;
+  unsigned int i, first, matched, limit, count;
+  char *name;
+
+  name = arg_string_katcp(d, 1);
+  if(name == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a sensor name");
+    return extra_response_katcp(d, KATCP_RESULT_INVALID, "sensor");
+  }
+
+  sn = find_sensor_katcp(d, name);
+  if(sn == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no sensor of name %s", name);
+    return extra_response_katcp(d, KATCP_RESULT_INVALID, "sensor");
+  }
+
+  h = sn->s_history;
+  if(h == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "sensor %s keeps no history", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  start.tv_sec = 0;
+  start.tv_usec = 0;
+
+  if(argc > 2){
+    if(string_to_tv_katcp(&start, arg_string_katcp(d, 2)) < 0){
+      return extra_response_katcp(d, KATCP_RESULT_INVALID, "start");
+    }
+  }
+
+  if(argc > 3){
+    if(string_to_tv_katcp(&end, arg_string_katcp(d, 3)) < 0){
+      return extra_response_katcp(d, KATCP_RESULT_INVALID, "end");
+    }
+  } else {
+    end.tv_sec = UINT32_MAX;
+    end.tv_usec = 0;
+  }
+
+  limit = (argc > 4) ? arg_unsigned_long_katcp(d, 4) : h->h_count;
+
+  /* entries are in time order, find the range, then keep the latest few */
+
+  first = 0;
+  while(first < h->h_count){
+    entry_history_katcp(h, first, &tv);
+    if(cmp_time_katcp(&tv, &start) >= 0){
+      break;
+    }
+    first++;
+  }
+
+  matched = 0;
+  while((first + matched) < h->h_count){
+    entry_history_katcp(h, first + matched, &tv);
+    if(cmp_time_katcp(&tv, &end) > 0){
+      break;
+    }
+    matched++;
+  }
+
+  if(matched > limit){
+    first += matched - limit;
+    matched = limit;
+  }
+
+  count = 0;
+  for(i = 0; i < matched; i++){
+    entry = entry_history_katcp(h, first + i, &tv);
+    if(print_history_katcp(d, sn, entry, &tv) >= 0){
+      count++;
+    }
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_ULONG, count);
+
+  return KATCP_RESULT_OWN;
+}
+
 int force_acquire_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn)
 {
   struct katcp_nonsense *ns;
@@ -3240,25 +3972,124 @@ int force_acquire_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn)
     ns->n_strategy = old;
   } else {
 
-    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "enabling offline sensor %s temporarily", sn->s_name);
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "enabling offline sensor %s temporarily", sn->s_name);
+
+    if(configure_sensor_katcp(d, sn, KATCP_STRATEGY_FORCED, 1, 0, NULL) < 0){
+      result = (-1);
+    } else {
+      result = run_acquire_katcp(d, a, 1);
+      configure_sensor_katcp(d, sn, KATCP_STRATEGY_OFF, 1, 0, NULL);
+    }
+  }
+
+  return result;
+}
+
+/* name queries: a prefix, or a /regex/ as per the sensor-list spec. Both
+ * only visit the range of the sorted sensor vector sharing the prefix,
+ * for a regex that is the literal part following a leading ^ */
+
+struct katcp_sensor_query{
+  char *q_prefix;
+  unsigned int q_length;
+  int q_regex;
+  regex_t q_compiled;
+  char *q_pattern;
+};
+
+static int start_query_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor_query *q, char *name)
+{
+  struct katcp_shared *s;
+  unsigned int len, i;
+  int result;
+
+  s = d->d_shared;
+
+  q->q_prefix = "";
+  q->q_length = 0;
+  q->q_regex = 0;
+  q->q_pattern = NULL;
+
+  if(name == NULL){
+    return 0;
+  }
+
+  len = strlen(name);
+
+  if((len < 2) || (name[0] != '/') || (name[len - 1] != '/')){
+    q->q_prefix = name;
+    q->q_length = len;
+    return lower_sensor_katcp(s, name, len);
+  }
+
+  q->q_pattern = malloc(len - 1);
+  if(q->q_pattern == NULL){
+    return -1;
+  }
+
+  memcpy(q->q_pattern, name + 1, len - 2);
+  q->q_pattern[len - 2] = '\0';
+
+  result = regcomp(&(q->q_compiled), q->q_pattern, REG_EXTENDED | REG_NOSUB);
+  if(result != 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to compile sensor expression %s", name);
+    free(q->q_pattern);
+    q->q_pattern = NULL;
+    return -1;
+  }
+
+  q->q_regex = 1;
+
+  if((q->q_pattern[0] == '^') && (strchr(q->q_pattern, '|') == NULL)){
+    for(i = 1; q->q_pattern[i] && (strchr(".[]()*+?{}^$\\", q->q_pattern[i]) == NULL); i++);
+    if((i > 1) && q->q_pattern[i] && strchr("*?{", q->q_pattern[i])){
+      i--; /* the quantifier makes the last literal optional */
+    }
+    q->q_prefix = q->q_pattern + 1;
+    q->q_length = i - 1;
+  }
+
+  return lower_sensor_katcp(s, q->q_prefix, q->q_length);
+}
+
+static int next_query_sensor_katcp(struct katcp_shared *s, struct katcp_sensor_query *q, int i)
+{
+  struct katcp_sensor *sn;
 
-    if(configure_sensor_katcp(d, sn, KATCP_STRATEGY_FORCED, 1, NULL) < 0){
-      result = (-1);
-    } else {
-      result = run_acquire_katcp(d, a, 1);
-      configure_sensor_katcp(d, sn, KATCP_STRATEGY_OFF, 1, NULL);
+  for(; i < s->s_tally; i++){
+    sn = s->s_sensors[i];
+    if(strncmp(q->q_prefix, sn->s_name, q->q_length)){
+      return -1; /* past the range */
+    }
+    if((q->q_regex == 0) || (regexec(&(q->q_compiled), sn->s_name, 0, NULL, 0) == 0)){
+      return i;
     }
   }
 
-  return result;
+  return -1;
+}
+
+static void stop_query_sensor_katcp(struct katcp_sensor_query *q)
+{
+  if(q->q_regex){
+    regfree(&(q->q_compiled));
+    q->q_regex = 0;
+  }
+
+  if(q->q_pattern){
+    free(q->q_pattern);
+    q->q_pattern = NULL;
+  }
 }
 
 int sensor_value_cmd_katcp(struct katcp_dispatch *d, int argc)
 {
   struct katcp_shared *s;
   struct katcp_sensor *sn;
-  unsigned int count, prefix, i;
+  struct katcp_sensor_query query;
+  unsigned int count;
   char *name;
+  int i;
 
   s = d->d_shared;
 
@@ -3269,22 +4100,22 @@ int sensor_value_cmd_katcp(struct katcp_dispatch *d, int argc)
   count = 0;
 
   name = arg_string_katcp(d, 1);
-  if(name){
-    prefix = strlen(name);
-  } else {
-    prefix = 0;
+
+  i = start_query_sensor_katcp(d, &query, name);
+  if(i < 0){
+    return extra_response_katcp(d, KATCP_RESULT_INVALID, "sensor");
   }
 
-  for(i = 0; i < s->s_tally; i++){
+  for(i = next_query_sensor_katcp(s, &query, i); i >= 0; i = next_query_sensor_katcp(s, &query, i + 1)){
     sn = s->s_sensors[i];
     if((sn->s_mode == 0) || (s->s_mode == sn->s_mode)){
-      if((name == NULL) || (!strncmp(name, sn->s_name, prefix))){
-        force_acquire_katcp(d, sn);
-        count++;
-      } /* else: display mode specific sensors but mark their status unknown ? */
-    }
+      force_acquire_katcp(d, sn);
+      count++;
+    } /* else: display mode specific sensors but mark their status unknown ? */
   } 
 
+  stop_query_sensor_katcp(&query);
+
   if(name && (count == 0)){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no match for %s", name);
     return extra_response_katcp(d, KATCP_RESULT_INVALID, "sensor");
@@ -3297,6 +4128,63 @@ int sensor_value_cmd_katcp(struct katcp_dispatch *d, int argc)
   return KATCP_RESULT_OWN;
 }
 
+/* a client which remembers the sequence number of its previous query
+ * only gets to see sensors which have changed since. Polled sensors
+ * are only sampled while there is a subscriber, so get sampled here */
+
+int sensor_value_since_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_shared *s;
+  struct katcp_sensor *sn;
+  struct katcp_acquire *a;
+  unsigned long since;
+  unsigned int i, count;
+
+  s = d->d_shared;
+
+  if(s == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  since = (argc > 1) ? arg_unsigned_long_katcp(d, 1) : 0;
+
+  for(i = 0; i < s->s_tally; i++){
+    sn = s->s_sensors[i];
+    a = sn->s_acquire;
+    if((a == NULL) || (type_lookup_table[a->a_type].c_has_poll == NULL)){
+      continue;
+    }
+    if(sn->s_mode && (s->s_mode != sn->s_mode)){
+      continue;
+    }
+    if((*(type_lookup_table[a->a_type].c_has_poll))(a)){
+      run_acquire_katcp(d, a, 1);
+    }
+  }
+
+  count = 0;
+
+  for(i = 0; i < s->s_tally; i++){
+    sn = s->s_sensors[i];
+    if(sn->s_changed <= since){
+      continue;
+    }
+    if(sn->s_mode && (s->s_mode != sn->s_mode)){
+      continue;
+    }
+    if(generic_sensor_update_katcp(d, sn, KATCP_SENSOR_VALUE_INFORM) >= 0){
+      count++;
+    }
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, count);
+  append_unsigned_long_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_ULONG, s->s_sequence);
+
+  return KATCP_RESULT_OWN;
+}
+
 int sensor_limit_cmd_katcp(struct katcp_dispatch *d, int argc)
 {
   struct katcp_sensor *sn;
@@ -3320,6 +4208,7 @@ int sensor_limit_cmd_katcp(struct katcp_dispatch *d, int argc)
   }
 
   rtn = (*(sn->s_flush))(d, sn);
+  invalidate_cache_katcp(d->d_shared, KATCP_CACHE_SENSOR_LIST);
 
   return (rtn == 0) ? KATCP_RESULT_OK : KATCP_RESULT_FAIL;
 }
@@ -3372,8 +4261,10 @@ int sensor_list_cmd_katcp(struct katcp_dispatch *d, int argc)
 {
   struct katcp_shared *s;
   struct katcp_sensor *sn;
-  unsigned int count, i, prefix;
+  struct katcp_sensor_query query;
+  unsigned int count;
   char *name;
+  int i, start, result;
 
   s = d->d_shared;
 
@@ -3386,27 +4277,46 @@ int sensor_list_cmd_katcp(struct katcp_dispatch *d, int argc)
     if(name == NULL){
       return KATCP_RESULT_FAIL;
     }
-
-    prefix = strlen(name);
   } else {
     name = NULL;
-    prefix = 0;
   }
 
   count = 0;
+  start = (-1);
 
-  for(i = 0; i < s->s_tally; i++){
+  if(name == NULL){
+    result = serve_cache_katcp(d, KATCP_CACHE_SENSOR_LIST);
+    if(result >= 0){
+      prepend_reply_katcp(d);
+      append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+      append_unsigned_long_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_ULONG, result);
+      return KATCP_RESULT_OWN;
+    }
+    start = start_cache_katcp(d);
+  }
+
+  i = start_query_sensor_katcp(d, &query, name);
+  if(i < 0){
+    return extra_response_katcp(d, KATCP_RESULT_INVALID, "sensor");
+  }
+
+  for(i = next_query_sensor_katcp(s, &query, i); i >= 0; i = next_query_sensor_katcp(s, &query, i + 1)){
     sn = s->s_sensors[i];
     if((sn->s_mode == 0) || (s->s_mode == sn->s_mode)){
-      if(name == NULL || (!strncmp(name, sn->s_name, prefix))){
-        if(inform_sensor_list_katcp(d, sn) < 0){
-          return KATCP_RESULT_FAIL;
-        }
-        count++;
+      if(inform_sensor_list_katcp(d, sn) < 0){
+        stop_query_sensor_katcp(&query);
+        return KATCP_RESULT_FAIL;
       }
+      count++;
     }
   } 
 
+  stop_query_sensor_katcp(&query);
+
+  if(start >= 0){
+    fill_cache_katcp(d, KATCP_CACHE_SENSOR_LIST, start, count);
+  }
+
   if(name && (count == 0)){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown sensor %s", name);
     return extra_response_katcp(d, KATCP_RESULT_INVALID, "sensor");
@@ -3460,7 +4370,7 @@ int append_sensor_diff_katcp(struct katcp_dispatch *d, int flags, struct katcp_n
   struct katcp_sensor *sn;
 
 #ifdef DEBUG
-  if(ns->n_strategy != KATCP_STRATEGY_DIFF){
+  if((ns->n_strategy != KATCP_STRATEGY_DIFF) && (ns->n_strategy != KATCP_STRATEGY_RATE)){
     log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "odd client to be interested in appending differential when not using that strategy");
   }
 #endif
@@ -3491,24 +4401,64 @@ int scan_sensor_diff_katcp(struct katcp_nonsense *ns, char *extra)
   return (*(type_lookup_table[sn->s_type].c_scan_diff))(ns, extra);
 }
 
-static int reply_sensor_sampling_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn)
+/* sampling periods are in seconds from v5, in milliseconds before */
+
+static int scan_period_katcp(struct timeval *tv, char *string)
 {
-  char *strategy;
-  int result, extra;
-#if KATCP_PROTOCOL_MAJOR_VERSION < 5 
+#if KATCP_PROTOCOL_MAJOR_VERSION >= 5 
+  return string_to_tv_katcp(tv, string);
+#else
   unsigned long period;
+  char *end;
+
+  if(string == NULL){
+    return -1;
+  }
+
+  period = strtoul(string, &end, 10);
+  if((end == string) || (*end != '\0')){
+    return -1;
+  }
+
+  tv->tv_sec = period / 1000;
+  tv->tv_usec = (period % 1000) * 1000;
+
+  return 0;
+#endif
+}
+
+static int append_period_katcp(struct katcp_dispatch *d, int flags, struct timeval *tv)
+{
+#if KATCP_PROTOCOL_MAJOR_VERSION >= 5 
+  return append_args_katcp(d, flags | KATCP_FLAG_STRING, "%lu.%06lu", tv->tv_sec, tv->tv_usec);
+#else
+  return append_unsigned_long_katcp(d, flags | KATCP_FLAG_ULONG, (tv->tv_sec * 1000) + (tv->tv_usec / 1000));
 #endif
+}
+
+/* inform set for the per-sensor lines of a bulk query, which carry no ok */
+
+static int reply_sensor_sampling_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn, int inform)
+{
+  char *strategy;
+  int result, extra;
   struct katcp_nonsense *ns;
   extra = 0; /* paranoid tautology */
 
   sane_sensor(sn);
 
-  if(prepend_reply_katcp(d) < 0){
-    return -1;
-  }
+  if(inform){
+    if(prepend_inform_katcp(d) < 0){
+      return -1;
+    }
+  } else {
+    if(prepend_reply_katcp(d) < 0){
+      return -1;
+    }
 
-  if(append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK) < 0){
-    return -1;
+    if(append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK) < 0){
+      return -1;
+    }
   }
 
   if(append_string_katcp(d, KATCP_FLAG_STRING, sn->s_name) < 0){
@@ -3522,6 +4472,7 @@ static int reply_sensor_sampling_katcp(struct katcp_dispatch *d, struct katcp_se
         extra = has_diff_katcp(sn);
         break;
       case KATCP_STRATEGY_PERIOD : 
+      case KATCP_STRATEGY_RATE : 
         extra = 1;
         break;
       default :
@@ -3548,16 +4499,18 @@ static int reply_sensor_sampling_katcp(struct katcp_dispatch *d, struct katcp_se
 #endif
     switch(ns->n_strategy){
       case KATCP_STRATEGY_PERIOD :
-#if KATCP_PROTOCOL_MAJOR_VERSION >= 5 
-        result = append_args_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "%lu.%06lu", ns->n_period.tv_sec, ns->n_period.tv_usec);
-#else
-        period = (ns->n_period.tv_sec * 1000) + (ns->n_period.tv_usec / 1000);
-        result = append_unsigned_long_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_ULONG, period);
-#endif
+        result = append_period_katcp(d, KATCP_FLAG_LAST, &(ns->n_period));
         break;
       case KATCP_STRATEGY_DIFF :
         result = append_sensor_diff_katcp(d, KATCP_FLAG_LAST, ns);
         break;
+      case KATCP_STRATEGY_RATE :
+        append_period_katcp(d, 0, &(ns->n_shortest));
+        result = append_period_katcp(d, ns->n_deadband ? 0 : KATCP_FLAG_LAST, &(ns->n_longest));
+        if(ns->n_deadband){
+          result = append_sensor_diff_katcp(d, KATCP_FLAG_LAST, ns);
+        }
+        break;
       default :
 #ifdef DEBUG
         fprintf(stderr, "sampling: major logic problem: strategy %d should not need extra stuff", ns->n_strategy);
@@ -3570,14 +4523,12 @@ static int reply_sensor_sampling_katcp(struct katcp_dispatch *d, struct katcp_se
   return result;
 }
 
-static int configure_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn, int strategy, int manual, char *extra)
+/* extra holds count strategy parameters */
+
+static int configure_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn, int strategy, int manual, unsigned int count, char **extra)
 {
   struct katcp_nonsense *ns;
   struct katcp_acquire *a;
-#if KATCP_PROTOCOL_MAJOR_VERSION < 5 
-  unsigned long period;
-  char *end;
-#endif
   struct timeval fudge;
 
   if(manual == 0){ /* automatic mode an alias for EVENT */
@@ -3639,18 +4590,11 @@ static int configure_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor
 #endif
         break;
       case KATCP_STRATEGY_PERIOD : 
-        if(extra == NULL){
+        if(count < 1){
           log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "require a period as extra parameter");
           return -1;
         }
-#if KATCP_PROTOCOL_MAJOR_VERSION >= 5 
-        string_to_tv_katcp(&(ns->n_period), extra);
-#else
-        period = strtoul(extra, &end, 10);
-        log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "scan period is %lums", period);
-        ns->n_period.tv_sec = period / 1000;
-        ns->n_period.tv_usec = (period % 1000) * 1000;
-#endif
+        scan_period_katcp(&(ns->n_period), extra[0]);
 
         if(cmp_time_katcp(&(ns->n_period), &(a->a_limit)) < 0){
           fudge.tv_sec = 0;
@@ -3671,17 +4615,69 @@ static int configure_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor
           log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "diff strategy not available for this type");
           return -1;
         }
-        if(extra == NULL){
+        if(count < 1){
           log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "require a delta as extra parameter");
           return -1;
         }
-        if(scan_sensor_diff_katcp(ns, extra) < 0){
-          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to scan delta value %s for sensor %s", extra, sn->s_name);
+        if(scan_sensor_diff_katcp(ns, extra[0]) < 0){
+          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to scan delta value %s for sensor %s", extra[0], sn->s_name);
           return -1;
         }
         ns->n_period.tv_sec = a->a_poll.tv_sec;
         ns->n_period.tv_usec = a->a_poll.tv_usec;
         break;
+      case KATCP_STRATEGY_RATE : 
+        if(count < 2){
+          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "require a shortest and longest period as extra parameters");
+          return -1;
+        }
+        if((scan_period_katcp(&(ns->n_shortest), extra[0]) < 0) || (scan_period_katcp(&(ns->n_longest), extra[1]) < 0)){
+          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to scan periods %s and %s", extra[0], extra[1]);
+          return -1;
+        }
+        if(((ns->n_longest.tv_sec == 0) && (ns->n_longest.tv_usec == 0)) || (cmp_time_katcp(&(ns->n_longest), &(ns->n_shortest)) < 0)){
+          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "longest period %s has to be nonzero and no shorter than %s", extra[1], extra[0]);
+          return -1;
+        }
+
+        ns->n_deadband = 0;
+        if(count > 2){
+          if(!has_diff_katcp(sn)){
+            log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "deadband not available for this type");
+            return -1;
+          }
+          if(scan_sensor_diff_katcp(ns, extra[2]) < 0){
+            log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to scan deadband %s for sensor %s", extra[2], sn->s_name);
+            return -1;
+          }
+          ns->n_deadband = 1;
+        }
+
+        /* sample often enough to release held back changes on time */
+        if(ns->n_shortest.tv_sec || ns->n_shortest.tv_usec){
+          ns->n_period.tv_sec = ns->n_shortest.tv_sec;
+          ns->n_period.tv_usec = ns->n_shortest.tv_usec;
+        } else if((a->a_poll.tv_sec || a->a_poll.tv_usec) && (cmp_time_katcp(&(a->a_poll), &(ns->n_longest)) < 0)){
+          ns->n_period.tv_sec = a->a_poll.tv_sec;
+          ns->n_period.tv_usec = a->a_poll.tv_usec;
+        } else {
+          ns->n_period.tv_sec = ns->n_longest.tv_sec;
+          ns->n_period.tv_usec = ns->n_longest.tv_usec;
+        }
+
+        if(cmp_time_katcp(&(ns->n_period), &(a->a_limit)) < 0){
+          fudge.tv_sec = 0;
+          fudge.tv_usec = SENSOR_LIMIT_FUDGE;
+
+          add_time_katcp(&(ns->n_period), &(a->a_limit), &fudge);
+
+          log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "clamping sample rate for %s to %lu.%06lus", sn->s_name, ns->n_period.tv_sec, ns->n_period.tv_usec);
+        }
+
+        /* no previous update, so the first sample goes out */
+        ns->n_next.tv_sec = 0;
+        ns->n_next.tv_usec = 0;
+        break;
       case KATCP_STRATEGY_FORCED :
         break;
 #ifdef DEBUG
@@ -3702,18 +4698,150 @@ static int configure_sensor_katcp(struct katcp_dispatch *d, struct katcp_sensor
 
   }
 
+  return 0;
+}
+
+static void report_sensor_sampling_katcp(struct katcp_dispatch *d, struct katcp_sensor *sn)
+{
+  struct katcp_acquire *a;
+
+  a = sn->s_acquire;
+
   log_message_katcp(d, sn->s_refs ? KATCP_LEVEL_INFO : KATCP_LEVEL_DEBUG, NULL, "%d clients subscribed to sensor %s", sn->s_refs, sn->s_name);
   if(a->a_periodics > 0){
     log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "sensor %s polled once every %lu.%06lus", sn->s_name, a->a_current.tv_sec, a->a_current.tv_usec);
   }
+}
 
-  return 0;
+/* bulk form: name is a comma separated list or a /regex/. All matching
+ * sensors get the same strategy in a single pass, the reply only carries
+ * a count. Without a strategy each sensor is reported as an inform. A
+ * list is resolved completely before anything is changed */
+
+static int is_bulk_sensor_sampling_katcp(char *name)
+{
+  unsigned int len;
+
+  if(strchr(name, ',')){
+    return 1;
+  }
+
+  len = strlen(name);
+
+  return ((len >= 2) && (name[0] == '/') && (name[len - 1] == '/')) ? 1 : 0;
+}
+
+static int bulk_sensor_sampling_katcp(struct katcp_dispatch *d, char *name, char *strategy, int value, int manual, unsigned int count, char **extra)
+{
+  struct katcp_shared *s;
+  struct katcp_sensor *sn, **vector;
+  struct katcp_sensor_query query;
+  unsigned int done, total, i;
+  char *copy, *ptr;
+  int j, failed;
+
+  s = d->d_shared;
+
+  vector = NULL;
+  total = 0;
+  failed = 0;
+
+  if(name[0] == '/'){
+    j = start_query_sensor_katcp(d, &query, name);
+    if(j < 0){
+      return extra_response_katcp(d, KATCP_RESULT_INVALID, "sensor");
+    }
+
+    vector = malloc(sizeof(struct katcp_sensor *) * (s->s_tally + 1));
+    if(vector == NULL){
+      stop_query_sensor_katcp(&query);
+      return KATCP_RESULT_FAIL;
+    }
+
+    for(j = next_query_sensor_katcp(s, &query, j); j >= 0; j = next_query_sensor_katcp(s, &query, j + 1)){
+      sn = s->s_sensors[j];
+      if((sn->s_mode == 0) || (s->s_mode == sn->s_mode)){
+        vector[total++] = sn;
+      }
+    }
+
+    stop_query_sensor_katcp(&query);
+
+  } else {
+    copy = strdup(name);
+    if(copy == NULL){
+      return KATCP_RESULT_FAIL;
+    }
+
+    for(i = 1, ptr = copy; (ptr = strchr(ptr, ',')) != NULL; ptr++, i++);
+
+    vector = malloc(sizeof(struct katcp_sensor *) * i);
+    if(vector == NULL){
+      free(copy);
+      return KATCP_RESULT_FAIL;
+    }
+
+    for(ptr = strtok(copy, ","); ptr; ptr = strtok(NULL, ",")){
+      sn = find_sensor_katcp(d, ptr);
+      if(sn == NULL){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown sensor %s", ptr);
+        failed = 1;
+      } else {
+        vector[total++] = sn;
+      }
+    }
+
+    free(copy);
+
+    if(failed){
+      free(vector);
+      return KATCP_RESULT_FAIL;
+    }
+  }
+
+  if(total == 0){
+    free(vector);
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no match for %s", name);
+    return extra_response_katcp(d, KATCP_RESULT_INVALID, "sensor");
+  }
+
+  done = 0;
+
+  for(i = 0; i < total; i++){
+    sn = vector[i];
+    if(strategy){
+      if(configure_sensor_katcp(d, sn, value, manual, count, extra) < 0){
+        continue;
+      }
+    } else {
+      reply_sensor_sampling_katcp(d, sn, 1);
+    }
+    done++;
+  }
+
+  free(vector);
+
+  if(done < total){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to configure %u of %u sensors for strategy %s", total - done, total, strategy);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(strategy){
+    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "set strategy %s for %u sensors", strategy, done);
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_ULONG, done);
+
+  return KATCP_RESULT_OWN;
 }
 
 int sensor_sampling_cmd_katcp(struct katcp_dispatch *d, int argc)
 {
   struct katcp_sensor *sn;
-  char *name, *strategy, *extra;
+  char *name, *strategy, *extra[SENSOR_SAMPLING_EXTRA];
+  unsigned int count;
   int value, manual;
 
   if(argc <= 1){
@@ -3726,26 +4854,21 @@ int sensor_sampling_cmd_katcp(struct katcp_dispatch *d, int argc)
   }
 
   strategy = NULL;
-  extra = NULL;
+  count = 0;
   manual = 1;
 
+  value = (-1);
+
   if(argc > 2){
     strategy = arg_string_katcp(d, 2);
-    if(argc > 3){
-      extra = arg_string_katcp(d, 3);
+    for(count = 0; (count < SENSOR_SAMPLING_EXTRA) && ((count + 3) < argc); count++){
+      extra[count] = arg_string_katcp(d, count + 3);
     }
   }
 
-  sn = find_sensor_katcp(d, name);
-  if(sn == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown sensor %s", name);
-    return KATCP_RESULT_FAIL;
-  }
-
   if(strategy){
     if(!strcmp(strategy, "auto")){
       manual = 0;
-      value = (-1);
     } else {
       manual = 1;
       value = strategy_code_sensor_katcp(strategy);
@@ -3754,14 +4877,27 @@ int sensor_sampling_cmd_katcp(struct katcp_dispatch *d, int argc)
         return KATCP_RESULT_FAIL;
       }
     }
+  }
+
+  if(is_bulk_sensor_sampling_katcp(name)){
+    return bulk_sensor_sampling_katcp(d, name, strategy, value, manual, count, extra);
+  }
+
+  sn = find_sensor_katcp(d, name);
+  if(sn == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown sensor %s", name);
+    return KATCP_RESULT_FAIL;
+  }
 
-    if(configure_sensor_katcp(d, sn, value, manual, extra) < 0){
+  if(strategy){
+    if(configure_sensor_katcp(d, sn, value, manual, count, extra) < 0){
       log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to configure sensor %s for strategy %s", name, strategy);
       return KATCP_RESULT_FAIL;
     }
+    report_sensor_sampling_katcp(d, sn);
   }
 
-  if(reply_sensor_sampling_katcp(d, sn) < 0){
+  if(reply_sensor_sampling_katcp(d, sn, 0) < 0){
     return KATCP_RESULT_FAIL;
   }
 
@@ -4264,15 +5400,17 @@ int set_status_group_sensor_katcp(struct katcp_dispatch *d, char *prefix, int st
   len = strlen(prefix);
 
   count = 0;
-  for(i = 0; i < s->s_tally; i++){
+  for(i = lower_sensor_katcp(s, prefix, len); i < s->s_tally; i++){
     sn = s->s_sensors[i];
 
     sane_sensor(sn);
 
-    if(!strncmp(prefix, sn->s_name, len)){
-      sn->s_status = status;
-      count++;
+    if(strncmp(prefix, sn->s_name, len)){
+      break;
     }
+
+    sn->s_status = status;
+    count++;
   }
 
   return count;
@@ -4463,6 +5601,21 @@ int sensor_cmd_katcp(struct katcp_dispatch *d, int argc)
 
     return KATCP_RESULT_OK;
 
+  } else if(!strcmp(name, "history")){
+    label = arg_string_katcp(d, 2);
+
+    if((label == NULL) || (argc < 4)){
+      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "need a sensor name and history size");
+      return KATCP_RESULT_FAIL;
+    }
+
+    if(history_sensor_katcp(d, label, arg_unsigned_long_katcp(d, 3)) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to keep history for sensor %s", label);
+      return KATCP_RESULT_FAIL;
+    }
+
+    return KATCP_RESULT_OK;
+
   } else if(!strcmp(name, "create")){
     label = arg_string_katcp(d, 2);
     type = arg_string_katcp(d, 3);
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 
 #include "katcp.h"
 #include "katcl.h"
@@ -17,6 +18,8 @@
 #define NOTICE_CHANGE_REMOVE  0x04
 #define NOTICE_CHANGE_GONE    0x80
 
+#define NOTICE_BINS             32  /* initial size of name hash, power of two */
+
 /**********************************************************************************/
 
 
@@ -39,6 +42,158 @@ static void sane_notice_katcp(struct katcp_notice *n)
 
 /**********************************************************************************/
 
+/* named notices are kept sorted for prefix queries and hashed for
+ * lookups by name. Anything which may need the attention of run_notices,
+ * a trigger or the loss of a subscriber or reference, puts a notice
+ * onto the due list, so run_notices need not visit every notice. Both
+ * the sorted and the due vectors are sized to hold all notices when a
+ * notice is created, so adding to them never fails */
+
+static unsigned int lower_notice_katcp(struct katcp_shared *s, char *name, unsigned int len)
+{
+  unsigned int low, high, mid;
+
+  low = 0;
+  high = s->s_titled;
+
+  while(low < high){
+    mid = low + ((high - low) / 2);
+    if(strncmp(s->s_titles[mid]->n_name, name, len) < 0){
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  return low;
+}
+
+static int rehash_notices_katcp(struct katcp_shared *s, unsigned int bins)
+{
+  struct katcp_notice **table, *n;
+  unsigned int i, h;
+
+  table = malloc_memory_katcp(KATCP_MEMORY_NOTICE, sizeof(struct katcp_notice *) * bins);
+  if(table == NULL){
+    return -1;
+  }
+
+  for(i = 0; i < bins; i++){
+    table[i] = NULL;
+  }
+
+  for(i = 0; i < s->s_titled; i++){
+    n = s->s_titles[i];
+    h = hash_interned_katcm(n->n_name) & (bins - 1);
+    n->n_chain = table[h];
+    table[h] = n;
+  }
+
+  if(s->s_lookup){
+    free_memory_katcp(KATCP_MEMORY_NOTICE, s->s_lookup, sizeof(struct katcp_notice *) * s->s_lookups);
+  }
+
+  s->s_lookup = table;
+  s->s_lookups = bins;
+
+  return 0;
+}
+
+static void index_notice_katcp(struct katcp_shared *s, struct katcp_notice *n)
+{
+  unsigned int i, h;
+
+  if(n->n_name == NULL){
+    return;
+  }
+
+  i = lower_notice_katcp(s, n->n_name, UINT_MAX);
+  memmove(&(s->s_titles[i + 1]), &(s->s_titles[i]), sizeof(struct katcp_notice *) * (s->s_titled - i));
+  s->s_titles[i] = n;
+  s->s_titled++;
+
+  if(s->s_titled > (s->s_lookups * 2)){
+    if(rehash_notices_katcp(s, s->s_lookups * 2) == 0){
+      return; /* now includes n */
+    }
+    /* failure to grow only makes chains longer */
+  }
+
+  h = hash_interned_katcm(n->n_name) & (s->s_lookups - 1);
+  n->n_chain = s->s_lookup[h];
+  s->s_lookup[h] = n;
+}
+
+static void unindex_notice_katcp(struct katcp_shared *s, struct katcp_notice *n)
+{
+  struct katcp_notice **prv;
+  unsigned int i;
+
+  if(n->n_name == NULL){
+    return;
+  }
+
+  for(i = lower_notice_katcp(s, n->n_name, UINT_MAX); (i < s->s_titled) && (s->s_titles[i] != n); i++);
+  if(i < s->s_titled){
+    s->s_titled--;
+    memmove(&(s->s_titles[i]), &(s->s_titles[i + 1]), sizeof(struct katcp_notice *) * (s->s_titled - i));
+  }
+
+  if(s->s_lookup){
+    for(prv = &(s->s_lookup[hash_interned_katcm(n->n_name) & (s->s_lookups - 1)]); *prv; prv = &((*prv)->n_chain)){
+      if(*prv == n){
+        *prv = n->n_chain;
+        break;
+      }
+    }
+  }
+
+  n->n_chain = NULL;
+}
+
+static void due_notice_katcp(struct katcp_shared *s, struct katcp_notice *n)
+{
+  if(n->n_due){
+    return;
+  }
+
+  s->s_woken[s->s_queued] = n;
+  s->s_queued++;
+
+  n->n_due = 1;
+}
+
+static void forget_notice_katcp(struct katcp_shared *s, struct katcp_notice *n)
+{
+  unsigned int i;
+
+  unindex_notice_katcp(s, n);
+
+  if(n->n_due){
+    for(i = 0; (i < s->s_queued) && (s->s_woken[i] != n); i++);
+    if(i < s->s_queued){
+      s->s_queued--;
+      memmove(&(s->s_woken[i]), &(s->s_woken[i + 1]), sizeof(struct katcp_notice *) * (s->s_queued - i));
+    }
+    n->n_due = 0;
+  }
+
+#ifdef KATCP_CONSISTENCY_CHECKS
+  if((n->n_slot >= s->s_pending) || (s->s_notices[n->n_slot] != n)){
+    fprintf(stderr, "notice: %p not at its position %u of %u\n", n, n->n_slot, s->s_pending);
+    abort();
+  }
+#endif
+
+  s->s_pending--;
+  if(n->n_slot < s->s_pending){
+    s->s_notices[n->n_slot] = s->s_notices[s->s_pending];
+    s->s_notices[n->n_slot]->n_slot = n->n_slot;
+  }
+}
+
+/**********************************************************************************/
+
 static void deallocate_notice_katcp(struct katcp_dispatch *d, struct katcp_notice *n)
 {
   if(n == NULL){
@@ -62,7 +217,7 @@ static void deallocate_notice_katcp(struct katcp_dispatch *d, struct katcp_notic
   }
 
   if(n->n_name){
-    free(n->n_name);
+    release_name_katcm(n->n_name);
     n->n_name = NULL;
   }
 
@@ -84,12 +239,11 @@ static void deallocate_notice_katcp(struct katcp_dispatch *d, struct katcp_notic
 
   n->n_changes = NOTICE_CHANGE_GONE;
 
-  free(n);
+  free_memory_katcp(KATCP_MEMORY_NOTICE, n, sizeof(struct katcp_notice));
 }
 
 static void reap_notice_katcp(struct katcp_dispatch *d, struct katcp_notice *n)
 {
-  int i, k, check;
   struct katcp_shared *s;
 
   if(n == NULL){
@@ -109,38 +263,8 @@ static void reap_notice_katcp(struct katcp_dispatch *d, struct katcp_notice *n)
     return;
   }
 
-  i = 0;
-  check = 0;
-
-  while(i < s->s_pending){
-    if(s->s_notices[i] == n){
-
-      if(check == 0){
-        deallocate_notice_katcp(d, n);
-      }
-
-      s->s_pending--;
-      check++;
-
-      for(k = i; k < s->s_pending; k++){
-        s->s_notices[k] = s->s_notices[k + 1];
-      }
-
-#if 0
-      if(i < s->s_pending){
-        s->s_notices[i] = s->s_notices[s->s_pending];
-      }
-#endif
-      
-    } else {
-      i++;
-    }
-  }
-
-  if(check > 1){
-    log_message_katcp(d, KATCP_LEVEL_FATAL, NULL, "major corruption as notice %p encountered %d times", n, check);
-  }
-
+  forget_notice_katcp(s, n);
+  deallocate_notice_katcp(d, n);
 }
 
 /**********************************************************************************/
@@ -183,6 +307,10 @@ static int notice_compact_notice_katcp(struct katcp_notice *n, struct katcp_disp
     log_message_katcp(d, KATCP_LEVEL_FATAL, NULL, "dispatch %p present multiple times in notice %p", d, n);
   }
 
+  if(check && d->d_shared){
+    due_notice_katcp(d->d_shared, n);
+  }
+
   return check;
 }
 
@@ -279,6 +407,24 @@ void destroy_notices_katcp(struct katcp_dispatch *d)
     free(s->s_notices);
     s->s_notices = NULL;
   }
+
+  if(s->s_titles){
+    free(s->s_titles);
+    s->s_titles = NULL;
+  }
+  s->s_titled = 0;
+
+  if(s->s_lookup){
+    free_memory_katcp(KATCP_MEMORY_NOTICE, s->s_lookup, sizeof(struct katcp_notice *) * s->s_lookups);
+    s->s_lookup = NULL;
+  }
+  s->s_lookups = 0;
+
+  if(s->s_woken){
+    free(s->s_woken);
+    s->s_woken = NULL;
+  }
+  s->s_queued = 0;
 }
 
 /**********************************************************************************/
@@ -319,7 +465,7 @@ struct katcp_notice *create_parse_notice_katcp(struct katcp_dispatch *d, char *n
     }
   }
 
-  n = malloc(sizeof(struct katcp_notice));
+  n = malloc_memory_katcp(KATCP_MEMORY_NOTICE, sizeof(struct katcp_notice));
   if(n == NULL){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes for notice", sizeof(struct katcp_notice));
     return NULL;
@@ -343,6 +489,10 @@ struct katcp_notice *create_parse_notice_katcp(struct katcp_dispatch *d, char *n
 
   n->n_changes = NOTICE_CHANGE_CLEAR;
 
+  n->n_slot = 0;
+  n->n_due = 0;
+  n->n_chain = NULL;
+
 #if 0
   n->n_msg = NULL;
   n->n_target = NULL;
@@ -350,7 +500,7 @@ struct katcp_notice *create_parse_notice_katcp(struct katcp_dispatch *d, char *n
 #endif
 
   if(name){
-    n->n_name = strdup(name);
+    n->n_name = intern_name_katcm(name);
     if(n->n_name == NULL){
       log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to duplicate name %s", name);
       deallocate_notice_katcp(d, n);
@@ -373,6 +523,30 @@ struct katcp_notice *create_parse_notice_katcp(struct katcp_dispatch *d, char *n
   }
   s->s_notices = t;
 
+  t = realloc(s->s_titles, sizeof(struct katcp_notice *) * (s->s_pending + 1));
+  if(t == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to insert notice into index");
+    deallocate_notice_katcp(d, n);
+    return NULL;
+  }
+  s->s_titles = t;
+
+  t = realloc(s->s_woken, sizeof(struct katcp_notice *) * (s->s_pending + 1));
+  if(t == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to extend list of due notices");
+    deallocate_notice_katcp(d, n);
+    return NULL;
+  }
+  s->s_woken = t;
+
+  if(s->s_lookup == NULL){
+    if(rehash_notices_katcp(s, NOTICE_BINS) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate notice hash");
+      deallocate_notice_katcp(d, n);
+      return NULL;
+    }
+  }
+
   /* has to be last - on failure, deallocate notice will destroy p */
   if(p){
     if(add_tail_queue_katcl(n->n_queue, p) < 0){
@@ -382,9 +556,15 @@ struct katcp_notice *create_parse_notice_katcp(struct katcp_dispatch *d, char *n
     n->n_changes |= NOTICE_CHANGE_ADD;
   }
 
+  n->n_slot = s->s_pending;
   s->s_notices[s->s_pending] = n;
   s->s_pending++;
 
+  index_notice_katcp(s, n);
+
+  /* gets collected if nobody subscribes to it */
+  due_notice_katcp(s, n);
+
   return n;
 }
 
@@ -462,6 +642,10 @@ int remove_notice_katcp(struct katcp_dispatch *d, struct katcp_notice *n, int (*
           n->n_vector = NULL;
         }
 
+        if(d->d_shared){
+          due_notice_katcp(d->d_shared, n);
+        }
+
         /* WARNING: require a return here, otherwise i will be increment while count decremented, skipping one invoke entry */
 
         return 0;
@@ -576,7 +760,7 @@ struct katcp_notice *find_notice_katcp(struct katcp_dispatch *d, char *name)
 {
   struct katcp_notice *n;
   struct katcp_shared *s;
-  int i;
+  char *key;
 
   if(name == NULL){
     return NULL;
@@ -584,9 +768,17 @@ struct katcp_notice *find_notice_katcp(struct katcp_dispatch *d, char *name)
 
   s = d->d_shared;
 
-  for(i = 0; i < s->s_pending; i++){
-    n = s->s_notices[i];
-    if(n->n_name && (!strcmp(name, n->n_name))){
+  if(s->s_lookup == NULL){
+    return NULL;
+  }
+
+  key = find_name_katcm(name);
+  if(key == NULL){
+    return NULL;
+  }
+
+  for(n = s->s_lookup[hash_interned_katcm(key) & (s->s_lookups - 1)]; n; n = n->n_chain){
+    if(n->n_name == key){
       return n;
     }
   }
@@ -598,7 +790,8 @@ int find_prefix_notices_katcp(struct katcp_dispatch *d, char *prefix, struct kat
 {
   struct katcp_notice *n;
   struct katcp_shared *s;
-  int len, i, found;
+  int len, found;
+  unsigned int i;
 
   if (prefix == NULL)
     return -1;
@@ -607,14 +800,15 @@ int find_prefix_notices_katcp(struct katcp_dispatch *d, char *prefix, struct kat
   len   = strlen(prefix);
   found = 0;
 
-  for (i = 0; i < s->s_pending; i++){
-    n = s->s_notices[i];
-    if (n->n_name && (!strncmp(prefix, n->n_name, len))){
-      if (found < n_count && n_set != NULL){
-        n_set[found] = n;
-      } 
-      found++;    
+  for (i = lower_notice_katcp(s, prefix, len); i < s->s_titled; i++){
+    n = s->s_titles[i];
+    if (strncmp(prefix, n->n_name, len)){
+      break;
     }
+    if (found < n_count && n_set != NULL){
+      n_set[found] = n;
+    } 
+    found++;    
   }
 
   return found;
@@ -790,6 +984,9 @@ void release_notice_katcp(struct katcp_dispatch *d, struct katcp_notice *n)
  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "releasing %p %s with use %d", n, n->n_name ? n->n_name : "<anonymous>", n->n_use);
   if(n->n_use > 0){
     n->n_use--;
+    if((n->n_use == 0) && d->d_shared){
+      due_notice_katcp(d->d_shared, n);
+    }
   } else {
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "notice: releasing %p %s already at 0 refcount", n, n->n_name ? n->n_name : "<anonymous>");
   }
@@ -900,11 +1097,20 @@ static int configure_notice_katcp(struct katcp_dispatch *d, struct katcp_notice
   log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "notice: triggering %p %s", n, n->n_name ? n->n_name : "<anonymous>");
 #endif
 
+  TRACE_KATCP(KATCP_TRACE_NOTICE, n->n_count, n->n_name);
+
   switch(trigger){
     case KATCP_NOTICE_TRIGGER_SINGLE :
     case KATCP_NOTICE_TRIGGER_ALL :
       n->n_trigger = trigger;
 
+      if(d->d_shared){
+        due_notice_katcp(d->d_shared, n);
+      }
+
+      /* woken from a timer or io handler, which run after notices: don't sleep on it */
+      mark_busy_katcp(d);
+
       if(trigger == KATCP_NOTICE_TRIGGER_SINGLE){
 #ifdef DEBUG
         w = 0;
@@ -922,9 +1128,6 @@ static int configure_notice_katcp(struct katcp_dispatch *d, struct katcp_notice
           fprintf(stderr, "notice: attempted to wake single item (%p) which can not be found\n", data);
         }
 #endif
-
-        mark_busy_katcp(d);
-
       }
 
       return 0;
@@ -989,6 +1192,7 @@ int wake_single_name_notice_katcp(struct katcp_dispatch *d, char *name, struct k
 
 int rename_notice_katcp(struct katcp_dispatch *d, struct katcp_notice *n, char *name)
 {
+  struct katcp_shared *s;
   char *ptr;
 
   if(n == NULL){
@@ -996,7 +1200,7 @@ int rename_notice_katcp(struct katcp_dispatch *d, struct katcp_notice *n, char *
   }
 
   if(name){
-    ptr = strdup(name);
+    ptr = intern_name_katcm(name);
     if(ptr == NULL){
       return -1;
     }
@@ -1004,12 +1208,18 @@ int rename_notice_katcp(struct katcp_dispatch *d, struct katcp_notice *n, char *
     ptr = NULL;
   }
 
+  s = d->d_shared;
+
+  unindex_notice_katcp(s, n);
+
   if(n->n_name){
-    free(n->n_name);
+    release_name_katcm(n->n_name);
   }
 
   n->n_name = ptr;
 
+  index_notice_katcp(s, n);
+
   return 0;
 }
 
@@ -1037,24 +1247,29 @@ int run_notices_katcp(struct katcp_dispatch *d)
   struct katcp_shared *s;
   struct katcp_notice *n;
   struct katcp_invoke *v;
-  int i, k, result, test, limit;
+  struct katcp_held *h;
+  int k, result, test, limit;
+  unsigned int i, due;
 
   s = d->d_shared;
-  i = 0;
+
+  /* only visit notices due now, others becoming due while running go next time */
+  due = s->s_queued;
 
 #ifdef DEBUG
-  fprintf(stderr, "notice: running %d pending entries\n", s->s_pending);
+  fprintf(stderr, "notice: running %u due of %d pending entries\n", due, s->s_pending);
 #endif
 
-  while(i < s->s_pending){
-    n = s->s_notices[i];
+  for(i = 0; i < due; i++){
+    n = s->s_woken[i];
+    n->n_due = 0;
 
     if(n->n_trigger != KATCP_NOTICE_TRIGGER_OFF){
 
       test = (n->n_trigger == KATCP_NOTICE_TRIGGER_ALL) ? 0 : 1;
 
 #ifdef DEBUG
-      fprintf(stderr, "notice: trigger[%d] (%s) with code %d\n", i, n->n_name ? n->n_name : "<anonymous>", test);
+      fprintf(stderr, "notice: trigger[%u] (%s) with code %d\n", i, n->n_name ? n->n_name : "<anonymous>", test);
 #endif
 
       n->n_trigger = KATCP_NOTICE_TRIGGER_OFF;
@@ -1086,7 +1301,10 @@ int run_notices_katcp(struct katcp_dispatch *d)
           if(v->v_trigger >= test){
             
             v->v_trigger = 0;
+
+            h = enter_held_katcp(v->v_client, n);
             result = (*(v->v_call))(v->v_client, n, v->v_data);
+            leave_held_katcp(v->v_client, h, n, result);
 
 #ifdef DEBUG
             fprintf(stderr, "notice: notice %p callback[%d]=%p returns %d (parse=%p)\n", n, k, v->v_call, result, n->n_parse);
@@ -1130,22 +1348,17 @@ int run_notices_katcp(struct katcp_dispatch *d)
     /* move onto the next notice */
 
     if((n->n_count <= 0) && (n->n_use <= 0)){
+      forget_notice_katcp(s, n);
       deallocate_notice_katcp(d, n);
+    }
 
-      s->s_pending--;
+  }
 
-      for(k = i; k < s->s_pending; k++){
-        s->s_notices[k] = s->s_notices[k + 1];
-      }
-#if 0
-      if(i < s->s_pending){
-        s->s_notices[i] = s->s_notices[s->s_pending];
-      }
-#endif
-    } else {
-      i++;
-    }
+  s->s_queued -= due;
+  memmove(s->s_woken, &(s->s_woken[due]), sizeof(struct katcp_notice *) * s->s_queued);
 
+  if(s->s_queued > 0){
+    mark_busy_katcp(d);
   }
 
   return 0;
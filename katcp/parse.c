@@ -5,6 +5,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "katpriv.h"
 #include "katcl.h"
@@ -34,31 +39,149 @@ static void sane_parse_katcl(struct katcl_parse *p)
 #define sane_parse_katcl(p)
 #endif
 
+/* released parses are kept, with their buffer and argument vector, in a pool sorted by buffer size */
+
+static struct katcl_parse *pool_parse_katcl[KATCL_POOL_CLASSES][KATCL_POOL_DEPTH];
+static unsigned int pool_count_katcl[KATCL_POOL_CLASSES];
+static unsigned long pool_hits_katcl = 0;
+static unsigned long pool_misses_katcl = 0;
+
+static int class_pool_parse_katcl(unsigned int size)
+{
+  unsigned int i, limit;
+
+  limit = KATCL_POOL_SMALLEST;
+
+  for(i = 0; i < KATCL_POOL_CLASSES; i++){
+    if(size <= limit){
+      return i;
+    }
+    limit *= 4;
+  }
+
+  return -1;
+}
+
+static struct katcl_parse *take_pool_parse_katcl()
+{
+  unsigned int i;
+  struct katcl_parse *p;
+
+  for(i = 0; i < KATCL_POOL_CLASSES; i++){
+    if(pool_count_katcl[i] > 0){
+      pool_count_katcl[i]--;
+      p = pool_parse_katcl[i][pool_count_katcl[i]];
+      pool_parse_katcl[i][pool_count_katcl[i]] = NULL;
+      pool_hits_katcl++;
+      return p;
+    }
+  }
+
+  pool_misses_katcl++;
+
+  return NULL;
+}
+
+static int give_pool_parse_katcl(struct katcl_parse *p)
+{
+  int c;
+
+  c = class_pool_parse_katcl(p->p_size);
+  if(c < 0){
+    return -1;
+  }
+
+  if(pool_count_katcl[c] >= KATCL_POOL_DEPTH){
+    return -1;
+  }
+
+  pool_parse_katcl[c][pool_count_katcl[c]] = p;
+  pool_count_katcl[c]++;
+
+  return 0;
+}
+
+void stats_pool_parse_katcl(unsigned int *held, unsigned long *hits, unsigned long *misses)
+{
+  unsigned int i, total;
+
+  total = 0;
+  for(i = 0; i < KATCL_POOL_CLASSES; i++){
+    total += pool_count_katcl[i];
+  }
+
+  if(held){
+    *held = total;
+  }
+  if(hits){
+    *hits = pool_hits_katcl;
+  }
+  if(misses){
+    *misses = pool_misses_katcl;
+  }
+}
+
+void drain_pool_parse_katcl()
+{
+  unsigned int i;
+  struct katcl_parse *p;
+
+  for(i = 0; i < KATCL_POOL_CLASSES; i++){
+    while(pool_count_katcl[i] > 0){
+      pool_count_katcl[i]--;
+      p = pool_parse_katcl[i][pool_count_katcl[i]];
+      pool_parse_katcl[i][pool_count_katcl[i]] = NULL;
+
+      if(p->p_buffer){
+        free_memory_katcp(KATCP_MEMORY_PARSE, p->p_buffer, p->p_size);
+      }
+      if(p->p_args){
+        free_memory_katcp(KATCP_MEMORY_PARSE, p->p_args, sizeof(struct katcl_larg) * p->p_count);
+      }
+      if(p->p_wire){
+        free_memory_katcp(KATCP_MEMORY_PARSE, p->p_wire, p->p_wire_size);
+      }
+      free_memory_katcp(KATCP_MEMORY_PARSE, p, sizeof(struct katcl_parse));
+    }
+  }
+}
+
 struct katcl_parse *create_parse_katcl()
 {
   struct katcl_parse *p;
 
-  p = malloc(sizeof(struct katcl_parse));
+  p = take_pool_parse_katcl();
   if(p == NULL){
-    return NULL;
-  }
+    p = malloc_memory_katcp(KATCP_MEMORY_PARSE, sizeof(struct katcl_parse));
+    if(p == NULL){
+      return NULL;
+    }
+
+    p->p_buffer = NULL;
+    p->p_size = 0;
+
+    p->p_args = NULL;
+    p->p_count = 0;
+
+    p->p_wire = NULL;
+    p->p_wire_size = 0;
+  } /* else keep buffer and argument vector of recycled parse */
+
+  p->p_wire_len = 0;
+  p->p_binary = 0;
 
   p->p_magic = KATCL_PARSE_MAGIC;
   p->p_state = KATCL_PARSE_FRESH;
 
-  p->p_buffer = NULL;
-  p->p_size = 0;
   p->p_have = 0;
   p->p_used = 0;
   p->p_kept = 0;
 
-  p->p_args = NULL;
   p->p_current = NULL;
 
   p->p_refs = 0; 
   p->p_tag = (-1);
 
-  p->p_count = 0;
   p->p_got = 0;
 
   return p;
@@ -119,6 +242,9 @@ static void clear_parse_katcl(struct katcl_parse *p)
   p->p_got = 0;
   p->p_current = NULL;
 
+  p->p_wire_len = 0;
+  p->p_binary = 0;
+
   p->p_tag = (-1);
 }
 
@@ -154,27 +280,40 @@ void destroy_parse_katcl(struct katcl_parse *p)
     p->p_magic = 0xdead;
     p->p_state = (-1);
 
+    p->p_have = 0;
+    p->p_used = 0;
+    p->p_kept = 0;
+    p->p_current = NULL;
+    p->p_got = 0;
+    p->p_wire_len = 0;
+    p->p_binary = 0;
+
+    p->p_refs = (-1);
+    p->p_tag = (-1);
+
+    if(give_pool_parse_katcl(p) == 0){
+      return; /* buffers retained for next create */
+    }
+
     if(p->p_buffer){
-      free(p->p_buffer);
+      free_memory_katcp(KATCP_MEMORY_PARSE, p->p_buffer, p->p_size);
       p->p_buffer = NULL;
     }
     p->p_size = 0;
-    p->p_have = 0;
-    p->p_used = 0;
-    p->p_kept = 0;
 
     if(p->p_args){
-      free(p->p_args);
+      free_memory_katcp(KATCP_MEMORY_PARSE, p->p_args, sizeof(struct katcl_larg) * p->p_count);
       p->p_args = NULL;
     }
-    p->p_current = NULL;
     p->p_count = 0;
-    p->p_got = 0;
 
-    p->p_refs = (-1);
-    p->p_tag = (-1);
+    if(p->p_wire){
+      free_memory_katcp(KATCP_MEMORY_PARSE, p->p_wire, p->p_wire_size);
+      p->p_wire = NULL;
+    }
+    p->p_wire_size = 0;
 
-    free(p);
+    free_memory_katcp(KATCP_MEMORY_PARSE, p, sizeof(struct katcl_parse));
   }
 }
 
@@ -357,9 +496,15 @@ static char *request_space_parse_katcl(struct katcl_parse *p, unsigned int amoun
   need = p->p_kept + amount;
   if(need >= p->p_size){
 
-    need++; /* TODO: could try to guess harder */
+    need++;
+
+    if(need < KATCL_POOL_SMALLEST){ /* grow from a pool size class, doubling thereafter */
+      need = KATCL_POOL_SMALLEST;
+    } else if(need < (p->p_size * 2)){
+      need = p->p_size * 2;
+    }
 
-    tmp = realloc(p->p_buffer, need);
+    tmp = realloc_memory_katcp(KATCP_MEMORY_PARSE, p->p_buffer, p->p_size, need);
 
     if(tmp == NULL){
       return NULL;
@@ -396,7 +541,7 @@ static int add_unsafe_parse_katcl(struct katcl_parse *p, int flags, char *string
 
 /*********************************************************************/
 
-int add_buffer_parse_katcl(struct katcl_parse *p, int flags, void *buffer, unsigned int len)
+static int add_escaped_parse_katcl(struct katcl_parse *p, int flags, void *buffer, unsigned int len, unsigned int escape)
 {
   char *src, *dst;
 
@@ -418,7 +563,12 @@ int add_buffer_parse_katcl(struct katcl_parse *p, int flags, void *buffer, unsig
     memcpy(dst, src, len);
   } /* else single \@ case */
 
-  return after_add_parse_katcl(p, len, 1);
+  return after_add_parse_katcl(p, len, escape);
+}
+
+int add_buffer_parse_katcl(struct katcl_parse *p, int flags, void *buffer, unsigned int len)
+{
+  return add_escaped_parse_katcl(p, flags, buffer, len, KATCL_ARG_BINARY);
 }
 
 int add_parameter_parse_katcl(struct katcl_parse *pd, int flags, struct katcl_parse *ps, unsigned int index)
@@ -460,7 +610,7 @@ int add_parameter_parse_katcl(struct katcl_parse *pd, int flags, struct katcl_pa
     memcpy(dst, src, len);
   } /* else single \@ case */
 
-  return after_add_parse_katcl(pd, len, 1);
+  return after_add_parse_katcl(pd, len, (ps->p_args[index].a_escape == KATCL_ARG_BINARY) ? KATCL_ARG_BINARY : 1);
 }
 
 /*********************************************************************/
@@ -473,12 +623,18 @@ int add_plain_parse_katcl(struct katcl_parse *p, int flags, char *string)
 int add_string_parse_katcl(struct katcl_parse *p, int flags, char *buffer)
 {
   if(buffer){
-    return add_buffer_parse_katcl(p, flags, buffer, strlen(buffer));
+    return add_escaped_parse_katcl(p, flags, buffer, strlen(buffer), 1);
   } else {
-    return add_buffer_parse_katcl(p, flags, NULL, 0);
+    return add_escaped_parse_katcl(p, flags, NULL, 0, 1);
   }
 }
 
+int add_counted_parse_katcl(struct katcl_parse *p, int flags, char *buffer, unsigned int len)
+{
+  /* a string which need not be terminated, eg a view into a mapped file */
+  return add_escaped_parse_katcl(p, flags, buffer, len, 1);
+}
+
 int add_unsigned_long_parse_katcl(struct katcl_parse *p, int flags, unsigned long v)
 {
 #define TMP_BUFFER 32
@@ -737,6 +893,47 @@ int get_tag_parse_katcl(struct katcl_parse *p)
   return p->p_tag;
 }
 
+void set_tag_parse_katcl(struct katcl_parse *p, int tag)
+{
+  /* only recorded, a sender has to include the tag in the name itself */
+  p->p_tag = tag;
+}
+
+int name_tag_parse_katcl(struct katcl_parse *p, int tag)
+{
+  /* turns a name into name[tag], only while it is the sole field */
+  struct katcl_larg *la;
+  char extra[16];
+  int len;
+
+  if((p->p_got != 1) || (tag < 0)){
+    return -1;
+  }
+
+  len = snprintf(extra, sizeof(extra), "[%d]", tag);
+  if((len <= 0) || (len >= sizeof(extra))){
+    return -1;
+  }
+
+  /* the name ends in a terminator just before p_kept, so the tag overwrites it */
+  if(request_space_parse_katcl(p, len) == NULL){
+    return -1;
+  }
+
+  la = &(p->p_args[0]);
+  memcpy(p->p_buffer + la->a_end, extra, len);
+  la->a_end += len;
+  p->p_buffer[la->a_end] = '\0';
+
+  p->p_kept += len;
+  p->p_have = p->p_kept;
+  p->p_used = p->p_kept;
+
+  p->p_tag = tag;
+
+  return 0;
+}
+
 int is_type_parse_katcl(struct katcl_parse *p, char type)
 {
   if(p->p_got <= 0){
@@ -908,6 +1105,7 @@ unsigned int get_buffer_parse_katcl(struct katcl_parse *p, unsigned int index, v
 static int check_array_parse_katcl(struct katcl_parse *p)
 {
   struct katcl_larg *tmp;
+  unsigned int increment;
 
   sane_parse_katcl(p);
 
@@ -916,13 +1114,15 @@ static int check_array_parse_katcl(struct katcl_parse *p)
     return 0;
   }
 
-  tmp = realloc(p->p_args, sizeof(struct katcl_larg) * (p->p_count + KATCL_ARGS_INC));
+  increment = (p->p_count > KATCL_ARGS_INC) ? p->p_count : KATCL_ARGS_INC;
+
+  tmp = realloc_memory_katcp(KATCP_MEMORY_PARSE, p->p_args, sizeof(struct katcl_larg) * p->p_count, sizeof(struct katcl_larg) * (p->p_count + increment));
   if(tmp == NULL){
     return -1;
   }
 
   p->p_args = tmp;
-  p->p_count += KATCL_ARGS_INC;
+  p->p_count += increment;
   p->p_current = &(p->p_args[p->p_got]);
 
   return 0;
@@ -942,7 +1142,7 @@ static int stash_remainder_parse_katcl(struct katcl_parse *p, char *buffer, unsi
   need = p->p_used + len;
 
   if(need > p->p_size){
-    tmp = realloc(p->p_buffer, need);
+    tmp = realloc_memory_katcp(KATCP_MEMORY_PARSE, p->p_buffer, p->p_size, need);
     if(tmp == NULL){
       return -1;
     }
@@ -956,6 +1156,157 @@ static int stash_remainder_parse_katcl(struct katcl_parse *p, char *buffer, unsi
   return 0;
 }
 
+static void keep_wire_parse_katcl(struct katcl_parse *p, char *ptr, unsigned int len)
+{
+  /* a message which arrives in one piece is kept as received, writing it out later is then a single copy */
+  char *tmp;
+
+  if((p->p_state != KATCL_PARSE_FRESH) || (p->p_used < p->p_have)){
+    return;
+  }
+
+  switch(ptr[0]){
+    case '#' :
+    case '!' :
+    case '?' :
+      break;
+    default :
+      return; /* leading junk is skipped by the parser, but would be sent along */
+  }
+
+  if(len > p->p_wire_size){
+    tmp = realloc_memory_katcp(KATCP_MEMORY_PARSE, p->p_wire, p->p_wire_size, len);
+    if(tmp == NULL){
+      return;
+    }
+    p->p_wire = tmp;
+    p->p_wire_size = len;
+  }
+
+  memcpy(p->p_wire, ptr, len);
+  p->p_wire[len - 1] = '\n'; /* a lone carriage return also ends a line */
+  p->p_wire_len = len;
+}
+
+static int pull_input_parse_katcl(struct katcl_line *l, struct katcl_parse *p)
+{
+  /* move input up to and including the next line end from the receive buffer into the parse */
+  char *tmp, *ptr, *end;
+  unsigned int len, need, size;
+  int complete;
+
+  sane_parse_katcl(p);
+
+  if((l->l_input == NULL) || (l->l_ihead >= l->l_itail)){
+    return 0;
+  }
+
+  ptr = l->l_input + l->l_ihead;
+  len = l->l_itail - l->l_ihead;
+
+  complete = 0;
+
+  end = memchr(ptr, '\n', len);
+  if(end){
+    len = (end - ptr) + 1;
+    complete = 1;
+  }
+  end = memchr(ptr, '\r', len);
+  if(end){
+    len = (end - ptr) + 1;
+    complete = 1;
+  }
+
+  if(complete && l->l_pass && (l->l_binary == 0)){
+    keep_wire_parse_katcl(p, ptr, len);
+  }
+
+  need = p->p_have + len;
+
+  if(need > p->p_size){
+    size = (p->p_size > KATCL_BUFFER_INC) ? (p->p_size * 2) : KATCL_BUFFER_INC;
+    if(size < need){
+      size = need;
+    }
+    tmp = realloc_memory_katcp(KATCP_MEMORY_PARSE, p->p_buffer, p->p_size, size);
+    if(tmp == NULL){
+      return -1;
+    }
+    p->p_buffer = tmp;
+    p->p_size = size;
+  }
+
+  memcpy(p->p_buffer + p->p_have, ptr, len);
+  p->p_have = need;
+
+  l->l_ihead += len;
+
+#if DEBUG>2
+  fprintf(stderr, "pulled %u bytes from input buffer, %u remain\n", len, l->l_itail - l->l_ihead);
+#endif
+
+  return len;
+}
+
+/* count leading bytes which are plain argument data, that is not whitespace, line end or escape */
+
+#define PLAIN_SWAR_ONES  0x0101010101010101ULL
+#define PLAIN_SWAR_HIGHS 0x8080808080808080ULL
+#define plain_swar_match(w, c) (((w ^ (PLAIN_SWAR_ONES * (c))) - PLAIN_SWAR_ONES) & ~(w ^ (PLAIN_SWAR_ONES * (c))) & PLAIN_SWAR_HIGHS)
+
+static unsigned int plain_span_parse_katcl(char *ptr, unsigned int len)
+{
+  unsigned int i;
+#ifdef __SSE2__
+  __m128i v, m;
+  int mask;
+#else
+  uint64_t w;
+#endif
+
+  i = 0;
+
+#ifdef __SSE2__
+  while((i + 16) <= len){
+    v = _mm_loadu_si128((__m128i *)(ptr + i));
+    m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                     _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+    mask = _mm_movemask_epi8(m);
+    if(mask){
+      return i + __builtin_ctz(mask);
+    }
+    i += 16;
+  }
+#else
+  /* portable fallback, a word at a time, works on either endianness */
+  while((i + 8) <= len){
+    memcpy(&w, ptr + i, 8);
+    if(plain_swar_match(w, ' ') | plain_swar_match(w, '\t') | plain_swar_match(w, '\n') | plain_swar_match(w, '\r') | plain_swar_match(w, '\\')){
+      break; /* locate it below */
+    }
+    i += 8;
+  }
+#endif
+
+  while(i < len){
+    switch(ptr[i]){
+      case ' '  :
+      case '\t' :
+      case '\n' :
+      case '\r' :
+      case '\\' :
+        return i;
+    }
+    i++;
+  }
+
+  return i;
+}
+
+#undef plain_swar_match
+#undef PLAIN_SWAR_HIGHS
+#undef PLAIN_SWAR_ONES
+
 #if 0
 int deparse_katcl(struct katcl_parse *p)
 {
@@ -998,7 +1349,8 @@ int deparse_katcl(struct katcl_parse *p)
 
 int parse_katcl(struct katcl_line *l) /* transform buffer -> args */
 {
-  int increment;
+  int increment, result;
+  unsigned int run;
   struct katcl_parse *p;
 
   p = l->l_next;
@@ -1015,7 +1367,39 @@ int parse_katcl(struct katcl_line *l) /* transform buffer -> args */
 
   sane_parse_katcl(p);
 
-  while((p->p_used < p->p_have) && (p->p_state != KATCL_PARSE_DONE)){
+  result = 0;
+
+  /* only take more from the receive buffer once the parse has consumed what it holds */
+  while((p->p_state != KATCL_PARSE_DONE) && ((p->p_used < p->p_have) || ((result = pull_input_parse_katcl(l, p)) > 0))){
+
+    if(p->p_state == KATCL_PARSE_ARG){ /* fast path: move runs of plain data in one go */
+      run = plain_span_parse_katcl(p->p_buffer + p->p_used, p->p_have - p->p_used);
+      if(run > 0){
+        if(p->p_kept != p->p_used){
+          memmove(p->p_buffer + p->p_kept, p->p_buffer + p->p_used, run);
+        }
+        p->p_used += run;
+        p->p_kept += run;
+        continue; /* WARNING: resume with delimiter or escape in state machine */
+      }
+    }
+
+    if(p->p_state == KATCL_PARSE_BINARY){ /* length known, take raw bytes without looking at them */
+      run = p->p_have - p->p_used;
+      if(run > p->p_binary){
+        run = p->p_binary;
+      }
+      if(p->p_kept != p->p_used){
+        memmove(p->p_buffer + p->p_kept, p->p_buffer + p->p_used, run);
+      }
+      p->p_used += run;
+      p->p_kept += run;
+      p->p_binary -= run;
+      if(p->p_binary == 0){
+        p->p_state = KATCL_PARSE_ARG;
+      }
+      continue;
+    }
 
     increment = 0; /* what to do to keep */
 
@@ -1193,6 +1577,12 @@ int parse_katcl(struct katcl_line *l) /* transform buffer -> args */
         break;
 
       case KATCL_PARSE_ESCAPE :
+        if(l->l_binary && (p->p_buffer[p->p_used] == '=')){ /* negotiated length prefixed argument */
+          p->p_current->a_escape = KATCL_ARG_BINARY;
+          p->p_binary = 0;
+          p->p_state = KATCL_PARSE_LENGTH;
+          break;
+        }
         increment = 1;
         switch(p->p_buffer[p->p_used]){
           case 'e' :
@@ -1222,33 +1612,83 @@ int parse_katcl(struct katcl_line *l) /* transform buffer -> args */
             p->p_buffer[p->p_kept] = p->p_buffer[p->p_used];
             break;
         }
-        p->p_current->a_escape = 1;
+        if(p->p_current->a_escape != KATCL_ARG_BINARY){
+          p->p_current->a_escape = 1;
+        }
         p->p_state = KATCL_PARSE_ARG;
         break;
+
+      case KATCL_PARSE_LENGTH :
+        switch(p->p_buffer[p->p_used]){
+          case '0' :
+          case '1' :
+          case '2' :
+          case '3' :
+          case '4' :
+          case '5' :
+          case '6' :
+          case '7' :
+          case '8' :
+          case '9' :
+            p->p_binary = (p->p_binary * 10) + (p->p_buffer[p->p_used] - '0');
+            if(p->p_binary > KATCL_BINARY_LIMIT){
+              l->l_error = EMSGSIZE;
+              return -1;
+            }
+            break;
+          case ':' :
+            p->p_state = (p->p_binary > 0) ? KATCL_PARSE_BINARY : KATCL_PARSE_ARG;
+            break;
+          default :
+#ifdef DEBUG
+            fprintf(stderr, "extract: invalid length char %c\n", p->p_buffer[p->p_used]);
+#endif
+            l->l_error = EINVAL;
+            return -1;
+        }
+        break;
     }
 
     p->p_used++;
     p->p_kept += increment;
   }
 
+  if(result < 0){
+    l->l_error = ENOMEM;
+    return -1;
+  }
+
   if(p->p_state != KATCL_PARSE_DONE){ /* not finished, run again later */
     return 0; 
   }
 
+  if(p->p_tag >= 0){ /* tags are not written out, so the received form differs */
+    p->p_wire_len = 0;
+  }
+
 #ifdef DEBUG 
   l->l_next = NULL; /* value kept in p */
 #endif
 
-  /* we now need a next entry */
-  l->l_next = create_referenced_parse_katcl();
+  /* we now need a next entry, preferably one recycled by clear_katcl */
+  if(l->l_spare){
+    l->l_next = l->l_spare;
+    l->l_spare = NULL;
+  } else {
+    l->l_next = create_referenced_parse_katcl();
+  }
   if(l->l_next == NULL){
     l->l_error = ENOMEM;
     return -1; /* is it safe to call parse with a next which is DONE ? */
   }
 
-  /* ready is about to be replaced, delete the old copy */
+  /* ready is about to be replaced, discard or recycle the old copy */
   if(l->l_ready){
-    destroy_parse_katcl(l->l_ready);
+    if(l->l_ready->p_refs <= 1){
+      l->l_spare = reuse_parse_katcl(l->l_ready);
+    } else {
+      destroy_parse_katcl(l->l_ready);
+    }
     l->l_ready = NULL;
   }
 
@@ -1308,9 +1748,12 @@ int dump_parse_katcl(struct katcl_parse *p, char *prefix, FILE *fp)
 int main()
 {
 #define BUFFER 32
+#define SPAN   77
   struct katcl_parse *p, *pc;
   char *ptr;
   char buffer[BUFFER];
+  char span[SPAN];
+  int i, j, k;
 
   p = create_referenced_parse_katcl();
   if(p == NULL){
@@ -1351,9 +1794,30 @@ int main()
   destroy_parse_katcl(p);
   destroy_parse_katcl(pc);
 
+  for(i = 0; i < SPAN; i++){
+    span[i] = 'a' + (i % 26);
+  }
+  for(i = 0; i < SPAN; i++){
+    for(j = 0; j < 5; j++){
+      span[i] = " \t\n\r\\"[j];
+      for(k = 0; k <= i; k++){
+        if(plain_span_parse_katcl(span + k, SPAN - k) != (i - k)){
+          fprintf(stderr, "span: failed to locate delimiter %d at %d from offset %d\n", j, i, k);
+          return 1;
+        }
+      }
+    }
+    span[i] = 0x80 | i; /* high bytes are plain data */
+  }
+  if(plain_span_parse_katcl(span, SPAN) != SPAN){
+    fprintf(stderr, "span: spurious delimiter found\n");
+    return 1;
+  }
+
   printf("parse test: ok\n");
 
   return 0;
+#undef SPAN
 #undef BUFFER
 }
   
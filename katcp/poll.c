@@ -0,0 +1,673 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* poller layer used by the core loop: the load functions declare
+ * interest in file descriptors, the core loop waits, and the run
+ * functions query readiness. With epoll the kernel registrations are
+ * kept across loop iterations, so only changes in interest result in
+ * system calls, and the wait only reports those descriptors which are
+ * actually ready. Without epoll we fall back to the old pselect logic
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/select.h>
+#include <sys/time.h>
+
+#ifdef KATCP_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#include "katpriv.h"
+#include "katcl.h"
+#include "katcp.h"
+
+#ifdef KATCP_USE_EPOLL
+
+#define KATCP_POLL_INC     64   /* grow fd tables by this amount */
+#define KATCP_POLL_PLAIN 0x80   /* epoll refused fd (regular file), always ready */
+
+int startup_poll_katcp(struct katcp_shared *s)
+{
+  struct katcp_poll *p;
+
+  if(s->s_poll){
+    return 0;
+  }
+
+  p = malloc(sizeof(struct katcp_poll));
+  if(p == NULL){
+    return -1;
+  }
+
+  p->p_fd = epoll_create(KATCP_POLL_INC);
+  if(p->p_fd < 0){
+    free(p);
+    return -1;
+  }
+
+  fcntl(p->p_fd, F_SETFD, FD_CLOEXEC);
+
+  p->p_want = NULL;
+  p->p_have = NULL;
+  p->p_ready = NULL;
+  p->p_size = 0;
+
+  p->p_list = NULL;
+  p->p_count = 0;
+
+  p->p_known = NULL;
+  p->p_registered = 0;
+
+  p->p_fired = NULL;
+  p->p_hits = 0;
+
+  p->p_events = NULL;
+  p->p_space = 0;
+
+  p->p_plain = 0;
+
+  s->s_poll = p;
+
+  return 0;
+}
+
+void shutdown_poll_katcp(struct katcp_shared *s)
+{
+  struct katcp_poll *p;
+
+  p = s->s_poll;
+  if(p == NULL){
+    return;
+  }
+
+  if(p->p_fd >= 0){
+    close(p->p_fd);
+    p->p_fd = (-1);
+  }
+
+  if(p->p_want){
+    free(p->p_want);
+    p->p_want = NULL;
+  }
+  if(p->p_have){
+    free(p->p_have);
+    p->p_have = NULL;
+  }
+  if(p->p_ready){
+    free(p->p_ready);
+    p->p_ready = NULL;
+  }
+  p->p_size = 0;
+
+  if(p->p_list){
+    free(p->p_list);
+    p->p_list = NULL;
+  }
+  p->p_count = 0;
+
+  if(p->p_known){
+    free(p->p_known);
+    p->p_known = NULL;
+  }
+  p->p_registered = 0;
+
+  if(p->p_fired){
+    free(p->p_fired);
+    p->p_fired = NULL;
+  }
+  p->p_hits = 0;
+
+  if(p->p_events){
+    free(p->p_events);
+    p->p_events = NULL;
+  }
+  p->p_space = 0;
+
+  free(p);
+
+  s->s_poll = NULL;
+}
+
+static int grow_poll_katcp(struct katcp_poll *p, int fd)
+{
+  unsigned int size, i;
+  unsigned char *ptr;
+  int *vector;
+
+  size = ((fd / KATCP_POLL_INC) + 1) * KATCP_POLL_INC;
+
+  ptr = realloc(p->p_want, sizeof(unsigned char) * size);
+  if(ptr == NULL){
+    return -1;
+  }
+  p->p_want = ptr;
+
+  ptr = realloc(p->p_have, sizeof(unsigned char) * size);
+  if(ptr == NULL){
+    return -1;
+  }
+  p->p_have = ptr;
+
+  ptr = realloc(p->p_ready, sizeof(unsigned char) * size);
+  if(ptr == NULL){
+    return -1;
+  }
+  p->p_ready = ptr;
+
+  /* each fd appears at most once in these lists, so they can not exceed size */
+
+  vector = realloc(p->p_list, sizeof(int) * size);
+  if(vector == NULL){
+    return -1;
+  }
+  p->p_list = vector;
+
+  vector = realloc(p->p_known, sizeof(int) * size);
+  if(vector == NULL){
+    return -1;
+  }
+  p->p_known = vector;
+
+  vector = realloc(p->p_fired, sizeof(int) * size);
+  if(vector == NULL){
+    return -1;
+  }
+  p->p_fired = vector;
+
+  for(i = p->p_size; i < size; i++){
+    p->p_want[i] = 0;
+    p->p_have[i] = 0;
+    p->p_ready[i] = 0;
+  }
+
+  p->p_size = size;
+
+  return 0;
+}
+
+void reset_poll_katcp(struct katcp_shared *s)
+{
+  struct katcp_poll *p;
+  unsigned int i;
+
+  p = s->s_poll;
+
+  for(i = 0; i < p->p_count; i++){
+    p->p_want[p->p_list[i]] = 0;
+  }
+
+  p->p_count = 0;
+}
+
+int want_poll_katcp(struct katcp_shared *s, int fd, unsigned int mode)
+{
+  struct katcp_poll *p;
+
+  if(fd < 0){
+    return -1;
+  }
+
+  p = s->s_poll;
+
+  if(fd >= p->p_size){
+    if(grow_poll_katcp(p, fd) < 0){
+#ifdef KATCP_STDERR_ERRORS
+      fprintf(stderr, "poll: unable to grow tables to accommodate fd %d\n", fd);
+#endif
+      return -1;
+    }
+  }
+
+  if(p->p_want[fd] == 0){
+    p->p_list[p->p_count] = fd;
+    p->p_count++;
+  }
+
+  p->p_want[fd] |= (mode & (KATCP_POLL_READ | KATCP_POLL_WRITE));
+
+  return 0;
+}
+
+void drop_poll_katcp(struct katcp_shared *s, unsigned int mode)
+{
+  struct katcp_poll *p;
+  unsigned int i, j;
+  int fd;
+
+  p = s->s_poll;
+
+  /* compact the list, so that an fd never appears in it twice */
+  for(i = 0, j = 0; i < p->p_count; i++){
+    fd = p->p_list[i];
+    p->p_want[fd] &= ~mode;
+    if(p->p_want[fd]){
+      p->p_list[j] = fd;
+      j++;
+    }
+  }
+
+  p->p_count = j;
+}
+
+void forget_poll_katcp(struct katcp_shared *s, int fd)
+{
+  struct katcp_poll *p;
+  struct epoll_event ev;
+
+  p = s->s_poll;
+  if((p == NULL) || (fd < 0) || (fd >= p->p_size)){
+    return;
+  }
+
+  /* fd number might be recycled for a new file, so registration is stale */
+
+  if(p->p_have[fd] & (KATCP_POLL_READ | KATCP_POLL_WRITE)){
+    if(!(p->p_have[fd] & KATCP_POLL_PLAIN)){
+      epoll_ctl(p->p_fd, EPOLL_CTL_DEL, fd, &ev);
+    }
+  }
+
+  p->p_have[fd] = 0;
+  p->p_ready[fd] = 0;
+}
+
+static unsigned int events_to_mode_katcp(uint32_t events)
+{
+  unsigned int mode;
+
+  mode = 0;
+
+  /* like select, report errors and hangups as readable and writable */
+  if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+    mode |= KATCP_POLL_READ;
+  }
+  if(events & (EPOLLOUT | EPOLLHUP | EPOLLERR)){
+    mode |= KATCP_POLL_WRITE;
+  }
+
+  return mode;
+}
+
+static uint32_t mode_to_events_katcp(unsigned int mode)
+{
+  uint32_t events;
+
+  events = 0;
+
+  if(mode & KATCP_POLL_READ){
+    events |= EPOLLIN;
+  }
+  if(mode & KATCP_POLL_WRITE){
+    events |= EPOLLOUT;
+  }
+
+  return events;
+}
+
+static int sync_poll_katcp(struct katcp_poll *p)
+{
+  struct epoll_event ev;
+  unsigned int i;
+  int fd, result;
+
+  /* first remove fds nobody wants anymore */
+  for(i = 0; i < p->p_registered; i++){
+    fd = p->p_known[i];
+    if((p->p_want[fd] == 0) && (p->p_have[fd] != 0)){
+      if(!(p->p_have[fd] & KATCP_POLL_PLAIN)){
+        /* fails harmlessly if fd has been closed meanwhile */
+        epoll_ctl(p->p_fd, EPOLL_CTL_DEL, fd, &ev);
+      }
+      p->p_have[fd] = 0;
+    }
+  }
+
+  p->p_registered = 0;
+  p->p_plain = 0;
+
+  /* now update those whose interest has changed, leave the rest */
+  for(i = 0; i < p->p_count; i++){
+    fd = p->p_list[i];
+
+    if(p->p_want[fd] == 0){
+      continue;
+    }
+
+    p->p_known[p->p_registered] = fd;
+    p->p_registered++;
+
+    if(p->p_have[fd] & KATCP_POLL_PLAIN){
+      p->p_have[fd] = p->p_want[fd] | KATCP_POLL_PLAIN;
+      p->p_plain++;
+      continue;
+    }
+
+    if(p->p_have[fd] == p->p_want[fd]){
+      continue;
+    }
+
+    ev.events = mode_to_events_katcp(p->p_want[fd]);
+    ev.data.fd = fd;
+
+    if(p->p_have[fd]){
+      result = epoll_ctl(p->p_fd, EPOLL_CTL_MOD, fd, &ev);
+      if((result < 0) && (errno == ENOENT)){
+        result = epoll_ctl(p->p_fd, EPOLL_CTL_ADD, fd, &ev);
+      }
+    } else {
+      result = epoll_ctl(p->p_fd, EPOLL_CTL_ADD, fd, &ev);
+      if((result < 0) && (errno == EEXIST)){
+        result = epoll_ctl(p->p_fd, EPOLL_CTL_MOD, fd, &ev);
+      }
+    }
+
+    if(result < 0){
+      if(errno == EPERM){
+        /* regular files and the like, select considers them always ready */
+        p->p_have[fd] = p->p_want[fd] | KATCP_POLL_PLAIN;
+        p->p_plain++;
+      } else {
+#ifdef KATCP_STDERR_ERRORS
+        fprintf(stderr, "poll: unable to register fd %d: %s\n", fd, strerror(errno));
+#endif
+        p->p_have[fd] = 0;
+        p->p_registered--;
+      }
+    } else {
+      p->p_have[fd] = p->p_want[fd];
+    }
+  }
+
+  if(p->p_space < p->p_registered){
+    /* does not have to be exact, epoll_wait just returns fewer events per call */
+    struct epoll_event *tmp;
+
+    tmp = realloc(p->p_events, sizeof(struct epoll_event) * p->p_registered);
+    if(tmp){
+      p->p_events = tmp;
+      p->p_space = p->p_registered;
+    }
+  }
+
+  return 0;
+}
+
+int wait_poll_katcp(struct katcp_shared *s, struct timespec *delta)
+{
+  struct katcp_poll *p;
+  unsigned int i, mode;
+  int result, timeout, fd, j;
+
+  p = s->s_poll;
+
+  for(i = 0; i < p->p_hits; i++){
+    p->p_ready[p->p_fired[i]] = 0;
+  }
+  p->p_hits = 0;
+
+  sync_poll_katcp(p);
+
+  if(delta){
+    /* round up, otherwise brief waits degenerate into a busy loop */
+    timeout = (delta->tv_sec * 1000) + ((delta->tv_nsec + 999999) / 1000000);
+  } else {
+    timeout = (-1);
+  }
+
+  if(p->p_plain > 0){
+    timeout = 0;
+  }
+
+  if(p->p_space > 0){
+    result = epoll_pwait(p->p_fd, p->p_events, p->p_space, timeout, &(s->s_mask_current));
+  } else {
+    /* nothing registered, still want to sleep and catch signals */
+    result = pselect(0, NULL, NULL, NULL, delta, &(s->s_mask_current));
+  }
+
+  if(result < 0){
+    return -1;
+  }
+
+  for(j = 0; j < result; j++){
+    fd = p->p_events[j].data.fd;
+    if((fd < 0) || (fd >= p->p_size)){
+      continue;
+    }
+    mode = events_to_mode_katcp(p->p_events[j].events) & p->p_want[fd];
+    if(mode && (p->p_ready[fd] == 0)){
+      p->p_fired[p->p_hits] = fd;
+      p->p_hits++;
+    }
+    p->p_ready[fd] |= mode;
+  }
+
+  if(p->p_plain > 0){
+    for(i = 0; i < p->p_registered; i++){
+      fd = p->p_known[i];
+      if(p->p_have[fd] & KATCP_POLL_PLAIN){
+        if(p->p_ready[fd] == 0){
+          p->p_fired[p->p_hits] = fd;
+          p->p_hits++;
+          result++;
+        }
+        p->p_ready[fd] |= p->p_want[fd];
+      }
+    }
+  }
+
+  return result;
+}
+
+int ready_poll_katcp(struct katcp_shared *s, int fd, unsigned int mode)
+{
+  struct katcp_poll *p;
+
+  p = s->s_poll;
+
+  if((fd < 0) || (fd >= p->p_size)){
+    return 0;
+  }
+
+  return (p->p_ready[fd] & mode) ? 1 : 0;
+}
+
+void clear_ready_poll_katcp(struct katcp_shared *s)
+{
+  struct katcp_poll *p;
+  unsigned int i;
+
+  p = s->s_poll;
+
+  for(i = 0; i < p->p_hits; i++){
+    p->p_ready[p->p_fired[i]] = 0;
+  }
+  p->p_hits = 0;
+}
+
+int fired_poll_katcp(struct katcp_shared *s, unsigned int *cursor)
+{
+  struct katcp_poll *p;
+
+  p = s->s_poll;
+
+  /* walks the fds reported by the last wait, cursor starts at zero */
+  if(*cursor >= p->p_hits){
+    return -1;
+  }
+
+  return p->p_fired[(*cursor)++];
+}
+
+#else
+
+/* pselect fallback, limited to FD_SETSIZE descriptors ***************/
+
+int startup_poll_katcp(struct katcp_shared *s)
+{
+  struct katcp_poll *p;
+
+  if(s->s_poll){
+    return 0;
+  }
+
+  p = malloc(sizeof(struct katcp_poll));
+  if(p == NULL){
+    return -1;
+  }
+
+  FD_ZERO(&(p->p_read));
+  FD_ZERO(&(p->p_write));
+  p->p_max = (-1);
+
+  s->s_poll = p;
+
+  return 0;
+}
+
+void shutdown_poll_katcp(struct katcp_shared *s)
+{
+  if(s->s_poll == NULL){
+    return;
+  }
+
+  free(s->s_poll);
+  s->s_poll = NULL;
+}
+
+void reset_poll_katcp(struct katcp_shared *s)
+{
+  struct katcp_poll *p;
+
+  p = s->s_poll;
+
+  FD_ZERO(&(p->p_read));
+  FD_ZERO(&(p->p_write));
+
+  p->p_max = (-1);
+}
+
+int want_poll_katcp(struct katcp_shared *s, int fd, unsigned int mode)
+{
+  struct katcp_poll *p;
+
+  if((fd < 0) || (fd >= FD_SETSIZE)){
+#ifdef KATCP_STDERR_ERRORS
+    fprintf(stderr, "poll: fd %d outside select range\n", fd);
+#endif
+    return -1;
+  }
+
+  p = s->s_poll;
+
+  if(mode & KATCP_POLL_READ){
+    FD_SET(fd, &(p->p_read));
+  }
+  if(mode & KATCP_POLL_WRITE){
+    FD_SET(fd, &(p->p_write));
+  }
+
+  if(fd > p->p_max){
+    p->p_max = fd;
+  }
+
+  return 0;
+}
+
+void drop_poll_katcp(struct katcp_shared *s, unsigned int mode)
+{
+  struct katcp_poll *p;
+
+  p = s->s_poll;
+
+  if(mode & KATCP_POLL_READ){
+    FD_ZERO(&(p->p_read));
+  }
+  if(mode & KATCP_POLL_WRITE){
+    FD_ZERO(&(p->p_write));
+  }
+}
+
+void forget_poll_katcp(struct katcp_shared *s, int fd)
+{
+  struct katcp_poll *p;
+
+  p = s->s_poll;
+  if((p == NULL) || (fd < 0) || (fd >= FD_SETSIZE)){
+    return;
+  }
+
+  FD_CLR(fd, &(p->p_read));
+  FD_CLR(fd, &(p->p_write));
+}
+
+int wait_poll_katcp(struct katcp_shared *s, struct timespec *delta)
+{
+  struct katcp_poll *p;
+  int result;
+
+  p = s->s_poll;
+
+  result = pselect(p->p_max + 1, &(p->p_read), &(p->p_write), NULL, delta, &(s->s_mask_current));
+  if(result < 0){
+    FD_ZERO(&(p->p_read));
+    FD_ZERO(&(p->p_write));
+  }
+
+  return result;
+}
+
+int ready_poll_katcp(struct katcp_shared *s, int fd, unsigned int mode)
+{
+  struct katcp_poll *p;
+
+  if((fd < 0) || (fd >= FD_SETSIZE)){
+    return 0;
+  }
+
+  p = s->s_poll;
+
+  if((mode & KATCP_POLL_READ) && FD_ISSET(fd, &(p->p_read))){
+    return 1;
+  }
+  if((mode & KATCP_POLL_WRITE) && FD_ISSET(fd, &(p->p_write))){
+    return 1;
+  }
+
+  return 0;
+}
+
+void clear_ready_poll_katcp(struct katcp_shared *s)
+{
+  reset_poll_katcp(s);
+}
+
+int fired_poll_katcp(struct katcp_shared *s, unsigned int *cursor)
+{
+  struct katcp_poll *p;
+  int fd;
+
+  p = s->s_poll;
+
+  /* here the cursor is simply the next fd to check */
+  for(fd = *cursor; fd <= p->p_max; fd++){
+    if(FD_ISSET(fd, &(p->p_read)) || FD_ISSET(fd, &(p->p_write))){
+      *cursor = fd + 1;
+      return fd;
+    }
+  }
+
+  *cursor = fd;
+
+  return -1;
+}
+
+#endif
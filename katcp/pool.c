@@ -0,0 +1,719 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* pools of persistent subprocesses: instead of forking a fresh child
+ * for every request, a pool keeps a number of katcp speaking children
+ * running and hands each request for its command to the least loaded
+ * one, relaying the reply. Idle members are sent a ?watchdog at every
+ * check interval, a member which fails or doesn't answer by the next
+ * check is terminated, as is one which has served its recycle count.
+ * Members which exit are restarted, immediately if they were not
+ * short lived, otherwise at the next check. The children have to
+ * keep reading requests, one-shot scripts still need ?process.
+ * Servers can also launch a pool of their own and submit requests to
+ * it, in which case no command is registered for it
+ */
+
+#ifdef KATCP_SUBPROCESS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "katpriv.h"
+#include "katcl.h"
+#include "katcp.h"
+
+#define KATCP_POOL_INTERVAL 10000 /* ms between health checks */
+#define KATCP_POOL_SETTLE       2 /* members dying younger than this are restarted by the check */
+
+struct katcp_pool;
+
+struct katcp_member{
+  struct katcp_pool *m_pool;
+  struct katcp_job *m_job;
+  struct katcp_notice *m_halt; /* set while the job has yet to report its exit */
+  struct timeval m_born;
+  unsigned int m_served;
+  int m_checking;              /* watchdog outstanding */
+  int m_draining;              /* terminated, won't get new requests */
+};
+
+struct katcp_pool{
+  char *p_name;                /* also the request it serves, without the ? */
+  char **p_vector;             /* executable and arguments, NULL terminated */
+  unsigned int p_args;
+
+  struct katcp_member *p_members;
+  unsigned int p_size;
+
+  unsigned int p_recycle;      /* requests before a member is restarted, 0 for never */
+  unsigned int p_next;         /* where the next search for a member starts */
+  unsigned int p_spawned;
+
+  int p_halted;
+};
+
+int pool_cmd_katcp(struct katcp_dispatch *d, int argc);
+
+static int spawn_member_katcp(struct katcp_dispatch *d, struct katcp_member *m);
+
+/* utilities ******************************************************/
+
+static struct katcp_pool *find_pool_katcp(struct katcp_shared *s, char *name)
+{
+  unsigned int i;
+
+  for(i = 0; i < s->s_pooled; i++){
+    if(!strcmp(s->s_pools[i]->p_name, name)){
+      return s->s_pools[i];
+    }
+  }
+
+  return NULL;
+}
+
+static int live_member_katcp(struct katcp_shared *s, struct katcp_member *m)
+{
+  unsigned int i;
+
+  if(m->m_job == NULL){
+    return 0;
+  }
+
+  /* the job is deallocated before its halt notice runs, so check it is still about */
+  for(i = 0; i < s->s_number; i++){
+    if(s->s_tasks[i] == m->m_job){
+      return 1;
+    }
+  }
+
+  m->m_job = NULL;
+
+  return 0;
+}
+
+static void drain_member_katcp(struct katcp_dispatch *d, struct katcp_member *m)
+{
+  if(m->m_draining){
+    return;
+  }
+
+  m->m_draining = 1;
+  zap_job_katcp(d, m->m_job);
+}
+
+static struct katcp_member *pick_member_katcp(struct katcp_shared *s, struct katcp_pool *p)
+{
+  struct katcp_member *m, *best, *spent;
+  unsigned int i, k;
+
+  best = NULL;
+  spent = NULL;
+
+  for(i = 0; i < p->p_size; i++){
+    k = (p->p_next + i) % p->p_size;
+    m = &(p->p_members[k]);
+
+    if(m->m_draining || (live_member_katcp(s, m) == 0)){
+      continue;
+    }
+
+    if(p->p_recycle && (m->m_served >= p->p_recycle)){
+      if(spent == NULL){
+        spent = m;
+      }
+      continue;
+    }
+
+    if((best == NULL) || (m->m_job->j_count < best->m_job->j_count)){
+      best = m;
+      p->p_next = k + 1;
+      if(best->m_job->j_count == 0){
+        break;
+      }
+    }
+  }
+
+  /* better to stretch the recycle count than to fail the request */
+  return best ? best : spent;
+}
+
+/* member lifecycle ***********************************************/
+
+static int halt_member_katcp(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct katcp_member *m;
+  struct katcp_pool *p;
+  struct timeval now, delta;
+
+  m = data;
+  p = m->m_pool;
+
+  log_message_katcp(d, m->m_draining ? KATCP_LEVEL_DEBUG : KATCP_LEVEL_WARN, NULL, "member of pool %s ended after %u requests", p->p_name, m->m_served);
+
+  m->m_job = NULL;
+  m->m_halt = NULL;
+  m->m_checking = 0;
+  m->m_draining = 0;
+
+  if(p->p_halted){
+    return 0;
+  }
+
+  monotonic_time_katcp(&now);
+  sub_time_katcp(&delta, &now, &(m->m_born));
+
+  if(delta.tv_sec >= KATCP_POOL_SETTLE){
+    spawn_member_katcp(d, m);
+  }
+
+  return 0;
+}
+
+static int checked_member_katcp(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct katcp_member *m;
+  struct katcl_parse *px;
+  char *code;
+
+  m = data;
+
+  m->m_checking = 0;
+
+  px = get_parse_notice_katcp(d, n);
+  code = px ? get_string_parse_katcl(px, 1) : NULL;
+
+  if(code && !strcmp(code, KATCP_OK)){
+    return 0;
+  }
+
+  if(live_member_katcp(d->d_shared, m)){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "member of pool %s failed its health check", m->m_pool->p_name);
+    drain_member_katcp(d, m);
+  }
+
+  return 0;
+}
+
+static int spawn_member_katcp(struct katcp_dispatch *d, struct katcp_member *m)
+{
+  struct katcp_dispatch *dl;
+  struct katcp_notice *n;
+  struct katcp_pool *p;
+  struct katcp_url *u;
+  struct katcp_job *j;
+
+  p = m->m_pool;
+
+  /* notices subscribed by the template outlive the client which started the pool */
+  dl = template_shared_katcp(d);
+  if(dl == NULL){
+    return -1;
+  }
+
+  u = create_exec_kurl_katcp(p->p_vector[0]);
+  if(u == NULL){
+    return -1;
+  }
+
+  n = create_notice_katcp(dl, NULL, 0);
+  if(n == NULL){
+    destroy_kurl_katcp(u);
+    return -1;
+  }
+
+  if(add_notice_katcp(dl, n, &halt_member_katcp, m) < 0){
+    destroy_kurl_katcp(u);
+    return -1;
+  }
+
+  j = process_relay_create_job_katcp(dl, u, p->p_vector, n, NULL);
+  if(j == NULL){
+    remove_notice_katcp(dl, n, &halt_member_katcp, m);
+    destroy_kurl_katcp(u);
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to start member of pool %s", p->p_name);
+    return -1;
+  }
+
+  m->m_job = j;
+  m->m_halt = n;
+  m->m_served = 0;
+  m->m_checking = 0;
+  m->m_draining = 0;
+  monotonic_time_katcp(&(m->m_born));
+
+  p->p_spawned++;
+
+  return 0;
+}
+
+static int check_pool_katcp(struct katcp_dispatch *d, void *data)
+{
+  struct katcp_shared *s;
+  struct katcp_member *m;
+  struct katcp_pool *p;
+  struct katcl_parse *px;
+  unsigned int i;
+
+  p = data;
+  s = d->d_shared;
+
+  if(p->p_halted){
+    return -1;
+  }
+
+  for(i = 0; i < p->p_size; i++){
+    m = &(p->p_members[i]);
+
+    if(live_member_katcp(s, m) == 0){
+      if(m->m_halt == NULL){
+        spawn_member_katcp(d, m);
+      }
+      continue;
+    }
+
+    if(m->m_draining){
+      continue;
+    }
+
+    if(m->m_checking){
+      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "member of pool %s did not answer its health check", p->p_name);
+      drain_member_katcp(d, m);
+      continue;
+    }
+
+    if(m->m_job->j_count > 0){
+      /* busy members show signs of life via their replies */
+      continue;
+    }
+
+    if(p->p_recycle && (m->m_served >= p->p_recycle)){
+      log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "recycling member of pool %s after %u requests", p->p_name, m->m_served);
+      drain_member_katcp(d, m);
+      continue;
+    }
+
+    px = create_parse_katcl();
+    if(px == NULL){
+      continue;
+    }
+
+    if(add_plain_parse_katcl(px, KATCP_FLAG_FIRST | KATCP_FLAG_LAST | KATCP_FLAG_STRING, KATCP_WATCHDOG_REQUEST) < 0){
+      destroy_parse_katcl(px);
+      continue;
+    }
+
+    m->m_checking = 1;
+
+    if(submit_to_job_katcp(d, m->m_job, px, NULL, &checked_member_katcp, m) < 0){
+      m->m_checking = 0;
+      destroy_parse_katcl(px);
+    }
+  }
+
+  return 0;
+}
+
+/* setup and teardown *********************************************/
+
+static void destroy_pool_katcp(struct katcp_pool *p)
+{
+  unsigned int i;
+
+  if(p->p_vector){
+    for(i = 0; i < p->p_args; i++){
+      if(p->p_vector[i]){
+        free(p->p_vector[i]);
+      }
+    }
+    free(p->p_vector);
+  }
+
+  if(p->p_members){
+    free(p->p_members);
+  }
+
+  if(p->p_name){
+    free(p->p_name);
+  }
+
+  free(p);
+}
+
+static struct katcp_pool *create_pool_katcp(char *name, unsigned int size, char **vector)
+{
+  struct katcp_pool *p;
+  unsigned int i, count;
+
+  p = malloc(sizeof(struct katcp_pool));
+  if(p == NULL){
+    return NULL;
+  }
+
+  p->p_name = NULL;
+  p->p_vector = NULL;
+  p->p_args = 0;
+  p->p_members = NULL;
+  p->p_size = 0;
+  p->p_recycle = 0;
+  p->p_next = 0;
+  p->p_spawned = 0;
+  p->p_halted = 0;
+
+  p->p_name = strdup(name);
+  if(p->p_name == NULL){
+    destroy_pool_katcp(p);
+    return NULL;
+  }
+
+  for(count = 0; vector[count]; count++);
+
+  p->p_vector = malloc(sizeof(char *) * (count + 1));
+  if(p->p_vector == NULL){
+    destroy_pool_katcp(p);
+    return NULL;
+  }
+
+  for(i = 0; i < count; i++){
+    p->p_vector[p->p_args] = strdup(vector[i]);
+    if(p->p_vector[p->p_args] == NULL){
+      destroy_pool_katcp(p);
+      return NULL;
+    }
+    p->p_args++;
+  }
+  p->p_vector[p->p_args] = NULL;
+
+  p->p_members = malloc(sizeof(struct katcp_member) * size);
+  if(p->p_members == NULL){
+    destroy_pool_katcp(p);
+    return NULL;
+  }
+
+  for(i = 0; i < size; i++){
+    p->p_members[i].m_pool = p;
+    p->p_members[i].m_job = NULL;
+    p->p_members[i].m_halt = NULL;
+    p->p_members[i].m_served = 0;
+    p->p_members[i].m_checking = 0;
+    p->p_members[i].m_draining = 0;
+  }
+  p->p_size = size;
+
+  return p;
+}
+
+static int idle_pool_katcp(struct katcp_pool *p)
+{
+  unsigned int i;
+
+  for(i = 0; i < p->p_size; i++){
+    if(p->p_members[i].m_job || p->p_members[i].m_halt){
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void halt_pools_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_shared *s;
+  unsigned int i;
+
+  s = d->d_shared;
+
+  /* jobs are being ended, don't restart any */
+  for(i = 0; i < s->s_pooled; i++){
+    s->s_pools[i]->p_halted = 1;
+  }
+}
+
+void destroy_pools_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_shared *s;
+  unsigned int i;
+
+  s = d->d_shared;
+
+  /* WARNING: has to run after the notices which refer to members are gone */
+
+  for(i = 0; i < s->s_pooled; i++){
+    discharge_timer_katcp(d, s->s_pools[i]);
+    destroy_pool_katcp(s->s_pools[i]);
+  }
+
+  if(s->s_pools){
+    free(s->s_pools);
+    s->s_pools = NULL;
+  }
+  s->s_pooled = 0;
+}
+
+/* commands *******************************************************/
+
+int submit_pool_katcp(struct katcp_dispatch *d, char *name, struct katcl_parse *px, int (*call)(struct katcp_dispatch *d, struct katcp_notice *n, void *data), void *data)
+{
+  struct katcp_shared *s;
+  struct katcp_member *m;
+  struct katcp_pool *p;
+
+  s = d->d_shared;
+
+  p = find_pool_katcp(s, name);
+  if((p == NULL) || p->p_halted){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no pool serves %s", name);
+    return -1;
+  }
+
+  m = pick_member_katcp(s, p);
+  if(m == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no member of pool %s is available", p->p_name);
+    return -1;
+  }
+
+  if(submit_to_job_katcp(d, m->m_job, px, NULL, call, data) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to submit request to pool %s", p->p_name);
+    return -1;
+  }
+
+  m->m_served++;
+
+  return 0;
+}
+
+int pool_request_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcl_parse *px;
+  char *name;
+
+  name = arg_string_katcp(d, 0);
+  if((name == NULL) || (name[0] != KATCP_REQUEST)){
+    return KATCP_RESULT_FAIL;
+  }
+
+  /* the request goes out as it came in, only a reference is taken */
+  px = copy_parse_katcl(arg_parse_katcp(d));
+  if(px == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(submit_pool_katcp(d, name + 1, px, &subprocess_resume_job_katcp, NULL) < 0){
+    destroy_parse_katcl(px);
+    return KATCP_RESULT_FAIL;
+  }
+
+  return KATCP_RESULT_PAUSE;
+}
+
+int launch_pool_katcp(struct katcp_dispatch *d, char *name, unsigned int size, unsigned int recycle, char **vector)
+{
+  struct katcp_shared *s;
+  struct katcp_pool *p, **tmp;
+  unsigned int i, index;
+
+  s = d->d_shared;
+
+  if((size == 0) || (vector == NULL) || (vector[0] == NULL)){
+    return -1;
+  }
+
+  p = find_pool_katcp(s, name);
+  if(p){
+    if((p->p_halted == 0) || (idle_pool_katcp(p) == 0)){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "pool %s still active", name);
+      return -1;
+    }
+    for(index = 0; (index < s->s_pooled) && (s->s_pools[index] != p); index++);
+  } else {
+    tmp = realloc(s->s_pools, sizeof(struct katcp_pool *) * (s->s_pooled + 1));
+    if(tmp == NULL){
+      return -1;
+    }
+    s->s_pools = tmp;
+    index = s->s_pooled;
+  }
+
+  p = create_pool_katcp(name, size, vector);
+  if(p == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate pool %s", name);
+    return -1;
+  }
+
+  p->p_recycle = recycle;
+
+  if(register_every_ms_katcp(d, KATCP_POOL_INTERVAL, &check_pool_katcp, p) < 0){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to schedule health checks for pool %s", name);
+  }
+
+  if(index < s->s_pooled){
+    destroy_pool_katcp(s->s_pools[index]);
+  } else {
+    s->s_pooled++;
+  }
+  s->s_pools[index] = p;
+
+  for(i = 0; i < size; i++){
+    spawn_member_katcp(d, &(p->p_members[i]));
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "started %u of %u members of pool %s", p->p_spawned, size, name);
+
+  return 0;
+}
+
+static int start_pool_katcp(struct katcp_dispatch *d, int argc)
+{
+  unsigned int size;
+  char *name, *label, **vector;
+  int len, result, i;
+
+  name = arg_string_katcp(d, 2);
+  size = arg_unsigned_long_katcp(d, 3);
+
+  if((argc < 5) || (name == NULL) || (size == 0)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a name, a size and an executable");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(name[0] == KATCP_REQUEST){
+    name++;
+  }
+
+  vector = malloc(sizeof(char *) * (argc - 3));
+  if(vector == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  for(i = 4; i < argc; i++){
+    /* WARNING: won't deal with arguments containing \0, same as ?process */
+    vector[i - 4] = arg_string_katcp(d, i);
+    if(vector[i - 4] == NULL){
+      free(vector);
+      return KATCP_RESULT_FAIL;
+    }
+  }
+  vector[i - 4] = NULL;
+
+  result = launch_pool_katcp(d, name, size, 0, vector);
+  free(vector);
+
+  if(result < 0){
+    return KATCP_RESULT_FAIL;
+  }
+
+  len = strlen(name) + 2;
+  label = malloc(len);
+  if(label == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+  snprintf(label, len, "%c%s", KATCP_REQUEST, name);
+
+  if(register_flag_mode_katcp(d, label, "pooled subprocess request", &pool_request_cmd_katcp, 0, 0) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to register handler for %s", label);
+    free(label);
+    return KATCP_RESULT_FAIL;
+  }
+  free(label);
+
+  return KATCP_RESULT_OK;
+}
+
+int pool_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_shared *s;
+  struct katcp_member *m;
+  struct katcp_pool *p;
+  char *name, *label, *ptr;
+  unsigned int i, k, live;
+  int len;
+
+  s = d->d_shared;
+
+  if(argc <= 1){
+    name = "list";
+  } else {
+    name = arg_string_katcp(d, 1);
+    if(name == NULL){
+      return KATCP_RESULT_FAIL;
+    }
+  }
+
+  if(!strcmp(name, "list")){
+    for(i = 0; i < s->s_pooled; i++){
+      p = s->s_pools[i];
+      live = 0;
+      for(k = 0; k < p->p_size; k++){
+        m = &(p->p_members[k]);
+        if(live_member_katcp(s, m)){
+          live++;
+          log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "pool %s member %u pid %d served %u queued %u%s", p->p_name, k, m->m_job->j_pid, m->m_served, m->m_job->j_count, m->m_draining ? " draining" : "");
+        }
+      }
+      log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "pool %s runs %s with %u of %u members live, %u started, recycled after %u requests%s", p->p_name, p->p_vector[0], live, p->p_size, p->p_spawned, p->p_recycle, p->p_halted ? ", halted" : "");
+    }
+    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "%u pools", s->s_pooled);
+    return KATCP_RESULT_OK;
+  }
+
+  if(!strcmp(name, "start")){
+    return start_pool_katcp(d, argc);
+  }
+
+  label = arg_string_katcp(d, 2);
+  if(label == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a pool name");
+    return KATCP_RESULT_FAIL;
+  }
+  if(label[0] == KATCP_REQUEST){
+    label++;
+  }
+
+  p = find_pool_katcp(s, label);
+  if(p == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no pool called %s", label);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(!strcmp(name, "recycle")){
+    if(argc < 4){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a request count");
+      return KATCP_RESULT_FAIL;
+    }
+    p->p_recycle = arg_unsigned_long_katcp(d, 3);
+    return KATCP_RESULT_OK;
+  }
+
+  if(!strcmp(name, "stop")){
+    if(p->p_halted){
+      return KATCP_RESULT_OK;
+    }
+
+    p->p_halted = 1;
+    discharge_timer_katcp(d, p);
+
+    len = strlen(p->p_name) + 2;
+    ptr = malloc(len);
+    if(ptr){
+      snprintf(ptr, len, "%c%s", KATCP_REQUEST, p->p_name);
+      deregister_command_katcp(d, ptr);
+      free(ptr);
+    }
+
+    for(k = 0; k < p->p_size; k++){
+      m = &(p->p_members[k]);
+      if(live_member_katcp(s, m)){
+        drain_member_katcp(d, m);
+      }
+    }
+
+    return KATCP_RESULT_OK;
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown pool operation %s", name);
+  return KATCP_RESULT_FAIL;
+}
+
+#endif
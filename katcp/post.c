@@ -0,0 +1,303 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* sensor updates from other threads: a producer thread claims a slot
+ * in a bounded ring with a single compare and swap, fills it in and
+ * publishes it by advancing the slot sequence number. Only the first
+ * producer after a drain writes to the pipe, the loop thread then
+ * empties the ring in one go from an arb callback, applying each
+ * value via the usual set functions. The post functions do not take a
+ * dispatch and touch nothing but the ring, so they need no locks, and
+ * not even KATCP_THREADS. When the ring is full the update is dropped
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "katpriv.h"
+#include "katcl.h"
+#include "katcp.h"
+
+#define KATCP_POSTER_NAME "poster"
+
+struct katcp_update{
+  unsigned long u_sequence; /* slot free when position, filled when position + 1 */
+  struct katcp_acquire *u_acquire;
+  struct timeval u_when;
+  int u_integer;
+#ifdef KATCP_USE_FLOATS
+  double u_double;
+#endif
+};
+
+struct katcp_poster{
+  struct katcp_update *p_slots;
+  unsigned long p_mask;  /* size is a power of two */
+
+  unsigned long p_tail;  /* claimed by producers */
+  unsigned long p_head;  /* only touched by the loop */
+
+  int p_wake;            /* set while a wakeup is pending */
+  unsigned long p_dropped;
+  unsigned long p_reported;
+
+  int p_pipe[2];
+};
+
+static void apply_update_katcp(struct katcp_dispatch *d, struct katcp_update *u)
+{
+  struct katcp_acquire *a;
+
+  a = u->u_acquire;
+
+  /* emit picks this up in place of the time it runs */
+  a->a_stamp = u->u_when;
+
+  switch(a->a_type){
+    case KATCP_SENSOR_INTEGER :
+      set_integer_acquire_katcp(d, a, u->u_integer);
+      break;
+    case KATCP_SENSOR_BOOLEAN :
+      set_boolean_acquire_katcp(d, a, u->u_integer);
+      break;
+    case KATCP_SENSOR_DISCRETE :
+      set_discrete_acquire_katcp(d, a, u->u_integer);
+      break;
+#ifdef KATCP_USE_FLOATS
+    case KATCP_SENSOR_FLOAT :
+      set_double_acquire_katcp(d, a, u->u_double);
+      break;
+#endif
+    default :
+      a->a_stamp.tv_sec = 0;
+      a->a_stamp.tv_usec = 0;
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to apply posted update to acquire of type %d", a->a_type);
+      break;
+  }
+}
+
+static int drain_poster_katcp(struct katcp_dispatch *d, struct katcp_arb *a, unsigned int mode)
+{
+  struct katcp_poster *p;
+  struct katcp_update *u;
+  unsigned long dropped;
+  unsigned int count;
+  char buffer[64];
+
+  p = data_arb_katcp(d, a);
+
+  while(read(p->p_pipe[0], buffer, sizeof(buffer)) > 0);
+
+  /* rearm before looking: a producer which publishes after this point writes to the pipe again */
+  __atomic_exchange_n(&(p->p_wake), 0, __ATOMIC_ACQ_REL);
+
+  count = 0;
+
+  for(;;){
+    u = &(p->p_slots[p->p_head & p->p_mask]);
+    if(__atomic_load_n(&(u->u_sequence), __ATOMIC_ACQUIRE) != (p->p_head + 1)){
+      break;
+    }
+
+    apply_update_katcp(d, u);
+    count++;
+
+    __atomic_store_n(&(u->u_sequence), p->p_head + p->p_mask + 1, __ATOMIC_RELEASE);
+    p->p_head++;
+  }
+
+  dropped = __atomic_load_n(&(p->p_dropped), __ATOMIC_RELAXED);
+  if(dropped != p->p_reported){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "dropped %lu posted sensor updates as ring of %lu was full", dropped - p->p_reported, p->p_mask + 1);
+    p->p_reported = dropped;
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "applied %u posted sensor updates", count);
+
+  return 0;
+}
+
+struct katcp_poster *start_poster_katcp(struct katcp_dispatch *d, unsigned int size)
+{
+  struct katcp_shared *s;
+  struct katcp_poster *p;
+  unsigned long i, total;
+
+  s = d->d_shared;
+  if(s == NULL){
+    return NULL;
+  }
+
+  if(s->s_poster){
+    return s->s_poster;
+  }
+
+  for(total = 1; total < size; total *= 2);
+
+  p = malloc(sizeof(struct katcp_poster));
+  if(p == NULL){
+    return NULL;
+  }
+
+  p->p_slots = malloc(sizeof(struct katcp_update) * total);
+  if(p->p_slots == NULL){
+    free(p);
+    return NULL;
+  }
+
+  for(i = 0; i < total; i++){
+    p->p_slots[i].u_sequence = i;
+    p->p_slots[i].u_acquire = NULL;
+  }
+
+  p->p_mask = total - 1;
+  p->p_tail = 0;
+  p->p_head = 0;
+  p->p_wake = 0;
+  p->p_dropped = 0;
+  p->p_reported = 0;
+
+  if(pipe(p->p_pipe) < 0){
+    free(p->p_slots);
+    free(p);
+    return NULL;
+  }
+
+  for(i = 0; i < 2; i++){
+    fcntl(p->p_pipe[i], F_SETFD, FD_CLOEXEC);
+    fcntl(p->p_pipe[i], F_SETFL, O_NONBLOCK);
+  }
+
+  /* the arb now owns the read end */
+  if(create_arb_katcp(d, KATCP_POSTER_NAME, p->p_pipe[0], KATCP_ARB_READ, &drain_poster_katcp, p) == NULL){
+    close(p->p_pipe[0]);
+    close(p->p_pipe[1]);
+    free(p->p_slots);
+    free(p);
+    return NULL;
+  }
+
+  s->s_poster = p;
+
+  return p;
+}
+
+void stop_poster_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_shared *s;
+  struct katcp_poster *p;
+  struct katcp_arb *a;
+
+  s = d->d_shared;
+  if((s == NULL) || (s->s_poster == NULL)){
+    return;
+  }
+
+  p = s->s_poster;
+
+  /* WARNING: producers have to be stopped by now, pending updates are discarded */
+
+  a = find_arb_katcp(d, KATCP_POSTER_NAME);
+  if(a){
+    unlink_arb_katcp(d, a);
+  }
+
+  close(p->p_pipe[1]);
+
+  free(p->p_slots);
+  free(p);
+
+  s->s_poster = NULL;
+}
+
+static struct katcp_update *claim_update_katcp(struct katcp_poster *p)
+{
+  struct katcp_update *u;
+  unsigned long position, sequence;
+  long delta;
+
+  position = __atomic_load_n(&(p->p_tail), __ATOMIC_RELAXED);
+
+  for(;;){
+    u = &(p->p_slots[position & p->p_mask]);
+    sequence = __atomic_load_n(&(u->u_sequence), __ATOMIC_ACQUIRE);
+    delta = (long)(sequence - position);
+
+    if(delta == 0){
+      if(__atomic_compare_exchange_n(&(p->p_tail), &position, position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+        return u;
+      }
+      /* failed exchange reloaded position */
+    } else if(delta < 0){
+      /* slot not yet drained since the previous lap */
+      __atomic_add_fetch(&(p->p_dropped), 1, __ATOMIC_RELAXED);
+      return NULL;
+    } else {
+      position = __atomic_load_n(&(p->p_tail), __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static void publish_update_katcp(struct katcp_poster *p, struct katcp_update *u, struct katcp_acquire *a, struct timeval *when)
+{
+  u->u_acquire = a;
+
+  if(when){
+    u->u_when = *when;
+  } else {
+    gettimeofday(&(u->u_when), NULL);
+  }
+
+  /* the slot index is the claimed position, so sequence is position + 1 */
+  __atomic_store_n(&(u->u_sequence), u->u_sequence + 1, __ATOMIC_RELEASE);
+
+  if(__atomic_exchange_n(&(p->p_wake), 1, __ATOMIC_ACQ_REL) == 0){
+    /* a full pipe is already readable, so a failure here is harmless */
+    if(write(p->p_pipe[1], "", 1) < 0){
+#ifdef DEBUG
+      fprintf(stderr, "poster: unable to signal loop: %s\n", strerror(errno));
+#endif
+    }
+  }
+}
+
+/* may be called from any thread, the acquire has to outlive the poster */
+
+int post_integer_acquire_katcp(struct katcp_poster *p, struct katcp_acquire *a, int value, struct timeval *when)
+{
+  struct katcp_update *u;
+
+  u = claim_update_katcp(p);
+  if(u == NULL){
+    return -1;
+  }
+
+  u->u_integer = value;
+
+  publish_update_katcp(p, u, a, when);
+
+  return 0;
+}
+
+#ifdef KATCP_USE_FLOATS
+int post_double_acquire_katcp(struct katcp_poster *p, struct katcp_acquire *a, double value, struct timeval *when)
+{
+  struct katcp_update *u;
+
+  u = claim_update_katcp(p);
+  if(u == NULL){
+    return -1;
+  }
+
+  u->u_double = value;
+
+  publish_update_katcp(p, u, a, when);
+
+  return 0;
+}
+#endif
@@ -61,7 +61,7 @@ struct katcl_queue *create_queue_katcl(void)
 {
   struct katcl_queue *q;
 
-  q = malloc(sizeof(struct katcl_queue));
+  q = malloc_memory_katcp(KATCP_MEMORY_QUEUE, sizeof(struct katcl_queue));
   if(q == NULL){
     fprintf(stderr, "unable to create parse\n");
     return NULL;
@@ -85,7 +85,7 @@ void destroy_queue_katcl(struct katcl_queue *q)
   }
 
   if(q->q_queue){
-    free(q->q_queue);
+    free_memory_katcp(KATCP_MEMORY_QUEUE, q->q_queue, sizeof(struct katcl_parse *) * q->q_size);
     q->q_queue = NULL;
   }
 
@@ -93,7 +93,7 @@ void destroy_queue_katcl(struct katcl_queue *q)
   q->q_size = 0;
   q->q_head = 0;
 
-  free(q);
+  free_memory_katcp(KATCP_MEMORY_QUEUE, q, sizeof(struct katcl_queue));
 }
 
 void clear_queue_katcl(struct katcl_queue *q)
@@ -146,7 +146,7 @@ int add_tail_queue_katcl(struct katcl_queue *q, struct katcl_parse *p)
       abort();
     }
 #endif
-    tmp = realloc(q->q_queue, sizeof(struct katcl_parse *) * (q->q_size + 1));
+    tmp = realloc_memory_katcp(KATCP_MEMORY_QUEUE, q->q_queue, sizeof(struct katcl_parse *) * q->q_size, sizeof(struct katcl_parse *) * (q->q_size + 1));
 
     if(tmp == NULL){
       return -1;
@@ -181,7 +181,7 @@ struct katcl_parse *get_index_queue_katcl(struct katcl_queue *q, unsigned int in
 {
   unsigned int wrap;
 
-  if((q->q_count == 0) || (q->q_size == 0) || (q->q_count >= q->q_size)){
+  if((q->q_count == 0) || (q->q_size == 0) || (q->q_count > q->q_size)){
     return NULL;
   }
 
@@ -198,6 +198,30 @@ struct katcl_parse *get_head_queue_katcl(struct katcl_queue *q)
   return (q->q_count > 0) ? q->q_queue[q->q_head] : NULL;
 }
 
+struct katcl_parse *replace_index_queue_katcl(struct katcl_queue *q, unsigned int index, struct katcl_parse *p)
+{
+  unsigned int wrap;
+  struct katcl_parse *old, *px;
+
+  /* WARNING: adds a reference to p, caller has to release the returned entry */
+
+  if(index >= q->q_count){
+    return NULL;
+  }
+
+  px = copy_parse_katcl(p);
+  if(px == NULL){
+    return NULL;
+  }
+
+  wrap = (q->q_head + index) % q->q_size;
+
+  old = q->q_queue[wrap];
+  q->q_queue[wrap] = px;
+
+  return old;
+}
+
 /*************************************************************************/
 
 struct katcl_parse *remove_index_queue_katcl(struct katcl_queue *q, unsigned int index)
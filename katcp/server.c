@@ -1,5 +1,6 @@
 /* (c) 2010,2011 SKA SA */
 /* Released under the GNU GPLv3 - see COPYING */
+#define _GNU_SOURCE
 
 #include <errno.h>
 #include <signal.h>
@@ -58,6 +59,110 @@ int inform_client_connections_katcp(struct katcp_dispatch *d, char *type)
   return 0;
 }
 
+static int client_limit_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_shared *s;
+  struct katcl_line *l;
+  char *ptr;
+  int policy, fallback, index;
+  unsigned int high, low;
+
+  s = d->d_shared;
+  if(s == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  l = line_katcp(d);
+
+  index = 1;
+  fallback = 0;
+
+  ptr = (argc > index) ? arg_string_katcp(d, index) : NULL;
+  if(ptr && !strcmp(ptr, "default")){
+    fallback = 1;
+    index++;
+  }
+
+  if(argc <= index){
+    if(fallback){
+      log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "new clients %s at %u messages, until back at %u", limit_to_string_katcl(s->s_limit_policy), s->s_limit_high, s->s_limit_low);
+    } else if(l){
+      log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "this client %s at %u messages, until back at %u, has %u queued and shed %lu", limit_to_string_katcl(l->l_policy), l->l_high, l->l_low, queued_katcl(l), shed_katcl(l));
+    }
+    return KATCP_RESULT_OK;
+  }
+
+  ptr = arg_string_katcp(d, index);
+  policy = limit_to_code_katcl(ptr);
+  if(policy < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown queue policy %s, expected none, latest, drop or disconnect", ptr ? ptr : "<null>");
+    return KATCP_RESULT_FAIL;
+  }
+  index++;
+
+  high = (argc > index) ? arg_unsigned_long_katcp(d, index) : KATCP_LIMIT_HIGH;
+  index++;
+  low = (argc > index) ? arg_unsigned_long_katcp(d, index) : (high / 2);
+
+  if(fallback){
+    if(low > high){
+      low = high;
+    }
+    s->s_limit_policy = (high > 0) ? policy : KATCL_LIMIT_NONE;
+    s->s_limit_high = high;
+    s->s_limit_low = low;
+    return KATCP_RESULT_OK;
+  }
+
+  if((l == NULL) || (limit_katcl(l, policy, high, low) < 0)){
+    return KATCP_RESULT_FAIL;
+  }
+
+  return KATCP_RESULT_OK;
+}
+
+static int client_tagged_cmd_katcp(struct katcp_dispatch *d, int argc)
+{
+  struct katcp_shared *s;
+  char *ptr;
+  int fallback, index;
+  unsigned int limit;
+
+  s = d->d_shared;
+  if(s == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  index = 1;
+  fallback = 0;
+
+  ptr = (argc > index) ? arg_string_katcp(d, index) : NULL;
+  if(ptr && !strcmp(ptr, "default")){
+    fallback = 1;
+    index++;
+  }
+
+  if(argc <= index){
+    if(fallback){
+      log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "new clients may have %u tagged requests outstanding", s->s_hold_limit);
+    } else {
+      log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "this client may have %u tagged requests outstanding, has %u", d->d_hold_limit, d->d_holding);
+    }
+    return KATCP_RESULT_OK;
+  }
+
+  /* zero makes tagged requests pause the client like untagged ones */
+  limit = arg_unsigned_long_katcp(d, index);
+
+  if(fallback){
+    s->s_hold_limit = limit;
+  } else {
+    d->d_hold_limit = limit;
+  }
+
+  return KATCP_RESULT_OK;
+}
+
 static int client_list_cmd_katcp(struct katcp_dispatch *d, int argc)
 {
   struct katcp_shared *s;
@@ -89,7 +194,10 @@ static int client_list_cmd_katcp(struct katcp_dispatch *d, int argc)
         level = log_to_string_katcl(dx->d_level);
         append_string_katcp(d, KATCP_FLAG_STRING, level ? level : "unknown");
 
-        append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, dx->d_pause ? "paused" : "parsing");
+        append_string_katcp(d, KATCP_FLAG_STRING, dx->d_pause ? "paused" : "parsing");
+
+        append_unsigned_long_katcp(d, KATCP_FLAG_ULONG, dx->d_line ? queued_katcl(dx->d_line) : 0);
+        append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, dx->d_line ? shed_katcl(dx->d_line) : 0);
 
       } else {
         append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, dx->d_name);
@@ -251,6 +359,7 @@ void add_client_server_katcp(struct katcp_dispatch *dl, int fd, char *label)
   log_message_katcp(dl, KATCP_LEVEL_INFO, NULL, "new client connection %s", label);
 
   fcntl(fd, F_SETFD, FD_CLOEXEC);
+  forget_poll_katcp(s, fd);
 
   dx = s->s_clients[s->s_used];
   s->s_used++;
@@ -266,24 +375,66 @@ void add_client_server_katcp(struct katcp_dispatch *dl, int fd, char *label)
 #endif
 }
 
-void perforate_client_server_katcp(struct katcp_dispatch *dl)
+static int accept_clients_server_katcp(struct katcp_dispatch *dl)
 {
+#define LABEL_BUFFER 32
   struct katcp_shared *s;
-  struct katcp_dispatch *dx;
+  struct sockaddr_storage sa;
+  socklen_t len;
+  char label[LABEL_BUFFER];
+  unsigned int more;
+  int nfd, count;
+#ifndef SOCK_NONBLOCK
+  long opts;
+#endif
 
   s = dl->d_shared;
 
-  if(s->s_used >= s->s_count){
-
-    dx = s->s_clients[(unsigned int)rand() % s->s_count];
+  for(count = 0; count < KATCP_ACCEPT_BATCH; count++){
 
-    basic_inform_katcp(dx, KATCP_CLIENT_DISCONNECT, "overloaded");
+    if(s->s_used >= s->s_count){
+      more = (s->s_count > 1) ? (s->s_count / 2) : 1;
+      if(grow_clients_shared_katcp(dl, more) <= 0){
+        /* rather than displacing somebody, leave the connection queued until a slot frees up */
+        log_message_katcp(dl, KATCP_LEVEL_WARN, NULL, "unable to accept more connections with %u clients", s->s_used);
+        break;
+      }
+      log_message_katcp(dl, KATCP_LEVEL_DEBUG, NULL, "client table now has space for %u connections", s->s_count);
+    }
 
-    terminate_katcp(dx, KATCP_EXIT_QUIT);
-#if 0
-    on_disconnect_katcp(dx, "displaced by new client connection");
+    len = sizeof(struct sockaddr_storage);
+#ifdef SOCK_NONBLOCK
+    nfd = accept4(s->s_lfd, (struct sockaddr *) &sa, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    nfd = accept(s->s_lfd, (struct sockaddr *) &sa, &len);
+    if(nfd >= 0){
+      opts = fcntl(nfd, F_GETFL, NULL);
+      if(opts >= 0){
+        fcntl(nfd, F_SETFL, opts | O_NONBLOCK);
+      }
+    }
 #endif
+
+    if(nfd < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR :
+        case ECONNABORTED :
+          break;
+        default :
+          log_message_katcp(dl, KATCP_LEVEL_WARN, NULL, "unable to accept new connection: %s", strerror(errno));
+          break;
+      }
+      break;
+    }
+
+    net_label(label, LABEL_BUFFER, (struct sockaddr *) &sa, nfd);
+
+    add_client_server_katcp(dl, nfd, label);
   }
+
+  return count;
+#undef LABEL_BUFFER
 }
 
 static int update_flags_katcp(struct katcp_dispatch *d, int argc, int flags)
@@ -421,8 +572,8 @@ int system_info_cmd_katcp(struct katcp_dispatch *d, int argc)
   struct tm *when;
   time_t now, delta;
   struct katcp_shared *s;
-  unsigned long hours;
-  unsigned int minutes, seconds;
+  unsigned long hours, hits, misses;
+  unsigned int minutes, seconds, held;
 
   s = d->d_shared;
 
@@ -459,6 +610,9 @@ int system_info_cmd_katcp(struct katcp_dispatch *d, int argc)
 
   log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "%d %s scheduled", s->s_length, (s->s_length == 1) ? "timer" : "timers");
 
+  stats_pool_parse_katcl(&held, &hits, &misses);
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "%u %s pooled after %lu reuses and %lu allocations", held, (held == 1) ? "message" : "messages", hits, misses);
+
   return KATCP_RESULT_OK;
 #undef BUFFER
 }
@@ -521,6 +675,12 @@ int prepare_core_loop_katcp(struct katcp_dispatch *dl)
   add_code_version_katcp(dl);
   add_kernel_version_katcp(dl);
 
+  s->s_coalesce = 1;
+
+  if(start_health_katcp(dl) < 0){
+    log_message_katcp(dl, KATCP_LEVEL_WARN, NULL, "unable to set up event loop health monitoring");
+  }
+
   /* extra commands, not really part of the standard */
   register_flag_mode_katcp(dl, "?setenv",  "sets/clears an enviroment variable (?setenv [label [value]]", &setenv_cmd_katcp, KATCP_CMD_HIDDEN, 0);
   register_flag_mode_katcp(dl, "?chdir",   "change directory (?chdir directory)", &chdir_cmd_katcp, KATCP_CMD_HIDDEN, 0);
@@ -535,11 +695,12 @@ int prepare_core_loop_katcp(struct katcp_dispatch *dl)
   register_flag_mode_katcp(dl, "?arb",     "arbitrary callback manipulation (?arb [list]", &arb_cmd_katcp, 0, 0);
 
 #ifdef KATCP_SUBPROCESS
-  register_flag_mode_katcp(dl, "?job",     "job operations (?job [list|process notice-name exec://executable-file|network notice-name katcp://net-host:remote-port|watchdog job-name|match job-name inform-message|stop job-name])", &job_cmd_katcp, 0, 0);
+  register_flag_mode_katcp(dl, "?job",     "job operations (?job [list|process notice-name exec://executable-file|network notice-name katcp://net-host:remote-port|share katcp://net-host:remote-port|release job-name|window job-name count|watchdog job-name|match job-name inform-message|stop job-name])", &job_cmd_katcp, 0, 0);
   register_flag_mode_katcp(dl, "?process", "register a process command (?process executable help-string [mode]", &register_subprocess_cmd_katcp, 0, 0);
-  register_flag_mode_katcp(dl, "?sensor",  "sensor operations (?sensor [list|create|relay job-name])", &sensor_cmd_katcp, 0, 0);
+  register_flag_mode_katcp(dl, "?pool",    "persistent subprocess pools (?pool [list|start name size executable [args]|recycle name count|stop name])", &pool_cmd_katcp, 0, 0);
+  register_flag_mode_katcp(dl, "?sensor",  "sensor operations (?sensor [list|create|history|relay job-name])", &sensor_cmd_katcp, 0, 0);
 #else
-  register_flag_mode_katcp(dl, "?sensor",  "sensor operations (?sensor [list|create])", &sensor_cmd_katcp, 0, 0);
+  register_flag_mode_katcp(dl, "?sensor",  "sensor operations (?sensor [list|create|history])", &sensor_cmd_katcp, 0, 0);
 #endif
   register_flag_mode_katcp(dl, "?version", "version operations (?sensor [add module version [mode]|remove module])", &version_cmd_katcp, 0, 0);
 
@@ -552,22 +713,14 @@ int prepare_core_loop_katcp(struct katcp_dispatch *dl)
 
   time(&(s->s_start));
 
-  /* used to randomly select a client to displace when a new connection arrives and table is full */
-  srand(getpid());
-
   return 0;
 }
 
 int run_core_loop_katcp(struct katcp_dispatch *dl)
 {
-#define LABEL_BUFFER 32
-  int run, nfd, result, suspend;
-  unsigned int len;
-  struct sockaddr_in sa;
+  int run, result, suspend;
   struct timespec delta;
   struct katcp_shared *s;
-  char label[LABEL_BUFFER];
-  long opts;
 
   s = dl->d_shared;
 
@@ -577,8 +730,9 @@ int run_core_loop_katcp(struct katcp_dispatch *dl)
   run = 1;
 
   while(run){
-    FD_ZERO(&(s->s_read));
-    FD_ZERO(&(s->s_write));
+    TRACE_KATCP(KATCP_TRACE_LOOP, s->s_used, NULL);
+
+    reset_poll_katcp(s);
 
 #if 0
     gettimeofday(&now, NULL);
@@ -586,15 +740,17 @@ int run_core_loop_katcp(struct katcp_dispatch *dl)
     future.tv_usec = now.tv_usec;
 #endif
 
-    s->s_max = (-1);
-
     suspend = run_timers_katcp(dl, &delta);
+    mark_phase_katcp(s, KATCP_PHASE_TIMERS);
+
+    /* before the load phase, so that updates queued here (or after the last wait) get written out in this pass */
+    flush_acquires_katcp(dl);
+    mark_phase_katcp(s, KATCP_PHASE_SENSORS);
 
     if(run > 0){ /* only bother with new connections if not stopping */
       if(s->s_lfd >= 0){
-        FD_SET(s->s_lfd, &(s->s_read));
-        if(s->s_lfd > s->s_max){
-          s->s_max = s->s_lfd;
+        if((s->s_used < s->s_count) || (s->s_count < s->s_ceiling)){ /* otherwise leave connections in backlog */
+          want_poll_katcp(s, s->s_lfd, KATCP_POLL_READ);
         }
       } else {
         if(s->s_used <= 0){ /* if we are not listening, and we have run out of clients, shut down too */
@@ -639,7 +795,7 @@ int run_core_loop_katcp(struct katcp_dispatch *dl)
       delta.tv_nsec = 0;
 
       suspend = 0;
-      FD_ZERO(&(s->s_read));
+      drop_poll_katcp(s, KATCP_POLL_READ);
     }
     
     if(s->s_busy > 0){
@@ -656,8 +812,11 @@ int run_core_loop_katcp(struct katcp_dispatch *dl)
     }
 #endif
 
+    mark_phase_katcp(s, KATCP_PHASE_LOAD);
+
     /* delta now timespec, not timeval */
-    result = pselect(s->s_max + 1, &(s->s_read), &(s->s_write), NULL, suspend ? NULL : &delta, &(s->s_mask_current));
+    result = wait_poll_katcp(s, suspend ? NULL : &delta);
+    mark_phase_katcp(s, KATCP_PHASE_WAIT);
 #ifdef DEBUG
     fprintf(stderr, "multi: select=%d, used=%d\n", result, s->s_used);
 #endif
@@ -666,8 +825,7 @@ int run_core_loop_katcp(struct katcp_dispatch *dl)
 
     if(result < 0){
 
-      FD_ZERO(&(s->s_read));
-      FD_ZERO(&(s->s_write));
+      clear_ready_poll_katcp(s);
 
       switch(errno){
         case EAGAIN :
@@ -691,50 +849,38 @@ int run_core_loop_katcp(struct katcp_dispatch *dl)
 #ifdef KATCP_SUBPROCESS
       wait_jobs_katcp(dl);
 #endif
+      mark_phase_katcp(s, KATCP_PHASE_JOBS);
     }
 
 #ifdef KATCP_EXPERIMENTAL
     /* WARNING: new logic */
     run_flat_katcp(dl);
+    mark_phase_katcp(s, KATCP_PHASE_FLATS);
 #endif
 
 #ifdef KATCP_EXPERIMENTAL 
     run_endpoints_katcp(dl);
+    mark_phase_katcp(s, KATCP_PHASE_ENDPOINTS);
 #endif
 
     run_shared_katcp(dl);
+    mark_phase_katcp(s, KATCP_PHASE_CLIENTS);
 #ifdef KATCP_SUBPROCESS
     run_jobs_katcp(dl);
+    mark_phase_katcp(s, KATCP_PHASE_JOBS);
 #endif
     run_notices_katcp(dl);
+    mark_phase_katcp(s, KATCP_PHASE_NOTICES);
     run_arb_katcp(dl);
+    mark_phase_katcp(s, KATCP_PHASE_ARBS);
 
-    if(FD_ISSET(s->s_lfd, &(s->s_read))){
-      if(s->s_used < s->s_count){
-
-        len = sizeof(struct sockaddr_in);
-        nfd = accept(s->s_lfd, (struct sockaddr *) &sa, &len);
-
-        if(nfd >= 0){
-          snprintf(label, LABEL_BUFFER, "%s:%d", inet_ntoa(sa.sin_addr), ntohs(sa.sin_port));
-          label[LABEL_BUFFER - 1] = '\0';
-
-          add_client_server_katcp(dl, nfd, label);
-        }
-
-#if 1
-        opts = fcntl(nfd, F_GETFL, NULL);
-        if(opts >= 0){
-          opts = fcntl(nfd, F_SETFL, opts | O_NONBLOCK);
-        }
-#endif
-
-      } else {
-        /* WARNING: will run a busy loop, terminating one entry each cycle until space becomes available. We expect an exit to happen quickly, otherwise this could empty out all clients (though there is a backoff, since we pick a slot randomly) */
-        perforate_client_server_katcp(dl);
-      }
+    if(ready_poll_katcp(s, s->s_lfd, KATCP_POLL_READ)){
+      accept_clients_server_katcp(dl);
+      mark_phase_katcp(s, KATCP_PHASE_CLIENTS);
     }
 
+    finish_pass_katcp(s);
+
   }
 
 #ifdef DEBUG
@@ -745,7 +891,6 @@ int run_core_loop_katcp(struct katcp_dispatch *dl)
   undo_signals_shared_katcp(s);
 
   return (exited_katcp(dl) == KATCP_EXIT_ABORT) ? (-1) : 0;
-#undef LABEL_BUFFER
 }
 
 int run_pipe_server_katcp(struct katcp_dispatch *dl, char *file, int pfd)
@@ -787,6 +932,7 @@ int run_pipe_server_katcp(struct katcp_dispatch *dl, char *file, int pfd)
 int run_config_server_katcp(struct katcp_dispatch *dl, char *file, int count, char *host, int port)
 {
   int fd, result;
+  struct katcp_shared *s;
 
   if(count <= 0){
 #ifdef DEBUG
@@ -802,6 +948,11 @@ int run_config_server_katcp(struct katcp_dispatch *dl, char *file, int count, ch
     return terminate_katcp(dl, KATCP_EXIT_ABORT);
   }
 
+  s = dl->d_shared;
+  if(s->s_ceiling == 0){ /* single client servers keep their single client */
+    max_clients_katcp(dl, (count > 1) ? KATCP_CLIENT_CEILING : count);
+  }
+
   if(prepare_core_loop_katcp(dl) < 0){
 #ifdef DEBUG
     fprintf(stderr, "server: need a natural number of clients, not %d\n", count);
@@ -813,7 +964,9 @@ int run_config_server_katcp(struct katcp_dispatch *dl, char *file, int count, ch
 #ifdef DEBUG
     fprintf(stderr, "multi: more than one client, registering client list\n");
 #endif
-    register_katcp(dl, "?client-list", "displays client list (?client-list)", &client_list_cmd_katcp);
+    register_katcp(dl, "?client-list", "displays client list (?client-list [detailed])", &client_list_cmd_katcp);
+    register_katcp(dl, "?client-limit", "bounds the output queue of this or new clients (?client-limit [default] [none|latest|drop|disconnect [high [low]]])", &client_limit_cmd_katcp);
+    register_katcp(dl, "?client-tagged", "bounds the tagged requests this or new clients may have outstanding (?client-tagged [default] [count])", &client_tagged_cmd_katcp);
   }
 
   if(file){
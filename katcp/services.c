@@ -23,6 +23,9 @@ int startup_services_katcp(struct katcp_dispatch *d)
 
   rtn += register_name_type_katcp(d, KATCP_TYPE_TAG, KATCP_DEP_BASE, &print_tag_katcp, &destroy_tag_katcp, NULL, &compare_tag_katcp, &parse_tag_katcp, &getkey_tag_katcp);
 
+  /* entries by schema, kept in the same sets as tags */
+  rtn += register_name_type_katcp(d, KATCP_TYPE_SCHEMA, KATCP_DEP_BASE, &print_tag_katcp, &destroy_tag_katcp, NULL, &compare_tag_katcp, &parse_tag_katcp, &getkey_tag_katcp);
+
   rtn += register_katcp(d, KATCP_DICT_REQUEST, "dict [key] {key0:value0,key1:value1,...}", &dict_cmd_katcp);
 
   rtn += register_katcp(d, KATCP_GET_REQUEST, "get [key] (n) from database (n optional)", &get_dbase_cmd_katcp);
@@ -30,6 +33,11 @@ int startup_services_katcp(struct katcp_dispatch *d)
 
   rtn += register_katcp(d, KATCP_SEARCH_REQUEST, "search [tag1 tag2 ...]", &search_cmd_katcp);
 
+  rtn += register_katcp(d, "?dbase-query", "list the entries with all the tags and schema given (?dbase-query [tag=name ...] [schema=name])", &query_dbase_cmd_katcp);
+  rtn += register_katcp(d, "?dbase-delete", "remove an entry from the database (?dbase-delete key)", &delete_dbase_cmd_katcp);
+
+  rtn += register_katcp(d, "?dbase-journal", "display or open the file persisting the database (?dbase-journal [path])", &journal_dbase_cmd_katcp);
+
   return rtn;
 }
 
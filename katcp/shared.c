@@ -137,6 +137,7 @@ int undo_signals_shared_katcp(struct katcp_shared *s)
 int startup_shared_katcp(struct katcp_dispatch *d)
 {
   struct katcp_shared *s;
+  unsigned int i;
 
   s = malloc(sizeof(struct katcp_shared));
   if(s == NULL){
@@ -145,6 +146,18 @@ int startup_shared_katcp(struct katcp_dispatch *d)
 
   s->s_magic = SHARED_MAGIC;
   s->s_default = KATCP_LEVEL_INFO;
+  s->s_log_floor = KATCP_LEVEL_TRACE; /* raised at the first broadcast */
+  s->s_log_ring = NULL;
+
+  memset(s->s_log_sites, 0, sizeof(struct katcp_log_site) * KATCP_LOG_SITES);
+  s->s_log_rate = KATCP_LOG_RATE;
+  s->s_log_burst = KATCP_LOG_BURST;
+  s->s_log_flushing = 0;
+
+  s->s_limit_policy = KATCL_LIMIT_NONE;
+  s->s_limit_high = 0;
+  s->s_limit_low = 0;
+  s->s_hold_limit = KATCP_HOLD_LIMIT;
 
   s->s_vector = NULL;
 
@@ -157,6 +170,10 @@ int startup_shared_katcp(struct katcp_dispatch *d)
   s->s_posthook = NULL;
 
   s->s_commands = NULL;
+  s->s_table = NULL;
+  s->s_slots = 0;
+  s->s_named = 0;
+  s->s_wild = NULL;
 
   s->s_mode_sensor = NULL;
   s->s_mode = 0;
@@ -171,6 +188,14 @@ int startup_shared_katcp(struct katcp_dispatch *d)
 
   s->s_count = 0;
   s->s_used = 0;
+  s->s_ceiling = 0;
+
+  s->s_owners = NULL;
+  s->s_span = 0;
+
+  s->s_active = NULL;
+  s->s_visits = 0;
+  s->s_seats = 0;
 
   s->s_lfd = (-1);
 
@@ -180,10 +205,19 @@ int startup_shared_katcp(struct katcp_dispatch *d)
 #endif
 
   s->s_tasks = NULL;
+  s->s_pools = NULL;
+  s->s_pooled = 0;
   s->s_number = 0;
 
   s->s_queue = NULL;
   s->s_length = 0;
+  s->s_room = 0;
+
+  s->s_timers = NULL;
+  s->s_buckets = 0;
+
+  s->s_due = NULL;
+  s->s_pass = 0;
 
   s->s_extras = NULL;
   s->s_total = 0;
@@ -191,6 +225,13 @@ int startup_shared_katcp(struct katcp_dispatch *d)
   s->s_notices = NULL;
   s->s_pending = 0;
 
+  s->s_titles = NULL;
+  s->s_titled = 0;
+  s->s_lookup = NULL;
+  s->s_lookups = 0;
+  s->s_woken = NULL;
+  s->s_queued = 0;
+
   s->s_busy = 0;
 
   s->s_groups = NULL;
@@ -198,7 +239,12 @@ int startup_shared_katcp(struct katcp_dispatch *d)
   s->s_this = NULL;
   s->s_members = 0;
 
+  s->s_flat_quantum = KATCP_FLAT_QUANTUM;
+  s->s_flat_burst = KATCP_FLAT_BURST;
+
   s->s_endpoints = NULL;
+  s->s_spare = NULL;
+  s->s_spares = 0;
 
   s->s_build_state = NULL;
   s->s_build_items = 0;
@@ -214,12 +260,37 @@ int startup_shared_katcp(struct katcp_dispatch *d)
 
   s->s_sensors = NULL;
   s->s_tally = 0;
+  s->s_index = NULL;
+  s->s_bins = 0;
+
+  s->s_coalesce = 0;
+  s->s_sequence = 0;
+  s->s_dirty = NULL;
+  s->s_stale = 0;
+  s->s_spots = 0;
+
+  s->s_workers = NULL;
+  s->s_poster = NULL;
+  s->s_journal = NULL;
 
-  FD_ZERO(&(s->s_read));
-  FD_ZERO(&(s->s_write));
+  s->s_health.h_ready = 0;
+
+  for(i = 0; i < KATCP_CACHE_KINDS; i++){
+    s->s_cache[i].c_vector = NULL;
+    s->s_cache[i].c_count = 0;
+    s->s_cache[i].c_mode = 0;
+    s->s_cache[i].c_valid = 0;
+  }
+
+  s->s_poll = NULL;
+  if(startup_poll_katcp(s) < 0){
+    free(s);
+    return -1;
+  }
 
   s->s_vector = malloc(sizeof(struct katcp_entry));
   if(s->s_vector == NULL){
+    shutdown_poll_katcp(s);
     free(s);
     return -1;
   }
@@ -340,14 +411,33 @@ void shutdown_shared_katcp(struct katcp_dispatch *d)
 
   destroy_notices_katcp(d);
 
+#ifdef KATCP_SUBPROCESS
+  destroy_pools_katcp(d); /* members are referenced by notices */
+#endif
+
   /* WARNING: s_mode_sensor used to leak, hopefully fixed now */
   s->s_mode_sensor = NULL;
+  s->s_coalesce = 0;
+  stop_poster_katcp(d); /* pending updates refer to acquires */
   destroy_sensors_katcp(d);
 
+  if(s->s_dirty){
+    free(s->s_dirty);
+    s->s_dirty = NULL;
+  }
+  s->s_stale = 0;
+  s->s_spots = 0;
+
   destroy_versions_katcp(d);
+
+  close_journal_dbase_katcp(d); /* index only, entries are released with their types */
+
+  ring_log_katcp(d, 0, KATCP_LEVEL_TRACE);
   
   destroy_type_list_katcp(d);
 
+  stop_workers_katcp(d); /* before arbs, one of which belongs to the workers */
+
   destroy_arbs_katcp(d);
 
   while(s->s_count > 0){
@@ -373,6 +463,19 @@ void shutdown_shared_katcp(struct katcp_dispatch *d)
   s->s_clients = NULL;
   s->s_template = NULL;
 
+  if(s->s_owners){
+    free(s->s_owners);
+    s->s_owners = NULL;
+  }
+  s->s_span = 0;
+
+  if(s->s_active){
+    free(s->s_active);
+    s->s_active = NULL;
+  }
+  s->s_visits = 0;
+  s->s_seats = 0;
+
   while(s->s_commands != NULL){
     c = s->s_commands;
     s->s_commands = c->c_next;
@@ -380,6 +483,16 @@ void shutdown_shared_katcp(struct katcp_dispatch *d)
     shutdown_cmd_katcp(c);
   }
 
+  destroy_caches_katcp(s);
+
+  if(s->s_table){
+    free(s->s_table);
+    s->s_table = NULL;
+  }
+  s->s_slots = 0;
+  s->s_named = 0;
+  s->s_wild = NULL;
+
   s->s_mode = 0;
   s->s_flaky = 1;
 
@@ -434,6 +547,11 @@ void shutdown_shared_katcp(struct katcp_dispatch *d)
 
   /* restore signal handlers if we messed with them */
   undo_signals_shared_katcp(s);
+
+  shutdown_poll_katcp(s);
+
+  /* give back recycled messages, useful when checking for leaks */
+  drain_pool_parse_katcl();
   
   free(s);
 }
@@ -475,6 +593,7 @@ static void release_clone(struct katcp_dispatch *d)
 
   inform_client_connections_katcp(d, KATCP_CLIENT_DISCONNECT); /* will not send to itself */
 
+  forget_poll_katcp(s, fileno_katcl(d->d_line));
   reset_katcp(d, -1);
 
 #ifdef DEBUG
@@ -550,10 +669,77 @@ int link_shared_katcp(struct katcp_dispatch *d, struct katcp_dispatch *cd)
 
 /***********************************************************************/
 
+#define KATCP_OWNER_INC 64
+
+static void visit_shared_katcp(struct katcp_shared *s, struct katcp_dispatch *dx)
+{
+  if(dx->d_visit){
+    return;
+  }
+
+#ifdef KATCP_CONSISTENCY_CHECKS
+  if(s->s_visits >= s->s_seats){
+    fprintf(stderr, "visit: logic problem: active list full at %u\n", s->s_visits);
+    abort();
+  }
+#endif
+
+  dx->d_visit = 1;
+  s->s_active[s->s_visits] = dx;
+  s->s_visits++;
+}
+
+static int own_shared_katcp(struct katcp_shared *s, int fd, struct katcp_dispatch *dx)
+{
+  struct katcp_dispatch **tmp;
+  unsigned int size, i;
+
+  if(fd >= s->s_span){
+    size = ((fd / KATCP_OWNER_INC) + 1) * KATCP_OWNER_INC;
+    tmp = realloc(s->s_owners, sizeof(struct katcp_dispatch *) * size);
+    if(tmp == NULL){
+      return -1;
+    }
+    for(i = s->s_span; i < size; i++){
+      tmp[i] = NULL;
+    }
+    s->s_owners = tmp;
+    s->s_span = size;
+  }
+
+  s->s_owners[fd] = dx;
+
+  return 0;
+}
+
+static struct katcp_dispatch *owner_shared_katcp(struct katcp_shared *s, int fd)
+{
+  struct katcp_dispatch *dx;
+
+  if((fd < 0) || (fd >= s->s_span)){
+    return NULL;
+  }
+
+  dx = s->s_owners[fd];
+  if(dx == NULL){
+    return NULL;
+  }
+
+  /* entries are not cleared on release, so fd may have gone to a job or a new client meanwhile */
+  if((dx->d_clone < 0) || (dx->d_clone >= s->s_used) || (s->s_clients[dx->d_clone] != dx)){
+    return NULL;
+  }
+  if(fileno_katcl(dx->d_line) != fd){
+    return NULL;
+  }
+
+  return dx;
+}
+
 int load_shared_katcp(struct katcp_dispatch *d)
 {
   struct katcp_shared *s;
-  struct katcp_dispatch *dx;
+  struct katcp_dispatch *dx, **tmp;
   int i, result, fd, status;
 
   sane_shared_katcp(d);
@@ -568,6 +754,16 @@ int load_shared_katcp(struct katcp_dispatch *d)
 
   result = exiting_katcp(d) ? (-1) : 0;
 
+  if(s->s_seats < s->s_count){
+    tmp = realloc(s->s_active, sizeof(struct katcp_dispatch *) * s->s_count);
+    if(tmp){
+      s->s_active = tmp;
+      s->s_seats = s->s_count;
+    } /* else run falls back to visiting everybody */
+  }
+
+  s->s_visits = 0;
+
   /* WARNING: all clients contiguous */
   for(i = 0; i < s->s_used; i++){
     dx = s->s_clients[i];
@@ -579,6 +775,18 @@ int load_shared_katcp(struct katcp_dispatch *d)
     }
 #endif
 
+    dx->d_visit = 0;
+
+    if(s->s_seats >= s->s_used){
+      /* io readiness is reported per fd, other reasons to run a client have to be caught here */
+      if((own_shared_katcp(s, fd, dx) < 0) || dx->d_wake || (exited_katcp(dx) != KATCP_EXIT_NOTYET) || overflowed_katcl(dx->d_line)){
+        visit_shared_katcp(s, dx);
+      }
+      if(dx->d_wake){
+        s->s_busy = 1; /* no io might follow, so don't wait around */
+      }
+    }
+
     status = exited_katcp(dx);
 #ifdef DEBUG
     fprintf(stderr, "load shared[%d]: status is %d, fd=%d\n", i, status, fd);
@@ -586,10 +794,7 @@ int load_shared_katcp(struct katcp_dispatch *d)
     switch(status){
       case KATCP_EXIT_NOTYET : /* still running */
         /* load up read fd */
-        FD_SET(fd, &(s->s_read));
-        if(fd > s->s_max){
-          s->s_max = fd;
-        }
+        want_poll_katcp(s, fd, KATCP_POLL_READ);
         break;
 
       case KATCP_EXIT_QUIT : /* only this connection is shutting down */
@@ -617,68 +822,108 @@ int load_shared_katcp(struct katcp_dispatch *d)
 #ifdef DEBUG
       fprintf(stderr, "load shared[%d]: want to flush data\n", i);
 #endif
-      FD_SET(fd, &(s->s_write));
-      if(fd > s->s_max){
-        s->s_max = fd;
-      }
+      want_poll_katcp(s, fd, KATCP_POLL_WRITE);
     }
   }
 
   return result;
 }
 
+static int run_client_shared_katcp(struct katcp_dispatch *d, struct katcp_dispatch *dx)
+{
+  struct katcp_shared *s;
+  int fd, result;
+
+  s = d->d_shared;
+  fd = fileno_katcl(dx->d_line);
+
+  dx->d_wake = 0;
+
+  if(ready_poll_katcp(s, fd, KATCP_POLL_WRITE) || overflowed_katcl(dx->d_line)){
+    if(write_katcp(dx) < 0){
+      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "write to %s failed: %s", dx->d_name, strerror(error_katcl(dx->d_line)));
+      release_clone(dx);
+      return -1; /* WARNING: after release_clone, dx will be invalid */
+    }
+  }
+
+  /* don't read or process if we are flushing on exit */
+  if(exited_katcp(dx)){
+    if(!flushing_katcp(dx)){
+      release_clone(dx);
+      return -1;
+    }
+    return 0;
+  }
+
+  if(ready_poll_katcp(s, fd, KATCP_POLL_READ)){
+    if((result = read_katcp(dx))){
+      if(result > 0){
+        log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "received end of file from %s", dx->d_name);
+      } else {
+        log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "read failed from %s: %s", dx->d_name, strerror(error_katcl(dx->d_line)));
+      }
+      release_clone(dx);
+      return -1;
+    }
+  }
+
+  if(dispatch_katcp(dx) < 0){
+    release_clone(dx);
+    return -1;
+  }
+
+  return 0;
+}
+
 int run_shared_katcp(struct katcp_dispatch *d)
 {
   struct katcp_shared *s;
   struct katcp_dispatch *dx;
-  int i, fd, result;
+  unsigned int cursor, i;
+  int fd;
 
   sane_shared_katcp(d);
   s = d->d_shared;
 
-  /* WARNING: all clients contiguous */
-  for(i = 0; i < s->s_used; i++){
-    dx = s->s_clients[i];
-    fd = fileno_katcl(dx->d_line);
-
+  if(s->s_seats < s->s_used){ /* unable to allocate active list, visit everybody as before */
+    for(i = 0; i < s->s_used; i++){
+      dx = s->s_clients[i];
 #ifdef DEBUG
-    fprintf(stderr, "run shared[%d/%d]: %p, fd=%d\n", i, s->s_used, dx, fd);
+      fprintf(stderr, "run shared[%d/%d]: %p, fd=%d\n", i, s->s_used, dx, fileno_katcl(dx->d_line));
 #endif
-
-    if(FD_ISSET(fd, &(s->s_write))){
-      if(write_katcp(dx) < 0){
-        log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "write to %s failed: %s", dx->d_name, strerror(error_katcl(dx->d_line)));
-        release_clone(dx);
-        continue; /* WARNING: after release_clone, dx will be invalid, forcing a continue */
-      }
+      run_client_shared_katcp(d, dx);
     }
+    return 0;
+  }
 
-    /* don't read or process if we are flushing on exit */
-    if(exited_katcp(dx)){
-      if(!flushing_katcp(dx)){
-        release_clone(dx);
-      }
-      continue;
+  /* add those clients reported by the poller to the ones load flagged */
+  cursor = 0;
+  while((fd = fired_poll_katcp(s, &cursor)) >= 0){
+    dx = owner_shared_katcp(s, fd);
+    if(dx){
+      visit_shared_katcp(s, dx);
     }
+  }
 
-    if(FD_ISSET(fd, &(s->s_read))){
-      if((result = read_katcp(dx))){
-        if(result > 0){
-          log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "received end of file from %s", dx->d_name);
-        } else {
-          log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "read failed from %s: %s", dx->d_name, strerror(error_katcl(dx->d_line)));
-        }
-        release_clone(dx);
-        continue;
-      }
-    }
+  for(i = 0; i < s->s_visits; i++){
+    dx = s->s_active[i];
+    dx->d_visit = 0;
 
-    if(dispatch_katcp(dx) < 0){
-      release_clone(dx);
+#ifdef DEBUG
+    fprintf(stderr, "run shared[%u/%u]: %p, fd=%d\n", i, s->s_visits, dx, fileno_katcl(dx->d_line));
+#endif
+
+    /* releases only affect the client being run, but accepts may have happened since load */
+    if((dx->d_clone < 0) || (dx->d_clone >= s->s_used) || (s->s_clients[dx->d_clone] != dx)){
       continue;
     }
+
+    run_client_shared_katcp(d, dx);
   }
 
+  s->s_visits = 0;
+
   return 0;
 }
 
@@ -763,6 +1008,50 @@ int allocate_clients_shared_katcp(struct katcp_dispatch *d, unsigned int count)
   return count;
 }
 
+int grow_clients_shared_katcp(struct katcp_dispatch *d, unsigned int count)
+{
+  unsigned int i;
+  struct katcp_shared *s;
+
+  sane_shared_katcp(d);
+
+  s = d->d_shared;
+  if(s == NULL){
+    return -1;
+  }
+
+  if((s->s_count + count) > s->s_ceiling){
+    count = (s->s_ceiling > s->s_count) ? (s->s_ceiling - s->s_count) : 0;
+  }
+
+  for(i = 0; i < count; i++){
+    if(clone_katcp(d) == NULL){
+      break;
+    }
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "grow: added %u client instances, now %u of at most %u\n", i, s->s_count, s->s_ceiling);
+#endif
+
+  return i;
+}
+
+int max_clients_katcp(struct katcp_dispatch *d, unsigned int limit)
+{
+  struct katcp_shared *s;
+
+  s = d->d_shared;
+  if(s == NULL){
+    return -1;
+  }
+
+  /* tables only grow, an existing count can not be undercut */
+  s->s_ceiling = (limit > s->s_count) ? limit : s->s_count;
+
+  return s->s_ceiling;
+}
+
 int listen_shared_katcp(struct katcp_dispatch *d, char *host, int port)
 {
   struct katcp_shared *s;
@@ -780,6 +1069,7 @@ int listen_shared_katcp(struct katcp_dispatch *d, char *host, int port)
   }
 
   fcntl(s->s_lfd, F_SETFD, FD_CLOEXEC);
+  fcntl(s->s_lfd, F_SETFL, fcntl(s->s_lfd, F_GETFL, 0) | O_NONBLOCK); /* accept in batches until it runs dry */
 
   return 0;
 }
@@ -1590,3 +1880,135 @@ int define_cmd_katcp(struct katcp_dispatch *d, int argc)
   return KATCP_RESULT_FAIL;
 }
 
+/* listings which every new client asks for (help, sensor-list, version-list
+ * and the version informs on connect) are kept as the informs generated
+ * the last time round. Later requests append the same parses, so each is
+ * escaped and serialized only once. The caches are marked invalid when
+ * the underlying commands, sensors or versions change, and are only
+ * used in the mode they were generated in */
+
+void invalidate_cache_katcp(struct katcp_shared *s, unsigned int kind)
+{
+  struct katcp_cache *c;
+  unsigned int i;
+
+  if((s == NULL) || (kind >= KATCP_CACHE_KINDS)){
+    return;
+  }
+
+  c = &(s->s_cache[kind]);
+
+  for(i = 0; i < c->c_count; i++){
+    destroy_parse_katcl(c->c_vector[i]);
+  }
+
+  if(c->c_vector){
+    free(c->c_vector);
+    c->c_vector = NULL;
+  }
+
+  c->c_count = 0;
+  c->c_valid = 0;
+}
+
+void destroy_caches_katcp(struct katcp_shared *s)
+{
+  unsigned int i;
+
+  for(i = 0; i < KATCP_CACHE_KINDS; i++){
+    invalidate_cache_katcp(s, i);
+  }
+}
+
+int start_cache_katcp(struct katcp_dispatch *d)
+{
+  /* returns the position where the informs about to be generated will start, or -1 if they can not be captured */
+
+  if((d->d_line == NULL) || this_flat_katcp(d)){
+    return -1;
+  }
+
+  /* informs to a tagged request carry its tag, not something to hand to others */
+  if(d->d_line->l_tag >= 0){
+    return -1;
+  }
+
+  return size_queue_katcl(d->d_line->l_queue);
+}
+
+int fill_cache_katcp(struct katcp_dispatch *d, unsigned int kind, int start, unsigned int count)
+{
+  struct katcp_shared *s;
+  struct katcp_cache *c;
+  struct katcl_queue *q;
+  unsigned int i;
+
+  s = d->d_shared;
+  if((s == NULL) || (start < 0) || (kind >= KATCP_CACHE_KINDS)){
+    return -1;
+  }
+
+  q = d->d_line->l_queue;
+
+  /* an inform dropped by the queue limit means we did not see everything */
+  if((size_queue_katcl(q) - start) != count){
+    return -1;
+  }
+
+  invalidate_cache_katcp(s, kind);
+
+  c = &(s->s_cache[kind]);
+
+  if(count > 0){
+    c->c_vector = malloc(sizeof(struct katcl_parse *) * count);
+    if(c->c_vector == NULL){
+      return -1;
+    }
+  }
+
+  for(i = 0; i < count; i++){
+    c->c_vector[i] = copy_parse_katcl(get_index_queue_katcl(q, start + i));
+    if(c->c_vector[i] == NULL){
+      c->c_count = i;
+      invalidate_cache_katcp(s, kind);
+      return -1;
+    }
+  }
+
+  c->c_count = count;
+  c->c_mode = s->s_mode;
+  c->c_valid = 1;
+
+  return 0;
+}
+
+int serve_cache_katcp(struct katcp_dispatch *d, unsigned int kind)
+{
+  /* returns the number of informs appended, or -1 if the caller has to generate them */
+  struct katcp_shared *s;
+  struct katcp_cache *c;
+  unsigned int i;
+
+  s = d->d_shared;
+  if((s == NULL) || (kind >= KATCP_CACHE_KINDS)){
+    return -1;
+  }
+
+  c = &(s->s_cache[kind]);
+
+  if((c->c_valid == 0) || (c->c_mode != s->s_mode)){
+    return -1;
+  }
+
+  if((d->d_line == NULL) || this_flat_katcp(d)){
+    return -1;
+  }
+
+  for(i = 0; i < c->c_count; i++){
+    if(append_parse_katcp(d, c->c_vector[i]) < 0){
+      return -1;
+    }
+  }
+
+  return c->c_count;
+}
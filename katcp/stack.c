@@ -19,10 +19,49 @@ struct katcp_stack *create_stack_katcp()
 
   s->s_objs     = NULL;
   s->s_count = 0;
+  s->s_size  = 0;
+
+  s->s_spare_count = 0;
 
   return s;
 } 
 
+static struct katcp_tobject *reuse_tobject_katcp(struct katcp_stack *s, void *data, struct katcp_type *type, int flagman)
+{
+  struct katcp_tobject *o;
+
+  if (data == NULL)
+    return NULL;
+
+  if (s->s_spare_count == 0)
+    return create_tobject_katcp(data, type, flagman);
+
+  s->s_spare_count--;
+  o = s->s_spare[s->s_spare_count];
+
+  o->o_data = data;
+  o->o_type = type;
+  o->o_man  = flagman;
+
+  return o;
+}
+
+static void recycle_tobject_katcp(struct katcp_stack *s, struct katcp_tobject *o)
+{
+  /* wrappers are plain mallocs either way, so one handed out by pop may still be freed by its caller */
+
+  if (s->s_spare_count >= KATCP_STACK_SPARE){
+    free(o);
+    return;
+  }
+
+  o->o_data = NULL;
+  o->o_type = NULL;
+
+  s->s_spare[s->s_spare_count] = o;
+  s->s_spare_count++;
+}
+
 struct katcp_tobject *create_tobject_katcp(void *data, struct katcp_type *type, int flagman)
 {
   struct katcp_tobject *o;
@@ -175,19 +214,29 @@ void destroy_stack_katcp(struct katcp_stack *s)
         destroy_tobject_katcp(s->s_objs[i]);
       free(s->s_objs);
     }
+    for (i=0; i<s->s_spare_count; i++)
+      free(s->s_spare[i]);
     free(s);
   }
 }
 
 int push_tobject_katcp(struct katcp_stack *s, struct katcp_tobject *o)
 {
+  struct katcp_tobject **tmp;
+  int size;
+
   if (s == NULL || o == NULL)
     return -1;
   
-  s->s_objs = realloc(s->s_objs, sizeof(struct katcp_tobject *) * (s->s_count + 1));
-  if (s->s_objs == NULL){
-    destroy_tobject_katcp(o);
-    return -1;
+  if (s->s_count >= s->s_size){
+    size = (s->s_size > 0) ? (s->s_size * 2) : KATCP_STACK_INITIAL;
+    tmp = realloc(s->s_objs, sizeof(struct katcp_tobject *) * size);
+    if (tmp == NULL){
+      destroy_tobject_katcp(o);
+      return -1;
+    }
+    s->s_objs = tmp;
+    s->s_size = size;
   }
   
   s->s_objs[s->s_count] = o;
@@ -212,7 +261,7 @@ int push_stack_katcp(struct katcp_stack *s, void *data, struct katcp_type *type)
   if (s == NULL)
     return -1;
 
-  o = create_tobject_katcp(data, type, 0);
+  o = reuse_tobject_katcp(s, data, type, 0);
   if (o == NULL)
     return -1;
   
@@ -221,18 +270,18 @@ int push_stack_katcp(struct katcp_stack *s, void *data, struct katcp_type *type)
 
 int push_named_stack_katcp(struct katcp_dispatch *d, struct katcp_stack *s, void *data, char *type)
 {
-  struct katcp_tobject *o;
+  struct katcp_type *t;
 
   if (s == NULL || type == NULL)
     return -1;
 
-  o = create_named_tobject_katcp(d, data, type, 0);
-  if (o == NULL)
+  t = find_name_type_katcp(d, type);
+  if (t == NULL)
     return -1;
 #if 0 
   return (refd > 0) ? push_stack_ref_obj_katcp(s, o) : push_tobject_katcp(s, o);
 #endif
-  return push_tobject_katcp(s, o);
+  return push_stack_katcp(s, data, t);
 }
 
 struct katcp_tobject *pop_stack_katcp(struct katcp_stack *s)
@@ -247,7 +296,7 @@ struct katcp_tobject *pop_stack_katcp(struct katcp_stack *s)
   
   o = s->s_objs[s->s_count - 1];
   
-  s->s_objs = realloc(s->s_objs, sizeof(struct katcp_tobject *) * (s->s_count - 1));
+  /* slots are kept, a stack tends to be refilled to the same depth */
   s->s_count--;
 
 #if 0
@@ -261,6 +310,7 @@ struct katcp_tobject *pop_stack_katcp(struct katcp_stack *s)
 void *pop_data_stack_katcp(struct katcp_stack *s)
 {
   struct katcp_tobject *o;
+  struct katcp_type *t;
   void *data;
 
   o = pop_stack_katcp(s);
@@ -269,7 +319,14 @@ void *pop_data_stack_katcp(struct katcp_stack *s)
     
   data = o->o_data;
 
-  destroy_tobject_katcp(o);
+  /* as destroy_tobject_katcp, but keep the wrapper for the next push */
+  if (o->o_man){
+    t = o->o_type;
+    if ((t != NULL) && (t->t_free != NULL))
+      (*t->t_free)(o->o_data);
+  }
+
+  recycle_tobject_katcp(s, o);
 
   return data;
 }
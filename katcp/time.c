@@ -2,6 +2,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
@@ -154,3 +155,17 @@ int sub_time_katcp(struct timeval *delta, struct timeval *alpha, struct timeval
   return 0;
 }
 
+
+void monotonic_time_katcp(struct timeval *tv)
+{
+  struct timespec ts;
+
+  /* immune to the wall clock being stepped, used for scheduling */
+  if(clock_gettime(CLOCK_MONOTONIC, &ts) < 0){
+    gettimeofday(tv, NULL);
+    return;
+  }
+
+  tv->tv_sec  = ts.tv_sec;
+  tv->tv_usec = ts.tv_nsec / 1000;
+}
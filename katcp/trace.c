@@ -0,0 +1,244 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* trace points on the hot paths: with KATCP_TRACE compiled in and the
+ * ring switched on (?trace on), each point records a timestamp, event
+ * id and small payload in a per process ring. Writers claim slots with
+ * an atomic increment, so nothing blocks. The ?trace request itself lives
+ * with the other builtins in dispatch.c, it can report the ring as informs
+ * or save it as chrome trace json or raw records */
+
+#ifdef KATCP_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "katcp.h"
+#include "katpriv.h"
+
+#define TRACE_MAGIC 0x6b747263 /* written at the start of binary dumps */
+
+int trace_enabled_katcp = 0;
+
+static struct katcp_trace_entry *trace_ring = NULL;
+static unsigned int trace_size = 0;     /* power of two */
+static unsigned long trace_next = 0;    /* total events recorded */
+
+static char *trace_names[KATCP_TRACE_EVENTS] = {
+  [KATCP_TRACE_LOOP]          = "loop",
+  [KATCP_TRACE_RECEIVED]      = "received",
+  [KATCP_TRACE_DISPATCH]      = "request",
+  [KATCP_TRACE_COMPLETE]      = "request",
+  [KATCP_TRACE_NOTICE]        = "notice",
+  [KATCP_TRACE_RELAY]         = "relay",
+  [KATCP_TRACE_FLUSH]         = "flush",
+  [KATCP_TRACE_TIMER]         = "timer",
+  [KATCP_TRACE_TIMER_DONE]    = "timer",
+  [KATCP_TRACE_REGISTER]      = "register",
+  [KATCP_TRACE_REGISTER_DONE] = "register"
+};
+
+/* chrome phases: B and E bracket a duration, i is an instant */
+static char trace_phases[KATCP_TRACE_EVENTS] = {
+  [KATCP_TRACE_LOOP]          = 'i',
+  [KATCP_TRACE_RECEIVED]      = 'i',
+  [KATCP_TRACE_DISPATCH]      = 'B',
+  [KATCP_TRACE_COMPLETE]      = 'E',
+  [KATCP_TRACE_NOTICE]        = 'i',
+  [KATCP_TRACE_RELAY]         = 'i',
+  [KATCP_TRACE_FLUSH]         = 'i',
+  [KATCP_TRACE_TIMER]         = 'B',
+  [KATCP_TRACE_TIMER_DONE]    = 'E',
+  [KATCP_TRACE_REGISTER]      = 'B',
+  [KATCP_TRACE_REGISTER_DONE] = 'E'
+};
+
+void record_trace_katcp(unsigned int event, unsigned int value, char *tag)
+{
+  struct katcp_trace_entry *te;
+  struct timespec ts;
+  unsigned long slot;
+
+  if(trace_ring == NULL){
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  slot = __sync_fetch_and_add(&trace_next, 1);
+  te = &(trace_ring[slot & (trace_size - 1)]);
+
+  te->e_when = (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+  te->e_event = event;
+  te->e_value = value;
+
+  if(tag){
+    strncpy(te->e_tag, tag, KATCP_TRACE_TAG - 1);
+    te->e_tag[KATCP_TRACE_TAG - 1] = '\0';
+  } else {
+    te->e_tag[0] = '\0';
+  }
+}
+
+unsigned int size_trace_katcp(void)
+{
+  return trace_size;
+}
+
+void clear_trace_katcp(void)
+{
+  trace_next = 0;
+}
+
+struct katcp_trace_entry *entry_trace_katcp(unsigned long index)
+{
+  if(trace_ring == NULL){
+    return NULL;
+  }
+
+  return &(trace_ring[index & (trace_size - 1)]);
+}
+
+char *name_trace_katcp(unsigned int event)
+{
+  if((event >= KATCP_TRACE_EVENTS) || (trace_names[event] == NULL)){
+    return "unknown";
+  }
+
+  return trace_names[event];
+}
+
+int resize_trace_katcp(unsigned int size)
+{
+  struct katcp_trace_entry *tmp;
+  unsigned int actual;
+
+  trace_enabled_katcp = 0;
+
+  for(actual = 1; actual < size; actual *= 2);
+
+  if((trace_ring == NULL) || (actual != trace_size)){
+    tmp = realloc(trace_ring, sizeof(struct katcp_trace_entry) * actual);
+    if(tmp == NULL){
+      return -1;
+    }
+    trace_ring = tmp;
+    trace_size = actual;
+  }
+
+  trace_next = 0;
+
+  return 0;
+}
+
+/* oldest event still held, and how many there are */
+
+unsigned long held_trace_katcp(unsigned long *first)
+{
+  unsigned long count;
+
+  count = (trace_next > trace_size) ? trace_size : trace_next;
+  *first = trace_next - count;
+
+  return count;
+}
+
+static int chrome_trace_katcp(FILE *fp)
+{
+  struct katcp_trace_entry *te;
+  unsigned long i, first, count;
+  unsigned long long base;
+  char *name;
+  pid_t pid;
+
+  count = held_trace_katcp(&first);
+  pid = getpid();
+  base = (count > 0) ? trace_ring[first & (trace_size - 1)].e_when : 0;
+
+  fprintf(fp, "{\"traceEvents\":[\n");
+
+  for(i = 0; i < count; i++){
+    te = &(trace_ring[(first + i) & (trace_size - 1)]);
+    name = name_trace_katcp(te->e_event);
+
+    /* chrome wants microseconds */
+    fprintf(fp, "%s{\"name\":\"%s%s%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":0,", (i > 0) ? ",\n" : "", name, te->e_tag[0] ? " " : "", te->e_tag, trace_phases[te->e_event], (te->e_when - base) / 1000, (te->e_when - base) % 1000, pid);
+    if(trace_phases[te->e_event] == 'i'){
+      fprintf(fp, "\"s\":\"p\",");
+    }
+    fprintf(fp, "\"args\":{\"value\":%u}}", te->e_value);
+  }
+
+  fprintf(fp, "\n]}\n");
+
+  return 0;
+}
+
+static int binary_trace_katcp(FILE *fp)
+{
+  unsigned long i, first, count;
+  uint32_t header[4];
+
+  count = held_trace_katcp(&first);
+
+  header[0] = TRACE_MAGIC;
+  header[1] = sizeof(struct katcp_trace_entry);
+  header[2] = count;
+  header[3] = 0;
+
+  if(fwrite(header, sizeof(header), 1, fp) != 1){
+    return -1;
+  }
+
+  for(i = 0; i < count; i++){
+    if(fwrite(&(trace_ring[(first + i) & (trace_size - 1)]), sizeof(struct katcp_trace_entry), 1, fp) != 1){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* writes the ring to path, format is either chrome or binary. Returns the number of events written */
+
+long save_trace_katcp(char *format, char *path)
+{
+  unsigned long first, count;
+  int was, result;
+  FILE *fp;
+
+  if(trace_ring == NULL){
+    return -1;
+  }
+
+  fp = fopen(path, "w");
+  if(fp == NULL){
+    return -1;
+  }
+
+  /* stop recording while we read, the ring would otherwise wrap underneath us */
+  was = trace_enabled_katcp;
+  trace_enabled_katcp = 0;
+
+  count = held_trace_katcp(&first);
+
+  if(!strcmp(format, "chrome")){
+    result = chrome_trace_katcp(fp);
+  } else {
+    result = binary_trace_katcp(fp);
+  }
+
+  trace_enabled_katcp = was;
+
+  if(fclose(fp) != 0){
+    result = (-1);
+  }
+
+  return (result < 0) ? -1 : count;
+}
+
+#endif
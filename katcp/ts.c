@@ -13,6 +13,9 @@
 /* attempt to do stuff within 5ms */
 #define KATCP_DEFAULT_DEADLINE 5000
 
+/* initial size of timer heap and hash table, power of two */
+#define KATCP_TIMER_BUCKETS 16
+
 void dump_timers_katcp(struct katcp_dispatch *d)
 {
   int i;
@@ -51,6 +54,11 @@ static struct katcp_time *create_ts_katcp(int (*call)(struct katcp_dispatch *d,
   ts->t_interval.tv_sec = 0;
   ts->t_interval.tv_usec = 0;
 
+  ts->t_armed = 0;
+  ts->t_index = (-1);
+  ts->t_pass = 0;
+  ts->t_next = NULL;
+
   ts->t_data = data;
   ts->t_call = call;
 
@@ -74,10 +82,62 @@ static void destroy_ts_katcp(struct katcp_dispatch *d, struct katcp_time *ts)
   free(ts);
 }
 
+/* hash table keyed on data pointer, timers are unique per data ******************/
+
+static unsigned int hash_ts_katcp(struct katcp_shared *s, void *data)
+{
+  unsigned long v;
+
+  v = (unsigned long) data;
+
+  /* low bits of pointers are mostly zero due to alignment */
+  v = v ^ (v >> 4) ^ (v >> 12);
+
+  return v & (s->s_buckets - 1);
+}
+
+static int grow_hash_ts_katcp(struct katcp_shared *s)
+{
+  struct katcp_time **vector, **old, *ts, *tn;
+  unsigned int size, i, prior, h;
+
+  size = (s->s_buckets > 0) ? (s->s_buckets * 2) : KATCP_TIMER_BUCKETS;
+
+  vector = malloc(sizeof(struct katcp_time *) * size);
+  if(vector == NULL){
+    return -1;
+  }
+
+  for(i = 0; i < size; i++){
+    vector[i] = NULL;
+  }
+
+  old = s->s_timers;
+  prior = s->s_buckets;
+
+  s->s_timers = vector;
+  s->s_buckets = size;
+
+  for(i = 0; i < prior; i++){
+    for(ts = old[i]; ts; ts = tn){
+      tn = ts->t_next;
+      h = hash_ts_katcp(s, ts->t_data);
+      ts->t_next = s->s_timers[h];
+      s->s_timers[h] = ts;
+    }
+  }
+
+  if(old){
+    free(old);
+  }
+
+  return 0;
+}
+
 static struct katcp_time *find_ts_katcp(struct katcp_dispatch *d, void *data)
 {
-  int i;
   struct katcp_shared *s;
+  struct katcp_time *ts;
 
   s = d->d_shared;
 #ifdef DEBUG
@@ -87,44 +147,143 @@ static struct katcp_time *find_ts_katcp(struct katcp_dispatch *d, void *data)
   }
 #endif
 
-  for(i = 0; i < s->s_length; i++){
-    if(s->s_queue[i]->t_data == data){
-      return s->s_queue[i];
+  if(s->s_buckets == 0){
+    return NULL;
+  }
+
+  for(ts = s->s_timers[hash_ts_katcp(s, data)]; ts; ts = ts->t_next){
+    if(ts->t_data == data){
+      return ts;
     }
   }
 
   return NULL;
 }
 
-static int append_ts_katcp(struct katcp_dispatch *d, struct katcp_time *ts)
+static void unhash_ts_katcp(struct katcp_shared *s, struct katcp_time *ts)
 {
-  struct katcp_time **tptr;
-  struct katcp_shared *s;
+  struct katcp_time **tp;
 
-  s = d->d_shared;
-#ifdef DEBUG
-  if(s == NULL){
-    fprintf(stderr, "prepend: no shared state\n");
-    return -1;
+  if(s->s_buckets == 0){
+    return;
   }
-#endif
 
-  tptr = realloc(s->s_queue, sizeof(struct katcp_time *) * (s->s_length + 1));
-  if(tptr == NULL){
-    return -1;
+  for(tp = &(s->s_timers[hash_ts_katcp(s, ts->t_data)]); *tp; tp = &((*tp)->t_next)){
+    if(*tp == ts){
+      *tp = ts->t_next;
+      ts->t_next = NULL;
+      return;
+    }
+  }
+}
+
+/* binary heap, earliest deadline at the root ************************************/
+
+static void place_ts_katcp(struct katcp_shared *s, struct katcp_time *ts, unsigned int index)
+{
+  s->s_queue[index] = ts;
+  ts->t_index = index;
+}
+
+static void up_heap_ts_katcp(struct katcp_shared *s, unsigned int index)
+{
+  struct katcp_time *ts;
+  unsigned int parent;
+
+  ts = s->s_queue[index];
+
+  while(index > 0){
+    parent = (index - 1) / 2;
+    if(cmp_time_katcp(&(s->s_queue[parent]->t_when), &(ts->t_when)) <= 0){
+      break;
+    }
+    place_ts_katcp(s, s->s_queue[parent], index);
+    index = parent;
   }
 
-  s->s_queue = tptr;
+  place_ts_katcp(s, ts, index);
+}
+
+static void down_heap_ts_katcp(struct katcp_shared *s, unsigned int index)
+{
+  struct katcp_time *ts;
+  unsigned int child;
+
+  ts = s->s_queue[index];
+
+  for(;;){
+    child = (2 * index) + 1;
+    if(child >= s->s_length){
+      break;
+    }
+    if(((child + 1) < s->s_length) && (cmp_time_katcp(&(s->s_queue[child + 1]->t_when), &(s->s_queue[child]->t_when)) < 0)){
+      child++;
+    }
+    if(cmp_time_katcp(&(ts->t_when), &(s->s_queue[child]->t_when)) <= 0){
+      break;
+    }
+    place_ts_katcp(s, s->s_queue[child], index);
+    index = child;
+  }
+
+  place_ts_katcp(s, ts, index);
+}
+
+static int insert_heap_ts_katcp(struct katcp_shared *s, struct katcp_time *ts)
+{
+  struct katcp_time **tptr;
+  unsigned int room;
 
-  s->s_queue[s->s_length] = ts;
+  if(s->s_length >= s->s_room){
+    room = (s->s_room > 0) ? (s->s_room * 2) : KATCP_TIMER_BUCKETS;
+    tptr = realloc(s->s_queue, sizeof(struct katcp_time *) * room);
+    if(tptr == NULL){
+      return -1;
+    }
+    s->s_queue = tptr;
+    s->s_room = room;
+  }
+
+  place_ts_katcp(s, ts, s->s_length);
   s->s_length++;
 
+  up_heap_ts_katcp(s, ts->t_index);
+
   return 0;
 }
 
+static void remove_heap_ts_katcp(struct katcp_shared *s, struct katcp_time *ts)
+{
+  unsigned int index;
+
+  index = ts->t_index;
+  ts->t_index = (-1);
+
+  s->s_length--;
+  if(index == s->s_length){
+    return;
+  }
+
+  place_ts_katcp(s, s->s_queue[s->s_length], index);
+
+  /* replacement could need to move either direction */
+  up_heap_ts_katcp(s, index);
+  down_heap_ts_katcp(s, s->s_queue[index]->t_index);
+}
+
 static struct katcp_time *find_make_append_ts_katcp(struct katcp_dispatch *d, int (*call)(struct katcp_dispatch *d, void *data), void *data)
 {
   struct katcp_time *ts;
+  struct katcp_shared *s;
+  unsigned int h;
+
+  s = d->d_shared;
+#ifdef DEBUG
+  if(s == NULL){
+    fprintf(stderr, "prepend: no shared state\n");
+    return NULL;
+  }
+#endif
 
   ts = find_ts_katcp(d, data);
   if(ts == NULL){
@@ -133,15 +292,51 @@ static struct katcp_time *find_make_append_ts_katcp(struct katcp_dispatch *d, in
       return NULL;
     }
 
-    if(append_ts_katcp(d, ts) < 0){
-      destroy_ts_katcp(d, ts);
-      return NULL;
+    if(s->s_length >= s->s_buckets){
+      if(grow_hash_ts_katcp(s) < 0){
+        destroy_ts_katcp(d, ts);
+        return NULL;
+      }
     }
+
+    h = hash_ts_katcp(s, data);
+    ts->t_next = s->s_timers[h];
+    s->s_timers[h] = ts;
   }
 
   return ts;
 }
 
+static int schedule_ts_katcp(struct katcp_dispatch *d, struct katcp_time *ts)
+{
+  struct katcp_shared *s;
+
+  s = d->d_shared;
+
+  ts->t_armed = 1;
+
+  if(ts->t_index >= 0){
+    /* already queued, only deadline changed */
+    up_heap_ts_katcp(s, ts->t_index);
+    down_heap_ts_katcp(s, ts->t_index);
+    return 0;
+  }
+
+  if(s->s_due == ts){
+    /* callback currently running, run logic will requeue it */
+    return 0;
+  }
+
+  if(insert_heap_ts_katcp(s, ts) < 0){
+    ts->t_armed = 0;
+    unhash_ts_katcp(s, ts);
+    destroy_ts_katcp(d, ts);
+    return -1;
+  }
+
+  return 0;
+}
+
 /* functions to schedule things at particular times *******************************/
 
 int register_every_ms_katcp(struct katcp_dispatch *d, unsigned int milli, int (*call)(struct katcp_dispatch *d, void *data), void *data)
@@ -174,22 +369,58 @@ int register_every_tv_katcp(struct katcp_dispatch *d, struct timeval *tv, int (*
     return -1;
   }
 
-  gettimeofday(&now, NULL);
+  monotonic_time_katcp(&now);
 
   ts->t_interval.tv_sec = tv->tv_sec;
   ts->t_interval.tv_usec = tv->tv_usec;
 
-  add_time_katcp(&(ts->t_when), &now, tv);
+  if(s->s_due == ts){
+    /* changing our own period from within the callback, run logic adds the new interval on return */
+    ts->t_when.tv_sec = now.tv_sec;
+    ts->t_when.tv_usec = now.tv_usec;
+  } else {
+    add_time_katcp(&(ts->t_when), &now, tv);
+  }
 
-  ts->t_armed = 1;
+  return schedule_ts_katcp(d, ts);
+}
 
-  return 0;
+int register_tick_tv_katcp(struct katcp_dispatch *d, struct timeval *tv, int (*call)(struct katcp_dispatch *d, void *data), void *data)
+{
+  struct katcp_time *ts;
+  struct timeval now;
+  unsigned long long period, when;
+
+  /* like every, but first fires on a multiple of the period, so that timers of equal period share a pass */
+
+  period = (tv->tv_sec * 1000000ULL) + tv->tv_usec;
+  if(period == 0){
+    return -1;
+  }
+
+  ts = find_make_append_ts_katcp(d, call, data);
+  if(ts == NULL){
+    return -1;
+  }
+
+  monotonic_time_katcp(&now);
+
+  ts->t_interval.tv_sec = tv->tv_sec;
+  ts->t_interval.tv_usec = tv->tv_usec;
+
+  when = (((now.tv_sec * 1000000ULL) + now.tv_usec) / period + 1) * period;
+
+  ts->t_when.tv_sec = when / 1000000ULL;
+  ts->t_when.tv_usec = when % 1000000ULL;
+
+  return schedule_ts_katcp(d, ts);
 }
 
 int register_at_tv_katcp(struct katcp_dispatch *d, struct timeval *tv, int (*call)(struct katcp_dispatch *d, void *data), void *data)
 {
   struct katcp_shared *s;
   struct katcp_time *ts;
+  struct timeval now, wall, delta;
 
   s = d->d_shared;
   if(s == NULL){
@@ -211,12 +442,14 @@ int register_at_tv_katcp(struct katcp_dispatch *d, struct timeval *tv, int (*cal
   ts->t_interval.tv_sec = 0;
   ts->t_interval.tv_usec = 0;
 
-  ts->t_when.tv_sec = tv->tv_sec; 
-  ts->t_when.tv_usec = tv->tv_usec; 
+  /* caller gives wall clock time, we schedule on the monotonic clock. Times in the past yield zero */
+  gettimeofday(&wall, NULL);
+  monotonic_time_katcp(&now);
 
-  ts->t_armed = 1;
+  sub_time_katcp(&delta, tv, &wall);
+  add_time_katcp(&(ts->t_when), &now, &delta);
 
-  return 0;
+  return schedule_ts_katcp(d, ts);
 }
 
 int register_in_tv_katcp(struct katcp_dispatch *d, struct timeval *tv, int (*call)(struct katcp_dispatch *d, void *data), void *data)
@@ -245,13 +478,11 @@ int register_in_tv_katcp(struct katcp_dispatch *d, struct timeval *tv, int (*cal
   ts->t_interval.tv_sec = 0;
   ts->t_interval.tv_usec = 0;
 
-  gettimeofday(&now, NULL);
+  monotonic_time_katcp(&now);
 
   add_time_katcp(&(ts->t_when), &now, tv);
 
-  ts->t_armed = 1;
-
-  return 0;
+  return schedule_ts_katcp(d, ts);
 }
 
 /* involve notices *******************************************************************/
@@ -326,6 +557,7 @@ int unwarp_timers_katcp(struct katcp_dispatch *d)
   struct katcp_shared *s;
   struct katcp_time *ts;
   struct timeval now, sum;
+  int changed;
 
   s = d->d_shared;
   if(s == NULL){
@@ -336,7 +568,9 @@ int unwarp_timers_katcp(struct katcp_dispatch *d)
     return 0;
   }
 
-  gettimeofday(&now, NULL);
+  monotonic_time_katcp(&now);
+
+  changed = 0;
 
   for(i = 0; i < s->s_length; i++){
     ts = s->s_queue[i];
@@ -346,10 +580,18 @@ int unwarp_timers_katcp(struct katcp_dispatch *d)
       if(cmp_time_katcp(&(ts->t_when), &sum) < 0){
         ts->t_when.tv_sec  = sum.tv_sec;
         ts->t_when.tv_usec = sum.tv_usec;
+        changed++;
       }
     }
   }
 
+  if(changed){
+    /* rebuild heap property */
+    for(i = s->s_length / 2; i > 0; i--){
+      down_heap_ts_katcp(s, i - 1);
+    }
+  }
+
   return 0;
 }
 
@@ -372,7 +614,19 @@ int discharge_timer_katcp(struct katcp_dispatch *d, void *data)
     return -1;
   }
 
-  ts->t_armed = (-1);
+  if(s->s_due == ts){
+    /* running, run logic will notice and destroy it */
+    ts->t_armed = (-1);
+    return 0;
+  }
+
+  if(ts->t_index >= 0){
+    remove_heap_ts_katcp(s, ts);
+  }
+
+  ts->t_armed = 0;
+  unhash_ts_katcp(s, ts);
+  destroy_ts_katcp(d, ts);
 
   return 0;
 }
@@ -387,32 +641,56 @@ int empty_timers_katcp(struct katcp_dispatch *d)
     return -1;
   }
 
-  if(s->s_length == 0){
-    return 0;
-  }
-
   for(i = 0; i < s->s_length; i++){
     s->s_queue[i]->t_armed = 0;
     destroy_ts_katcp(d, s->s_queue[i]);
   }
 
-  free(s->s_queue);
-  s->s_queue = NULL;
+  if(s->s_queue){
+    free(s->s_queue);
+    s->s_queue = NULL;
+  }
   s->s_length = 0;
+  s->s_room = 0;
+
+  if(s->s_timers){
+    free(s->s_timers);
+    s->s_timers = NULL;
+  }
+  s->s_buckets = 0;
 
   return 0;
 }
 
 /* do the hard work of actually running the timers ************************************/
 
-int run_timers_katcp(struct katcp_dispatch *d, struct timespec *interval)
+static void skip_ts_katcp(struct katcp_time *ts, struct timeval *now)
 {
-  /* this used to be a snazzy priority queue */
+  unsigned long long period, when, current;
+
+  /* advance by whole intervals to the first expiry after now */
+
+  period = (ts->t_interval.tv_sec * 1000000ULL) + ts->t_interval.tv_usec;
+  when = (ts->t_when.tv_sec * 1000000ULL) + ts->t_when.tv_usec;
+  current = (now->tv_sec * 1000000ULL) + now->tv_usec;
+
+  if((period == 0) || (when > current)){
+    return;
+  }
 
+  when += ((current - when) / period + 1) * period;
+
+  ts->t_when.tv_sec = when / 1000000ULL;
+  ts->t_when.tv_usec = when % 1000000ULL;
+}
+
+int run_timers_katcp(struct katcp_dispatch *d, struct timespec *interval)
+{
   struct katcp_shared *s;
   struct katcp_time *ts;
-  struct timeval now, delta, min, deadline;
-  unsigned int i, j;
+  struct timeval now, delta, deadline;
+  unsigned long late;
+  int result;
 
   s = d->d_shared;
   if(s == NULL){
@@ -429,7 +707,7 @@ int run_timers_katcp(struct katcp_dispatch *d, struct timespec *interval)
     return 1;
   }
 
-  gettimeofday(&now, NULL);
+  monotonic_time_katcp(&now);
 
   delta.tv_sec = 0;
   delta.tv_usec = KATCP_DEFAULT_DEADLINE;
@@ -439,90 +717,234 @@ int run_timers_katcp(struct katcp_dispatch *d, struct timespec *interval)
   dump_timers_katcp(d);
 #endif
 
-  /* run all timers */
-  for(i = 0; i < s->s_length; i++){
-    ts = s->s_queue[i];
-    if(ts->t_armed > 0){
-      if(cmp_time_katcp(&(ts->t_when), &now) <= 0){
-        if(cmp_time_katcp(&(ts->t_when), &deadline) <= 0){
-          log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "missed deadline: scheduled=%lu.%06lus actual=%lu.%06lus for %p", ts->t_when.tv_sec, ts->t_when.tv_usec, now.tv_sec, now.tv_usec, ts->t_data);
-        }
-        ts->t_armed = 0; /* assume that we won't run again */
+  /* a timer rescheduled into the past by its own callback waits for the next pass */
+  s->s_pass++;
+
+  /* run all expired timers, earliest first */
+  while(s->s_length > 0){
+    ts = s->s_queue[0];
+
+    if(cmp_time_katcp(&(ts->t_when), &now) > 0){
+      break;
+    }
+    if(ts->t_pass == s->s_pass){
+      break;
+    }
+
+    remove_heap_ts_katcp(s, ts);
+    ts->t_pass = s->s_pass;
+
+    if(s->s_health.h_ready){
+      late = record_stats_katcp(&(s->s_health.h_lag), &(ts->t_when), KATCP_RESULT_OK);
+      if(late > s->s_health.h_worst){
+        s->s_health.h_worst = late;
+      }
+    }
+
+    if(cmp_time_katcp(&(ts->t_when), &deadline) <= 0){
+      log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "missed deadline: scheduled=%lu.%06lus actual=%lu.%06lus for %p", ts->t_when.tv_sec, ts->t_when.tv_usec, now.tv_sec, now.tv_usec, ts->t_data);
+    }
+
+    ts->t_armed = 0; /* assume that we won't run again */
+    s->s_due = ts;
 #ifdef DEBUG
-        fprintf(stderr, "timer: running timer %p with data %p\n", ts->t_call, ts->t_data);
+    fprintf(stderr, "timer: running timer %p with data %p\n", ts->t_call, ts->t_data);
 #endif
-        if((*(ts->t_call))(d, ts->t_data) >= 0){
-          /* only automatically re-arm if periodic and not failed */
-          if((ts->t_interval.tv_sec != 0) || (ts->t_interval.tv_usec != 0)){
-            ts->t_armed++; /* a discharge will result in this still being zero */
-            add_time_katcp(&(ts->t_when), &(ts->t_when), &(ts->t_interval));
-            if(cmp_time_katcp(&(ts->t_when), &now) < 0){
-              log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "will miss deadline: scheduled=%lu.%06lus, now aiming for +%lu.%06lus for %p", ts->t_when.tv_sec, ts->t_when.tv_usec, ts->t_interval.tv_sec, ts->t_interval.tv_usec, ts->t_data);
-
-#if 0 /* might be needed later */
-              gettimeofday(&now, NULL);
-              delta.tv_sec = 0;
-              delta.tv_usec = KATCP_DEFAULT_DEADLINE;
-              sub_time_katcp(&deadline, &now, &delta);
-#endif
-
-              add_time_katcp(&(ts->t_when), &now, &(ts->t_interval));
-            }
-          }
+    TRACE_KATCP(KATCP_TRACE_TIMER, 0, NULL);
+    result = (*(ts->t_call))(d, ts->t_data);
+    TRACE_KATCP(KATCP_TRACE_TIMER_DONE, result, NULL);
+    if(result >= 0){
+      /* only automatically re-arm if periodic and not failed */
+      if((ts->t_interval.tv_sec != 0) || (ts->t_interval.tv_usec != 0)){
+        ts->t_armed++; /* a discharge will result in this still being zero */
+        add_time_katcp(&(ts->t_when), &(ts->t_when), &(ts->t_interval));
+        if(cmp_time_katcp(&(ts->t_when), &now) < 0){
+          log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "will miss deadline: scheduled=%lu.%06lus, now aiming for +%lu.%06lus for %p", ts->t_when.tv_sec, ts->t_when.tv_usec, ts->t_interval.tv_sec, ts->t_interval.tv_usec, ts->t_data);
+          skip_ts_katcp(ts, &now); /* keep the phase, so aligned ticks stay together */
         }
       }
     }
-  }
+    s->s_due = NULL;
 
-  /* trim out empty elements */
-  j = 0;
-  for(i = 0; i < s->s_length; i++){
-    ts = s->s_queue[i];
-    if(ts->t_armed > 0){
-      s->s_queue[j] = ts;
-      j++;
-    } else {
+    if((ts->t_armed <= 0) || (insert_heap_ts_katcp(s, ts) < 0)){
+      ts->t_armed = 0;
+      unhash_ts_katcp(s, ts);
       destroy_ts_katcp(d, ts);
     }
   }
-  s->s_length = j;
 
-  /* only destroy queue if everthing has been done */
   if(s->s_length == 0){
+#ifdef DEBUG
+    fprintf(stderr, "schedule: everything sheduled done, no timeout\n");
+#endif
+    return 1;
+  }
 
-    free(s->s_queue);
-    s->s_queue = NULL;
+  /* earliest deadline is at the root */
+  monotonic_time_katcp(&now);
+
+  sub_time_katcp(&delta, &(s->s_queue[0]->t_when), &now);
 
 #ifdef DEBUG
-    fprintf(stderr, "schedule: everything sheduled done, no timeout\n");
+  fprintf(stderr, "schedule: %d scheduled callbacks left\n", s->s_length);
 #endif
+
+  interval->tv_sec = delta.tv_sec;
+  interval->tv_nsec = delta.tv_usec * 1000;
+
+  return 0;
+}
+
+#ifdef UNIT_TEST_TS
+
+#include <unistd.h>
+
+#define TIMERS 200
+
+static unsigned int fired[TIMERS];
+static unsigned int order[TIMERS];
+static unsigned int total = 0;
+
+static int count_timer_test(struct katcp_dispatch *d, void *data)
+{
+  unsigned int *slot;
+
+  slot = data;
+
+  order[total++] = slot - fired;
+  (*slot)++;
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  struct katcp_dispatch *d;
+  struct katcp_shared *s;
+  struct timespec interval;
+  struct timeval tv;
+  unsigned int i, rounds, expected;
+  int result;
+
+  d = startup_katcp();
+  if(d == NULL){
+    fprintf(stderr, "unable to create dispatch\n");
     return 1;
   }
 
-  /* now try to catch up */
-  gettimeofday(&now, NULL);
+  s = d->d_shared;
 
-  ts = s->s_queue[0];
-  min.tv_sec  = ts->t_when.tv_sec;
-  min.tv_usec = ts->t_when.tv_usec;
+  srand(getpid());
 
-  for(i = 1; i < s->s_length; i++){
-    ts = s->s_queue[i];
+  /* register in reverse order with random delays, expect them in deadline order */
+  for(i = 0; i < TIMERS; i++){
+    fired[i] = 0;
+    tv.tv_sec = 0;
+    tv.tv_usec = (rand() % 50) * 1000;
+    if(register_in_tv_katcp(d, &tv, &count_timer_test, &(fired[i])) < 0){
+      fprintf(stderr, "unable to register timer %u\n", i);
+      return 1;
+    }
+  }
 
-    if(cmp_time_katcp(&(ts->t_when), &min) < 0){
-      min.tv_sec  = ts->t_when.tv_sec;
-      min.tv_usec = ts->t_when.tv_usec;
+  if(s->s_length != TIMERS){
+    fprintf(stderr, "expected %d timers, have %u\n", TIMERS, s->s_length);
+    return 1;
+  }
+
+  /* rescheduling an existing timer may not duplicate it */
+  tv.tv_sec = 0;
+  tv.tv_usec = 1000;
+  register_in_tv_katcp(d, &tv, &count_timer_test, &(fired[0]));
+
+  /* and every odd one gets discharged */
+  for(i = 1; i < TIMERS; i += 2){
+    if(discharge_timer_katcp(d, &(fired[i])) < 0){
+      fprintf(stderr, "unable to discharge timer %u\n", i);
+      return 1;
     }
   }
 
-  sub_time_katcp(&delta, &min, &now);
+  expected = TIMERS / 2;
 
-#ifdef DEBUG
-  fprintf(stderr, "schedule: %d scheduled callbacks left\n", s->s_length);
-#endif
+  if(s->s_length != expected){
+    fprintf(stderr, "expected %u timers after discharge, have %u\n", expected, s->s_length);
+    return 1;
+  }
 
-  interval->tv_sec = delta.tv_sec;
-  interval->tv_nsec = delta.tv_usec * 1000;
+  for(rounds = 0; rounds < 1000; rounds++){
+
+    for(i = 1; i < s->s_length; i++){
+      if(cmp_time_katcp(&(s->s_queue[(i - 1) / 2]->t_when), &(s->s_queue[i]->t_when)) > 0){
+        fprintf(stderr, "heap property violated at %u\n", i);
+        return 1;
+      }
+    }
+
+    result = run_timers_katcp(d, &interval);
+    if(result > 0){
+      break;
+    }
+    usleep(1000);
+  }
+
+  if(total != expected){
+    fprintf(stderr, "expected %u timer callbacks, saw %u\n", expected, total);
+    return 1;
+  }
+
+  for(i = 0; i < TIMERS; i++){
+    if(fired[i] != ((i % 2) ? 0 : 1)){
+      fprintf(stderr, "timer %u fired %u times\n", i, fired[i]);
+      return 1;
+    }
+  }
+
+  /* periodic timer runs more than once, and a discharge stops it */
+  total = 0;
+  tv.tv_sec = 0;
+  tv.tv_usec = 2000;
+  register_every_tv_katcp(d, &tv, &count_timer_test, &(fired[0]));
+
+  for(rounds = 0; (rounds < 1000) && (total < 5); rounds++){
+    run_timers_katcp(d, &interval);
+    usleep(500);
+  }
+
+  if(total < 5){
+    fprintf(stderr, "periodic timer only ran %u times\n", total);
+    return 1;
+  }
+
+  discharge_timer_katcp(d, &(fired[0]));
+
+  if(run_timers_katcp(d, &interval) <= 0){
+    fprintf(stderr, "expected no more timers after discharge\n");
+    return 1;
+  }
+
+  /* ticks registered at different times land on multiples of their period */
+  tv.tv_sec = 0;
+  tv.tv_usec = 20000;
+  register_tick_tv_katcp(d, &tv, &count_timer_test, &(fired[0]));
+  usleep(3000);
+  register_tick_tv_katcp(d, &tv, &count_timer_test, &(fired[1]));
+
+  for(i = 0; i < s->s_length; i++){
+    if((s->s_length != 2) || (s->s_queue[i]->t_when.tv_usec % tv.tv_usec)){
+      fprintf(stderr, "expected two aligned ticks\n");
+      return 1;
+    }
+  }
+
+  discharge_timer_katcp(d, &(fired[0]));
+  discharge_timer_katcp(d, &(fired[1]));
+
+  printf("timer test ok\n");
+
+  shutdown_katcp(d);
 
   return 0;
 }
+
+#endif
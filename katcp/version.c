@@ -8,20 +8,27 @@
 #include <sys/utsname.h>
 
 #include <katpriv.h>
+#include <katcl.h>
 #include <katcp.h>
 
 static int locate_version_katcp(struct katcp_dispatch *d, char *label)
 {
   int i;
   struct katcp_shared *s;
+  char *key;
 
   s = d->d_shared;
   if(s == NULL){
     return -1;
   }
 
+  key = find_name_katcm(label);
+  if(key == NULL){
+    return -1;
+  }
+
   for(i = 0; i < s->s_amount; i++){
-    if(!strcmp(label, s->s_versions[i]->v_label)){
+    if(s->s_versions[i]->v_label == key){
       return i;
     }
   }
@@ -36,7 +43,7 @@ static void destroy_version_katcp(struct katcp_dispatch *d, struct katcp_version
   }
 
   if(v->v_label){
-    free(v->v_label);
+    release_name_katcm(v->v_label);
     v->v_label = NULL;
   }
 
@@ -62,7 +69,7 @@ static struct katcp_version *allocate_version_katcp(struct katcp_dispatch *d, ch
     return NULL;
   }
 
-  v->v_label = strdup(label);
+  v->v_label = intern_name_katcm(label);
   v->v_mode = 0;
   v->v_value = NULL;
   v->v_build = NULL;
@@ -137,6 +144,9 @@ static int set_version_katcp(struct katcp_dispatch *d, struct katcp_version *v,
   v->v_value = vt;
   v->v_mode = mode;
 
+  invalidate_cache_katcp(d->d_shared, KATCP_CACHE_VERSION_LIST);
+  invalidate_cache_katcp(d->d_shared, KATCP_CACHE_VERSION_CONNECT);
+
   return 0;
 }
 
@@ -160,6 +170,9 @@ static int insert_version_katcp(struct katcp_dispatch *d, struct katcp_version *
   s->s_versions[s->s_amount] = v;
   s->s_amount++;
 
+  invalidate_cache_katcp(s, KATCP_CACHE_VERSION_LIST);
+  invalidate_cache_katcp(s, KATCP_CACHE_VERSION_CONNECT);
+
   return 0;
 }
 
@@ -186,6 +199,9 @@ void destroy_versions_katcp(struct katcp_dispatch *d)
     s->s_amount = 0;
     free(s->s_versions);
   }
+
+  invalidate_cache_katcp(s, KATCP_CACHE_VERSION_LIST);
+  invalidate_cache_katcp(s, KATCP_CACHE_VERSION_CONNECT);
 }
 
 int remove_version_katcp(struct katcp_dispatch *d, char *label)
@@ -210,6 +226,9 @@ int remove_version_katcp(struct katcp_dispatch *d, char *label)
     s->s_versions[pos] = s->s_versions[s->s_amount];
   }
 
+  invalidate_cache_katcp(s, KATCP_CACHE_VERSION_LIST);
+  invalidate_cache_katcp(s, KATCP_CACHE_VERSION_CONNECT);
+
   return 0;
 }
 
@@ -254,6 +273,7 @@ int print_versions_katcp(struct katcp_dispatch *d, int initial)
   struct katcp_shared *s;
 #if KATCP_PROTOCOL_MAJOR_VERSION >= 5
   char *prefix;
+  int kind, start;
 #endif
   int count;
 
@@ -276,6 +296,18 @@ int print_versions_katcp(struct katcp_dispatch *d, int initial)
     default :
       return -1;
   }
+
+  /* the connect and list informs are the same for every client, reuse the last set */
+  kind = (initial == KATCP_PRINT_VERSION_CONNECT) ? KATCP_CACHE_VERSION_CONNECT : ((initial == KATCP_PRINT_VERSION_LIST) ? KATCP_CACHE_VERSION_LIST : (-1));
+  start = (-1);
+
+  if(kind >= 0){
+    count = serve_cache_katcp(d, kind);
+    if(count >= 0){
+      return count;
+    }
+    start = start_cache_katcp(d);
+  }
 #endif
 
   count = 0;
@@ -323,6 +355,12 @@ int print_versions_katcp(struct katcp_dispatch *d, int initial)
 #endif
   }
 
+#if KATCP_PROTOCOL_MAJOR_VERSION >= 5
+  if(start >= 0){
+    fill_cache_katcp(d, kind, start, count);
+  }
+#endif
+
   return count;
 }
 
@@ -369,6 +407,9 @@ int add_code_version_katcp(struct katcp_dispatch *d)
 
   result += add_version_katcp(d, KATCP_PROTOCOL_LABEL, 0, buffer, NULL);
 
+  /* clients which want raw binary arguments issue ?binary-encoding */
+  result += add_version_katcp(d, KATCP_BINARY_LABEL, 0, KATCL_BINARY_NAME, NULL);
+
   return result;
 #undef BUFFER
 }
@@ -0,0 +1,394 @@
+/* (c) 2010,2011 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* worker threads for requests which would otherwise stall the loop.
+ * Only the work function runs in a worker, it gets handed a data
+ * pointer and may not touch any katcp state. Everything else,
+ * including the done function which generates the reply, runs in the
+ * loop thread, which remains the only owner of shared state. Finished
+ * work is handed back via a list and a pipe, which an arb callback
+ * drains, waking the notice the paused request is waiting on. Without
+ * KATCP_THREADS the work is simply done in place
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef KATCP_THREADS
+#include <pthread.h>
+#endif
+
+#include "katpriv.h"
+#include "katcl.h"
+#include "katcp.h"
+
+#ifdef KATCP_THREADS
+
+#define KATCP_WORKER_NAME "workers"
+
+struct katcp_task{
+  int (*t_work)(void *data);
+  int (*t_done)(struct katcp_dispatch *d, int status, void *data);
+  void *t_data;
+  int t_status;
+  int t_delivered;
+  struct katcp_notice *t_notice;
+  struct katcp_task *t_next;
+};
+
+struct katcp_workers{
+  pthread_t *w_threads;
+  unsigned int w_count;
+
+  pthread_mutex_t w_lock;
+  pthread_cond_t w_cond;
+
+  struct katcp_task *w_head; /* waiting for a worker */
+  struct katcp_task *w_tail;
+  struct katcp_task *w_finished; /* waiting for the loop */
+
+  int w_stop;
+  int w_pipe[2];
+};
+
+static void *run_worker_katcp(void *data)
+{
+  struct katcp_workers *w;
+  struct katcp_task *t;
+
+  w = data;
+
+  pthread_mutex_lock(&(w->w_lock));
+
+  for(;;){
+    while((w->w_stop == 0) && (w->w_head == NULL)){
+      pthread_cond_wait(&(w->w_cond), &(w->w_lock));
+    }
+
+    if(w->w_stop){
+      break;
+    }
+
+    t = w->w_head;
+    w->w_head = t->t_next;
+    if(w->w_head == NULL){
+      w->w_tail = NULL;
+    }
+
+    pthread_mutex_unlock(&(w->w_lock));
+
+    t->t_status = (*(t->t_work))(t->t_data);
+
+    pthread_mutex_lock(&(w->w_lock));
+
+    t->t_next = w->w_finished;
+    w->w_finished = t;
+
+    /* a full pipe is already readable, so a failure here is harmless */
+    if(write(w->w_pipe[1], "", 1) < 0){
+#ifdef DEBUG
+      fprintf(stderr, "worker: unable to signal loop: %s\n", strerror(errno));
+#endif
+    }
+  }
+
+  pthread_mutex_unlock(&(w->w_lock));
+
+  return NULL;
+}
+
+static void discard_tasks_katcp(struct katcp_task *list)
+{
+  struct katcp_task *t;
+
+  while(list){
+    t = list;
+    list = t->t_next;
+
+    /* never got to the requesting client, let done release its data */
+    (*(t->t_done))(NULL, t->t_status, t->t_data);
+    free(t);
+  }
+}
+
+static int collect_workers_katcp(struct katcp_dispatch *d, struct katcp_arb *a, unsigned int mode)
+{
+  struct katcp_workers *w;
+  struct katcp_task *t, *list;
+  char buffer[64];
+
+  w = data_arb_katcp(d, a);
+
+  while(read(w->w_pipe[0], buffer, sizeof(buffer)) > 0);
+
+  pthread_mutex_lock(&(w->w_lock));
+  list = w->w_finished;
+  w->w_finished = NULL;
+  pthread_mutex_unlock(&(w->w_lock));
+
+  while(list){
+    t = list;
+    list = t->t_next;
+    t->t_next = NULL;
+
+    wake_notice_katcp(d, t->t_notice, NULL);
+  }
+
+  mark_busy_katcp(d); /* notices run before arbs, don't wait for the next io */
+
+  return 0;
+}
+
+static int deliver_task_katcp(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct katcp_task *t;
+  int result;
+
+  t = data;
+  t->t_delivered = 1;
+
+  /* like call_katcp, generate the reply unless done has done so itself */
+  result = (*(t->t_done))(d, t->t_status, t->t_data);
+  if(result <= 0){
+    extra_response_katcp(d, result, NULL);
+  }
+
+  resume_katcp(d);
+
+  return 0;
+}
+
+static int reap_task_katcp(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
+{
+  struct katcp_task *t;
+
+  t = data;
+
+  /* subscribed after the client, so runs after deliver, or alone if the client has gone */
+  if(t->t_delivered == 0){
+    (*(t->t_done))(NULL, t->t_status, t->t_data);
+  }
+
+  free(t);
+
+  return 0;
+}
+
+int start_workers_katcp(struct katcp_dispatch *d, unsigned int count)
+{
+  struct katcp_shared *s;
+  struct katcp_workers *w;
+  sigset_t all, previous;
+  unsigned int i;
+
+  s = d->d_shared;
+  if(s == NULL){
+    return -1;
+  }
+
+  if(s->s_workers){
+    return -1;
+  }
+
+  if(count == 0){
+    return 0;
+  }
+
+  w = malloc(sizeof(struct katcp_workers));
+  if(w == NULL){
+    return -1;
+  }
+
+  w->w_threads = malloc(sizeof(pthread_t) * count);
+  if(w->w_threads == NULL){
+    free(w);
+    return -1;
+  }
+  w->w_count = 0;
+
+  pthread_mutex_init(&(w->w_lock), NULL);
+  pthread_cond_init(&(w->w_cond), NULL);
+
+  w->w_head = NULL;
+  w->w_tail = NULL;
+  w->w_finished = NULL;
+
+  w->w_stop = 0;
+
+  if(pipe(w->w_pipe) < 0){
+    free(w->w_threads);
+    free(w);
+    return -1;
+  }
+
+  for(i = 0; i < 2; i++){
+    fcntl(w->w_pipe[i], F_SETFD, FD_CLOEXEC);
+    fcntl(w->w_pipe[i], F_SETFL, O_NONBLOCK);
+  }
+
+  /* the arb now owns the read end */
+  if(create_arb_katcp(d, KATCP_WORKER_NAME, w->w_pipe[0], KATCP_ARB_READ, &collect_workers_katcp, w) == NULL){
+    close(w->w_pipe[0]);
+    close(w->w_pipe[1]);
+    free(w->w_threads);
+    free(w);
+    return -1;
+  }
+
+  s->s_workers = w;
+
+  /* signals are for the loop thread, workers inherit a blocked mask */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &previous);
+
+  for(i = 0; i < count; i++){
+    if(pthread_create(&(w->w_threads[i]), NULL, &run_worker_katcp, w) != 0){
+      break;
+    }
+    w->w_count++;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  if(w->w_count == 0){
+    stop_workers_katcp(d);
+    return -1;
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "started %u of %u worker threads", w->w_count, count);
+
+  return w->w_count;
+}
+
+void stop_workers_katcp(struct katcp_dispatch *d)
+{
+  struct katcp_shared *s;
+  struct katcp_workers *w;
+  struct katcp_arb *a;
+  unsigned int i;
+
+  s = d->d_shared;
+  if((s == NULL) || (s->s_workers == NULL)){
+    return;
+  }
+
+  w = s->s_workers;
+
+  pthread_mutex_lock(&(w->w_lock));
+  w->w_stop = 1;
+  pthread_cond_broadcast(&(w->w_cond));
+  pthread_mutex_unlock(&(w->w_lock));
+
+  /* WARNING: waits for work in progress to complete */
+  for(i = 0; i < w->w_count; i++){
+    pthread_join(w->w_threads[i], NULL);
+  }
+
+  discard_tasks_katcp(w->w_head);
+  discard_tasks_katcp(w->w_finished);
+
+  w->w_head = NULL;
+  w->w_tail = NULL;
+  w->w_finished = NULL;
+
+  a = find_arb_katcp(d, KATCP_WORKER_NAME);
+  if(a){
+    unlink_arb_katcp(d, a);
+  }
+
+  close(w->w_pipe[1]);
+
+  pthread_cond_destroy(&(w->w_cond));
+  pthread_mutex_destroy(&(w->w_lock));
+
+  free(w->w_threads);
+  free(w);
+
+  s->s_workers = NULL;
+}
+
+int offload_katcp(struct katcp_dispatch *d, int (*work)(void *data), int (*done)(struct katcp_dispatch *d, int status, void *data), void *data)
+{
+  struct katcp_shared *s;
+  struct katcp_workers *w;
+  struct katcp_task *t;
+  struct katcp_notice *n;
+
+  s = d->d_shared;
+  if(s == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  w = s->s_workers;
+  if(w == NULL){
+    return (*done)(d, (*work)(data), data);
+  }
+
+  t = malloc(sizeof(struct katcp_task));
+  if(t == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  t->t_work = work;
+  t->t_done = done;
+  t->t_data = data;
+  t->t_status = (-1);
+  t->t_delivered = 0;
+  t->t_next = NULL;
+
+  n = create_notice_katcp(d, NULL, 0);
+  if(n == NULL){
+    free(t);
+    return KATCP_RESULT_FAIL;
+  }
+
+  t->t_notice = n;
+
+  if(add_notice_katcp(d, n, &deliver_task_katcp, t) < 0){
+    free(t);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(add_notice_katcp(s->s_template, n, &reap_task_katcp, t) < 0){
+    remove_notice_katcp(d, n, &deliver_task_katcp, t);
+    free(t);
+    return KATCP_RESULT_FAIL;
+  }
+
+  pthread_mutex_lock(&(w->w_lock));
+
+  if(w->w_tail){
+    w->w_tail->t_next = t;
+  } else {
+    w->w_head = t;
+  }
+  w->w_tail = t;
+
+  pthread_cond_signal(&(w->w_cond));
+  pthread_mutex_unlock(&(w->w_lock));
+
+  return KATCP_RESULT_PAUSE;
+}
+
+#else
+
+int start_workers_katcp(struct katcp_dispatch *d, unsigned int count)
+{
+  return (count > 0) ? (-1) : 0;
+}
+
+void stop_workers_katcp(struct katcp_dispatch *d)
+{
+}
+
+int offload_katcp(struct katcp_dispatch *d, int (*work)(void *data), int (*done)(struct katcp_dispatch *d, int status, void *data), void *data)
+{
+  return (*done)(d, (*work)(data), data);
+}
+
+#endif
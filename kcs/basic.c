@@ -100,6 +100,20 @@ int script_wildcard_cmd(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
+  len = strlen(path);
+  if(kb->b_pyworkers && (len > 3) && !strcmp(path + len - 3, ".py")){
+    /* warm interpreters run concurrently, no need for the python notice */
+    if(submit_pyworker_kcs(d, path, argc, &script_wildcard_resume) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to hand %s to a python worker", path);
+      free(path);
+      destroy_kurl_katcp(name);
+      return KATCP_RESULT_FAIL;
+    }
+    free(path);
+    destroy_kurl_katcp(name);
+    return KATCP_RESULT_PAUSE;
+  }
+
   n = find_notice_katcp(d, KCS_NOTICE_PYTHON);
   if(n != NULL){
     free(path);
@@ -191,6 +205,16 @@ void destroy_basic_kcs(struct katcp_dispatch *d, unsigned int mode)
     kb->b_pool_head = NULL;
   }
 
+  if (kb->b_graph != NULL){
+    release_graph_kcs(kb->b_graph);
+    kb->b_graph = NULL;
+  }
+
+  if (kb->b_sched != NULL){
+    destroy_scheduler_kcs(kb->b_sched);
+    kb->b_sched = NULL;
+  }
+
 /*
   if (kb->b_sms != NULL){
     statemachine_destroy(d);
@@ -356,6 +380,9 @@ int setup_basic_kcs(struct katcp_dispatch *d, char *scripts, char **argv, int ar
   kb->b_argv       = argv;
   kb->b_argc       = argc;
   kb->b_ds         = NULL;
+  kb->b_graph      = NULL;
+  kb->b_sched      = NULL;
+  kb->b_pyworkers  = 0;
 
   kb->b_scripts = strdup(scripts);
   if(kb->b_scripts == NULL){
@@ -363,6 +390,13 @@ int setup_basic_kcs(struct katcp_dispatch *d, char *scripts, char **argv, int ar
     return -1;
   }
 
+  kb->b_sched = create_scheduler_kcs();
+  if(kb->b_sched == NULL){
+    free(kb->b_scripts);
+    free(kb);
+    return -1;
+  }
+
   /* TODO: trim out trailing / to make things look neater */
   if(store_full_mode_katcp(d, KCS_MODE_BASIC, KCS_MODE_BASIC_NAME, &enter_basic_kcs, NULL, kb, &destroy_basic_kcs) < 0){
     fprintf(stderr, "setup: unable to register basic mode\n");
@@ -385,6 +385,82 @@ void execpy_do(char * filename, char **argv){
 }
 
 
+/* persistent workers: .py scripts are handed to a pool of warm
+ * interpreters as ?execpy path [args] instead of forking one each */
+
+int setup_pyworkers_kcs(struct katcp_dispatch *d, unsigned int count, unsigned int recycle, char *worker, char *modules)
+{
+  struct kcs_basic *kb;
+  char *vector[6];
+  int i;
+
+  kb = get_mode_katcp(d, KCS_MODE_BASIC);
+  if(kb == NULL){
+    return -1;
+  }
+
+  if(count == 0){
+    return 0;
+  }
+
+  i = 0;
+  vector[i++] = worker ? worker : KCS_PYWORKER;
+  vector[i++] = "-r";
+  vector[i++] = KCS_PYWORKER_GROWTH;
+  if(modules){
+    vector[i++] = "-m";
+    vector[i++] = modules;
+  }
+  vector[i] = NULL;
+
+  if(launch_pool_katcp(d, KCS_PYWORKER_POOL, count, recycle, vector) < 0){
+    fprintf(stderr, "setup: unable to start %u python workers\n", count);
+    return -1;
+  }
+
+  kb->b_pyworkers = count;
+
+  return 0;
+}
+
+int submit_pyworker_kcs(struct katcp_dispatch *d, char *path, int argc, int (*call)(struct katcp_dispatch *d, struct katcp_notice *n, void *data))
+{
+  struct katcl_parse *px;
+  char *ptr;
+  int i;
+
+  px = create_parse_katcl();
+  if(px == NULL){
+    return -1;
+  }
+
+  if(add_string_parse_katcl(px, KATCP_FLAG_FIRST, "?" KCS_PYWORKER_POOL) < 0){
+    destroy_parse_katcl(px);
+    return -1;
+  }
+
+  if(add_string_parse_katcl(px, (argc > 1) ? 0 : KATCP_FLAG_LAST, path) < 0){
+    destroy_parse_katcl(px);
+    return -1;
+  }
+
+  for(i = 1; i < argc; i++){
+    /* WARNING: same as the forked case, arguments can't contain \0 */
+    ptr = arg_string_katcp(d, i);
+    if((ptr == NULL) || (add_string_parse_katcl(px, (i + 1 < argc) ? 0 : KATCP_FLAG_LAST, ptr) < 0)){
+      destroy_parse_katcl(px);
+      return -1;
+    }
+  }
+
+  if(submit_pool_katcp(d, KCS_PYWORKER_POOL, px, call, NULL) < 0){
+    destroy_parse_katcl(px);
+    return -1;
+  }
+
+  return 0;
+}
+
 #ifdef STANDALONE
 
 int greeting(char *app) {
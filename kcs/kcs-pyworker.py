@@ -0,0 +1,169 @@
+#!/usr/bin/env python
+
+# (c) 2011 SKA SA
+# Released under the GNU GPLv3 - see COPYING
+
+# persistent python worker for kcs: reads katcp requests on standard
+# input and runs ?execpy script [args] inside this interpreter, so that
+# modules preloaded with -m (and those imported by earlier scripts)
+# don't have to be loaded again. Script output is relayed as #log
+# messages, the same way execpy does for forked interpreters. Once the
+# resident size has grown by more than the -r limit the worker exits
+# after replying, kcs then starts a fresh one
+
+import os
+import sys
+import time
+import runpy
+import traceback
+
+escapes = { '\\' : '\\', '_' : ' ', '0' : '\0', 'n' : '\n', 'r' : '\r', 'e' : '\x1b', 't' : '\t', '@' : '' }
+
+def unescape(word):
+  out = []
+  i = 0
+  while i < len(word):
+    c = word[i]
+    if c == '\\' and i + 1 < len(word):
+      i += 1
+      out.append(escapes.get(word[i], word[i]))
+    else:
+      out.append(c)
+    i += 1
+  return ''.join(out)
+
+def escape(word):
+  if word == '':
+    return '\\@'
+  for (a, b) in (('\\', '\\\\'), (' ', '\\_'), ('\0', '\\0'), ('\n', '\\n'), ('\r', '\\r'), ('\x1b', '\\e'), ('\t', '\\t')):
+    word = word.replace(a, b)
+  return word
+
+def send(*words):
+  sys.__stdout__.write(' '.join(words) + '\n')
+  sys.__stdout__.flush()
+
+def log(level, name, text):
+  send('#log', level, '%.3f' % time.time(), escape(name), escape(text))
+
+def resident():
+  try:
+    f = open('/proc/self/statm')
+    pages = int(f.read().split()[1])
+    f.close()
+  except (IOError, ValueError, IndexError):
+    return 0
+  return pages * os.sysconf('SC_PAGE_SIZE')
+
+class Relay:
+  def __init__(self, name, level):
+    self.name = name
+    self.level = level
+    self.partial = ''
+
+  def write(self, text):
+    lines = (self.partial + text).split('\n')
+    self.partial = lines.pop()
+    for line in lines:
+      log(self.level, self.name, line)
+
+  def flush(self):
+    pass
+
+  def close(self):
+    if self.partial:
+      log(self.level, self.name, self.partial)
+      self.partial = ''
+
+def run(name, args):
+  out = Relay(name, 'info')
+  err = Relay(name, 'error')
+  saved = (sys.argv, sys.stdin, sys.stdout, sys.stderr, os.getcwd())
+
+  code = 'ok'
+
+  sys.argv = [name] + args
+  sys.stdin = open(os.devnull)
+  sys.stdout = out
+  sys.stderr = err
+
+  try:
+    try:
+      runpy.run_path(name, run_name='__main__')
+    except SystemExit:
+      status = sys.exc_info()[1].code
+      if status not in (None, 0):
+        code = 'fail'
+    except Exception:
+      traceback.print_exc()
+      code = 'fail'
+  finally:
+    out.close()
+    err.close()
+    sys.stdin.close()
+    (sys.argv, sys.stdin, sys.stdout, sys.stderr, cwd) = saved
+    os.chdir(cwd)
+
+  return code
+
+def main():
+  modules = []
+  limit = 256
+
+  i = 1
+  while i < len(sys.argv):
+    if sys.argv[i] == '-m' and i + 1 < len(sys.argv):
+      modules += [m for m in sys.argv[i + 1].split(',') if m]
+      i += 1
+    elif sys.argv[i] == '-r' and i + 1 < len(sys.argv):
+      limit = int(sys.argv[i + 1])
+      i += 1
+    else:
+      sys.stderr.write('%s: usage [-m module[,module]] [-r growth-megabytes]\n' % sys.argv[0])
+      return 2
+    i += 1
+
+  for m in modules:
+    try:
+      __import__(m)
+    except Exception:
+      log('warn', 'kcs-pyworker', 'unable to preload module %s: %s' % (m, sys.exc_info()[1]))
+
+  base = resident()
+  served = 0
+
+  while True:
+    line = sys.stdin.readline()
+    if line == '':
+      return 0
+
+    words = line.split()
+    if len(words) == 0 or words[0][0] != '?':
+      continue
+
+    request = words[0][1:]
+    reply = '!' + request
+    command = request.split('[')[0]
+    args = [unescape(w) for w in words[1:]]
+
+    if command == 'execpy':
+      if len(args) < 1:
+        send(reply, 'fail', 'usage')
+        continue
+      code = run(args[0], args[1:])
+      served += 1
+      grown = (resident() - base) / (1024 * 1024)
+      send(reply, code)
+      if limit > 0 and grown > limit:
+        log('info', 'kcs-pyworker', 'exiting after %d scripts as memory grew by %dMb' % (served, grown))
+        return 0
+    elif command == 'watchdog':
+      send(reply, 'ok')
+    elif command == 'halt':
+      send(reply, 'ok')
+      return 0
+    else:
+      send(reply, 'invalid', escape('unknown request %s' % command))
+
+if __name__ == '__main__':
+  sys.exit(main())
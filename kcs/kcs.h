@@ -11,6 +11,10 @@
 
 #define KCS_NOTICE_PYTHON   "python"
 
+#define KCS_PYWORKER_POOL   "execpy"
+#define KCS_PYWORKER        "kcs-pyworker.py"
+#define KCS_PYWORKER_GROWTH "256"  /* megabytes a worker may grow by before it is replaced */
+
 #ifdef DEBUG
 
 #define KCS_FOREGROUND 1
@@ -38,6 +42,11 @@ struct kcs_basic
   struct kcs_obj *b_pool_head;
 
   struct avl_tree *b_ds;
+
+  struct kcs_sm_graph *b_graph;
+  struct kcs_scheduler *b_sched;
+
+  unsigned int b_pyworkers;
 };
 
 
@@ -50,6 +59,14 @@ struct p_parser {
   time_t open_time;
   struct p_comment **comments;
   int comcount;
+
+  /* hashed lookups: labels by name, settings by label and name */
+  struct p_label **lindex;
+  struct p_setting **sindex;
+  unsigned int bins;
+  unsigned int entries;
+
+  int reused;
 };
 
 struct p_comment {
@@ -63,6 +80,15 @@ struct p_label {
   char *str;
   struct p_comment **comments;
   int comcount;
+
+  unsigned int hash;
+  struct p_label *chain;
+  int slot;
+
+  /* source section, unchanged ones are kept across a reload */
+  unsigned long long sum;
+  off_t len;
+  int dirty;
 };
 
 struct p_setting {
@@ -71,6 +97,10 @@ struct p_setting {
   char *str;
   struct p_comment **comments;
   int comcount;
+
+  unsigned int hash;
+  struct p_setting *chain;
+  struct p_label *label;
 };
 
 struct p_value {
@@ -101,6 +131,8 @@ struct e_state {
 };
 
 void execpy_do(char *filename, char **argv);
+int setup_pyworkers_kcs(struct katcp_dispatch *d, unsigned int count, unsigned int recycle, char *worker, char *modules);
+int submit_pyworker_kcs(struct katcp_dispatch *d, char *path, int argc, int (*call)(struct katcp_dispatch *d, struct katcp_notice *n, void *data));
 
 #define KCS_ID_ROACH        2 
 #define KCS_ID_NODE         1
@@ -109,16 +141,27 @@ void execpy_do(char *filename, char **argv);
 #define KCS_OK    0
 #define KCS_FAIL  1
 
+#define KCS_POOL_BINS      64   /* initial size of the name index, a power of two */
+
 struct kcs_obj {
   int tid;
   struct kcs_obj *parent;
   char *name;
   void *payload;
+
+  struct kcs_obj *chain; /* next in name index bin */
+  int slot;              /* position in parent children */
 };
 
 struct kcs_node {
   struct kcs_obj **children;
   int childcount;
+  int childsize;
+
+  /* name index of the whole tree, only kept in the root node */
+  struct kcs_obj **index;
+  unsigned int bins;
+  unsigned int tally;
 };
 
 struct kcs_roach {
@@ -193,6 +236,17 @@ int add_sensor_to_roach_kcs(struct katcp_dispatch *d, struct kcs_obj *ko);
 
 #define PROCESS_MASTER                  0x1
 #define PROCESS_SLAVE                   0x2
+#define PROCESS_CRITICAL                0x4
+#define PROCESS_BULK                    0x8
+
+/* priority classes, lower runs first */
+#define KCS_SCHED_CRITICAL              0
+#define KCS_SCHED_NORMAL                1
+#define KCS_SCHED_BULK                  2
+#define KCS_SCHED_CLASSES               3
+
+#define KCS_SCHED_LIMIT                 16 /* tasks in flight, critical ones excepted */
+#define KCS_SCHED_RESOURCE_LIMIT        2  /* tasks in flight per actor */
 
 struct katcp_module {
   char *m_name;
@@ -202,16 +256,47 @@ struct katcp_module {
 struct kcs_sched_task {
   int t_flags;
 
+  /* admission control, see dispatch_sched_kcs */
+  struct kcs_sched_task *t_next;
+  char *t_name;
+  char *t_resource;
+  int t_class;
+  int t_admitted;
+
   int t_state;
   int t_edge_i;
   int t_op_i;
 
   struct katcp_stack *t_stack;
-  struct kcs_sm_state *t_pc;
+
+  /* index of the current state in the compiled graph */
+  struct kcs_sm_graph *t_graph;
+  int t_pc;
   
   int t_rtn;
 };
 
+struct kcs_sched_busy {
+  char *b_resource;
+  int b_count;
+};
+
+struct kcs_scheduler {
+  struct kcs_sched_task *s_head[KCS_SCHED_CLASSES];
+  struct kcs_sched_task *s_tail[KCS_SCHED_CLASSES];
+  int s_queued[KCS_SCHED_CLASSES];
+  int s_running[KCS_SCHED_CLASSES];
+  unsigned long s_admitted[KCS_SCHED_CLASSES];
+
+  int s_limit;
+  int s_resource_limit;
+
+  /* only resources with tasks in flight, so never more than running */
+  struct kcs_sched_busy *s_busy;
+  int s_busy_count;
+  int s_busy_size;
+};
+
 struct kcs_sm {
   char *m_name;
 };
@@ -223,6 +308,7 @@ struct kcs_sm_op {
 
 struct kcs_sm_state {
   char *s_name;
+  int s_id; /* position in the most recently compiled graph */
   
   struct kcs_sm_edge **s_edge_list;
   int s_edge_list_count;
@@ -236,6 +322,35 @@ struct kcs_sm_edge {
   int (*e_call)(struct katcp_dispatch *, struct katcp_notice *, void *);
 };
 
+/* the states, edges and ops above laid out as flat arrays, states refer
+ * to their ops and edges as ranges, edges to their target by index */
+
+struct kcs_sm_link {
+  int l_next;
+  int (*l_call)(struct katcp_dispatch *, struct katcp_notice *, void *);
+};
+
+struct kcs_sm_node {
+  char *n_name;
+  int n_op_base;
+  int n_op_count;
+  int n_link_base;
+  int n_link_count;
+};
+
+struct kcs_sm_graph {
+  int g_refs;
+
+  struct kcs_sm_node *g_nodes;
+  int g_node_count;
+
+  struct kcs_sm_link *g_links;
+  int g_link_count;
+
+  struct kcs_sm_op *g_ops;
+  int g_op_count;
+};
+
 int *create_integer_type_kcs(int val);
 int init_statemachine_base_kcs(struct katcp_dispatch *d);
 
@@ -247,6 +362,12 @@ struct kcs_sm_op *create_sm_op_kcs(int (*call)(struct katcp_dispatch *d, struct
 struct kcs_sm_edge *create_sm_edge_kcs(struct kcs_sm_state *s_next, int (*call)(struct katcp_dispatch *d, struct katcp_notice *n, void *data));
 
 int start_process_kcs(struct katcp_dispatch *d, char *startnode, struct katcp_tobject *to, int flags);
+int schedule_process_kcs(struct katcp_dispatch *d, char *startnode, struct katcp_tobject *to, int flags, char *resource);
+struct kcs_sm_graph *compile_graph_kcs(struct katcp_dispatch *d);
+void release_graph_kcs(struct kcs_sm_graph *g);
+
+struct kcs_scheduler *create_scheduler_kcs(void);
+void destroy_scheduler_kcs(struct kcs_scheduler *s);
 int trigger_edge_process_kcs(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_tobject *to);
 
 int init_actor_tag_katcp(struct katcp_dispatch *d);
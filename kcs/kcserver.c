@@ -37,6 +37,10 @@ void usage(char *app)
   printf("-i init-file     file containing commands to run at startup\n");
   printf("-l log-file      log file name\n");
   printf("-f               run in foreground (default is background)\n");
+  printf("-w count         python workers to run .py scripts in (default 0, fork each)\n");
+  printf("-W worker        python worker executable (default %s)\n", KCS_PYWORKER);
+  printf("-M modules       comma separated modules for the workers to preload\n");
+  printf("-R count         scripts a worker runs before being replaced (default 0, never)\n");
 
 }
 
@@ -47,7 +51,8 @@ int main(int argc, char **argv)
   struct utsname un;
   int status;
   int i, j, c, foreground, lfd;
-  char *port, *scripts, *mode, *init, *lfile;
+  char *port, *scripts, *mode, *init, *lfile, *worker, *modules;
+  unsigned int workers, recycle;
   char uname_buffer[UNAME_BUFFER];
   time_t now;
 
@@ -57,6 +62,10 @@ int main(int argc, char **argv)
   init = NULL;
   lfile = KCS_LOGFILE;
   foreground = KCS_FOREGROUND;
+  worker = NULL;
+  modules = NULL;
+  workers = 0;
+  recycle = 0;
 
   i = 1;
   j = 1;
@@ -85,6 +94,10 @@ int main(int argc, char **argv)
         case 's' :
         case 'p' :
         case 'i' :
+        case 'w' :
+        case 'W' :
+        case 'M' :
+        case 'R' :
           j++;
           if (argv[i][j] == '\0') {
             j = 0;
@@ -111,6 +124,18 @@ int main(int argc, char **argv)
             case 'l':
               lfile = argv[i] + j;  
               break;
+            case 'w' :
+              workers = atoi(argv[i] + j);
+              break;
+            case 'W' :
+              worker = argv[i] + j;
+              break;
+            case 'M' :
+              modules = argv[i] + j;
+              break;
+            case 'R' :
+              recycle = atoi(argv[i] + j);
+              break;
           }
           i++;
           j = 1;
@@ -160,6 +185,11 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  if(setup_pyworkers_kcs(d, workers, recycle, worker, modules) < 0){
+    fprintf(stderr, "%s: unable to start python workers\n", argv[0]);
+    return 1;
+  }
+
   /* mode from command line */
   if(mode){
     if(enter_name_mode_katcp(d, mode, NULL) < 0){
@@ -10,6 +10,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
 
 #include <katcp.h>
@@ -34,6 +35,20 @@
 #define OKAY 1
 #define FAIL 0
 
+/* fnv-1a, the short one for lookups, the long one to spot changed sections */
+#define P_HASH_BASIS  2166136261U
+#define P_HASH_PRIME  16777619U
+#define P_SUM_BASIS   14695981039346656037ULL
+#define P_SUM_PRIME   1099511628211ULL
+
+#define P_MIN_BINS    16
+
+struct p_span {
+  off_t start;
+  off_t name;
+  off_t name_end;
+};
+
 int greeting(char *app)
 {
   fprintf(stderr,"ROACH Configuration Parser\n\n\tUsage:\t%s -f [filename]\n\n",app);
@@ -78,6 +93,179 @@ char *rm_whitespace(char *str)
 }
 
 
+static unsigned int hash_string_parser(unsigned int h, char *str){
+  unsigned char *ptr;
+
+  for (ptr = (unsigned char *)str; *ptr != '\0'; ptr++){
+    h ^= *ptr;
+    h *= P_HASH_PRIME;
+  }
+
+  return h;
+}
+
+static unsigned int hash_label_parser(char *label){
+  return hash_string_parser(P_HASH_BASIS, label);
+}
+
+static unsigned int hash_setting_parser(char *label, char *setting){
+  /* the terminating nul of the label keeps "ab"/"c" apart from "a"/"bc" */
+  return hash_string_parser(hash_label_parser(label) * P_HASH_PRIME, setting);
+}
+
+static unsigned long long sum_section_parser(char *buf, off_t start, off_t end){
+  unsigned long long sum;
+  off_t i;
+
+  sum = P_SUM_BASIS;
+  for (i=start;i<end;i++){
+    sum ^= (unsigned char)buf[i];
+    sum *= P_SUM_PRIME;
+  }
+
+  return sum;
+}
+
+static int alloc_index_parser(struct p_parser *p){
+  struct p_label **lindex;
+  struct p_setting **sindex;
+  unsigned int bins, entries;
+  int i;
+
+  entries = 0;
+  for (i=0;i<p->lcount;i++){
+    entries += p->labels[i]->scount;
+  }
+
+  bins = P_MIN_BINS;
+  while ((bins < entries) || (bins < p->lcount)){
+    bins *= 2;
+  }
+
+  lindex = calloc(bins,sizeof(struct p_label *));
+  sindex = calloc(bins,sizeof(struct p_setting *));
+  if (lindex == NULL || sindex == NULL){
+    if (lindex) free(lindex);
+    if (sindex) free(sindex);
+    return FAIL;
+  }
+
+  if (p->lindex) free(p->lindex);
+  if (p->sindex) free(p->sindex);
+
+  p->lindex  = lindex;
+  p->sindex  = sindex;
+  p->bins    = bins;
+  p->entries = entries;
+
+  return OKAY;
+}
+
+static void fill_index_parser(struct p_parser *p){
+  struct p_label *cl;
+  struct p_setting *cs;
+  unsigned int b;
+  int i,j;
+
+  memset(p->lindex,0,sizeof(struct p_label *)*p->bins);
+  memset(p->sindex,0,sizeof(struct p_setting *)*p->bins);
+
+  /* insert back to front, so the first occurrence is found first, as with a scan */
+  for (i=p->lcount-1;i>=0;i--){
+    cl = p->labels[i];
+    cl->slot  = i;
+    cl->hash  = hash_label_parser(cl->str);
+    b = cl->hash & (p->bins - 1);
+    cl->chain = p->lindex[b];
+    p->lindex[b] = cl;
+
+    for (j=cl->scount-1;j>=0;j--){
+      cs = cl->settings[j];
+      cs->label = cl;
+      cs->hash  = hash_setting_parser(cl->str,cs->str);
+      b = cs->hash & (p->bins - 1);
+      cs->chain = p->sindex[b];
+      p->sindex[b] = cs;
+    }
+  }
+}
+
+static int index_parser(struct p_parser *p){
+  if (!alloc_index_parser(p))
+    return FAIL;
+
+  fill_index_parser(p);
+
+  return OKAY;
+}
+
+static struct p_label *find_label_parser(struct p_parser *p, char *label){
+  struct p_label *cl;
+  unsigned int h;
+
+  if (p->lindex == NULL)
+    return NULL;
+
+  h = hash_label_parser(label);
+
+  for (cl = p->lindex[h & (p->bins - 1)]; cl != NULL; cl = cl->chain){
+    if ((cl->hash == h) && (strcmp(label,cl->str) == 0))
+      return cl;
+  }
+
+  return NULL;
+}
+
+static struct p_setting *find_setting_parser(struct p_parser *p, char *label, char *setting){
+  struct p_setting *cs;
+  unsigned int h;
+
+  if (p->sindex == NULL)
+    return NULL;
+
+  h = hash_setting_parser(label,setting);
+
+  for (cs = p->sindex[h & (p->bins - 1)]; cs != NULL; cs = cs->chain){
+    if ((cs->hash == h) && (strcmp(setting,cs->str) == 0) && (strcmp(label,cs->label->str) == 0))
+      return cs;
+  }
+
+  return NULL;
+}
+
+static int add_label_index_parser(struct p_parser *p, struct p_label *cl){
+  unsigned int b;
+
+  cl->slot = p->lcount - 1;
+
+  if (p->lindex == NULL || p->lcount > (2 * p->bins))
+    return index_parser(p);
+
+  cl->hash  = hash_label_parser(cl->str);
+  b = cl->hash & (p->bins - 1);
+  cl->chain = p->lindex[b];
+  p->lindex[b] = cl;
+
+  return OKAY;
+}
+
+static int add_setting_index_parser(struct p_parser *p, struct p_label *cl, struct p_setting *cs){
+  unsigned int b;
+
+  cs->label = cl;
+  p->entries++;
+
+  if (p->sindex == NULL || p->entries > (2 * p->bins))
+    return index_parser(p);
+
+  cs->hash  = hash_setting_parser(cl->str,cs->str);
+  b = cs->hash & (p->bins - 1);
+  cs->chain = p->sindex[b];
+  p->sindex[b] = cs;
+
+  return OKAY;
+}
+
 int store_comment(struct p_parser *p, char *buf, int start, int end){
 
   struct p_comment *c;
@@ -144,6 +332,12 @@ int store_label(struct p_parser *p, char *buf, int start, int end){
   l->str      = NULL;
   l->comments = NULL;
   l->comcount = 0;
+  l->hash     = 0;
+  l->chain    = NULL;
+  l->slot     = (-1);
+  l->sum      = 0;
+  l->len      = 0;
+  l->dirty    = 0;
 
   len = end - start;
   l->str = malloc(sizeof(char)*len+1);
@@ -184,6 +378,9 @@ int store_setting(struct p_parser *p, char *buf, int start, int end){
   s->str      = NULL;
   s->comments = NULL;
   s->comcount = 0;
+  s->hash     = 0;
+  s->chain    = NULL;
+  s->label    = NULL;
 
   len = end - start;
   s->str = malloc(sizeof(char)*len+1);
@@ -202,9 +399,17 @@ int store_setting(struct p_parser *p, char *buf, int start, int end){
   fprintf(stderr,"SETTING: {%s}\n",s->str);
 #endif
 
+  if (p->lcount <= 0){
+    /* a setting outside of any label */
+    free(s->str);
+    free(s);
+    return FAIL;
+  }
+
   l = p->labels[p->lcount-1];
   l->settings = realloc(l->settings,sizeof(struct p_setting*)*(++l->scount));
   l->settings[l->scount-1] = s;
+  s->label = l;
   
   return OKAY;
 }
@@ -249,47 +454,14 @@ int store_value(struct p_parser *p, char *buf, int start, int end){
   return OKAY;
 }
 
-int start_parser(struct p_parser *p, char *f) {
-  
-  FILE *file;
-  int i,fd,pos;
+static int parse_range_parser(struct p_parser *p, char *buffer, off_t from, off_t to){
+  off_t i,pos;
   char c;
-  char *buffer, *temp;
-  struct stat file_stats;
-
-  temp   = NULL;
-  buffer = NULL;
-  file   = fopen(f,"r");
-
-  if (file == NULL){
-    fprintf(stderr,"Error Reading File: %s\n",f);
-    return errno;
-  }
-  fd     = fileno(file);
-  if (stat(f,&file_stats) != 0)
-    return errno;
-  
-  p->open_time = file_stats.st_atime;
-  p->fsize     = file_stats.st_size; 
-
-  buffer = mmap(NULL,p->fsize,PROT_READ,MAP_SHARED,fd,0);
-
-  if (buffer == MAP_FAILED){
-#ifdef DEBUG
-    fprintf(stderr,"mmap failed: %s\n",strerror(errno));
-#endif
-    fclose(file);
-    return EIO;
-  }
-
-#ifdef DEBUG
-  fprintf(stderr,"fd: %d st_atime:%d st_size:%d mmap:%p\n",fd,(int)p->open_time,(int)p->fsize,buffer);
-#endif
 
   p->state = S_START; 
-  pos=0;
+  pos = from;
 
-  for (i=0;i<p->fsize;i++){
+  for (i=from;i<to;i++){
     c = buffer[i];
     
     switch (p->state){
@@ -299,7 +471,7 @@ int start_parser(struct p_parser *p, char *f) {
           case '\n':
           case '\r':
             if (!store_comment(p,buffer,pos,i))
-              return KATCP_RESULT_FAIL;
+              return FAIL;
             p->state = S_START;
             pos = i+1;
             break;
@@ -310,7 +482,7 @@ int start_parser(struct p_parser *p, char *f) {
         switch(c){
           case CLABEL:
             if (!store_label(p,buffer,pos,i))
-              return KATCP_RESULT_FAIL;
+              return FAIL;
             p->state = S_START;
             pos = i;
             break;
@@ -319,7 +491,7 @@ int start_parser(struct p_parser *p, char *f) {
 
       case S_SETTING:
         if (!store_setting(p,buffer,pos,i-1))
-          return KATCP_RESULT_FAIL;
+          return FAIL;
         pos = i;
         p->state = S_VALUE;
         break;
@@ -332,14 +504,14 @@ int start_parser(struct p_parser *p, char *f) {
             break;
           case VALUE:
             if (!store_value(p,buffer,pos,i))
-              return KATCP_RESULT_FAIL;
+              return FAIL;
             p->state = S_VALUE;
             pos = i+1;
             break;
           case '\n':
           case '\r':
             if (!store_value(p,buffer,pos,i))
-              return KATCP_RESULT_FAIL;
+              return FAIL;
             p->state = S_START;
             pos = i+1;
             break;
@@ -350,7 +522,7 @@ int start_parser(struct p_parser *p, char *f) {
           switch(c){
             case CLABEL:
               if (!store_value(p,buffer,pos,i+1))
-                return KATCP_RESULT_FAIL;
+                return FAIL;
               p->state = S_START;
               break;
           }
@@ -378,10 +550,231 @@ int start_parser(struct p_parser *p, char *f) {
     }
   }
 
+  return OKAY;
+}
+
+/* finds the sections with the same transitions as parse_range_parser, without storing anything */
+static int scan_sections_parser(char *buffer, off_t size, struct p_span **spans, int *count){
+  struct p_span *tmp, current;
+  int state, have;
+  off_t i;
+
+  state = S_START;
+  have  = 0;
+  current.start = current.name = current.name_end = 0;
+
+  for (i=0;i<size;i++){
+    switch (state){
+      case S_COMMENT:
+        if (buffer[i] == '\n' || buffer[i] == '\r')
+          state = S_START;
+        break;
+
+      case S_LABEL:
+        if (buffer[i] == CLABEL){
+          current.name_end = i;
+          if (have <= *count){
+            tmp = realloc(*spans,sizeof(struct p_span)*(have+16));
+            if (tmp == NULL)
+              return FAIL;
+            *spans = tmp;
+            *count = have + 16;
+          }
+          (*spans)[have++] = current;
+          state = S_START;
+        }
+        break;
+
+      case S_SETTING:
+        state = S_VALUE;
+        break;
+
+      case S_VALUE:
+        switch (buffer[i]){
+          case OLABEL:
+            state = S_MLVALUE;
+            break;
+          case '\n':
+          case '\r':
+            state = S_START;
+            break;
+        }
+        break;
+
+      case S_MLVALUE:
+        if (buffer[i] == CLABEL)
+          state = S_START;
+        break;
+
+      default:
+        switch (buffer[i]){
+          case COMMENT:
+            state = S_COMMENT;
+            break;
+          case OLABEL:
+            current.start = i;
+            current.name  = i+1;
+            state = S_LABEL;
+            break;
+          case SETTING:
+            state = S_SETTING;
+            break;
+        }
+        break;
+    }
+  }
+
+  *count = have;
+
+  return OKAY;
+}
+
+/* hand sections taken over from the previous load back to it, or let go of them for good */
+static void settle_reused_parser(struct p_parser *p, struct p_parser *old, int keep){
+  struct p_label *cl;
+  int i;
+
+  if (old == NULL)
+    return;
+
+  for (i=0;i<p->lcount;i++){
+    cl = p->labels[i];
+    if (cl->slot < 0)
+      continue;
+    if (keep){
+      cl->slot = (-1);
+    } else {
+      old->labels[cl->slot] = cl;
+      p->labels[i] = NULL;
+    }
+  }
+}
+
+static int section_parser(struct p_parser *p, struct p_parser *old, char *buffer, struct p_span *span, off_t end){
+  struct p_label *cl, **tmp;
+  unsigned long long sum;
+  char *name;
+  int before;
+
+  sum = sum_section_parser(buffer,span->start,end);
+
+  if (old != NULL){
+    name = strndup(buffer+span->name,span->name_end-span->name);
+    name = rm_whitespace(name);
+    if (name == NULL)
+      return FAIL;
+
+    cl = find_label_parser(old,name);
+    free(name);
+
+    if (cl != NULL && cl->slot >= 0 && old->labels[cl->slot] == cl && !cl->dirty && cl->len == (end - span->start) && cl->sum == sum){
+      tmp = realloc(p->labels,sizeof(struct p_label*)*(p->lcount+1));
+      if (tmp == NULL)
+        return FAIL;
+      p->labels = tmp;
+      p->labels[p->lcount++] = cl;
+      /* slot still names its place in old, see settle_reused_parser */
+      old->labels[cl->slot] = NULL;
+      p->reused++;
+#ifdef DEBUG
+      fprintf(stderr,"PARSER section [%s] unchanged\n",cl->str);
+#endif
+      return OKAY;
+    }
+  }
+
+  before = p->lcount;
+
+  if (!parse_range_parser(p,buffer,span->start,end))
+    return FAIL;
+
+  if (p->lcount > before){
+    cl = p->labels[p->lcount-1];
+    cl->sum = sum;
+    cl->len = end - span->start;
+  }
+
+  return OKAY;
+}
+
+int start_parser(struct p_parser *p, char *f, struct p_parser *old) {
+  
+  int i,fd,count,result;
+  char *buffer;
+  struct stat file_stats;
+  struct p_span *spans;
+  off_t end;
+
+  fd = open(f,O_RDONLY);
+  if (fd < 0){
+    fprintf(stderr,"Error Reading File: %s\n",f);
+    return errno;
+  }
+
+  if (fstat(fd,&file_stats) != 0){
+    result = errno;
+    close(fd);
+    return result;
+  }
+  
+  p->open_time = file_stats.st_atime;
+  p->fsize     = file_stats.st_size; 
+
+  if (p->fsize <= 0){
+    close(fd);
+    return (index_parser(p) == OKAY) ? EX_OK : ENOMEM;
+  }
+
+  buffer = mmap(NULL,p->fsize,PROT_READ,MAP_SHARED,fd,0);
+
+  if (buffer == MAP_FAILED){
+#ifdef DEBUG
+    fprintf(stderr,"mmap failed: %s\n",strerror(errno));
+#endif
+    close(fd);
+    return EIO;
+  }
+
+#ifdef DEBUG
+  fprintf(stderr,"fd: %d st_atime:%d st_size:%d mmap:%p\n",fd,(int)p->open_time,(int)p->fsize,buffer);
+#endif
+
+  spans  = NULL;
+  count  = 0;
+  result = EX_OK;
+
+  if (!scan_sections_parser(buffer,p->fsize,&spans,&count)){
+    result = ENOMEM;
+  } else if (!parse_range_parser(p,buffer,0,(count > 0) ? spans[0].start : p->fsize)){
+    result = EINVAL;
+  } else {
+    for (i=0;i<count;i++){
+      end = ((i+1) < count) ? spans[i+1].start : p->fsize;
+      if (!section_parser(p,old,buffer,&(spans[i]),end)){
+        result = EINVAL;
+        break;
+      }
+    }
+  }
+
+  /* allocate before settling, filling in the index can not fail */
+  if (result == EX_OK && !alloc_index_parser(p)){
+    result = ENOMEM;
+  }
+
+  settle_reused_parser(p,old,(result == EX_OK) ? 1 : 0);
+
+  if (result == EX_OK){
+    fill_index_parser(p);
+  }
+
+  if (spans != NULL)
+    free(spans);
+
   munmap(buffer,p->fsize);
-  fclose(file);
+  close(fd);
   
-  return EX_OK;
+  return result;
 }
 
 void show_tree(struct katcp_dispatch *d, struct p_parser *p){
@@ -441,51 +834,55 @@ void show_tree(struct katcp_dispatch *d, struct p_parser *p){
 
 }
 
+static void destroy_label_parser(struct p_label *cl){
+  int j,k;
+
+  struct p_setting *cs;
+  struct p_value *cv;
+  struct p_comment *cc;
+
+  for (j=0;j<cl->scount;j++){
+    cs = cl->settings[j];
+    for (k=0;k<cs->vcount;k++){
+      cv = cs->values[k];
+      free(cv->str);
+      free(cv);
+    }
+    for (k=0;k<cs->comcount;k++){
+      cc = cs->comments[k];
+      free(cc->str);
+      free(cc);
+    }
+    if (cs->comments != NULL)
+      free(cs->comments);
+    free(cs->str);
+    free(cs->values);
+    free(cs);
+  }
+  for (j=0;j<cl->comcount;j++){
+    cc = cl->comments[j];
+    free(cc->str);
+    free(cc);
+  }
+  if (cl->comments != NULL)
+    free(cl->comments);
+  free(cl->str);
+  free(cl->settings);
+  free(cl);
+}
+
 void clean_up_parser(struct p_parser *p){
   //fprintf(stderr,"Starting parser cleanup\n");
 
-  int i,j,k;
+  int i;
   
-  struct p_label *cl;
-  struct p_setting *cs;
-  struct p_value *cv;
   struct p_comment *cc;
 
   if (p != NULL) {
     for (i=0;i<p->lcount;i++){
-      cl = p->labels[i];
-      for (j=0;j<cl->scount;j++){
-        cs = cl->settings[j];
-        for (k=0;k<cs->vcount;k++){
-          cv = cs->values[k];
-          free(cv->str);
-          free(cv);
-        }
-        for (k=0;k<cs->comcount;k++){
-          cc = cs->comments[k];
-     //     fprintf(stderr,"FREE COMMENT: %s\n",cc->str);
-          free(cc->str);
-          free(cc);
-        }
-        if (cs->comments != NULL)
-          free(cs->comments);
-        //fprintf(stderr,"\t\tPARSER FREE'd %d vals\n",cs->vcount);
-        free(cs->str);
-        free(cs->values);
-        free(cs);
-      }
-      for (j=0;j<cl->comcount;j++){
-        cc = cl->comments[j];
-   //     fprintf(stderr,"FREE COMMENT: %s\n",cc->str);
-        free(cc->str);
-        free(cc);
-      }
-      if (cl->comments != NULL)
-        free(cl->comments);
-      //fprintf(stderr,"\tPARSER FREE'd %d settings\n",cl->scount);
-      free(cl->str);
-      free(cl->settings);
-      free(cl);
+      /* empty slots were handed on to a reloaded parser */
+      if (p->labels[i] != NULL)
+        destroy_label_parser(p->labels[i]);
     }
     
     //fprintf(stderr,"PARSER FREE'd %d labels\n",p->lcount);
@@ -494,6 +891,10 @@ void clean_up_parser(struct p_parser *p){
       free(p->labels);
     if (p->filename != NULL)
       free(p->filename);
+    if (p->lindex != NULL)
+      free(p->lindex);
+    if (p->sindex != NULL)
+      free(p->sindex);
     
     for (i=0;i<p->comcount;i++){
       cc = p->comments[i];
@@ -501,7 +902,8 @@ void clean_up_parser(struct p_parser *p){
       free(cc->str);
       free(cc);
     }
-    free(p->comments);
+    if (p->comments != NULL)
+      free(p->comments);
 
     free(p);
     p = NULL;
@@ -588,23 +990,11 @@ int save_tree(struct p_parser *p,char *filename, int force){
 
 struct p_value * get_label_setting_value(struct katcp_dispatch *d,struct p_parser *p, char *srcl, char *srcs, unsigned long vidx){
 
-  int i,j;
-
-  struct p_label *cl;
   struct p_setting *cs;
 
-  for (i=0;i<p->lcount;i++){
-    cl = p->labels[i];
-    if (strcmp(srcl,cl->str)==0){
-      for (j=0;j<cl->scount;j++){
-        cs = cl->settings[j];
-        if (strcmp(srcs,cs->str)==0){
-          if (cs->values[vidx] != NULL){
-            return cs->values[vidx];
-          }
-        }
-      }
-    }
+  cs = find_setting_parser(p,srcl,srcs);
+  if (cs != NULL && vidx < cs->vcount && cs->values[vidx] != NULL){
+    return cs->values[vidx];
   }
 
   log_message_katcp(d,KATCP_LEVEL_INFO,NULL,"Could not find [%s] %s(%d)",srcl,srcs,vidx);
@@ -612,137 +1002,186 @@ struct p_value * get_label_setting_value(struct katcp_dispatch *d,struct p_parse
 }
 
 struct p_value **parser_get_values(struct p_parser *p, char *s, int *count){
-  int i,j;
-  struct p_label *cl;
+  int i;
   struct p_setting *cs;
 
+  /* one hashed probe per label, rather than a compare per setting */
   for (i=0;i<p->lcount;i++){
-    cl = p->labels[i];
-    for (j=0;j<cl->scount;j++){
-      cs = cl->settings[j];
-      if (strcmp(s,cs->str) == 0){
-        *count = cs->vcount;
-        return cs->values;
-      }
+    cs = find_setting_parser(p,p->labels[i]->str,s);
+    if (cs != NULL){
+      *count = cs->vcount;
+      return cs->values;
     }
   }
   return NULL;
 }
 
-int set_label_setting_value(struct katcp_dispatch *d,struct p_parser *p, char *srcl, char *srcs, unsigned long vidx, char *newval){
+static struct p_value *create_value_parser(char *str){
+  struct p_value *v;
 
-  int i,j;
+  v = malloc(sizeof(struct p_value));
+  if (v == NULL)
+    return NULL;
 
-  struct p_label *cl;
+  v->str = strdup(str);
+  if (v->str == NULL){
+    free(v);
+    return NULL;
+  }
+
+  return v;
+}
+
+static struct p_setting *create_setting_parser(char *str, char *val){
   struct p_setting *cs;
-  struct p_value *cv;
 
-  for (i=0;i<p->lcount;i++){
-    cl = p->labels[i];
-    
-    if (strcmp(srcl,cl->str)==0){ //if label exists
-      for (j=0;j<cl->scount;j++){
-        cs = cl->settings[j];
-        
-        if (strcmp(srcs,cs->str)==0){ //if settings exists
-          
-          if (cs->vcount > vidx && cs->values[vidx] != NULL){ //if value index exists
-            cv = cs->values[vidx];
-            if (cv->str != NULL){
-              log_message_katcp(d,KATCP_LEVEL_INFO,NULL,"OLD Value: %s",cv->str);
-              free(cv->str);
-            }
-            cv->str = strdup(newval);
-            
-           // fprintf(stderr,"label,setting,value exist ... update\n");
-
-            log_message_katcp(d,KATCP_LEVEL_INFO,NULL,"Updateing value for %s/%s",srcl,srcs);
-            
-            return KATCP_RESULT_OK;
-          }
-          else { //can find the value at vidx so create a new value for setting at scount+1
-            if (cs->values == NULL){
-              cs->vcount++;
-              cs->values = malloc(sizeof(struct p_value*));
-            }
-            else {
-              cs->vcount++;
-              cs->values = realloc(cs->values,sizeof(struct p_value*)*cs->vcount);
-            }
-
-            struct p_value *nv;
-            nv = malloc(sizeof(struct p_value));
-            nv->str = strdup(newval);
-
-            cs->values[cs->vcount-1] = nv;
-
-            log_message_katcp(d,KATCP_LEVEL_INFO,NULL,"Adding new value for %s/%s",srcl,srcs);
-            //fprintf(stderr,"label,setting exist ... create new value\n");
-            return KATCP_RESULT_OK;
-          }
+  cs = malloc(sizeof(struct p_setting));
+  if (cs == NULL)
+    return NULL;
 
-        }
-      }
+  cs->vcount   = 0;
+  cs->comments = NULL;
+  cs->comcount = 0;
+  cs->hash     = 0;
+  cs->chain    = NULL;
+  cs->label    = NULL;
+
+  cs->str    = strdup(str);
+  cs->values = malloc(sizeof(struct p_value*));
+  if (cs->str == NULL || cs->values == NULL){
+    if (cs->str) free(cs->str);
+    if (cs->values) free(cs->values);
+    free(cs);
+    return NULL;
+  }
+
+  cs->values[0] = create_value_parser(val);
+  if (cs->values[0] == NULL){
+    free(cs->str);
+    free(cs->values);
+    free(cs);
+    return NULL;
+  }
+  cs->vcount = 1;
+
+  return cs;
+}
+
+static int append_setting_parser(struct p_parser *p, struct p_label *cl, struct p_setting *cs){
+  struct p_setting **tmp;
+
+  tmp = realloc(cl->settings,sizeof(struct p_setting*)*(cl->scount+1));
+  if (tmp == NULL)
+    return FAIL;
+
+  cl->settings = tmp;
+  cl->settings[cl->scount++] = cs;
+
+  return add_setting_index_parser(p,cl,cs);
+}
+
+int set_label_setting_value(struct katcp_dispatch *d,struct p_parser *p, char *srcl, char *srcs, unsigned long vidx, char *newval){
+
+  struct p_label *cl, **tmp;
+  struct p_setting *cs;
+  struct p_value *cv, **vtmp;
+  char *str;
+
+  cl = find_label_parser(p,srcl);
+
+  if (cl != NULL){ //if label exists
+    /* edited in memory, a reload has to parse this section again */
+    cl->dirty = 1;
+
+    cs = find_setting_parser(p,srcl,srcs);
+
+    if (cs != NULL){ //if settings exists
       
-      if (cl->settings == NULL){
-        cl->scount++;
-        cl->settings = malloc(sizeof(struct p_setting*));
-      }
-      else {
-        cl->scount++;
-        cl->settings = realloc(cl->settings,sizeof(struct p_setting*)*cl->scount);
+      if (cs->vcount > vidx && cs->values[vidx] != NULL){ //if value index exists
+        cv = cs->values[vidx];
+        str = strdup(newval);
+        if (str == NULL)
+          return KATCP_RESULT_FAIL;
+        if (cv->str != NULL){
+          log_message_katcp(d,KATCP_LEVEL_INFO,NULL,"OLD Value: %s",cv->str);
+          free(cv->str);
+        }
+        cv->str = str;
+
+        log_message_katcp(d,KATCP_LEVEL_INFO,NULL,"Updateing value for %s/%s",srcl,srcs);
+        
+        return KATCP_RESULT_OK;
       }
-      struct p_setting *ns;
-      ns = malloc(sizeof(struct p_setting));
 
-      ns->str = strdup(srcs);
-      ns->values = malloc(sizeof(struct p_value*));
-      ns->vcount = 1;
+      //can find the value at vidx so create a new value for setting at scount+1
+      cv = create_value_parser(newval);
+      if (cv == NULL)
+        return KATCP_RESULT_FAIL;
 
-      struct p_value *nv;
-      nv = malloc(sizeof(struct p_value));
-      nv->str = strdup(newval);
+      vtmp = realloc(cs->values,sizeof(struct p_value*)*(cs->vcount+1));
+      if (vtmp == NULL){
+        free(cv->str);
+        free(cv);
+        return KATCP_RESULT_FAIL;
+      }
+      cs->values = vtmp;
+      cs->values[cs->vcount++] = cv;
 
-      ns->values[0] = nv;
-      cl->settings[cl->scount-1] = ns;
-      
-      log_message_katcp(d,KATCP_LEVEL_INFO,NULL,"Adding setting and value for %s",srcl);
-      //fprintf(stderr,"label exists ... create new setting and value\n");
+      log_message_katcp(d,KATCP_LEVEL_INFO,NULL,"Adding new value for %s/%s",srcl,srcs);
       return KATCP_RESULT_OK;
-    } 
-  }
-  
-  if (p->labels == NULL){
-    p->lcount++;
-    p->labels = malloc(sizeof(struct p_label*));
+    }
+    
+    cs = create_setting_parser(srcs,newval);
+    if (cs == NULL)
+      return KATCP_RESULT_FAIL;
+
+    if (!append_setting_parser(p,cl,cs)){
+      return KATCP_RESULT_FAIL;
+    }
+    
+    log_message_katcp(d,KATCP_LEVEL_INFO,NULL,"Adding setting and value for %s",srcl);
+    return KATCP_RESULT_OK;
   }
-  else {
-    p->lcount++;
-    p->labels = realloc(p->labels,sizeof(struct p_label*)*p->lcount);
+
+  cl = malloc(sizeof(struct p_label));
+  if (cl == NULL)
+    return KATCP_RESULT_FAIL;
+
+  cl->settings = NULL;
+  cl->scount   = 0;
+  cl->comments = NULL;
+  cl->comcount = 0;
+  cl->hash     = 0;
+  cl->chain    = NULL;
+  cl->slot     = (-1);
+  cl->sum      = 0;
+  cl->len      = 0;
+  cl->dirty    = 1;
+
+  cl->str = strdup(srcl);
+  tmp = realloc(p->labels,sizeof(struct p_label*)*(p->lcount+1));
+  if (cl->str == NULL || tmp == NULL){
+    if (cl->str) free(cl->str);
+    free(cl);
+    return KATCP_RESULT_FAIL;
   }
 
-  struct p_label *nl;
-  nl = malloc(sizeof(struct p_label));
-  nl->scount = 1;
-  nl->str = strdup(srcl);
-  nl->settings = malloc(sizeof(struct p_setting*));
+  p->labels = tmp;
+  p->labels[p->lcount++] = cl;
 
-  struct p_setting *ns;
-  ns = malloc(sizeof(struct p_setting));
-  ns->str = strdup(srcs);
-  ns->values = malloc(sizeof(struct p_value*));
-  ns->vcount=1;
+  if (!add_label_index_parser(p,cl)){
+    return KATCP_RESULT_FAIL;
+  }
 
-  struct p_value *nv;
-  nv = malloc(sizeof(struct p_value));
-  nv->str = strdup(newval);
+  cs = create_setting_parser(srcs,newval);
+  if (cs == NULL)
+    return KATCP_RESULT_FAIL;
 
-  ns->values[0] = nv;
-  nl->settings[0] = ns;
-  p->labels[p->lcount-1] = nl;
+  if (!append_setting_parser(p,cl,cs)){
+    return KATCP_RESULT_FAIL;
+  }
 
   log_message_katcp(d,KATCP_LEVEL_INFO,NULL,"Added new label setting and value");
-  //fprintf(stderr,"... none exist\n");
   return KATCP_RESULT_OK;
 }
 
@@ -821,25 +1260,37 @@ int parser_load(struct katcp_dispatch *d, char *filename){
   int rtn;
   
   struct kcs_basic *kb;
-  struct p_parser *p;
+  struct p_parser *p, *old;
   kb = get_mode_katcp(d,KCS_MODE_BASIC);
   
   if (kb == NULL)
     return KATCP_RESULT_FAIL;
 
-  p = kb->b_parser;
+  old = kb->b_parser;
 
-  if (p != NULL){
-    clean_up_parser(p);
-  }
-  
   p = malloc(sizeof(struct p_parser));
+  if (p == NULL)
+    return KATCP_RESULT_FAIL;
+
+  p->state    = S_START;
   p->lcount   = 0;
   p->labels   = NULL;
   p->comments = NULL;
   p->comcount = 0;
   p->fsize    = 0;
-  rtn = start_parser(p,filename);
+  p->filename = NULL;
+  p->lindex   = NULL;
+  p->sindex   = NULL;
+  p->bins     = 0;
+  p->entries  = 0;
+  p->reused   = 0;
+
+  /* reloading the same file only parses the sections which changed */
+  if (old != NULL && old->filename != NULL && strcmp(old->filename,filename) == 0){
+    rtn = start_parser(p,filename,old);
+  } else {
+    rtn = start_parser(p,filename,NULL);
+  }
   
   if (rtn != 0){
     log_message_katcp(d,KATCP_LEVEL_ERROR,NULL,"%s",strerror(rtn)); 
@@ -848,9 +1299,13 @@ int parser_load(struct katcp_dispatch *d, char *filename){
   }
 
   p->filename = strdup(filename);
+
+  if (old != NULL){
+    clean_up_parser(old);
+  }
   kb->b_parser = p;
 
-  log_message_katcp(d,KATCP_LEVEL_INFO,NULL,"Configuration file loaded");
+  log_message_katcp(d,KATCP_LEVEL_INFO,NULL,"Configuration file loaded, %d of %d sections unchanged",p->reused,p->lcount);
 
   return KATCP_RESULT_OK;
 }
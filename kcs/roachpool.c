@@ -16,6 +16,8 @@
 
 #include "kcs.h"
 
+void destroy_tree(struct kcs_obj *o);
+
 void destroy_roach_kcs(struct kcs_roach *kr){
   //int i;
   if (kr){
@@ -43,6 +45,8 @@ struct kcs_obj *new_kcs_obj(struct kcs_obj *parent, char *name, int tid, void *p
   ko->parent  = parent;
   ko->name    = strdup(name);
   ko->payload = payload;
+  ko->chain   = NULL;
+  ko->slot    = (-1);
 #ifdef DEBUG
   fprintf(stderr,"roachpool: new kcs_obj %s (%p) with payload type:%d (%p)\n",name,ko,tid,payload);
 #endif
@@ -59,7 +63,15 @@ struct kcs_obj *new_kcs_node_obj(struct kcs_obj *parent, char *name){
     return NULL;
   kn->children   = NULL;
   kn->childcount = 0;
+  kn->childsize  = 0;
+  kn->index      = NULL;
+  kn->bins       = 0;
+  kn->tally      = 0;
   ko = new_kcs_obj(parent, name, KCS_ID_NODE, kn);
+  if (ko == NULL){
+    free(kn);
+    return NULL;
+  }
   return ko;
 }
 
@@ -100,43 +112,127 @@ struct kcs_obj *new_kcs_roach_obj(struct kcs_obj *parent, char *url, char *ip, c
   kr->kurl->u_use++;
   return ko;
 }
+/* all pools and roaches are found through a name index hung off the
+ * root node, so lookups no longer walk the tree */
+
+static struct kcs_obj *root_of_obj(struct kcs_obj *o)
+{
+  while (o->parent)
+    o = o->parent;
+  return o;
+}
+
+static int rehash_tree(struct kcs_node *rn, unsigned int bins)
+{
+  struct kcs_obj **table, *o, *next;
+  unsigned int i, h;
+
+  table = malloc(sizeof(struct kcs_obj *) * bins);
+  if (table == NULL)
+    return KCS_FAIL;
+
+  for (i=0; i<bins; i++)
+    table[i] = NULL;
+
+  for (i=0; i<rn->bins; i++){
+    for (o = rn->index[i]; o; o = next){
+      next = o->chain;
+      h = hash_name_katcm(o->name) & (bins - 1);
+      o->chain = table[h];
+      table[h] = o;
+    }
+  }
+
+  if (rn->index)
+    free(rn->index);
+
+  rn->index = table;
+  rn->bins  = bins;
+
+  return KCS_OK;
+}
+
+static int index_obj(struct kcs_obj *root, struct kcs_obj *o)
+{
+  struct kcs_node *rn;
+  struct kcs_obj **prv;
+
+  rn = root->payload;
+
+  if (rn->tally >= rn->bins){
+    if (rehash_tree(rn, (rn->bins > 0) ? (rn->bins * 2) : KCS_POOL_BINS) == KCS_FAIL){
+      if (rn->index == NULL)
+        return KCS_FAIL;
+      /* failure to grow only makes chains longer */
+    }
+  }
+
+  /* append, so that of two objects with the same name the older one is found */
+  for (prv = &(rn->index[hash_name_katcm(o->name) & (rn->bins - 1)]); *prv; prv = &((*prv)->chain));
+  o->chain = NULL;
+  *prv = o;
+
+  rn->tally++;
+
+  return KCS_OK;
+}
+
+static void unindex_obj(struct kcs_obj *root, struct kcs_obj *o)
+{
+  struct kcs_node *rn;
+  struct kcs_obj **prv;
+
+  rn = root->payload;
+  if ((rn == NULL) || (rn->index == NULL))
+    return;
+
+  for (prv = &(rn->index[hash_name_katcm(o->name) & (rn->bins - 1)]); *prv; prv = &((*prv)->chain)){
+    if (*prv == o){
+      *prv = o->chain;
+      rn->tally--;
+      break;
+    }
+  }
+
+  o->chain = NULL;
+}
+
 struct kcs_obj *init_tree(){
   struct kcs_obj *root;
   root = new_kcs_node_obj(NULL,"root");
+  if (root == NULL)
+    return NULL;
+  if (index_obj(root, root) == KCS_FAIL){
+    destroy_tree(root);
+    return NULL;
+  }
   return root;
 }
 
 struct kcs_obj *search_tree(struct kcs_obj *o, char *str){
 
-  struct kcs_obj *co;
-  struct kcs_node *n;
-  int i;
+  struct kcs_obj *root, *co, *p;
+  struct kcs_node *rn;
 
-  if (strcmp(o->name,str) == 0){
-#ifdef DEBUG
-    fprintf(stderr,"roachpool: found match %s (%p) type:%d\n",o->name, o, o->tid);
-#endif
-    return o;
-  }
+  if ((o == NULL) || (str == NULL))
+    return NULL;
 
-  switch (o->tid){
-    
-    case KCS_ID_NODE:
+  root = root_of_obj(o);
+  rn = root->payload;
+  if ((rn == NULL) || (rn->index == NULL))
+    return NULL;
 
-      n = (struct kcs_node*) o->payload;
-      if (!n) 
-        return NULL;
-      for (i=0; i < n->childcount; i++) {
-#if 0
+  for (co = rn->index[hash_name_katcm(str) & (rn->bins - 1)]; co; co = co->chain){
+    if (strcmp(co->name, str))
+      continue;
+    /* only report matches at or below o */
+    for (p = co; p && (p != o); p = p->parent);
+    if (p){
 #ifdef DEBUG
-        fprintf(stderr,"Searching children of %s (%p) for %s\n",o->name,o,str);
-#endif
+      fprintf(stderr,"roachpool: found match %s (%p) type:%d\n",co->name, co, co->tid);
 #endif
-        co = search_tree(n->children[i], str);
-        if (co) 
-          return co;
-      }
-      break;
+      return co;
+    }
   }
 
 #ifdef DEBUG
@@ -149,11 +245,22 @@ int add_obj_to_node(struct kcs_obj *pno, struct kcs_obj *cno){
   /*mac      = arg_copy_string_katcp(d,4);*/
   
   struct kcs_node *parent;
+  struct kcs_obj **tmp;
+  int size;
 
   parent = (struct kcs_node*) pno->payload;
 
-  parent->children = realloc(parent->children, sizeof(struct kcs_obj *) * ++(parent->childcount));
-  parent->children[parent->childcount-1] = cno;
+  if (parent->childcount >= parent->childsize){
+    size = (parent->childsize > 0) ? (parent->childsize * 2) : 8;
+    tmp = realloc(parent->children, sizeof(struct kcs_obj *) * size);
+    if (tmp == NULL)
+      return KCS_FAIL;
+    parent->children  = tmp;
+    parent->childsize = size;
+  }
+
+  cno->slot = parent->childcount;
+  parent->children[parent->childcount++] = cno;
 
   cno->parent = pno;
 
@@ -172,10 +279,18 @@ int add_new_roach_to_tree(struct kcs_obj *root, char *poolname, char *url, char
     fprintf(stderr,"roachpool: parent pool doesn't exist so create\n");
 #endif
     parent = new_kcs_node_obj(root, poolname);
+    if (parent == NULL)
+      return KCS_FAIL;
     if (add_obj_to_node(root, parent) == KCS_FAIL){
 #ifdef DEBUG
       fprintf(stderr,"roachpool: could not add roach to node\n");
 #endif
+      parent->parent = NULL;
+      destroy_tree(parent);
+      return KCS_FAIL;
+    }
+    if (index_obj(root, parent) == KCS_FAIL){
+      destroy_tree(parent);
       return KCS_FAIL;
     }
   }
@@ -201,6 +316,13 @@ int add_new_roach_to_tree(struct kcs_obj *root, char *poolname, char *url, char
 #ifdef DEBUG
     fprintf(stderr,"roachpool: could not add roach to node\n");
 #endif
+    roach->parent = NULL;
+    destroy_tree(roach);
+    return KCS_FAIL;
+  }
+
+  if (index_obj(root, roach) == KCS_FAIL){
+    destroy_tree(roach);
     return KCS_FAIL;
   }
 #if 0
@@ -391,14 +513,23 @@ int remove_obj_from_current_pool(struct kcs_obj *ro)
 
   opn = (struct kcs_node*) ro->parent->payload;
 
-  for (i=0;i<opn->childcount;i++){
-    if (opn->children[i] == ro){
-      opn->children[i] = opn->children[opn->childcount-1];
-      opn->children = realloc(opn->children, sizeof(struct kcs_obj *) * --(opn->childcount));
-      break;
-    }
+  i = ro->slot;
+  if ((i < 0) || (i >= opn->childcount) || (opn->children[i] != ro)){
+#ifdef DEBUG
+    fprintf(stderr,"roachpool: obj %s not where its parent expects it\n", ro->name);
+#endif
+    ro->parent = NULL;
+    return KCS_FAIL;
+  }
+
+  /* fill the gap with the last child, membership order does not matter */
+  opn->childcount--;
+  if (i < opn->childcount){
+    opn->children[i] = opn->children[opn->childcount];
+    opn->children[i]->slot = i;
   }
   
+  ro->slot   = (-1);
   ro->parent = NULL;
 
   return KCS_OK;
@@ -425,12 +556,12 @@ void destroy_tree(struct kcs_obj *o)
       fprintf(stderr,"\troachpool: destory in kcs_node (%p) cc:%d\n", n, n->childcount);
 #endif
 
-      for (i=0;i<n->childcount;i++){
-        destroy_tree(n->children[i]);
-        /*if (n->children[i])
-          n->children[i] = NULL;*/
+      /* children take themselves out of the array, so start at the end */
+      for (i=n->childcount;i>0;i--){
+        destroy_tree(n->children[i-1]);
       }
       if (n->children) { free(n->children); n->children = NULL; }
+      if (n->index) { free(n->index); n->index = NULL; }
       if (n) { free(n); n = NULL; }
 
       break;
@@ -454,6 +585,8 @@ void destroy_tree(struct kcs_obj *o)
 #ifdef DEBUG
   fprintf(stderr,"roachpool: destroy in kcs_obj (%p) %s type:%d\n", o, o->name, o->tid);
 #endif
+  if (o->parent)
+    unindex_obj(root_of_obj(o), o);
   if (o->name) { free(o->name); o->name = NULL; }
   if (remove_obj_from_current_pool(o) == KCS_FAIL){
 #ifdef DEBUG 
@@ -468,14 +601,25 @@ int mod_roach_to_new_pool(struct kcs_obj *root, char *pool, char *hostname){
   
   struct kcs_obj *ro;
   struct kcs_obj *po;
-  
+  struct kcs_obj *p;
+
   ro = search_tree(root, hostname);
 
-  if (!ro)
+  /* the root stays where it is */
+  if (!ro || (ro->parent == NULL))
     return KCS_FAIL;
   
   po = search_tree(root, pool);
 
+  if (po){
+    if (po->tid != KCS_ID_NODE)
+      return KCS_FAIL;
+    /* no moving a pool into itself */
+    for (p = po; p && (p != ro); p = p->parent);
+    if (p)
+      return KCS_FAIL;
+  }
+
   if (!po){
 #ifdef DEBUG
     fprintf(stderr,"roachpool: new pool doesn't exist so create\n");
@@ -487,6 +631,12 @@ int mod_roach_to_new_pool(struct kcs_obj *root, char *pool, char *hostname){
 #ifdef DEBUG
       fprintf(stderr,"roachpool: could not add new pool to node\n");
 #endif
+      po->parent = NULL;
+      destroy_tree(po);
+      return KCS_FAIL;
+    }
+    if (index_obj(root, po) == KCS_FAIL){
+      destroy_tree(po);
       return KCS_FAIL;
     }
   }
@@ -20,6 +20,8 @@
 
 #include "kcs.h"
 
+static void invalidate_graph_kcs(struct katcp_dispatch *d);
+
 /*Statemachine API*********************************************************************************************/
 int statemachine_init_kcs(struct katcp_dispatch *d)
 { 
@@ -107,6 +109,7 @@ struct kcs_sm_state *create_sm_state_kcs(char *name)
   if (s == NULL)
     return NULL;
   s->s_name            = strdup(name);
+  s->s_id              = (-1);
   s->s_edge_list       = NULL;
   s->s_edge_list_count = 0;
   s->s_op_list         = NULL;
@@ -213,6 +216,8 @@ int create_named_node_kcs(struct katcp_dispatch *d, char *s_name)
     destroy_sm_state_kcs(s);
     return -1;
   }
+
+  invalidate_graph_kcs(d);
   
   return 0;
 }
@@ -283,6 +288,8 @@ int create_named_edge_kcs(struct katcp_dispatch *d, char *n_current, char *n_nex
   s_current->s_op_list[s_current->s_op_list_count] = o;
   s_current->s_op_list_count++;
 
+  invalidate_graph_kcs(d);
+
   return 0;
 }
 
@@ -319,11 +326,164 @@ int create_named_op_kcs(struct katcp_dispatch *d, char *state, char *op)
 
   s->s_op_list[s->s_op_list_count] = o;
   s->s_op_list_count++;
+
+  invalidate_graph_kcs(d);
   
   return 0;
 }
 
 
+/*Compiled graph**********************************************************************************************/
+void release_graph_kcs(struct kcs_sm_graph *g)
+{
+  int i;
+
+  if (g == NULL)
+    return;
+
+  g->g_refs--;
+  if (g->g_refs > 0)
+    return;
+
+#ifdef DEBUG
+  fprintf(stderr, "statemachine: releasing compiled graph (%p)\n", g);
+#endif
+
+  if (g->g_nodes){
+    for (i=0; i<g->g_node_count; i++){
+      if (g->g_nodes[i].n_name) { free(g->g_nodes[i].n_name); g->g_nodes[i].n_name = NULL; }
+    }
+    free(g->g_nodes);
+    g->g_nodes = NULL;
+  }
+  if (g->g_links) { free(g->g_links); g->g_links = NULL; }
+  if (g->g_ops)   { free(g->g_ops);   g->g_ops   = NULL; }
+
+  free(g);
+}
+
+static void invalidate_graph_kcs(struct katcp_dispatch *d)
+{
+  struct kcs_basic *kb;
+
+  /* running tasks keep their reference, new ones get a fresh compile */
+  kb = get_mode_katcp(d, KCS_MODE_BASIC);
+  if (kb == NULL || kb->b_graph == NULL)
+    return;
+
+  release_graph_kcs(kb->b_graph);
+  kb->b_graph = NULL;
+}
+
+struct kcs_sm_graph *compile_graph_kcs(struct katcp_dispatch *d)
+{
+  struct kcs_basic *kb;
+  struct katcp_type *type;
+  struct avl_tree *tree;
+  struct avl_node *an;
+  struct kcs_sm_state *s;
+  struct kcs_sm_graph *g;
+  struct kcs_sm_node *gn;
+  struct kcs_sm_link *gl;
+  int i, nodes, links, ops;
+
+  kb = get_mode_katcp(d, KCS_MODE_BASIC);
+  if (kb == NULL)
+    return NULL;
+
+  if (kb->b_graph != NULL)
+    return kb->b_graph;
+
+  type = find_name_type_katcp(d, KATCP_TYPE_STATEMACHINE_STATE);
+  if (type == NULL)
+    return NULL;
+
+  tree = get_tree_type_katcp(type);
+  if (tree == NULL)
+    return NULL;
+
+  /* first pass numbers the states and sizes the arrays */
+  nodes = 0;
+  links = 0;
+  ops   = 0;
+  for (an = first_avltree(tree); an; an = next_avltree(an)){
+    s = get_node_data_avltree(an);
+    if (s == NULL)
+      continue;
+    s->s_id = nodes++;
+    links += s->s_edge_list_count;
+    ops   += s->s_op_list_count;
+  }
+
+  g = malloc(sizeof(struct kcs_sm_graph));
+  if (g == NULL)
+    return NULL;
+
+  g->g_refs       = 1;
+  g->g_node_count = nodes;
+  g->g_link_count = links;
+  g->g_op_count   = ops;
+
+  g->g_nodes = calloc((nodes > 0) ? nodes : 1, sizeof(struct kcs_sm_node));
+  g->g_links = malloc(sizeof(struct kcs_sm_link) * ((links > 0) ? links : 1));
+  g->g_ops   = malloc(sizeof(struct kcs_sm_op) * ((ops > 0) ? ops : 1));
+
+  if (g->g_nodes == NULL || g->g_links == NULL || g->g_ops == NULL){
+    g->g_node_count = 0;
+    release_graph_kcs(g);
+    return NULL;
+  }
+
+  links = 0;
+  ops   = 0;
+  for (an = first_avltree(tree); an; an = next_avltree(an)){
+    s = get_node_data_avltree(an);
+    if (s == NULL)
+      continue;
+
+    gn = &(g->g_nodes[s->s_id]);
+
+    gn->n_name = strdup(s->s_name);
+    if (gn->n_name == NULL){
+      release_graph_kcs(g);
+      return NULL;
+    }
+
+    gn->n_op_base  = ops;
+    gn->n_op_count = s->s_op_list_count;
+    for (i=0; i<s->s_op_list_count; i++){
+      if (s->s_op_list[i] != NULL){
+        g->g_ops[ops] = *(s->s_op_list[i]);
+      } else {
+        g->g_ops[ops].o_call    = NULL;
+        g->g_ops[ops].o_tobject = NULL;
+      }
+      ops++;
+    }
+
+    gn->n_link_base  = links;
+    gn->n_link_count = s->s_edge_list_count;
+    for (i=0; i<s->s_edge_list_count; i++){
+      gl = &(g->g_links[links++]);
+      if (s->s_edge_list[i] != NULL && s->s_edge_list[i]->e_next != NULL){
+        gl->l_next = s->s_edge_list[i]->e_next->s_id;
+        gl->l_call = s->s_edge_list[i]->e_call;
+      } else {
+        gl->l_next = (-1);
+        gl->l_call = NULL;
+      }
+    }
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "statemachine: compiled %d states, %d edges, %d ops\n", g->g_node_count, g->g_link_count, g->g_op_count);
+#endif
+
+  kb->b_graph = g;
+
+  return g;
+}
+
 /*Modules*****************************************************************************************************/
 void print_sm_mod_kcs(struct katcp_dispatch *d, char *key, void *data)
 {
@@ -452,11 +612,11 @@ int statemachine_loadmod_kcs(struct katcp_dispatch *d)
 }
 
 /*Task Scheduler**********************************************************************************************/
-struct kcs_sched_task *create_sched_task_kcs(struct kcs_sm_state *s, struct katcp_tobject *to, int flags)
+struct kcs_sched_task *create_sched_task_kcs(struct kcs_sm_graph *g, int pc, struct katcp_tobject *to, int flags)
 {
   struct kcs_sched_task *t;
 
-  if (s == NULL){
+  if (g == NULL || pc < 0 || pc >= g->g_node_count){
 #ifdef DEBUG
     fprintf(stderr, "statemachine: cannot schedule a null task\n");
 #endif
@@ -473,13 +633,30 @@ struct kcs_sched_task *create_sched_task_kcs(struct kcs_sm_state *s, struct katc
   t->t_op_i    = 0;
   t->t_flags   = flags;
   
-  t->t_pc = s;
+  t->t_pc    = pc;
+  t->t_graph = g;
+
+  t->t_next     = NULL;
+  t->t_name     = NULL;
+  t->t_resource = NULL;
+  t->t_admitted = 0;
+
+  if (flags & PROCESS_CRITICAL){
+    t->t_class = KCS_SCHED_CRITICAL;
+  } else if (flags & (PROCESS_BULK | PROCESS_SLAVE)){
+    /* spawned machines are fan out work, keep them out of the way */
+    t->t_class = KCS_SCHED_BULK;
+  } else {
+    t->t_class = KCS_SCHED_NORMAL;
+  }
   
   t->t_stack = create_stack_katcp();
   if (t->t_stack == NULL){
     free(t);
     return NULL;
   }
+
+  g->g_refs++;
   
   if (to != NULL){
     push_tobject_katcp(t->t_stack, to);
@@ -492,29 +669,302 @@ void destroy_sched_task_kcs(struct kcs_sched_task *t)
 {
   if (t != NULL){
     destroy_stack_katcp(t->t_stack);
+    release_graph_kcs(t->t_graph);
+    t->t_graph = NULL;
+    if (t->t_name) free(t->t_name);
+    if (t->t_resource) free(t->t_resource);
     free(t);
   }
 }
 
+/*Admission control*******************************************************************************************/
+struct kcs_scheduler *create_scheduler_kcs(void)
+{
+  struct kcs_scheduler *s;
+  int i;
+
+  s = malloc(sizeof(struct kcs_scheduler));
+  if (s == NULL)
+    return NULL;
+
+  for (i=0; i<KCS_SCHED_CLASSES; i++){
+    s->s_head[i]     = NULL;
+    s->s_tail[i]     = NULL;
+    s->s_queued[i]   = 0;
+    s->s_running[i]  = 0;
+    s->s_admitted[i] = 0;
+  }
+
+  s->s_limit          = KCS_SCHED_LIMIT;
+  s->s_resource_limit = KCS_SCHED_RESOURCE_LIMIT;
+
+  s->s_busy       = NULL;
+  s->s_busy_count = 0;
+  s->s_busy_size  = 0;
+
+  return s;
+}
+
+void destroy_scheduler_kcs(struct kcs_scheduler *s)
+{
+  struct kcs_sched_task *t;
+  int i;
+
+  if (s == NULL)
+    return;
+
+  /* running tasks belong to their notices, only the waiting ones are ours */
+  for (i=0; i<KCS_SCHED_CLASSES; i++){
+    while ((t = s->s_head[i]) != NULL){
+      s->s_head[i] = t->t_next;
+      destroy_sched_task_kcs(t);
+    }
+    s->s_tail[i] = NULL;
+  }
+
+  if (s->s_busy){
+    for (i=0; i<s->s_busy_count; i++){
+      if (s->s_busy[i].b_resource) free(s->s_busy[i].b_resource);
+    }
+    free(s->s_busy);
+    s->s_busy = NULL;
+  }
+
+  free(s);
+}
+
+static struct kcs_scheduler *get_scheduler_kcs(struct katcp_dispatch *d)
+{
+  struct kcs_basic *kb;
+
+  kb = get_mode_katcp(d, KCS_MODE_BASIC);
+  if (kb == NULL)
+    return NULL;
+
+  return kb->b_sched;
+}
+
+static int find_busy_kcs(struct kcs_scheduler *s, char *resource)
+{
+  int i;
+
+  for (i=0; i<s->s_busy_count; i++){
+    if (strcmp(s->s_busy[i].b_resource, resource) == 0)
+      return i;
+  }
+
+  return -1;
+}
+
+static int busy_resource_kcs(struct kcs_scheduler *s, char *resource)
+{
+  int i;
+
+  if (resource == NULL)
+    return 0;
+
+  i = find_busy_kcs(s, resource);
+  
+  return (i < 0) ? 0 : s->s_busy[i].b_count;
+}
+
+static int acquire_resource_kcs(struct kcs_scheduler *s, char *resource)
+{
+  struct kcs_sched_busy *tmp;
+  int i;
+
+  if (resource == NULL)
+    return 0;
+
+  i = find_busy_kcs(s, resource);
+  if (i >= 0){
+    s->s_busy[i].b_count++;
+    return 0;
+  }
+
+  if (s->s_busy_count >= s->s_busy_size){
+    tmp = realloc(s->s_busy, sizeof(struct kcs_sched_busy) * (s->s_busy_size + 8));
+    if (tmp == NULL)
+      return -1;
+    s->s_busy = tmp;
+    s->s_busy_size += 8;
+  }
+
+  s->s_busy[s->s_busy_count].b_resource = strdup(resource);
+  if (s->s_busy[s->s_busy_count].b_resource == NULL)
+    return -1;
+
+  s->s_busy[s->s_busy_count].b_count = 1;
+  s->s_busy_count++;
+
+  return 0;
+}
+
+static void release_resource_kcs(struct kcs_scheduler *s, char *resource)
+{
+  int i;
+
+  if (resource == NULL)
+    return;
+
+  i = find_busy_kcs(s, resource);
+  if (i < 0)
+    return;
+
+  s->s_busy[i].b_count--;
+  if (s->s_busy[i].b_count > 0)
+    return;
+
+  free(s->s_busy[i].b_resource);
+  s->s_busy_count--;
+  s->s_busy[i] = s->s_busy[s->s_busy_count];
+}
+
+static int running_sched_kcs(struct kcs_scheduler *s)
+{
+  int i, sum;
+
+  for (sum=0, i=0; i<KCS_SCHED_CLASSES; i++){
+    sum += s->s_running[i];
+  }
+
+  return sum;
+}
+
+static void enqueue_sched_kcs(struct kcs_scheduler *s, struct kcs_sched_task *t)
+{
+  t->t_next = NULL;
+
+  if (s->s_tail[t->t_class]){
+    s->s_tail[t->t_class]->t_next = t;
+  } else {
+    s->s_head[t->t_class] = t;
+  }
+  s->s_tail[t->t_class] = t;
+
+  s->s_queued[t->t_class]++;
+}
+
+static int dequeue_sched_kcs(struct kcs_scheduler *s, struct kcs_sched_task *t)
+{
+  struct kcs_sched_task *prev, *c;
+
+  for (prev = NULL, c = s->s_head[t->t_class]; c; prev = c, c = c->t_next){
+    if (c == t){
+      if (prev){
+        prev->t_next = c->t_next;
+      } else {
+        s->s_head[t->t_class] = c->t_next;
+      }
+      if (s->s_tail[t->t_class] == c){
+        s->s_tail[t->t_class] = prev;
+      }
+      c->t_next = NULL;
+      s->s_queued[t->t_class]--;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/* admit waiting tasks in class order. A task blocked on its actor does not
+ * hold up the ones behind it, the global limit does not apply to critical
+ * tasks, so they never wait for bulk work to drain */
+static void dispatch_sched_kcs(struct katcp_dispatch *d)
+{
+  struct kcs_scheduler *s;
+  struct kcs_sched_task *t, *next;
+  struct katcp_notice *n;
+  int c, running;
+
+  s = get_scheduler_kcs(d);
+  if (s == NULL)
+    return;
+
+  running = running_sched_kcs(s);
+
+  for (c=0; c<KCS_SCHED_CLASSES; c++){
+    for (t = s->s_head[c]; t; t = next){
+      next = t->t_next;
+
+      if ((c != KCS_SCHED_CRITICAL) && (running >= s->s_limit))
+        return;
+
+      if (t->t_resource && (busy_resource_kcs(s, t->t_resource) >= s->s_resource_limit))
+        continue;
+
+      dequeue_sched_kcs(s, t);
+
+      /* the notice may have gone away with its client while we waited */
+      n = find_notice_katcp(d, t->t_name);
+      if (n == NULL){
+        log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "dropping queued statemachine %s as its notice has gone", t->t_name);
+        destroy_sched_task_kcs(t);
+        continue;
+      }
+
+      if (acquire_resource_kcs(s, t->t_resource) < 0){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to account for resource %s", t->t_resource);
+        enqueue_sched_kcs(s, t);
+        return;
+      }
+
+      t->t_admitted = 1;
+      s->s_running[c]++;
+      s->s_admitted[c]++;
+      running++;
+
+#ifdef DEBUG
+      fprintf(stderr, "statemachine: admitted %s (class %d, resource %s, %d running)\n", t->t_name, c, t->t_resource ? t->t_resource : "<none>", running);
+#endif
+
+      wake_notice_katcp(d, n, NULL);
+    }
+  }
+}
+
+/* called as a task goes away, hands its slot to whoever is waiting */
+static void retire_sched_kcs(struct katcp_dispatch *d, struct kcs_sched_task *t)
+{
+  struct kcs_scheduler *s;
+
+  s = get_scheduler_kcs(d);
+  if (s == NULL)
+    return;
+
+  if (t->t_admitted){
+    release_resource_kcs(s, t->t_resource);
+    s->s_running[t->t_class]--;
+    t->t_admitted = 0;
+  } else {
+    /* stopped before it got a chance to run */
+    dequeue_sched_kcs(s, t);
+  }
+}
+
 struct katcp_stack *get_task_stack_kcs(struct kcs_sched_task *t)
 {
   return (t != NULL) ? t->t_stack : NULL;
 }
 
-struct kcs_sm_state *get_task_pc_kcs(struct kcs_sched_task *t)
+struct kcs_sm_node *get_task_pc_kcs(struct kcs_sched_task *t)
 {
-  return (t != NULL) ? t->t_pc : NULL;
+  if (t == NULL || t->t_graph == NULL || t->t_pc < 0 || t->t_pc >= t->t_graph->g_node_count)
+    return NULL;
+
+  return &(t->t_graph->g_nodes[t->t_pc]);
 }
 
-int set_task_pc_kcs(struct kcs_sched_task *t, struct kcs_sm_state *s)
+int set_task_pc_kcs(struct kcs_sched_task *t, int pc)
 {
-  if (t == NULL || s == NULL)
+  if (t == NULL || pc < 0 || pc >= t->t_graph->g_node_count)
     return -1;
   
-  t->t_pc = s;
+  t->t_pc = pc;
 
 #ifdef DEBUG
-  fprintf(stderr, "statemachine: set pc: <%s>\n", s->s_name);
+  fprintf(stderr, "statemachine: set pc: <%s>\n", t->t_graph->g_nodes[pc].n_name);
 #endif
 
   return 0;
@@ -531,7 +981,7 @@ void print_task_stack_kcs(struct katcp_dispatch *d, struct kcs_sched_task *t)
 
 int statemachine_run_ops_kcs(struct katcp_dispatch *d, struct katcp_notice *n, struct kcs_sched_task *t)
 {
-  struct kcs_sm_state *s;
+  struct kcs_sm_node *s;
   struct katcp_stack *stack;
   struct kcs_sm_op *op;
   int rtn;
@@ -546,14 +996,11 @@ int statemachine_run_ops_kcs(struct katcp_dispatch *d, struct katcp_notice *n, s
     return TASK_STATE_CLEAN_UP;
 
 #if 0 
-  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "running ops in state %s", s->s_name);
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "running ops in state %s", s->n_name);
 #endif
-#if 0
-  for (i=0; i<s->s_op_list_count; i++){
-#endif
-  for (; t->t_op_i < s->s_op_list_count; t->t_op_i++){
-    op = s->s_op_list[t->t_op_i];
-    if (op != NULL){
+  for (; t->t_op_i < s->n_op_count; t->t_op_i++){
+    op = &(t->t_graph->g_ops[s->n_op_base + t->t_op_i]);
+    if (op->o_call != NULL){
 
       if (op->o_call == &trigger_edge_process_kcs){
 #ifdef DEBUG
@@ -581,8 +1028,8 @@ int statemachine_run_ops_kcs(struct katcp_dispatch *d, struct katcp_notice *n, s
 
 int statemachine_follow_edges_kcs(struct katcp_dispatch *d, struct katcp_notice *n, struct kcs_sched_task *t)
 {
-  struct kcs_sm_state *s;
-  struct kcs_sm_edge *e;
+  struct kcs_sm_node *s;
+  struct kcs_sm_link *e;
   struct katcp_stack *stack;
   int rtn;
   
@@ -599,7 +1046,7 @@ int statemachine_follow_edges_kcs(struct katcp_dispatch *d, struct katcp_notice
   fprintf(stderr, "statemachine: follow edges [%d]\n",t->t_edge_i);
 #endif
 
-  if (s->s_edge_list_count <= 0){
+  if (s->n_link_count <= 0){
 #ifdef DEBUG
     fprintf(stderr, "statemachine: no edges ending\n");
 #endif
@@ -608,15 +1055,15 @@ int statemachine_follow_edges_kcs(struct katcp_dispatch *d, struct katcp_notice
   }
 
 #if 0  
-  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "testing edges in state %s", s->s_name);
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "testing edges in state %s", s->n_name);
 #endif
 
-  e = s->s_edge_list[t->t_edge_i];
+  e = &(t->t_graph->g_links[s->n_link_base + t->t_edge_i]);
 
-  if (e != NULL){
+  if (e->l_next >= 0){
 
-    if (e->e_call != NULL){
-      rtn = (*(e->e_call))(d, n, stack);
+    if (e->l_call != NULL){
+      rtn = (*(e->l_call))(d, n, stack);
     } else {
       /*this is for edges with no callback (default edge) always follow*/
       rtn = 0;
@@ -625,7 +1072,7 @@ int statemachine_follow_edges_kcs(struct katcp_dispatch *d, struct katcp_notice
 
     switch (rtn){
       case EDGE_OKAY:
-        set_task_pc_kcs(t, e->e_next);
+        set_task_pc_kcs(t, e->l_next);
         t->t_edge_i = 0;      
         t->t_op_i   = 0;
 #ifdef DEBUG
@@ -646,7 +1093,7 @@ int statemachine_follow_edges_kcs(struct katcp_dispatch *d, struct katcp_notice
 
   }
 
-  if ((t->t_edge_i+1) < s->s_edge_list_count){
+  if ((t->t_edge_i+1) < s->n_link_count){
     t->t_edge_i++;
 #ifdef DEBUG
     fprintf(stderr, "statemachine: follow edges STILL TRYING\n");
@@ -670,6 +1117,7 @@ int statemachine_follow_edges_kcs(struct katcp_dispatch *d, struct katcp_notice
 int statemachine_process_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
 {
   struct kcs_sched_task *t;
+  struct kcs_sm_node *s;
   struct katcl_parse *p;
   int rtn;
   char *ptr, *name;
@@ -704,7 +1152,8 @@ int statemachine_process_kcs(struct katcp_dispatch *d, struct katcp_notice *n, v
     case TASK_STATE_EDGE_WAIT:
       
       p = get_parse_notice_katcp(d, n);
-      if (p == NULL){
+      s = get_task_pc_kcs(t);
+      if (p == NULL || s == NULL){
         rtn = -1;
       } else {
         ptr = get_string_parse_katcl(p, 1);
@@ -712,21 +1161,7 @@ int statemachine_process_kcs(struct katcp_dispatch *d, struct katcp_notice *n, v
 #ifdef DEBUG
           fprintf(stderr, "statemachine: process edge wait FAIL try next OP\n");
 #endif
-#if 0
-          if ((t->t_edge_i+1) < (t->t_pc->s_edge_list_count)){
-            t->t_edge_i++;
-#ifdef DEBUG
-            fprintf(stderr, "statemachine: follow edges STILL TRYING\n");
-#endif
-            rtn = statemachine_follow_edges_kcs(d, n, t);
-          } else {
-#ifdef DEBUG
-            fprintf(stderr, "statemachine: no more edges! FAIL\n");
-#endif
-            rtn = -1;
-          }
-#endif
-          if ((t->t_edge_i+1) < (t->t_pc->s_edge_list_count)){
+          if ((t->t_edge_i+1) < (s->n_link_count)){
             t->t_edge_i++;
           }
           rtn = TASK_STATE_RUN_OPS;
@@ -735,8 +1170,9 @@ int statemachine_process_kcs(struct katcp_dispatch *d, struct katcp_notice *n, v
 #ifdef DEBUG
           fprintf(stderr, "statemachine: process edge wait SUCCESS follow edge\n");
 #endif
-          /*TODO: err checking*/
-          set_task_pc_kcs(t, t->t_pc->s_edge_list[t->t_edge_i]->e_next);
+          if (set_task_pc_kcs(t, t->t_graph->g_links[s->n_link_base + t->t_edge_i].l_next) < 0){
+            log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "edge %d of state %s leads nowhere", t->t_edge_i, s->n_name);
+          }
           t->t_edge_i = 0;      
           t->t_op_i   = 0;      
           rtn = TASK_STATE_RUN_OPS;
@@ -767,11 +1203,14 @@ int statemachine_process_kcs(struct katcp_dispatch *d, struct katcp_notice *n, v
         log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "statemachine slave process ending %s", name);
       }
 
+      retire_sched_kcs(d, t);
       destroy_sched_task_kcs(t);
 
 #ifdef DEBUG
       fprintf(stderr, "**********[end statemachine (%s) run]**********\n", name);
 #endif
+      dispatch_sched_kcs(d);
+
       return 0;
   }
 
@@ -798,64 +1237,173 @@ int statemachine_process_kcs(struct katcp_dispatch *d, struct katcp_notice *n, v
 TODO: think about running each task as a subprocess
 this will achive task / process ||ism
 */
-int start_process_kcs(struct katcp_dispatch *d, char *startnode, struct katcp_tobject *to, int flags)
+int schedule_process_kcs(struct katcp_dispatch *d, char *startnode, struct katcp_tobject *to, int flags, char *resource)
 {
   struct katcp_notice *n;
   struct kcs_sched_task *t;
   struct kcs_sm_state *s;
-  char *name;
+  struct kcs_sm_graph *g;
+  struct kcs_scheduler *ks;
   
 #ifdef DEBUG
   fprintf(stderr, "**********[start statemachine run]**********\n");
 #endif
 
+  ks = get_scheduler_kcs(d);
+  if (ks == NULL)
+    return -1;
+
   s = get_key_data_type_katcp(d, KATCP_TYPE_STATEMACHINE_STATE, startnode);
   
   if (s == NULL)
     return -1;
+
+  /* only the first run after a change pays for the compile */
+  g = compile_graph_kcs(d);
+  if (g == NULL)
+    return -1;
   
-  t = create_sched_task_kcs(s, to, flags);
+  t = create_sched_task_kcs(g, s->s_id, to, flags);
   if (t == NULL)
     return -1;
- 
-  name = gen_id_avltree("sm");
 
-  n = register_notice_katcp(d, name, 0, &statemachine_process_kcs, t);
-
-  if (name != NULL) 
-    free(name);
+  /* tasks working on the same actor count against its limit */
+  if (resource == NULL && to != NULL && to->o_type != NULL && to->o_type->t_getkey != NULL){
+    resource = (*(to->o_type->t_getkey))(to->o_data);
+  }
+  if (resource != NULL){
+    t->t_resource = strdup(resource);
+    if (t->t_resource == NULL){
+      destroy_sched_task_kcs(t);
+      return -1;
+    }
+  }
+ 
+  t->t_name = gen_id_avltree("sm");
+  if (t->t_name == NULL){
+    destroy_sched_task_kcs(t);
+    return -1;
+  }
 
+  /* registered now so that the client owns it, only woken once admitted */
+  n = register_notice_katcp(d, t->t_name, 0, &statemachine_process_kcs, t);
   if (n == NULL){
     destroy_sched_task_kcs(t);
     return -1;
   }
-  
-  wake_notice_katcp(d, n, NULL);
+
+  enqueue_sched_kcs(ks, t);
+
+  dispatch_sched_kcs(d);
 
   return 0;
 }
 
+int start_process_kcs(struct katcp_dispatch *d, char *startnode, struct katcp_tobject *to, int flags)
+{
+  return schedule_process_kcs(d, startnode, to, flags, NULL);
+}
+
 int trigger_edge_process_kcs(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_tobject *to)
 {
   return 0;
 }
 
 /*KATCP Dispatch API*******************************************************************************************/
-int statemachine_run_kcs(struct katcp_dispatch *d)
+int statemachine_run_kcs(struct katcp_dispatch *d, int argc)
 {
-  char *startnode;
+  char *startnode, *priority, *resource;
+  int flags;
 
   startnode = arg_string_katcp(d, 2);
 
   if (startnode == NULL)
     return KATCP_RESULT_FAIL;
 
-  if (start_process_kcs(d, startnode, NULL, PROCESS_MASTER) < 0)
+  flags    = PROCESS_MASTER;
+  resource = NULL;
+
+  if (argc > 3){
+    priority = arg_string_katcp(d, 3);
+    if (priority == NULL)
+      return KATCP_RESULT_FAIL;
+
+    if (strcmp(priority, "critical") == 0){
+      flags |= PROCESS_CRITICAL;
+    } else if (strcmp(priority, "bulk") == 0){
+      flags |= PROCESS_BULK;
+    } else if (strcmp(priority, "normal") != 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown priority class %s", priority);
+      return KATCP_RESULT_FAIL;
+    }
+  }
+
+  if (argc > 4){
+    resource = arg_string_katcp(d, 4);
+  }
+
+  if (schedule_process_kcs(d, startnode, NULL, flags, resource) < 0)
     return KATCP_RESULT_FAIL;
 
   return KATCP_RESULT_PAUSE;
 }
 
+int statemachine_limit_kcs(struct katcp_dispatch *d, int argc)
+{
+  struct kcs_scheduler *s;
+  int limit, resource;
+
+  s = get_scheduler_kcs(d);
+  if (s == NULL)
+    return KATCP_RESULT_FAIL;
+
+  if (argc > 2){
+    limit    = arg_unsigned_long_katcp(d, 2);
+    resource = (argc > 3) ? arg_unsigned_long_katcp(d, 3) : s->s_resource_limit;
+    if (limit <= 0 || resource <= 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "limits need to be positive");
+      return KATCP_RESULT_FAIL;
+    }
+    s->s_limit          = limit;
+    s->s_resource_limit = resource;
+
+    /* a raised limit may let waiting tasks in */
+    dispatch_sched_kcs(d);
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "statemachine scheduler runs %d tasks, %d per actor", s->s_limit, s->s_resource_limit);
+
+  return KATCP_RESULT_OK;
+}
+
+int statemachine_queue_kcs(struct katcp_dispatch *d)
+{
+  struct kcs_scheduler *s;
+  char *names[KCS_SCHED_CLASSES] = { "critical", "normal", "bulk" };
+  int i;
+
+  s = get_scheduler_kcs(d);
+  if (s == NULL)
+    return KATCP_RESULT_FAIL;
+
+  for (i=0; i<KCS_SCHED_CLASSES; i++){
+    prepend_inform_katcp(d);
+    append_string_katcp(d, KATCP_FLAG_STRING, names[i]);
+    append_signed_long_katcp(d, KATCP_FLAG_SLONG, s->s_running[i]);
+    append_signed_long_katcp(d, KATCP_FLAG_SLONG, s->s_queued[i]);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, s->s_admitted[i]);
+  }
+
+  for (i=0; i<s->s_busy_count; i++){
+    prepend_inform_katcp(d);
+    append_string_katcp(d, KATCP_FLAG_STRING, "actor");
+    append_string_katcp(d, KATCP_FLAG_STRING, s->s_busy[i].b_resource);
+    append_signed_long_katcp(d, KATCP_FLAG_SLONG | KATCP_FLAG_LAST, s->s_busy[i].b_count);
+  }
+
+  return KATCP_RESULT_OK;
+}
+
 int statemachine_stopall_kcs(struct katcp_dispatch *d)
 {
   struct katcp_notice **n_set, *n;
@@ -981,6 +1529,8 @@ int statemachine_flush_kcs(struct katcp_dispatch *d)
     return KATCP_RESULT_FAIL;
 
   flush_type_katcp(t);
+
+  invalidate_graph_kcs(d);
   
 #if 0
   if (dump_tagsets_katcp(d) < 0)
@@ -990,6 +1540,19 @@ int statemachine_flush_kcs(struct katcp_dispatch *d)
   return KATCP_RESULT_OK;
 }
 
+int statemachine_compile_kcs(struct katcp_dispatch *d)
+{
+  struct kcs_sm_graph *g;
+
+  g = compile_graph_kcs(d);
+  if (g == NULL)
+    return KATCP_RESULT_FAIL;
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "statemachine graph has %d states, %d edges and %d ops", g->g_node_count, g->g_link_count, g->g_op_count);
+
+  return KATCP_RESULT_OK;
+}
+
 int statemachine_print_ds_kcs(struct katcp_dispatch *d)
 {
   print_types_katcp(d);
@@ -1053,7 +1616,13 @@ int statemachine_greeting_kcs(struct katcp_dispatch *d)
   prepend_inform_katcp(d);
   append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "[from state name] edge [to state name] ([condition])");
   prepend_inform_katcp(d);
-  append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "run [start state]");
+  append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "compile (lay out the defined states for running)");
+  prepend_inform_katcp(d);
+  append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "run [start state] ([critical|normal|bulk] [actor])");
+  prepend_inform_katcp(d);
+  append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "limit ([tasks] [tasks per actor])");
+  prepend_inform_katcp(d);
+  append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "queue (running, waiting and admitted tasks per class)");
   prepend_inform_katcp(d);
   append_string_katcp(d,KATCP_FLAG_STRING | KATCP_FLAG_LAST, "ds (print the entire datastore)");
   prepend_inform_katcp(d);
@@ -1091,6 +1660,12 @@ int statemachine_cmd(struct katcp_dispatch *d, int argc)
         return statemachine_stopall_kcs(d);
       if (strcmp(arg_string_katcp(d, 1), "tagsets") == 0)
         return statemachine_tagsets_kcs(d);
+      if (strcmp(arg_string_katcp(d, 1), "compile") == 0)
+        return statemachine_compile_kcs(d);
+      if (strcmp(arg_string_katcp(d, 1), "queue") == 0)
+        return statemachine_queue_kcs(d);
+      if (strcmp(arg_string_katcp(d, 1), "limit") == 0)
+        return statemachine_limit_kcs(d, argc);
       
       break;
     case 3:
@@ -1101,13 +1676,19 @@ int statemachine_cmd(struct katcp_dispatch *d, int argc)
       if (strcmp(arg_string_katcp(d, 1), "node") == 0)
         return statemachine_node_kcs(d);
       if (strcmp(arg_string_katcp(d, 1), "run") == 0)
-        return statemachine_run_kcs(d);
+        return statemachine_run_kcs(d, argc);
+      if (strcmp(arg_string_katcp(d, 1), "limit") == 0)
+        return statemachine_limit_kcs(d, argc);
       if (strcmp(arg_string_katcp(d, 1), "dt") == 0)
         return statemachine_dump_type_kcs(d);
       
       break;
   }
   if (argc > 3){
+    if (strcmp(arg_string_katcp(d, 1), "run") == 0)
+      return statemachine_run_kcs(d, argc);
+    if (strcmp(arg_string_katcp(d, 1), "limit") == 0)
+      return statemachine_limit_kcs(d, argc);
     if (strcmp(arg_string_katcp(d, 2), "op") == 0)
       return statemachine_op_kcs(d);
     if (strcmp(arg_string_katcp(d, 2), "edge") == 0)
@@ -1,6 +1,8 @@
 /* (c) 2011 SKA SA */
 /* Released under the GNU GPLv3 - see COPYING */
 
+#define _GNU_SOURCE /* recvmmsg */
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -25,19 +27,156 @@
 
 #define MTU 1500
 
+#define KCS_ANNOUNCE_BATCH    32   /* datagrams fetched per recvmmsg */
+#define KCS_ANNOUNCE_MAX     256   /* boards reported in one #roach appeared */
+#define KCS_ANNOUNCE_SEEN    512   /* announcements remembered for de-duplication */
+#define KCS_ANNOUNCE_WINDOW    5   /* seconds a repeated announcement is ignored for */
+
+struct kcs_announce_seen {
+  char *s_name;
+  struct in_addr s_addr;
+  struct timeval s_when;
+};
+
+/* a whole rack power cycling announces itself at once, and boards
+ * repeat themselves: drain everything queued on the socket, drop what
+ * was seen within the window and report the rest in one inform */
+
+static struct kcs_announce_seen *seen_announce_kcs(struct kcs_announce_seen *seen, char *name, struct in_addr *addr, struct timeval *now)
+{
+  struct kcs_announce_seen *oldest, *sn;
+  struct timeval delta;
+  int i;
+
+  oldest = &(seen[0]);
+
+  for (i = 0; i < KCS_ANNOUNCE_SEEN; i++){
+    sn = &(seen[i]);
+    if (sn->s_name == NULL){
+      if (oldest->s_name != NULL)
+        oldest = sn;
+      continue;
+    }
+
+    if ((sn->s_addr.s_addr == addr->s_addr) && (strcmp(sn->s_name, name) == 0)){
+      sub_time_katcp(&delta, now, &(sn->s_when));
+      if (delta.tv_sec < KCS_ANNOUNCE_WINDOW)
+        return NULL;
+      sn->s_when = *now;
+      return sn;
+    }
+
+    if ((oldest->s_name != NULL) && (cmp_time_katcp(&(sn->s_when), &(oldest->s_when)) < 0))
+      oldest = sn;
+  }
+
+  /* entries from the current batch are the newest, so never evicted by it */
+  if (oldest->s_name)
+    free(oldest->s_name);
+
+  oldest->s_name = strdup(name);
+  if (oldest->s_name == NULL)
+    return NULL;
+
+  oldest->s_addr = *addr;
+  oldest->s_when = *now;
+
+  return oldest;
+}
+
+static int drain_announce_kcs(struct katcl_line *l, int fd, struct kcs_announce_seen *seen)
+{
+  static unsigned char buffers[KCS_ANNOUNCE_BATCH][MTU + 1];
+  struct mmsghdr msgs[KCS_ANNOUNCE_BATCH];
+  struct iovec iovs[KCS_ANNOUNCE_BATCH];
+  struct sockaddr_in peers[KCS_ANNOUNCE_BATCH];
+  struct kcs_announce_seen *fresh[KCS_ANNOUNCE_MAX], *sn;
+  struct katcl_parse *p;
+  struct timeval now;
+  int i, rb, count, total;
+
+  count = 0;
+  total = 0;
+
+  do {
+    for (i = 0; i < KCS_ANNOUNCE_BATCH; i++){
+      iovs[i].iov_base = buffers[i];
+      iovs[i].iov_len  = MTU;
+      memset(&(msgs[i].msg_hdr), 0, sizeof(struct msghdr));
+      msgs[i].msg_hdr.msg_name    = &(peers[i]);
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      msgs[i].msg_hdr.msg_iov     = &(iovs[i]);
+      msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    /* never more than fit into this report, the rest stays queued */
+    rb = KCS_ANNOUNCE_MAX - count;
+    rb = recvmmsg(fd, msgs, (rb < KCS_ANNOUNCE_BATCH) ? rb : KCS_ANNOUNCE_BATCH, MSG_DONTWAIT, NULL);
+    if (rb < 0){
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+        break;
+      log_message_katcl(l, KATCP_LEVEL_ERROR, NULL, "udp ear: recv error: %s", strerror(errno));
+      return -1;
+    }
+
+    monotonic_time_katcp(&now);
+    total += rb;
+
+    for (i = 0; i < rb; i++){
+      buffers[i][msgs[i].msg_len] = '\0';
+      if (buffers[i][0] == '\0')
+        continue;
+
+      sn = seen_announce_kcs(seen, (char *) buffers[i], &(peers[i].sin_addr), &now);
+      if (sn == NULL)
+        continue;
+
+#ifdef DEBUG
+      fprintf(stderr,"udp ear: %s announced %s\n", inet_ntoa(peers[i].sin_addr), buffers[i]);
+#endif
+      fresh[count++] = sn;
+    }
+  } while ((rb == KCS_ANNOUNCE_BATCH) && (count < KCS_ANNOUNCE_MAX));
+
+#ifdef DEBUG
+  fprintf(stderr,"udp ear: %d announcements, %d new\n", total, count);
+#endif
+
+  if (count == 0)
+    return 0;
+
+  p = create_referenced_parse_katcl();
+  if (p == NULL){
+    log_message_katcl(l, KATCP_LEVEL_ERROR, NULL, "udp ear: unable to create parse structure for %d announcements", count);
+    return -1;
+  }
+
+  add_string_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#roach");
+  add_string_parse_katcl(p,                    KATCP_FLAG_STRING, "appeared");
+  add_string_parse_katcl(p,                    KATCP_FLAG_STRING, "spare");
+  for (i = 0; i < count; i++){
+    add_string_parse_katcl(p, KATCP_FLAG_STRING, fresh[i]->s_name);
+    add_string_parse_katcl(p, ((i + 1 < count) ? 0 : KATCP_FLAG_LAST) | KATCP_FLAG_STRING, inet_ntoa(fresh[i]->s_addr));
+  }
+
+  if (append_parse_katcl(l, p) < 0){
+    log_message_katcl(l, KATCP_LEVEL_ERROR, NULL, "udp ear: unable to relay %d announcements", count);
+  }
+  destroy_parse_katcl(p);
+
+  return count;
+}
+
 /*call with &someint*/
 int watch_announce_kcs(struct katcl_line *l, void *data)
 {
-  struct katcl_parse *p;
+  struct kcs_announce_seen seen[KCS_ANNOUNCE_SEEN];
 
-  struct sockaddr_in ear, peer;
-  int mfd, run, fd, lfd, rb, rtn;
+  struct sockaddr_in ear;
+  int mfd, run, fd, lfd, rb, rtn, i;
   int *lport;
-  unsigned char buffer[MTU];
   fd_set ins;
   fd_set outs;
-  socklen_t len;
-  char *ptr;
 
   if (data == NULL)
     return -1;
@@ -46,6 +185,10 @@ int watch_announce_kcs(struct katcl_line *l, void *data)
   if (lport  <= 0)
     return -1;
 
+  for (i = 0; i < KCS_ANNOUNCE_SEEN; i++){
+    seen[i].s_name = NULL;
+  }
+
 #ifdef DEBUG
   fprintf(stderr,"udp ear: about to try port: %d\n",*lport);
 #endif
@@ -77,8 +220,6 @@ int watch_announce_kcs(struct katcl_line *l, void *data)
   fprintf(stderr,"udp ear: about to run with socket on fd: %d\n",fd);
 #endif
 
-  len = sizeof(struct sockaddr_in);
-
   FD_ZERO(&outs);
   for (run = 1; run > 0;) {
 
@@ -105,53 +246,10 @@ int watch_announce_kcs(struct katcl_line *l, void *data)
       fprintf(stderr,"udp ear: got select %d\n",rtn);
 #endif
       if (FD_ISSET(fd,&ins)){
-        bzero(buffer, MTU);
-#if 0
-        rb = recv(fd, buffer, MTU, 0); 
-#endif
-        rb = recvfrom(fd, buffer, MTU, 0, (struct sockaddr *) &peer, &len);
-        if (rb <= 0){
-          log_message_katcl(l, KATCP_LEVEL_ERROR, NULL, "udp ear: recv error: %s", strerror(errno));
+        if (drain_announce_kcs(l, fd, seen) < 0){
           run = 0;
           break;
         }
-#ifdef DEBUG
-        fprintf(stderr,"udp ear: fd %d read: %d bytes %s\n", fd, rb, buffer);
-#endif
-       
-#if 0
-        if (getpeername(fd,  (struct sockaddr *) &peer, &len) < 0){
-       // if (getsockname(fd, (struct sockaddr *) &peer, &len) < 0){
-#ifdef DEBUG
-          fprintf(stderr,"udp ear: getpeername error %s\n",strerror(errno));
-#endif
-          ptr = NULL;
-        }
-        else {
-          ptr = inet_ntoa(peer.sin_addr);
-        }
-#endif
-
-        ptr = inet_ntoa(peer.sin_addr);
-#ifdef DEBUG
-        fprintf(stderr,"udp ear: %s\n", ptr);
-#endif
-
-        //log_message_katcl(l, KATCP_LEVEL_INFO, NULL, "udp ear: recv %d bytes: %s", rb, buffer);
-        p = create_referenced_parse_katcl();
-        if (p) {
-          add_string_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#roach");
-          add_string_parse_katcl(p,                    KATCP_FLAG_STRING, "add");
-          add_string_parse_katcl(p,                    KATCP_FLAG_STRING, (char *) buffer);
-          add_string_parse_katcl(p,                    KATCP_FLAG_STRING, ptr);
-          add_string_parse_katcl(p, KATCP_FLAG_LAST  | KATCP_FLAG_STRING, "spare");
-          if (append_parse_katcl(l, p) < 0){
-            log_message_katcl(l, KATCP_LEVEL_ERROR, NULL, "udp ear: unable to append parse to line recv %d bytes: %s", rb, buffer);
-          }
-          destroy_parse_katcl(p);
-        } else {
-          log_message_katcl(l, KATCP_LEVEL_ERROR, NULL, "udp ear: unable to create parse structure log insted recv %d bytes: %s", rb, buffer);
-        }
       }
       if (FD_ISSET(lfd,&ins)){
         rb = read_katcl(l);
@@ -177,16 +275,18 @@ int watch_announce_kcs(struct katcl_line *l, void *data)
     }
   }
 
+  for (i = 0; i < KCS_ANNOUNCE_SEEN; i++){
+    if (seen[i].s_name)
+      free(seen[i].s_name);
+  }
+
   return 0;
 }
 
 int handle_roach_via_watch_announce_kcs(struct katcp_dispatch *d, struct katcp_notice *n, void *data)
 {
   struct katcl_parse *p;
-#if 0
-  int i;
-#endif
-  int argc;
+  int argc, i, added;
   char *dcmd, *rcmd, *url, *ip, *pool;
   
 #if 0
@@ -198,16 +298,31 @@ int handle_roach_via_watch_announce_kcs(struct katcp_dispatch *d, struct katcp_n
   if (p) {
     argc = get_count_parse_katcl(p);
     
+    dcmd = get_string_parse_katcl(p,0);
+    rcmd = get_string_parse_katcl(p,1);
+
+    /* #roach appeared pool url ip [url ip ...], a whole batch at once */
+    if (argc >= 5 && ((argc - 3) % 2) == 0 && dcmd && rcmd && strcmp(dcmd,"#roach") == 0 && strcmp(rcmd,"appeared") == 0){
+      pool = get_string_parse_katcl(p,2);
+      added = 0;
+      for (i = 3; pool && i < argc; i += 2){
+        url = get_string_parse_katcl(p,i);
+        ip  = get_string_parse_katcl(p,i+1);
+        if (url && ip && add_roach_to_pool_kcs(d, pool, url, ip) == KCS_OK)
+          added++;
+      }
+      log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "udpear: %d of %d announced boards added to pool %s", added, (argc - 3) / 2, pool ? pool : "<none>");
+      return 1;
+    }
+
     switch (argc){
       case 5:
           
-          dcmd = get_string_parse_katcl(p,0);
-          rcmd = get_string_parse_katcl(p,1);
           url  = get_string_parse_katcl(p,2);
           ip   = get_string_parse_katcl(p,3);
           pool = get_string_parse_katcl(p,4);
           
-          if (strcmp(dcmd,"#roach") == 0 && strcmp(rcmd,"add") == 0 && url && ip && pool){
+          if (dcmd && rcmd && strcmp(dcmd,"#roach") == 0 && strcmp(rcmd,"add") == 0 && url && ip && pool){
             if (add_roach_to_pool_kcs(d, pool, url, ip) == KCS_FAIL) {
 #ifdef DEBUG
               fprintf(stderr, "udpear: error cannot add roach to pool in kcs\n");
@@ -0,0 +1,890 @@
+/* (c) 2012 SKA SA */
+/* Released under the GNU GPLv3 - see COPYING */
+
+/* load generator for katcp servers: keeps a number of connections to
+ * one server, issues a weighted mix of requests open loop at a fixed
+ * overall rate and reports throughput and latency percentiles.
+ * Latency is measured from the time a request was due, not from when
+ * it could be sent, so a stalling server isn't hidden by a backlog */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "netc.h"
+#include "katcp.h"
+#include "katcl.h"
+#include "katpriv.h"
+
+#define KCPLOAD_NAME "kcpload"
+
+#define LOAD_RING     4096 /* requests due or in flight per connection */
+#define LOAD_WINDOW     32 /* default requests in flight per connection */
+#define LOAD_GRACE    2000 /* ms to wait for replies once the run is over */
+
+#define LOAD_UNTIMED  (-1) /* setup requests, not part of the statistics */
+
+/* latency histogram with 16 subdivisions per power of two, in us */
+#define LOAD_SUB        16
+#define LOAD_SHIFT       4
+#define LOAD_BUCKETS  (LOAD_SUB * 40)
+
+struct load_kind{
+  char *k_text;
+  char *k_name;
+  unsigned int k_weight;
+  struct katcl_parse *k_parse;
+
+  unsigned long k_sent;
+  unsigned long k_ok;
+  unsigned long k_fail;
+};
+
+struct load_pending{
+  struct timeval p_when;
+  int p_kind;
+};
+
+struct load_conn{
+  struct katcl_line *c_line;
+  int c_up;
+
+  struct load_pending c_ring[LOAD_RING];
+  unsigned int c_head; /* oldest request awaiting its reply */
+  unsigned int c_sent; /* next request to be sent */
+  unsigned int c_tail; /* end of requests which are due */
+};
+
+struct load_histogram{
+  unsigned long h_counts[LOAD_BUCKETS];
+  unsigned long h_total;
+  unsigned long h_max;
+};
+
+struct load_state{
+  struct load_kind **l_kinds;
+  unsigned int l_count;
+  unsigned int l_weights;
+  unsigned int l_rotor;
+
+  char **l_samplings;
+  unsigned int l_sampling_count;
+
+  struct load_conn **l_conns;
+  unsigned int l_conn_count;
+  unsigned int l_next;
+
+  unsigned int l_window;
+
+  unsigned long l_scheduled;
+  unsigned long l_shed;
+  unsigned long l_completed;
+  unsigned long l_informs;
+  unsigned long l_lost;
+
+  struct load_histogram l_histogram;
+};
+
+/* histogram ********************************************************/
+
+static unsigned int index_histogram(unsigned long us)
+{
+  unsigned int top, index;
+
+  if(us < LOAD_SUB){
+    return us;
+  }
+
+  for(top = 0; (us >> top) > 1; top++);
+
+  index = ((top - LOAD_SHIFT + 1) * LOAD_SUB) + ((us >> (top - LOAD_SHIFT)) & (LOAD_SUB - 1));
+  if(index >= LOAD_BUCKETS){
+    return LOAD_BUCKETS - 1;
+  }
+
+  return index;
+}
+
+static unsigned long value_histogram(unsigned int index)
+{
+  unsigned int top;
+
+  if(index < LOAD_SUB){
+    return index;
+  }
+
+  /* report the middle of the bucket */
+  top = (index / LOAD_SUB) + LOAD_SHIFT - 1;
+
+  return ((unsigned long)(LOAD_SUB + (index % LOAD_SUB)) << (top - LOAD_SHIFT)) + ((1UL << (top - LOAD_SHIFT)) / 2);
+}
+
+void record_histogram(struct load_histogram *h, unsigned long us)
+{
+  h->h_counts[index_histogram(us)]++;
+  h->h_total++;
+  if(us > h->h_max){
+    h->h_max = us;
+  }
+}
+
+unsigned long percentile_histogram(struct load_histogram *h, double fraction)
+{
+  unsigned long want, seen;
+  unsigned int i;
+
+  if(h->h_total == 0){
+    return 0;
+  }
+
+  want = (unsigned long)(fraction * h->h_total);
+  if(want >= h->h_total){
+    want = h->h_total - 1;
+  }
+
+  seen = 0;
+  for(i = 0; i < LOAD_BUCKETS; i++){
+    seen += h->h_counts[i];
+    if(seen > want){
+      return ((i == (LOAD_BUCKETS - 1)) || (value_histogram(i) > h->h_max)) ? h->h_max : value_histogram(i);
+    }
+  }
+
+  return h->h_max;
+}
+
+/* request mix ******************************************************/
+
+void destroy_kind(struct load_kind *lk)
+{
+  if(lk == NULL){
+    return;
+  }
+
+  if(lk->k_text){
+    free(lk->k_text);
+    lk->k_text = NULL;
+  }
+
+  if(lk->k_parse){
+    destroy_parse_katcl(lk->k_parse);
+    lk->k_parse = NULL;
+  }
+
+  free(lk);
+}
+
+/* turn "?name arg arg" into a parse, words separated by spaces */
+
+struct katcl_parse *text_to_parse(char *text)
+{
+  struct katcl_parse *px;
+  char *copy, *ptr, *end;
+  int flags;
+
+  copy = strdup(text);
+  if(copy == NULL){
+    return NULL;
+  }
+
+  px = create_referenced_parse_katcl();
+  if(px == NULL){
+    free(copy);
+    return NULL;
+  }
+
+  ptr = copy;
+  flags = KATCP_FLAG_FIRST;
+
+  while(*ptr == ' '){
+    ptr++;
+  }
+
+  while(*ptr != '\0'){
+    end = strchr(ptr, ' ');
+    if(end){
+      *end = '\0';
+      end++;
+      while(*end == ' '){
+        end++;
+      }
+    } else {
+      end = ptr + strlen(ptr);
+    }
+
+    if(*end == '\0'){
+      flags |= KATCP_FLAG_LAST;
+    }
+
+    if(add_string_parse_katcl(px, flags, ptr) < 0){
+      destroy_parse_katcl(px);
+      free(copy);
+      return NULL;
+    }
+
+    flags = 0;
+    ptr = end;
+  }
+
+  free(copy);
+
+  if(flags != 0){ /* empty */
+    destroy_parse_katcl(px);
+    return NULL;
+  }
+
+  return px;
+}
+
+/* a mix entry is [weight:]?request [args] */
+
+int add_kind(struct load_state *ls, char *spec)
+{
+  struct load_kind *lk, **tmp;
+  char *ptr, *name;
+  unsigned int weight;
+
+  weight = 1;
+  ptr = spec;
+
+  if((spec[0] >= '0') && (spec[0] <= '9')){
+    weight = strtoul(spec, &ptr, 10);
+    if(*ptr != ':'){
+      return -1;
+    }
+    ptr++;
+  }
+
+  if((weight == 0) || (ptr[0] != KATCP_REQUEST)){
+    return -1;
+  }
+
+  lk = malloc(sizeof(struct load_kind));
+  if(lk == NULL){
+    return -1;
+  }
+
+  lk->k_text = NULL;
+  lk->k_name = NULL;
+  lk->k_weight = weight;
+  lk->k_parse = NULL;
+  lk->k_sent = 0;
+  lk->k_ok = 0;
+  lk->k_fail = 0;
+
+  lk->k_text = strdup(ptr);
+  lk->k_parse = text_to_parse(ptr);
+  if((lk->k_text == NULL) || (lk->k_parse == NULL)){
+    destroy_kind(lk);
+    return -1;
+  }
+
+  name = get_string_parse_katcl(lk->k_parse, 0);
+  lk->k_name = name + 1;
+
+  tmp = realloc(ls->l_kinds, sizeof(struct load_kind *) * (ls->l_count + 1));
+  if(tmp == NULL){
+    destroy_kind(lk);
+    return -1;
+  }
+
+  ls->l_kinds = tmp;
+  ls->l_kinds[ls->l_count] = lk;
+  ls->l_count++;
+  ls->l_weights += weight;
+
+  return 0;
+}
+
+/* deterministic weighted rotation, so that runs are repeatable */
+
+int pick_kind(struct load_state *ls)
+{
+  unsigned int i, slot;
+
+  slot = ls->l_rotor % ls->l_weights;
+  ls->l_rotor++;
+
+  for(i = 0; i < ls->l_count; i++){
+    if(slot < ls->l_kinds[i]->k_weight){
+      return i;
+    }
+    slot -= ls->l_kinds[i]->k_weight;
+  }
+
+  return 0;
+}
+
+/* connections ******************************************************/
+
+void destroy_conn(struct load_conn *lc)
+{
+  if(lc == NULL){
+    return;
+  }
+
+  if(lc->c_line){
+    destroy_katcl(lc->c_line, 1);
+    lc->c_line = NULL;
+  }
+
+  free(lc);
+}
+
+struct load_conn *create_conn(char *server)
+{
+  struct load_conn *lc;
+  int fd, flags;
+
+  fd = net_connect(server, 0, 0);
+  if(fd < 0){
+    return NULL;
+  }
+
+  flags = fcntl(fd, F_GETFL, 0);
+  if((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)){
+    close(fd);
+    return NULL;
+  }
+
+  lc = malloc(sizeof(struct load_conn));
+  if(lc == NULL){
+    close(fd);
+    return NULL;
+  }
+
+  lc->c_line = create_katcl(fd);
+  if(lc->c_line == NULL){
+    close(fd);
+    free(lc);
+    return NULL;
+  }
+
+  lc->c_up = 1;
+  lc->c_head = 0;
+  lc->c_sent = 0;
+  lc->c_tail = 0;
+
+  return lc;
+}
+
+int due_conn(struct load_conn *lc, int kind, struct timeval *when)
+{
+  struct load_pending *lp;
+
+  if((lc->c_up == 0) || ((lc->c_tail - lc->c_head) >= LOAD_RING)){
+    return -1;
+  }
+
+  lp = &(lc->c_ring[lc->c_tail % LOAD_RING]);
+  lp->p_when = *when;
+  lp->p_kind = kind;
+
+  lc->c_tail++;
+
+  return 0;
+}
+
+/* put due requests on the wire, no more than the window in flight */
+
+int send_conn(struct load_state *ls, struct load_conn *lc)
+{
+  struct load_pending *lp;
+  struct load_kind *lk;
+
+  while((lc->c_sent != lc->c_tail) && ((lc->c_sent - lc->c_head) < ls->l_window)){
+    lp = &(lc->c_ring[lc->c_sent % LOAD_RING]);
+    lk = ls->l_kinds[lp->p_kind];
+
+    if(append_parse_katcl(lc->c_line, lk->k_parse) < 0){
+      return -1;
+    }
+
+    lk->k_sent++;
+
+    lc->c_sent++;
+  }
+
+  return 0;
+}
+
+int receive_conn(struct load_state *ls, struct load_conn *lc, struct timeval *now)
+{
+  struct load_pending *lp;
+  struct load_kind *lk;
+  struct timeval delta;
+  char *ptr, *code;
+  int result;
+
+  result = read_katcl(lc->c_line);
+  if(result != 0){
+    return -1;
+  }
+
+  while(have_katcl(lc->c_line) > 0){
+    ptr = arg_string_katcl(lc->c_line, 0);
+    if(ptr == NULL){
+      continue;
+    }
+
+    if(ptr[0] == KATCP_INFORM){
+      if(!strcmp(ptr + 1, "sensor-status")){
+        ls->l_informs++;
+      }
+      continue;
+    }
+
+    if((ptr[0] != KATCP_REPLY) || (lc->c_head == lc->c_sent)){
+      continue;
+    }
+
+    lp = &(lc->c_ring[lc->c_head % LOAD_RING]);
+    lc->c_head++;
+
+    if(lp->p_kind == LOAD_UNTIMED){
+      continue;
+    }
+
+    lk = ls->l_kinds[lp->p_kind];
+
+    if(strcmp(ptr + 1, lk->k_name)){
+      fprintf(stderr, "%s: expected reply to %s, got %s\n", KCPLOAD_NAME, lk->k_name, ptr + 1);
+    }
+
+    code = arg_string_katcl(lc->c_line, 1);
+    if(code && !strcmp(code, KATCP_OK)){
+      lk->k_ok++;
+    } else {
+      lk->k_fail++;
+    }
+
+    sub_time_katcp(&delta, now, &(lp->p_when));
+    record_histogram(&(ls->l_histogram), (delta.tv_sec * 1000000UL) + delta.tv_usec);
+
+    ls->l_completed++;
+  }
+
+  return 0;
+}
+
+/********************************************************************/
+
+void usage(char *app)
+{
+  printf("usage: %s [flags] [-x [weight:]?request [args]]*\n", app);
+  printf("-h                 this help\n");
+  printf("-c count           number of connections (default 8)\n");
+  printf("-d duration        length of the run in seconds (default 10)\n");
+  printf("-r rate            requests per second across all connections (default 1000)\n");
+  printf("-S sampling        subscribe each connection with ?sensor-sampling sampling, eg \"name period 100\"\n");
+  printf("-s server:port     specify server:port\n");
+  printf("-v                 report progress every second\n");
+  printf("-w count           number of requests to have in flight per connection (default %d)\n", LOAD_WINDOW);
+  printf("-x request         add a request, as a single argument, to the mix (default ?watchdog)\n");
+
+  printf("return codes:\n");
+  printf("0     run completed\n");
+  printf("1     requests failed or went unanswered\n");
+  printf("2     usage problems\n");
+  printf("3     network problems\n");
+  printf("4     severe internal errors\n");
+
+  printf("environment variables:\n");
+  printf("  KATCP_SERVER     default server (overridden by -s option)\n");
+
+  printf("notes:\n");
+  printf("  requests are issued open loop: due times follow the rate, and latency counts from\n");
+  printf("  the due time, so a backlog waiting for the window shows up as latency\n");
+  printf("  example mix: -x 4:?watchdog -x \"?sensor-value raw.temp.fpga\" -x \"?read sys_scratchpad 0 4\"\n");
+}
+
+void report_load(struct load_state *ls, struct timeval *elapsed)
+{
+  struct load_histogram *h;
+  struct load_kind *lk;
+  unsigned int i;
+  double seconds;
+  unsigned long failed;
+
+  h = &(ls->l_histogram);
+  seconds = elapsed->tv_sec + (elapsed->tv_usec / 1000000.0);
+  if(seconds <= 0.0){
+    seconds = 1.0;
+  }
+
+  failed = 0;
+  for(i = 0; i < ls->l_count; i++){
+    failed += ls->l_kinds[i]->k_fail;
+  }
+
+  printf("duration %.3fs connections %u\n", seconds, ls->l_conn_count);
+  printf("scheduled %lu completed %lu failed %lu shed %lu unanswered %lu\n", ls->l_scheduled, ls->l_completed, failed, ls->l_shed, ls->l_lost);
+  printf("throughput %.1f requests/s\n", ls->l_completed / seconds);
+  printf("latency ms p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+    percentile_histogram(h, 0.5) / 1000.0,
+    percentile_histogram(h, 0.9) / 1000.0,
+    percentile_histogram(h, 0.99) / 1000.0,
+    percentile_histogram(h, 0.999) / 1000.0,
+    h->h_max / 1000.0);
+
+  for(i = 0; i < ls->l_count; i++){
+    lk = ls->l_kinds[i];
+    printf("request %s sent %lu ok %lu failed %lu\n", lk->k_text, lk->k_sent, lk->k_ok, lk->k_fail);
+  }
+
+  if(ls->l_sampling_count > 0){
+    printf("informs sensor-status %lu (%.1f/s)\n", ls->l_informs, ls->l_informs / seconds);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  struct load_state state, *ls;
+  struct load_conn *lc;
+  struct katcl_parse **setups;
+  struct pollfd *pfds;
+  struct timeval start, stop, now, next, interval, delta, last, finish;
+  char *app, *server, *ptr;
+  unsigned int i, count, rate, duration, verbose, done, s;
+  unsigned long previous;
+  int j, c, result, ms, running;
+
+  server = getenv("KATCP_SERVER");
+  if(server == NULL){
+    server = "localhost:7147";
+  }
+
+  ls = &state;
+  memset(ls, 0, sizeof(struct load_state));
+
+  ls->l_window = LOAD_WINDOW;
+
+  app = argv[0];
+  count = 8;
+  rate = 1000;
+  duration = 10;
+  verbose = 0;
+  i = j = 1;
+
+  while (i < argc) {
+    if (argv[i][0] == '-') {
+      c = argv[i][j];
+      switch (c) {
+
+        case 'h' :
+          usage(app);
+          return 0;
+
+        case 'v' :
+          verbose++;
+          j++;
+          break;
+
+        case 'c' :
+        case 'd' :
+        case 'r' :
+        case 'S' :
+        case 's' :
+        case 'w' :
+        case 'x' :
+
+          j++;
+          if (argv[i][j] == '\0') {
+            j = 0;
+            i++;
+          }
+          if (i >= argc) {
+            fprintf(stderr, "%s: argument needs a parameter\n", app);
+            return 2;
+          }
+
+          ptr = argv[i] + j;
+
+          switch(c){
+            case 'c' :
+              count = atoi(ptr);
+              break;
+            case 'd' :
+              duration = atoi(ptr);
+              break;
+            case 'r' :
+              rate = atoi(ptr);
+              break;
+            case 'S' :
+              ls->l_samplings = realloc(ls->l_samplings, sizeof(char *) * (ls->l_sampling_count + 1));
+              if(ls->l_samplings == NULL){
+                return 4;
+              }
+              ls->l_samplings[ls->l_sampling_count++] = ptr;
+              break;
+            case 's' :
+              server = ptr;
+              break;
+            case 'w' :
+              ls->l_window = atoi(ptr);
+              if((ls->l_window == 0) || (ls->l_window > LOAD_RING)){
+                ls->l_window = LOAD_WINDOW;
+              }
+              break;
+            case 'x' :
+              if(add_kind(ls, ptr) < 0){
+                fprintf(stderr, "%s: unable to add request %s, expected [weight:]?request [args]\n", app, ptr);
+                return 2;
+              }
+              break;
+          }
+
+          i++;
+          j = 1;
+          break;
+
+        case '-' :
+          j++;
+          break;
+        case '\0':
+          j = 1;
+          i++;
+          break;
+        default:
+          fprintf(stderr, "%s: unknown option -%c\n", app, argv[i][j]);
+          return 2;
+      }
+    } else {
+      fprintf(stderr, "%s: extra argument %s\n", app, argv[i]);
+      return 2;
+    }
+  }
+
+  if((count == 0) || (rate == 0) || (duration == 0)){
+    fprintf(stderr, "%s: connections, rate and duration have to be nonzero\n", app);
+    return 2;
+  }
+
+  if(ls->l_count == 0){
+    if(add_kind(ls, "?watchdog") < 0){
+      return 4;
+    }
+  }
+
+  setups = NULL;
+  if(ls->l_sampling_count > 0){
+    setups = malloc(sizeof(struct katcl_parse *) * ls->l_sampling_count);
+    if(setups == NULL){
+      return 4;
+    }
+    for(s = 0; s < ls->l_sampling_count; s++){
+      ptr = malloc(strlen(ls->l_samplings[s]) + 20);
+      if(ptr == NULL){
+        return 4;
+      }
+      sprintf(ptr, "?sensor-sampling %s", ls->l_samplings[s]);
+      setups[s] = text_to_parse(ptr);
+      free(ptr);
+      if(setups[s] == NULL){
+        fprintf(stderr, "%s: unable to build sampling request for %s\n", app, ls->l_samplings[s]);
+        return 2;
+      }
+    }
+  }
+
+  ls->l_conns = malloc(sizeof(struct load_conn *) * count);
+  pfds = malloc(sizeof(struct pollfd) * count);
+  if((ls->l_conns == NULL) || (pfds == NULL)){
+    return 4;
+  }
+
+  for(ls->l_conn_count = 0; ls->l_conn_count < count; ls->l_conn_count++){
+    lc = create_conn(server);
+    if(lc == NULL){
+      fprintf(stderr, "%s: unable to connect to %s: %s\n", app, server, strerror(errno));
+      return 3;
+    }
+    ls->l_conns[ls->l_conn_count] = lc;
+  }
+
+  gettimeofday(&now, NULL);
+
+  /* subscriptions go out first and directly, they are answered before any timed request */
+  for(i = 0; i < count; i++){
+    lc = ls->l_conns[i];
+    for(s = 0; s < ls->l_sampling_count; s++){
+      due_conn(lc, LOAD_UNTIMED, &now);
+      lc->c_sent++;
+      append_parse_katcl(lc->c_line, setups[s]);
+    }
+  }
+
+  interval.tv_sec = 0;
+  interval.tv_usec = 1000000 / rate;
+  if(interval.tv_usec == 0){
+    interval.tv_usec = 1;
+  }
+  if(interval.tv_usec >= 1000000){
+    interval.tv_sec = 1;
+    interval.tv_usec = 0;
+  }
+
+  gettimeofday(&start, NULL);
+  delta.tv_sec = duration;
+  delta.tv_usec = 0;
+  add_time_katcp(&stop, &start, &delta);
+
+  delta.tv_sec = LOAD_GRACE / 1000;
+  delta.tv_usec = (LOAD_GRACE % 1000) * 1000;
+  add_time_katcp(&finish, &stop, &delta);
+
+  next = start;
+  last = start;
+  previous = 0;
+  running = 1;
+
+  for(;;){
+    gettimeofday(&now, NULL);
+
+    if(running){
+      /* everything which has become due since the last pass, round robin over connections */
+      while((cmp_time_katcp(&next, &now) <= 0) && (cmp_time_katcp(&next, &stop) < 0)){
+        lc = ls->l_conns[ls->l_next];
+        ls->l_next = (ls->l_next + 1) % count;
+
+        if(due_conn(lc, pick_kind(ls), &next) < 0){
+          ls->l_shed++;
+        }
+        ls->l_scheduled++;
+
+        add_time_katcp(&next, &next, &interval);
+      }
+
+      if(cmp_time_katcp(&now, &stop) >= 0){
+        running = 0;
+      }
+    }
+
+    if(verbose && (now.tv_sec > last.tv_sec)){
+      sub_time_katcp(&delta, &now, &start);
+      fprintf(stderr, "%s: %lus completed %lu (%lu/s) p99 %.3fms\n", app, delta.tv_sec, ls->l_completed, ls->l_completed - previous, percentile_histogram(&(ls->l_histogram), 0.99) / 1000.0);
+      previous = ls->l_completed;
+      last = now;
+    }
+
+    done = 1;
+
+    for(i = 0; i < count; i++){
+      lc = ls->l_conns[i];
+      pfds[i].fd = (-1);
+      pfds[i].events = 0;
+      pfds[i].revents = 0;
+
+      if(lc->c_up == 0){
+        continue;
+      }
+
+      /* write straight away, waiting for the poll would add to the latency */
+      if((send_conn(ls, lc) < 0) || (flushing_katcl(lc->c_line) && (write_katcl(lc->c_line) < 0))){
+        fprintf(stderr, "%s: unable to send on connection %u\n", app, i);
+        lc->c_up = 0;
+        continue;
+      }
+
+      if(lc->c_head != lc->c_tail){
+        done = 0;
+      }
+
+      pfds[i].fd = fileno_katcl(lc->c_line);
+      pfds[i].events = POLLIN | (flushing_katcl(lc->c_line) ? POLLOUT : 0);
+    }
+
+    if((running == 0) && (done || (cmp_time_katcp(&now, &finish) >= 0))){
+      break;
+    }
+
+    if(running){
+      sub_time_katcp(&delta, &next, &now);
+      ms = (cmp_time_katcp(&next, &now) <= 0) ? 0 : ((delta.tv_sec * 1000) + ((delta.tv_usec + 999) / 1000));
+    } else {
+      ms = 100;
+    }
+    if(ms > 100){
+      ms = 100;
+    }
+
+    result = poll(pfds, count, ms);
+    if(result < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      fprintf(stderr, "%s: poll failed: %s\n", app, strerror(errno));
+      return 4;
+    }
+
+    gettimeofday(&now, NULL);
+
+    for(i = 0; i < count; i++){
+      lc = ls->l_conns[i];
+      if(pfds[i].fd < 0){
+        continue;
+      }
+
+      if(pfds[i].revents & (POLLOUT | POLLERR | POLLHUP)){
+        if(write_katcl(lc->c_line) < 0){
+          fprintf(stderr, "%s: write to connection %u failed\n", app, i);
+          lc->c_up = 0;
+          continue;
+        }
+      }
+
+      if(pfds[i].revents & (POLLIN | POLLERR | POLLHUP)){
+        if(receive_conn(ls, lc, &now) < 0){
+          fprintf(stderr, "%s: connection %u closed by server\n", app, i);
+          lc->c_up = 0;
+        }
+      }
+    }
+  }
+
+  for(i = 0; i < count; i++){
+    lc = ls->l_conns[i];
+    for(; lc->c_head != lc->c_tail; lc->c_head++){
+      if(lc->c_ring[lc->c_head % LOAD_RING].p_kind != LOAD_UNTIMED){
+        ls->l_lost++;
+      }
+    }
+  }
+
+  gettimeofday(&now, NULL);
+  sub_time_katcp(&delta, ((cmp_time_katcp(&now, &stop) < 0) ? &now : &stop), &start);
+
+  report_load(ls, &delta);
+
+  result = (ls->l_lost > 0) ? 1 : 0;
+  for(i = 0; i < ls->l_count; i++){
+    if(ls->l_kinds[i]->k_fail > 0){
+      result = 1;
+    }
+    destroy_kind(ls->l_kinds[i]);
+  }
+  free(ls->l_kinds);
+
+  for(i = 0; i < count; i++){
+    destroy_conn(ls->l_conns[i]);
+  }
+  free(ls->l_conns);
+  free(pfds);
+
+  for(s = 0; s < ls->l_sampling_count; s++){
+    destroy_parse_katcl(setups[s]);
+  }
+  if(setups){
+    free(setups);
+  }
+  free(ls->l_samplings);
+
+  return result;
+}
@@ -7,10 +7,13 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
+#include <stdarg.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/wait.h>
 
 #include <netc.h>
 #include <katcl.h>
@@ -20,6 +23,47 @@
 
 #define NAME "kcplog"
 
+#define CAPTURE_BUFFER  (256 * 1024)
+#define CAPTURE_FLUSH             1  /* seconds data may sit in the buffer */
+
+#define CAPTURE_RAW               0
+#define CAPTURE_BINARY            1
+
+#define CAPTURE_MAGIC    "KCPLOG\0\1"
+#define CAPTURE_MAGIC_SIZE        8
+
+#define CAPTURE_COMPRESSOR   "gzip"
+
+/* binary capture files start with CAPTURE_MAGIC, followed by one
+ * record per log message:
+ *   4 bytes  length of the rest of the record, big endian
+ *   8 bytes  timestamp in milliseconds, big endian
+ *   1 byte   level code
+ *   1 byte   length of the module name
+ *   the module name, then the message text, neither terminated
+ * other katcp messages are not recorded in this format
+ */
+
+struct capture{
+  char *c_path;
+  int c_flags;
+  int c_fd;
+  pid_t c_child;
+
+  int c_format;
+  int c_compress;
+
+  unsigned long c_size;
+  unsigned int c_period;
+
+  unsigned long c_written;
+  time_t c_opened;
+  time_t c_flushed;
+
+  char *c_buffer;
+  unsigned int c_have;
+};
+
 static volatile int log_level = KATCP_LEVEL_INFO;
 static volatile int log_changed = 0;
 static volatile int log_reload = 0;
@@ -36,8 +80,17 @@ void usage(char *app)
   printf("-t              truncate the logfile when opening it\n");
   printf("-s server:port  connect to the specified server rather than localhost:7147\n");
   printf("-a attempts     make the given number attempts to connect to the server before giving up\n");
+  printf("-m module       only keep log messages from the given module (may be repeated or comma separated)\n");
+  printf("-c              capture mode: gather output into large writes to the logfile\n");
+  printf("-b              capture in a compact binary record format (implies -c)\n");
+  printf("-r size         rotate the logfile once size bytes (k, M, G suffixes) were written (implies -c)\n");
+  printf("-p seconds      rotate the logfile every given number of seconds (implies -c)\n");
+  printf("-z              compress the logfile with %s as it is written (implies -c)\n", CAPTURE_COMPRESSOR);
   printf("signals: HUP USR1 USR2\n");
   printf(" HUP            re-open the logfile (if -o is given)\n");
+  printf("notes:\n");
+  printf(" the level given with -l is also applied locally, before messages are written\n");
+  printf(" rotated logfiles are renamed to logfile.YYYYmmddTHHMMSS of the time they were opened\n");
   printf(" USR1           change log level one level more detailed (eg from DEBUG to TRACE)\n");
   printf(" USR2           change log level one level less detailed (eg from INFO to WARN)\n");
 }
@@ -69,15 +122,449 @@ static void handle_signal(int signal)
 
 }
 
+/* filters, applied to the parse, ahead of any formatting *************/
+
+static int add_modules(char ***modules, unsigned int *count, char *list)
+{
+  char *copy, *ptr, **tmp;
+
+  copy = strdup(list);
+  if(copy == NULL){
+    return -1;
+  }
+
+  for(ptr = strtok(copy, ","); ptr; ptr = strtok(NULL, ",")){
+    tmp = realloc(*modules, sizeof(char *) * (*count + 1));
+    if(tmp == NULL){
+      return -1;
+    }
+    *modules = tmp;
+    (*modules)[*count] = ptr;
+    (*count)++;
+  }
+
+  /* copy is referenced by the vector, never freed */
+
+  return 0;
+}
+
+static int keep_message(struct katcl_parse *p, int threshold, char **modules, unsigned int count)
+{
+  char *ptr;
+  unsigned int i;
+  int code;
+
+  ptr = get_string_parse_katcl(p, 0);
+  if((ptr == NULL) || strcmp(ptr, KATCP_LOG_INFORM)){
+    return 1;
+  }
+
+  if(threshold > KATCP_LEVEL_TRACE){
+    code = log_to_code_katcl(get_string_parse_katcl(p, 1));
+    if((code >= 0) && (code < threshold)){
+      return 0;
+    }
+  }
+
+  if(count > 0){
+    ptr = get_string_parse_katcl(p, 3);
+    if(ptr == NULL){
+      return 0;
+    }
+    for(i = 0; i < count; i++){
+      if(!strcmp(ptr, modules[i])){
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  return 1;
+}
+
+/* capture logic *****************************************************/
+
+static unsigned long parse_size(char *string)
+{
+  unsigned long value;
+  char *end;
+
+  value = strtoul(string, &end, 0);
+  switch(end[0]){
+    case 'k' :
+    case 'K' :
+      value *= 1024;
+      break;
+    case 'm' :
+    case 'M' :
+      value *= 1024 * 1024;
+      break;
+    case 'g' :
+    case 'G' :
+      value *= 1024 * 1024 * 1024;
+      break;
+  }
+
+  return value;
+}
+
+static int write_all(int fd, char *data, unsigned int len)
+{
+  unsigned int done;
+  int wr;
+
+  done = 0;
+  while(done < len){
+    wr = write(fd, data + done, len - done);
+    if(wr < 0){
+      switch(errno){
+        case EINTR :
+          continue;
+        default :
+          return -1;
+      }
+    }
+    done += wr;
+  }
+
+  return 0;
+}
+
+static int flush_capture(struct capture *c)
+{
+  time(&(c->c_flushed));
+
+  if(c->c_have == 0){
+    return 0;
+  }
+
+  if(write_all(c->c_fd, c->c_buffer, c->c_have) < 0){
+    return -1;
+  }
+
+  c->c_have = 0;
+
+  return 0;
+}
+
+static int append_capture(struct capture *c, char *data, unsigned int len)
+{
+  if((c->c_have + len) > CAPTURE_BUFFER){
+    if(flush_capture(c) < 0){
+      return -1;
+    }
+    if(len > CAPTURE_BUFFER){ /* oversized, bypass the buffer */
+      c->c_written += len;
+      return write_all(c->c_fd, data, len);
+    }
+  }
+
+  memcpy(c->c_buffer + c->c_have, data, len);
+  c->c_have += len;
+  c->c_written += len;
+
+  return 0;
+}
+
+/* returns the write end of a pipe into a compressor which writes to fd */
+
+static int spawn_compressor(int fd, pid_t *child)
+{
+  int fds[2];
+  pid_t pid;
+
+  if(pipe(fds) < 0){
+    return -1;
+  }
+
+  pid = fork();
+  if(pid < 0){
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  if(pid == 0){
+    if((dup2(fds[0], STDIN_FILENO) < 0) || (dup2(fd, STDOUT_FILENO) < 0)){
+      _exit(EX_OSERR);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    close(fd);
+    execlp(CAPTURE_COMPRESSOR, CAPTURE_COMPRESSOR, "-c", "-1", (char *)NULL);
+    _exit(EX_UNAVAILABLE);
+  }
+
+  close(fds[0]);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+  *child = pid;
+
+  return fds[1];
+}
+
+static int open_capture(struct capture *c)
+{
+  struct stat st;
+  int fd;
+
+  fd = open(c->c_path, c->c_flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+  if(fd < 0){
+    return -1;
+  }
+
+  if(fstat(fd, &st) < 0){
+    st.st_size = 0;
+  }
+
+  if(c->c_compress){
+    c->c_fd = spawn_compressor(fd, &(c->c_child));
+    close(fd);
+    if(c->c_fd < 0){
+      return -1;
+    }
+    c->c_written = 0; /* counts uncompressed data */
+  } else {
+    c->c_fd = fd;
+    c->c_written = st.st_size;
+  }
+
+  time(&(c->c_opened));
+  c->c_flushed = c->c_opened;
+
+  if((c->c_format == CAPTURE_BINARY) && (st.st_size == 0)){
+    if(append_capture(c, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) < 0){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int close_capture(struct capture *c)
+{
+  int result, status;
+
+  result = 0;
+
+  if(c->c_fd < 0){
+    return 0;
+  }
+
+  if(flush_capture(c) < 0){
+    result = (-1);
+  }
+
+  close(c->c_fd);
+  c->c_fd = (-1);
+
+  if(c->c_child > 0){ /* let the compressor finish its file */
+    if(waitpid(c->c_child, &status, 0) == c->c_child){
+      if(!WIFEXITED(status) || WEXITSTATUS(status)){
+        result = (-1);
+      }
+    }
+    c->c_child = 0;
+  }
+
+  return result;
+}
+
+/* close the current file, move it out of the way and start a new one */
+
+static int rotate_capture(struct capture *c)
+{
+#define BUFFER 32
+  char stamp[BUFFER];
+  char *name;
+  unsigned int len, i;
+  int result;
+
+  result = close_capture(c);
+
+  strftime(stamp, BUFFER - 1, "%Y%m%dT%H%M%S", localtime(&(c->c_opened)));
+  stamp[BUFFER - 1] = '\0';
+
+  len = strlen(c->c_path) + BUFFER + 16;
+  name = malloc(len);
+  if(name == NULL){
+    return -1;
+  }
+
+  snprintf(name, len, "%s.%s", c->c_path, stamp);
+  for(i = 1; (access(name, F_OK) == 0) && (i < 1000); i++){
+    snprintf(name, len, "%s.%s-%u", c->c_path, stamp, i);
+  }
+
+  if(rename(c->c_path, name) < 0){
+    result = (-1);
+  }
+
+  free(name);
+
+  if(open_capture(c) < 0){
+    return -1;
+  }
+
+  return result;
+#undef BUFFER
+}
+
+static int due_capture(struct capture *c, time_t now)
+{
+  if((c->c_size > 0) && (c->c_written >= c->c_size)){
+    return 1;
+  }
+
+  if((c->c_period > 0) && ((now - c->c_opened) >= c->c_period)){
+    return 1;
+  }
+
+  return 0;
+}
+
+static unsigned long long parse_stamp(char *string)
+{
+  unsigned long long value;
+  unsigned int i;
+  char *end;
+
+  if(string == NULL){
+    return 0;
+  }
+
+  value = strtoull(string, &end, 10) * 1000;
+  if(end[0] == '.'){
+    end++;
+    for(i = 100; (i > 0) && (end[0] >= '0') && (end[0] <= '9'); i /= 10){
+      value += (end[0] - '0') * i;
+      end++;
+    }
+  }
+
+  return value;
+}
+
+static int record_binary(struct capture *c, struct katcl_parse *p)
+{
+#define HEADER 14
+  unsigned char header[HEADER];
+  unsigned long long stamp;
+  char *ptr, *module, *text;
+  unsigned int mlen, tlen, total, i;
+  int code;
+
+  ptr = get_string_parse_katcl(p, 0);
+  if((ptr == NULL) || strcmp(ptr, KATCP_LOG_INFORM)){
+    return 0;
+  }
+
+  code = log_to_code_katcl(get_string_parse_katcl(p, 1));
+  stamp = parse_stamp(get_string_parse_katcl(p, 2));
+
+  module = get_string_parse_katcl(p, 3);
+  mlen = module ? get_buffer_parse_katcl(p, 3, NULL, 0) : 0;
+  if(mlen > 255){
+    mlen = 255;
+  }
+
+  text = get_string_parse_katcl(p, 4);
+  tlen = text ? get_buffer_parse_katcl(p, 4, NULL, 0) : 0;
+
+  total = HEADER - 4 + mlen + tlen;
+
+  for(i = 0; i < 4; i++){
+    header[i] = (total >> (8 * (3 - i))) & 0xff;
+  }
+  for(i = 0; i < 8; i++){
+    header[4 + i] = (stamp >> (8 * (7 - i))) & 0xff;
+  }
+  header[12] = (code < 0) ? 0xff : code;
+  header[13] = mlen;
+
+  if(append_capture(c, (char *)header, HEADER) < 0){
+    return -1;
+  }
+  if(mlen && (append_capture(c, module, mlen) < 0)){
+    return -1;
+  }
+  if(tlen && (append_capture(c, text, tlen) < 0)){
+    return -1;
+  }
+
+  return 0;
+#undef HEADER
+}
+
+static int record_capture(struct capture *c, struct katcl_parse *p)
+{
+  char *wire;
+  int len;
+
+  if(c->c_format == CAPTURE_BINARY){
+    return record_binary(c, p);
+  }
+
+  len = wire_parse_katcl(p, &wire);
+  if(len <= 0){
+    return 0;
+  }
+
+  return append_capture(c, wire, len);
+}
+
+/* put a message of our own into the capture, like the plain mode writes to its output */
+
+static int note_capture(struct capture *c, int level, char *fmt, ...)
+{
+#define BUFFER 256
+  char text[BUFFER], stamp[BUFFER];
+  struct katcl_parse *p;
+  struct timeval tv;
+  va_list args;
+  int result;
+
+  va_start(args, fmt);
+  vsnprintf(text, BUFFER, fmt, args);
+  va_end(args);
+  text[BUFFER - 1] = '\0';
+
+  gettimeofday(&tv, NULL);
+  snprintf(stamp, BUFFER, "%lu.%03lu", (unsigned long) tv.tv_sec, (unsigned long) tv.tv_usec / 1000);
+
+  p = create_parse_katcl();
+  if(p == NULL){
+    return -1;
+  }
+
+  add_string_parse_katcl(p, KATCP_FLAG_FIRST, KATCP_LOG_INFORM);
+  add_string_parse_katcl(p, 0, log_to_string_katcl(level));
+  add_string_parse_katcl(p, 0, stamp);
+  add_string_parse_katcl(p, 0, NAME);
+  add_string_parse_katcl(p, KATCP_FLAG_LAST, text);
+
+  result = record_capture(c, p);
+
+  destroy_parse_katcl(p);
+
+  return result;
+#undef BUFFER
+}
+
 int main(int argc, char **argv)
 {
 #define BUFFER 64
   char buffer[BUFFER];
   char *level, *app, *server, *output;
-  int run, fd, i, j, c, verbose, attempts, detach, result, truncate, flags;
+  char **modules;
+  int run, fd, i, j, c, verbose, attempts, detach, result, truncate, flags, threshold, capture;
+  unsigned int count;
   struct katcl_parse *p;
   struct katcl_line *ls, *lo;
+  struct capture cx;
   struct sigaction sa;
+  struct timeval tv;
+  fd_set fsr;
   time_t now;
   struct tm *local;
 
@@ -97,6 +584,25 @@ int main(int argc, char **argv)
   output = NULL;
   level = NULL;
 
+  modules = NULL;
+  count = 0;
+  threshold = KATCP_LEVEL_TRACE;
+
+  capture = 0;
+  cx.c_path = NULL;
+  cx.c_flags = 0;
+  cx.c_fd = (-1);
+  cx.c_child = 0;
+  cx.c_format = CAPTURE_RAW;
+  cx.c_compress = 0;
+  cx.c_size = 0;
+  cx.c_period = 0;
+  cx.c_written = 0;
+  cx.c_opened = 0;
+  cx.c_flushed = 0;
+  cx.c_buffer = NULL;
+  cx.c_have = 0;
+
   flags = 0; /* placate -Wall */
 
   while (i < argc) {
@@ -133,10 +639,30 @@ int main(int argc, char **argv)
           j++;
           break;
 
+        case 'c' : 
+          capture = 1;
+          j++;
+          break;
+
+        case 'b' : 
+          capture = 1;
+          cx.c_format = CAPTURE_BINARY;
+          j++;
+          break;
+
+        case 'z' : 
+          capture = 1;
+          cx.c_compress = 1;
+          j++;
+          break;
+
         case 'l' :
         case 'o' :
         case 'a' :
         case 's' :
+        case 'm' :
+        case 'r' :
+        case 'p' :
 
           j++;
           if (argv[i][j] == '\0') {
@@ -161,6 +687,20 @@ int main(int argc, char **argv)
             case 's' : 
               server = argv[i] + j;
               break;
+            case 'm' : 
+              if(add_modules(&modules, &count, argv[i] + j) < 0){
+                fprintf(stderr, "%s: unable to allocate module filter\n", app);
+                return EX_OSERR;
+              }
+              break;
+            case 'r' : 
+              capture = 1;
+              cx.c_size = parse_size(argv[i] + j);
+              break;
+            case 'p' : 
+              capture = 1;
+              cx.c_period = atoi(argv[i] + j);
+              break;
           }
 
           i++;
@@ -217,6 +757,12 @@ int main(int argc, char **argv)
       fprintf(stderr, "%s: usage: invalid initial log priority %s\n", app, level);
       return EX_USAGE;
     } 
+    threshold = log_level;
+  }
+
+  if(capture && (output == NULL)){
+    fprintf(stderr, "%s: usage: capture mode needs a logfile\n", app);
+    return EX_USAGE;
   }
 
   if(output == NULL){
@@ -225,6 +771,25 @@ int main(int argc, char **argv)
       return EX_USAGE;
     }
     fd = STDOUT_FILENO;
+  } else if(capture){
+    cx.c_path = output;
+    cx.c_flags = O_CREAT | O_WRONLY | (truncate ? O_TRUNC : O_APPEND);
+    cx.c_buffer = malloc(CAPTURE_BUFFER);
+    if(cx.c_buffer == NULL){
+      fprintf(stderr, "%s: unable to allocate capture buffer\n", app);
+      return EX_OSERR;
+    }
+    if(cx.c_compress){
+      /* a compressor which dies should show up as a write error */
+      signal(SIGPIPE, SIG_IGN);
+    }
+    if(open_capture(&cx) < 0){
+      fprintf(stderr, "%s: unable to open file %s: %s\n", app, output, strerror(errno));
+      return EX_OSERR;
+    }
+    /* our own complaints go to stderr, the capture only holds messages */
+    fd = STDERR_FILENO;
+    flags = cx.c_flags & (~O_TRUNC);
   } else {
     flags = O_CREAT | O_WRONLY;
     if(truncate == 0){
@@ -269,12 +834,22 @@ int main(int argc, char **argv)
   local = localtime(&now);
   strftime(buffer, BUFFER - 1, "%Y-%m-%dT%H:%M:%S", local);
 
-  sync_message_katcl(lo, KATCP_LEVEL_INFO, NAME, "monitor start for %s at %s", server, buffer);
+  if(capture){
+    note_capture(&cx, KATCP_LEVEL_INFO, "monitor start for %s at %s", server, buffer);
+  } else {
+    sync_message_katcl(lo, KATCP_LEVEL_INFO, NAME, "monitor start for %s at %s", server, buffer);
+  }
 
   for(run = 1; run > 0;){
 
     if(log_reload > 0){
-      if(output){
+      if(capture){
+        cx.c_flags &= (~O_TRUNC);
+        if((close_capture(&cx) < 0) || (open_capture(&cx) < 0)){
+          sync_message_katcl(lo, KATCP_LEVEL_FATAL, NAME, "unable to reopen %s: %s", output, strerror(errno));
+          return EX_OSERR;
+        }
+      } else if(output){
         fd = open(output, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
         if(fd >= 0){
           exchange_katcl(lo, fd);
@@ -300,7 +875,11 @@ int main(int argc, char **argv)
 #endif
           add_string_parse_katcl(p, KATCP_FLAG_STRING | KATCP_FLAG_LAST, level);
 
-          append_parse_katcl(lo, p);
+          if(capture){
+            record_capture(&cx, p);
+          } else {
+            append_parse_katcl(lo, p);
+          }
 
           /* dodgy refcount dealings: p is created with refcount = 0, so can only do write at end, otherwise may end up being deallocated */
 
@@ -312,9 +891,65 @@ int main(int argc, char **argv)
         sync_message_katcl(lo, KATCP_LEVEL_ERROR, NAME, "invalid log priority number %d", level);
       }
 
+      threshold = log_level;
       log_changed = 0;
     }
 
+    if(capture){
+      /* wake up periodically to flush and rotate, even if there is no traffic */
+      FD_ZERO(&fsr);
+      FD_SET(fileno_katcl(ls), &fsr);
+
+      tv.tv_sec = CAPTURE_FLUSH;
+      tv.tv_usec = 0;
+
+      result = select(fileno_katcl(ls) + 1, &fsr, NULL, NULL, &tv);
+      if(result < 0){
+        if(errno == EINTR){
+          continue;
+        }
+        sync_message_katcl(lo, KATCP_LEVEL_FATAL, NAME, "select failed: %s", strerror(errno));
+        return EX_OSERR;
+      }
+
+      if(result > 0){
+        result = read_katcl(ls);
+        if(result < 0){
+          sync_message_katcl(lo, KATCP_LEVEL_FATAL, NAME, "read from network failed: %s", strerror(errno));
+          return EX_OSERR;
+        }
+        if(result == 1){
+          run = 0;
+        }
+      }
+
+      while(have_katcl(ls)){
+        p = ready_katcl(ls);
+        if(p && keep_message(p, threshold, modules, count)){
+          if(record_capture(&cx, p) < 0){
+            sync_message_katcl(lo, KATCP_LEVEL_FATAL, NAME, "unable to write to %s: %s", output, strerror(errno));
+            return EX_OSERR;
+          }
+        }
+      }
+
+      time(&now);
+
+      if(due_capture(&cx, now)){
+        if(rotate_capture(&cx) < 0){
+          sync_message_katcl(lo, KATCP_LEVEL_FATAL, NAME, "unable to rotate %s: %s", output, strerror(errno));
+          return EX_OSERR;
+        }
+      } else if((now - cx.c_flushed) >= CAPTURE_FLUSH){
+        if(flush_capture(&cx) < 0){
+          sync_message_katcl(lo, KATCP_LEVEL_FATAL, NAME, "unable to write to %s: %s", output, strerror(errno));
+          return EX_OSERR;
+        }
+      }
+
+      continue;
+    }
+
     result = read_katcl(ls);
     if(result < 0){
       sync_message_katcl(lo, KATCP_LEVEL_FATAL, NAME, "read from network failed: %s", strerror(errno));
@@ -327,7 +962,7 @@ int main(int argc, char **argv)
 
     while(have_katcl(ls)){
       p = ready_katcl(ls);
-      if(p){
+      if(p && keep_message(p, threshold, modules, count)){
         append_parse_katcl(lo, p);
       }
     }
@@ -335,6 +970,13 @@ int main(int argc, char **argv)
     write_katcl(lo);
   }
 
+  if(capture){
+    if(close_capture(&cx) < 0){
+      sync_message_katcl(lo, KATCP_LEVEL_ERROR, NAME, "unable to complete %s: %s", output, strerror(errno));
+      return EX_OSERR;
+    }
+  }
+
   return EX_OK;
 #undef BUFFER
 }
@@ -126,67 +126,141 @@ int replace_value_config_setting_mod(struct config_setting *cs, char *setting)
 
 int parse_csv_mod(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_tobject *o);
 
-int store_config_setting_mod(struct katcp_dispatch *d, char *setting, char *value)
+/* settings are loaded straight out of the mapped file: fields are
+ * views into it, only copied into the arena when whitespace has to
+ * be squeezed out, and each line goes into the dbase as one ?set */
+
+struct config_view_mod {
+  char *v_ptr;
+  int v_len;
+};
+
+struct config_load_mod {
+  char *l_arena;
+  int l_size;
+  int l_used;
+
+  struct config_view_mod *l_fields;
+  int l_count;
+  int l_max;
+};
+
+static int reserve_config_load_mod(struct config_load_mod *l, int len)
 {
-  struct katcp_stack *stack, *stack2;
-  struct katcl_parse *p;
-  char *val;
-  int err;
+  char *tmp;
 
-  stack = create_stack_katcp();
-  if (stack == NULL)
-    return -1;
+  l->l_used = 0;
+
+  if (len <= l->l_size)
+    return 0;
 
-  stack2 = create_stack_katcp();
-  if (stack2 == NULL){
-    destroy_stack_katcp(stack);
+  tmp = realloc(l->l_arena, sizeof(char) * len);
+  if (tmp == NULL)
     return -1;
+
+  l->l_arena = tmp;
+  l->l_size = len;
+
+  return 0;
+}
+
+static int is_whitespace_mod(char c)
+{
+  switch(c){
+    case 0x09:
+    case 0x0a:
+    case 0x0b:
+    case 0x0c:
+    case 0x0d:
+    case 0x20:
+      return 1;
+  }
+  return 0;
+}
+
+/* all whitespace goes, not only at the ends, the same as before */
+static void strip_view_mod(struct config_load_mod *l, struct config_view_mod *v)
+{
+  char *dst;
+  int i, len;
+
+  for (i = 0; i < v->v_len && !is_whitespace_mod(v->v_ptr[i]); i++);
+  if (i >= v->v_len)
+    return;
+
+  /* the arena was reserved for the whole line, so this can't overflow */
+  dst = l->l_arena + l->l_used;
+  memcpy(dst, v->v_ptr, i);
+  len = i;
+  for (; i < v->v_len; i++){
+    if (!is_whitespace_mod(v->v_ptr[i]))
+      dst[len++] = v->v_ptr[i];
+  }
+
+  l->l_used += len;
+  v->v_ptr = dst;
+  v->v_len = len;
+}
+
+static int split_fields_mod(struct config_load_mod *l, struct config_view_mod *value)
+{
+  struct config_view_mod *tmp;
+  int i, pos;
+
+  l->l_count = 0;
+  pos = 0;
+
+  for (i = 0; i <= value->v_len; i++){
+    if (i < value->v_len && value->v_ptr[i] != VALUE)
+      continue;
+
+    if (l->l_count >= l->l_max){
+      tmp = realloc(l->l_fields, sizeof(struct config_view_mod) * (l->l_max + 16));
+      if (tmp == NULL)
+        return -1;
+      l->l_fields = tmp;
+      l->l_max += 16;
+    }
+
+    l->l_fields[l->l_count].v_ptr = value->v_ptr + pos;
+    l->l_fields[l->l_count].v_len = i - pos;
+    l->l_count++;
+
+    pos = i + 1;
   }
 
+  return l->l_count;
+}
+
+int store_config_setting_mod(struct katcp_dispatch *d, struct config_load_mod *l, struct config_view_mod *setting, struct config_view_mod *value)
+{
+  struct katcl_parse *p;
+  int err, i;
+
+  if (split_fields_mod(l, value) < 0)
+    return -1;
+
   p = create_parse_katcl();
   if (p == NULL){
 #ifdef DEBUG
     fprintf(stderr,"mod: could not create parse\n");
 #endif
-    destroy_stack_katcp(stack);
-    destroy_stack_katcp(stack2);
     return -1;
   }
-  
-  if (push_named_stack_katcp(d, stack, value, KATCP_TYPE_STRING) < 0){
-#ifdef DEBUG
-    fprintf(stderr,"mod: store config cannot push_named_stack\n");
-#endif
-    destroy_stack_katcp(stack);
-    destroy_stack_katcp(stack2);
-    destroy_parse_katcl(p);
-    return -1;
-  } 
 
-  if (parse_csv_mod(d, stack, NULL) < 0){
-#ifdef DEBUG
-    fprintf(stderr,"mod: store config cannot parse_csv\n");
-#endif
-    destroy_stack_katcp(stack);
-    destroy_stack_katcp(stack2);
-    destroy_parse_katcl(p);
-    return -1;
-  }
- 
-  /*setting and values*/
+  /* values in the order the old stack based code produced, last first */
   err  = add_string_parse_katcl(p, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, KATCP_SET_REQUEST);
-  err += add_string_parse_katcl(p, KATCP_FLAG_STRING, setting);
-  while ((val = pop_data_expecting_stack_katcp(d, stack, KATCP_TYPE_STRING)) != NULL) {
-    err += add_string_parse_katcl(p, KATCP_FLAG_STRING, val);  
-    push_named_stack_katcp(d, stack2, val, KATCP_TYPE_STRING);
+  err += add_counted_parse_katcl(p, KATCP_FLAG_STRING, setting->v_ptr, setting->v_len);
+  for (i = l->l_count - 1; i >= 0; i--){
+    err += add_counted_parse_katcl(p, KATCP_FLAG_STRING, l->l_fields[i].v_ptr, l->l_fields[i].v_len);
   }
 
   err += add_string_parse_katcl(p, KATCP_FLAG_STRING, "tags");
 
   /*all as tags*/
-  err += add_string_parse_katcl(p, KATCP_FLAG_STRING, setting);
-  while ((val = pop_data_expecting_stack_katcp(d, stack2, KATCP_TYPE_STRING)) != NULL) {
-    err += add_string_parse_katcl(p, KATCP_FLAG_STRING, val);  
+  err += add_counted_parse_katcl(p, KATCP_FLAG_STRING, setting->v_ptr, setting->v_len);
+  for (i = 0; i < l->l_count; i++){
+    err += add_counted_parse_katcl(p, KATCP_FLAG_STRING, l->l_fields[i].v_ptr, l->l_fields[i].v_len);
   }
 
   err += finalize_parse_katcl(p);
@@ -195,8 +269,6 @@ int store_config_setting_mod(struct katcp_dispatch *d, char *setting, char *valu
 #ifdef DEBUG
     fprintf(stderr, "mod: error building parse\n");
 #endif
-    destroy_stack_katcp(stack);
-    destroy_stack_katcp(stack2);
     destroy_parse_katcl(p);
     return -1;
   }
@@ -206,73 +278,20 @@ int store_config_setting_mod(struct katcp_dispatch *d, char *setting, char *valu
     fprintf(stderr, "mod: cannot set_dbase_katcp\n");
 #endif
     destroy_parse_katcl(p); 
-    destroy_stack_katcp(stack);
-    destroy_stack_katcp(stack2);
     return -1;
   }
 
   destroy_parse_katcl(p); 
-  destroy_stack_katcp(stack);
-  destroy_stack_katcp(stack2);
-
-
-#if 0
-  if (store_kv_dbase_katcp(d, setting, NULL, stack, NULL) < 0){
-#ifdef DEBUG
-    fprintf(stderr,"mod: store config cannot store_kv_dbase\n");
-#endif
-    destroy_stack_katcp(stack);
-    return -1;
-  }
-#endif
 
   return 0;
 }
 
-char *rm_whitespace_mod(char *str)
-{
-  int i,len,pos;
-  char *buf;
-
-  if (str == NULL){
-#ifdef DEBUG
-    fprintf(stderr,"Cannot remove whitespace from NULL string\n");
-#endif
-    return NULL;
-  }
-
-  len = strlen(str);
-  buf = malloc(sizeof(char) * (len+1));
-
-  if (buf == NULL)
-    return NULL;
-
-  pos = 0;
-
-  for (i=0;i<len;i++){
-    switch(str[i]){
-      case 0x09:
-      case 0x0a:
-      case 0x0b:
-      case 0x0c:
-      case 0x0d:
-      case 0x20:
-        break;
-      default:
-        buf[pos++] = str[i];
-        break;
-    }
-  }
-  buf[pos] = '\0';
-  free(str);
-
-  return buf;
-}
-
 int start_config_parser_mod(struct katcp_dispatch *d, char *file)
 {
-  char *buffer, c, *setting, *value;
-  int fd, i, pos, state, rcount, run;
+  struct config_load_mod load;
+  struct config_view_mod setting, value;
+  char *buffer, *line, *end, *ptr;
+  int fd, rcount, result, stored;
   struct stat file_stats;
   off_t fsize;
   
@@ -296,6 +315,10 @@ int start_config_parser_mod(struct katcp_dispatch *d, char *file)
   }
     
   fsize = file_stats.st_size;
+  if (fsize == 0){
+    close(fd);
+    return 0;
+  }
 
   buffer = mmap(NULL, fsize, PROT_READ, MAP_SHARED, fd, 0);
 
@@ -306,119 +329,82 @@ int start_config_parser_mod(struct katcp_dispatch *d, char *file)
     close(fd);
     return -1;
   }
-  
-  state   = S_WHITESPACE;
-  pos     = 0;
-  setting = NULL;
-  value   = NULL;
-  rcount  = 0;
-  run     = 1;
+
+  madvise(buffer, fsize, MADV_SEQUENTIAL);
+
+  load.l_arena  = NULL;
+  load.l_size   = 0;
+  load.l_used   = 0;
+  load.l_fields = NULL;
+  load.l_count  = 0;
+  load.l_max    = 0;
+
+  rcount = 0;
+  stored = 0;
+  result = 0;
 
 #ifdef DEBUG
   fprintf(stderr, "mod_config_parser: about to start parsing file: %s\n", file);
 #endif
 
-  for (i=0; i<fsize && run; i++){
-    c = buffer[i];
+  for (line = buffer; line < buffer + fsize; line = end + 1){
+    rcount++;
 
-    switch(state){
-      
-      case S_WHITESPACE:
-        switch (c){
-          case COMMENT:
-          case OLABEL:
-          case CLABEL:
-            state = S_COMMENT;
-            break;
-          case CR:
-          case LF:
-            state = S_WHITESPACE;
-            pos = i;
-            rcount++;
-            break;
-          case SETTING:
-            state = S_SETTING;
-            break;
-        }
-        break;
+    end = line;
+    while (end < buffer + fsize && *end != CR && *end != LF)
+      end++;
 
-      case S_COMMENT:
-        switch (c){
-          case CR:
-          case LF:
-            state = S_WHITESPACE;
-            pos = i;
-            rcount++;
-            break;
-        }
+    /* a label or comment before the = makes the line a comment */
+    for (ptr = line; ptr < end; ptr++){
+      if (*ptr == SETTING || *ptr == COMMENT || *ptr == OLABEL || *ptr == CLABEL)
         break;
+    }
+    if (ptr >= end || *ptr != SETTING)
+      continue;
+
+    if (reserve_config_load_mod(&load, end - line) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "config parser cannot allocate space for line %d", rcount);
+      result = -1;
+      break;
+    }
+
+    setting.v_ptr = line;
+    setting.v_len = ptr - line;
+    value.v_ptr   = ptr + 1;
+    value.v_len   = end - (ptr + 1);
+
+    strip_view_mod(&load, &setting);
+    strip_view_mod(&load, &value);
 
-      case S_SETTING:
-        if (setting != NULL){
-          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "config parser cannot parse malformed config around line[%d,%d]", rcount, i-(i/rcount));
-          run = 0;
-        }
-        setting = strndup(buffer + pos, i - pos - 2);
-        setting = rm_whitespace_mod(setting);
-#ifdef DEBUG
-        fprintf(stderr, "%d: SETTING: {%s} ", rcount, setting);  
-#endif
-        state = S_VALUE;
-        pos = i;
-        break;
-      
-      case S_VALUE:
-        switch(c) {
-          case CR:
-          case LF:
-            if (value != NULL){
-              log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "config parser cannot parse malformed config around line[%d,%d]", rcount, i-(i/rcount));
-              run = 0;
-            }
-            value = strndup(buffer + pos, i - pos);
-            value = rm_whitespace_mod(value);
 #ifdef DEBUG
-            fprintf(stderr, "\tVALUE: {%s}\n", value);  
+    fprintf(stderr, "%d: SETTING: {%.*s}\tVALUE: {%.*s}\n", rcount, setting.v_len, setting.v_ptr, value.v_len, value.v_ptr);
 #endif
-#if 1 
-            if (store_config_setting_mod(d, setting, value) < 0){
-              log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "config parser cannot store data ending");
+
+    if (store_config_setting_mod(d, &load, &setting, &value) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "config parser cannot store data ending at line %d", rcount);
 #ifdef DEBUG
-              fprintf(stderr, "mod_config_parser: cannot store data!!\n");
+      fprintf(stderr, "mod_config_parser: cannot store data!!\n");
 #endif
-              run = 0;
-            }
-#endif
-
-            free(value);
-            value = NULL;
-            free(setting);
-            setting = NULL;
-            state = S_WHITESPACE;
-            pos = i;
-            rcount++;
-            break;
-        }
-        break;
-
+      result = -1;
+      break;
     }
-  
+    stored++;
   }
-  
-  if (setting != NULL)
-    free(setting);
 
-  if (value != NULL)
-    free(value);
+  if (load.l_arena != NULL)
+    free(load.l_arena);
+
+  if (load.l_fields != NULL)
+    free(load.l_fields);
 
   munmap(buffer, fsize);
   close(fd);
 
 #ifdef DEBUG
-  fprintf(stderr, "mod_config_parser: done!\n");
+  fprintf(stderr, "mod_config_parser: done, %d settings from %d lines!\n", stored, rcount);
 #endif
 
-  return 0;
+  return result;
 }
 
 int config_parser_mod(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_tobject *o)
@@ -38,23 +38,32 @@ int init_mod(struct katcp_dispatch *d)
 
 #define MEDIAMAN_OPERATION_SUBPROCESS "subprocess"
 #define MEDIAMAN_OPERATION_SEARCH     "search"
+#define MEDIAMAN_OPERATION_SEARCH_ALL "search_all"
 #define MEDIAMAN_TYPE_MEDIA_ITEM      "media_item"
 #define MEDIAMAN_TYPE_MEDIA_TAG       "media_tag"
 #define MEDIAMAN_TYPE_SEARCH_TERMS    "search_terms"
 
+#define MEDIAMAN_SEARCH_TOPK          32
+
 struct media_item {
+  unsigned long mi_id;
   char *mi_key;
   char *mi_path;
   struct media_tag **mi_tag;
   int mi_tag_count;
 };
 
+/* each tag is an inverted index entry: its items are kept sorted by
+ * mi_id so that searches can merge several tags in one pass */
 struct media_tag {
   char *mt_key;
   struct media_item **mt_item;
   int mt_item_count;
+  int mt_item_size;
 };
 
+static unsigned long media_item_ids_mm = 0;
+
 //void print_media_item_mm(struct katcp_dispatch *d, void *data);
 
 void print_media_tag_mm(struct katcp_dispatch *d, void *data)
@@ -110,6 +119,7 @@ void *parse_media_tag_mm(struct katcp_dispatch *d, char **str)
   }
   mt->mt_item = NULL;
   mt->mt_item_count = 0;
+  mt->mt_item_size = 0;
 
   return mt;
 }
@@ -194,22 +204,51 @@ struct media_tag *get_named_media_tag_mm(struct katcp_dispatch *d, char *tagname
   return mt;
 }
 
+static int find_posting_mm(struct media_tag *mt, unsigned long id)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = mt->mt_item_count;
+
+  while (lo < hi){
+    mid = lo + (hi - lo) / 2;
+    if (mt->mt_item[mid]->mi_id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
 int add_media_item_media_tag_mm(struct katcp_dispatch *d, struct media_tag *mt, struct media_item *mi)
 {
-  int i;
+  struct media_item **tmp;
+  int pos, size;
 
   if (mt == NULL || mi == NULL)
     return -1;
 
-/*should replace with a bsearch / qsort*/
-  for(i=0; i<mt->mt_item_count; i++){
-    if (mt->mt_item[i] == mi){
+  pos = find_posting_mm(mt, mi->mi_id);
+  if (pos < mt->mt_item_count && mt->mt_item[pos] == mi){
+    return -1;
+  }
+
+  if (mt->mt_item_count >= mt->mt_item_size){
+    size = (mt->mt_item_size > 0) ? (mt->mt_item_size * 2) : 8;
+    tmp = realloc(mt->mt_item, sizeof(struct media_item *) * size);
+    if (tmp == NULL)
       return -1;
-    }
+    mt->mt_item = tmp;
+    mt->mt_item_size = size;
   }
 
-  mt->mt_item = realloc(mt->mt_item, sizeof(struct media_item *) * (mt->mt_item_count+1));
-  mt->mt_item[mt->mt_item_count] = mi;
+  /* new items get the largest id, so this is almost always an append */
+  if (pos < mt->mt_item_count){
+    memmove(&(mt->mt_item[pos + 1]), &(mt->mt_item[pos]), sizeof(struct media_item *) * (mt->mt_item_count - pos));
+  }
+  mt->mt_item[pos] = mi;
   mt->mt_item_count++;
 
   return 0;
@@ -263,6 +302,9 @@ void *parse_media_item_mm(struct katcp_dispatch *d, char **str)
   if (mi == NULL)
     return NULL;
   
+  mi->mi_id = ++media_item_ids_mm;
+  mi->mi_key = NULL;
+  mi->mi_path = NULL;
   mi->mi_tag = NULL;
   mi->mi_tag_count = 0;
 
@@ -491,76 +533,112 @@ struct result_item {
   int r_weight;
 };
 
-int compare_result_items_mm(const void *m1, const void *m2)
+struct posting_cursor {
+  struct media_tag *c_tag;
+  int c_pos;
+};
+
+#define cursor_id_mm(c) ((c)->c_tag->mt_item[(c)->c_pos]->mi_id)
+
+static void sift_cursors_mm(struct posting_cursor *heap, int count, int i)
 {
-  const struct result_item *a, *b;
-  a = m1;
-  b = m2;
-#ifdef DEBUG
-  fprintf(stderr, "MEDIAMAN compare %s & %s\n", a->r_mi->mi_key, b->r_mi->mi_key);
-#endif
-  return strcmp(a->r_mi->mi_key, b->r_mi->mi_key);
+  struct posting_cursor tmp;
+  int child;
+
+  for (;;){
+    child = (2 * i) + 1;
+    if (child >= count)
+      return;
+    if (child + 1 < count && cursor_id_mm(&heap[child + 1]) < cursor_id_mm(&heap[child]))
+      child++;
+    if (cursor_id_mm(&heap[i]) <= cursor_id_mm(&heap[child]))
+      return;
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
+  }
 }
 
-int add_item_results_mm(struct katcp_dispatch *d, struct result_item **r, int count, struct media_item *mi)
+/* < 0 if a ranks below b: fewer matching tags, or catalogued later */
+static int rank_result_items_mm(const struct result_item *a, const struct result_item *b)
 {
-  struct result_item key, *check, *results;
+  if (a->r_weight != b->r_weight)
+    return a->r_weight - b->r_weight;
 
-  if (r == NULL || mi == NULL)
-    return -1;
-  
-  results = *r;
+  if (a->r_mi->mi_id != b->r_mi->mi_id)
+    return (a->r_mi->mi_id > b->r_mi->mi_id) ? -1 : 1;
+
+  return 0;
+}
 
-  key.r_mi = mi;
-  key.r_weight = 1;
+int compare_result_items_mm(const void *m1, const void *m2)
+{
+  return rank_result_items_mm(m2, m1);
+}
 
-#ifdef DEBUG
-  fprintf(stderr, "MEDIAMAN: about to bsearch\n");
-#endif
-  
-  check = bsearch(&key, results, count, sizeof(struct result_item), &compare_result_items_mm);
-  if (check != NULL){
-#ifdef DEBUG
-    fprintf(stderr, "MEDIAMAN: found item ++weight\n");
-#endif
-    check->r_weight++;
-    return count;
+static void sift_results_mm(struct result_item *heap, int count, int i)
+{
+  struct result_item tmp;
+  int child;
+
+  for (;;){
+    child = (2 * i) + 1;
+    if (child >= count)
+      return;
+    if (child + 1 < count && rank_result_items_mm(&heap[child + 1], &heap[child]) < 0)
+      child++;
+    if (rank_result_items_mm(&heap[i], &heap[child]) <= 0)
+      return;
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
+    i = child;
   }
-  
-  results = realloc(results, sizeof(struct result_item)*(count+1));
-  if (results == NULL)
-    return -1;
-  
-  results[count].r_mi = key.r_mi;
-  results[count].r_weight = key.r_weight;
+}
 
-  count++;
+/* keeps the best MEDIAMAN_SEARCH_TOPK results in a heap, weakest at the root */
+int add_item_results_mm(struct result_item *heap, int count, struct media_item *mi, int weight)
+{
+  struct result_item r;
+  int i, parent;
+
+  r.r_mi = mi;
+  r.r_weight = weight;
+
+  if (count < MEDIAMAN_SEARCH_TOPK){
+    i = count++;
+    heap[i] = r;
+    while (i > 0){
+      parent = (i - 1) / 2;
+      if (rank_result_items_mm(&heap[parent], &heap[i]) <= 0)
+        break;
+      heap[i] = heap[parent];
+      heap[parent] = r;
+      i = parent;
+    }
+    return count;
+  }
 
-#ifdef DEBUG
-  fprintf(stderr, "MEDIAMAN: about to qsort\n");
-#endif
-  qsort(results, count, sizeof(struct result_item), &compare_result_items_mm);
+  if (rank_result_items_mm(&r, &heap[0]) > 0){
+    heap[0] = r;
+    sift_results_mm(heap, count, 0);
+  }
 
-  *r = results;
   return count;
 }
-void destroy_result_items_mm(void *data)
-{
-  struct result_item *r;
-  r = data;
-  if (r != NULL)
-    free(r);
-}
 
-int search_mm(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_tobject *o)
+/* k-way merge over the posting lists of the search terms: an item
+ * surfaces once for each tag holding it, which is its weight. With
+ * all set only items carrying every tag are reported */
+static int run_search_mm(struct katcp_dispatch *d, struct katcp_stack *stack, int all)
 {
-  struct result_item *results, r;
+  struct result_item results[MEDIAMAN_SEARCH_TOPK];
+  struct posting_cursor *heap;
   struct media_tag *mt;
+  struct media_item *mi;
   char **tags;
-  int i, j, count;
-
-  results = NULL;
-  count = 0;
+  int i, terms, live, count, weight, exhausted;
 
 #ifdef DEBUG
   fprintf(stderr, "MEDIAMAN: runing SEARCH\n");
@@ -569,45 +647,87 @@ int search_mm(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_
   tags = pop_data_expecting_stack_katcp(d, stack, MEDIAMAN_TYPE_SEARCH_TERMS);
   if (tags == NULL)
     return -1;
-  
-  for (i=0; tags[i] != NULL; i++) {
-    mt = get_named_media_tag_mm(d, tags[i]);
-    if (mt != NULL){
-#ifdef DEBUG
-      fprintf(stderr, "MEDIAMAN SEARCH: got <%s>\n", mt->mt_key);
-#endif
-      for (j=0; j<mt->mt_item_count; j++){
-        count = add_item_results_mm(d, &results, count, mt->mt_item[j]);
-        if (count < 0){
-#ifdef DEBUG
-          fprintf(stderr, "MEDIAMAN: fatal error adding to item results\n"); 
-#endif
-          destroy_result_items_mm(results);
-          return -1;
-        }
-      }
-#if 0
-      if (push_named_stack_katcp(d, stack, mt, MEDIAMAN_TYPE_MEDIA_TAG) < 0){
+
+  for (terms = 0; tags[terms] != NULL; terms++);
+  if (terms == 0)
+    return 0;
+
+  heap = malloc(sizeof(struct posting_cursor) * terms);
+  if (heap == NULL)
+    return -1;
+
+  live = 0;
+  for (i = 0; i < terms; i++) {
+    /* only a lookup, searching for a tag shouldn't create it */
+    mt = get_key_data_type_katcp(d, MEDIAMAN_TYPE_MEDIA_TAG, tags[i]);
+    if (mt != NULL && mt->mt_item_count > 0){
 #ifdef DEBUG
-        fprintf(stderr, "MEDIAMAN: seach failed to push media tag onto stack\n");
-#endif
-        return -1;
+      fprintf(stderr, "MEDIAMAN SEARCH: got <%s> with %d items\n", mt->mt_key, mt->mt_item_count);
+#endif
+      heap[live].c_tag = mt;
+      heap[live].c_pos = 0;
+      live++;
+    } else if (all){
+      live = 0;
+      break;
+    }
+  }
+
+  for (i = (live / 2) - 1; i >= 0; i--){
+    sift_cursors_mm(heap, live, i);
+  }
+
+  count = 0;
+
+  while (live > 0){
+    mi = heap[0].c_tag->mt_item[heap[0].c_pos];
+    weight = 0;
+    exhausted = 0;
+
+    while (live > 0 && cursor_id_mm(&heap[0]) == mi->mi_id){
+      weight++;
+      heap[0].c_pos++;
+      if (heap[0].c_pos >= heap[0].c_tag->mt_item_count){
+        heap[0] = heap[--live];
+        exhausted = 1;
       }
-#endif
+      sift_cursors_mm(heap, live, 0);
+    }
+
+    if (!all || weight == terms){
+      count = add_item_results_mm(results, count, mi, weight);
+    }
+
+    if (all && exhausted){
+      /* nothing further can carry the tag which ran out */
+      break;
     }
   }
+
+  free(heap);
+
+  qsort(results, count, sizeof(struct result_item), &compare_result_items_mm);
   
-  for (i=0;i<count;i++){
-    r = results[i];
+  for (i = 0; i < count; i++){
 #ifdef DEBUG
-    fprintf(stderr, "MEDIAMAN: %3d <%s>\n", r.r_weight, r.r_mi->mi_key);
+    fprintf(stderr, "MEDIAMAN: %3d <%s>\n", results[i].r_weight, results[i].r_mi->mi_key);
 #endif
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "search result %d has weight %d: %s", i, results[i].r_weight, results[i].r_mi->mi_key);
   }
 
-  destroy_result_items_mm(results);
   return 0;
 }
 
+int search_mm(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_tobject *o)
+{
+  return run_search_mm(d, stack, 0);
+}
+
+int search_all_mm(struct katcp_dispatch *d, struct katcp_stack *stack, struct katcp_tobject *o)
+{
+  return run_search_mm(d, stack, 1);
+}
+
 struct kcs_sm_op *search_setup_mm(struct katcp_dispatch *d, struct kcs_sm_state *s)
 {
   struct kcs_sm_op *op;
@@ -623,6 +743,21 @@ struct kcs_sm_op *search_setup_mm(struct katcp_dispatch *d, struct kcs_sm_state
   return op;
 }
 
+struct kcs_sm_op *search_all_setup_mm(struct katcp_dispatch *d, struct kcs_sm_state *s)
+{
+  struct kcs_sm_op *op;
+
+  op = create_sm_op_kcs(&search_all_mm, NULL);
+  if (op == NULL)
+    return NULL;
+
+#ifdef DEBUG
+  fprintf(stderr, "mod_media_man: created op %s (%p)\n", MEDIAMAN_OPERATION_SEARCH_ALL, op);
+#endif
+
+  return op;
+}
+
 #if 0
 int media_item_cmd_mm(struct katcp_dispatch *d, int argc)
 {
@@ -671,8 +806,10 @@ int init_mod(struct katcp_dispatch *d)
   log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "added operations:");
   rtn += store_data_type_katcp(d, KATCP_TYPE_OPERATION, KATCP_DEP_BASE, MEDIAMAN_OPERATION_SUBPROCESS, &subprocess_setup_mm, NULL, NULL, NULL, NULL, NULL, NULL);
   rtn += store_data_type_katcp(d, KATCP_TYPE_OPERATION, KATCP_DEP_BASE, MEDIAMAN_OPERATION_SEARCH, &search_setup_mm, NULL, NULL, NULL, NULL, NULL, NULL);
+  rtn += store_data_type_katcp(d, KATCP_TYPE_OPERATION, KATCP_DEP_BASE, MEDIAMAN_OPERATION_SEARCH_ALL, &search_all_setup_mm, NULL, NULL, NULL, NULL, NULL, NULL);
   log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "%s", MEDIAMAN_OPERATION_SUBPROCESS);
   log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "%s", MEDIAMAN_OPERATION_SEARCH);
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "%s", MEDIAMAN_OPERATION_SEARCH_ALL);
 #if 0
   log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "added edges:");
   rtn += store_data_type_katcp(d, KATCP_TYPE_EDGE, KATCP_DEP_BASE, KATCP_EDGE_CONF_SEARCH, &config_search_setup_mod, NULL, NULL, NULL, NULL, NULL);
@@ -187,40 +187,36 @@ int roach_connect_mod(struct katcp_dispatch *d, struct katcp_stack *stack, struc
 #endif
     return -1;
   }
-#if 0 
-  n = register_notice_katcp(d, NULL, 0, &roach_disconnect_mod, NULL);
-#endif
-  n = create_notice_katcp(d, NULL, 0);
-  if (n == NULL){
-#ifdef DEBUG
-    fprintf(stderr, "mod_roach_comms: cannot create notice\n");
-#endif
-    return -1;
-  }
-
 #ifdef DEBUG
   fprintf(stderr, "mod_roach_comms: running roach connect to <%s>\n", u->u_str);
 #endif
   
-  j = network_connect_job_katcp(d, u, n);
+  /* repeated connects to the same roach share one connection */
+  j = acquire_network_job_katcp(d, u);
   if (j == NULL){
     return -1;
   }
+
+  n = halt_notice_job_katcp(j);
+  if (n == NULL){
+    release_network_job_katcp(d, j);
+    return -1;
+  }
   
   a = create_actor_type_katcp(d, u->u_str, j, NULL, NULL, NULL);
   if (a == NULL){
-    zap_job_katcp(d, j);
+    release_network_job_katcp(d, j);
     return -1;
   }
 
   if (store_data_type_katcp(d, KATCP_TYPE_ACTOR, KATCP_DEP_BASE, u->u_str, a, &print_actor_type_katcp, &destroy_actor_type_katcp, &copy_actor_type_katcp, &compare_actor_type_katcp, &parse_actor_type_katcp, &getkey_actor_katcp) < 0){
-    zap_job_katcp(d, j);
+    release_network_job_katcp(d, j);
     destroy_actor_type_katcp(a);
     return -1;
   }
   
   if (add_notice_katcp(d, n, &roach_disconnect_mod, a) < 0){
-    zap_job_katcp(d, j);
+    release_network_job_katcp(d, j);
     destroy_actor_type_katcp(a);
     return -1;
   }
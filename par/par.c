@@ -7,12 +7,17 @@
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdarg.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/time.h>
 
+#ifdef KATCP_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #include "netc.h"
 #include "katcp.h"
 #include "katcl.h"
@@ -21,10 +26,14 @@
 #define KCPPAR_NAME "kcppar"
 
 #define BUFFER 1024
-#define TIMEOUT   4
+#define TIMEOUT   4 /* default connect timeout, in seconds */
+
+#define PAR_BURST   32 /* connects in progress at once */
+#define PAR_EVENTS  64
 
 #define RX_SETUP 1 
 #define RX_UP    2 
+#define RX_IDLE  3 
 #define RX_OK    0
 #define RX_FAIL  (-1)
 #define RX_BAD   (-2)
@@ -35,11 +44,18 @@ struct remote{
 
   int r_state;
 
-  unsigned int r_index;
+  unsigned int r_index; /* next request to send */
+  unsigned int r_acked; /* next request to expect a reply for */
   unsigned int r_count;
 
   struct katcl_parse **r_vector;
-  char *r_match;
+
+  struct timeval r_deadline; /* connect has to complete by then */
+  char *r_outcome;
+
+#ifdef KATCP_USE_EPOLL
+  unsigned int r_mode;       /* events registered */
+#endif
 };
 
 struct set{
@@ -48,6 +64,31 @@ struct set{
 
   int s_status;
   unsigned int s_finished;
+
+  unsigned int s_window;      /* requests in flight per remote */
+  unsigned int s_limit;       /* requests in flight overall, 0 for no limit */
+  unsigned int s_outstanding;
+  unsigned int s_rotor;
+
+  unsigned int s_next;        /* next remote to connect */
+  unsigned int s_burst;       /* connects in progress at once, 0 for no limit */
+  unsigned int s_connecting;
+  unsigned int s_connect;     /* connect timeout in ms */
+
+  struct katcl_line *s_report;
+  char *s_label;
+  int s_timeout;
+  int s_verbose;
+  int s_info;
+  int s_show;
+  int s_munge;
+  int s_once;
+  int s_summary;
+  unsigned int s_ok;
+
+#ifdef KATCP_USE_EPOLL
+  int s_efd;
+#endif
 };
 
 void destroy_remote(struct remote *rx)
@@ -68,11 +109,15 @@ void destroy_remote(struct remote *rx)
     rx->r_line = NULL;
   }
 
+  if(rx->r_outcome){
+    free(rx->r_outcome);
+    rx->r_outcome = NULL;
+  }
+
   rx->r_index = 0;
+  rx->r_acked = 0;
   rx->r_state = RX_BAD;
 
-  rx->r_match = NULL;
-
   if(rx->r_vector){
     for(i = 0; i < rx->r_count; i++){
       if(rx->r_vector[i]){
@@ -101,11 +146,19 @@ struct remote *create_remote(char *name)
   rs->r_line = NULL;
 
   rs->r_index = 0;
-  rs->r_state = RX_BAD;
+  rs->r_acked = 0;
+  rs->r_state = RX_IDLE;
 
   rs->r_count = 0;
   rs->r_vector = NULL;
-  rs->r_match = NULL;
+
+  rs->r_deadline.tv_sec = 0;
+  rs->r_deadline.tv_usec = 0;
+  rs->r_outcome = NULL;
+
+#ifdef KATCP_USE_EPOLL
+  rs->r_mode = 0;
+#endif
 
   rs->r_name = strdup(name);
   if(rs->r_name == NULL){
@@ -151,6 +204,31 @@ struct set *create_set()
   ss->s_status = 0;
   ss->s_finished = 0;
 
+  ss->s_window = 1;
+  ss->s_limit = 0;
+  ss->s_outstanding = 0;
+  ss->s_rotor = 0;
+
+  ss->s_next = 0;
+  ss->s_burst = PAR_BURST;
+  ss->s_connecting = 0;
+  ss->s_connect = TIMEOUT * 1000;
+
+  ss->s_report = NULL;
+  ss->s_label = KCPPAR_NAME;
+  ss->s_timeout = 0;
+  ss->s_verbose = 1;
+  ss->s_info = 1;
+  ss->s_show = 1;
+  ss->s_munge = 0;
+  ss->s_once = 1;
+  ss->s_summary = 0;
+  ss->s_ok = 0;
+
+#ifdef KATCP_USE_EPOLL
+  ss->s_efd = (-1);
+#endif
+
   return ss;
 }
 
@@ -171,6 +249,13 @@ void destroy_set(struct set *ss)
     free(ss->s_vector);
     ss->s_vector = NULL;
   }
+
+#ifdef KATCP_USE_EPOLL
+  if(ss->s_efd >= 0){
+    close(ss->s_efd);
+    ss->s_efd = (-1);
+  }
+#endif
   
   ss->s_status = (-1);
 
@@ -313,61 +398,172 @@ int load_parse_set(struct set *ss, char *list, struct katcl_parse *px)
   return result;
 }
 
-int activate_remotes(struct set *ss, struct katcl_line *k)
+void update_state(struct set *ss, struct remote *rx, int state);
+
+void note_outcome(struct remote *rx, char *fmt, ...)
 {
-  unsigned int i;
-  struct remote *rx;
+  va_list args;
+  char buffer[BUFFER];
+
+  /* the first problem is usually the interesting one */
+  if(rx->r_outcome){
+    return;
+  }
+
+  va_start(args, fmt);
+  vsnprintf(buffer, BUFFER - 1, fmt, args);
+  va_end(args);
+
+  buffer[BUFFER - 1] = '\0';
+
+  rx->r_outcome = strdup(buffer);
+}
+
+/* per remote chatter, suppressed when only a summary is wanted */
+
+void remote_message(struct set *ss, int level, char *fmt, ...)
+{
+  va_list args;
+  char buffer[BUFFER];
+
+  if(ss->s_summary){
+    return;
+  }
+
+  va_start(args, fmt);
+  vsnprintf(buffer, BUFFER - 1, fmt, args);
+  va_end(args);
+
+  buffer[BUFFER - 1] = '\0';
+
+  log_message_katcl(ss->s_report, level, ss->s_label, "%s", buffer);
+}
+
+#ifdef KATCP_USE_EPOLL
+int interest_remote(struct set *ss, struct remote *rx)
+{
+  struct epoll_event ev;
+  unsigned int mode;
   int fd;
 
-#ifdef DEBUG
-  fprintf(stderr, "launching %u clients\n", ss->s_count);
+  if(rx->r_line == NULL){
+    return 0;
+  }
+
+  switch(rx->r_state){
+    case RX_SETUP :
+      mode = EPOLLOUT;
+      break;
+    case RX_UP :
+      mode = EPOLLIN | (flushing_katcl(rx->r_line) ? EPOLLOUT : 0);
+      break;
+    default :
+      mode = 0;
+      break;
+  }
+
+  if(mode == rx->r_mode){
+    return 0;
+  }
+
+  fd = fileno_katcl(rx->r_line);
+
+  ev.events = mode;
+  ev.data.ptr = rx;
+
+  if(rx->r_mode == 0){
+    if(epoll_ctl(ss->s_efd, EPOLL_CTL_ADD, fd, &ev) < 0){
+      return -1;
+    }
+  } else if(mode == 0){
+    epoll_ctl(ss->s_efd, EPOLL_CTL_DEL, fd, &ev);
+  } else {
+    if(epoll_ctl(ss->s_efd, EPOLL_CTL_MOD, fd, &ev) < 0){
+      return -1;
+    }
+  }
+
+  rx->r_mode = mode;
+
+  return 0;
+}
 #endif
 
-  for(i = 0; i < ss->s_count; i++){
-    rx = ss->s_vector[i];
+int start_remote(struct set *ss, struct remote *rx)
+{
+  struct timeval now, delta;
+  int fd;
+
 #ifdef DEBUG
-    fprintf(stderr, "attempting to start connect to %s (%u requests)\n", rx->r_name, rx->r_count);
+  fprintf(stderr, "attempting to start connect to %s (%u requests)\n", rx->r_name, rx->r_count);
 #endif
-    fd = net_connect(rx->r_name, 0, NETC_ASYNC);
-    if(fd < 0){
-      if(k){
-        /* TODO */
-      }
-      return -1;
-    }
 
-    if(rx->r_line){
+  if(rx->r_line){
 #ifdef DEBUG
-      fprintf(stderr, "logic failure: line already initialised\n");
+    fprintf(stderr, "logic failure: line already initialised\n");
 #endif
-      return -1;
-    }
+    return -1;
+  }
 
-    rx->r_line = create_katcl(fd);
-    if(rx->r_line == NULL){
-      if(k){
-        /* TODO */
-      }
+  fd = net_connect(rx->r_name, 0, NETC_ASYNC);
+  if(fd < 0){
+    note_outcome(rx, "unable to initiate connection: %s", strerror(errno));
+    return -1;
+  }
+
+  rx->r_line = create_katcl(fd);
+  if(rx->r_line == NULL){
 #ifdef DEBUG
-      fprintf(stderr, "setup failure: unable to create line for %s\n", rx->r_name);
+    fprintf(stderr, "setup failure: unable to create line for %s\n", rx->r_name);
 #endif
-      close(fd);
-      return -1;
-    }
+    close(fd);
+    note_outcome(rx, "unable to allocate connection state");
+    return -1;
+  }
+
+  gettimeofday(&now, NULL);
+
+  delta.tv_sec = ss->s_connect / 1000;
+  delta.tv_usec = (ss->s_connect % 1000) * 1000;
 
-    rx->r_state = RX_SETUP;
-    rx->r_index = 0;
+  add_time_katcp(&(rx->r_deadline), &now, &delta);
+
+  rx->r_index = 0;
+  rx->r_acked = 0;
+
+  update_state(ss, rx, RX_SETUP);
+
+#ifdef KATCP_USE_EPOLL
+  if(interest_remote(ss, rx) < 0){
+    note_outcome(rx, "unable to register connection: %s", strerror(errno));
+    return -1;
   }
+#endif
 
   return 0;
 }
 
+/* only have a limited number of connects in progress, a large array would otherwise see a burst of them */
+
+void launch_remotes(struct set *ss)
+{
+  struct remote *rx;
+
+  while((ss->s_next < ss->s_count) && ((ss->s_burst == 0) || (ss->s_connecting < ss->s_burst))){
+    rx = ss->s_vector[ss->s_next];
+    ss->s_next++;
+
+    if(start_remote(ss, rx) < 0){
+      remote_message(ss, KATCP_LEVEL_ERROR, "unable to connect to %s: %s", rx->r_name, rx->r_outcome ? rx->r_outcome : "unknown failure");
+      update_state(ss, rx, RX_BAD);
+    }
+  }
+}
+
 int next_request(struct remote *rx)
 {
   char *ptr;
 
-  rx->r_match = NULL;
-
   if(rx->r_index >= rx->r_count){
     return 1;
   }
@@ -384,21 +580,95 @@ int next_request(struct remote *rx)
     return -1;
   }
 
-  rx->r_match = ptr + 1;
   rx->r_index++;
 
   return 0;
 }
 
+char *expected_reply(struct remote *rx)
+{
+  char *ptr;
+
+  if(rx->r_acked >= rx->r_index){
+    return NULL;
+  }
+
+  ptr = get_string_parse_katcl(rx->r_vector[rx->r_acked], 0);
+  if(ptr == NULL){
+    return NULL;
+  }
+
+  return ptr + 1;
+}
+
+/* keep up to s_window requests in flight to this remote, within the overall limit */
+
+int fill_window(struct set *ss, struct remote *rx)
+{
+  int result;
+
+  while(((rx->r_index - rx->r_acked) < ss->s_window) && ((ss->s_limit == 0) || (ss->s_outstanding < ss->s_limit))){
+    result = next_request(rx);
+    if(result){
+      return (result < 0) ? (-1) : 0;
+    }
+    ss->s_outstanding++;
+  }
+
+  return 0;
+}
+
+/* hand out free slots, starting at a different remote each time so that none starves under the overall limit */
+
+int fill_set(struct set *ss)
+{
+  unsigned int i;
+  struct remote *rx;
+  int result;
+
+  result = 0;
+
+  for(i = 0; i < ss->s_count; i++){
+    rx = ss->s_vector[(ss->s_rotor + i) % ss->s_count];
+    if(rx->r_state == RX_UP){
+      if(fill_window(ss, rx) < 0){
+        note_outcome(rx, "unable to queue request");
+        update_state(ss, rx, RX_BAD);
+        result = (-1);
+      }
+    }
+  }
+
+  if(ss->s_count > 0){
+    ss->s_rotor = (ss->s_rotor + 1) % ss->s_count;
+  }
+
+  return result;
+}
+
 void update_state(struct set *ss, struct remote *rx, int state)
 {
   if(rx->r_state == state){
     return;
   }
 
+  switch(rx->r_state){
+    case RX_SETUP :
+      ss->s_connecting--;
+      break;
+    case RX_UP :
+      /* whatever is still in flight no longer counts against the limit */
+      ss->s_outstanding -= (rx->r_index - rx->r_acked);
+      break;
+  }
+
   rx->r_state = state;
 
   switch(state){
+    case RX_SETUP :
+      ss->s_connecting++;
+      break;
+
     case RX_BAD : 
       ss->s_status = 2;
       ss->s_finished++;
@@ -410,27 +680,528 @@ void update_state(struct set *ss, struct remote *rx, int state)
       break;
 
     case RX_OK : 
+      note_outcome(rx, "ok");
       ss->s_finished++;
       break;
   }
 
+  switch(state){
+    case RX_BAD : 
+    case RX_FAIL : 
+    case RX_OK : 
+      /* report each remote as it completes rather than only at the end */
+      if((ss->s_summary == 0) && (ss->s_verbose > 1)){
+        remote_message(ss, (state == RX_OK) ? KATCP_LEVEL_INFO : KATCP_LEVEL_WARN, "%s completed: %s", rx->r_name, rx->r_outcome ? rx->r_outcome : "no details");
+      }
+      break;
+  }
+
 #ifdef DEBUG
   fprintf(stderr, "updated state=%d, status=%d\n", rx->r_state, ss->s_status);
 #endif
 }
 
+/* close connections as soon as a remote is done, frees up descriptors in large arrays */
+
+void retire_remote(struct set *ss, struct remote *rx)
+{
+  switch(rx->r_state){
+    case RX_OK :
+    case RX_FAIL :
+    case RX_BAD :
+      break;
+    default :
+      return;
+  }
+
+  if(rx->r_line == NULL){
+    return;
+  }
+
+  /* closing the descriptor also removes it from any epoll set */
+  destroy_katcl(rx->r_line, 1);
+  rx->r_line = NULL;
+
+#ifdef KATCP_USE_EPOLL
+  rx->r_mode = 0;
+#endif
+}
+
+void check_deadlines(struct set *ss, struct timeval *now)
+{
+  unsigned int i;
+  struct remote *rx;
+
+  for(i = 0; i < ss->s_next; i++){
+    rx = ss->s_vector[i];
+    if((rx->r_state == RX_SETUP) && (cmp_time_katcp(&(rx->r_deadline), now) <= 0)){
+      note_outcome(rx, "connect timed out after %ums", ss->s_connect);
+      remote_message(ss, KATCP_LEVEL_ERROR, "unable to connect to %s within %ums", rx->r_name, ss->s_connect);
+      update_state(ss, rx, RX_BAD);
+    }
+  }
+}
+
+/* wait no longer than the overall stop time, or the earliest connect deadline */
+
+void compute_wait(struct set *ss, struct timeval *stop, struct timeval *now, struct timeval *delta)
+{
+  unsigned int i;
+  struct remote *rx;
+  struct timeval *until;
+
+  until = stop;
+
+  for(i = 0; i < ss->s_next; i++){
+    rx = ss->s_vector[i];
+    if((rx->r_state == RX_SETUP) && (cmp_time_katcp(&(rx->r_deadline), until) < 0)){
+      until = &(rx->r_deadline);
+    }
+  }
+
+  if(cmp_time_katcp(until, now) <= 0){
+    delta->tv_sec = 0;
+    delta->tv_usec = 0;
+  } else {
+    sub_time_katcp(delta, until, now);
+  }
+}
+
+void process_remote(struct set *ss, struct remote *rx, int readable, int writable)
+{
+  struct katcl_line *k;
+  char *cmd, *ptr, *parm, *extra, *want;
+  int result, code;
+  unsigned int len;
+  int fd;
+
+  k = ss->s_report;
+
+  if(rx->r_line == NULL){
+    return;
+  }
+
+  fd = fileno_katcl(rx->r_line);
+
+  switch(rx->r_state){
+    case RX_SETUP :
+      if(writable){
+        len = sizeof(int);
+        result = getsockopt(fd, SOL_SOCKET, SO_ERROR, &code, &len);
+        if(result == 0){
+          switch(code){
+            case 0 :
+              if(ss->s_verbose){
+                remote_message(ss, KATCP_LEVEL_DEBUG, "async connect to %s succeeded", rx->r_name);
+              }
+              update_state(ss, rx, RX_UP);
+              break;
+            case EINPROGRESS :
+              remote_message(ss, KATCP_LEVEL_WARN, "saw an in progress despite write set being ready on job %s", rx->r_name);
+              break;
+            default :
+              remote_message(ss, KATCP_LEVEL_ERROR, "unable to connect to %s: %s", rx->r_name, strerror(code));
+              note_outcome(rx, "unable to connect: %s", strerror(code));
+              update_state(ss, rx, RX_BAD);
+              break;
+          }
+        }
+      }
+      break;
+    case RX_UP :
+
+      if(writable){ /* flushing things */
+        result = write_katcl(rx->r_line);
+        if(result < 0){
+          remote_message(ss, KATCP_LEVEL_ERROR, "unable to write to %s: %s", rx->r_name, strerror(error_katcl(rx->r_line)));
+          note_outcome(rx, "write failed: %s", strerror(error_katcl(rx->r_line)));
+          update_state(ss, rx, RX_BAD);
+        }
+      }
+
+      if(readable && (rx->r_state == RX_UP)){ /* get things */
+        result = read_katcl(rx->r_line);
+        if(result){
+          if(result < 0){
+            remote_message(ss, KATCP_LEVEL_ERROR, "read from %s failed: %s", rx->r_name, strerror(error_katcl(rx->r_line)));
+            note_outcome(rx, "read failed: %s", strerror(error_katcl(rx->r_line)));
+          } else {
+            remote_message(ss, KATCP_LEVEL_WARN, "%s disconnected", rx->r_name);
+            note_outcome(rx, "disconnected");
+          }
+          /* process what we have, then give up */
+        }
+      } else {
+        result = 0;
+      }
+
+      while((rx->r_state == RX_UP) && (have_katcl(rx->r_line) > 0)){ /* compute, but ignore replies to requests issued after a failure */
+
+        cmd = arg_string_katcl(rx->r_line, 0);
+        if(cmd){
+#ifdef DEBUG
+          fprintf(stderr, "reading message <%s ...>\n", cmd);
+#endif
+          switch(cmd[0]){
+            case KATCP_INFORM : 
+              if(ss->s_info){
+                if(ss->s_show == 0){
+                  if(!strcmp(KATCP_VERSION_CONNECT_INFORM, cmd)){
+                    break;
+                  }
+                  if(!strcmp(KATCP_VERSION_INFORM, cmd)){
+                    break;
+                  }
+                  if(!strcmp(KATCP_BUILD_STATE_INFORM, cmd)){
+                    break;
+                  }
+                }
+                relay_katcl(rx->r_line, k);
+              }
+              break;
+            case KATCP_REPLY : 
+
+              switch(cmd[1]){
+                case ' '  :
+                case '\n' : 
+                case '\r' :
+                case '\t' :
+                case '\\' :
+                case '\0' :
+                  remote_message(ss, KATCP_LEVEL_ERROR, "unreasonable response message from %s", rx->r_name);
+                  note_outcome(rx, "unreasonable response message");
+                  update_state(ss, rx, RX_BAD);
+                  break;
+                default : 
+                  ptr = cmd + 1;
+                  want = expected_reply(rx);
+                  if((want == NULL) || strcmp(ptr, want)){
+                    remote_message(ss, KATCP_LEVEL_ERROR, "downstream %s returned response %s which was never requested", rx->r_name, ptr);
+                    note_outcome(rx, "unrequested response %s", ptr);
+                    update_state(ss, rx, RX_BAD);
+                  } else {
+                    parm = arg_string_katcl(rx->r_line, 1);
+                    if(parm){
+                      if(strcmp(parm, KATCP_OK) == 0){
+                        ss->s_ok++;
+                        if(ss->s_munge){
+                          remote_message(ss, KATCP_LEVEL_INFO, "%s %s ok", rx->r_name, ptr);
+                        } 
+                        if(ss->s_verbose > 1){
+                          remote_message(ss, KATCP_LEVEL_TRACE, "request %s to %s returned ok", ptr, rx->r_name);
+                        }
+                        rx->r_acked++;
+                        ss->s_outstanding--;
+                        if(rx->r_acked >= rx->r_count){
+                          update_state(ss, rx, RX_OK);
+                        }
+                      } else {
+                        extra = arg_string_katcl(rx->r_line, 2);
+                        if(ss->s_munge){
+                          remote_message(ss, KATCP_LEVEL_ERROR, "%s %s %s (%s)", rx->r_name, ptr, parm, extra ? extra : "no extra information");
+                        } 
+                        if(ss->s_verbose > 0){
+                          remote_message(ss, KATCP_LEVEL_ERROR, "downstream %s unable to process %s with status %s (%s)", rx->r_name, cmd, parm, extra ? extra : "no extra information");
+                        }
+                        note_outcome(rx, "%s %s (%s)", ptr, parm, extra ? extra : "no extra information");
+                        update_state(ss, rx, RX_FAIL);
+                      }
+                    } else {
+                      remote_message(ss, KATCP_LEVEL_ERROR, "response %s without status from %s", cmd, rx->r_name);
+                      note_outcome(rx, "response %s without status", cmd);
+                      update_state(ss, rx, RX_FAIL);
+                    }
+                  }
+                  break;
+              }
+              break;
+            case KATCP_REQUEST : 
+              remote_message(ss, KATCP_LEVEL_WARN, "encountered unanswerable request %s", cmd);
+              note_outcome(rx, "unanswerable request %s", cmd);
+              update_state(ss, rx, RX_BAD);
+              break;
+            default :
+              if(ss->s_once){
+                remote_message(ss, KATCP_LEVEL_WARN, "read malformed message %s from %s", cmd, rx->r_name);
+                ss->s_once = 1;
+              }
+              break;
+          }
+
+        }
+      }
+
+      if(result && (rx->r_state == RX_UP)){
+        /* connection went away before all replies arrived */
+        update_state(ss, rx, RX_BAD);
+      }
+      break;
+
+    /* case RX_OK : */
+    /* case RX_FAIL : */
+    /* case RX_BAD : */
+    default :
+      break;
+  }
+}
+
+#ifdef KATCP_USE_EPOLL
+
+int run_set(struct set *ss, struct timeval *stop)
+{
+  struct epoll_event events[PAR_EVENTS];
+  struct timeval now, delta;
+  struct remote *rx;
+  unsigned int i;
+  int result, ms;
+
+  ss->s_efd = epoll_create(PAR_EVENTS);
+  if(ss->s_efd < 0){
+    sync_message_katcl(ss->s_report, KATCP_LEVEL_ERROR, ss->s_label, "unable to create epoll instance: %s", strerror(errno));
+    return 4;
+  }
+
+  for(ss->s_finished = 0; ss->s_finished < ss->s_count;){
+
+    launch_remotes(ss);
+
+    if(fill_set(ss) < 0){
+      log_message_katcl(ss->s_report, KATCP_LEVEL_ERROR, ss->s_label, "unable to queue further requests");
+    }
+
+    for(i = 0; i < ss->s_next; i++){
+      rx = ss->s_vector[i];
+      retire_remote(ss, rx);
+      if(interest_remote(ss, rx) < 0){
+        note_outcome(rx, "unable to register connection: %s", strerror(errno));
+        update_state(ss, rx, RX_BAD);
+      }
+    }
+
+    /* the report stream has no deadline, let it block if the consumer is slow */
+    while(flushing_katcl(ss->s_report)){
+      if(write_katcl(ss->s_report) < 0){
+        break;
+      }
+    }
+
+    if(ss->s_finished >= ss->s_count){
+      break;
+    }
+
+    gettimeofday(&now, NULL);
+    if(cmp_time_katcp(stop, &now) <= 0){
+      sync_message_katcl(ss->s_report, KATCP_LEVEL_ERROR, ss->s_label, "requests timed out after %dms", ss->s_timeout);
+      return 3;
+    }
+
+    compute_wait(ss, stop, &now, &delta);
+    ms = (delta.tv_sec * 1000) + ((delta.tv_usec + 999) / 1000);
+
+    result = epoll_wait(ss->s_efd, events, PAR_EVENTS, ms);
+    if(result < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          continue; /* WARNING */
+        default  :
+          sync_message_katcl(ss->s_report, KATCP_LEVEL_ERROR, ss->s_label, "epoll wait failed: %s", strerror(errno));
+          return 4;
+      }
+    }
+
+    for(i = 0; i < result; i++){
+      rx = events[i].data.ptr;
+      /* errors show up as readiness, the io routines will report the details */
+      process_remote(ss, rx, (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ? 1 : 0, (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) ? 1 : 0);
+    }
+
+    gettimeofday(&now, NULL);
+    check_deadlines(ss, &now);
+  }
+
+  return ss->s_status;
+}
+
+#else
+
+int run_set(struct set *ss, struct timeval *stop)
+{
+  struct timeval now, delta;
+  struct remote *rx;
+  fd_set fsr, fsw;
+  unsigned int i;
+  int result, fd, mfd;
+
+  for(ss->s_finished = 0; ss->s_finished < ss->s_count;){
+
+    launch_remotes(ss);
+
+    if(fill_set(ss) < 0){
+      log_message_katcl(ss->s_report, KATCP_LEVEL_ERROR, ss->s_label, "unable to queue further requests");
+    }
+
+    if(ss->s_finished >= ss->s_count){
+      break;
+    }
+
+    mfd = 0;
+    FD_ZERO(&fsr);
+    FD_ZERO(&fsw);
+
+    if(flushing_katcl(ss->s_report)){
+      mfd = fileno_katcl(ss->s_report);
+      FD_SET(mfd, &fsw);
+    }
+
+    for(i = 0; i < ss->s_next; i++){
+      rx = ss->s_vector[i];
+
+      retire_remote(ss, rx);
+      if(rx->r_line == NULL){
+        continue;
+      }
+
+      fd = fileno_katcl(rx->r_line);
+      if(fd > mfd){
+        mfd = fd;
+      }
+
+      switch(rx->r_state){
+        case RX_SETUP :
+          FD_SET(fd, &fsw);
+          break;
+        case RX_UP :
+          if(flushing_katcl(rx->r_line)){ /* only write data if we have some */
+            FD_SET(fd, &fsw);
+          }
+          FD_SET(fd, &fsr);
+          break;
+        default :
+          break;
+      }
+    }
+
+    gettimeofday(&now, NULL);
+    if(cmp_time_katcp(stop, &now) <= 0){
+      sync_message_katcl(ss->s_report, KATCP_LEVEL_ERROR, ss->s_label, "requests timed out after %dms", ss->s_timeout);
+      return 3;
+    }
+
+    compute_wait(ss, stop, &now, &delta);
+
+    result = select(mfd + 1, &fsr, &fsw, NULL, &delta);
+    if(result < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          continue; /* WARNING */
+        default  :
+          sync_message_katcl(ss->s_report, KATCP_LEVEL_ERROR, ss->s_label, "select failed: %s", strerror(errno));
+          return 4;
+      }
+    }
+
+    fd = fileno_katcl(ss->s_report);
+    if(FD_ISSET(fd, &fsw)){
+      write_katcl(ss->s_report); /* WARNING: ignores write failures - unable to do much about it */
+    }
+
+    for(i = 0; i < ss->s_next; i++){
+      rx = ss->s_vector[i];
+      if(rx->r_line == NULL){
+        continue;
+      }
+      fd = fileno_katcl(rx->r_line);
+      process_remote(ss, rx, FD_ISSET(fd, &fsr) ? 1 : 0, FD_ISSET(fd, &fsw) ? 1 : 0);
+    }
+
+    gettimeofday(&now, NULL);
+    check_deadlines(ss, &now);
+  }
+
+  return ss->s_status;
+}
+
+#endif
+
+/* collapse identical outcomes, so that a large array does not produce a line per remote */
+
+void summarise_set(struct set *ss)
+{
+  unsigned int i, j, n, len, used;
+  struct remote *rx, *ry;
+  char *names, *tmp, *outcome;
+  unsigned char *done;
+
+  done = calloc(ss->s_count, 1);
+  if(done == NULL){
+    return;
+  }
+
+  for(i = 0; i < ss->s_count; i++){
+    if(done[i]){
+      continue;
+    }
+
+    rx = ss->s_vector[i];
+    outcome = rx->r_outcome ? rx->r_outcome : "not attempted";
+
+    names = NULL;
+    used = 0;
+    n = 0;
+
+    for(j = i; j < ss->s_count; j++){
+      ry = ss->s_vector[j];
+      if(done[j] || (ry->r_state != rx->r_state) || strcmp(ry->r_outcome ? ry->r_outcome : "not attempted", outcome)){
+        continue;
+      }
+
+      done[j] = 1;
+      n++;
+
+      len = strlen(ry->r_name);
+      tmp = realloc(names, used + len + 2);
+      if(tmp == NULL){
+        continue;
+      }
+      names = tmp;
+
+      if(used > 0){
+        names[used++] = ',';
+      }
+      memcpy(names + used, ry->r_name, len);
+      used += len;
+      names[used] = '\0';
+    }
+
+    log_message_katcl(ss->s_report, (rx->r_state == RX_OK) ? KATCP_LEVEL_INFO : KATCP_LEVEL_ERROR, ss->s_label, "%u of %u: %s (%s)", n, ss->s_count, outcome, names ? names : "");
+
+    if(names){
+      free(names);
+    }
+  }
+
+  free(done);
+}
+
 void usage(char *app)
 {
   printf("usage: %s [flags] [-s server[,server]* -x command args*]*\n", app);
   printf("-h                 this help\n");
+  printf("-a count           number of connection attempts in progress at once (default %d, 0 for all)\n", PAR_BURST);
+  printf("-c count           limit the number of requests in flight across all servers\n");
+  printf("-g                 only report a summary, grouping servers with identical outcomes\n");
   printf("-i                 inhibit relaying of downstream inform messages\n");
   printf("-l label           assign log messages a given label\n");
   printf("-m                 munge replies into log messages\n");
   printf("-n                 suppress relaying of downstream version information\n");
+  printf("-o timeout         connect timeout per server (in ms, default %d)\n", TIMEOUT * 1000);
   printf("-q                 run quietly\n");
   printf("-s server:port     specify server:port\n");
   printf("-t timeout         set timeout (in ms)\n");
   printf("-v                 increase verbosity\n");
+  printf("-w count           number of requests to have in flight per server (default 1)\n");
 
   printf("return codes:\n");
   printf("0     command completed successfully\n");
@@ -444,29 +1215,27 @@ void usage(char *app)
 
   printf("notes:\n");
   printf("  command and parameters have to be given as separate arguments\n");
+  printf("  with a window larger than 1 requests after a failing one may already have been issued\n");
 }
 
 int main(int argc, char **argv)
 {
   struct set *ss;
-  struct remote *rx;
   struct katcl_parse *px;
   struct katcl_line *k;
   struct timeval delta, start, stop;
-  fd_set fsr, fsw;
 
-  char *app, *parm, *cmd, *copy, *ptr, *servers, *extra, *label;
-  int i, j, c, fd, mfd, count;
-  int verbose, result, status, info, timeout, flags, show, munge, once;
-  int xmit, code;
-  unsigned int len;
+  char *app, *copy, *ptr, *servers, *label;
+  int i, j, c, count;
+  int verbose, status, info, timeout, flags, show, munge, summary;
+  int xmit;
   
   servers = getenv("KATCP_SERVER");
   if(servers == NULL){
     servers = "localhost:7147";
   }
   
-  once = 1;
+  summary = 0;
   munge = 0;
   info = 1;
   verbose = 1;
@@ -475,8 +1244,6 @@ int main(int argc, char **argv)
   timeout = 0;
   k = NULL;
   show = 1;
-  parm = NULL;
-  extra = NULL;
   label = KCPPAR_NAME;
   count = 0;
   px = NULL;
@@ -503,6 +1270,11 @@ int main(int argc, char **argv)
         case 'h' :
           usage(app);
           return 0;
+        case 'g' : 
+          summary = 1;
+          j++;
+          break;
+
         case 'i' : 
           info = 1 - info;
           j++;
@@ -529,9 +1301,13 @@ int main(int argc, char **argv)
           j++;
           break;
 
+        case 'a' :
+        case 'c' :
         case 'l' :
+        case 'o' :
         case 's' :
         case 't' :
+        case 'w' :
 
           j++;
           if (argv[i][j] == '\0') {
@@ -544,15 +1320,33 @@ int main(int argc, char **argv)
           }
 
           switch(c){
+            case 'a' :
+              ss->s_burst = atoi(argv[i] + j);
+              break;
+            case 'c' :
+              ss->s_limit = atoi(argv[i] + j);
+              break;
             case 'l' :
               label = argv[i] + j;
               break;
+            case 'o' :
+              ss->s_connect = atoi(argv[i] + j);
+              if(ss->s_connect == 0){
+                ss->s_connect = TIMEOUT * 1000;
+              }
+              break;
             case 's' :
               servers = argv[i] + j;
               break;
             case 't' :
               timeout = atoi(argv[i] + j);
               break;
+            case 'w' :
+              ss->s_window = atoi(argv[i] + j);
+              if(ss->s_window == 0){
+                ss->s_window = 1;
+              }
+              break;
           }
 
           i++;
@@ -657,244 +1451,34 @@ int main(int argc, char **argv)
 
   add_time_katcp(&stop, &start, &delta);
 
-  if(activate_remotes(ss, k) < 0){
-    sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to initiate connections to remote servers");
-    return 3;
+  ss->s_report = k;
+  ss->s_label = label;
+  ss->s_timeout = timeout;
+  ss->s_verbose = verbose;
+  ss->s_munge = munge;
+  ss->s_show = show;
+  ss->s_summary = summary;
+
+  if(summary){
+    /* results only show up in the summary */
+    ss->s_info = 0;
+    ss->s_munge = 0;
+    ss->s_verbose = 0;
+  } else {
+    ss->s_info = info;
   }
 
-  for(ss->s_finished = 0; ss->s_finished < ss->s_count;){
-
-    mfd = 0;
-    FD_ZERO(&fsr);
-    FD_ZERO(&fsw);
-
-    if(k){
-      if(flushing_katcl(k)){
-        mfd = fileno_katcl(k);
-        FD_SET(mfd, &fsw);
-      }
-    }
-
-    for(i = 0; i < ss->s_count; i++){
-      rx = ss->s_vector[i];
-      if(rx->r_line){
-        fd = fileno_katcl(rx->r_line);
-        if(fd > mfd){
-          mfd = fd;
-        }
-      } else {
-        fd = (-1); /* WARNING: live dangerously */
-      }
-
-      switch(rx->r_state){
-        case RX_SETUP :
-          FD_SET(fd, &fsw);
-          break;
-        case RX_UP :
-          if(flushing_katcl(rx->r_line)){ /* only write data if we have some */
-            FD_SET(fd, &fsw);
-          }
-          FD_SET(fd, &fsr);
-          break;
-          /* case RX_OK : */
-          /* case RX_FAIL : */
-          /* case RX_BAD  : */
-        default :
-          break;
-      }
-    }
-
-    gettimeofday(&start, NULL);
-    sub_time_katcp(&delta, &stop, &start);
-
-    result = select(mfd + 1, &fsr, &fsw, NULL, &delta);
-    switch(result){
-      case -1 :
-        switch(errno){
-          case EAGAIN :
-          case EINTR  :
-            continue; /* WARNING */
-          default  :
-            sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "select failed: %s", strerror(errno));
-            return 4;
-        }
-        break;
-      case  0 :
-        sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "requests timed out after %dms", timeout);
-        /* could terminate cleanly here, but ... */
-        return 3;
-    }
-
-    if(k){
-      fd = fileno_katcl(k);
-      if(FD_ISSET(fd, &fsw)){
-        write_katcl(k); /* WARNING: ignores write failures - unable to do much about it */
-      }
-    }
-
-    for(i = 0; i < ss->s_count; i++){
-      rx = ss->s_vector[i];
-      if(rx->r_line){
-        fd = fileno_katcl(rx->r_line);
-      } else {
-        fd = (-1); /* WARNING: live dangerously, will cause select to core dump if logic is incorrect */
-      }
-
-      switch(rx->r_state){
-        case RX_SETUP :
-          if(FD_ISSET(fd, &fsw)){
-            len = sizeof(int);
-            result = getsockopt(fd, SOL_SOCKET, SO_ERROR, &code, &len);
-            if(result == 0){
-              switch(code){
-                case 0 :
-                  if(verbose){
-                    log_message_katcl(k, KATCP_LEVEL_DEBUG, label, "async connect to %s succeeded", rx->r_name);
-                  }
-                  if(next_request(rx) < 0){
-                    log_message_katcl(k, KATCP_LEVEL_ERROR, label, "failed to load request for destination %s", rx->r_name);
-                    update_state(ss, rx, RX_BAD);
-                  } else {
-                    update_state(ss, rx, RX_UP);
-                  }
-                  break;
-                case EINPROGRESS :
-                  log_message_katcl(k, KATCP_LEVEL_WARN, label, "saw an in progress despite write set being ready on job %s", rx->r_name);
-                  break;
-                default :
-                  log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to connect to %s: %s", rx->r_name, strerror(code));
-                  update_state(ss, rx, RX_BAD);
-                  break;
-              }
-            }
-          }
-          break;
-        case RX_UP :
-
-          if(FD_ISSET(fd, &fsw)){ /* flushing things */
-            result = write_katcl(rx->r_line);
-            if(result < 0){
-              log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to write to %s: %s", rx->r_name, strerror(error_katcl(rx->r_line)));
-              update_state(ss, rx, RX_BAD);
-            }
-          }
-
-          if(FD_ISSET(fd, &fsr)){ /* get things */
-            result = read_katcl(rx->r_line);
-            if(result){
-              if(result < 0){
-                log_message_katcl(k, KATCP_LEVEL_ERROR, label, "read from %s failed: %s", rx->r_name, strerror(error_katcl(rx->r_line)));
-              } else {
-                log_message_katcl(k, KATCP_LEVEL_WARN, label, "%s disconnected", rx->r_name);
-              }
-            }
-          }
-
-          while(have_katcl(rx->r_line) > 0){ /* compute */
-
-
-            cmd = arg_string_katcl(rx->r_line, 0);
-            if(cmd){
-#ifdef DEBUG
-              fprintf(stderr, "reading message <%s ...>\n", cmd);
-#endif
-              switch(cmd[0]){
-                case KATCP_INFORM : 
-                  if(info){
-                    if(show == 0){
-                      if(!strcmp(KATCP_VERSION_CONNECT_INFORM, cmd)){
-                        break;
-                      }
-                      if(!strcmp(KATCP_VERSION_INFORM, cmd)){
-                        break;
-                      }
-                      if(!strcmp(KATCP_BUILD_STATE_INFORM, cmd)){
-                        break;
-                      }
-                    }
-                    relay_katcl(rx->r_line, k);
-                  }
-                  break;
-                case KATCP_REPLY : 
-
-                  switch(cmd[1]){
-                    case ' '  :
-                    case '\n' : 
-                    case '\r' :
-                    case '\t' :
-                    case '\\' :
-                    case '\0' :
-                      log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unreasonable response message from %s", rx->r_name);
-                      update_state(ss, rx, RX_BAD);
-                      break;
-                    default : 
-                      ptr = cmd + 1;
-                      if(strcmp(ptr, rx->r_match)){
-                        log_message_katcl(k, KATCP_LEVEL_ERROR, label, "downstream %s returned response %s which was never requested", rx->r_name, ptr);
-                        update_state(ss, rx, RX_BAD);
-                      } else {
-                        parm = arg_string_katcl(rx->r_line, 1);
-                        if(parm){
-                          if(strcmp(parm, KATCP_OK) == 0){
-                            count++;
-                            if(munge){
-                              log_message_katcl(k, KATCP_LEVEL_INFO, label, "%s %s ok", rx->r_name, ptr);
-                            } 
-                            if(verbose > 1){
-                              log_message_katcl(k, KATCP_LEVEL_TRACE, label, "request %s to %s returned ok", ptr, rx->r_name);
-                            }
-                            result = next_request(rx);
-                            if(result){
-                              if(result < 0){
-                                sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to queue request %s to %s", ptr, rx->r_name);
-                                update_state(ss, rx, RX_BAD);
-                              } else {
-                                update_state(ss, rx, RX_OK);
-                              } 
-                            }
-                          } else {
-                            if(munge){
-                              extra = arg_string_katcl(rx->r_line, 2);
-                              log_message_katcl(k, KATCP_LEVEL_ERROR, label, "%s %s %s (%s)", rx->r_name, ptr, parm, extra ? extra : "no extra information");
-                            } 
-                            if(verbose > 0){
-                              log_message_katcl(k, KATCP_LEVEL_ERROR, label, "downstream %s unable to process %s with status %s (%s)", rx->r_name, cmd, parm, extra ? extra : "no extra information");
-                            }
-                            update_state(ss, rx, RX_FAIL);
-                          }
-                        } else {
-                          log_message_katcl(k, KATCP_LEVEL_ERROR, label, "response %s without status from %s", cmd, rx->r_name);
-                          update_state(ss, rx, RX_FAIL);
-                        }
-                      }
-                      break;
-                  }
-                  break;
-                case KATCP_REQUEST : 
-                  log_message_katcl(k, KATCP_LEVEL_WARN, label, "encountered unanswerable request %s", cmd);
-                  update_state(ss, rx, RX_BAD);
-                  break;
-                default :
-                  if(once){
-                    log_message_katcl(k, KATCP_LEVEL_WARN, label, "read malformed message %s from %s", cmd, rx->r_name);
-                    once = 1;
-                  }
-                  break;
-              }
-
-            }
-          }
-          break;
+  status = run_set(ss, &stop);
+  if(status > 2){
+    return status;
+  }
 
-        /* case RX_OK : */
-        /* case RX_FAIL : */
-        /* case RX_BAD : */
-        default :
-          break;
-      }
-    }
+  if(summary){
+    summarise_set(ss);
   }
 
+  count = ss->s_ok;
+
   status = ss->s_status;
 
   destroy_set(ss);
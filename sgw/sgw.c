@@ -37,13 +37,59 @@ static struct speed_item speed_table[] = {
   { 0,       B0 } 
 };
 
-static int start_serial(char *device, int speed)
+#define SGW_FRAME_KATCP      0
+#define SGW_FRAME_LINE       1
+#define SGW_FRAME_RAW        2
+
+#define SGW_DEFAULT_SPEED    9600
+#define SGW_DEFAULT_GAP        50
+#define SGW_DEFAULT_MAX      1024
+#define SGW_DEFAULT_TIMEOUT  1000
+
+#define SGW_NAME_MAX          128
+
+/* one serial device. A port either speaks katcp itself, or has its
+ * bytes framed into messages by line terminator or by an idle gap */
+
+struct sgw_port{
+  char *p_name;
+  char *p_device;
+  int p_flat;
+
+  int p_speed;
+  int p_vmin;
+  int p_vtime;
+
+  int p_frame;
+  int p_eol;
+  unsigned int p_gap;
+  unsigned int p_max;
+  unsigned int p_timeout;
+
+  int p_fd;
+  struct katcl_line *p_line;
+
+  unsigned char *p_input;
+  unsigned int p_have;
+  struct timeval p_last;
+
+  unsigned char *p_output;
+  unsigned int p_size;
+  unsigned int p_pending;
+
+  int p_query;
+  struct timeval p_deadline;
+};
+
+static char *frame_table[] = { "katcp", "line", "raw", NULL };
+
+static int start_serial(struct sgw_port *sp)
 {
   struct termios tio;
   int i, code;
   int fd;
 
-  fd = open(device, O_RDWR | O_NONBLOCK | O_NOCTTY);
+  fd = open(sp->p_device, O_RDWR | O_NONBLOCK | O_NOCTTY);
   if(fd < 0){
     return -1;
   }
@@ -53,11 +99,17 @@ static int start_serial(char *device, int speed)
     return -1;
   }
 
-  tio.c_cc[VMIN] = 1;
-  tio.c_cc[VTIME] = 0;
+  /* with VTIME zero the tty only reports readable once VMIN bytes are in */
+  tio.c_cc[VMIN] = sp->p_vmin;
+  tio.c_cc[VTIME] = sp->p_vtime;
 
   tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IXOFF | IXON);
-  tio.c_iflag |= (IGNCR | ICRNL);
+  if(sp->p_frame == SGW_FRAME_KATCP){
+    tio.c_iflag |= (IGNCR | ICRNL);
+  } else {
+    /* framing is done by us, keep every byte */
+    tio.c_iflag &= ~(IGNCR | ICRNL);
+  }
 
 #if 0
   tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR);
@@ -75,17 +127,18 @@ static int start_serial(char *device, int speed)
   tio.c_cflag &= ~(CSIZE | PARENB);
   tio.c_cflag |=  (CS8 | CLOCAL);
 
-  if(speed){
-    for(i = 0; (speed_table[i].x_speed > 0) && (speed_table[i].x_speed != speed); i++);
+  if(sp->p_speed){
+    for(i = 0; (speed_table[i].x_speed > 0) && (speed_table[i].x_speed != sp->p_speed); i++);
 
-    if(speed_table[i].x_speed != speed){
+    if(speed_table[i].x_speed != sp->p_speed){
       close(fd);
+      errno = EINVAL;
       return -1;
     }
 
     code = speed_table[i].x_code;
 #ifdef DEBUG
-    fprintf(stderr, "serial: setting serial speed to %d\n", speed);
+    fprintf(stderr, "serial: setting serial speed to %d\n", sp->p_speed);
 #endif
     cfsetispeed(&tio, code);
     cfsetospeed(&tio, code);
@@ -99,19 +152,695 @@ static int start_serial(char *device, int speed)
   return fd;
 }
 
+static void destroy_port(struct sgw_port *sp)
+{
+  if(sp == NULL){
+    return;
+  }
+
+  if(sp->p_line){
+    destroy_katcl(sp->p_line, 0);
+    sp->p_line = NULL;
+  }
+
+  if(sp->p_fd >= 0){
+    close(sp->p_fd);
+    sp->p_fd = (-1);
+  }
+
+  if(sp->p_name){
+    free(sp->p_name);
+    sp->p_name = NULL;
+  }
+
+  if(sp->p_device){
+    free(sp->p_device);
+    sp->p_device = NULL;
+  }
+
+  if(sp->p_input){
+    free(sp->p_input);
+    sp->p_input = NULL;
+  }
+
+  if(sp->p_output){
+    free(sp->p_output);
+    sp->p_output = NULL;
+  }
+
+  free(sp);
+}
+
+/* close a port which has failed, keep the structure for its name */
+static void shut_port(struct sgw_port *sp)
+{
+  if(sp->p_line){
+    destroy_katcl(sp->p_line, 0);
+    sp->p_line = NULL;
+  }
+
+  if(sp->p_fd >= 0){
+    close(sp->p_fd);
+    sp->p_fd = (-1);
+  }
+
+  sp->p_have = 0;
+  sp->p_pending = 0;
+}
+
+static int option_port(struct sgw_port *sp, char *key, char *value)
+{
+  int i;
+
+  if(!strcmp(key, "flat")){
+    sp->p_flat = 1;
+    return 0;
+  }
+  if(!strcmp(key, "prefix")){
+    sp->p_flat = 0;
+    return 0;
+  }
+
+  if(value == NULL){
+    return -1;
+  }
+
+  if(!strcmp(key, "speed")){
+    sp->p_speed = atoi(value);
+  } else if(!strcmp(key, "vmin")){
+    sp->p_vmin = atoi(value);
+    if((sp->p_vmin < 0) || (sp->p_vmin > 255)){
+      return -1;
+    }
+  } else if(!strcmp(key, "vtime")){
+    sp->p_vtime = atoi(value);
+    if((sp->p_vtime < 0) || (sp->p_vtime > 255)){
+      return -1;
+    }
+  } else if(!strcmp(key, "frame")){
+    for(i = 0; frame_table[i] && strcmp(frame_table[i], value); i++);
+    if(frame_table[i] == NULL){
+      return -1;
+    }
+    sp->p_frame = i;
+  } else if(!strcmp(key, "eol")){
+    if(!strcmp(value, "cr")){
+      sp->p_eol = '\r';
+    } else if(!strcmp(value, "lf")){
+      sp->p_eol = '\n';
+    } else {
+      sp->p_eol = strtol(value, NULL, 0) & 0xff;
+    }
+  } else if(!strcmp(key, "gap")){
+    sp->p_gap = atoi(value);
+  } else if(!strcmp(key, "max")){
+    i = atoi(value);
+    if(i <= 0){
+      return -1;
+    }
+    sp->p_max = i;
+  } else if(!strcmp(key, "timeout")){
+    sp->p_timeout = atoi(value);
+  } else {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* spec is [name=]device[,option[=value]]... - a port without a name is flat */
+
+static struct sgw_port *create_port(struct katcl_line *k, char *label, char *spec, int speed)
+{
+  struct sgw_port *sp;
+  char *copy, *token, *next, *value, *device;
+
+  sp = malloc(sizeof(struct sgw_port));
+  if(sp == NULL){
+    return NULL;
+  }
+
+  sp->p_name = NULL;
+  sp->p_device = NULL;
+  sp->p_flat = 0;
+
+  sp->p_speed = speed;
+  sp->p_vmin = 1;
+  sp->p_vtime = 0;
+
+  sp->p_frame = SGW_FRAME_KATCP;
+  sp->p_eol = '\n';
+  sp->p_gap = SGW_DEFAULT_GAP;
+  sp->p_max = SGW_DEFAULT_MAX;
+  sp->p_timeout = SGW_DEFAULT_TIMEOUT;
+
+  sp->p_fd = (-1);
+  sp->p_line = NULL;
+
+  sp->p_input = NULL;
+  sp->p_have = 0;
+
+  sp->p_output = NULL;
+  sp->p_size = 0;
+  sp->p_pending = 0;
+
+  sp->p_query = 0;
+
+  copy = strdup(spec);
+  if(copy == NULL){
+    destroy_port(sp);
+    return NULL;
+  }
+
+  next = strchr(copy, ',');
+  if(next){
+    *next++ = '\0';
+  }
+
+  device = strchr(copy, '=');
+  if(device){
+    *device++ = '\0';
+    sp->p_name = strdup(copy);
+  } else {
+    device = copy;
+    sp->p_name = strdup(device);
+    sp->p_flat = 1;
+  }
+  sp->p_device = strdup(device);
+
+  if((sp->p_name == NULL) || (sp->p_device == NULL)){
+    free(copy);
+    destroy_port(sp);
+    return NULL;
+  }
+
+  while(next){
+    token = next;
+    next = strchr(token, ',');
+    if(next){
+      *next++ = '\0';
+    }
+
+    value = strchr(token, '=');
+    if(value){
+      *value++ = '\0';
+    }
+
+    if(option_port(sp, token, value) < 0){
+      sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "bad option %s%s%s for port %s", token, value ? "=" : "", value ? value : "", sp->p_name);
+      free(copy);
+      destroy_port(sp);
+      return NULL;
+    }
+  }
+
+  free(copy);
+
+  if(sp->p_frame != SGW_FRAME_KATCP){
+    sp->p_input = malloc(sp->p_max);
+    if(sp->p_input == NULL){
+      destroy_port(sp);
+      return NULL;
+    }
+  }
+
+  sp->p_fd = start_serial(sp);
+  if(sp->p_fd < 0){
+    sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to open serial device %s: %s", sp->p_device, strerror(errno));
+    destroy_port(sp);
+    return NULL;
+  }
+
+  if(sp->p_frame == SGW_FRAME_KATCP){
+    sp->p_line = create_katcl(sp->p_fd);
+    if(sp->p_line == NULL){
+      sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to run katcp wrapper on serial file descriptor");
+      destroy_port(sp);
+      return NULL;
+    }
+  }
+
+  return sp;
+}
+
+static int live_port(struct sgw_port *sp)
+{
+  return sp->p_fd >= 0;
+}
+
+/* a prefixed port sees ?name.cmd as ?cmd, and its messages get the name put back */
+
+static char *local_name(struct sgw_port *sp, char *name)
+{
+  unsigned int len;
+
+  if(sp->p_flat){
+    return name + 1;
+  }
+
+  len = strlen(sp->p_name);
+  if(strncmp(name + 1, sp->p_name, len) || (name[len + 1] != '.')){
+    return NULL;
+  }
+
+  return name + len + 2;
+}
+
+static char *remote_name(struct sgw_port *sp, char *buffer, int type, char *name)
+{
+  if(sp->p_flat){
+    snprintf(buffer, SGW_NAME_MAX, "%c%s", type, name);
+  } else {
+    snprintf(buffer, SGW_NAME_MAX, "%c%s.%s", type, sp->p_name, name);
+  }
+  buffer[SGW_NAME_MAX - 1] = '\0';
+
+  return buffer;
+}
+
+static int rename_katcl(struct katcl_line *l, struct katcl_parse *p, char *name)
+{
+  unsigned int i, count;
+
+  count = get_count_parse_katcl(p);
+
+  if(append_string_katcl(l, KATCP_FLAG_FIRST | ((count <= 1) ? KATCP_FLAG_LAST : 0), name) < 0){
+    return -1;
+  }
+
+  for(i = 1; i < count; i++){
+    if(append_parameter_katcl(l, ((i + 1) >= count) ? KATCP_FLAG_LAST : 0, p, i) < 0){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int queue_output(struct sgw_port *sp, void *buffer, unsigned int len)
+{
+  unsigned char *tmp;
+
+  if((sp->p_pending + len) > sp->p_size){
+    tmp = realloc(sp->p_output, sp->p_pending + len);
+    if(tmp == NULL){
+      return -1;
+    }
+    sp->p_output = tmp;
+    sp->p_size = sp->p_pending + len;
+  }
+
+  memcpy(sp->p_output + sp->p_pending, buffer, len);
+  sp->p_pending += len;
+
+  return 0;
+}
+
+static int write_port(struct sgw_port *sp)
+{
+  int wr;
+
+  if(sp->p_line){
+    return write_katcl(sp->p_line);
+  }
+
+  if(sp->p_pending <= 0){
+    return 0;
+  }
+
+  wr = write(sp->p_fd, sp->p_output, sp->p_pending);
+  if(wr < 0){
+    switch(errno){
+      case EAGAIN :
+      case EINTR  :
+        return 0;
+    }
+    return -1;
+  }
+
+  sp->p_pending -= wr;
+  if(sp->p_pending > 0){
+    memmove(sp->p_output, sp->p_output + wr, sp->p_pending);
+  }
+
+  return 0;
+}
+
+static int flushing_port(struct sgw_port *sp)
+{
+  if(sp->p_line){
+    return flushing_katcl(sp->p_line);
+  }
+
+  return sp->p_pending > 0;
+}
+
+/* ?write and ?query on a framed port: arguments are sent separated by spaces */
+
+static int framed_request(struct sgw_port *sp, struct katcl_line *nk, struct katcl_parse *p, char *cmd)
+{
+  char buffer[SGW_NAME_MAX];
+  unsigned int i, count, len;
+  int query;
+  char eol, space;
+  void *ptr;
+
+  if(!strcmp(cmd, "write")){
+    query = 0;
+  } else if(!strcmp(cmd, "query")){
+    query = 1;
+  } else {
+    return 1;
+  }
+
+  remote_name(sp, buffer, KATCP_REPLY, cmd);
+
+  if(!live_port(sp)){
+    append_string_katcl(nk, KATCP_FLAG_FIRST, buffer);
+    append_string_katcl(nk, 0, KATCP_FAIL);
+    append_string_katcl(nk, KATCP_FLAG_LAST, "port down");
+    return 0;
+  }
+
+  if(query && sp->p_query){
+    append_string_katcl(nk, KATCP_FLAG_FIRST, buffer);
+    append_string_katcl(nk, 0, KATCP_FAIL);
+    append_string_katcl(nk, KATCP_FLAG_LAST, "query in progress");
+    return 0;
+  }
+
+  space = ' ';
+  count = get_count_parse_katcl(p);
+
+  for(i = 1; i < count; i++){
+    len = get_buffer_parse_katcl(p, i, NULL, 0);
+    ptr = NULL;
+    if(len > 0){
+      ptr = malloc(len);
+      if(ptr == NULL){
+        return -1;
+      }
+      get_buffer_parse_katcl(p, i, ptr, len);
+    }
+    if((i > 1) && queue_output(sp, &space, 1) < 0){
+      free(ptr);
+      return -1;
+    }
+    if(ptr){
+      if(queue_output(sp, ptr, len) < 0){
+        free(ptr);
+        return -1;
+      }
+      free(ptr);
+    }
+  }
+
+  if(sp->p_frame == SGW_FRAME_LINE){
+    eol = sp->p_eol;
+    if(queue_output(sp, &eol, 1) < 0){
+      return -1;
+    }
+  }
+
+  if(query){
+    /* stale input is not the answer to this question */
+    sp->p_have = 0;
+    sp->p_query = 1;
+    gettimeofday(&(sp->p_deadline), NULL);
+    sp->p_deadline.tv_sec += sp->p_timeout / 1000;
+    sp->p_deadline.tv_usec += (sp->p_timeout % 1000) * 1000;
+    if(sp->p_deadline.tv_usec >= 1000000){
+      sp->p_deadline.tv_sec++;
+      sp->p_deadline.tv_usec -= 1000000;
+    }
+  } else {
+    append_string_katcl(nk, KATCP_FLAG_FIRST, buffer);
+    append_string_katcl(nk, KATCP_FLAG_LAST, KATCP_OK);
+  }
+
+  return 0;
+}
+
+static int route_request(struct sgw_port **vector, unsigned int count, struct katcl_line *nk, struct katcl_parse *p)
+{
+  struct sgw_port *sp;
+  char *name, *cmd;
+  char buffer[SGW_NAME_MAX];
+  unsigned int i;
+  int pass, result;
+
+  name = get_string_parse_katcl(p, 0);
+  if(name == NULL){
+    return -1;
+  }
+
+  if(name[0] != KATCP_REQUEST){
+    return 0;
+  }
+
+  /* prefixed ports first, so that flat ones do not shadow them */
+  for(pass = 0; pass < 2; pass++){
+    for(i = 0; i < count; i++){
+      sp = vector[i];
+      if(sp->p_flat != pass){
+        continue;
+      }
+
+      cmd = local_name(sp, name);
+      if(cmd == NULL){
+        continue;
+      }
+
+      if(sp->p_frame != SGW_FRAME_KATCP){
+        result = framed_request(sp, nk, p, cmd);
+        if(result <= 0){
+          return result;
+        }
+        if(pass == 0){
+          break; /* prefix matched, but no such command */
+        }
+        continue;
+      }
+
+      if(!live_port(sp)){
+        append_string_katcl(nk, KATCP_FLAG_FIRST, remote_name(sp, buffer, KATCP_REPLY, cmd));
+        append_string_katcl(nk, 0, KATCP_FAIL);
+        append_string_katcl(nk, KATCP_FLAG_LAST, "port down");
+        return 0;
+      }
+
+      if(sp->p_flat){
+        return append_parse_katcl(sp->p_line, p);
+      }
+
+      buffer[0] = KATCP_REQUEST;
+      strncpy(buffer + 1, cmd, SGW_NAME_MAX - 1);
+      buffer[SGW_NAME_MAX - 1] = '\0';
+
+      return rename_katcl(sp->p_line, p, buffer);
+    }
+  }
+
+  snprintf(buffer, SGW_NAME_MAX, "%c%s", KATCP_REPLY, name + 1);
+  buffer[SGW_NAME_MAX - 1] = '\0';
+
+  append_string_katcl(nk, KATCP_FLAG_FIRST, buffer);
+  append_string_katcl(nk, 0, KATCP_FAIL);
+  append_string_katcl(nk, KATCP_FLAG_LAST, "no serial port handles this request");
+
+  return 0;
+}
+
+static void forward_message(struct sgw_port *sp, struct katcl_line *nk, struct katcl_parse *p)
+{
+  char buffer[SGW_NAME_MAX];
+  char *name;
+
+  if(sp->p_flat){
+    append_parse_katcl(nk, p);
+    return;
+  }
+
+  name = get_string_parse_katcl(p, 0);
+  if(name == NULL){
+    return;
+  }
+
+  rename_katcl(nk, p, remote_name(sp, buffer, name[0], name + 1));
+}
+
+/* a framed message is the answer to an outstanding query, otherwise it is reported as data */
+
+static void deliver_message(struct sgw_port *sp, struct katcl_line *nk, unsigned char *data, unsigned int len, unsigned int *discarded)
+{
+  char buffer[SGW_NAME_MAX];
+
+  if(nk == NULL){
+    sp->p_query = 0;
+    (*discarded)++;
+    return;
+  }
+
+  if(sp->p_query){
+    sp->p_query = 0;
+    append_string_katcl(nk, KATCP_FLAG_FIRST, remote_name(sp, buffer, KATCP_REPLY, "query"));
+    append_string_katcl(nk, 0, KATCP_OK);
+  } else {
+    append_string_katcl(nk, KATCP_FLAG_FIRST, remote_name(sp, buffer, KATCP_INFORM, "data"));
+  }
+
+  append_buffer_katcl(nk, KATCP_FLAG_LAST, data, len);
+}
+
+static int frame_input(struct sgw_port *sp, struct katcl_line *nk, unsigned int *discarded)
+{
+  unsigned char *end;
+  unsigned int len, used;
+
+  if(sp->p_frame == SGW_FRAME_RAW){
+    /* raw messages end on an idle gap, or when the buffer fills */
+    if(sp->p_have >= sp->p_max){
+      deliver_message(sp, nk, sp->p_input, sp->p_have, discarded);
+      sp->p_have = 0;
+    }
+    return 0;
+  }
+
+  used = 0;
+  while((end = memchr(sp->p_input + used, sp->p_eol, sp->p_have - used)) != NULL){
+    len = end - (sp->p_input + used);
+    if((len > 0) && (sp->p_eol == '\n') && (sp->p_input[used + len - 1] == '\r')){
+      len--;
+    }
+    if(len > 0){
+      deliver_message(sp, nk, sp->p_input + used, len, discarded);
+    }
+    used = (end - sp->p_input) + 1;
+  }
+
+  if(used > 0){
+    sp->p_have -= used;
+    if(sp->p_have > 0){
+      memmove(sp->p_input, sp->p_input + used, sp->p_have);
+    }
+  }
+
+  /* an overlong line is passed on in pieces rather than dropped */
+  if(sp->p_have >= sp->p_max){
+    deliver_message(sp, nk, sp->p_input, sp->p_have, discarded);
+    sp->p_have = 0;
+  }
+
+  return 0;
+}
+
+static int read_framed(struct sgw_port *sp)
+{
+  int rr;
+
+  rr = read(sp->p_fd, sp->p_input + sp->p_have, sp->p_max - sp->p_have);
+  if(rr < 0){
+    switch(errno){
+      case EAGAIN :
+      case EINTR  :
+        return 0;
+    }
+    return -1;
+  }
+
+  if(rr == 0){
+    return 1;
+  }
+
+  sp->p_have += rr;
+  gettimeofday(&(sp->p_last), NULL);
+
+  return 0;
+}
+
+static int port_deadline(struct sgw_port *sp, struct timeval *when)
+{
+  struct timeval delta;
+  int found;
+
+  found = 0;
+
+  if(!live_port(sp)){
+    return 0;
+  }
+
+  if((sp->p_frame == SGW_FRAME_RAW) && (sp->p_have > 0)){
+    delta.tv_sec = sp->p_gap / 1000;
+    delta.tv_usec = (sp->p_gap % 1000) * 1000;
+    add_time_katcp(when, &(sp->p_last), &delta);
+    found = 1;
+  }
+
+  if(sp->p_query){
+    if((found == 0) || (cmp_time_katcp(&(sp->p_deadline), when) < 0)){
+      when->tv_sec = sp->p_deadline.tv_sec;
+      when->tv_usec = sp->p_deadline.tv_usec;
+    }
+    found = 1;
+  }
+
+  return found;
+}
+
+static void expire_port(struct sgw_port *sp, struct katcl_line *nk, struct timeval *now, unsigned int *discarded)
+{
+  struct timeval delta, when;
+  char buffer[SGW_NAME_MAX];
+
+  if(!live_port(sp)){
+    return;
+  }
+
+  if((sp->p_frame == SGW_FRAME_RAW) && (sp->p_have > 0)){
+    delta.tv_sec = sp->p_gap / 1000;
+    delta.tv_usec = (sp->p_gap % 1000) * 1000;
+    add_time_katcp(&when, &(sp->p_last), &delta);
+    if(cmp_time_katcp(&when, now) <= 0){
+      /* pick up anything held back by a large VMIN before closing the message */
+      if(sp->p_have < sp->p_max){
+        read_framed(sp);
+      }
+      deliver_message(sp, nk, sp->p_input, sp->p_have, discarded);
+      sp->p_have = 0;
+    }
+  }
+
+  if(sp->p_query && (cmp_time_katcp(&(sp->p_deadline), now) <= 0)){
+    sp->p_query = 0;
+    if(nk){
+      append_string_katcl(nk, KATCP_FLAG_FIRST, remote_name(sp, buffer, KATCP_REPLY, "query"));
+      append_string_katcl(nk, 0, KATCP_FAIL);
+      append_string_katcl(nk, KATCP_FLAG_LAST, "timeout");
+    }
+  }
+}
+
 void usage(char *label, struct katcl_line *k)
 {
   sync_message_katcl(k, KATCP_LEVEL_INFO, label, "serial-device [port [serial-speed]]");
+  sync_message_katcl(k, KATCP_LEVEL_INFO, label, "-d [name=]device[,option]... adds a port, may be given repeatedly");
+  sync_message_katcl(k, KATCP_LEVEL_INFO, label, "port options: speed=n vmin=n vtime=n frame=katcp|line|raw eol=lf|cr|n gap=ms max=bytes timeout=ms flat prefix");
+  sync_message_katcl(k, KATCP_LEVEL_INFO, label, "a named port answers ?name.cmd, an unnamed or flat port answers ?cmd");
+  sync_message_katcl(k, KATCP_LEVEL_INFO, label, "line and raw ports take ?write and ?query, and report unsolicited input as #data");
+  sync_message_katcl(k, KATCP_LEVEL_INFO, label, "-p address sets the listening address, -b speed the default serial speed");
 }
 
 int main(int argc, char **argv)
 {
-  char *net, *serial, *label;
-  int i, j, c, lfd, run, fd, mfd, result, count, speed;
-  struct katcl_line *sk, *nk, *k;
+  char *net, *serial, *label, **specs, **tmp;
+  int i, j, c, lfd, run, fd, mfd, result, speed, live;
+  unsigned int count, total, n;
+  struct katcl_line *nk, *k;
   struct katcl_parse *p;
+  struct sgw_port **ports, *sp;
+  struct timeval now, when, earliest, delta;
   fd_set fsr, fsw;
-  
+
   label = "katcp-serial-gateway";
 
   k = create_katcl(STDOUT_FILENO);
@@ -119,7 +848,6 @@ int main(int argc, char **argv)
     fprintf(stderr, "%s: unable to create katcp message logic\n", label);
     return 4;
   }
-  sk = NULL;
   nk = NULL;
 
   speed = 0;
@@ -127,6 +855,9 @@ int main(int argc, char **argv)
   net = NULL;
   count = 0;
 
+  specs = NULL;
+  total = 0;
+
   i = j = 1;
   while (i < argc) {
     if (argv[i][0] == '-') {
@@ -138,6 +869,8 @@ int main(int argc, char **argv)
           return 0;
 
         case 'b' :
+        case 'd' :
+        case 'p' :
         case 's' :
 
           j++;
@@ -164,8 +897,20 @@ int main(int argc, char **argv)
             case 's' :
               serial = argv[i] + j;
               break;
+            case 'd' :
+              tmp = realloc(specs, sizeof(char *) * (total + 1));
+              if(tmp == NULL){
+                return 4;
+              }
+              specs = tmp;
+              specs[total++] = argv[i] + j;
+              break;
           }
 
+          i++;
+          j = 1;
+          break;
+
         case '-' :
           j++;
           break;
@@ -194,32 +939,45 @@ int main(int argc, char **argv)
   }
 
   if(speed <= 0){
-    speed = 9600;
+    speed = SGW_DEFAULT_SPEED;
   }
 
-  if(serial == NULL){
+  if((serial == NULL) && (total == 0)){
     sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "need a serial port to relay");
     usage(label, k);
     return 2;
   }
 
-#if 0
-  fd = open(serial, O_RDWR | O_NOCTTY);
-#endif
-  fd = start_serial(serial, speed);
-  if(fd < 0){
-    sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to open serial device %s: %s", serial, strerror(errno));
-    return 3;
-  }
-  sk = create_katcl(fd);
-  if(sk == NULL){
-    sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to run katcp wrapper on serial file descriptor");
+  /* the plain serial device argument is an unnamed, flat katcp port */
+  ports = malloc(sizeof(struct sgw_port *) * (total + 1));
+  if(ports == NULL){
     return 4;
   }
 
+  n = 0;
+  if(serial){
+    ports[n] = create_port(k, label, serial, speed);
+    if(ports[n] == NULL){
+      return 3;
+    }
+    n++;
+  }
+  for(i = 0; i < total; i++){
+    ports[n] = create_port(k, label, specs[i], speed);
+    if(ports[n] == NULL){
+      return 3;
+    }
+    n++;
+  }
+  total = n;
+
+  if(specs){
+    free(specs);
+  }
+
   lfd = net_listen(net, 0, 0);
   if(lfd < 0){
-    sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unknown option -%c", argv[i][j]);
+    sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to listen on %s", net ? net : "default port");
     return 3;
   }
 
@@ -252,18 +1010,45 @@ int main(int argc, char **argv)
       }
     }
 
-    if(sk){
-      fd = fileno_katcl(sk);
-      if(flushing_katcl(sk)){
+    live = 0;
+    result = 0;
+
+    for(i = 0; i < total; i++){
+      sp = ports[i];
+      if(!live_port(sp)){
+        continue;
+      }
+      live++;
+
+      fd = sp->p_fd;
+      if(flushing_port(sp)){
         FD_SET(fd, &fsw);
       }
       FD_SET(fd, &fsr);
       if(mfd < fd){
         mfd = fd;
       }
+
+      if(port_deadline(sp, &when)){
+        if((result == 0) || (cmp_time_katcp(&when, &earliest) < 0)){
+          earliest.tv_sec = when.tv_sec;
+          earliest.tv_usec = when.tv_usec;
+        }
+        result = 1;
+      }
+    }
+
+    if(live == 0){
+      sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "no serial ports left");
+      break;
     }
 
-    result = select(mfd + 1, &fsr, &fsw, NULL, NULL);
+    if(result){
+      gettimeofday(&now, NULL);
+      sub_time_katcp(&delta, &earliest, &now);
+    }
+
+    result = select(mfd + 1, &fsr, &fsw, NULL, result ? &delta : NULL);
     switch(result){
       case -1 :
         switch(errno){
@@ -275,12 +1060,10 @@ int main(int argc, char **argv)
             return 4;
         }
         break;
-#if 0
-      case  0 :
-        sync_message_katcl(k, KATCP_LEVEL_ERROR, label, "requests timed out after %dms", timeout);
-        /* could terminate cleanly here, but ... */
-        return 3;
-#endif
+      case 0 :
+        FD_ZERO(&fsr);
+        FD_ZERO(&fsw);
+        break;
     }
 
     if(k){
@@ -313,75 +1096,100 @@ int main(int argc, char **argv)
           }
           destroy_katcl(nk, 1);
           nk = NULL;
+          for(i = 0; i < total; i++){
+            ports[i]->p_query = 0;
+          }
           continue;
         }
 
         while(have_katcl(nk) > 0){
           p = ready_katcl(nk);
           if(p){
-            append_parse_katcl(sk, p);
+            if(route_request(ports, total, nk, p) < 0){
+              log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to relay request");
+            }
           }
         }
       }
-    } else {
+    } else if(FD_ISSET(lfd, &fsr)){
       /* TODO: should report an address */
       fd = accept(lfd, NULL, NULL);
       if(fd < 0){
-        log_message_katcl(k, KATCP_LEVEL_ERROR, label, "network accept failed: %s", strerror(error_katcl(nk)));
-      }
-      nk = create_katcl(fd);
-      if(nk == NULL){
-        log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to encapsulate network file descriptor");
-        close(fd);
-      }
-      if(count > 0){
-        log_message_katcl(nk, KATCP_LEVEL_WARN, label, "discarded %u messages while no client was connected", count);
-        count = 0;
+        log_message_katcl(k, KATCP_LEVEL_ERROR, label, "network accept failed: %s", strerror(errno));
+      } else {
+        nk = create_katcl(fd);
+        if(nk == NULL){
+          log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to encapsulate network file descriptor");
+          close(fd);
+        } else {
+          if(count > 0){
+            log_message_katcl(nk, KATCP_LEVEL_WARN, label, "discarded %u messages while no client was connected", count);
+            count = 0;
+          }
+          for(i = 0; i < total; i++){
+            sp = ports[i];
+            log_message_katcl(nk, KATCP_LEVEL_DEBUG, label, "%s port %s on %s at speed %d framed as %s", sp->p_flat ? "flat" : "prefixed", sp->p_name, sp->p_device, sp->p_speed, frame_table[sp->p_frame]);
+          }
+        }
       }
-      log_message_katcl(nk, KATCP_LEVEL_DEBUG, label, "connected to %s at speed %d", serial, speed);
     }
 
-    if(sk){
-      fd = fileno_katcl(sk);
+    for(i = 0; i < total; i++){
+      sp = ports[i];
+      if(!live_port(sp)){
+        continue;
+      }
+
+      fd = sp->p_fd;
 
       if(FD_ISSET(fd, &fsw)){ /* flushing things */
-        result = write_katcl(sk);
+        result = write_port(sp);
         if(result < 0){
-          log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to write to serial port %s: %s", serial, strerror(error_katcl(sk)));
-          destroy_katcl(sk, 1);
-          sk = NULL;
-          run = 0;
-          /* WARNING: unsatisfactory, may starve flushing logic */
+          log_message_katcl(k, KATCP_LEVEL_ERROR, label, "unable to write to serial port %s: %s", sp->p_name, strerror(sp->p_line ? error_katcl(sp->p_line) : errno));
+          shut_port(sp);
           continue;
         }
       }
 
       if(FD_ISSET(fd, &fsr)){ /* reading */
-        result = read_katcl(sk);
+        if(sp->p_line){
+          result = read_katcl(sp->p_line);
+        } else {
+          result = read_framed(sp);
+        }
+
         if(result){
           if(result < 0){
-            log_message_katcl(k, KATCP_LEVEL_ERROR, label, "serial read from %s failed: %s", serial, strerror(error_katcl(sk)));
+            log_message_katcl(k, KATCP_LEVEL_ERROR, label, "serial read from %s failed: %s", sp->p_name, strerror(sp->p_line ? error_katcl(sp->p_line) : errno));
           } else {
-            log_message_katcl(k, KATCP_LEVEL_WARN, label, "serial port hung up");
+            log_message_katcl(k, KATCP_LEVEL_WARN, label, "serial port %s hung up", sp->p_name);
           }
-          destroy_katcl(sk, 1);
-          sk = NULL;
-          run = 0;
+          shut_port(sp);
+          continue;
         }
-        while(have_katcl(sk) > 0){
-          p = ready_katcl(sk);
-          if(p){
-            if(nk){
-              append_parse_katcl(nk, p);
-            } else {
-              count++;
+
+        if(sp->p_line){
+          while(have_katcl(sp->p_line) > 0){
+            p = ready_katcl(sp->p_line);
+            if(p){
+              if(nk){
+                forward_message(sp, nk, p);
+              } else {
+                count++;
+              }
             }
           }
+        } else {
+          frame_input(sp, nk, &count);
         }
-        continue;
       }
     }
 
+    gettimeofday(&now, NULL);
+    for(i = 0; i < total; i++){
+      expire_port(ports[i], nk, &now, &count);
+    }
+
   }
 
   if(nk){
@@ -389,10 +1197,10 @@ int main(int argc, char **argv)
     nk = NULL;
   }
 
-  if(sk){
-    destroy_katcl(sk, 1);
-    sk = NULL;
+  for(i = 0; i < total; i++){
+    destroy_port(ports[i]);
   }
+  free(ports);
 
   if(lfd >= 0){
     close(lfd);
@@ -39,6 +39,13 @@ char *sensor_status_names[KATCP_STATA_COUNT] = { "unknown", "nominal", "warn", "
 char *sensor_status_names[KATCP_STATA_COUNT] = { "unknown", "nominal", "warn", "error", "failure" };
 #endif
 
+struct sq_sensor{
+  char *s_name;
+  unsigned short s_success[SENSOR_NAMES_COUNT];
+  int s_explicit;
+  int s_met;
+};
+
 volatile int up_running;
 
 void handle_alarm(int signal)
@@ -88,11 +95,56 @@ int issue_request(struct katcl_line *l, char *sensor, int verbose)
   return 0;
 }
 
-int await_result(struct katcl_line *l, char *sensor, unsigned short *success, int verbose)
+static int check_condition(struct sq_sensor *set, unsigned int count, int any)
+{
+  unsigned int i, met;
+
+  met = 0;
+  for(i = 0; i < count; i++){
+    if(set[i].s_met){
+      met++;
+    }
+  }
+
+  if(any){
+    return (met > 0) ? 1 : 0;
+  }
+
+  return (met >= count) ? 1 : 0;
+}
+
+static void update_sensor(struct sq_sensor *set, unsigned int count, char *match, char *status, int verbose)
+{
+  unsigned int i, j;
+
+  if(verbose){
+    fprintf(stderr, "%s: sensor status is %s for %s\n", NAME, status, match);
+  }
+
+  for(i = 0; i < count; i++){
+    if(strcmp(set[i].s_name, match)){
+      continue;
+    }
+
+    set[i].s_met = 0;
+    for(j = 0; j < SENSOR_NAMES_COUNT; j++){
+      if(set[i].s_success[j] && !strcmp(sensor_status_names[j], status)){
+        if(verbose){
+          fprintf(stderr, "%s: sensor %s matches desired status %s\n", NAME, match, sensor_status_names[j]);
+        }
+        set[i].s_met = 1;
+      }
+    }
+  }
+}
+
+/* returns 1 once the condition holds, 0 to keep waiting, -1 to reconnect */
+
+int await_result(struct katcl_line *l, struct sq_sensor *set, unsigned int count, int any, unsigned int *acked, int verbose)
 {
   char *status, *match, *ptr;
   fd_set fsr, fsw;
-  int i, fd, count, result;
+  int i, fd, total, result;
 
   fd = fileno_katcl(l);
 
@@ -142,22 +194,13 @@ int await_result(struct katcl_line *l, char *sensor, unsigned short *success, in
       switch(ptr[0]){
         case KATCP_INFORM : 
           if(!strcmp(ptr, "#sensor-status")){
-            count = arg_count_katcl(l);
-            if(count >= 5){
-              match = arg_string_katcl(l, 3);
-              status = arg_string_katcl(l, 4);
+            /* #sensor-status time count (name status value)+ */
+            total = arg_count_katcl(l);
+            for(i = 3; (i + 1) < total; i += 3){
+              match = arg_string_katcl(l, i);
+              status = arg_string_katcl(l, i + 1);
               if(match && status){
-                if(verbose){
-                  fprintf(stderr, "%s: sensor status is %s for %s\n", NAME, status, match);
-                }
-                for(i = 0; i < SENSOR_NAMES_COUNT; i++){
-                  if(success[i] && !strcmp(sensor_status_names[i], status)){
-                    if(verbose){
-                      fprintf(stderr, "%s: sensor %s matches desired status %s\n", NAME, match, sensor_status_names[i]);
-                    }
-                    return 1;
-                  }
-                }
+                update_sensor(set, count, match, status, verbose);
               }
             }
           }
@@ -166,9 +209,11 @@ int await_result(struct katcl_line *l, char *sensor, unsigned short *success, in
           if(!strcmp(ptr, "!sensor-sampling")){
             ptr = arg_string_katcl(l, 1);
             if((ptr == NULL) || strcmp(ptr, KATCP_OK)){
-              fprintf(stderr, "%s: unable to monitor sensor %s\n", NAME, sensor);
+              /* replies arrive in the order of the requests */
+              fprintf(stderr, "%s: unable to monitor sensor %s\n", NAME, (*acked < count) ? set[*acked].s_name : "(unknown)");
               return -1;
             }
+            (*acked)++;
           } else {
             if(verbose){
               fprintf(stderr, "%s: response %s is unexpected", NAME, ptr);
@@ -187,15 +232,16 @@ int await_result(struct katcl_line *l, char *sensor, unsigned short *success, in
     }
   }
 
-  return 0;
+  return check_condition(set, count, any);
 }
 
 void usage(char *app){
   int i;
 
-  printf("%s: sensor query - wait for a sensor to acquire a given status\n", NAME);
-  printf("usage: %s [-h] [-v] [-q] [-s server:port] [-t timeout] [-w status] sensor-name\n", app);
+  printf("%s: sensor query - wait for sensors to acquire a given status\n", NAME);
+  printf("usage: %s [-h] [-v] [-q] [-a] [-s server:port] [-t timeout] [-w status] sensor-name[=status[,status]] ...\n", app);
   printf("-h              this help\n");
+  printf("-a              stop once any of the sensors has a desired status (default is all of them)\n");
   printf("-v              increase verbosity\n");
   printf("-q              quiet\n");
   printf("-s server:port  connect to the server address on the given port\n");
@@ -210,15 +256,67 @@ void usage(char *app){
   printf(" (default is %s)\n", sensor_status_names[SENSOR_NAME_NOMINAL]);
 
   printf("-t timeout      timeout in seconds (wait indefinitely by default)\n");
+  printf("notes:\n");
+  printf("  a status list given after a sensor name overrides the -w options for that sensor\n");
+  printf("  all sensors are monitored with event sampling over a single connection\n");
 
 }
 
+static int add_sensor(struct sq_sensor **set, unsigned int *count, char *arg)
+{
+  struct sq_sensor *tmp, *sx;
+  char *ptr, *list;
+  int k, found;
+
+  tmp = realloc(*set, sizeof(struct sq_sensor) * (*count + 1));
+  if(tmp == NULL){
+    return -1;
+  }
+  *set = tmp;
+
+  sx = &(tmp[*count]);
+
+  sx->s_name = arg;
+  sx->s_explicit = 0;
+  sx->s_met = 0;
+
+  for(k = 0; k < SENSOR_NAMES_COUNT; k++){
+    sx->s_success[k] = 0;
+  }
+
+  list = strchr(arg, '=');
+  if(list){
+    *list = '\0';
+    list++;
+    for(ptr = strtok(list, ","); ptr; ptr = strtok(NULL, ",")){
+      found = 0;
+      for(k = 0; k < SENSOR_NAMES_COUNT; k++){
+        if(!strcmp(sensor_status_names[k], ptr)){
+          sx->s_success[k] = 1;
+          found = 1;
+        }
+      }
+      if(found == 0){
+        fprintf(stderr, "%s: unknown status %s for sensor %s\n", NAME, ptr, arg);
+        return -1;
+      }
+      sx->s_explicit = 1;
+    }
+  }
+
+  (*count)++;
+
+  return 0;
+}
+
 int main(int argc, char **argv)
 {
-  char *server, *sensor;
+  char *server;
   int i, j, k, c;
-  int verbose, result, timeout, code;
+  int verbose, result, timeout, code, any;
+  unsigned int count, acked, n;
   struct katcl_line *l;
+  struct sq_sensor *set;
   unsigned short success[SENSOR_NAMES_COUNT];
   struct sigaction san, sao;
 
@@ -229,7 +327,10 @@ int main(int argc, char **argv)
   
   verbose = 1;
   timeout = 0;
-  sensor = NULL;
+  any = 0;
+
+  set = NULL;
+  count = 0;
 
   for(i = 0; i < SENSOR_NAMES_COUNT; i++){
     success[i] = 0;
@@ -253,6 +354,10 @@ int main(int argc, char **argv)
           verbose = 0;
           j++;
           break;
+        case 'a' : 
+          any = 1;
+          j++;
+          break;
 
         case 's' :
         case 't' :
@@ -300,46 +405,51 @@ int main(int argc, char **argv)
           return 2;
       }
     } else {
-      if(sensor){
-        fprintf(stderr, "%s: extra parameter %s\n", NAME, argv[i]);
+      if(add_sensor(&set, &count, argv[i]) < 0){
+        fprintf(stderr, "%s: unable to add sensor %s\n", NAME, argv[i]);
         return 2;
       }
-      sensor = argv[i];
       i++;
     }
   }
 
-  if(sensor == NULL){
+  if(count == 0){
     fprintf(stderr, "%s: need a sensor to monitor\n", NAME);
     return 2;
   }
 
-  if(verbose){
-    fprintf(stderr, "%s: waiting for sensor %s to acquire status", NAME, sensor);
-  }
-
-  i = j = 0;
-  while(i < SENSOR_NAMES_COUNT){
-    if(success[i]){
-      if(verbose){
-        fprintf(stderr, "%s%s", (j > 0) ? " or " : " ", sensor_status_names[i]);
-      }
+  for(k = 0, j = 0; k < SENSOR_NAMES_COUNT; k++){
+    if(success[k]){
       j++;
     }
-    i++;
   }
-  
   if(j == 0){
     success[SENSOR_NAME_NOMINAL] = 1;
-    if(verbose){
-      fprintf(stderr, " %s\n", sensor_status_names[SENSOR_NAME_NOMINAL]);
+  }
+
+  for(n = 0; n < count; n++){
+    if(set[n].s_explicit == 0){
+      for(k = 0; k < SENSOR_NAMES_COUNT; k++){
+        set[n].s_success[k] = success[k];
+      }
     }
-  } else {
+
     if(verbose){
+      fprintf(stderr, "%s: waiting for sensor %s to acquire status", NAME, set[n].s_name);
+      for(k = 0, j = 0; k < SENSOR_NAMES_COUNT; k++){
+        if(set[n].s_success[k]){
+          fprintf(stderr, "%s%s", (j > 0) ? " or " : " ", sensor_status_names[k]);
+          j++;
+        }
+      }
       fprintf(stderr, "\n");
     }
   }
 
+  if(verbose && (count > 1)){
+    fprintf(stderr, "%s: done once %s of the %u sensors match\n", NAME, any ? "any" : "all", count);
+  }
+
   up_running = 1;
 
   if(timeout > 0){
@@ -367,11 +477,14 @@ int main(int argc, char **argv)
       continue;
     }
 
-    if(issue_request(l, sensor, verbose) < 0){
-      continue;
+    /* a fresh connection reports every sensor again */
+    acked = 0;
+    for(n = 0; n < count; n++){
+      set[n].s_met = 0;
+      issue_request(l, set[n].s_name, verbose);
     }
 
-    while((result = await_result(l, sensor, success, verbose)) == 0);
+    while(((result = await_result(l, set, count, any, &acked, verbose)) == 0) && (up_running > 0));
 
     if(result > 0){
       up_running = 0;
@@ -379,10 +492,20 @@ int main(int argc, char **argv)
     }
   }
 
+  if(code && verbose){
+    for(n = 0; n < count; n++){
+      if(set[n].s_met == 0){
+        fprintf(stderr, "%s: sensor %s has not reached a desired status\n", NAME, set[n].s_name);
+      }
+    }
+  }
+
   if(l){
     destroy_katcl(l, 1);
   }
 
+  free(set);
+
 #if 0
   alarm(0);
   sigaction(SIGALRM, &sao, NULL);
@@ -65,54 +65,162 @@ struct tbs_hwsensor *alloc_hwsensor_tbs()
   hs->h_name = NULL;
   hs->h_desc = NULL;
   hs->h_unit = NULL;
+  hs->h_acquire = NULL;
+  hs->h_raw = 0;
+  hs->h_valid = 0;
 
   return hs;
 }
 
-int read_fd_hwsensor_tbs(int fd)
+int read_fd_hwsensor_tbs(int fd, int *value)
 {
-  char buf[10];
+  char buf[16], *end;
   int size;
+  long v;
 
   if (fd < 0){
     return -1;
   }
 
-  if (lseek(fd, 0, SEEK_SET) < 0){
+  /* sysfs attributes are regenerated on every read from offset zero, pread saves the seek */
+  size = pread(fd, buf, sizeof(buf) - 1, 0);
+  if (size <= 0){
 #ifdef KATCP_STDERR_ERRORS
-    fprintf(stderr, "hwmon: cannot lseek fd: %d\n", fd);
+    fprintf(stderr, "hwmon: cannot read fd %d: %s\n", fd, (size < 0) ? strerror(errno) : "empty");
 #endif
     return -1;
   }
+  buf[size] = '\0';
 
-  size = read(fd, &buf, sizeof(buf));
-  if (size <= 0){
+  v = strtol(buf, &end, 10);
+  if (end == buf){
     return -1;
   }
 
-  return atoi(buf);
+  *value = v;
+
+  return 0;
 }
 
-int read_hwsensor_tbs(struct katcp_dispatch *d, struct katcp_acquire *a)
+static int scale_hwsensor_tbs(struct tbs_hwsensor *hs)
 {
+  if (hs->h_div == 0){
+    return hs->h_raw;
+  }
+
+  return (hs->h_mult * hs->h_raw) / hs->h_div;
+}
+
+/* nobody watching means the files are only read every few ticks, otherwise
+ * the interval keeps up with the fastest periodic subscriber. Checking for
+ * subscribers costs nothing, so that happens on every tick */
+
+static unsigned int watch_hwmon_tbs(struct katcp_dispatch *d, struct tbs_hwgroup *hg, unsigned int *interval)
+{
+  struct katcp_acquire *a;
+  unsigned int i, next, period, users;
+
+  users = 0;
+  next = TBS_HWMON_PERIOD;
+
+  for(i = 0; i < hg->w_count; i++){
+    a = hg->w_sensors[i]->h_acquire;
+    if(is_up_acquire_katcp(d, a) <= 0){
+      continue;
+    }
+    users++;
+    if(a->a_periodics > 0){
+      period = (a->a_current.tv_sec * 1000) + (a->a_current.tv_usec / 1000);
+      if(period < next){
+        next = period;
+      }
+    }
+  }
+
+  if(next < TBS_HWMON_FAST){
+    next = TBS_HWMON_FAST;
+  }
+
+  *interval = next;
+
+  return users;
+}
+
+/* one pass over all hardware sensors: values which have not changed are
+ * not propagated, the others are collected by the core loop and go out
+ * together once this callback returns */
+
+int poll_hwmon_tbs(struct katcp_dispatch *d, void *data)
+{
+  struct tbs_hwgroup *hg;
   struct tbs_hwsensor *hs;
+  unsigned int i, users, next;
   int value;
 
-  if (a == NULL){
-    return -1;
+  hg = data;
+
+  users = watch_hwmon_tbs(d, hg, &next);
+
+  if(users > 0){
+    hg->w_idle = 0;
+  } else if(hg->w_idle > 0){
+    hg->w_idle--;
+  } else {
+    hg->w_idle = (TBS_HWMON_IDLE / TBS_HWMON_PERIOD) - 1;
+    users = 1; /* refresh the cached values anyway */
   }
 
-  hs = a->a_local;
-  if (hs == NULL){
-    return -1;
+  for(i = 0; (i < hg->w_count) && (users > 0); i++){
+    hs = hg->w_sensors[i];
+
+    if(read_fd_hwsensor_tbs(hs->h_adc_fd, &value) < 0){
+      if(hs->h_valid){
+        /* report the loss once */
+        hs->h_valid = 0;
+        propagate_acquire_katcp(d, hs->h_acquire);
+      }
+      continue;
+    }
+
+    if(hs->h_valid && (hs->h_raw == value)){
+      continue;
+    }
+
+    hs->h_raw = value;
+    hs->h_valid = 1;
+
+    set_integer_acquire_katcp(d, hs->h_acquire, scale_hwsensor_tbs(hs));
   }
 
-  value = read_fd_hwsensor_tbs(hs->h_adc_fd);
-  if(value == (-1)){
-    return -1;
+  if(next != hg->w_poll){
+    if(register_every_ms_katcp(d, next, &poll_hwmon_tbs, hg) < 0){
+      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to poll hardware sensors every %ums", next);
+    } else {
+      log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "polling %u hardware sensors every %ums", hg->w_count, next);
+      hg->w_poll = next;
+    }
   }
 
-  return (hs->h_mult * value) / hs->h_div;
+  return 0;
+}
+
+void release_hwmon_tbs(struct katcp_dispatch *d, struct tbs_raw *tr)
+{
+  struct tbs_hwgroup *hg;
+
+  hg = &(tr->r_hwgroup);
+
+  if(hg->w_poll){
+    discharge_timer_katcp(d, hg);
+    hg->w_poll = 0;
+  }
+
+  /* the sensors themselves belong to the r_hwmon tree */
+  if(hg->w_sensors){
+    free(hg->w_sensors);
+    hg->w_sensors = NULL;
+  }
+  hg->w_count = 0;
 }
 
 int extract_hwsensor_tbs(struct katcp_dispatch *d, struct katcp_sensor *sn)
@@ -137,7 +245,9 @@ int extract_hwsensor_tbs(struct katcp_dispatch *d, struct katcp_sensor *sn)
   is = sn->s_more;
   ia = a->a_more;
 
-  if((ia->ia_current < hs->h_min) || (ia->ia_current > hs->h_max)){
+  if(hs->h_valid == 0){
+    set_status_sensor_katcp(sn, KATCP_STATUS_UNREACHABLE);
+  } else if((ia->ia_current < hs->h_min) || (ia->ia_current > hs->h_max)){
     set_status_sensor_katcp(sn, KATCP_STATUS_ERROR);
   } else {
     set_status_sensor_katcp(sn, KATCP_STATUS_NOMINAL);
@@ -235,6 +345,11 @@ int flush_hwsensor_tbs(struct katcp_dispatch *d, struct katcp_sensor *sn)
     }
   }
 
+  if(hs->h_valid){
+    /* scaling or limits changed, don't wait for the reading to change too */
+    set_integer_acquire_katcp(d, a, scale_hwsensor_tbs(hs));
+  }
+
   return 0;
 }
 
@@ -304,7 +419,9 @@ struct tbs_hwsensor *create_hwsensor_tbs(struct katcp_dispatch *d, char *name, c
   if (min){
     minfd = open(min, O_RDONLY);
     if (minfd > 0){
-      hs->h_min = read_fd_hwsensor_tbs(minfd);
+      if (read_fd_hwsensor_tbs(minfd, &(hs->h_min)) < 0){
+        hs->h_min = 0;
+      }
       close(minfd);
     } else {
 #if KATCP_STDERR_ERRORS
@@ -317,7 +434,9 @@ struct tbs_hwsensor *create_hwsensor_tbs(struct katcp_dispatch *d, char *name, c
   if (max) {
     maxfd = open(max, O_RDONLY);
     if (maxfd > 0){
-      hs->h_max = read_fd_hwsensor_tbs(maxfd);
+      if (read_fd_hwsensor_tbs(maxfd, &(hs->h_max)) < 0){
+        hs->h_max = INT_MAX;
+      }
       close(maxfd);
     } else {
 #if KATCP_STDERR_ERRORS
@@ -334,7 +453,7 @@ int register_hwmon_tbs(struct katcp_dispatch *d, char *label, char *desc, char *
 {
   struct katcp_acquire *a;
   struct tbs_raw *tr;
-  struct tbs_hwsensor *hs;
+  struct tbs_hwsensor *hs, **tmp;
 
   tr = get_mode_katcp(d, TBS_MODE_RAW);
   if (tr == NULL){
@@ -353,8 +472,16 @@ int register_hwmon_tbs(struct katcp_dispatch *d, char *label, char *desc, char *
     return -1;
   }
 
-  /*NULL release since avltree will manage the data*/
-  a = setup_integer_acquire_katcp(d, &read_hwsensor_tbs, hs, NULL);
+  tmp = realloc(tr->r_hwgroup.w_sensors, sizeof(struct tbs_hwsensor *) * (tr->r_hwgroup.w_count + 1));
+  if (tmp == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate space for hw sensor %s", label);
+    destroy_hwsensor_tbs(hs);
+    return -1;
+  }
+  tr->r_hwgroup.w_sensors = tmp;
+
+  /* no get function, poll_hwmon_tbs pushes values in. NULL release since avltree will manage the data */
+  a = setup_integer_acquire_katcp(d, NULL, hs, NULL);
   if (a == NULL){
 #ifdef DEBUG
     fprintf(stderr, "hwmon: unable to setup integer acquire for %s\n", label);
@@ -392,6 +519,11 @@ int register_hwmon_tbs(struct katcp_dispatch *d, char *label, char *desc, char *
     return -1;
   }
 
+  hs->h_acquire = a;
+
+  tr->r_hwgroup.w_sensors[tr->r_hwgroup.w_count] = hs;
+  tr->r_hwgroup.w_count++;
+
 #ifdef DEBUG
   fprintf(stderr, "hwmon: registered new sensor %s\n", label);
 #endif
@@ -400,230 +532,191 @@ int register_hwmon_tbs(struct katcp_dispatch *d, char *label, char *desc, char *
 }
 
 
-int setup_hwmon_tbs(struct katcp_dispatch *d)
+/* known roach2 hardware sensors, set up a few at a time by discover_hwmon_tbs */
+
+struct tbs_hwdef
 {
-  int rtn;
-  
-  rtn = 0;
+  char *d_label;
+  char *d_desc;
+  char *d_unit;
+  char *d_file;
+  char *d_min;
+  char *d_max;
+  unsigned int d_mult;
+  unsigned int d_div;
+};
+
+/* TODO: if input 7 on 50 is nonzero, we have a roach2r2 board, otherwise older */
+
+static struct tbs_hwdef hwdef_tbs[] = {
+  { "raw.temp.ambient", "Ambient board temperature", "millidegrees",
+    "/sys/bus/i2c/devices/0-0018/temp1_input",
+    "/sys/bus/i2c/devices/0-0018/temp1_min",
+    "/sys/bus/i2c/devices/0-0018/temp1_max",
+    1, 1 },
+  { "raw.temp.ppc", "PowerPC temperature", "millidegrees",
+    "/sys/bus/i2c/devices/0-0018/temp2_input",
+    "/sys/bus/i2c/devices/0-0018/temp2_min",
+    "/sys/bus/i2c/devices/0-0018/temp2_max",
+    1, 1 },
+  { "raw.temp.fpga", "FPGA temperature", "millidegrees",
+    "/sys/bus/i2c/devices/0-0018/temp3_input",
+    "/sys/bus/i2c/devices/0-0018/temp3_min",
+    "/sys/bus/i2c/devices/0-0018/temp3_max",
+    1, 1 },
+  { "raw.fan.chs1", "Chassis fan speed", "rpm",
+    "/sys/bus/i2c/devices/0-001b/fan1_input",
+    NULL,
+    NULL,
+    1, 1 },
+  { "raw.fan.chs2", "Chassis fan speed", "rpm",
+    "/sys/bus/i2c/devices/0-001f/fan1_input",
+    NULL,
+    NULL,
+    1, 1 },
+  { "raw.fan.fpga", "FPGA fan speed", "rpm",
+    "/sys/bus/i2c/devices/0-0048/fan1_input",
+    NULL,
+    NULL,
+    1, 1 },
+  { "raw.fan.chs0", "Chassis fan speed", "rpm",
+    "/sys/bus/i2c/devices/0-004b/fan1_input",
+    NULL,
+    NULL,
+    1, 1 },
+  { "raw.temp.inlet", "Inlet ambient temperature", "millidegrees",
+    "/sys/bus/i2c/devices/0-004c/temp1_input",
+    "/sys/bus/i2c/devices/0-004c/temp1_min",
+    "/sys/bus/i2c/devices/0-004c/temp1_max",
+    1, 1 },
+  { "raw.temp.outlet", "Outlet ambient temperature", "millidegrees",
+    "/sys/bus/i2c/devices/0-004e/temp1_input",
+    "/sys/bus/i2c/devices/0-004e/temp1_min",
+    "/sys/bus/i2c/devices/0-004e/temp1_max",
+    1, 1 },
 
-#if 0
-  rtn += register_hwmon_tbs(d, "dummy", 
-                               "dummy debug sensor",
-                               "millidegrees",
-                               "dummy_input", 
-                               "dummy_min",
-                               "dummy_max");
-#endif
+  /* most voltages live on 50. They start here */
 
-  /* TODO: if input 7 on 50 is nonzero, we have a roach2r2 board, otherwise older */
+  { "raw.voltage.1v", "1v voltage rail", "millivolts",
+    "/sys/bus/i2c/devices/0-0050/in0_input",
+    NULL,
+    "/sys/bus/i2c/devices/0-0050/in0_crit",
+    1, 1 },
+  { "raw.voltage.1v5", "1.5v voltage rail", "millivolts",
+    "/sys/bus/i2c/devices/0-0050/in1_input",
+    NULL,
+    "/sys/bus/i2c/devices/0-0050/in1_crit",
+    1, 1 },
+  { "raw.voltage.1v8", "1.8v voltage rail", "millivolts",
+    "/sys/bus/i2c/devices/0-0050/in2_input",
+    NULL,
+    "/sys/bus/i2c/devices/0-0050/in2_crit",
+    1, 1 },
+  { "raw.voltage.2v5", "2.5v voltage rail", "millivolts",
+    "/sys/bus/i2c/devices/0-0050/in3_input",
+    NULL,
+    "/sys/bus/i2c/devices/0-0050/in3_crit",
+    1, 1 },
+  { "raw.voltage.3v3", "3.3v voltage rail", "millivolts",
+    "/sys/bus/i2c/devices/0-0050/in4_input",
+    NULL,
+    "/sys/bus/i2c/devices/0-0050/in4_crit",
+    1, 1 },
+  { "raw.voltage.5v", "5v voltage rail", "millivolts",
+    "/sys/bus/i2c/devices/0-0050/in5_input",
+    NULL,
+    "/sys/bus/i2c/devices/0-0050/in5_crit",
+    1, 1 },
+  /* on rev1 this would be not connected */
+  { "raw.voltage.12v", "12v voltage rail", "millivolts",
+    "/sys/bus/i2c/devices/0-0050/in6_input",
+    NULL,
+    NULL,
+    1, 1 },
+  /* on rev1 this would be 12V */
+  { "raw.voltage.3v3aux", "auxiliary 3.3v voltage rail", "millivolts",
+    "/sys/bus/i2c/devices/0-0050/in7_input",
+    NULL,
+    NULL,
+    1, 1 },
+  /* on rev1 this would be 12V */
+  { "raw.voltage.5vaux", "auxiliary 5v voltage rail", "millivolts",
+    "/sys/bus/i2c/devices/0-0051/in6_input",
+    NULL,
+    NULL,
+    1, 1 },
+
+  { "raw.current.3v3", "3.3v rail current", "milliamps",
+    "/sys/bus/i2c/devices/0-0051/in0_input",
+    NULL,
+    "/sys/bus/i2c/devices/0-0051/in0_crit",
+    5, 2 },
+  { "raw.current.2v5", "2.5v rail current", "milliamps",
+    "/sys/bus/i2c/devices/0-0051/in1_input",
+    NULL,
+    "/sys/bus/i2c/devices/0-0051/in1_crit",
+    200, 499 },
+  { "raw.current.1v8", "1.8v rail current", "milliamps",
+    "/sys/bus/i2c/devices/0-0051/in2_input",
+    NULL,
+    "/sys/bus/i2c/devices/0-0051/in2_crit",
+    5, 2 },
+  { "raw.current.1v5", "1.5v rail current", "milliamps",
+    "/sys/bus/i2c/devices/0-0051/in3_input",
+    NULL,
+    "/sys/bus/i2c/devices/0-0051/in3_crit",
+    10, 1 },
+  { "raw.current.1v", "1v rail current", "milliamps",
+    "/sys/bus/i2c/devices/0-0051/in4_input",
+    NULL,
+    "/sys/bus/i2c/devices/0-0051/in4_crit",
+    40, 1 },
+  { "raw.current.5v", "5v rail current", "milliamps",
+    "/sys/bus/i2c/devices/0-0051/curr1_input",
+    NULL,
+    NULL,
+    1, 1 },
+  { "raw.current.12v", "12v rail current", "milliamps",
+    "/sys/bus/i2c/devices/0-0050/curr1_input",
+    NULL,
+    NULL,
+    1, 1 },
+  { NULL, NULL, NULL, NULL, NULL, NULL, 0, 0 }
+};
+
+/* register up to count further sensors, returns the number still outstanding */
+
+int discover_hwmon_tbs(struct katcp_dispatch *d, unsigned int count)
+{
+  struct tbs_raw *tr;
+  struct tbs_hwgroup *hg;
+  struct tbs_hwdef *hd;
+  unsigned int i, total;
 
-  rtn += register_hwmon_tbs(d, "raw.temp.ambient", 
-                               "Ambient board temperature",
-                               "millidegrees",
-                               "/sys/bus/i2c/devices/0-0018/temp1_input", 
-                               "/sys/bus/i2c/devices/0-0018/temp1_min",
-                               "/sys/bus/i2c/devices/0-0018/temp1_max", 
-                               1, 1);
-  
-  rtn += register_hwmon_tbs(d, "raw.temp.ppc", 
-                               "PowerPC temperature",
-                               "millidegrees",
-                               "/sys/bus/i2c/devices/0-0018/temp2_input", 
-                               "/sys/bus/i2c/devices/0-0018/temp2_min",
-                               "/sys/bus/i2c/devices/0-0018/temp2_max",
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.temp.fpga", 
-                               "FPGA temperature",
-                               "millidegrees",
-                               "/sys/bus/i2c/devices/0-0018/temp3_input", 
-                               "/sys/bus/i2c/devices/0-0018/temp3_min",
-                               "/sys/bus/i2c/devices/0-0018/temp3_max",
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.fan.chs1", 
-                               "Chassis fan speed",
-                               "rpm",
-                               "/sys/bus/i2c/devices/0-001b/fan1_input",
-                               NULL,
-                               NULL,
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.fan.chs2",
-                               "Chassis fan speed",
-                               "rpm",
-                               "/sys/bus/i2c/devices/0-001f/fan1_input",
-                               NULL,
-                               NULL, 
-                               1, 1);
-  
-  rtn += register_hwmon_tbs(d, "raw.fan.fpga", 
-                               "FPGA fan speed",
-                               "rpm",
-                               "/sys/bus/i2c/devices/0-0048/fan1_input",
-                               NULL,
-                               NULL, 
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.fan.chs0", 
-                               "Chassis fan speed",
-                               "rpm",
-                               "/sys/bus/i2c/devices/0-004b/fan1_input",
-                               NULL,
-                               NULL,
-                               1, 1);
-  
-  rtn += register_hwmon_tbs(d, "raw.temp.inlet", 
-                               "Inlet ambient temperature",
-                               "millidegrees",
-                               "/sys/bus/i2c/devices/0-004c/temp1_input",
-                               "/sys/bus/i2c/devices/0-004c/temp1_min",
-                               "/sys/bus/i2c/devices/0-004c/temp1_max",
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.temp.outlet", 
-                               "Outlet ambient temperature",
-                               "millidegrees",
-                               "/sys/bus/i2c/devices/0-004e/temp1_input",
-                               "/sys/bus/i2c/devices/0-004e/temp1_min",
-                               "/sys/bus/i2c/devices/0-004e/temp1_max",
-                               1, 1);
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return -1;
+  }
 
-  /* most voltages live on 50. They start here */
+  hg = &(tr->r_hwgroup);
+  total = (sizeof(hwdef_tbs) / sizeof(struct tbs_hwdef)) - 1;
 
-  rtn += register_hwmon_tbs(d, "raw.voltage.1v",
-                               "1v voltage rail",
-                               "millivolts",
-                               "/sys/bus/i2c/devices/0-0050/in0_input",
-                               NULL,
-                               "/sys/bus/i2c/devices/0-0050/in0_crit",
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.voltage.1v5",
-                               "1.5v voltage rail",
-                               "millivolts",
-                               "/sys/bus/i2c/devices/0-0050/in1_input",
-                               NULL,
-                               "/sys/bus/i2c/devices/0-0050/in1_crit",
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.voltage.1v8",
-                               "1.8v voltage rail",
-                               "millivolts",
-                               "/sys/bus/i2c/devices/0-0050/in2_input",
-                               NULL,
-                               "/sys/bus/i2c/devices/0-0050/in2_crit",
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.voltage.2v5",
-                               "2.5v voltage rail",
-                               "millivolts",
-                               "/sys/bus/i2c/devices/0-0050/in3_input",
-                               NULL,
-                               "/sys/bus/i2c/devices/0-0050/in3_crit",
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.voltage.3v3",
-                               "3.3v voltage rail",
-                               "millivolts",
-                               "/sys/bus/i2c/devices/0-0050/in4_input",
-                               NULL,
-                               "/sys/bus/i2c/devices/0-0050/in4_crit",
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.voltage.5v",
-                               "5v voltage rail",
-                               "millivolts",
-                               "/sys/bus/i2c/devices/0-0050/in5_input",
-                               NULL,
-                               "/sys/bus/i2c/devices/0-0050/in5_crit",
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.voltage.12v",
-                               "12v voltage rail",
-                               "millivolts",
-                               /* on rev1 this would be not connected */
-                               "/sys/bus/i2c/devices/0-0050/in6_input",
-                               NULL,
-                               NULL,
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.voltage.3v3aux",
-                               "auxiliary 3.3v voltage rail",
-                               "millivolts",
-                               /* on rev1 this would be 12V */
-                               "/sys/bus/i2c/devices/0-0050/in7_input",
-                               NULL,
-                               NULL,
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.voltage.5vaux",
-                               "auxiliary 5v voltage rail",
-                               "millivolts",
-                               /* on rev1 this would be 12V */
-                               "/sys/bus/i2c/devices/0-0051/in6_input",
-                               NULL,
-                               NULL,
-                               1, 1);
-
-
-
-  rtn += register_hwmon_tbs(d, "raw.current.3v3",
-                               "3.3v rail current",
-                               "milliamps",
-                               "/sys/bus/i2c/devices/0-0051/in0_input",
-                               NULL,
-                               "/sys/bus/i2c/devices/0-0051/in0_crit",
-                               5, 2);
-
-  rtn += register_hwmon_tbs(d, "raw.current.2v5",
-                               "2.5v rail current",
-                               "milliamps",
-                               "/sys/bus/i2c/devices/0-0051/in1_input",
-                               NULL,
-                               "/sys/bus/i2c/devices/0-0051/in1_crit", 
-                               200, 499);
-
-  rtn += register_hwmon_tbs(d, "raw.current.1v8",
-                               "1.8v rail current",
-                               "milliamps",
-                               "/sys/bus/i2c/devices/0-0051/in2_input",
-                               NULL,
-                               "/sys/bus/i2c/devices/0-0051/in2_crit", 
-                               5, 2);
-
-  rtn += register_hwmon_tbs(d, "raw.current.1v5",
-                               "1.5v rail current",
-                               "milliamps",
-                               "/sys/bus/i2c/devices/0-0051/in3_input",
-                               NULL,
-                               "/sys/bus/i2c/devices/0-0051/in3_crit", 
-                               10, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.current.1v",
-                               "1v rail current",
-                               "milliamps",
-                               "/sys/bus/i2c/devices/0-0051/in4_input",
-                               NULL,
-                               "/sys/bus/i2c/devices/0-0051/in4_crit",
-                               40, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.current.5v",
-                               "5v rail current",
-                               "milliamps",
-                               "/sys/bus/i2c/devices/0-0051/curr1_input",
-                               NULL,
-                               NULL, 
-                               1, 1);
-
-  rtn += register_hwmon_tbs(d, "raw.current.12v",
-                               "12v rail current",
-                               "milliamps",
-                               "/sys/bus/i2c/devices/0-0050/curr1_input",
-                               NULL,
-                               NULL, 
-                               1, 1);
-
-  return rtn;
-}
+  for(i = 0; (i < count) && (hg->w_probe < total); i++){
+    hd = &(hwdef_tbs[hg->w_probe]);
+    hg->w_probe++;
+
+    /* failures already logged, a missing sensor shouldn't hold up the rest */
+    register_hwmon_tbs(d, hd->d_label, hd->d_desc, hd->d_unit, hd->d_file, hd->d_min, hd->d_max, hd->d_mult, hd->d_div);
+  }
+
+  if(hg->w_probe < total){
+    return total - hg->w_probe;
+  }
+
+  if((hg->w_poll == 0) && (hg->w_count > 0)){
+    /* first readings now, this also starts the timer */
+    poll_hwmon_tbs(d, hg);
+  }
 
+  return 0;
+}
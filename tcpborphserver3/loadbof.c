@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,8 +12,12 @@
 #include <magic.h>
 #endif
 
+#include <signal.h>
+#include <sysexits.h>
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <katcp.h>
 #include <avltree.h>
@@ -41,6 +47,31 @@ struct bof_state
   unsigned long b_reg_count;
 
   char *b_strings;
+
+  /* register table, kept so that it can be saved to or loaded from the index cache */
+  struct bofioreg *b_regs;
+  int b_cached;
+
+  char *b_path;
+  unsigned long b_mtime;
+};
+
+/* sidecar index cache: a parsed register table stored in BOF_INDEX_DIR under
+ * the directory of the bof file, valid as long as size and mtime match. The
+ * register descriptors are in native byte order, followed by the string table */
+
+#define BOF_INDEX_DIR     ".index"
+#define BOF_INDEX_MAGIC   "BIX1"
+
+struct bof_index_header
+{
+  char i_magic[4];
+  uint32_t i_size;
+  uint32_t i_mtime;
+  uint32_t i_bit_offset;
+  uint32_t i_bit_size;
+  uint32_t i_reg_count;
+  uint32_t i_str_size;
 };
 
 /*************************************************************************/
@@ -217,27 +248,24 @@ void close_bof(struct katcp_dispatch *d, struct bof_state *bs)
     bs->b_strings = NULL;
   }
 
+  if(bs->b_regs){
+    free(bs->b_regs);
+    bs->b_regs = NULL;
+  }
+  bs->b_cached = 0;
+
+  if(bs->b_path){
+    free(bs->b_path);
+    bs->b_path = NULL;
+  }
+  bs->b_mtime = 0;
+
   free(bs);
 }
 
-struct bof_state *open_bof_fd(struct katcp_dispatch *d, int fd)
+static struct bof_state *create_state_bof(struct katcp_dispatch *d)
 {
   struct bof_state *bs;
-  int rr, have;
-#if 0
-  struct stat st;
-#endif
-  struct bofhdr bh;
-  struct hwrhdr hh;
-
-  if (fd < 0){
-    return NULL;
-  }
-  
-#if 0
-  magic_t cookie;
-  const char *mf;
-#endif
 
   bs = malloc(sizeof(struct bof_state));
   if(bs == NULL){
@@ -264,6 +292,39 @@ struct bof_state *open_bof_fd(struct katcp_dispatch *d, int fd)
 
   bs->b_strings = NULL;
 
+  bs->b_regs = NULL;
+  bs->b_cached = 0;
+
+  bs->b_path = NULL;
+  bs->b_mtime = 0;
+
+  return bs;
+}
+
+struct bof_state *open_bof_fd(struct katcp_dispatch *d, int fd)
+{
+  struct bof_state *bs;
+  int rr, have;
+#if 0
+  struct stat st;
+#endif
+  struct bofhdr bh;
+  struct hwrhdr hh;
+
+  if (fd < 0){
+    return NULL;
+  }
+  
+#if 0
+  magic_t cookie;
+  const char *mf;
+#endif
+
+  bs = create_state_bof(d);
+  if(bs == NULL){
+    return NULL;
+  }
+
   bs->b_fd = gzdopen(fd, "r");
   if(bs->b_fd == NULL){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "gzdopen fail %s", strerror(errno));
@@ -369,8 +430,218 @@ struct bof_state *open_bof_fd(struct katcp_dispatch *d, int fd)
   return bs;
 }
 
+/**************************************************************************/
+
+static char *index_path_bof(char *name)
+{
+  char *base, *path;
+  unsigned int len, dir;
+
+  base = strrchr(name, '/');
+  if(base){
+    dir = base - name;
+    base++;
+  } else {
+    dir = 1;
+    base = name;
+  }
+
+  len = dir + 1 + strlen(BOF_INDEX_DIR) + 1 + strlen(base) + 1;
+
+  path = malloc(len);
+  if(path == NULL){
+    return NULL;
+  }
+
+  snprintf(path, len, "%.*s/%s/%s", dir, (base == name) ? "." : name, BOF_INDEX_DIR, base);
+  path[len - 1] = '\0';
+
+  return path;
+}
+
+static int read_index_header_bof(int fd, struct bof_index_header *ih, struct stat *st)
+{
+  if(read(fd, ih, sizeof(struct bof_index_header)) != sizeof(struct bof_index_header)){
+    return -1;
+  }
+
+  if(memcmp(ih->i_magic, BOF_INDEX_MAGIC, 4)){
+    return -1;
+  }
+
+  /* stale if the image has been replaced since */
+  if((ih->i_size != (uint32_t)(st->st_size)) || (ih->i_mtime != (uint32_t)(st->st_mtime))){
+    return -1;
+  }
+
+  return 0;
+}
+
+static struct bof_state *load_index_bof(struct katcp_dispatch *d, int fd, char *name, struct stat *st)
+{
+  struct bof_index_header ih;
+  struct bof_state *bs;
+  unsigned int regs;
+  char *path;
+  int ifd;
+
+  path = index_path_bof(name);
+  if(path == NULL){
+    return NULL;
+  }
+
+  ifd = open(path, O_RDONLY);
+  free(path);
+  if(ifd < 0){
+    return NULL;
+  }
+
+  if(read_index_header_bof(ifd, &ih, st) < 0){
+    close(ifd);
+    return NULL;
+  }
+
+  bs = create_state_bof(d);
+  if(bs == NULL){
+    close(ifd);
+    return NULL;
+  }
+
+  regs = sizeof(struct bofioreg) * ih.i_reg_count;
+
+  bs->b_regs = malloc(regs + 1);
+  bs->b_strings = malloc(ih.i_str_size + 1);
+
+  if((bs->b_regs == NULL) || (bs->b_strings == NULL) || 
+     (read(ifd, bs->b_regs, regs) != regs) || 
+     (read(ifd, bs->b_strings, ih.i_str_size) != ih.i_str_size)){
+    close(ifd);
+    close_bof(d, bs);
+    return NULL;
+  }
+
+  close(ifd);
+
+  bs->b_strings[ih.i_str_size] = '\0';
+
+  bs->b_bit_offset = ih.i_bit_offset;
+  bs->b_bit_size = ih.i_bit_size;
+  bs->b_reg_count = ih.i_reg_count;
+  bs->b_str_size = ih.i_str_size;
+  bs->b_file_size = st->st_size;
+  bs->b_cached = 1;
+
+  /* only take ownership of fd once nothing else can fail */
+  bs->b_fd = gzdopen(fd, "r");
+  if(bs->b_fd == NULL){
+    close_bof(d, bs);
+    return NULL;
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "loaded index of %u registers for %s from cache", ih.i_reg_count, name);
+
+  return bs;
+}
+
+static void save_index_bof(struct katcp_dispatch *d, struct bof_state *bs)
+{
+  struct bof_index_header ih;
+  char *path, *tmp, *ptr;
+  unsigned int len, regs;
+  int fd, result;
+
+  path = index_path_bof(bs->b_path);
+  if(path == NULL){
+    return;
+  }
+
+  ptr = strrchr(path, '/');
+  *ptr = '\0';
+  mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+  *ptr = '/';
+
+  len = strlen(path) + 5;
+  tmp = malloc(len);
+  if(tmp == NULL){
+    free(path);
+    return;
+  }
+  snprintf(tmp, len, "%s.tmp", path);
+
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(fd < 0){
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "unable to create index cache %s: %s", tmp, strerror(errno));
+    free(tmp);
+    free(path);
+    return;
+  }
+
+  memcpy(ih.i_magic, BOF_INDEX_MAGIC, 4);
+  ih.i_size = bs->b_file_size;
+  ih.i_mtime = bs->b_mtime;
+  ih.i_bit_offset = bs->b_bit_offset;
+  ih.i_bit_size = bs->b_bit_size;
+  ih.i_reg_count = bs->b_reg_count;
+  ih.i_str_size = bs->b_str_size;
+
+  regs = sizeof(struct bofioreg) * bs->b_reg_count;
+
+  result = 0;
+  if((write(fd, &ih, sizeof(struct bof_index_header)) != sizeof(struct bof_index_header)) || 
+     (write(fd, bs->b_regs, regs) != regs) || 
+     (write(fd, bs->b_strings, bs->b_str_size) != bs->b_str_size)){
+    result = (-1);
+  }
+
+  if(close(fd) < 0){
+    result = (-1);
+  }
+
+  /* rename so that a reader never sees a partial index */
+  if((result < 0) || (rename(tmp, path) < 0)){
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "unable to save index cache %s", path);
+    unlink(tmp);
+  } else {
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "saved index of %lu registers to %s", bs->b_reg_count, path);
+  }
+
+  free(tmp);
+  free(path);
+}
+
+int count_index_bof(char *name)
+{
+  struct bof_index_header ih;
+  struct stat st;
+  char *path;
+  int fd, result;
+
+  if(stat(name, &st) < 0){
+    return -1;
+  }
+
+  path = index_path_bof(name);
+  if(path == NULL){
+    return -1;
+  }
+
+  fd = open(path, O_RDONLY);
+  free(path);
+  if(fd < 0){
+    return -1;
+  }
+
+  result = (read_index_header_bof(fd, &ih, &st) < 0) ? (-1) : ih.i_reg_count;
+
+  close(fd);
+
+  return result;
+}
+
 struct bof_state *open_bof(struct katcp_dispatch *d, char *name)
 {
+  struct bof_state *bs;
+  struct stat st;
   int fd;
 
   fd = open(name, O_RDONLY);
@@ -380,15 +651,241 @@ struct bof_state *open_bof(struct katcp_dispatch *d, char *name)
   }
 
   log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "opened boffile %s", name);
-  
-  return open_bof_fd(d, fd); 
+
+  if(fstat(fd, &st) < 0){
+    /* no cache without a key */
+    return open_bof_fd(d, fd); 
+  }
+
+  bs = load_index_bof(d, fd, name, &st);
+  if(bs){
+    return bs;
+  }
+
+  bs = open_bof_fd(d, fd); 
+  if(bs == NULL){
+    return NULL;
+  }
+
+  /* remember where we came from, index_bof saves the register table for next time */
+  bs->b_path = strdup(name);
+  bs->b_file_size = st.st_size;
+  bs->b_mtime = st.st_mtime;
+
+  return bs;
+}
+
+/* work out where the bitstream lives from the leading bytes of an image
+ * still being received. Returns 1 if more data is needed, 0 once offset
+ * and size are known and -1 if the data can not be a plain bof file */
+
+int locate_bitstream_bof(void *data, unsigned int have, unsigned long *offset, unsigned long *size)
+{
+  char magic[4] = { 0x19, 'B', 'O', 'F' };
+  unsigned char *ptr;
+  struct bofhdr bh;
+  struct hwrhdr hh;
+  uint32_t check;
+  int disk, memory;
+
+  ptr = data;
+
+  if(have < sizeof(struct bofhdr)){
+    return 1;
+  }
+
+  memcpy(&bh, ptr, sizeof(struct bofhdr));
+  if(memcmp(magic, bh.ident, 4)){
+    return -1;
+  }
+
+  disk = bh.ident[BI_ENDIAN];
+  if((disk != BOFDATA2LSB) && (disk != BOFDATA2MSB)){
+    return -1;
+  }
+
+  memcpy(&check, "word", 4);
+  memory = (check == 0x776f7264) ? BOFDATA2MSB : BOFDATA2LSB;
+
+  if(disk != memory){
+    flip_bofhdr_bof(&bh);
+  }
+
+  if(have < (bh.b_hwoff + sizeof(struct hwrhdr))){
+    return 1;
+  }
+
+  memcpy(&hh, ptr + bh.b_hwoff, sizeof(struct hwrhdr));
+  if(disk != memory){
+    flip_hwrhdr_bof(&hh);
+  }
+
+  if((hh.strtab_off >= hh.pl_off) || (hh.pl_len == 0)){
+    return -1;
+  }
+
+  *offset = hh.pl_off;
+  *size = hh.pl_len;
+
+  return 0;
+}
+
+/* chunk handed between the decompressor and the configuration writer.
+ * The pipe between them holds two, so that one chunk can be inflated
+ * while the previous one is being written to the device */
+#define BOF_PIPE_CHUNK  (64 * 1024)
+
+static int write_device_bof(struct katcp_dispatch *d, int dfd, char *buffer, int len)
+{
+  int wr, have;
+
+  have = 0;
+  do{
+    wr = write(dfd, buffer + have, len - have);
+    switch(wr){
+      case -1 :
+        switch(errno){
+          case EAGAIN :
+          case EINTR  :
+            break;
+          default :
+            log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "write to fpga failed: %s", strerror(errno));
+            return -1;
+        }
+        break;
+      case 0 :
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "write to fpga failed: %s", strerror(errno));
+        return -1;
+      default : 
+        have += wr;
+        break;
+    }
+  } while(have < len);
+
+  return 0;
+}
+
+/* runs in a child process, may not touch katcp state */
+
+static void inflate_child_bof(struct bof_state *bs, int wfd)
+{
+  char buffer[BOF_PIPE_CHUNK];
+  int rr, wr, have, can;
+  unsigned long need;
+
+  need = bs->b_bit_size;
+  while(need > 0){
+    can = (need > BOF_PIPE_CHUNK) ? BOF_PIPE_CHUNK : need;
+    rr = gzread(bs->b_fd, buffer, can);
+    if(rr <= 0){
+      _exit(EX_DATAERR);
+    }
+
+    have = 0;
+    while(have < rr){
+      wr = write(wfd, buffer + have, rr - have);
+      if(wr <= 0){
+        if((wr < 0) && (errno == EINTR)){
+          continue;
+        }
+        _exit(EX_IOERR);
+      }
+      have += wr;
+    }
+
+    need -= rr;
+  }
+
+  _exit(EX_OK);
+}
+
+static int pipeline_bof(struct katcp_dispatch *d, struct bof_state *bs, int dfd)
+{
+  char buffer[BOF_PIPE_CHUNK];
+  int fds[2], rr, status, result;
+  unsigned long got;
+  pid_t pid;
+
+  if(pipe(fds) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create decompression pipe: %s", strerror(errno));
+    return -1;
+  }
+
+#ifdef F_SETPIPE_SZ
+  fcntl(fds[1], F_SETPIPE_SZ, 2 * BOF_PIPE_CHUNK);
+#endif
+
+  pid = fork();
+  if(pid < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to fork decompressor: %s", strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  if(pid == 0){
+    close(fds[0]);
+    close(dfd);
+    inflate_child_bof(bs, fds[1]);
+  }
+
+  close(fds[1]);
+
+  result = 0;
+  got = 0;
+
+  while(got < bs->b_bit_size){
+    rr = read(fds[0], buffer, BOF_PIPE_CHUNK);
+    if(rr < 0){
+      if((errno == EAGAIN) || (errno == EINTR)){
+        continue;
+      }
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "read from decompressor failed: %s", strerror(errno));
+      result = -1;
+      break;
+    }
+    if(rr == 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "encountered EOF in bitstream with %lu bytes still to load", bs->b_bit_size - got);
+      result = -1;
+      break;
+    }
+    if(write_device_bof(d, dfd, buffer, rr) < 0){
+      result = -1;
+      break;
+    }
+    got += rr;
+  }
+
+  /* a blocked decompressor will see a broken pipe */
+  close(fds[0]);
+
+  if(result < 0){
+    kill(pid, SIGTERM);
+  }
+
+  /* SIGCHLD is blocked while requests are processed, so the job reaper can not beat us to it */
+  while(waitpid(pid, &status, 0) < 0){
+    if(errno != EINTR){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to collect decompressor %d: %s", pid, strerror(errno));
+      return -1;
+    }
+  }
+
+  if((result == 0) && (!WIFEXITED(status) || (WEXITSTATUS(status) != EX_OK))){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "decompressor failed with status 0x%x", status);
+    result = -1;
+  }
+
+  /* the child moved the shared file offset, make sure later reads start over */
+  gzrewind(bs->b_fd);
+
+  return result;
 }
 
 int program_bof(struct katcp_dispatch *d, struct bof_state *bs, char *device)
 {
-#define BUFFER 4096
-  int dfd, rr, wr, can, need, have;
-  char buffer[BUFFER];
+  int dfd, rr, can, need;
+  char buffer[BOF_PIPE_CHUNK];
 #if 0
   if(lseek(bs->b_fd, bs->b_bit_offset, SEEK_SET) != (bs->b_bit_offset)){
 #endif
@@ -408,11 +905,21 @@ int program_bof(struct katcp_dispatch *d, struct bof_state *bs, char *device)
     return -1;
   }
 
-  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "attempting to program bitstream of %u bytes to device %s", bs->b_bit_size, device);
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "attempting to program %s bitstream of %u bytes to device %s", gzdirect(bs->b_fd) ? "plain" : "compressed", bs->b_bit_size, device);
 
-  need = bs->b_bit_size;
-  do{
-    can = (need > BUFFER) ? BUFFER : need;
+  if(!gzdirect(bs->b_fd)){
+    /* inflating is as slow as the configuration port, overlap the two */
+    if(pipeline_bof(d, bs, dfd) < 0){
+      close(dfd);
+      return -1;
+    }
+    need = 0;
+  } else {
+    need = bs->b_bit_size;
+  }
+
+  while(need > 0){
+    can = (need > BOF_PIPE_CHUNK) ? BOF_PIPE_CHUNK : need;
 #if 0
     rr = read(bs->b_fd, buffer, can);
 #endif
@@ -435,33 +942,13 @@ int program_bof(struct katcp_dispatch *d, struct bof_state *bs, char *device)
         return -1;
       default : 
         need -= rr;
-        have = 0;
-        do{
-          wr = write(dfd, buffer + have, rr - have);
-          switch(wr){
-            case -1 :
-              switch(errno){
-                case EAGAIN :
-                case EINTR  :
-                  break;
-                default :
-                  log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "write to fpga failed: %s", strerror(errno));
-                  close(dfd);
-                  return -1;
-              }
-              break;
-            case 0 :
-              log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "write to fpga failed: %s", strerror(errno));
-              close(dfd);
-              return -1;
-            default : 
-              have += wr;
-              break;
-          }
-        } while(have < rr);
+        if(write_device_bof(d, dfd, buffer, rr) < 0){
+          close(dfd);
+          return -1;
+        }
         break;
     }
-  } while(need > 0);
+  }
 
   if(close(dfd) < 0){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to program fpga with %d bytes", need);
@@ -469,7 +956,6 @@ int program_bof(struct katcp_dispatch *d, struct bof_state *bs, char *device)
   }
 
   return 0;
-#undef BUFFER
 }
 
 int index_bof(struct katcp_dispatch *d, struct bof_state *bs)
@@ -488,26 +974,45 @@ int index_bof(struct katcp_dispatch *d, struct bof_state *bs)
     return KATCP_RESULT_FAIL;
   }
 
+  if(bs->b_cached == 0){
 #if 0
-  if(lseek(bs->b_fd, bs->b_hwr_offset + sizeof(struct hwrhdr), SEEK_SET) != (bs->b_hwr_offset + sizeof(struct hwrhdr))){
+    if(lseek(bs->b_fd, bs->b_hwr_offset + sizeof(struct hwrhdr), SEEK_SET) != (bs->b_hwr_offset + sizeof(struct hwrhdr))){
 #endif
-  if(gzseek(bs->b_fd, bs->b_hwr_offset + sizeof(struct hwrhdr), SEEK_SET) != (bs->b_hwr_offset + sizeof(struct hwrhdr))){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "seek to register index at 0x%lx failed", bs->b_hwr_offset + sizeof(struct hwrhdr));
-    return -1;
+    if(gzseek(bs->b_fd, bs->b_hwr_offset + sizeof(struct hwrhdr), SEEK_SET) != (bs->b_hwr_offset + sizeof(struct hwrhdr))){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "seek to register index at 0x%lx failed", bs->b_hwr_offset + sizeof(struct hwrhdr));
+      return -1;
+    }
+
+    if(bs->b_regs == NULL){
+      bs->b_regs = malloc(sizeof(struct bofioreg) * (bs->b_reg_count + 1));
+      /* failure only means we can't save an index */
+    }
   }
 
   for(i = 0; i < bs->b_reg_count; i++){
+    if(bs->b_cached){
+      memcpy(&br, &(bs->b_regs[i]), sizeof(struct bofioreg));
+      if(br.name >= bs->b_str_size){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "cached register name at location %d outside string table", br.name);
+        return -1;
+      }
+    } else {
 #if 0
-    rr = read(bs->b_fd, &br, sizeof(struct bofioreg));
+      rr = read(bs->b_fd, &br, sizeof(struct bofioreg));
 #endif
-    rr = gzread(bs->b_fd, &br, sizeof(struct bofioreg));
-    if(rr < sizeof(struct bofioreg)){
-      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to read register descriptor structure number %u from disk: %s", i, (rr < 0) ? strerror(errno) : "incomplete read");
-      return -1;
-    }
+      rr = gzread(bs->b_fd, &br, sizeof(struct bofioreg));
+      if(rr < sizeof(struct bofioreg)){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to read register descriptor structure number %u from disk: %s", i, (rr < 0) ? strerror(errno) : "incomplete read");
+        return -1;
+      }
 
-    if(check_ioreg_bof(d, bs, &br) < 0){
-      return -1;
+      if(check_ioreg_bof(d, bs, &br) < 0){
+        return -1;
+      }
+
+      if(bs->b_regs){
+        memcpy(&(bs->b_regs[i]), &br, sizeof(struct bofioreg));
+      }
     }
 
     log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "about to define register %s", bs->b_strings + br.name);
@@ -517,7 +1022,7 @@ int index_bof(struct katcp_dispatch *d, struct bof_state *bs)
       return -1;
     }
 
-    te = malloc(sizeof(struct tbs_entry));
+    te = alloc_arena_avltree(tr->r_registers, sizeof(struct tbs_entry));
     if(te == NULL){
       log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes for register entry %u", sizeof(struct tbs_entry), i);
       return -1;
@@ -533,6 +1038,8 @@ int index_bof(struct katcp_dispatch *d, struct bof_state *bs)
     te->e_len_base = br.len;
     te->e_len_offset = 0;
 
+    te->e_shadow = NULL;
+
     top = br.loc + br.len;
     if(tr->r_top_register < top){
       tr->r_top_register = top;
@@ -556,13 +1063,16 @@ int index_bof(struct katcp_dispatch *d, struct bof_state *bs)
 
     if(store_named_node_avltree(tr->r_registers, name, te) < 0){
       log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to store definition of register %s", name);
-      free(te);
       return -1;
     }
   }
 
   log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "address range needs to be at least %u", tr->r_top_register);
 
+  if((bs->b_cached == 0) && bs->b_regs && bs->b_path){
+    save_index_bof(d, bs);
+  }
+
   return 0;
 }
 
@@ -9,5 +9,8 @@ void close_bof(struct katcp_dispatch *d, struct bof_state *bs);
 
 int program_bof(struct katcp_dispatch *d, struct bof_state *bs, char *device);
 int index_bof(struct katcp_dispatch *d, struct bof_state *bs);
+int locate_bitstream_bof(void *data, unsigned int have, unsigned long *offset, unsigned long *size);
+
+int count_index_bof(char *name);
 
 #endif
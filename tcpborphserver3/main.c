@@ -29,9 +29,10 @@
 void usage(char *app)
 {
   printf("Usage: %s" 
-  " [-b bof-dir] [-f] [-h] [-i init-script] [-l log-file] [-m mode] [-p network-port]\n", app);
+  " [-b bof-dir] [-e image] [-f] [-h] [-i init-script] [-l log-file] [-m mode] [-p network-port]\n", app);
 
   printf("-b dir           directory containing bof files\n");
+  printf("-e file          emulate the fpga with a memory image (created as needed)\n");
   printf("-f               run in foreground (default is background)\n");
   printf("-h               this help\n");
   printf("-i file          run the specified startup script\n");
@@ -46,7 +47,7 @@ int main(int argc, char **argv)
   struct katcp_dispatch *d;
   int status;
   int i, j, c, foreground, lfd;
-  char *port, *mode, *init, *lfile, *bofdir;
+  char *port, *mode, *init, *lfile, *bofdir, *emulate;
   time_t now;
 
   port = "7147";
@@ -55,6 +56,7 @@ int main(int argc, char **argv)
   lfile = TBS_LOGFILE;
   foreground = 0;
   bofdir = NULL;
+  emulate = NULL;
 
   i = 1;
   j = 1;
@@ -79,6 +81,7 @@ int main(int argc, char **argv)
           break;
 
         case 'b' :
+        case 'e' :
         case 'i' :
         case 'l' :
         case 'm' :
@@ -95,6 +98,9 @@ int main(int argc, char **argv)
             case 'b' :
               bofdir = argv[i] + j;
               break;
+            case 'e' :
+              emulate = argv[i] + j;
+              break;
             case 'i' :
               init = argv[i] + j;
               break;
@@ -137,7 +143,7 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  if(setup_raw_tbs(d, bofdir, argc, argv) < 0){
+  if(setup_raw_tbs(d, bofdir, emulate, argc, argv) < 0){
     fprintf(stderr, "%s: unable to initialise logic for raw mode\n", argv[0]);
     return 1;
   }
@@ -9,9 +9,13 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <limits.h>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
 #include <sys/time.h>
 
 #include <katpriv.h>
@@ -23,17 +27,181 @@
 #include "loadbof.h"
 #include "tg.h"
 
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
 /*********************************************************************/
 
 int status_fpga_tbs(struct katcp_dispatch *d, int status);
 
 /*********************************************************************/
 
+/* copy engine for register transfers: the fpga bus only does 32 bit
+ * accesses, so wider loads would be split or fault - instead loops are
+ * unrolled, and volatile stops the compiler from merging them. The
+ * shift kernels take a bit offset between 1 and 31 and load each bus
+ * word only once */
+
+#define TBS_UNROLL 4
+
+static void copy_in_tbs(void *buffer, volatile uint32_t *src, unsigned long words)
+{
+  unsigned char *dst;
+  uint32_t w0, w1, w2, w3;
+  unsigned long k;
+
+  dst = buffer;
+
+  for(k = 0; (k + TBS_UNROLL) <= words; k += TBS_UNROLL){
+    w0 = src[k];
+    w1 = src[k + 1];
+    w2 = src[k + 2];
+    w3 = src[k + 3];
+    memcpy(dst, &w0, 4);
+    memcpy(dst + 4, &w1, 4);
+    memcpy(dst + 8, &w2, 4);
+    memcpy(dst + 12, &w3, 4);
+    dst += 16;
+  }
+
+  for(; k < words; k++){
+    w0 = src[k];
+    memcpy(dst, &w0, 4);
+    dst += 4;
+  }
+}
+
+/* out[k] = (src[k] << shift) | (src[k + 1] >> (32 - shift)), reads words + 1 bus words */
+static void shift_in_tbs(void *buffer, volatile uint32_t *src, unsigned long words, unsigned int shift)
+{
+  unsigned char *dst;
+  uint32_t prev, w0, w1, w2, w3;
+  unsigned int back;
+  unsigned long k;
+
+  dst = buffer;
+  back = 32 - shift;
+
+  prev = src[0];
+
+  for(k = 0; (k + TBS_UNROLL) <= words; k += TBS_UNROLL){
+    w0 = src[k + 1];
+    w1 = src[k + 2];
+    w2 = src[k + 3];
+    w3 = src[k + 4];
+    prev = (prev << shift) | (w0 >> back);
+    memcpy(dst, &prev, 4);
+    prev = (w0 << shift) | (w1 >> back);
+    memcpy(dst + 4, &prev, 4);
+    prev = (w1 << shift) | (w2 >> back);
+    memcpy(dst + 8, &prev, 4);
+    prev = (w2 << shift) | (w3 >> back);
+    memcpy(dst + 12, &prev, 4);
+    prev = w3;
+    dst += 16;
+  }
+
+  for(; k < words; k++){
+    w0 = src[k + 1];
+    prev = (prev << shift) | (w0 >> back);
+    memcpy(dst, &prev, 4);
+    prev = w0;
+    dst += 4;
+  }
+}
+
+static void copy_out_tbs(volatile uint32_t *dst, uint32_t *src, unsigned long words)
+{
+  unsigned long k;
+
+  for(k = 0; (k + TBS_UNROLL) <= words; k += TBS_UNROLL){
+    dst[k]     = src[k];
+    dst[k + 1] = src[k + 1];
+    dst[k + 2] = src[k + 2];
+    dst[k + 3] = src[k + 3];
+  }
+
+  for(; k < words; k++){
+    dst[k] = src[k];
+  }
+}
+
+/* dst[k] = carry | (src[k] >> shift), returns the bits carried into dst[words] */
+static uint32_t shift_out_tbs(volatile uint32_t *dst, uint32_t *src, unsigned long words, unsigned int shift, uint32_t carry)
+{
+  unsigned int back;
+  unsigned long k;
+  uint32_t value;
+
+  back = 32 - shift;
+
+  for(k = 0; (k + TBS_UNROLL) <= words; k += TBS_UNROLL){
+    value = src[k];
+    dst[k] = carry | (value >> shift);
+    carry = value << back;
+    value = src[k + 1];
+    dst[k + 1] = carry | (value >> shift);
+    carry = value << back;
+    value = src[k + 2];
+    dst[k + 2] = carry | (value >> shift);
+    carry = value << back;
+    value = src[k + 3];
+    dst[k + 3] = carry | (value >> shift);
+    carry = value << back;
+  }
+
+  for(; k < words; k++){
+    value = src[k];
+    dst[k] = carry | (value >> shift);
+    carry = value << back;
+  }
+
+  return carry;
+}
+
+#ifdef PROFILE
+static void profile_transfer_tbs(struct katcp_dispatch *d, char *what, unsigned long bytes, struct timeval *then)
+{
+  struct timeval now, delta;
+  double seconds;
+
+  gettimeofday(&now, NULL);
+  sub_time_katcp(&delta, &now, then);
+
+  seconds = delta.tv_sec + (delta.tv_usec / 1000000.0);
+
+  if(seconds > 0.0){
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "%s of %lu bytes took %lu.%06lus (%.2fMB/s)", what, bytes, (unsigned long) delta.tv_sec, (unsigned long) delta.tv_usec, (bytes / seconds) / 1000000.0);
+  } else {
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "%s of %lu bytes took no measurable time", what, bytes);
+  }
+}
+#endif
+
+/*********************************************************************/
+
 static volatile int bus_error_happened;
 
+/* armed by the thread doing an offloaded transfer, a SIGBUS is delivered to the faulting thread */
+static __thread sigjmp_buf *bus_guard_tbs = NULL;
+
 void handle_bus_error(int signal)
 {
+  struct sigaction sa;
+
   bus_error_happened = 1;
+
+  if(bus_guard_tbs){
+    siglongjmp(*bus_guard_tbs, 1);
+  }
+
+  /* unguarded access: returning retries the faulting access, which now kills us as before */
+  sa.sa_handler = SIG_DFL;
+  sa.sa_flags = 0;
+  sigemptyset(&(sa.sa_mask));
+
+  sigaction(SIGBUS, &sa, NULL);
 }
 
 static int check_bus_error(struct katcp_dispatch *d)
@@ -54,18 +222,243 @@ static int check_bus_error(struct katcp_dispatch *d)
 
 /*********************************************************************/
 
-void free_entry(void *data)
+/* Registers which the gateware never changes (static settings, or
+ * tables only ever written by the host) can be shadowed with
+ * ?register-shadow. Reads are then answered from the host copy, and
+ * writes are applied to a staging copy first: only the span of words
+ * which actually differ goes out, in one burst, and an unchanged value
+ * does not touch the bus at all. The copies live in the register arena,
+ * so ?progdev discards them with the rest of the register table */
+
+static unsigned int shadow_words_tbs(struct tbs_entry *te)
 {
-  struct tbs_entry *te;
+  return (te->e_pos_offset + (te->e_len_base * 8) + te->e_len_offset + 31) / 32;
+}
 
-  te = data;
+/* where a read of te should look, origin is the bus position of the returned pointer */
+static char *view_shadow_tbs(struct tbs_raw *tr, struct tbs_entry *te, unsigned int *origin)
+{
+  if(te->e_mode & TBS_SHADOWED){
+    *origin = te->e_pos_base;
+    return (char *)(te->e_shadow);
+  }
+
+  *origin = 0;
+  return tr->r_map;
+}
+
+/* limit a run of count words from first to the words spanned by te */
+static unsigned int clip_shadow_tbs(struct tbs_entry *te, unsigned int first, unsigned int count)
+{
+  unsigned int words;
+
+  words = shadow_words_tbs(te);
+  if(first >= words){
+    return 0;
+  }
+
+  return (count > (words - first)) ? (words - first) : count;
+}
+
+/* where a write to words first to first+count of te should go, for shadowed registers those words of the staging copy */
+static char *stage_shadow_tbs(struct tbs_raw *tr, struct tbs_entry *te, unsigned int first, unsigned int count, unsigned int *origin)
+{
+  unsigned int words;
+
+  if(te->e_mode & TBS_SHADOWED){
+    words = shadow_words_tbs(te);
+    count = clip_shadow_tbs(te, first, count);
+    memcpy(te->e_shadow + words + first, te->e_shadow + first, count * 4);
+    *origin = te->e_pos_base;
+    return (char *)(te->e_shadow + words);
+  }
+
+  *origin = 0;
+  return tr->r_map;
+}
+
+/* push those staged words which differ from the shadow out to the bus, returns the number of words written */
+static unsigned int commit_shadow_tbs(struct tbs_raw *tr, struct tbs_entry *te, unsigned int first, unsigned int count)
+{
+  unsigned int words, end, last;
+  uint32_t *stage;
+
+  if(!(te->e_mode & TBS_SHADOWED)){
+    return 0;
+  }
+
+  words = shadow_words_tbs(te);
+  stage = te->e_shadow + words;
+
+  end = first + clip_shadow_tbs(te, first, count);
+
+  for(; (first < end) && (stage[first] == te->e_shadow[first]); first++);
+  if(first >= end){
+    return 0;
+  }
+
+  for(last = end - 1; stage[last] == te->e_shadow[last]; last--);
+
+  copy_out_tbs((volatile uint32_t *)(tr->r_map + te->e_pos_base) + first, stage + first, last + 1 - first);
+  memcpy(te->e_shadow + first, stage + first, (last + 1 - first) * 4);
+
+  return last + 1 - first;
+}
+
+/*********************************************************************/
+
+/* Large aligned ?read and ?write transfers are copied by the io thread
+ * (the katcp worker pool started in setup_raw_tbs). The loop thread does
+ * all the checking and builds the reply, the worker only moves words
+ * between the bus and a private buffer. A mapping released while such
+ * transfers are in flight is only unmapped once they have finished */
+
+static volatile uint32_t *aligned_bus_tbs(struct tbs_raw *tr, struct tbs_entry *te, struct katcl_byte_bit *start, unsigned int bytes)
+{
+  unsigned long position;
+
+  if(bytes < TBS_OFFLOAD_THRESHOLD){
+    return NULL;
+  }
+
+  if((bytes % 4) || te->e_pos_offset || start->b_bit){
+    return NULL;
+  }
+
+  if(te->e_mode & TBS_SHADOWED){
+    return NULL; /* served from memory anyway */
+  }
+
+  position = te->e_pos_base + start->b_byte;
+  if(position % 4){
+    return NULL;
+  }
+
+  if((start->b_byte + bytes) > te->e_len_base){
+    return NULL; /* let the inline path report it */
+  }
+
+  if((position + bytes) > tr->r_map_size){
+    return NULL;
+  }
+
+  return (volatile uint32_t *)(tr->r_map + position);
+}
+
+static int transfer_guard_tbs(void *data)
+{
+  struct tbs_transfer *tt;
+  sigjmp_buf jump;
+  sigset_t bus, previous;
+
+  tt = data;
+
+  /* workers start with all signals blocked, a blocked SIGBUS would kill us outright */
+  sigemptyset(&bus);
+  sigaddset(&bus, SIGBUS);
+  pthread_sigmask(SIG_UNBLOCK, &bus, &previous);
+
+  if(sigsetjmp(jump, 1)){
+    bus_guard_tbs = NULL;
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return -1;
+  }
+
+  bus_guard_tbs = &jump;
+
+  if(tt->t_write){
+    copy_out_tbs(tt->t_bus, tt->t_buffer, tt->t_bytes / 4);
+    msync(tt->t_map, tt->t_map_size, MS_SYNC);
+  } else {
+    copy_in_tbs(tt->t_buffer, tt->t_bus, tt->t_bytes / 4);
+  }
+
+  bus_guard_tbs = NULL;
+
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+  return tt->t_bytes;
+}
+
+static void release_mappings_tbs(struct tbs_raw *tr)
+{
+  struct tbs_mapping *tm;
+
+  while(tr->r_retired){
+    tm = tr->r_retired;
+    tr->r_retired = tm->m_next;
+
+    munmap(tm->m_base, tm->m_size);
+    free(tm);
+  }
+}
+
+static int transfer_done_tbs(struct katcp_dispatch *d, int status, void *data)
+{
+  struct tbs_transfer *tt;
+  struct tbs_raw *tr;
+  int result;
+
+  tt = data;
+  tr = tt->t_raw;
+
+  tr->r_transfers--;
+  if(tr->r_transfers == 0){
+    release_mappings_tbs(tr);
+  }
+
+  TRACE_KATCP(KATCP_TRACE_REGISTER_DONE, status, tt->t_write ? "write" : "read");
+
+  if(d == NULL){ /* client has gone away */
+    result = KATCP_RESULT_FAIL;
+  } else if(status != tt->t_bytes){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "bus error during %s of %u bytes", tt->t_write ? "write" : "read", tt->t_bytes);
+    result = KATCP_RESULT_FAIL;
+  } else if(tt->t_write){
+    result = KATCP_RESULT_OK;
+  } else {
+    prepend_reply_katcp(d);
+    append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+    append_buffer_katcp(d, KATCP_FLAG_BUFFER | KATCP_FLAG_LAST, tt->t_buffer, tt->t_bytes);
+    result = KATCP_RESULT_OWN;
+  }
+
+  free(tt->t_buffer);
+  free(tt);
+
+  return result;
+}
+
+/* takes over buffer, returns a katcp result, PAUSE if the io thread has the transfer */
+
+static int offload_transfer_tbs(struct katcp_dispatch *d, struct tbs_raw *tr, volatile uint32_t *bus, void *buffer, unsigned int bytes, int write)
+{
+  struct tbs_transfer *tt;
 
-  /* TODO: maybe add magic field to check we are deleting the correct thing */
-  if(te){
-    free(te);
+  tt = malloc(sizeof(struct tbs_transfer));
+  if(tt == NULL){
+    free(buffer);
+    return KATCP_RESULT_FAIL;
   }
+
+  tt->t_raw = tr;
+  tt->t_bus = bus;
+  tt->t_buffer = buffer;
+  tt->t_bytes = bytes;
+  tt->t_write = write;
+  tt->t_map = tr->r_map;
+  tt->t_map_size = tr->r_map_size;
+
+  tr->r_transfers++;
+
+  TRACE_KATCP(KATCP_TRACE_REGISTER, bytes, write ? "write" : "read");
+
+  /* without threads this completes in place, done still builds the reply */
+  return offload_katcp(d, &transfer_guard_tbs, &transfer_done_tbs, tt);
 }
 
+/*********************************************************************/
+
 void print_entry(struct katcp_dispatch *d, char *key, void *data)
 {
   struct tbs_entry *te;
@@ -226,8 +619,11 @@ int display_dir_cmd(struct katcp_dispatch *d, char *directory)
 int listdev_cmd(struct katcp_dispatch *d, int argc)
 {
   struct tbs_raw *tr;
-  char *a1;
-  void *call;
+  struct avl_iterator it;
+  struct avl_node *n;
+  char *a1, *prefix;
+  void (*call)(struct katcp_dispatch *d, char *key, void *data);
+  int index;
 
   tr = get_current_mode_katcp(d);
   if(tr == NULL){
@@ -241,30 +637,86 @@ int listdev_cmd(struct katcp_dispatch *d, int argc)
   }
 
   call = &print_entry;
+  index = 1;
 
-  if (argc > 1) {
-    a1 = arg_string_katcp(d, 1);
+  if (argc > index) {
+    a1 = arg_string_katcp(d, index);
+    if (a1 == NULL){
+      return KATCP_RESULT_FAIL;
+    }
     if (strcmp(a1, "size") == 0){
       call = &print_entry_size;
+      index++;
     } else if (strcmp(a1, "detail") == 0){
       call = &print_entry_detail;
-    } else {
-      log_message_katcp(d, KATCP_LEVEL_FATAL, NULL, "unable to get raw state");
-      return KATCP_RESULT_FAIL;
+      index++;
     }
   }
 
-  if (tr->r_registers != NULL){
-    print_inorder_avltree(d, tr->r_registers->t_root, call, 0);
-    return KATCP_RESULT_OK;
+  /* anything else restricts the listing to registers starting with it */
+  prefix = (argc > index) ? arg_string_katcp(d, index) : NULL;
+
+  if (tr->r_registers == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  start_iterator_avltree(tr->r_registers, &it, prefix);
+  while ((n = next_iterator_avltree(&it)) != NULL){
+    (*call)(d, get_node_name_avltree(n), get_node_data_avltree(n));
+  }
+
+  return KATCP_RESULT_OK;
+}
+
+static int display_bof_detail(struct katcp_dispatch *d, char *directory)
+{
+  DIR *dr;
+  struct dirent *de;
+  char path[PATH_MAX];
+  unsigned long count;
+  int regs;
+
+  dr = opendir(directory);
+  if(dr == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to open %s: %s", directory, strerror(errno));
+    extra_response_katcp(d, KATCP_RESULT_FAIL, "io");
+    return KATCP_RESULT_OWN;
+  }
+
+  count = 0;
+
+  while((de = readdir(dr)) != NULL){
+    if(de->d_name[0] != '.'){
+      snprintf(path, PATH_MAX, "%s/%s", directory, de->d_name);
+      path[PATH_MAX - 1] = '\0';
+
+      /* only consults the index cache, images which have not been programmed yet show as unknown */
+      regs = count_index_bof(path);
+
+      prepend_inform_katcp(d);
+      append_string_katcp(d, KATCP_FLAG_STRING, de->d_name);
+      if(regs < 0){
+        append_string_katcp(d, KATCP_FLAG_STRING | KATCP_FLAG_LAST, "unknown");
+      } else {
+        append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, regs);
+      }
+      count++;
+    }
   }
 
-  return KATCP_RESULT_FAIL;
+  closedir(dr);
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, count);
+
+  return KATCP_RESULT_OWN;
 }
 
 int listbof_cmd(struct katcp_dispatch *d, int argc)
 {
   struct tbs_raw *tr;
+  char *option;
 
   tr = get_current_mode_katcp(d);
   if(tr == NULL){
@@ -274,6 +726,13 @@ int listbof_cmd(struct katcp_dispatch *d, int argc)
 
   log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "bof directory is %s", tr->r_bof_dir);
 
+  if(argc > 1){
+    option = arg_string_katcp(d, 1);
+    if(option && !strcmp(option, "detail")){
+      return display_bof_detail(d, tr->r_bof_dir);
+    }
+  }
+
   return display_dir_cmd(d, tr->r_bof_dir);
 }
 
@@ -342,9 +801,9 @@ int word_write_cmd(struct katcp_dispatch *d, int argc)
   struct tbs_raw *tr;
   struct tbs_entry *te;
 
-  unsigned int i, start, shift, j;
+  unsigned int i, start, shift, j, origin, words;
   uint32_t value, prev, update, current;
-  char *name;
+  char *name, *map;
 
   tr = get_mode_katcp(d, TBS_MODE_RAW);
   if(tr == NULL){
@@ -388,9 +847,13 @@ int word_write_cmd(struct katcp_dispatch *d, int argc)
   }
 
   shift = te->e_pos_offset;
+  words = (argc - 3) + ((shift > 0) ? 1 : 0);
+
+  map = stage_shadow_tbs(tr, te, start / 4, words, &origin);
+
   j = te->e_pos_base + start;
   if(shift > 0){
-    current = *((uint32_t *)(tr->r_map + j));
+    current = *((uint32_t *)(map + j - origin));
     prev = current & (0xffffffff << (32 - shift));
   } else {
     prev = 0;
@@ -406,17 +869,24 @@ int word_write_cmd(struct katcp_dispatch *d, int argc)
     update = prev | (value >> shift);
 
     log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "writing 0x%x to position 0x%x", update, j);
-    *((uint32_t *)(tr->r_map + j)) = update;
+    *((uint32_t *)(map + j - origin)) = update;
 
-    prev = value << (32 - shift);
+    prev = (shift > 0) ? (value << (32 - shift)) : 0; /* a shift by the full width is undefined, x86 shifts by nothing */
     j += 4;
   }
 
   if(shift > 0){
-    current = (*((uint32_t *)(tr->r_map + j))) & (0xffffffff >> shift);
+    current = (*((uint32_t *)(map + j - origin))) & (0xffffffff >> shift);
     update = prev | current;
     log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "writing final, partial 0x%x to position 0x%x", update, j);
-    *((uint32_t *)(tr->r_map + j)) = update;
+    *((uint32_t *)(map + j - origin)) = update;
+  }
+
+  if(te->e_mode & TBS_SHADOWED){
+    if(commit_shadow_tbs(tr, te, start / 4, words) == 0){
+      log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "register %s unchanged, nothing written", name);
+      return KATCP_RESULT_OK;
+    }
   }
 
 #if 0
@@ -431,96 +901,51 @@ int word_write_cmd(struct katcp_dispatch *d, int argc)
   return KATCP_RESULT_OK;
 }
 
-int write_cmd(struct katcp_dispatch *d, int argc)
+/* writes blen bytes (or amount, if given) from buffer into register te at start, buffer
+ * needs to be padded out to a whole number of words. Does not sync the mapping, callers
+ * do that once they are done with all their writes */
+
+static int transfer_write_register(struct katcp_dispatch *d, struct tbs_entry *te, struct katcl_byte_bit *start, struct katcl_byte_bit *amount, uint32_t *buffer, unsigned int blen)
 {
   struct tbs_raw *tr;
-  struct tbs_entry *te;
-
   struct katcl_byte_bit off, len;
-
-  uint32_t *buffer;
-  unsigned int blen, ptr_base, ptr_offset, i, prefix_bits, register_bits, start_bits, copy_bits, copy_words_floor, remaining_bits;
+  unsigned int ptr_base, ptr_offset, i, prefix_bits, register_bits, start_bits, copy_bits, copy_words_floor, remaining_bits, origin, first, words;
   uint32_t current, prev, value, update;
+  char *map;
+#ifdef PROFILE
+  struct timeval then;
 
-  char *name;
+  gettimeofday(&then, NULL);
+#endif
 
   tr = get_mode_katcp(d, TBS_MODE_RAW);
   if(tr == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to acquire raw mode state");
-    return KATCP_RESULT_FAIL;
+    return -1;
   }
 
   if(tr->r_fpga != TBS_FPGA_MAPPED){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fpga not programmed");
-    return KATCP_RESULT_FAIL;
+    return -1;
   }
 
-  if(argc <= 3){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a register to read, followed by offset and one or more values");
-    return KATCP_RESULT_INVALID;
+  if(!(te->e_mode & TBS_WRITABLE)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register is not marked writeable");
+    return -1;
   }
 
-  name = arg_string_katcp(d, 1);
-  if(name == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register name inaccessible");
-    return KATCP_RESULT_FAIL;
-  }
+  memcpy(&off, start, sizeof(struct katcl_byte_bit));
 
-  te = find_data_avltree(tr->r_registers, name);
-  if(te == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s not defined", name);
-    return KATCP_RESULT_FAIL;
-  }
+  register_bits     = (te->e_len_base * 8) + te->e_len_offset;
+  start_bits         = (off.b_byte * 8) + off.b_bit;
 
-  if(!(te->e_mode & TBS_WRITABLE)){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s is not marked writeable", name);
-    return KATCP_RESULT_FAIL;
-  }
-  
-  if (arg_bb_katcp(d, 2, &off) < 0){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "expect offset in byte:bit format");
-    return KATCP_RESULT_FAIL;
-  }
+  if(amount == NULL){
+    /* no length given, assume all data given is data  */
 
-#if 0
-  /* WARNING: not strictly needed, comes later */
-  word_normalise(&off);
-#endif
+    len.b_bit = 0;
+    len.b_byte = blen;
 
-  blen = arg_buffer_katcp(d, 3, NULL, 0); 
-  if (blen < 0){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "cannot read buffer");
-    return KATCP_RESULT_FAIL;
-  }
-
-  buffer = malloc(sizeof(uint32_t) * ((blen + 3) / 4));
-  if (buffer == NULL){
-#ifdef DEBUG
-    fprintf(stderr, "raw: write cmd cannot allocate buffer of %d bytes\n", blen);
-#endif
-    return KATCP_RESULT_FAIL;
-  }
-
-  blen = arg_buffer_katcp(d, 3, buffer, blen);
-  if (blen < 0){
-    if (buffer != NULL){
-      free(buffer);
-    }
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "cannot read buffer");
-    return KATCP_RESULT_FAIL;
-  }
-  
-  register_bits     = (te->e_len_base * 8) + te->e_len_offset;
-  start_bits         = (off.b_byte * 8) + off.b_bit;
-
-  if (arg_bb_katcp(d, 4, &len) < 0){ 
-    /* no length given, assume all data given is data  */
-
-    len.b_bit = 0;
-    len.b_byte = blen;
-
-    word_normalise_bb_katcl(&len);
-    copy_bits = len.b_byte * 8 + len.b_bit;
+    word_normalise_bb_katcl(&len);
+    copy_bits = len.b_byte * 8 + len.b_bit;
 
 #ifdef DEBUG
     fprintf(stderr, "no length specified, defaulting to data %lu:%d\n", len.b_byte, len.b_bit);
@@ -528,12 +953,14 @@ int write_cmd(struct katcp_dispatch *d, int argc)
 
   } else {
 
+    memcpy(&len, amount, sizeof(struct katcl_byte_bit));
+
     word_normalise_bb_katcl(&len);
     copy_bits = len.b_byte * 8 + len.b_bit;
 
     if((blen * 8) < copy_bits){
       log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "requested %u bits to copy, buffer only contains %u", copy_bits, blen * 8);
-      return KATCP_RESULT_FAIL;
+      return -1;
     }
   }
 
@@ -544,11 +971,8 @@ int write_cmd(struct katcp_dispatch *d, int argc)
 #endif
 
   if((start_bits + copy_bits) > register_bits){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "trying to write past the end of the register %s of bits %u, start bits %u, payload %u bits", name, register_bits, start_bits, copy_bits);
-    if (buffer != NULL){
-      free(buffer);
-    }
-    return KATCP_RESULT_FAIL;
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "trying to write past the end of a register of bits %u, start bits %u, payload %u bits", register_bits, start_bits, copy_bits);
+    return -1;
   }
   
 #ifdef DEBUG
@@ -560,13 +984,19 @@ int write_cmd(struct katcp_dispatch *d, int argc)
   
   word_normalise_bb_katcl(&off);
 
-  log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "writing to %s@0x%lx:%d: start position 0x%lx:%d, payload length 0x%lx:%d, register size 0x%lx:%d", name, te->e_pos_base, te->e_pos_offset, off.b_byte, off.b_bit, len.b_byte, len.b_bit, te->e_len_base, te->e_len_offset);
+  log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "writing to 0x%lx:%d: start position 0x%lx:%d, payload length 0x%lx:%d, register size 0x%lx:%d", te->e_pos_base, te->e_pos_offset, off.b_byte, off.b_bit, len.b_byte, len.b_bit, te->e_len_base, te->e_len_offset);
 
   ptr_base   = off.b_byte;
   ptr_offset = off.b_bit;
 
+  /* only the words touched, for a shadowed register the rest is neither copied nor compared */
+  first = (ptr_base - te->e_pos_base) / 4;
+  words = (ptr_offset + copy_bits + 31) / 32;
+
+  map = stage_shadow_tbs(tr, te, first, words, &origin);
+
   if (ptr_offset > 0){
-    current = *((uint32_t *)(tr->r_map + ptr_base));
+    current = *((uint32_t *)(map + ptr_base - origin));
     prev    = current & (0xffffffff << (32 - ptr_offset));
   } else {
     prev    = 0;
@@ -581,21 +1011,17 @@ int write_cmd(struct katcp_dispatch *d, int argc)
 
   copy_words_floor = len.b_byte / 4;
 
-  /* the easy part, whole words */
-  for (i = 0; i < copy_words_floor; i++){
-
-    /* implicit is a ntohs */
-    value = buffer[i];
-
-    update = prev | (value >> ptr_offset);
-
-    log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "writing 0x%x to position 0x%x", update, ptr_base);
-
-    *((uint32_t *)(tr->r_map + ptr_base)) = update;
-    
-    prev = value << (32 - ptr_offset);
-    ptr_base += 4;
+  /* the easy part, whole words - implicit is a ntohs */
+  if(copy_words_floor > 0){
+    log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "writing %u whole words from position 0x%x shifted by %u", copy_words_floor, ptr_base, ptr_offset);
+    if(ptr_offset > 0){
+      prev = shift_out_tbs((uint32_t *)(map + ptr_base - origin), buffer, copy_words_floor, ptr_offset, prev);
+    } else {
+      copy_out_tbs((uint32_t *)(map + ptr_base - origin), buffer, copy_words_floor);
+    }
+    ptr_base += copy_words_floor * 4;
   }
+  i = copy_words_floor;
 
   /* WARNING, WARNING, WARNING: still not correct from down here onwards */
 
@@ -622,7 +1048,7 @@ int write_cmd(struct katcp_dispatch *d, int argc)
 
       log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "writing penultimate 0x%x to position 0x%x", prev, ptr_base);
 
-      *((uint32_t *)(tr->r_map + ptr_base)) = prev;
+      *((uint32_t *)(map + ptr_base - origin)) = prev;
 
       prev = value << (32 - ptr_offset);
       ptr_base += 4;
@@ -641,7 +1067,7 @@ int write_cmd(struct katcp_dispatch *d, int argc)
     /* now write a partial destination, so need to load in some bits */
     if(remaining_bits > 0){
 
-      current = *((uint32_t *)(tr->r_map + ptr_base));
+      current = *((uint32_t *)(map + ptr_base - origin));
 
       log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "read value 0x%x from 0x%x", current, ptr_base);
 
@@ -649,7 +1075,7 @@ int write_cmd(struct katcp_dispatch *d, int argc)
 
       log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "writing final 0x%x to position 0x%x", update, ptr_base);
 
-      *((uint32_t *)(tr->r_map + ptr_base)) = update;
+      *((uint32_t *)(map + ptr_base - origin)) = update;
 
     }
   }
@@ -713,12 +1139,126 @@ int write_cmd(struct katcp_dispatch *d, int argc)
   } 
 #endif
 
-  msync(tr->r_map, tr->r_map_size, MS_SYNC);
 
-  if (buffer != NULL){
-    free(buffer);
+  commit_shadow_tbs(tr, te, first, words);
+
+#ifdef PROFILE
+  profile_transfer_tbs(d, "write", (copy_bits + 7) / 8, &then);
+#endif
+
+  return 0;
+}
+
+int write_register(struct katcp_dispatch *d, struct tbs_entry *te, struct katcl_byte_bit *start, struct katcl_byte_bit *amount, uint32_t *buffer, unsigned int blen)
+{
+  int result;
+
+  TRACE_KATCP(KATCP_TRACE_REGISTER, blen, "write");
+  result = transfer_write_register(d, te, start, amount, buffer, blen);
+  TRACE_KATCP(KATCP_TRACE_REGISTER_DONE, result, "write");
+
+  return result;
+}
+
+int write_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct tbs_raw *tr;
+  struct tbs_entry *te;
+
+  struct katcl_byte_bit off, len;
+
+  uint32_t *buffer;
+  volatile uint32_t *bus;
+  unsigned int blen;
+  int result;
+
+  char *name;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to acquire raw mode state");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(tr->r_fpga != TBS_FPGA_MAPPED){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fpga not programmed");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc <= 3){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a register to read, followed by offset and one or more values");
+    return KATCP_RESULT_INVALID;
+  }
+
+  name = arg_string_katcp(d, 1);
+  if(name == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register name inaccessible");
+    return KATCP_RESULT_FAIL;
+  }
+
+  te = find_data_avltree(tr->r_registers, name);
+  if(te == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s not defined", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(!(te->e_mode & TBS_WRITABLE)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s is not marked writeable", name);
+    return KATCP_RESULT_FAIL;
+  }
+  
+  if (arg_bb_katcp(d, 2, &off) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "expect offset in byte:bit format");
+    return KATCP_RESULT_FAIL;
+  }
+
+#if 0
+  /* WARNING: not strictly needed, comes later */
+  word_normalise(&off);
+#endif
+
+  blen = arg_buffer_katcp(d, 3, NULL, 0); 
+  if (blen < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "cannot read buffer");
+    return KATCP_RESULT_FAIL;
+  }
+
+  buffer = malloc(sizeof(uint32_t) * ((blen + 3) / 4));
+  if (buffer == NULL){
+#ifdef DEBUG
+    fprintf(stderr, "raw: write cmd cannot allocate buffer of %d bytes\n", blen);
+#endif
+    return KATCP_RESULT_FAIL;
+  }
+
+  blen = arg_buffer_katcp(d, 3, buffer, blen);
+  if (blen < 0){
+    if (buffer != NULL){
+      free(buffer);
+    }
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "cannot read buffer");
+    return KATCP_RESULT_FAIL;
+  }
+  
+  if (arg_bb_katcp(d, 4, &len) < 0){ 
+    bus = aligned_bus_tbs(tr, te, &off, blen);
+    if(bus){
+      return offload_transfer_tbs(d, tr, bus, buffer, blen, 1);
+    }
+    result = write_register(d, te, &off, NULL, buffer, blen);
+  } else {
+    result = write_register(d, te, &off, &len, buffer, blen);
+  }
+
+  free(buffer);
+
+  if(result < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to write to register %s", name);
+    return KATCP_RESULT_FAIL;
   }
 
+  msync(tr->r_map, tr->r_map_size, MS_SYNC);
+
   if(check_bus_error(d) < 0){
     return KATCP_RESULT_FAIL;
   }  
@@ -730,9 +1270,9 @@ int word_read_cmd(struct katcp_dispatch *d, int argc)
 {
   struct tbs_raw *tr;
   struct tbs_entry *te;
-  char *name;
+  char *name, *map;
   uint32_t value, prev, current;
-  unsigned int length, start, i, j, shift, flags;
+  unsigned int length, start, i, j, shift, flags, origin;
 
   tr = get_mode_katcp(d, TBS_MODE_RAW);
   if(tr == NULL){
@@ -793,6 +1333,7 @@ int word_read_cmd(struct katcp_dispatch *d, int argc)
 
   j = te->e_pos_base + (start * 4);
   shift = te->e_pos_offset;
+  map = view_shadow_tbs(tr, te, &origin);
 
   log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "attempting to read %d words from fpga at 0x%x", length, j);
 
@@ -804,7 +1345,7 @@ int word_read_cmd(struct katcp_dispatch *d, int argc)
   flags = KATCP_FLAG_XLONG;
 
   if(shift > 0){
-    current = *((uint32_t *)(tr->r_map + j));
+    current = *((uint32_t *)(map + j - origin));
     prev = (current << shift);
     j += 4;
   } else {
@@ -813,11 +1354,11 @@ int word_read_cmd(struct katcp_dispatch *d, int argc)
   }
 
   for(i = 0; i < length; i++){
-    current = *((uint32_t *)(tr->r_map + j));
+    current = *((uint32_t *)(map + j - origin));
     /* WARNING: masking would be wise here, just in case sign extension happens */
     value = (current >> (32 - shift)) | prev;
 
-    prev = (current << shift);
+    prev = (shift < 32) ? (current << shift) : 0;
     j += 4;
     if(i + 1 >= length){
       flags |= KATCP_FLAG_LAST;
@@ -864,16 +1405,18 @@ void check_read_results(int *v, int floor)
 }
 #endif
 
-int read_register(struct katcp_dispatch *d, struct tbs_entry *te, struct katcl_byte_bit *start, struct katcl_byte_bit *amount, void *buffer, unsigned int size)
+static int transfer_read_register(struct katcp_dispatch *d, struct tbs_entry *te, struct katcl_byte_bit *start, struct katcl_byte_bit *amount, void *buffer, unsigned int size)
 {
   struct katcl_byte_bit sum, total, reg_len, reg_start, combined_start, limit;
   struct tbs_raw *tr;
-  unsigned int shift, grab_base, grab_offset, round_left;
-  unsigned long i, j;
-  uint32_t *ptr, prev, current, mask, tail_mask;
+  unsigned int shift, round_left;
+  unsigned long i, words;
+  uint32_t *ptr, current, tail_mask;
+  unsigned int origin;
+  char *map;
   int transfer;
 #ifdef PROFILE
-  struct timeval then, now, delta;
+  struct timeval then;
 
   gettimeofday(&then, NULL);
 #endif
@@ -978,6 +1521,8 @@ int read_register(struct katcp_dispatch *d, struct tbs_entry *te, struct katcl_b
   }
   word_normalise_bb_katcl(&combined_start);
 
+  map = view_shadow_tbs(tr, te, &origin);
+
 
   if(combined_start.b_bit == 0){
 
@@ -993,12 +1538,10 @@ int read_register(struct katcp_dispatch *d, struct tbs_entry *te, struct katcl_b
     }
 #else 
     /* WTF moments right here: FPGA 32 bit issues */
-    for(i = 0; i < amount->b_byte; i += 4){
-      current = *((uint32_t *)(tr->r_map + combined_start.b_byte + i));
-      memcpy(buffer + i, &current, 4);
-    }
+    i = amount->b_byte;
+    copy_in_tbs(buffer, (uint32_t *)(map + combined_start.b_byte - origin), i / 4);
     if(amount->b_bit){
-      current = *((uint32_t *)(tr->r_map + combined_start.b_byte + i));
+      current = *((uint32_t *)(map + combined_start.b_byte - origin + i));
       current = current & (~(0xffffffff >> (amount->b_bit)));
       memcpy(buffer + i, &current, round_left);
     }
@@ -1010,6 +1553,10 @@ int read_register(struct katcp_dispatch *d, struct tbs_entry *te, struct katcl_b
     }
 #endif
 
+#endif
+
+#ifdef PROFILE
+    profile_transfer_tbs(d, "fast read", transfer, &then);
 #endif
 
     /* END easy case */
@@ -1019,67 +1566,54 @@ int read_register(struct katcp_dispatch *d, struct tbs_entry *te, struct katcl_b
   /* COMPLEX: start at bit offset, read arb bytes and bits => shift, then copy */
 
   shift = combined_start.b_bit;
-  grab_base = amount->b_byte;
-  grab_offset = combined_start.b_bit + amount->b_bit;
+  words = amount->b_byte / 4;
+  ptr = (uint32_t *)(map + combined_start.b_byte - origin);
 
-  if(grab_offset > 32){
-    grab_offset -= 32;
-    grab_base += 4;
-  }
-
-  log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "complex read starting at %u:%u of 0x%x:%u maps to pos 0x%x:%u with grab %u:%u shifted by %u copied into %u bytes", start->b_byte, start->b_bit, amount->b_byte, amount->b_bit, combined_start.b_byte, combined_start.b_bit, grab_base, grab_offset, shift, transfer);
-
-  mask = ~(0xffffffff << shift);
-  ptr = (uint32_t *)(tr->r_map + combined_start.b_byte);
-
-  prev = (ptr[0]) << shift;
-  j = 1;
-  i = 0;
-
-  log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "complex read, partial first byte shifted is now 0x%08x (shift %u, mask 0x%08x)", prev, shift, mask);
+  log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "complex read starting at %u:%u of 0x%x:%u maps to pos 0x%x:%u with %lu words shifted by %u copied into %u bytes", start->b_byte, start->b_bit, amount->b_byte, amount->b_bit, combined_start.b_byte, combined_start.b_bit, words, shift, transfer);
 
-  while(i < grab_base){
-    current = ptr[j];
+  /* each output word straddles two bus words */
+  shift_in_tbs(buffer, ptr, words, shift);
+  i = words * 4;
 
-    current = prev | (mask & (ptr[j] >> (32 - shift)));
-    memcpy(buffer + i, &current, 4);
-  
-    prev = current << shift;
+  if(amount->b_bit){
+    /* last partial word only reaches into the next bus word if its bits cross over */
+    current = ptr[words] << shift;
+    if((shift + amount->b_bit) > 32){
+      current |= ptr[words + 1] >> (32 - shift);
+    }
+    tail_mask = ~(0xffffffff >> (amount->b_bit));
+    current &= tail_mask;
 
-    j++;
+    memcpy(buffer + i, &current, round_left);
 
-    i += 4;
+    log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "complex read, final word %u needs mask 0x%08x, result is 0x%08x", i, tail_mask, current);
   }
 
-  if(grab_offset){
-
-    if(grab_base > 0){
-      tail_mask = 0xffffffff << (32 - grab_offset);
-      current = (prev | (mask & ((ptr[j] & tail_mask) >> (32 - shift))));
-    } else {
 #ifdef KATCP_CONSISTENCY_CHECKS
-      if(shift > grab_offset){
-        fprintf(stderr, "read: expected at least one bit (shifted %u bits, last data bit %u", shift, grab_offset);
-        abort();
-      }
-#endif
-      tail_mask = 0xffffffff << (32 - (grab_offset - shift));
-      current = prev & tail_mask;
-    }
-    memcpy(buffer + i, &current, round_left);
-#ifdef KATCP_CONSISTENCY_CHECKS
-    if((i + round_left) != transfer){
-      fprintf(stderr, "read: read the incorrect number of bytes, needed %d\n", transfer);
-      abort();
-    }
+  if((i + round_left) != transfer){
+    fprintf(stderr, "read: read the incorrect number of bytes, needed %d\n", transfer);
+    abort();
+  }
 #endif
 
-    log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "complex read, final word %u needs mask 0x%08x, prev is 0x%08x, result is 0x%08x", i, tail_mask, prev, current);
-  }
+#ifdef PROFILE
+  profile_transfer_tbs(d, "complex read", transfer, &then);
+#endif
 
   return transfer;
 }
 
+int read_register(struct katcp_dispatch *d, struct tbs_entry *te, struct katcl_byte_bit *start, struct katcl_byte_bit *amount, void *buffer, unsigned int size)
+{
+  int result;
+
+  TRACE_KATCP(KATCP_TRACE_REGISTER, size, "read");
+  result = transfer_read_register(d, te, start, amount, buffer, size);
+  TRACE_KATCP(KATCP_TRACE_REGISTER_DONE, result, "read");
+
+  return result;
+}
+
 int read_cmd(struct katcp_dispatch *d, int argc)
 {
   struct katcl_byte_bit start, amount;
@@ -1088,6 +1622,7 @@ int read_cmd(struct katcp_dispatch *d, int argc)
   char *name;
   unsigned int space;
   void *ptr;
+  volatile uint32_t *bus;
   int results[3], result;
 #ifdef PROFILE
   struct timeval then, now, delta;
@@ -1157,6 +1692,13 @@ int read_cmd(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
+  if(amount.b_bit == 0){
+    bus = aligned_bus_tbs(tr, te, &start, space);
+    if(bus){
+      return offload_transfer_tbs(d, tr, bus, ptr, space, 0);
+    }
+  }
+
   result = read_register(d, te, &start, &amount, ptr, space);
 
   if(result != space){
@@ -1332,31 +1874,828 @@ int read_cmd(struct katcp_dispatch *d, int argc)
   if(want_offset){
     tail_mask = 0xff << (8 - want_offset);
 
-    if(grab_base > 0){
-      current = ptr[j];
-      buffer[i] = (prev | (mask & (current >> (8 - shift)))) & tail_mask;
-    } else {
-      buffer[i] = prev & tail_mask;
-    }
+    if(grab_base > 0){
+      current = ptr[j];
+      buffer[i] = (prev | (mask & (current >> (8 - shift)))) & tail_mask;
+    } else {
+      buffer[i] = prev & tail_mask;
+    }
+
+    log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "complex read, final byte (%u) needs mask 0x%02x, prev is 0x%02x, result is 0x%02x", i, tail_mask, prev, buffer[i]);
+
+    i++;
+  }
+
+  results[0] = prepend_reply_katcp(d);
+  results[1] = append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  results[2] = append_buffer_katcp(d, KATCP_FLAG_BUFFER | KATCP_FLAG_LAST, buffer, i);
+
+  free(buffer);
+
+#ifdef DEBUG
+  check_read_results(results, want_base + 1);
+#endif
+  check_bus_error(d);
+
+  return KATCP_RESULT_OWN;
+#endif
+}
+
+/*********************************************************************/
+
+/* vectored access: ?readv and ?writev resolve a list of name:byte-offset:byte-length
+ * specifications up front, then access all of them in one request, saving a round
+ * trip per register */
+
+#define TBS_VECTOR_NAME 128
+
+struct tbs_vector_item
+{
+  struct tbs_entry *v_entry;
+  struct katcl_byte_bit v_start;
+  struct katcl_byte_bit v_amount;
+  unsigned int v_size;
+};
+
+static int span_vector_tbs(struct katcp_dispatch *d, struct tbs_vector_item *vi, char *spec, unsigned long offset, unsigned long amount)
+{
+  /* written so that neither side can wrap */
+  if((offset > vi->v_entry->e_len_base) || (amount > (vi->v_entry->e_len_base - offset))){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "%s exceeds the %u bytes of its register", spec, vi->v_entry->e_len_base);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int total_vector_tbs(struct katcp_dispatch *d, unsigned int *total, unsigned int size)
+{
+  if(size > (TBS_VECTOR_TOTAL - *total)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "vector request exceeds limit of %u bytes", TBS_VECTOR_TOTAL);
+    return -1;
+  }
+
+  *total += size;
+
+  return 0;
+}
+
+static int resolve_vector_tbs(struct katcp_dispatch *d, struct tbs_raw *tr, char *spec, struct tbs_vector_item *vi, unsigned int mode)
+{
+  char name[TBS_VECTOR_NAME];
+  char *ptr, *end;
+  unsigned int len;
+  unsigned long offset, amount;
+
+  ptr = strchr(spec, ':');
+  len = (ptr == NULL) ? strlen(spec) : (ptr - spec);
+
+  if((len <= 0) || (len >= TBS_VECTOR_NAME)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unreasonable register name length in %s", spec);
+    return -1;
+  }
+
+  memcpy(name, spec, len);
+  name[len] = '\0';
+
+  vi->v_entry = find_data_avltree(tr->r_registers, name);
+  if(vi->v_entry == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s not defined", name);
+    return -1;
+  }
+
+  if(!(vi->v_entry->e_mode & mode)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s is not marked %s", name, (mode & TBS_WRITABLE) ? "writeable" : "readable");
+    return -1;
+  }
+
+  offset = 0;
+  amount = 4;
+
+  if(ptr){
+    offset = strtoul(ptr + 1, &end, 0);
+    if(end == (ptr + 1)){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to parse offset in %s", spec);
+      return -1;
+    }
+    if(*end == ':'){
+      ptr = end + 1;
+      amount = strtoul(ptr, &end, 0);
+      if((end == ptr) || (amount <= 0)){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to parse length in %s", spec);
+        return -1;
+      }
+    }
+    if(*end != '\0'){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "trailing garbage in %s", spec);
+      return -1;
+    }
+  }
+
+  /* default of a word, unless the register is smaller than that */
+  if((amount == 4) && (amount > vi->v_entry->e_len_base)){
+    amount = vi->v_entry->e_len_base;
+  }
+
+  /* writes replace the amount with the length of their value and check that themselves */
+  if(span_vector_tbs(d, vi, spec, offset, (mode & TBS_WRITABLE) ? 0 : amount) < 0){
+    return -1;
+  }
+
+  make_bb_katcl(&(vi->v_start), offset, 0);
+  word_normalise_bb_katcl(&(vi->v_start));
+
+  make_bb_katcl(&(vi->v_amount), amount, 0);
+  word_normalise_bb_katcl(&(vi->v_amount));
+
+  vi->v_size = amount;
+
+  return 0;
+}
+
+int readv_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct tbs_raw *tr;
+  struct tbs_vector_item *vector;
+  unsigned int i, count, total, flags;
+  unsigned char *buffer, *ptr;
+  char *spec;
+  int result;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(tr->r_fpga != TBS_FPGA_MAPPED){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fpga not programmed");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc <= 1){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need one or more registers to read in name[:byte-offset[:byte-length]] format");
+    return KATCP_RESULT_INVALID;
+  }
+
+  count = argc - 1;
+
+  vector = malloc(sizeof(struct tbs_vector_item) * count);
+  if(vector == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate vector of %u registers", count);
+    return KATCP_RESULT_FAIL;
+  }
+
+  total = 0;
+
+  for(i = 0; i < count; i++){
+    spec = arg_string_katcp(d, i + 1);
+    if(spec == NULL){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register specification %u inaccessible", i + 1);
+      free(vector);
+      return KATCP_RESULT_FAIL;
+    }
+    if(resolve_vector_tbs(d, tr, spec, &(vector[i]), TBS_READABLE) < 0){
+      free(vector);
+      return KATCP_RESULT_FAIL;
+    }
+    if(total_vector_tbs(d, &total, vector[i].v_size) < 0){
+      free(vector);
+      return KATCP_RESULT_FAIL;
+    }
+  }
+
+  buffer = malloc(total);
+  if(buffer == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %u bytes", total);
+    free(vector);
+    return KATCP_RESULT_FAIL;
+  }
+
+  /* do all the reads before we start the reply, so that errors can still be logged */
+  ptr = buffer;
+  for(i = 0; i < count; i++){
+    result = read_register(d, vector[i].v_entry, &(vector[i].v_start), &(vector[i].v_amount), ptr, vector[i].v_size);
+    if(result != vector[i].v_size){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to read %u bytes for %s", vector[i].v_size, arg_string_katcp(d, i + 1));
+      free(buffer);
+      free(vector);
+      return KATCP_RESULT_FAIL;
+    }
+    ptr += vector[i].v_size;
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+
+  ptr = buffer;
+  flags = KATCP_FLAG_BUFFER;
+  for(i = 0; i < count; i++){
+    if((i + 1) >= count){
+      flags |= KATCP_FLAG_LAST;
+    }
+    append_buffer_katcp(d, flags, ptr, vector[i].v_size);
+    ptr += vector[i].v_size;
+  }
+
+  free(buffer);
+  free(vector);
+
+  check_bus_error(d);
+
+  return KATCP_RESULT_OWN;
+}
+
+int writev_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct tbs_raw *tr;
+  struct tbs_vector_item *vector;
+  unsigned int i, count, blen, most;
+  uint32_t *buffer;
+  char *spec;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(tr->r_fpga != TBS_FPGA_MAPPED){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fpga not programmed");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if((argc <= 1) || ((argc % 2) == 0)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need one or more pairs of name[:byte-offset] and value");
+    return KATCP_RESULT_INVALID;
+  }
+
+  count = (argc - 1) / 2;
+
+  vector = malloc(sizeof(struct tbs_vector_item) * count);
+  if(vector == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate vector of %u registers", count);
+    return KATCP_RESULT_FAIL;
+  }
+
+  /* resolve everything first, so that a typo late in the list doesn't leave a partial update */
+  most = 0;
+  for(i = 0; i < count; i++){
+    spec = arg_string_katcp(d, (i * 2) + 1);
+    if(spec == NULL){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register specification %u inaccessible", (i * 2) + 1);
+      free(vector);
+      return KATCP_RESULT_FAIL;
+    }
+    if(resolve_vector_tbs(d, tr, spec, &(vector[i]), TBS_WRITABLE) < 0){
+      free(vector);
+      return KATCP_RESULT_FAIL;
+    }
+    blen = arg_buffer_katcp(d, (i * 2) + 2, NULL, 0);
+    if(blen <= 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no value given for %s", spec);
+      free(vector);
+      return KATCP_RESULT_FAIL;
+    }
+    if(span_vector_tbs(d, &(vector[i]), spec, vector[i].v_start.b_byte + (vector[i].v_start.b_bit / 8), blen) < 0){
+      free(vector);
+      return KATCP_RESULT_FAIL;
+    }
+    vector[i].v_size = blen;
+    if(blen > most){
+      most = blen;
+    }
+  }
+
+  buffer = malloc(sizeof(uint32_t) * ((most + 3) / 4));
+  if(buffer == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %u bytes", most);
+    free(vector);
+    return KATCP_RESULT_FAIL;
+  }
+
+  for(i = 0; i < count; i++){
+    blen = arg_buffer_katcp(d, (i * 2) + 2, buffer, most);
+    if(blen != vector[i].v_size){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to retrieve value %u", (i * 2) + 2);
+      break;
+    }
+    if(write_register(d, vector[i].v_entry, &(vector[i].v_start), NULL, buffer, blen) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to write %s", arg_string_katcp(d, (i * 2) + 1));
+      break;
+    }
+  }
+
+  free(buffer);
+  free(vector);
+
+  msync(tr->r_map, tr->r_map_size, MS_SYNC);
+
+  if(i < count){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "only %u of %u registers written", i, count);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(check_bus_error(d) < 0){
+    return KATCP_RESULT_FAIL;
+  }
+
+  return KATCP_RESULT_OK;
+}
+
+/*********************************************************************/
+
+/* bulkread streams a region as a sequence of #bulkread informs, a chunk at a time.
+ * The request yields between chunks, and only generates the next chunk once the
+ * client output queue has drained to below TBS_BULK_DEPTH messages, so memory use
+ * does not depend on the size of the region */
+
+static struct tbs_bulk *find_bulk_tbs(struct tbs_raw *tr, struct katcp_dispatch *d)
+{
+  unsigned int i;
+
+  for(i = 0; i < tr->r_bulk_count; i++){
+    if(tr->r_bulks[i]->b_dispatch == d){
+      return tr->r_bulks[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void release_bulk_tbs(struct tbs_raw *tr, struct tbs_bulk *tb)
+{
+  unsigned int i;
+
+  for(i = 0; (i < tr->r_bulk_count) && (tr->r_bulks[i] != tb); i++);
+
+  if(i < tr->r_bulk_count){
+    tr->r_bulk_count--;
+    tr->r_bulks[i] = tr->r_bulks[tr->r_bulk_count];
+  }
+
+  if(tb->b_buffer){
+    free(tb->b_buffer);
+    tb->b_buffer = NULL;
+  }
+
+  free(tb);
+}
+
+static struct tbs_bulk *acquire_bulk_tbs(struct tbs_raw *tr, struct katcp_dispatch *d, unsigned int chunk)
+{
+  struct tbs_bulk *tb, **tmp;
+
+  /* a stale entry is left behind if a client disconnects during a transfer, reuse it */
+  tb = find_bulk_tbs(tr, d);
+  if(tb){
+    release_bulk_tbs(tr, tb);
+  }
+
+  tmp = realloc(tr->r_bulks, sizeof(struct tbs_bulk *) * (tr->r_bulk_count + 1));
+  if(tmp == NULL){
+    return NULL;
+  }
+  tr->r_bulks = tmp;
+
+  tb = malloc(sizeof(struct tbs_bulk));
+  if(tb == NULL){
+    return NULL;
+  }
+
+  tb->b_buffer = malloc(chunk);
+  if(tb->b_buffer == NULL){
+    free(tb);
+    return NULL;
+  }
+
+  tb->b_dispatch = d;
+  tb->b_offset = 0;
+  tb->b_remaining = 0;
+  tb->b_chunk = chunk;
+  tb->b_sent = 0;
+
+  tr->r_bulks[tr->r_bulk_count] = tb;
+  tr->r_bulk_count++;
+
+  return tb;
+}
+
+int bulkread_more_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct katcl_byte_bit start, amount;
+  struct tbs_raw *tr;
+  struct tbs_bulk *tb;
+  unsigned int size;
+  int result;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  tb = find_bulk_tbs(tr, d);
+  if(tb == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "lost state of bulk transfer");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(tb->b_remaining <= 0){
+    prepend_reply_katcp(d);
+    append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+    append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, tb->b_sent);
+
+    release_bulk_tbs(tr, tb);
+
+    return KATCP_RESULT_OWN;
+  }
+
+  if(queued_katcl(line_katcp(d)) >= TBS_BULK_DEPTH){
+    /* still busy sending earlier chunks, come back later */
+    return KATCP_RESULT_YIELD;
+  }
+
+  size = (tb->b_remaining > tb->b_chunk) ? tb->b_chunk : tb->b_remaining;
+
+  make_bb_katcl(&start, tb->b_offset, 0);
+  make_bb_katcl(&amount, size, 0);
+
+  /* read_register rechecks the mapping, in case the fpga was reprogrammed under us */
+  result = read_register(d, &(tb->b_entry), &start, &amount, tb->b_buffer, size);
+  if(result != size){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "bulk read failed at offset %u after %u bytes", tb->b_offset, tb->b_sent);
+    release_bulk_tbs(tr, tb);
+    return KATCP_RESULT_FAIL;
+  }
+
+  prepend_inform_katcp(d);
+  append_buffer_katcp(d, KATCP_FLAG_BUFFER | KATCP_FLAG_LAST, tb->b_buffer, size);
+
+  tb->b_offset += size;
+  tb->b_remaining -= size;
+  tb->b_sent += size;
+
+  check_bus_error(d);
+
+  return KATCP_RESULT_YIELD;
+}
+
+int bulkread_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct tbs_raw *tr;
+  struct tbs_entry *te;
+  struct tbs_bulk *tb;
+  char *name;
+  unsigned int offset, length, chunk;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(tr->r_fpga != TBS_FPGA_MAPPED){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fpga not programmed");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc <= 1){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a register to read, followed by optional offset, length and chunk size");
+    return KATCP_RESULT_INVALID;
+  }
+
+  name = arg_string_katcp(d, 1);
+  if(name == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register name inaccessible");
+    return KATCP_RESULT_FAIL;
+  }
+
+  te = find_data_avltree(tr->r_registers, name);
+  if(te == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s not defined", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(!(te->e_mode & TBS_READABLE)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s is not marked readable", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  offset = 0;
+  if(argc > 2){
+    offset = arg_unsigned_long_katcp(d, 2);
+  }
+
+  if(offset > te->e_len_base){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "offset %u beyond end of register %s of %u bytes", offset, name, te->e_len_base);
+    return KATCP_RESULT_FAIL;
+  }
+
+  /* zero length, as sent by bulkread if no count is given, means up to the end */
+  length = 0;
+  if(argc > 3){
+    length = arg_unsigned_long_katcp(d, 3);
+  }
+  if(length == 0){
+    length = te->e_len_base - offset;
+  }
+
+  if((offset + length) > te->e_len_base){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "request for %u bytes at %u extends beyond end of register %s of %u bytes", length, offset, name, te->e_len_base);
+    return KATCP_RESULT_FAIL;
+  }
+
+  chunk = TBS_BULK_CHUNK;
+  if(argc > 4){
+    chunk = arg_unsigned_long_katcp(d, 4);
+    if((chunk <= 0) || (chunk > TBS_BULK_MAX_CHUNK)){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "chunk size %u not in range 1 to %u", chunk, TBS_BULK_MAX_CHUNK);
+      return KATCP_RESULT_FAIL;
+    }
+    /* keep the chunks word aligned */
+    chunk = (chunk + 3) & ~0x3;
+  }
+
+  tb = acquire_bulk_tbs(tr, d, chunk);
+  if(tb == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate bulk read state of %u bytes", chunk);
+    return KATCP_RESULT_FAIL;
+  }
+
+  /* a copy, the register table might get rebuilt during the transfer */
+  memcpy(&(tb->b_entry), te, sizeof(struct tbs_entry));
+  tb->b_entry.e_mode &= ~TBS_SHADOWED; /* the shadow goes away with the table, read the bus */
+  tb->b_offset = offset;
+  tb->b_remaining = length;
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "streaming %u bytes of %s from %u in chunks of %u", length, name, offset, chunk);
+
+  continue_katcp(d, 0, &bulkread_more_cmd);
+
+  return bulkread_more_cmd(d, argc);
+}
+
+/*********************************************************************/
+
+/* register handles: ?register-handle resolves and validates a register once,
+ * and returns a small integer. ?handleread and ?handlewrite then take that
+ * integer instead of a name, skipping the tree lookup and the layout checks.
+ * A handle carries the full epoch above its index, stop_fpga_tbs moves to
+ * a new epoch, so handles obtained before a ?progdev never match again.
+ * Rather than wrap, handles run out once the epoch no longer fits */
+
+static int make_handle_tbs(struct tbs_raw *tr, unsigned int index, unsigned long *handle)
+{
+  if(tr->r_handle_epoch > ((ULONG_MAX - index) / TBS_MAX_HANDLES)){
+    return -1;
+  }
+
+  *handle = (tr->r_handle_epoch * TBS_MAX_HANDLES) + index;
+
+  return 0;
+}
+
+static struct tbs_entry *resolve_handle_tbs(struct katcp_dispatch *d, struct tbs_raw *tr, unsigned long handle)
+{
+  unsigned int index;
+
+  index = handle % TBS_MAX_HANDLES;
+
+  if(((handle / TBS_MAX_HANDLES) != tr->r_handle_epoch) || (index >= tr->r_handle_count)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register handle %lu is stale or invalid", handle);
+    return NULL;
+  }
+
+  return tr->r_handles[index];
+}
+
+static void forget_handles_tbs(struct tbs_raw *tr)
+{
+  tr->r_handle_count = 0;
+  tr->r_handle_epoch++;
+}
+
+int register_handle_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct tbs_raw *tr;
+  struct tbs_entry *te, **tmp;
+  unsigned int i;
+  unsigned long handle;
+  char *name;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(tr->r_fpga != TBS_FPGA_MAPPED){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fpga not programmed");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc <= 1){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a register name");
+    return KATCP_RESULT_INVALID;
+  }
+
+  name = arg_string_katcp(d, 1);
+  if(name == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register name inaccessible");
+    return KATCP_RESULT_FAIL;
+  }
+
+  te = find_data_avltree(tr->r_registers, name);
+  if(te == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s not defined", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  /* the validation the handle commands rely on to skip */
+  if((te->e_pos_base + te->e_len_base + ((te->e_pos_offset + te->e_len_offset + 31) / 32) * 4) > tr->r_map_size){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s falls outside mapped fpga range", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  for(i = 0; (i < tr->r_handle_count) && (tr->r_handles[i] != te); i++);
+
+  if(make_handle_tbs(tr, i, &handle) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register handles exhausted after %lu reprogrammings", tr->r_handle_epoch);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(i >= tr->r_handle_count){
+    if(tr->r_handle_count >= TBS_MAX_HANDLES){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "all %u register handles in use", TBS_MAX_HANDLES);
+      return KATCP_RESULT_FAIL;
+    }
+
+    tmp = realloc(tr->r_handles, sizeof(struct tbs_entry *) * (tr->r_handle_count + 1));
+    if(tmp == NULL){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate handle for %s", name);
+      return KATCP_RESULT_FAIL;
+    }
+
+    tr->r_handles = tmp;
+    tr->r_handles[tr->r_handle_count] = te;
+    i = tr->r_handle_count;
+    tr->r_handle_count++;
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_unsigned_long_katcp(d, KATCP_FLAG_ULONG | KATCP_FLAG_LAST, handle);
+
+  return KATCP_RESULT_OWN;
+}
+
+int handle_read_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct katcl_byte_bit start, amount;
+  struct tbs_raw *tr;
+  struct tbs_entry *te;
+  uint32_t local[TBS_HANDLE_BUFFER / 4];
+  unsigned int offset, length;
+  void *ptr;
+  int result;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(tr->r_fpga != TBS_FPGA_MAPPED){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fpga not programmed");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc <= 1){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a register handle, followed by optional byte offset and count");
+    return KATCP_RESULT_INVALID;
+  }
+
+  te = resolve_handle_tbs(d, tr, arg_unsigned_long_katcp(d, 1));
+  if(te == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(!(te->e_mode & TBS_READABLE)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register is not marked readable");
+    return KATCP_RESULT_FAIL;
+  }
+
+  offset = (argc > 2) ? arg_unsigned_long_katcp(d, 2) : 0;
+  length = (argc > 3) ? arg_unsigned_long_katcp(d, 3) : 4;
+
+  if((length <= 0) || ((offset + length) > te->e_len_base) || ((offset + length) < offset)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "read of %u bytes at %u does not fit register of %u bytes", length, offset, te->e_len_base);
+    return KATCP_RESULT_FAIL;
+  }
+
+  ptr = (length <= TBS_HANDLE_BUFFER) ? local : malloc(length);
+  if(ptr == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %u bytes", length);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if((te->e_pos_offset == 0) && ((offset % 4) == 0) && ((length % 4) == 0) && !(te->e_mode & TBS_SHADOWED)){
+    /* common case: bounds were checked when the handle was issued */
+    copy_in_tbs(ptr, (uint32_t *)(tr->r_map + te->e_pos_base + offset), length / 4);
+  } else {
+    make_bb_katcl(&start, offset, 0);
+    make_bb_katcl(&amount, length, 0);
+    result = read_register(d, te, &start, &amount, ptr, length);
+    if(result != length){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "requested %u bytes but got %d", length, result);
+      if(ptr != local){
+        free(ptr);
+      }
+      return KATCP_RESULT_FAIL;
+    }
+  }
+
+  prepend_reply_katcp(d);
+  append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
+  append_buffer_katcp(d, KATCP_FLAG_BUFFER | KATCP_FLAG_LAST, ptr, length);
+
+  if(ptr != local){
+    free(ptr);
+  }
+
+  check_bus_error(d);
+
+  return KATCP_RESULT_OWN;
+}
+
+int handle_write_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct katcl_byte_bit start;
+  struct tbs_raw *tr;
+  struct tbs_entry *te;
+  uint32_t local[TBS_HANDLE_BUFFER / 4], *ptr;
+  unsigned int offset, length;
+  int result;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(tr->r_fpga != TBS_FPGA_MAPPED){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fpga not programmed");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc <= 3){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a register handle, followed by byte offset and value");
+    return KATCP_RESULT_INVALID;
+  }
+
+  te = resolve_handle_tbs(d, tr, arg_unsigned_long_katcp(d, 1));
+  if(te == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(!(te->e_mode & TBS_WRITABLE)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register is not marked writeable");
+    return KATCP_RESULT_FAIL;
+  }
+
+  offset = arg_unsigned_long_katcp(d, 2);
+
+  length = arg_buffer_katcp(d, 3, NULL, 0);
+  if((length <= 0) || ((offset + length) > te->e_len_base) || ((offset + length) < offset)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "write of %u bytes at %u does not fit register of %u bytes", length, offset, te->e_len_base);
+    return KATCP_RESULT_FAIL;
+  }
+
+  ptr = (length <= TBS_HANDLE_BUFFER) ? local : malloc(sizeof(uint32_t) * ((length + 3) / 4));
+  if(ptr == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %u bytes", length);
+    return KATCP_RESULT_FAIL;
+  }
+
+  arg_buffer_katcp(d, 3, ptr, length);
 
-    log_message_katcp(d, KATCP_LEVEL_TRACE, NULL, "complex read, final byte (%u) needs mask 0x%02x, prev is 0x%02x, result is 0x%02x", i, tail_mask, prev, buffer[i]);
+  if((te->e_pos_offset == 0) && ((offset % 4) == 0) && ((length % 4) == 0) && !(te->e_mode & TBS_SHADOWED)){
+    copy_out_tbs((uint32_t *)(tr->r_map + te->e_pos_base + offset), ptr, length / 4);
+    result = 0;
+  } else {
+    make_bb_katcl(&start, offset, 0);
+    result = write_register(d, te, &start, NULL, ptr, length);
+  }
 
-    i++;
+  if(ptr != local){
+    free(ptr);
   }
 
-  results[0] = prepend_reply_katcp(d);
-  results[1] = append_string_katcp(d, KATCP_FLAG_STRING, KATCP_OK);
-  results[2] = append_buffer_katcp(d, KATCP_FLAG_BUFFER | KATCP_FLAG_LAST, buffer, i);
+  if(result < 0){
+    return KATCP_RESULT_FAIL;
+  }
 
-  free(buffer);
+  msync(tr->r_map, tr->r_map_size, MS_SYNC);
 
-#ifdef DEBUG
-  check_read_results(results, want_base + 1);
-#endif
-  check_bus_error(d);
+  if(check_bus_error(d) < 0){
+    return KATCP_RESULT_FAIL;
+  }
 
-  return KATCP_RESULT_OWN;
-#endif
+  return KATCP_RESULT_OK;
 }
 
 int fpgastatus_cmd(struct katcp_dispatch *d, int argc)
@@ -1537,6 +2876,7 @@ int register_cmd(struct katcp_dispatch *d, int argc)
   entry.e_len_offset = mod;
 
   entry.e_mode = TBS_WRABLE;
+  entry.e_shadow = NULL;
 
   if((entry.e_len_base == 0) && (entry.e_len_offset == 0)){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "size of register %s malformed", name);
@@ -1548,7 +2888,7 @@ int register_cmd(struct katcp_dispatch *d, int argc)
   
   log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "start of %s at 0x%x and bit %d with size of %u bytes and %u bits", name, entry.e_pos_base, entry.e_pos_offset, entry.e_len_base, entry.e_len_offset);
 
-  te = malloc(sizeof(struct tbs_entry));
+  te = alloc_arena_avltree(tr->r_registers, sizeof(struct tbs_entry));
   if(te == NULL){
     return KATCP_RESULT_FAIL;
   }
@@ -1557,7 +2897,85 @@ int register_cmd(struct katcp_dispatch *d, int argc)
 
   if(store_named_node_avltree(tr->r_registers, name, te) < 0){
     log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to store definition of register %s", name);
-    free(te);
+    return KATCP_RESULT_FAIL;
+  }
+
+  return KATCP_RESULT_OK;
+}
+
+int register_shadow_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct tbs_raw *tr;
+  struct tbs_entry *te;
+  char *name, *state;
+  unsigned int words;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(tr->r_fpga != TBS_FPGA_MAPPED){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fpga not programmed");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc <= 1){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a register name");
+    return KATCP_RESULT_INVALID;
+  }
+
+  name = arg_string_katcp(d, 1);
+  if(name == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register name inaccessible");
+    return KATCP_RESULT_FAIL;
+  }
+
+  te = find_data_avltree(tr->r_registers, name);
+  if(te == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s not defined", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  state = (argc > 2) ? arg_string_katcp(d, 2) : "on";
+  if(state == NULL){
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(!strcmp(state, "off")){
+    /* storage stays in the arena until the next progdev, in case it gets switched on again */
+    te->e_mode &= ~TBS_SHADOWED;
+    return KATCP_RESULT_OK;
+  }
+
+  if(strcmp(state, "on")){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown shadow state %s, expected on or off", state);
+    return KATCP_RESULT_INVALID;
+  }
+
+  words = shadow_words_tbs(te);
+
+  if((te->e_pos_base % 4) || ((te->e_pos_base + (words * 4)) > tr->r_map_size)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register %s at 0x%x can not be shadowed", name, te->e_pos_base);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(te->e_shadow == NULL){
+    te->e_shadow = alloc_arena_avltree(tr->r_registers, words * 4 * 2);
+    if(te->e_shadow == NULL){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %u bytes to shadow register %s", words * 4 * 2, name);
+      return KATCP_RESULT_FAIL;
+    }
+  }
+
+  /* (re)load from the bus, switching on again resynchronises a shadow */
+  copy_in_tbs(te->e_shadow, (volatile uint32_t *)(tr->r_map + te->e_pos_base), words);
+  te->e_mode |= TBS_SHADOWED;
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "shadowing %u words of register %s", words, name);
+
+  if(check_bus_error(d) < 0){
+    te->e_mode &= ~TBS_SHADOWED;
     return KATCP_RESULT_FAIL;
   }
 
@@ -1602,6 +3020,7 @@ int status_fpga_tbs(struct katcp_dispatch *d, int status)
 int unmap_raw_tbs(struct katcp_dispatch *d)
 {
   struct tbs_raw *tr;
+  struct tbs_mapping *tm;
 
   tr = get_mode_katcp(d, TBS_MODE_RAW);
   if(tr == NULL){
@@ -1613,7 +3032,19 @@ int unmap_raw_tbs(struct katcp_dispatch *d)
     return 0;
   }
 
-  munmap(tr->r_map, tr->r_map_size);
+  if(tr->r_transfers > 0){
+    tm = malloc(sizeof(struct tbs_mapping));
+    if(tm == NULL){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to defer unmapping, leaking mapping still used by %u transfers", tr->r_transfers);
+    } else {
+      tm->m_base = tr->r_map;
+      tm->m_size = tr->r_map_size;
+      tm->m_next = tr->r_retired;
+      tr->r_retired = tm;
+    }
+  } else {
+    munmap(tr->r_map, tr->r_map_size);
+  }
   status_fpga_tbs(d, TBS_FPGA_PROGRAMMED);
 
   tr->r_map_size = 0;
@@ -1622,6 +3053,49 @@ int unmap_raw_tbs(struct katcp_dispatch *d)
   return 0;
 }
 
+/* Emulation (-e image): instead of the fpga bus, map a file which stands
+ * in for it. The image is created if needed and grown to cover the
+ * registers of the bof - sparse, so only the pages touched take up space.
+ * On hugetlbfs the mapping is rounded up to whole huge pages */
+
+static int open_image_tbs(struct katcp_dispatch *d, struct tbs_raw *tr)
+{
+  struct statfs sf;
+  struct stat st;
+  unsigned long page;
+  int fd;
+
+  fd = open(tr->r_emulate, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if(fd < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to open emulated fpga image %s: %s", tr->r_emulate, strerror(errno));
+    return -1;
+  }
+
+  if((fstatfs(fd, &sf) == 0) && (sf.f_type == HUGETLBFS_MAGIC)){
+    page = sf.f_bsize;
+    tr->r_map_size = ((tr->r_map_size + page - 1) / page) * page;
+  }
+
+  if(fstat(fd, &st) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to stat emulated fpga image %s: %s", tr->r_emulate, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  if(st.st_size < tr->r_map_size){
+    /* accesses beyond the end of a file would raise bus errors */
+    if(ftruncate(fd, tr->r_map_size) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to extend emulated fpga image %s to %u bytes: %s", tr->r_emulate, tr->r_map_size, strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "emulating fpga with %u bytes of %s", tr->r_map_size, tr->r_emulate);
+
+  return fd;
+}
+
 int map_raw_tbs(struct katcp_dispatch *d)
 {
   struct tbs_raw *tr;
@@ -1652,16 +3126,23 @@ int map_raw_tbs(struct katcp_dispatch *d)
     log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "requesting to map a rather large area of 0x%x", tr->r_map_size);
   }
 
-  fd = open(TBS_FPGA_MEM, O_RDWR);
-  if(fd < 0){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to open file %s: %s", TBS_FPGA_MEM, strerror(errno));
-    return -1;
+  if(tr->r_emulate){
+    fd = open_image_tbs(d, tr);
+    if(fd < 0){
+      return -1;
+    }
+  } else {
+    fd = open(TBS_FPGA_MEM, O_RDWR);
+    if(fd < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to open file %s: %s", TBS_FPGA_MEM, strerror(errno));
+      return -1;
+    }
   }
 
   tr->r_map = mmap(NULL, tr->r_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
   if(tr->r_map == MAP_FAILED){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to map file %s: %s", TBS_FPGA_MEM, strerror(errno));
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to map file %s: %s", tr->r_emulate ? tr->r_emulate : TBS_FPGA_MEM, strerror(errno));
     close(fd);
     return -1;
   }
@@ -1708,8 +3189,11 @@ int stop_fpga_tbs(struct katcp_dispatch *d)
     tr->r_image = NULL;
   }
 
+  forget_regsensors_tbs(tr);
+  forget_handles_tbs(tr);
+
   if(tr->r_registers){
-    destroy_avltree(tr->r_registers, &free_entry);
+    destroy_avltree(tr->r_registers, NULL); /* entries are in the arena */
     tr->r_registers = NULL;
   }
 
@@ -1731,19 +3215,42 @@ int start_fpga_tbs(struct katcp_dispatch *d, struct bof_state *bs)
     return -1;
   }
 
-  tr->r_registers = create_avltree();
-  if(tr->r_registers == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create register lookup structure");
+  if(tr->r_emulate){
+    /* nothing to configure, the image only needs the register table of the bof */
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "emulating fpga, not loading bit stream");
+  } else if(program_bof(d, bs, TBS_FPGA_CONFIG) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to program bit stream to %s", TBS_FPGA_CONFIG);
     return -1;
   }
 
-  if(program_bof(d, bs, TBS_FPGA_CONFIG) < 0){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to program bit stream to %s", TBS_FPGA_CONFIG);
+  return attach_fpga_tbs(d, bs);
+}
+
+/* for an fpga which already holds the bitstream of bs, eg streamed in during an upload */
+
+int attach_fpga_tbs(struct katcp_dispatch *d, struct bof_state *bs)
+{
+  struct tbs_raw *tr;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    log_message_katcp(d, KATCP_LEVEL_FATAL, NULL, "unable to acquire state");
+    return -1;
+  }
+
+  if((tr->r_registers)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "fpga seems already programmed");
     return -1;
   }
 
   status_fpga_tbs(d, TBS_FPGA_PROGRAMMED);
 
+  tr->r_registers = create_arena_avltree(0);
+  if(tr->r_registers == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create register lookup structure");
+    return -1;
+  }
+
   if(index_bof(d, bs) < 0){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to load register mapping");
     return -1;
@@ -1764,6 +3271,14 @@ void destroy_raw_tbs(struct katcp_dispatch *d, struct tbs_raw *tr)
     return;
   }
 
+  if(tr->r_io_threads){
+    /* waits for the transfer in progress, queued ones are completed with a NULL dispatch */
+    stop_workers_katcp(d);
+    tr->r_io_threads = 0;
+  }
+
+  release_mappings_tbs(tr);
+
   /* slight duplication of stop_fpga_tbs */
 
   stop_all_getap(d, 1);
@@ -1776,7 +3291,7 @@ void destroy_raw_tbs(struct katcp_dispatch *d, struct tbs_raw *tr)
   }
 
   if(tr->r_registers){
-    destroy_avltree(tr->r_registers, &free_entry);
+    destroy_avltree(tr->r_registers, NULL); /* entries are in the arena */
     tr->r_registers = NULL;
   }
 
@@ -1787,6 +3302,13 @@ void destroy_raw_tbs(struct katcp_dispatch *d, struct tbs_raw *tr)
 
   /**********************/
 
+  if(tr->r_startup.s_timer){
+    discharge_timer_katcp(d, &(tr->r_startup));
+    tr->r_startup.s_timer = 0;
+  }
+
+  release_hwmon_tbs(d, tr);
+
   if (tr->r_hwmon){
     destroy_avltree(tr->r_hwmon, &destroy_hwsensor_tbs);
     tr->r_hwmon = NULL;
@@ -1797,6 +3319,34 @@ void destroy_raw_tbs(struct katcp_dispatch *d, struct tbs_raw *tr)
     tr->r_chassis = NULL;
   }
 
+  while(tr->r_bulk_count > 0){
+    release_bulk_tbs(tr, tr->r_bulks[0]);
+  }
+
+  if(tr->r_bulks){
+    free(tr->r_bulks);
+    tr->r_bulks = NULL;
+  }
+
+  if(tr->r_handles){
+    free(tr->r_handles);
+    tr->r_handles = NULL;
+  }
+
+  if(tr->r_regsensor_timer){
+    discharge_timer_katcp(d, tr);
+    tr->r_regsensor_timer = 0;
+  }
+
+  if(tr->r_regsensors){
+    while(tr->r_regsensor_count > 0){
+      tr->r_regsensor_count--;
+      destroy_regsensor_tbs(tr->r_regsensors[tr->r_regsensor_count]);
+    }
+    free(tr->r_regsensors);
+    tr->r_regsensors = NULL;
+  }
+
   if (tr->r_bof_dir != NULL){
     free(tr->r_bof_dir);
     tr->r_bof_dir = NULL;
@@ -1859,13 +3409,62 @@ int make_bofdir_tbs(struct katcp_dispatch *d, struct tbs_raw *tr, char *bofdir)
   return -1;
 }
 
-int setup_raw_tbs(struct katcp_dispatch *d, char *bofdir, int argc, char **argv)
+/* one step of the deferred hardware setup: the chassis first, then hwmon a batch at a time */
+
+static int step_startup_tbs(struct katcp_dispatch *d, void *data)
+{
+  struct tbs_startup *ts;
+  struct tbs_raw *tr;
+  struct timeval now, delta;
+  int pending;
+
+  ts = data;
+  tr = ts->s_raw;
+
+  monotonic_time_katcp(&now);
+  sub_time_katcp(&delta, &now, &(ts->s_began));
+
+  if(ts->s_steps == 0){
+    log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "listening %lu.%03lus after startup", delta.tv_sec, delta.tv_usec / 1000);
+  }
+  ts->s_steps++;
+
+  if(ts->s_chassis){
+    ts->s_chassis = 0;
+    /* ?chassis-start may have beaten us to it */
+    if(tr->r_chassis == NULL){
+      tr->r_chassis = chassis_init_tbs(d, TBS_ROACH_CHASSIS);
+      if(tr->r_chassis){
+        hook_commands_katcp(d, KATCP_HOOK_PRE, &pre_hook_led_cmd);
+        hook_commands_katcp(d, KATCP_HOOK_POST, &post_hook_led_cmd);
+      }
+
+      monotonic_time_katcp(&now);
+      sub_time_katcp(&delta, &now, &(ts->s_began));
+      log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "chassis %s %lu.%03lus after startup", tr->r_chassis ? "ready" : "unavailable", delta.tv_sec, delta.tv_usec / 1000);
+    }
+  }
+
+  pending = discover_hwmon_tbs(d, TBS_STARTUP_BATCH);
+  if(pending > 0){
+    return 0;
+  }
+
+  monotonic_time_katcp(&now);
+  sub_time_katcp(&delta, &now, &(ts->s_began));
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "hardware setup found %u hwmon sensors in %u steps, done %lu.%03lus after startup", tr->r_hwgroup.w_count, ts->s_steps, delta.tv_sec, delta.tv_usec / 1000);
+
+  ts->s_timer = 0;
+
+  /* stops the timer */
+  return -1;
+}
+
+int setup_raw_tbs(struct katcp_dispatch *d, char *bofdir, char *emulate, int argc, char **argv)
 {
   struct tbs_raw *tr;
   int result;
-#if 0
   struct sigaction sa;
-#endif
 
   tr = malloc(sizeof(struct tbs_raw));
   if(tr == NULL){
@@ -1876,11 +3475,22 @@ int setup_raw_tbs(struct katcp_dispatch *d, char *bofdir, int argc, char **argv)
   tr->r_hwmon = NULL;
   tr->r_fpga = TBS_FPGA_DOWN;
 
+  tr->r_hwgroup.w_sensors = NULL;
+  tr->r_hwgroup.w_count = 0;
+  tr->r_hwgroup.w_poll = 0;
+  tr->r_hwgroup.w_idle = 0;
+  tr->r_hwgroup.w_probe = 0;
+
   tr->r_map = NULL;
   tr->r_map_size = 0;
 
+  tr->r_transfers = 0;
+  tr->r_retired = NULL;
+  tr->r_io_threads = 0;
+
   tr->r_image = NULL;
   tr->r_bof_dir = NULL;
+  tr->r_emulate = emulate;
 
   tr->r_top_register = 0;
 
@@ -1889,13 +3499,34 @@ int setup_raw_tbs(struct katcp_dispatch *d, char *bofdir, int argc, char **argv)
 
   tr->r_chassis = NULL;
 
+  tr->r_startup.s_raw = tr;
+  monotonic_time_katcp(&(tr->r_startup.s_began));
+  tr->r_startup.s_steps = 0;
+  tr->r_startup.s_timer = 0;
+  tr->r_startup.s_chassis = 1;
+
   tr->r_taps = NULL;
   tr->r_instances = 0;
 
+  tr->r_tap_scheduler.c_raw = tr;
+  tr->r_tap_scheduler.c_poll = 0;
+  tr->r_tap_scheduler.c_next = 0;
+
+  tr->r_bulks = NULL;
+  tr->r_bulk_count = 0;
+
+  tr->r_regsensors = NULL;
+  tr->r_regsensor_count = 0;
+  tr->r_regsensor_timer = 0;
+
+  tr->r_handles = NULL;
+  tr->r_handle_count = 0;
+  tr->r_handle_epoch = 0;
+
   /* clear out further structure elements */
 
   /* allocate structure elements */
-  tr->r_registers = create_avltree();
+  tr->r_registers = create_arena_avltree(0);
   if(tr->r_registers == NULL){
     destroy_raw_tbs(d, tr);
     return -1;
@@ -1916,59 +3547,181 @@ int setup_raw_tbs(struct katcp_dispatch *d, char *bofdir, int argc, char **argv)
     return -1;
   }
 
-  if ((result = setup_hwmon_tbs(d)) < 0){
-#ifdef DEBUG
-    fprintf(stderr, "hwmon: setup returns %d\n", result);
-#endif
-  }
-
-#if 0
+  /* only recovers inside transfer_guard_tbs, elsewhere a bus error remains fatal */
   sa.sa_handler = handle_bus_error;
   sa.sa_flags = SA_RESTART;
   sigemptyset(&(sa.sa_mask));
 
   sigaction(SIGBUS, &sa, NULL);
-#endif
 
   bus_error_happened = 0;
 
+  if(start_workers_katcp(d, TBS_IO_THREADS) > 0){
+    tr->r_io_threads = 1;
+  } else {
+    /* happens when libkatcp is built without KATCP_THREADS, see Makefile.inc */
+    fprintf(stderr, "raw: unable to start register io thread, large transfers will block all clients\n");
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "no register io thread, large transfers stay in the loop");
+  }
+
   result = 0;
 
-  result += register_flag_mode_katcp(d, "?uploadbof",    "upload a (possibly compressed) boffile (?uploadbof port filename [length [timeout]])", &uploadbof_cmd, 0, TBS_MODE_RAW);
-  result += register_flag_mode_katcp(d, "?upload",       "upload and program a (possibly compressed) boffile (?upload [port [length [timeout]]])", &upload_cmd, 0, TBS_MODE_RAW);
+  result += register_flag_mode_katcp(d, "?uploadbof",    "upload a (possibly compressed) boffile (?uploadbof port filename [length [timeout [compress]]])", &uploadbof_cmd, 0, TBS_MODE_RAW);
+  result += register_flag_mode_katcp(d, "?upload",       "upload and program a (possibly compressed) boffile (?upload [port [length [timeout [store|stream [save-name]]]]])", &upload_cmd, 0, TBS_MODE_RAW);
 
   result += register_flag_mode_katcp(d, "?register",     "name a memory location (?register name position bit-offset length)", &register_cmd, 0, TBS_MODE_RAW);
+  result += register_flag_mode_katcp(d, "?register-shadow", "serve a register the gateware never changes from a host copy (?register-shadow name [on|off])", &register_shadow_cmd, 0, TBS_MODE_RAW);
 
   result += register_flag_mode_katcp(d, "?write",        "write binary data to a named register (?write name byte-offset:bit-offset value byte-length:bit-length)", &write_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?read",         "read binary data from a named register (?read name byte-offset:bit-offset byte-length:bit-length)", &read_cmd, 0, TBS_MODE_RAW);
 
+  result += register_flag_mode_katcp(d, "?readv",        "read binary data from several registers (?readv name[:byte-offset[:byte-length]]+)", &readv_cmd, 0, TBS_MODE_RAW);
+  result += register_flag_mode_katcp(d, "?writev",       "write binary data to several registers (?writev [name[:byte-offset] value]+)", &writev_cmd, 0, TBS_MODE_RAW);
+
+  result += register_flag_mode_katcp(d, "?bulkread",     "stream binary data from a named register as informs (?bulkread name [byte-offset [byte-length [chunk-size]]])", &bulkread_cmd, 0, TBS_MODE_RAW);
+
+  result += register_flag_mode_katcp(d, "?register-handle", "obtain a numeric handle for a register (?register-handle name)", &register_handle_cmd, 0, TBS_MODE_RAW);
+  result += register_flag_mode_katcp(d, "?handleread",   "read binary data using a register handle (?handleread handle [byte-offset [byte-length]])", &handle_read_cmd, 0, TBS_MODE_RAW);
+  result += register_flag_mode_katcp(d, "?handlewrite",  "write binary data using a register handle (?handlewrite handle byte-offset value)", &handle_write_cmd, 0, TBS_MODE_RAW);
+
   result += register_flag_mode_katcp(d, "?wordwrite",    "write hex words to a named register (?wordwrite name index value+)", &word_write_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?wordread",     "read hex words from a named register (?wordread name word-offset:bit-offset word-count)", &word_read_cmd, 0, TBS_MODE_RAW);
 
   result += register_flag_mode_katcp(d, "?progdev",      "program the fpga (?progdev [filename])", &progdev_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?fpgastatus",   "display if the fpga is programmed (?fpgastatus)", &fpgastatus_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?status",       "compatebility alias for fpgastatus, use fpgastatus in new code (?status)", &fpgastatus_cmd, 0, TBS_MODE_RAW);
-  result += register_flag_mode_katcp(d, "?listdev",      "lists available registers (?listdev [size|detail]", &listdev_cmd, 0, TBS_MODE_RAW);
+  result += register_flag_mode_katcp(d, "?listdev",      "lists available registers (?listdev [size|detail] [prefix])", &listdev_cmd, 0, TBS_MODE_RAW);
 
-  result += register_flag_mode_katcp(d, "?listbof",      "display available bof files (?listbof)", &listbof_cmd, 0, TBS_MODE_RAW);
+  result += register_flag_mode_katcp(d, "?listbof",      "display available bof files (?listbof [detail])", &listbof_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?delbof",       "deletes a gateware image (?delbof image-file)", &delbof_cmd, 0, TBS_MODE_RAW);
 
   result += register_flag_mode_katcp(d, "?tap-start",    "start a tap instance (?tap-start (?tap-start tap-device register-name ip-address [port [mac]])", &tap_start_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?tap-stop",     "deletes a tap instance (?tap-stop register-name)", &tap_stop_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?tap-info",     "displays diagnostics for a tap instance (?tap-info register-name)", &tap_info_cmd, 0, TBS_MODE_RAW);
+  result += register_flag_mode_katcp(d, "?tap-emulate",  "have the emulated gateware offer synthetic frames to a tap instance (?tap-emulate tap-name frame-bytes)", &tap_emulate_cmd, 0, TBS_MODE_RAW);
 
   result += register_flag_mode_katcp(d, "?tap-multicast-add", "join a multicast group (?tap-multicast-add tap-name [recv|send] multicast-address+hosts", &tap_multicast_add_group_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?tap-multicast-remove", "remove a multicast group (?tap-multicast-remove tap-name multicast-address", &tap_multicast_remove_group_cmd, 0, TBS_MODE_RAW);
 
+  result += register_flag_mode_katcp(d, "?sensor-register", "declare a sensor backed by a register field (?sensor-register sensor-name register [byte-offset [shift [mask [mult [div [min [max]]]]]]])", &sensor_register_cmd, 0, TBS_MODE_RAW);
+
   result += register_flag_mode_katcp(d, "?chassis-start",  "initialise chassis interface", &start_chassis_cmd, 0, TBS_MODE_RAW);
   result += register_flag_mode_katcp(d, "?chassis-led",    "set a chassis led (?chassis-led led state)", &led_chassis_cmd, 0, TBS_MODE_RAW);
 
-  tr->r_chassis = chassis_init_tbs(d, TBS_ROACH_CHASSIS);
-  if(tr->r_chassis){
-    hook_commands_katcp(d, KATCP_HOOK_PRE, &pre_hook_led_cmd);
-    hook_commands_katcp(d, KATCP_HOOK_POST, &post_hook_led_cmd);
+  /* hwmon discovery and the chassis are slow, so they happen once the server listens */
+  if(register_every_ms_katcp(d, TBS_STARTUP_STEP, &step_startup_tbs, &(tr->r_startup)) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to schedule hardware setup");
+    return -1;
   }
+  tr->r_startup.s_timer = 1;
 
   return result;
 }
 
+
+#ifdef UNIT_TEST_VECTOR
+
+static void define_vector_test(struct tbs_raw *tr, char *name, unsigned int length)
+{
+  struct tbs_entry *te;
+
+  te = alloc_arena_avltree(tr->r_registers, sizeof(struct tbs_entry));
+  if(te == NULL){
+    fprintf(stderr, "unable to allocate entry\n");
+    abort();
+  }
+
+  memset(te, 0, sizeof(struct tbs_entry));
+  te->e_len_base = length;
+  te->e_mode = TBS_WRABLE;
+
+  if(store_named_node_avltree(tr->r_registers, name, te) < 0){
+    fprintf(stderr, "unable to store %s\n", name);
+    abort();
+  }
+}
+
+static void check_vector_test(struct katcp_dispatch *d, struct tbs_raw *tr, char *spec, unsigned int mode, int expect)
+{
+  struct tbs_vector_item item;
+  int result;
+
+  result = resolve_vector_tbs(d, tr, spec, &item, mode);
+  if((result < 0) != (expect < 0)){
+    fprintf(stderr, "%s: resolving %s gave %d, expected %d\n", (mode & TBS_WRITABLE) ? "writev" : "readv", spec, result, expect);
+    abort();
+  }
+
+  if((result == 0) && (mode & TBS_READABLE) && (item.v_size > item.v_entry->e_len_base)){
+    fprintf(stderr, "readv: %s resolved to %u bytes\n", spec, item.v_size);
+    abort();
+  }
+}
+
+int main()
+{
+  struct katcp_dispatch *d;
+  struct tbs_raw tr;
+  unsigned int total;
+
+  d = startup_katcp();
+  if(d == NULL){
+    fprintf(stderr, "unable to create dispatch\n");
+    return 1;
+  }
+
+  memset(&tr, 0, sizeof(struct tbs_raw));
+  tr.r_registers = create_arena_avltree(0);
+  if(tr.r_registers == NULL){
+    fprintf(stderr, "unable to create register tree\n");
+    return 1;
+  }
+
+  define_vector_test(&tr, "big", 0x30000);
+  define_vector_test(&tr, "reg", 4);
+  define_vector_test(&tr, "half", 2);
+
+  check_vector_test(d, &tr, "reg", TBS_READABLE, 0);
+  check_vector_test(d, &tr, "half", TBS_READABLE, 0);
+  check_vector_test(d, &tr, "reg:0:4", TBS_READABLE, 0);
+  check_vector_test(d, &tr, "reg:2:2", TBS_READABLE, 0);
+  check_vector_test(d, &tr, "big:0x2fff0:0x10", TBS_READABLE, 0);
+
+  check_vector_test(d, &tr, "reg:0:8", TBS_READABLE, -1);
+  check_vector_test(d, &tr, "reg:0:0xfffffffc", TBS_READABLE, -1);
+  check_vector_test(d, &tr, "reg:4", TBS_READABLE, -1);
+  check_vector_test(d, &tr, "reg:0xffffffff:2", TBS_READABLE, -1);
+  check_vector_test(d, &tr, "big:0:0xfffe0010", TBS_READABLE, -1);
+  check_vector_test(d, &tr, "big:0x2fff0:0x11", TBS_READABLE, -1);
+
+  /* writev sizes by value, a default word near the end is fine */
+  check_vector_test(d, &tr, "big:0x2fffe", TBS_WRITABLE, 0);
+  check_vector_test(d, &tr, "big:0x30001", TBS_WRITABLE, -1);
+
+  total = 0;
+  if(total_vector_tbs(d, &total, 0x20000) < 0){
+    fprintf(stderr, "total: rejected a reasonable size\n");
+    abort();
+  }
+  if(total_vector_tbs(d, &total, 0xfffe0010) == 0){
+    fprintf(stderr, "total: %u accepted after wrapping\n", total);
+    abort();
+  }
+  if(total_vector_tbs(d, &total, TBS_VECTOR_TOTAL) == 0){
+    fprintf(stderr, "total: %u accepted beyond limit\n", total);
+    abort();
+  }
+  if(total != 0x20000){
+    fprintf(stderr, "total: rejected sizes changed total to %u\n", total);
+    abort();
+  }
+
+  destroy_avltree(tr.r_registers, NULL);
+  shutdown_katcp(d);
+
+  printf("vector: check ok\n");
+
+  return 0;
+}
+
+#endif
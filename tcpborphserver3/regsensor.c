@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include <katcp.h>
+#include <katcl.h>
+#include <katpriv.h>
+#include <avltree.h>
+
+#include "tcpborphserver3.h"
+
+/* sensors backed by a bit field in an fpga register. All of them are
+ * read out of the mapping by a single timer, instead of a client
+ * polling each register over the network */
+
+void destroy_regsensor_tbs(struct tbs_regsensor *rs)
+{
+  if(rs == NULL){
+    return;
+  }
+
+  if(rs->g_name){
+    free(rs->g_name);
+    rs->g_name = NULL;
+  }
+
+  if(rs->g_register){
+    free(rs->g_register);
+    rs->g_register = NULL;
+  }
+
+  free(rs);
+}
+
+static struct tbs_regsensor *create_regsensor_tbs(char *name, char *reg)
+{
+  struct tbs_regsensor *rs;
+
+  rs = malloc(sizeof(struct tbs_regsensor));
+  if(rs == NULL){
+    return NULL;
+  }
+
+  rs->g_name = NULL;
+  rs->g_register = NULL;
+  rs->g_entry = NULL;
+  rs->g_acquire = NULL;
+
+  rs->g_offset = 0;
+  rs->g_shift = 0;
+  rs->g_mask = 0xffffffff;
+  rs->g_mult = 1;
+  rs->g_div = 1;
+  rs->g_min = INT_MIN;
+  rs->g_max = INT_MAX;
+  rs->g_valid = 0;
+
+  rs->g_name = strdup(name);
+  rs->g_register = strdup(reg);
+
+  if((rs->g_name == NULL) || (rs->g_register == NULL)){
+    destroy_regsensor_tbs(rs);
+    return NULL;
+  }
+
+  return rs;
+}
+
+void forget_regsensors_tbs(struct tbs_raw *tr)
+{
+  unsigned int i;
+
+  /* register definitions are about to go away, look them up again later */
+  for(i = 0; i < tr->r_regsensor_count; i++){
+    tr->r_regsensors[i]->g_entry = NULL;
+  }
+}
+
+static int sample_regsensor_tbs(struct tbs_raw *tr, struct tbs_regsensor *rs, int *value)
+{
+  struct tbs_entry *te;
+  unsigned int pos, shift;
+  uint32_t word;
+  long long scaled;
+
+  if(rs->g_entry == NULL){
+    if(tr->r_registers == NULL){
+      return -1;
+    }
+    rs->g_entry = find_data_avltree(tr->r_registers, rs->g_register);
+    if(rs->g_entry == NULL){
+      return -1;
+    }
+  }
+
+  te = rs->g_entry;
+
+  if(!(te->e_mode & TBS_READABLE)){
+    return -1;
+  }
+
+  if((rs->g_offset + 4) > te->e_len_base){
+    return -1;
+  }
+
+  pos = te->e_pos_base + rs->g_offset;
+  shift = te->e_pos_offset;
+
+  /* non word aligned registers straddle two bus words */
+  if((pos + ((shift > 0) ? 8 : 4)) > tr->r_map_size){
+    return -1;
+  }
+
+  word = *((volatile uint32_t *)(tr->r_map + pos));
+  if(shift > 0){
+    word = (word << shift) | ((*((volatile uint32_t *)(tr->r_map + pos + 4))) >> (32 - shift));
+  }
+
+  word = (word >> rs->g_shift) & rs->g_mask;
+
+  scaled = ((long long)word * rs->g_mult) / rs->g_div;
+  if(scaled > INT_MAX){
+    scaled = INT_MAX;
+  } else if(scaled < INT_MIN){
+    scaled = INT_MIN;
+  }
+
+  *value = scaled;
+
+  return 0;
+}
+
+int poll_regsensors_tbs(struct katcp_dispatch *d, void *data)
+{
+  struct tbs_raw *tr;
+  struct tbs_regsensor *rs;
+  unsigned int i;
+  int value, valid;
+
+  tr = data;
+
+  for(i = 0; i < tr->r_regsensor_count; i++){
+    rs = tr->r_regsensors[i];
+
+    if(tr->r_fpga == TBS_FPGA_MAPPED){
+      valid = (sample_regsensor_tbs(tr, rs, &value) == 0) ? 1 : 0;
+    } else {
+      valid = 0;
+    }
+
+    if(valid){
+      rs->g_valid = 1;
+      set_integer_acquire_katcp(d, rs->g_acquire, value);
+    } else if(rs->g_valid){
+      /* only tell subscribers once that the value has gone away */
+      rs->g_valid = 0;
+      propagate_acquire_katcp(d, rs->g_acquire);
+    }
+  }
+
+  /* keep the timer running, even if the fpga is down */
+  return 0;
+}
+
+static int extract_regsensor_tbs(struct katcp_dispatch *d, struct katcp_sensor *sn)
+{
+  struct katcp_integer_acquire *ia;
+  struct katcp_integer_sensor *is;
+  struct katcp_acquire *a;
+  struct tbs_regsensor *rs;
+
+  a = sn->s_acquire;
+
+  if((a == NULL) || (a->a_type != KATCP_SENSOR_INTEGER) || (sn->s_type != KATCP_SENSOR_INTEGER)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "type mismatch for putative integer sensor %s", sn->s_name);
+    return -1;
+  }
+
+  rs = a->a_local;
+  if(rs == NULL){
+    return -1;
+  }
+
+  is = sn->s_more;
+  ia = a->a_more;
+
+  if(rs->g_valid == 0){
+    set_status_sensor_katcp(sn, KATCP_STATUS_UNREACHABLE);
+  } else if((ia->ia_current < rs->g_min) || (ia->ia_current > rs->g_max)){
+    set_status_sensor_katcp(sn, KATCP_STATUS_ERROR);
+  } else {
+    set_status_sensor_katcp(sn, KATCP_STATUS_NOMINAL);
+  }
+
+  is->is_current = ia->ia_current;
+
+  return 0;
+}
+
+int sensor_register_cmd(struct katcp_dispatch *d, int argc)
+{
+  struct tbs_raw *tr;
+  struct tbs_regsensor *rs, **tmp;
+  struct katcp_acquire *a;
+  char *name, *reg, *ptr;
+
+  tr = get_mode_katcp(d, TBS_MODE_RAW);
+  if(tr == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to acquire raw mode state");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc <= 2){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a sensor name and a register name");
+    return KATCP_RESULT_INVALID;
+  }
+
+  name = arg_string_katcp(d, 1);
+  reg = arg_string_katcp(d, 2);
+  if((name == NULL) || (reg == NULL)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "sensor or register name inaccessible");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(find_sensor_katcp(d, name)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "sensor %s already exists", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  rs = create_regsensor_tbs(name, reg);
+  if(rs == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate register sensor %s", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc > 3){
+    rs->g_offset = arg_unsigned_long_katcp(d, 3);
+  }
+  if(argc > 4){
+    rs->g_shift = arg_unsigned_long_katcp(d, 4);
+  }
+  if(argc > 5){
+    rs->g_mask = arg_unsigned_long_katcp(d, 5);
+  }
+  if(argc > 6){
+    rs->g_mult = arg_unsigned_long_katcp(d, 6);
+  }
+  if(argc > 7){
+    rs->g_div = arg_unsigned_long_katcp(d, 7);
+  }
+  if(argc > 8){
+    ptr = arg_string_katcp(d, 8);
+    rs->g_min = ptr ? strtol(ptr, NULL, 0) : INT_MIN;
+  }
+  if(argc > 9){
+    ptr = arg_string_katcp(d, 9);
+    rs->g_max = ptr ? strtol(ptr, NULL, 0) : INT_MAX;
+  }
+
+  if((rs->g_offset % 4) || (rs->g_shift >= 32) || (rs->g_div == 0)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a word aligned offset, a shift below 32 and a nonzero divisor for sensor %s", name);
+    destroy_regsensor_tbs(rs);
+    return KATCP_RESULT_FAIL;
+  }
+
+  tmp = realloc(tr->r_regsensors, sizeof(struct tbs_regsensor *) * (tr->r_regsensor_count + 1));
+  if(tmp == NULL){
+    destroy_regsensor_tbs(rs);
+    return KATCP_RESULT_FAIL;
+  }
+  tr->r_regsensors = tmp;
+
+  /* no get function, values are pushed in by poll_regsensors_tbs */
+  a = setup_integer_acquire_katcp(d, NULL, rs, NULL);
+  if(a == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to setup integer acquire for sensor %s", name);
+    destroy_regsensor_tbs(rs);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(register_multi_integer_sensor_katcp(d, TBS_MODE_RAW, name, "register backed sensor", "none", INT_MIN, INT_MAX, a, &extract_regsensor_tbs, NULL) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to register sensor %s", name);
+    destroy_acquire_katcp(d, a);
+    destroy_regsensor_tbs(rs);
+    return KATCP_RESULT_FAIL;
+  }
+
+  rs->g_acquire = a;
+
+  tr->r_regsensors[tr->r_regsensor_count] = rs;
+  tr->r_regsensor_count++;
+
+  if(tr->r_regsensor_timer == 0){
+    if(register_every_ms_katcp(d, TBS_REGSENSOR_PERIOD, &poll_regsensors_tbs, tr) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to register timer to poll register sensors");
+      return KATCP_RESULT_FAIL;
+    }
+    tr->r_regsensor_timer = 1;
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "sensor %s reads (%s@%u >> %u) & 0x%x", name, reg, rs->g_offset, rs->g_shift, rs->g_mask);
+
+  return KATCP_RESULT_OK;
+}
@@ -2,6 +2,7 @@
 #define TBS_H_
 
 #include <stdint.h>
+#include <sys/time.h>
 
 #include <katcp.h>
 #include <avltree.h>
@@ -29,12 +30,14 @@
 
 #define TBS_ROACH_CHASSIS  "roach2chassis"
 
-int setup_raw_tbs(struct katcp_dispatch *d, char *bofdir, int argc, char **argv);
+int setup_raw_tbs(struct katcp_dispatch *d, char *bofdir, char *emulate, int argc, char **argv);
 
 #include "loadbof.h"
 
 int start_fpga_tbs(struct katcp_dispatch *d, struct bof_state *bs);
 int stop_fpga_tbs(struct katcp_dispatch *d);
+int attach_fpga_tbs(struct katcp_dispatch *d, struct bof_state *bs);
+int status_fpga_tbs(struct katcp_dispatch *d, int status);
 
 #define GETAP_IP_BUFFER         16
 #define GETAP_MAC_BUFFER        18
@@ -44,6 +47,31 @@ int stop_fpga_tbs(struct katcp_dispatch *d);
 
 #define GETAP_ARP_CACHE        256
 
+#define GETAP_RX_SLOTS           8 /* frames from gateware awaiting the tap device */
+#define GETAP_TX_SLOTS           8 /* frames from tap device awaiting the gateware */
+
+/* per tap statistics, each exported as sensor raw.tap.<device>.<name> */
+#define GETAP_STAT_RX_FRAMES     0 /* frames from the gateware */
+#define GETAP_STAT_RX_BYTES      1
+#define GETAP_STAT_TX_FRAMES     2 /* frames to the gateware */
+#define GETAP_STAT_TX_BYTES      3
+#define GETAP_STAT_RX_RUNTS      4
+#define GETAP_STAT_RX_OVERSIZE   5
+#define GETAP_STAT_TX_RUNTS      6
+#define GETAP_STAT_RX_UNKNOWN    7 /* frames of unknown ethertype */
+#define GETAP_STAT_ARP_REQUESTS  8 /* requests seen */
+#define GETAP_STAT_ARP_REPLIES   9 /* replies sent */
+#define GETAP_STAT_ARP_SPAMS    10 /* requests and announcements sent */
+#define GETAP_STAT_TX_BUSY      11 /* gateware transmit buffer still full */
+#define GETAP_STAT_KERNEL_STALLS 12 /* tap device write would block */
+#define GETAP_STAT_RX_DROPS     13
+#define GETAP_STAT_RX_STALLS    14 /* receive ring full */
+#define GETAP_STAT_TX_DROPS     15
+#define GETAP_STAT_TX_STALLS    16 /* transmit ring full */
+#define GETAP_STAT_RX_LATENCY   17 /* worst time in receive ring over the last window */
+#define GETAP_STAT_TX_LATENCY   18 /* worst time in transmit ring over the last window */
+#define GETAP_STATS             19
+
 struct getap_state{
   uint32_t s_magic;
 
@@ -81,50 +109,172 @@ struct getap_state{
   struct timeval s_timeout;
 #endif
 
-  unsigned int s_timer;
+  unsigned int s_timer; /* nominal polling interval, in ms */
+  unsigned int s_slot;
+
+  uint32_t s_sizes;     /* buffer size register as of the last sweep */
+  int s_ready;          /* gateware holds a frame for us */
+  unsigned int s_received;
+
+  unsigned int s_rx_frames;
+  struct timeval s_rate_start;
+  struct katcp_acquire *s_rate_acquire;
 
   unsigned int s_rx_len;
-  unsigned int s_tx_len;
   unsigned int s_arp_len;
 
-  unsigned char s_rxb[GETAP_MAX_FRAME];
-  unsigned char s_txb[GETAP_MAX_FRAME];
+  unsigned int s_synthetic; /* length of frames the emulated gateware offers, 0 for none */
+
+  /* s_rxb and s_txb point at the free slot after the queued frames */
+  unsigned char *s_rxb;
+  unsigned char *s_txb;
   unsigned char s_arp_buffer[GETAP_ARP_FRAME];
 
+  unsigned int s_rx_head;
+  unsigned int s_rx_count;
+  unsigned int s_rx_lens[GETAP_RX_SLOTS];
+
+  unsigned int s_tx_head;
+  unsigned int s_tx_count;
+  unsigned int s_tx_lens[GETAP_TX_SLOTS];
+
+  struct timeval s_rx_stamps[GETAP_RX_SLOTS];
+  struct timeval s_tx_stamps[GETAP_TX_SLOTS];
+
+  unsigned int s_stats[GETAP_STATS];
+  struct katcp_acquire *s_stat_acquire[GETAP_STATS];
+
+  unsigned char s_rx_ring[GETAP_RX_SLOTS][GETAP_MAX_FRAME];
+  unsigned char s_tx_ring[GETAP_TX_SLOTS][GETAP_MAX_FRAME];
+
   uint8_t s_arp_table[GETAP_ARP_CACHE][GETAP_MAC_SIZE];
   uint16_t s_arp_fresh[GETAP_ARP_CACHE];
 };
 
+#define TBS_BULK_CHUNK       (64 * 1024)
+#define TBS_BULK_MAX_CHUNK   (1024 * 1024)
+#define TBS_BULK_DEPTH       2
+
+#define TBS_REGSENSOR_PERIOD 1000
+
+#define TBS_HWMON_FAST        250 /* fastest hwmon poll in ms, i2c reads are slow */
+#define TBS_HWMON_PERIOD     1000 /* hwmon poll while clients are watching */
+#define TBS_HWMON_IDLE      10000 /* hwmon refresh while nobody is */
+
+#define TBS_OFFLOAD_THRESHOLD (64 * 1024) /* aligned ?read and ?write transfers this large leave the loop */
+#define TBS_IO_THREADS       1
+
+#define TBS_VECTOR_TOTAL     (1024 * 1024) /* largest combined ?readv reply */
+
+#define TBS_MAX_HANDLES      4096
+#define TBS_HANDLE_BUFFER    256
+
 #define TBS_FPGA_DOWN        0
 #define TBS_FPGA_PROGRAMMED  1
 #define TBS_FPGA_MAPPED      2
 #define TBS_STATES_FPGA      3
 
+/* a single timer serves all tap instances, see run_timer_tap */
+
+struct getap_scheduler
+{
+  struct tbs_raw *c_raw;
+  unsigned int c_poll; /* current interval in usecs, zero if not running */
+  unsigned int c_next; /* instance served first on the next tick */
+};
+
+/* all hardware monitor sensors are read by one timer */
+
+struct tbs_hwgroup
+{
+  struct tbs_hwsensor **w_sensors;
+  unsigned int w_count;
+  unsigned int w_poll; /* current interval in ms, zero if not running */
+  unsigned int w_idle; /* ticks to skip while nobody is subscribed */
+  unsigned int w_probe; /* next definition to be discovered */
+};
+
+/* slow hardware setup runs from the loop once the server listens */
+
+#define TBS_STARTUP_STEP       10 /* ms between startup steps */
+#define TBS_STARTUP_BATCH       4 /* hwmon sensors discovered per step */
+
+struct tbs_startup
+{
+  struct tbs_raw *s_raw;
+  struct timeval s_began;
+  unsigned int s_steps;
+  int s_timer;
+  int s_chassis; /* nonzero while the chassis still needs to be opened */
+};
+
+/* a mapping dropped while offloaded transfers still used it */
+
+struct tbs_mapping
+{
+  void *m_base;
+  unsigned int m_size;
+  struct tbs_mapping *m_next;
+};
+
+/* an aligned register transfer handed to the io thread */
+
+struct tbs_transfer
+{
+  struct tbs_raw *t_raw;
+  volatile uint32_t *t_bus;
+  void *t_buffer;
+  unsigned int t_bytes;
+  int t_write;
+  void *t_map;
+  unsigned int t_map_size;
+};
+
 struct tbs_raw
 {
   struct avl_tree *r_registers;
   struct avl_tree *r_hwmon;
+  struct tbs_hwgroup r_hwgroup;
   int r_fpga;
 
   void *r_map;
   unsigned int r_map_size;
 
+  unsigned int r_transfers; /* offloaded transfers in flight */
+  struct tbs_mapping *r_retired;
+  int r_io_threads;
+
   char *r_image;
   char *r_bof_dir;
+  char *r_emulate; /* memory image standing in for the fpga, NULL on hardware */
   unsigned int r_top_register;
 
   int r_argc;
   char **r_argv;
 
   struct katcp_arb *r_chassis;
+  struct tbs_startup r_startup;
 
   struct getap_state **r_taps;
   unsigned int r_instances;
+  struct getap_scheduler r_tap_scheduler;
+
+  struct tbs_bulk **r_bulks;
+  unsigned int r_bulk_count;
+
+  struct tbs_regsensor **r_regsensors;
+  unsigned int r_regsensor_count;
+  int r_regsensor_timer;
+
+  struct tbs_entry **r_handles;
+  unsigned int r_handle_count;
+  unsigned long r_handle_epoch;
 };
 
 #define TBS_READABLE   1
 #define TBS_WRITABLE   2
 #define TBS_WRABLE     3
+#define TBS_SHADOWED   4
 
 struct tbs_entry
 {
@@ -134,6 +284,19 @@ struct tbs_entry
   unsigned char e_pos_offset;
   unsigned char e_len_offset;
   unsigned char e_mode;
+
+  uint32_t *e_shadow; /* copy of the bus words spanned, then as many staging words, in the register arena */
+};
+
+struct tbs_bulk
+{
+  struct katcp_dispatch *b_dispatch;
+  struct tbs_entry b_entry;
+  unsigned int b_offset;
+  unsigned int b_remaining;
+  unsigned int b_chunk;
+  unsigned int b_sent;
+  void *b_buffer;
 };
 
 struct tbs_hwsensor 
@@ -148,10 +311,35 @@ struct tbs_hwsensor
   char *h_name;
   char *h_desc;
   char *h_unit;
+  struct katcp_acquire *h_acquire;
+  int h_raw;   /* last value read, before scaling */
+  int h_valid; /* h_raw is current and has been propagated */
 };
 
-int setup_hwmon_tbs(struct katcp_dispatch *d);
+int discover_hwmon_tbs(struct katcp_dispatch *d, unsigned int count);
 void destroy_hwsensor_tbs(void *data);
+void release_hwmon_tbs(struct katcp_dispatch *d, struct tbs_raw *tr);
+
+struct tbs_regsensor
+{
+  char *g_name;
+  char *g_register;
+  struct tbs_entry *g_entry;
+  unsigned int g_offset;
+  unsigned int g_shift;
+  uint32_t g_mask;
+  int g_mult;
+  int g_div;
+  int g_min;
+  int g_max;
+  int g_valid;
+  struct katcp_acquire *g_acquire;
+};
+
+void destroy_regsensor_tbs(struct tbs_regsensor *rs);
+void forget_regsensors_tbs(struct tbs_raw *tr);
+int poll_regsensors_tbs(struct katcp_dispatch *d, void *data);
+int sensor_register_cmd(struct katcp_dispatch *d, int argc);
 
 struct tbs_port_data {
   int t_port;
@@ -159,6 +347,9 @@ struct tbs_port_data {
   int t_program;
   unsigned int t_expected;
   int t_fd;
+  int t_stream;
+  int t_tee;
+  int t_compress;
 #if 0
   struct katcp_notice *t_notice;
   int t_rsize;
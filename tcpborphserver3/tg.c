@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
+#include <limits.h>
 
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -35,6 +36,10 @@
 
 #define RECEIVE_BURST      8 /* read at most N frames per polling interval */
 
+#define POLL_BUSY        250 /* usecs until next poll while the gateware still holds frames */
+#define POLL_BACKOFF       8 /* when idle, slow down to at most this multiple of the polling interval */
+#define RATE_WINDOW  1000000 /* usecs over which the receive rate sensor is averaged */
+
 #define GO_DEFAULT_PORT 7148
 
 #define GO_MAC          0x00
@@ -46,6 +51,8 @@
 #define GO_BUFFER_SIZES 0x18
 #define GO_EN_RST_PORT  0x20
 
+#define TAP_MEMORY     "tap" /* name under which ?memory-stats reports tap state */
+
 #define MIN_FRAME         64
 
 #define IP_SIZE            4
@@ -86,6 +93,36 @@
 
 static const uint8_t arp_const[] = { 0, 1, 8, 0, 6, 4, 0 }; /* disgusting */
 static const uint8_t broadcast_const[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+static const uint8_t synthetic_const[] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 }; /* peer of the emulated gateware */
+
+struct getap_stat_spec{
+  char *t_name;
+  char *t_description;
+  char *t_units;
+  int t_window; /* reset after every rate window, otherwise a running count */
+};
+
+static const struct getap_stat_spec stat_specs[GETAP_STATS] = {
+  [GETAP_STAT_RX_FRAMES]     = { "rx-frames",     "frames received from the gateware", "count", 0 },
+  [GETAP_STAT_RX_BYTES]      = { "rx-bytes",      "bytes received from the gateware", "bytes", 0 },
+  [GETAP_STAT_TX_FRAMES]     = { "tx-frames",     "frames sent to the gateware", "count", 0 },
+  [GETAP_STAT_TX_BYTES]      = { "tx-bytes",      "bytes sent to the gateware", "bytes", 0 },
+  [GETAP_STAT_RX_RUNTS]      = { "rx-runts",      "runt frames discarded from the gateware", "count", 0 },
+  [GETAP_STAT_RX_OVERSIZE]   = { "rx-oversize",   "oversized frames discarded from the gateware", "count", 0 },
+  [GETAP_STAT_TX_RUNTS]      = { "tx-runts",      "runt packets discarded from the tap device", "count", 0 },
+  [GETAP_STAT_RX_UNKNOWN]    = { "rx-unknown",    "frames of unknown ethertype discarded", "count", 0 },
+  [GETAP_STAT_ARP_REQUESTS]  = { "arp-requests",  "arp requests received", "count", 0 },
+  [GETAP_STAT_ARP_REPLIES]   = { "arp-replies",   "arp replies sent", "count", 0 },
+  [GETAP_STAT_ARP_SPAMS]     = { "arp-spams",     "unsolicited arp requests and announcements sent", "count", 0 },
+  [GETAP_STAT_TX_BUSY]       = { "tx-busy",       "sends deferred as the gateware was still transmitting", "count", 0 },
+  [GETAP_STAT_KERNEL_STALLS] = { "kernel-stalls", "writes to the tap device which would have blocked", "count", 0 },
+  [GETAP_STAT_RX_DROPS]      = { "rx-drops",      "frames from the gateware lost on the way to the tap device", "count", 0 },
+  [GETAP_STAT_RX_STALLS]     = { "rx-stalls",     "polls which left frames in the gateware as the receive queue was full", "count", 0 },
+  [GETAP_STAT_TX_DROPS]      = { "tx-drops",      "frames from the tap device the gateware would not take", "count", 0 },
+  [GETAP_STAT_TX_STALLS]     = { "tx-stalls",     "tap device reads deferred as the transmit queue was full", "count", 0 },
+  [GETAP_STAT_RX_LATENCY]    = { "rx-latency",    "longest time a frame from the gateware waited for the tap device", "us", 1 },
+  [GETAP_STAT_TX_LATENCY]    = { "tx-latency",    "longest time a frame from the tap device waited for the gateware", "us", 1 }
+};
 
 /************************************************************************/
 
@@ -312,6 +349,7 @@ int reply_arp(struct getap_state *gs)
   memcpy(gs->s_rxb + FRAME_SRC, gs->s_mac_binary, 6);
 
   gs->s_rxb[SIZE_FRAME_HEADER + ARP_OP2] = 2;
+  gs->s_stats[GETAP_STAT_ARP_REPLIES]++;
 
   /* make sender of receive the target of transmit*/
   memcpy(gs->s_rxb + SIZE_FRAME_HEADER + ARP_THA_BASE, gs->s_rxb + SIZE_FRAME_HEADER + ARP_SHA_BASE, 10); 
@@ -357,6 +395,7 @@ int process_arp(struct getap_state *gs)
 #ifdef DEBUG
       fprintf(stderr, "arp: saw request\n");
 #endif
+      gs->s_stats[GETAP_STAT_ARP_REQUESTS]++;
       glean_arp(gs, gs->s_rxb + SIZE_FRAME_HEADER + ARP_SHA_BASE, gs->s_rxb + SIZE_FRAME_HEADER + ARP_SIP_BASE);
       if(!memcmp(gs->s_rxb + SIZE_FRAME_HEADER + ARP_TIP_BASE, &(gs->s_address_binary), 4)){
 #ifdef DEBUG
@@ -396,6 +435,7 @@ void spam_arp(struct getap_state *gs)
         } else {
           request_arp(gs, i);
         }
+        gs->s_stats[GETAP_STAT_ARP_SPAMS]++;
       }
       update++;
     }
@@ -498,7 +538,8 @@ static int write_frame_fpga(struct getap_state *gs, unsigned char *data, unsigne
 
   if((buffer_sizes & 0xffff0000) > 0){
 #ifdef __PPC__
-    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "tx queue still busy (%d words to send)", (buffer_sizes & 0xffff0000) >> 16);
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "tx queue still busy (%d words to send)", (buffer_sizes & 0xffff0000) >> 16);
+    gs->s_stats[GETAP_STAT_TX_BUSY]++;
     return 0;
 #else
     log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "in test mode we ignore %d words previously queued", (buffer_sizes & 0xffff0000) >> 16);
@@ -510,6 +551,9 @@ static int write_frame_fpga(struct getap_state *gs, unsigned char *data, unsigne
   buffer_sizes = (buffer_sizes & 0xffff) | (0xffff0000 & (((actual + 7) / 8) << 16));
   *((uint32_t *)(base + GO_BUFFER_SIZES)) = buffer_sizes;
 
+  gs->s_stats[GETAP_STAT_TX_FRAMES]++;
+  gs->s_stats[GETAP_STAT_TX_BYTES] += actual;
+
 #ifdef DEBUG
   fprintf(stderr, "txf: wrote date to %p (bytes=%d, gateware register=0x%08x)\n", base + GO_TXBUFFER, actual, buffer_sizes);
 #endif
@@ -541,16 +585,47 @@ static int write_frame_fpga(struct getap_state *gs, unsigned char *data, unsigne
   return 1;
 }
 
-static int transmit_frame_fpga(struct getap_state *gs)
+/* remember the worst queueing delay for the rate window */
+
+static void note_latency_tap(struct getap_state *gs, struct timeval *stamp, unsigned int index)
 {
-  int result;
+  struct timeval now, delta;
+  unsigned long long usecs;
 
-  result = write_frame_fpga(gs, gs->s_txb, gs->s_tx_len);
-  if(result != 0){
-    gs->s_tx_len = 0;
+  gettimeofday(&now, NULL);
+  if(timercmp(&now, stamp, <)){
+    return;
   }
 
-  return result;
+  timersub(&now, stamp, &delta);
+  usecs = (delta.tv_sec * 1000000ULL) + delta.tv_usec;
+  if(usecs > UINT_MAX){
+    usecs = UINT_MAX;
+  }
+
+  if(usecs > gs->s_stats[index]){
+    gs->s_stats[index] = usecs;
+  }
+}
+
+/* the arb only asks for what the queues can deal with: tap reads while
+ * there is space for frames to the gateware, tap writes while frames
+ * from the gateware are waiting */
+
+static void update_io_tap(struct katcp_dispatch *d, struct getap_state *gs)
+{
+  unsigned int mode;
+
+  mode = 0;
+
+  if(gs->s_tx_count < GETAP_TX_SLOTS){
+    mode |= KATCP_ARB_READ;
+  }
+  if(gs->s_rx_count > 0){
+    mode |= KATCP_ARB_WRITE;
+  }
+
+  mode_arb_katcp(d, gs->s_tap_io, mode);
 }
 
  /*    
@@ -568,17 +643,27 @@ int transmit_ip_fpga(struct getap_state *gs)
   uint8_t mcast_mac[6] = { 0x01, 0x00, 0x5E, 0x00, 0x00, 0x00 };
   uint8_t *mac;
   uint32_t temp;
+  unsigned char *frame;
+  int result;
+
+  /* only the frame at the head of the queue waits for the gateware */
 
-  if (gs->s_txb[SIZE_FRAME_HEADER + IP_DEST1] >= 0xE0 && gs->s_txb[SIZE_FRAME_HEADER + IP_DEST1] < 0xF0){
+  if(gs->s_tx_count == 0){
+    return 1;
+  }
+
+  frame = gs->s_tx_ring[gs->s_tx_head];
+
+  if (frame[SIZE_FRAME_HEADER + IP_DEST1] >= 0xE0 && frame[SIZE_FRAME_HEADER + IP_DEST1] < 0xF0){
 
 #ifdef DEBUG
     fprintf(stderr, "txf: calculating multicast mac\n");
 #endif
 
-    temp = 0x7FFFFF & ( gs->s_txb[SIZE_FRAME_HEADER + IP_DEST1] << 24 
-                      | gs->s_txb[SIZE_FRAME_HEADER + IP_DEST2] << 16 
-                      | gs->s_txb[SIZE_FRAME_HEADER + IP_DEST3] << 8 
-                      | gs->s_txb[SIZE_FRAME_HEADER + IP_DEST4] );
+    temp = 0x7FFFFF & ( frame[SIZE_FRAME_HEADER + IP_DEST1] << 24 
+                      | frame[SIZE_FRAME_HEADER + IP_DEST2] << 16 
+                      | frame[SIZE_FRAME_HEADER + IP_DEST3] << 8 
+                      | frame[SIZE_FRAME_HEADER + IP_DEST4] );
 
     mcast_mac[3] = temp & 0xFF0000;
     mcast_mac[4] = temp & 0xFF00;
@@ -586,23 +671,141 @@ int transmit_ip_fpga(struct getap_state *gs)
 
     mac = (uint8_t *) &mcast_mac;
   } else {
-    mac = gs->s_arp_table[gs->s_txb[SIZE_FRAME_HEADER + IP_DEST4]];
+    mac = gs->s_arp_table[frame[SIZE_FRAME_HEADER + IP_DEST4]];
   }
 
 #ifdef DEBUG
   fprintf(stderr, "txf: looked up dst mac: %x:%x:%x:%x:%x:%x\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 #endif
   
-  memcpy(gs->s_txb, mac, GETAP_MAC_SIZE);
+  memcpy(frame, mac, GETAP_MAC_SIZE);
+
+  result = write_frame_fpga(gs, frame, gs->s_tx_lens[gs->s_tx_head]);
+  if(result == 0){
+    return 0;
+  }
+
+  if(result < 0){
+    gs->s_stats[GETAP_STAT_TX_DROPS]++;
+  } else {
+    note_latency_tap(gs, &(gs->s_tx_stamps[gs->s_tx_head]), GETAP_STAT_TX_LATENCY);
+  }
 
-  return transmit_frame_fpga(gs);
+  gs->s_tx_head = (gs->s_tx_head + 1) % GETAP_TX_SLOTS;
+  gs->s_tx_count--;
+
+  return result;
 }
 
 /* receive from gateware ************************************************/
 
+/* emulated gateware ****************************************************/
+
+/* with the fpga emulated by a memory image nobody drains the transmit
+ * buffer or fills the receive buffer, so we play the gateware: transmit
+ * buffers are taken as sent, and if a synthetic frame length is set the
+ * receive buffer offers the same frame again as soon as it was read. The
+ * frame is udp to the discard port on our address, from a made up peer
+ * in our subnet, so it goes all the way into the kernel */
+
+static void build_synthetic_fpga(struct getap_state *gs, unsigned int len)
+{
+  unsigned char frame[GETAP_MAX_FRAME];
+  unsigned char *ip, *udp;
+  uint32_t peer, sum;
+  unsigned int i;
+  void *base;
+
+  base = gs->s_raw_mode->r_map + gs->s_register->e_pos_base;
+
+  memcpy(frame + FRAME_DST, gs->s_mac_binary, 6);
+  memcpy(frame + FRAME_SRC, synthetic_const, 6);
+  frame[FRAME_TYPE1] = 0x08;
+  frame[FRAME_TYPE2] = 0x00;
+
+  peer = (gs->s_address_binary & gs->s_mask_binary) | htonl(1);
+  if(peer == gs->s_address_binary){
+    peer = (gs->s_address_binary & gs->s_mask_binary) | htonl(2);
+  }
+
+  ip = frame + SIZE_FRAME_HEADER;
+  memset(ip, 0, 20);
+  ip[0] = 0x45;
+  ip[2] = ((len - SIZE_FRAME_HEADER) >> 8) & 0xff;
+  ip[3] = (len - SIZE_FRAME_HEADER) & 0xff;
+  ip[6] = 0x40; /* don't fragment */
+  ip[8] = 64;   /* ttl */
+  ip[9] = 17;   /* udp */
+  memcpy(ip + 12, &peer, 4);
+  memcpy(ip + 16, &(gs->s_address_binary), 4);
+
+  sum = 0;
+  for(i = 0; i < 20; i += 2){
+    sum += (ip[i] << 8) | ip[i + 1];
+  }
+  while(sum >> 16){
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  sum = (~sum) & 0xffff;
+  ip[10] = (sum >> 8) & 0xff;
+  ip[11] = sum & 0xff;
+
+  udp = ip + 20;
+  udp[0] = 0;
+  udp[1] = 9;
+  udp[2] = 0;
+  udp[3] = 9;
+  udp[4] = ((len - SIZE_FRAME_HEADER - 20) >> 8) & 0xff;
+  udp[5] = (len - SIZE_FRAME_HEADER - 20) & 0xff;
+  udp[6] = 0; /* no checksum, fine for ipv4 */
+  udp[7] = 0;
+
+  for(i = SIZE_FRAME_HEADER + 28; i < len; i++){
+    frame[i] = i & 0xff;
+  }
+
+  memcpy(base + GO_RXBUFFER, frame, len);
+}
+
+static void emulate_frame_fpga(struct getap_state *gs)
+{
+  uint32_t buffer_sizes, update;
+  void *base;
+
+  base = gs->s_raw_mode->r_map + gs->s_register->e_pos_base;
+
+  buffer_sizes = *((uint32_t *)(base + GO_BUFFER_SIZES));
+  update = buffer_sizes & 0xffff;
+
+  if(gs->s_synthetic && (update == 0)){
+    update = gs->s_synthetic / 8;
+  }
+
+  if(update != buffer_sizes){
+    *((uint32_t *)(base + GO_BUFFER_SIZES)) = update;
+  }
+}
+
+static int sweep_frame_fpga(struct getap_state *gs)
+{
+  void *base;
+
+  /* just the buffer size register, the scheduler reads this for all taps in one pass */
+
+  if(gs->s_raw_mode->r_emulate){
+    emulate_frame_fpga(gs);
+  }
+
+  base = gs->s_raw_mode->r_map + gs->s_register->e_pos_base;
+
+  gs->s_sizes = *((uint32_t *)(base + GO_BUFFER_SIZES));
+
+  return (gs->s_sizes & 0xffff) ? 1 : 0;
+}
+
 int receive_frame_fpga(struct getap_state *gs)
 {
-  /* 1 - useful data, 0 - false alarm, -1 problem */
+  /* 1 - useful data, 0 - false alarm, -1 problem, expects sweep_frame_fpga to have been run */
   struct katcp_dispatch *d;
   uint32_t buffer_sizes;
   int len;
@@ -622,7 +825,7 @@ int receive_frame_fpga(struct getap_state *gs)
     return -1;
   }
 
-  buffer_sizes = *((uint32_t *)(base + GO_BUFFER_SIZES));
+  buffer_sizes = gs->s_sizes;
   len = (buffer_sizes & 0xffff) * 8;
   if(len <= 0){
 #if DEBUG > 1
@@ -631,12 +834,23 @@ int receive_frame_fpga(struct getap_state *gs)
     return 0;
   }
 
+  if(gs->s_rx_count >= GETAP_RX_SLOTS){
+    /* leave it in the gateware until the tap device has caught up */
+    gs->s_stats[GETAP_STAT_RX_STALLS]++;
+    return 0;
+  }
+
+  gs->s_rxb = gs->s_rx_ring[(gs->s_rx_head + gs->s_rx_count) % GETAP_RX_SLOTS];
+
 #ifdef DEBUG
   fprintf(stderr, "rxf: %d bytes to read\n", len);
 #endif
 
   if((len <= SIZE_FRAME_HEADER) || (len > GETAP_MAX_FRAME)){
-    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "saw runt or oversized frame, len=%u bytes", len);
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "saw runt or oversized frame, len=%u bytes", len);
+    gs->s_stats[(len > GETAP_MAX_FRAME) ? GETAP_STAT_RX_OVERSIZE : GETAP_STAT_RX_RUNTS]++;
+    /* discard it, otherwise it is seen again on every poll */
+    *((uint32_t *)(base + GO_BUFFER_SIZES)) = buffer_sizes & 0xffff0000;
     return -1;
   }
 
@@ -644,6 +858,9 @@ int receive_frame_fpga(struct getap_state *gs)
 
   gs->s_rx_len = len;
 
+  gs->s_stats[GETAP_STAT_RX_FRAMES]++;
+  gs->s_stats[GETAP_STAT_RX_BYTES] += len;
+
 #ifdef DEBUG
   fprintf(stderr, "rxf: data:");
   for(i = 0; i < len; i++){
@@ -666,49 +883,62 @@ int receive_ip_kernel(struct katcp_dispatch *d, struct getap_state *gs)
 #ifdef DEBUG
   int i;
 #endif
-  int rr;
+  int rr, got;
+  unsigned int tail;
 
 #ifdef DEBUG
   fprintf(stderr, "tap: got something to read from tap device\n");
 #endif
 
-  if(gs->s_tx_len > 0){
-    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "transmit buffer on device %s still in use", gs->s_tap_name);
-    return 0;
-  }
+  got = 0;
 
-  rr = read(gs->s_tap_fd, gs->s_txb + SIZE_FRAME_HEADER, GETAP_MAX_FRAME - SIZE_FRAME_HEADER);
-  switch(rr){
-    case -1 :
-      switch(errno){
-        case EAGAIN : 
-        case EINTR  :
-          return 0;
-        default :
-          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "read from tap device %s failed: %s", gs->s_tap_name, strerror(errno));
-          return -1;
-      }
-    case  0 :
-      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "got unexpected end of file from tap device %s", gs->s_tap_name);
-      return -1;
-  }
+  /* drain the tap device in a batch, as long as there are free slots */
+  while(gs->s_tx_count < GETAP_TX_SLOTS){
+    tail = (gs->s_tx_head + gs->s_tx_count) % GETAP_TX_SLOTS;
+    gs->s_txb = gs->s_tx_ring[tail];
 
-  if(rr < RUNT_LENGTH){
-    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "read runt packet from tap deivce %s", gs->s_tap_name);
-    return 0;
-  }
+    rr = read(gs->s_tap_fd, gs->s_txb + SIZE_FRAME_HEADER, GETAP_MAX_FRAME - SIZE_FRAME_HEADER);
+    switch(rr){
+      case -1 :
+        switch(errno){
+          case EAGAIN : 
+          case EINTR  :
+            return got;
+          default :
+            log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "read from tap device %s failed: %s", gs->s_tap_name, strerror(errno));
+            return (got > 0) ? got : -1;
+        }
+      case  0 :
+        log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "got unexpected end of file from tap device %s", gs->s_tap_name);
+        return (got > 0) ? got : -1;
+    }
+
+    if(rr < RUNT_LENGTH){
+      log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "read runt packet from tap deivce %s", gs->s_tap_name);
+      gs->s_stats[GETAP_STAT_TX_RUNTS]++;
+      continue;
+    }
 
 #ifdef DEBUG
-  fprintf(stderr, "rxt: tap rx=%d, data=", rr);
-  for(i = 0; i < rr; i++){
-    fprintf(stderr, " %02x", gs->s_txb[i]); 
-  }
-  fprintf(stderr, "\n");
+    fprintf(stderr, "rxt: tap rx=%d, data=", rr);
+    for(i = 0; i < rr; i++){
+      fprintf(stderr, " %02x", gs->s_txb[i]); 
+    }
+    fprintf(stderr, "\n");
 #endif
 
-  gs->s_tx_len = rr + SIZE_FRAME_HEADER;
+    gs->s_tx_lens[tail] = rr + SIZE_FRAME_HEADER;
+    gettimeofday(&(gs->s_tx_stamps[tail]), NULL);
+    gs->s_tx_count++;
+    got++;
+  }
 
-  return 1;
+  if(got == 0){
+    log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "transmit queue on device %s full", gs->s_tap_name);
+    gs->s_stats[GETAP_STAT_TX_STALLS]++;
+  }
+
+  return got;
 }
 
 /* send to kernel *******************************************************/
@@ -718,151 +948,386 @@ static void forget_receive(struct getap_state *gs)
   gs->s_rx_len = 0;
 }
 
+static void queue_receive(struct getap_state *gs)
+{
+  unsigned int tail;
+
+  tail = (gs->s_rx_head + gs->s_rx_count) % GETAP_RX_SLOTS;
+
+  gs->s_rx_lens[tail] = gs->s_rx_len;
+  gettimeofday(&(gs->s_rx_stamps[tail]), NULL);
+  gs->s_rx_count++;
+  gs->s_rx_len = 0;
+}
+
+static void pop_receive(struct getap_state *gs)
+{
+  gs->s_rx_head = (gs->s_rx_head + 1) % GETAP_RX_SLOTS;
+  gs->s_rx_count--;
+}
+
 int transmit_ip_kernel(struct getap_state *gs)
 {
   int wr;
+  unsigned int len;
+  unsigned char *frame;
   struct katcp_dispatch *d;
 
   d = gs->s_dispatch;
 
-  if(gs->s_rx_len <= SIZE_FRAME_HEADER){
-    if(gs->s_rx_len == 0){
-      return 1;
-    } else {
-      forget_receive(gs);
+  /* returns 1 once the queue to the kernel is empty, 0 if it has to wait, -1 if frames were dropped */
+
+  while(gs->s_rx_count > 0){
+    frame = gs->s_rx_ring[gs->s_rx_head];
+    len = gs->s_rx_lens[gs->s_rx_head];
+
+    if(len <= SIZE_FRAME_HEADER){
+      gs->s_stats[GETAP_STAT_RX_DROPS]++;
+      pop_receive(gs);
+      continue;
+    }
+
+    wr = write(gs->s_tap_fd, frame + SIZE_FRAME_HEADER, len - SIZE_FRAME_HEADER);
+    if(wr < 0){
+      switch(errno){
+        case EINTR  :
+        case EAGAIN :
+          gs->s_stats[GETAP_STAT_KERNEL_STALLS]++;
+          return 0;
+        default :
+          log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "write to tap device %s failed: %s", gs->s_tap_name, strerror(errno));
+          /* WARNING: drops packet on floor, better than spamming logs */
+          gs->s_stats[GETAP_STAT_RX_DROPS]++;
+          pop_receive(gs);
+          return -1;
+      }
+    }
+
+    if((wr + SIZE_FRAME_HEADER) < len){
+      log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "incomplete packet transmission to %s: %d + %d < %u", gs->s_tap_name, SIZE_FRAME_HEADER, wr, len);
+      /* WARNING: also ditches packet, otherwise we might have an unending stream of fragments (for some errors) */
+      gs->s_stats[GETAP_STAT_RX_DROPS]++;
+      pop_receive(gs);
       return -1;
     }
+
+    note_latency_tap(gs, &(gs->s_rx_stamps[gs->s_rx_head]), GETAP_STAT_RX_LATENCY);
+
+    pop_receive(gs);
   }
 
-  wr = write(gs->s_tap_fd, gs->s_rxb + SIZE_FRAME_HEADER, gs->s_rx_len - SIZE_FRAME_HEADER);
-  if(wr < 0){
-    switch(errno){
-      case EINTR  :
-      case EAGAIN :
-        return 0;
-      default :
-        log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "write to tap device %s failed: %s", gs->s_tap_name, strerror(errno));
-        /* WARNING: drops packet on floor, better than spamming logs */
-        forget_receive(gs);
-        return -1;
+  return 1;
+}
+
+/* callback/scheduling parts ********************************************/
+
+static void update_rate_tap(struct katcp_dispatch *d, struct getap_state *gs)
+{
+  struct timeval now, delta;
+  unsigned long long elapsed;
+  unsigned int i;
+
+  gettimeofday(&now, NULL);
+
+  if(timercmp(&now, &(gs->s_rate_start), <)){
+    /* clock stepped back, start over */
+    gs->s_rate_start = now;
+    gs->s_rx_frames = 0;
+    return;
+  }
+
+  timersub(&now, &(gs->s_rate_start), &delta);
+  elapsed = (delta.tv_sec * 1000000ULL) + delta.tv_usec;
+  if(elapsed < RATE_WINDOW){
+    return;
+  }
+
+  if(gs->s_rate_acquire){
+    set_integer_acquire_katcp(d, gs->s_rate_acquire, (gs->s_rx_frames * 1000000ULL) / elapsed);
+  }
+
+  /* counters only change sensors once per window, not per frame */
+  for(i = 0; i < GETAP_STATS; i++){
+    if(gs->s_stat_acquire[i]){
+      /* running counts wrap around at INT_MAX */
+      set_integer_acquire_katcp(d, gs->s_stat_acquire[i], gs->s_stats[i] & INT_MAX);
+    }
+    if(stat_specs[i].t_window){
+      gs->s_stats[i] = 0;
     }
   }
 
-  if((wr + SIZE_FRAME_HEADER) < gs->s_rx_len){
-    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "incomplete packet transmission to %s: %d + %d < %u", gs->s_tap_name, SIZE_FRAME_HEADER, wr, gs->s_rx_len);
-    /* WARNING: also ditches packet, otherwise we might have an unending stream of fragments (for some errors) */
-    forget_receive(gs);
-    return -1;
+  gs->s_rate_start = now;
+  gs->s_rx_frames = 0;
+}
+
+int run_timer_tap(struct katcp_dispatch *d, void *data);
+
+/* poll faster while frames are arriving, back off when quiet */
+
+static void adapt_poll_tap(struct katcp_dispatch *d, struct getap_scheduler *sc, unsigned int burst, int pending)
+{
+  unsigned int next, period, i;
+  struct tbs_raw *tr;
+  struct timeval tv;
+
+  tr = sc->c_raw;
+
+  /* the most demanding tap sets the pace */
+  period = UINT_MAX;
+  for(i = 0; i < tr->r_instances; i++){
+    if((tr->r_taps[i]->s_timer * 1000) < period){
+      period = tr->r_taps[i]->s_timer * 1000;
+    }
+  }
+
+  if(pending){
+    next = POLL_BUSY;
+  } else if(burst > 0){
+    next = period;
+  } else {
+    next = sc->c_poll * 2;
+    if(next > (period * POLL_BACKOFF)){
+      next = period * POLL_BACKOFF;
+    }
+  }
+
+  if(next < POLL_BUSY){
+    next = POLL_BUSY;
+  }
+
+  if(next == sc->c_poll){
+    return;
   }
 
+  tv.tv_sec = next / 1000000;
+  tv.tv_usec = next % 1000000;
+
+  if(register_every_tv_katcp(d, &tv, &run_timer_tap, sc) < 0){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to change tap polling interval to %uus", next);
+    return;
+  }
+
+  sc->c_poll = next;
+}
+
+static int process_frame_tap(struct katcp_dispatch *d, struct getap_state *gs)
+{
+  /* returns 0 if this tap should not be read further in this tick */
+
+  if(gs->s_rxb[FRAME_TYPE1] == 0x08){
+    switch(gs->s_rxb[FRAME_TYPE2]){
+      case 0x00 : /* IP packet */
+        queue_receive(gs);
+        /* if the kernel can't take it now, the write select picks it up, we carry on filling the queue */
+        transmit_ip_kernel(gs);
+        return 1;
+
+      case 0x06 : /* arp packet */
+        if(process_arp(gs) == 0){
+          forget_receive(gs);
+          return 0; /* arp reply stalled, wait ... */
+        }
+        forget_receive(gs);
+        return 1;
+
+      default :
+        log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "discarding frame of unknown type 0x%02x%02x and length %d", gs->s_rxb[FRAME_TYPE1], gs->s_rxb[FRAME_TYPE2], gs->s_rx_len);
+        gs->s_stats[GETAP_STAT_RX_UNKNOWN]++;
+        forget_receive(gs);
+        return 1;
+    }
+  }
+
+  gs->s_stats[GETAP_STAT_RX_UNKNOWN]++;
   forget_receive(gs);
 
   return 1;
 }
 
-/* callback/scheduling parts ********************************************/
+static void account_tap(struct katcp_dispatch *d, struct getap_state *gs, unsigned int elapsed)
+{
+  unsigned int slots;
+
+  gs->s_rx_frames += gs->s_received;
+  update_rate_tap(d, gs);
+
+  /* arp timing is in units of the nominal polling interval of this tap, so count those off, however fast or slow the scheduler runs */
+  gs->s_slot += elapsed;
+  slots = 0;
+
+  while((gs->s_slot >= (gs->s_timer * 1000)) && (slots < POLL_BACKOFF)){
+    gs->s_slot -= gs->s_timer * 1000;
+    slots++;
+
+    if(gs->s_received < (gs->s_deferrals + 1)){ /* try to spam the network if it is reasonably quiet, but adjust our definition of quiet */
+      spam_arp(gs);
+      gs->s_deferrals = 0;
+    } else {
+      gs->s_deferrals++;
+    }
+  }
+
+  if(slots >= POLL_BACKOFF){
+    /* fell far behind, don't try to catch up */
+    gs->s_slot = 0;
+  }
+
+  update_io_tap(d, gs);
+}
+
+/* one timer for all taps: the buffer size registers of all gateware
+ * instances are read in one sweep, then each tap with a frame waiting
+ * gets to deliver one, round robin, until all are drained or the shared
+ * budget is used up. The first tap served rotates from tick to tick */
 
 int run_timer_tap(struct katcp_dispatch *d, void *data)
 {
+  struct getap_scheduler *sc;
   struct getap_state *gs;
-  struct katcp_arb *a;
-  int result, run;
-  unsigned int burst;
   struct tbs_raw *tr;
+  unsigned int i, j, count, budget, burst;
+  int result, ready, pending;
 
-  gs = data;
-  sane_gs(gs);
+  sc = data;
+  tr = sc->c_raw;
 
-  tr = get_current_mode_katcp(d);
-  if(tr == NULL){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to get raw state");
+  if(tr->r_instances == 0){
+    /* returning failure makes the timer go away */
+    sc->c_poll = 0;
     return -1;
   }
 
   if(tr->r_fpga != TBS_FPGA_MAPPED){
-    log_message_katcp(d, KATCP_LEVEL_FATAL, NULL, "major problem, attempted to run %s despite fpga being down", gs->s_tap_name);
+    log_message_katcp(d, KATCP_LEVEL_FATAL, NULL, "major problem, attempted to run taps despite fpga being down");
+    sc->c_poll = 0;
     return -1;
   }
 
-  a = gs->s_tap_io;
+  count = tr->r_instances;
+  budget = 0;
 
   /* attempt to flush out stuff still stuck in buffers */
 
-  if(gs->s_arp_len > 0){
-    result = write_frame_fpga(gs, gs->s_arp_buffer, gs->s_arp_len);
-    if(result != 0){
-      gs->s_arp_len = 0;
+  for(i = 0; i < count; i++){
+    gs = tr->r_taps[i];
+    sane_gs(gs);
+
+    if(gs->s_arp_len > 0){
+      result = write_frame_fpga(gs, gs->s_arp_buffer, gs->s_arp_len);
+      if(result != 0){
+        gs->s_arp_len = 0;
+      }
     }
-  }
 
-  if(gs->s_tx_len > 0){
-    result = write_frame_fpga(gs, gs->s_txb, gs->s_tx_len);
-    if(result != 0){
-      gs->s_tx_len = 0;
+    if(gs->s_arp_len == 0){
+      transmit_ip_fpga(gs);
     }
+
+    gs->s_received = 0;
+    gs->s_ready = 1;
+    budget += gs->s_burst;
   }
 
   burst = 0;
-  run = 1;
+  pending = 0;
 
-  /* TODO: might want to handle burst of traffic better, instead of waiting poll interval for next frame */
   do{
+    ready = 0;
 
-    if(receive_frame_fpga(gs) > 0){
-
-      if(gs->s_rxb[FRAME_TYPE1] == 0x08){
-        switch(gs->s_rxb[FRAME_TYPE2]){
-          case 0x00 : /* IP packet */
-            if(transmit_ip_kernel(gs) == 0){
-              /* attempt another transmit when tfd becomes writable */
-              mode_arb_katcp(d, a, KATCP_ARB_READ | KATCP_ARB_WRITE);
-              run = 0; /* don't bother getting more if we can't send it on */
-            }
-            break;
-
-          case 0x06 : /* arp packet */
-            if(process_arp(gs) == 0){
-              run = 0; /* arp reply stalled, wait ... */
-            }
-            forget_receive(gs);
-            break;
+    for(i = 0; i < count; i++){
+      gs = tr->r_taps[i];
+      if(gs->s_ready){
+        gs->s_ready = sweep_frame_fpga(gs);
+        ready += gs->s_ready;
+      }
+    }
 
-          default :
+    for(j = 0; (j < count) && (ready > 0); j++){
+      gs = tr->r_taps[(sc->c_next + j) % count];
+      if(gs->s_ready == 0){
+        continue;
+      }
 
-            log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "discarding frame of unknown type 0x%02x%02x and length %d", gs->s_rxb[FRAME_TYPE1], gs->s_rxb[FRAME_TYPE2], gs->s_rx_len);
-            forget_receive(gs);
+      if(budget == 0){
+        /* the remaining frames are collected after a short busy interval, see adapt_poll_tap */
+        pending = 1;
+        ready = 0;
+        break;
+      }
 
-            break;
+      if(receive_frame_fpga(gs) > 0){
+        gs->s_received++;
+        burst++;
+        if(process_frame_tap(d, gs) == 0){
+          gs->s_ready = 0;
         }
       } else {
-        forget_receive(gs);
+        gs->s_ready = 0;
       }
 
-      burst++;
-
-      if(burst > gs->s_burst){
-        run = 0;
-      }
-
-    } else { /* nothing more to receive */
-      run = 0;
+      budget--;
     }
-  } while(run);
+
+  } while(ready > 0);
 
 #if DEBUG > 1
-  fprintf(stderr, "run timer loop: burst now %d\n", burst);
+  fprintf(stderr, "run timer loop: burst now %u over %u taps\n", burst, count);
 #endif
 
-  if(burst < (gs->s_deferrals + 1)){ /* try to spam the network if it is reasonably quiet, but adjust our definition of quiet */
-    spam_arp(gs);
-    gs->s_deferrals = 0;
-  } else {
-    gs->s_deferrals++;
+  sc->c_next = (sc->c_next + 1) % count;
+
+  for(i = 0; i < count; i++){
+    gs = tr->r_taps[i];
+    account_tap(d, gs, sc->c_poll);
+    /* frames queued for the gateware also need the next poll soon */
+    if(gs->s_tx_count > 0){
+      pending = 1;
+    }
+  }
+
+  adapt_poll_tap(d, sc, burst, pending);
+
+  return 0;
+}
+
+/* start the shared timer once the first tap shows up */
+
+static int start_scheduler_tap(struct katcp_dispatch *d, struct tbs_raw *tr, unsigned int period)
+{
+  struct getap_scheduler *sc;
+
+  sc = &(tr->r_tap_scheduler);
+
+  if(sc->c_poll > 0){
+    /* already running, adapt_poll_tap picks up a shorter period on the next tick */
+    return 0;
+  }
+
+  if(register_every_ms_katcp(d, period, &run_timer_tap, sc) < 0){
+    return -1;
   }
 
+  sc->c_poll = period * 1000;
+  sc->c_next = 0;
+
   return 0;
 }
 
+static void stop_scheduler_tap(struct katcp_dispatch *d, struct tbs_raw *tr)
+{
+  struct getap_scheduler *sc;
+
+  sc = &(tr->r_tap_scheduler);
+
+  if(sc->c_poll == 0){
+    return;
+  }
+
+  discharge_timer_katcp(d, sc);
+  sc->c_poll = 0;
+}
+
 int run_io_tap(struct katcp_dispatch *d, struct katcp_arb *a, unsigned int mode)
 {
   struct getap_state *gs;
@@ -878,16 +1343,16 @@ int run_io_tap(struct katcp_dispatch *d, struct katcp_arb *a, unsigned int mode)
 
     if(mode & KATCP_ARB_READ){
       result = receive_ip_kernel(d, gs);
-      if(result > 0){
-        transmit_ip_fpga(gs); /* if it doesn't work out, hope that next schedule will clear it */
+      if((result > 0) && (gs->s_arp_len == 0)){
+        transmit_ip_fpga(gs); /* if the gateware is busy, the timer retries the head of the queue */
       }
     }
 
     if(mode & KATCP_ARB_WRITE){
-      if(transmit_ip_kernel(gs) != 0){ /* unless we have to defer again disable write select */
-        mode_arb_katcp(d, a, KATCP_ARB_READ);
-      }
+      transmit_ip_kernel(gs);
     }
+
+    update_io_tap(d, gs);
   }
 
   return 0;
@@ -917,9 +1382,12 @@ int configure_fpga(struct getap_state *gs)
     return -1;
   }
 
-  memcpy(gs->s_txb + 6, gs->s_mac_binary, 6);
-  gs->s_txb[FRAME_TYPE1] = 0x08;
-  gs->s_txb[FRAME_TYPE2] = 0x00;
+  /* source and type are the same for every frame we send, tap reads only fill in the payload */
+  for(i = 0; i < GETAP_TX_SLOTS; i++){
+    memcpy(gs->s_tx_ring[i] + 6, gs->s_mac_binary, 6);
+    gs->s_tx_ring[i][FRAME_TYPE1] = 0x08;
+    gs->s_tx_ring[i][FRAME_TYPE2] = 0x00;
+  }
 
   if(gs->s_gateway_name[0] != '\0'){
     if(inet_aton(gs->s_gateway_name, &in) == 0){
@@ -1005,8 +1473,62 @@ static int configure_tap(struct getap_state *gs)
 
 /* state allocations ****************************************************/
 
+static struct katcp_acquire *setup_sensor_tap(struct katcp_dispatch *d, struct getap_state *gs, char *suffix, char *description, char *units)
+{
+  struct katcp_sensor *sn;
+  struct katcp_acquire *a;
+  char name[NAME_BUFFER];
+
+  snprintf(name, NAME_BUFFER, "raw.tap.%s.%s", gs->s_tap_name, suffix);
+  name[NAME_BUFFER - 1] = '\0';
+
+  sn = find_sensor_katcp(d, name);
+  if(sn){
+    /* left behind by an earlier instance of this tap */
+    return acquire_from_sensor_katcp(d, sn);
+  }
+
+  a = setup_integer_acquire_katcp(d, NULL, NULL, NULL);
+  if(a == NULL){
+    return NULL;
+  }
+
+  if(register_multi_integer_sensor_katcp(d, TBS_MODE_RAW, name, description, units, 0, INT_MAX, a, NULL, NULL) < 0){
+    destroy_acquire_katcp(d, a);
+    return NULL;
+  }
+
+  return a;
+}
+
+static int setup_sensors_tap(struct katcp_dispatch *d, struct getap_state *gs)
+{
+  unsigned int i;
+  int result;
+
+  result = 0;
+
+  gs->s_rate_acquire = setup_sensor_tap(d, gs, "rx-rate", "frames received from the gateware per second", "Hz");
+  if(gs->s_rate_acquire == NULL){
+    result = -1;
+  }
+
+  for(i = 0; i < GETAP_STATS; i++){
+    gs->s_stat_acquire[i] = setup_sensor_tap(d, gs, stat_specs[i].t_name, stat_specs[i].t_description, stat_specs[i].t_units);
+    if(gs->s_stat_acquire[i] == NULL){
+      result = -1;
+    } else {
+      set_integer_acquire_katcp(d, gs->s_stat_acquire[i], 0);
+    }
+  }
+
+  return result;
+}
+
 void destroy_getap(struct katcp_dispatch *d, struct getap_state *gs)
 {
+  unsigned int i;
+
   /* WARNING: destroy_getap, does not remove itself from the global structure */
 
   sane_gs(gs);
@@ -1018,9 +1540,15 @@ void destroy_getap(struct katcp_dispatch *d, struct getap_state *gs)
     gs->s_tap_io = NULL;
   }
 
-  if(gs->s_timer){
-    discharge_timer_katcp(d, gs);
-    gs->s_timer = 0;
+  if(gs->s_rate_acquire){
+    /* sensors can not be removed, leave it for the next tap of the same name */
+    set_integer_acquire_katcp(d, gs->s_rate_acquire, 0);
+    gs->s_rate_acquire = NULL;
+  }
+
+  for(i = 0; i < GETAP_STATS; i++){
+    /* keep the final counts visible until a new instance starts */
+    gs->s_stat_acquire[i] = NULL;
   }
 
   /* empty out the rest of the data structure */
@@ -1031,7 +1559,7 @@ void destroy_getap(struct katcp_dispatch *d, struct getap_state *gs)
   }
 
   if(gs->s_tap_name){
-    free(gs->s_tap_name);
+    free_string_memory_katcp(tag_memory_katcp(TAP_MEMORY), gs->s_tap_name);
     gs->s_tap_name = NULL;
   }
 
@@ -1051,12 +1579,14 @@ void destroy_getap(struct katcp_dispatch *d, struct getap_state *gs)
   gs->s_iteration = 0;
 
   gs->s_rx_len = 0;
-  gs->s_tx_len = 0;
   gs->s_arp_len = 0;
 
+  gs->s_rx_count = 0;
+  gs->s_tx_count = 0;
+
   gs->s_magic = 0;
 
-  free(gs);
+  free_memory_katcp(tag_memory_katcp(TAP_MEMORY), gs, sizeof(struct getap_state));
 }
 
 void unlink_getap(struct katcp_dispatch *d, struct getap_state *gs)
@@ -1082,6 +1612,10 @@ void unlink_getap(struct katcp_dispatch *d, struct getap_state *gs)
     }
   }
 
+  if(tr->r_instances == 0){
+    stop_scheduler_tap(d, tr);
+  }
+
   destroy_getap(d, gs);
 }
 
@@ -1110,6 +1644,8 @@ void stop_all_getap(struct katcp_dispatch *d, int final)
 
   tr->r_instances = 0;
 
+  stop_scheduler_tap(d, tr);
+
   if(final){
     free(tr->r_taps);
     tr->r_taps = NULL;
@@ -1144,7 +1680,7 @@ struct getap_state *create_getap(struct katcp_dispatch *d, unsigned int instance
     return NULL;
   }
 
-  gs = malloc(sizeof(struct getap_state));
+  gs = malloc_memory_katcp(tag_memory_katcp(TAP_MEMORY), sizeof(struct getap_state));
   if(gs == NULL){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate state for %s", name);
     return NULL;
@@ -1178,11 +1714,34 @@ struct getap_state *create_getap(struct katcp_dispatch *d, unsigned int instance
   gs->s_mcast_fd = (-1);
 
   gs->s_timer = 0;
+  gs->s_slot = 0;
+
+  gs->s_sizes = 0;
+  gs->s_ready = 0;
+  gs->s_received = 0;
+
+  gs->s_rx_frames = 0;
+  gettimeofday(&(gs->s_rate_start), NULL);
+  gs->s_rate_acquire = NULL;
 
   gs->s_rx_len = 0;
-  gs->s_tx_len = 0;
   gs->s_arp_len = 0;
 
+  gs->s_synthetic = 0;
+
+  gs->s_rx_head = 0;
+  gs->s_rx_count = 0;
+  gs->s_tx_head = 0;
+  gs->s_tx_count = 0;
+
+  gs->s_rxb = gs->s_rx_ring[0];
+  gs->s_txb = gs->s_tx_ring[0];
+
+  for(i = 0; i < GETAP_STATS; i++){
+    gs->s_stats[i] = 0;
+    gs->s_stat_acquire[i] = NULL;
+  }
+
   /* buffers, table */
 
   for(i = 0; i < GETAP_ARP_CACHE; i++){
@@ -1199,7 +1758,7 @@ struct getap_state *create_getap(struct katcp_dispatch *d, unsigned int instance
     return NULL;
   }
 
-  gs->s_tap_name = strdup(tap);
+  gs->s_tap_name = strdup_memory_katcp(tag_memory_katcp(TAP_MEMORY), tap);
   if(gs->s_tap_name == NULL){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to duplicate tap device name %s", tap);
     destroy_getap(d, gs);
@@ -1235,6 +1794,9 @@ struct getap_state *create_getap(struct katcp_dispatch *d, unsigned int instance
     return NULL;
   }
 
+  /* frames are read and written in batches until the device pushes back */
+  fcntl(gs->s_tap_fd, F_SETFL, fcntl(gs->s_tap_fd, F_GETFL) | O_NONBLOCK);
+
   gs->s_tap_io = create_arb_katcp(d, gs->s_tap_name, gs->s_tap_fd, KATCP_ARB_READ, &run_io_tap, gs);
   if(gs->s_tap_io == NULL){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create io handler for tap device %s", gs->s_tap_name);
@@ -1248,13 +1810,11 @@ struct getap_state *create_getap(struct katcp_dispatch *d, unsigned int instance
     return NULL;
   }
 
-  if(register_every_ms_katcp(d, period, &run_timer_tap, gs) < 0){
-    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to register timer for interval of %dms", gs->s_timer);
-    destroy_getap(d, gs);
-    return NULL;
-  }
+  gs->s_timer = period;
 
-  gs->s_timer = period; /* a nonzero value here means the timer is running ... */
+  if(setup_sensors_tap(d, gs) < 0){
+    log_message_katcp(d, KATCP_LEVEL_WARN, NULL, "unable to provide all traffic sensors for %s", gs->s_tap_name);
+  }
 
   return gs;
 }
@@ -1302,6 +1862,12 @@ int insert_getap(struct katcp_dispatch *d, char *name, char *tap, char *ip, unsi
 
   tr->r_instances++;
 
+  if(start_scheduler_tap(d, tr, period) < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to register tap timer for interval of %ums", period);
+    unlink_getap(d, gs);
+    return -1;
+  }
+
   return 0;
 }
 
@@ -1398,6 +1964,7 @@ void tap_print_info(struct katcp_dispatch *d, struct getap_state *gs)
   }
 
   log_message_katcp(gs->s_dispatch, KATCP_LEVEL_INFO, NULL, "polling interval %ums", gs->s_timer);
+  log_message_katcp(gs->s_dispatch, KATCP_LEVEL_INFO, NULL, "current adaptive polling interval %uus shared by %u taps", gs->s_raw_mode->r_tap_scheduler.c_poll, gs->s_raw_mode->r_instances);
   log_message_katcp(gs->s_dispatch, KATCP_LEVEL_INFO, NULL, "max reads per interval %u", gs->s_burst);
   log_message_katcp(gs->s_dispatch, KATCP_LEVEL_INFO, NULL, "address %s", gs->s_address_name);
   log_message_katcp(gs->s_dispatch, KATCP_LEVEL_INFO, NULL, "gateware port is %u", gs->s_port);
@@ -1405,7 +1972,12 @@ void tap_print_info(struct katcp_dispatch *d, struct getap_state *gs)
 
   log_message_katcp(gs->s_dispatch, KATCP_LEVEL_INFO, NULL, "current iteration %u", gs->s_iteration);
   log_message_katcp(gs->s_dispatch, KATCP_LEVEL_INFO, NULL, "current arp spam deferrals %u", gs->s_deferrals);
-  log_message_katcp(gs->s_dispatch, KATCP_LEVEL_INFO, NULL, "current buffers arp=%u/rx=%u/tx=%u", gs->s_arp_len, gs->s_rx_len, gs->s_tx_len);
+  log_message_katcp(gs->s_dispatch, KATCP_LEVEL_INFO, NULL, "current buffers arp=%u/rx=%u", gs->s_arp_len, gs->s_rx_len);
+  log_message_katcp(gs->s_dispatch, KATCP_LEVEL_INFO, NULL, "queued frames to kernel=%u/%u to gateware=%u/%u", gs->s_rx_count, GETAP_RX_SLOTS, gs->s_tx_count, GETAP_TX_SLOTS);
+
+  for(i = 0; i < GETAP_STATS; i++){
+    log_message_katcp(gs->s_dispatch, KATCP_LEVEL_INFO, NULL, "%s %u%s", stat_specs[i].t_name, gs->s_stats[i], stat_specs[i].t_window ? "us" : "");
+  }
 }
 
 int tap_info_cmd(struct katcp_dispatch *d, int argc)
@@ -1444,6 +2016,74 @@ int tap_info_cmd(struct katcp_dispatch *d, int argc)
   return KATCP_RESULT_FAIL;
 }
 
+int tap_emulate_cmd(struct katcp_dispatch *d, int argc)
+{
+  char *name;
+  unsigned int i, len;
+  struct tbs_raw *tr;
+  struct getap_state *gs;
+
+  tr = get_current_mode_katcp(d);
+  if(tr == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to get raw state");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(tr->r_emulate == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "synthetic traffic only available when the fpga is emulated");
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(argc <= 2){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a tap name and a frame length");
+    return KATCP_RESULT_INVALID;
+  }
+
+  name = arg_string_katcp(d, 1);
+  if(name == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "internal failure while acquiring parameters");
+    return KATCP_RESULT_FAIL;
+  }
+
+  gs = NULL;
+  for(i = 0; i < tr->r_instances; i++){
+    if(!strcmp(tr->r_taps[i]->s_tap_name, name)){
+      gs = tr->r_taps[i];
+    }
+  }
+
+  if(gs == NULL){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "no tap instance called %s", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  len = arg_unsigned_long_katcp(d, 2);
+  if(len == 0){
+    gs->s_synthetic = 0;
+    return KATCP_RESULT_OK;
+  }
+
+  /* the gateware counts in 8 byte words */
+  len = (len + 7) & ~0x7;
+
+  if((len < MIN_FRAME) || (len > GETAP_MAX_FRAME)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "frame length %u not in range %u to %u", len, MIN_FRAME, GETAP_MAX_FRAME);
+    return KATCP_RESULT_FAIL;
+  }
+
+  if(gs->s_register->e_len_base < (GO_RXBUFFER + len)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "register of tap %s too small for a receive buffer", name);
+    return KATCP_RESULT_FAIL;
+  }
+
+  build_synthetic_fpga(gs, len);
+  gs->s_synthetic = len;
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "emulated gateware offers frames of %u bytes to tap %s", len, name);
+
+  return KATCP_RESULT_OK;
+}
+
 int tap_multicast_add_group_cmd(struct katcp_dispatch *d, int argc)
 {
   struct tbs_raw *tr;
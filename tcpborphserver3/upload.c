@@ -18,6 +18,8 @@
 #include <katpriv.h>
 #include <netc.h>
 
+#include <zlib.h>
+
 #include "tcpborphserver3.h"
 #include "loadbof.h"
 #include "tg.h"
@@ -29,6 +31,11 @@
 #define UPLOAD_TIMEOUT    30 
 #define UPLOAD_PORT       7146
 
+/* receive buffer requested for upload sockets, so that the sender is not throttled by our disk or fpga writes */
+#define UPLOAD_SOCKET_BUFFER  (1024*1024)
+/* largest amount of leading data accepted before the start of the bitstream has to be known */
+#define UPLOAD_HEADER_MAX     (1024*1024)
+
 
 void destroy_port_data_tbs(struct katcp_dispatch *d, struct tbs_port_data *pd)
 {
@@ -69,6 +76,10 @@ struct tbs_port_data *create_port_data_tbs(struct katcp_dispatch *d, char *file,
   pd->t_program = program;
   pd->t_expected = expected;
 
+  pd->t_stream = 0;
+  pd->t_tee = 0;
+  pd->t_compress = 0;
+
   pd->t_fd = (-1);
 
   if(file == NULL){
@@ -97,19 +108,41 @@ struct tbs_port_data *create_port_data_tbs(struct katcp_dispatch *d, char *file,
   return pd;
 }
 
-int upload_tbs(struct katcl_line *l, void *data)
-{ 
-  struct tbs_port_data *pd;
-  int lfd, nfd, rr, wr, have;
-  unsigned char buf[MTU];
-  unsigned int count;
+static int write_all_upload(struct katcl_line *l, int fd, unsigned char *buf, int len, char *what)
+{
+  int wr, have;
+
+  have = 0;
+  while(have < len){
+    wr = write(fd, buf + have, len - have);
+    switch(wr){
+      case -1:
+        switch(errno){
+          case EAGAIN:
+          case EINTR:
+            break;
+          default:
+            sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "%s failed: %s", what, strerror(errno));
+            return -1;
+        }
+        break;
+
+      case 0:
+        sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "unexpected zero write during %s", what);
+        return -1;
+
+      default:
+        have += wr;
+        break;
+    }
+  }
 
-  pd = data;
+  return 0;
+}
 
-  if (pd == NULL){
-    sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "no state supplied to subordinate logic");
-    return -1;
-  }
+static int accept_upload(struct katcl_line *l, struct tbs_port_data *pd)
+{
+  int lfd, nfd, size;
 
   lfd = net_listen(NULL, pd->t_port, 0);
   if (lfd < 0){
@@ -117,6 +150,12 @@ int upload_tbs(struct katcl_line *l, void *data)
     return -1;
   }
 
+  /* accepted socket inherits this, has to be set before the connection is established to get a decent window */
+  size = UPLOAD_SOCKET_BUFFER;
+  if(setsockopt(lfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0){
+    sync_message_katcl(l, KATCP_LEVEL_WARN, UPLOAD_LABEL, "unable to enlarge receive buffer to %d bytes: %s", size, strerror(errno));
+  }
+
   signal(SIGALRM, SIG_DFL);
   alarm(pd->t_timeout);
 
@@ -127,8 +166,262 @@ int upload_tbs(struct katcl_line *l, void *data)
     sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "accept on port %d failed: %s", pd->t_port, strerror(errno));
     return -1;
   }
+
+  return nfd;
+}
+
+/* move up to need bytes from the socket into the config device without
+ * copying through user space. Returns bytes moved, 0 at end of input, -1 on
+ * failure. Clears splicing if the descriptors turn out not to support it,
+ * in which case data already in the pipe is copied across conventionally */
+
+static int splice_upload(struct katcl_line *l, int nfd, int dfd, int *pfd, unsigned int need, int *splicing)
+{
+  unsigned char buf[MTU];
+  int rr, wr, have;
+
+  rr = splice(nfd, NULL, pfd[1], NULL, (need > MTU) ? MTU : need, SPLICE_F_MOVE | SPLICE_F_MORE);
+  if(rr < 0){
+    if(errno == EINVAL){
+      *splicing = 0;
+      return 0;
+    }
+    sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "splice from network failed: %s", strerror(errno));
+    return -1;
+  }
+  if(rr == 0){
+    return 0;
+  }
+
+  have = 0;
+  while(have < rr){
+    if(*splicing){
+      wr = splice(pfd[0], NULL, dfd, NULL, rr - have, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if(wr > 0){
+        have += wr;
+        continue;
+      }
+      if((wr < 0) && ((errno == EAGAIN) || (errno == EINTR))){
+        continue;
+      }
+      if((wr < 0) && (errno == EINVAL)){
+        *splicing = 0;
+        continue;
+      }
+      sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "splice to %s failed: %s", TBS_FPGA_CONFIG, (wr < 0) ? strerror(errno) : "zero write");
+      return -1;
+    }
+
+    wr = read(pfd[0], buf, rr - have);
+    if(wr <= 0){
+      sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "unable to drain splice pipe: %s", (wr < 0) ? strerror(errno) : "empty");
+      return -1;
+    }
+    if(write_all_upload(l, dfd, buf, wr, "write to fpga") < 0){
+      return -1;
+    }
+    have += wr;
+  }
+
+  return rr;
+}
+
+/* program the fpga while the image arrives: the header is parsed as soon as
+ * enough of it is available, bitstream data goes straight to the config
+ * device. Only the header (or everything if teeing) is kept in t_fd, which
+ * is enough for the parent to load the register table */
+
+static int stream_upload_tbs(struct katcl_line *l, struct tbs_port_data *pd, int nfd)
+{
+  unsigned char buf[MTU], *header, *tmp;
+  unsigned int count, have, start, stop, programmed, hsize;
+  unsigned long offset, size;
+  int rr, dfd, located, result, splicing, piped, pfd[2];
+
+  header = NULL;
+  hsize = 0;
+  have = 0;
+  count = 0;
+  programmed = 0;
+  located = 0;
+  offset = 0;
+  size = 0;
+
+#ifdef __PPC__
+  dfd = open(TBS_FPGA_CONFIG, O_WRONLY);
+#else
+  dfd = open(TBS_FPGA_CONFIG, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+#endif
+  if(dfd < 0){
+    sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "unable to open device %s: %s", TBS_FPGA_CONFIG, strerror(errno));
+    return -1;
+  }
+
+  piped = 0;
+  if(pd->t_tee == 0){
+    if(pipe(pfd) == 0){
+      piped = 1;
+    }
+  }
+  splicing = piped;
+
+  result = -1;
+
+  for(;;){
+
+    if(located && splicing && (count >= offset) && (programmed < size)){
+      rr = splice_upload(l, nfd, dfd, pfd, size - programmed, &splicing);
+      if(rr < 0){
+        goto out;
+      }
+      if(rr > 0){
+        count += rr;
+        programmed += rr;
+        alarm(UPLOAD_TIMEOUT);
+        continue;
+      }
+      if(splicing){
+        break;
+      }
+      /* not supported here, fall back to copying */
+    }
+
+    rr = read(nfd, buf, MTU);
+    if (rr == 0){
+      break;
+    } else if (rr < 0){
+      if((errno == EAGAIN) || (errno == EINTR)){
+        continue;
+      }
+      sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "read failed while receiving bof file: %s", strerror(errno));
+      goto out;
+    }
+
+    if(located == 0){
+      if((have + rr) > UPLOAD_HEADER_MAX){
+        sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "no bitstream location within the first %u bytes of the image", UPLOAD_HEADER_MAX);
+        goto out;
+      }
+      if((have + rr) > hsize){
+        tmp = realloc(header, have + rr);
+        if(tmp == NULL){
+          sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "unable to allocate %u bytes for image header", have + rr);
+          goto out;
+        }
+        header = tmp;
+        hsize = have + rr;
+      }
+      memcpy(header + have, buf, rr);
+      have += rr;
+
+      switch(locate_bitstream_bof(header, have, &offset, &size)){
+        case -1 :
+          sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "image is not an uncompressed bof file, unable to stream it");
+          goto out;
+        case 0 :
+          located = 1;
+          sync_message_katcl(l, KATCP_LEVEL_DEBUG, UPLOAD_LABEL, "bitstream of %lu bytes starts at 0x%lx", size, offset);
+          break;
+      }
+    }
+
+    /* keep the header for the register table, the remainder only if asked to */
+    if(pd->t_tee || (located == 0)){
+      stop = rr;
+    } else {
+      stop = (count >= offset) ? 0 : (((offset - count) < rr) ? (offset - count) : rr);
+    }
+    if(stop > 0){
+      if(write_all_upload(l, pd->t_fd, buf, stop, "saving of bof file") < 0){
+        goto out;
+      }
+    }
+
+    if(located && (programmed < size)){
+      start = (count < offset) ? (offset - count) : 0;
+      if(start < rr){
+        stop = rr - start;
+        if(stop > (size - programmed)){
+          stop = size - programmed;
+        }
+        if(write_all_upload(l, dfd, buf + start, stop, "write to fpga") < 0){
+          goto out;
+        }
+        programmed += stop;
+      }
+    }
+
+    count += rr;
+
+    alarm(UPLOAD_TIMEOUT);
+  }
+
+  sync_message_katcl(l, KATCP_LEVEL_INFO, UPLOAD_LABEL, "received bof file data of %u bytes, streamed %u bitstream bytes", count, programmed);
+
+  if((located == 0) || (programmed < size)){
+    sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "image ended with %lu bitstream bytes still to load", size - programmed);
+    goto out;
+  }
+
+  if((pd->t_expected > 0) && (pd->t_expected != count)){
+    sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "expected %u bytes, received %u", pd->t_expected, count);
+    goto out;
+  }
+
+  if(close(dfd) < 0){
+    dfd = (-1);
+    sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "unable to complete programming of fpga: %s", strerror(errno));
+    goto out;
+  }
+  dfd = (-1);
+
+  result = 0;
+
+out:
+  if(piped){
+    close(pfd[0]);
+    close(pfd[1]);
+  }
+  if(dfd >= 0){
+    close(dfd);
+  }
+  if(header){
+    free(header);
+  }
+
+  return result;
+}
+
+int upload_tbs(struct katcl_line *l, void *data)
+{ 
+  struct tbs_port_data *pd;
+  int nfd, rr, wr, have, len, result, compress;
+  unsigned char buf[MTU];
+  unsigned int count;
+  gzFile gz;
+
+  pd = data;
+
+  if (pd == NULL){
+    sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "no state supplied to subordinate logic");
+    return -1;
+  }
+
+  nfd = accept_upload(l, pd);
+  if(nfd < 0){
+    return -1;
+  }
+
+  if(pd->t_stream){
+    result = stream_upload_tbs(l, pd, nfd);
+    close(nfd);
+    alarm(0);
+    return result;
+  }
   
   count = 0;
+  compress = pd->t_compress;
+  gz = NULL;
 
   for (;;){
     rr = read(nfd, buf, MTU);
@@ -140,8 +433,35 @@ int upload_tbs(struct katcl_line *l, void *data)
       return -1;
     }
 
+    len = rr;
+
+    if(compress){
+      /* data which arrives compressed already is kept as is */
+      if((count == 0) && (rr >= 2) && (buf[0] == 0x1f) && (buf[1] == 0x8b)){
+        compress = 0;
+      } else {
+        gz = gzdopen(dup(pd->t_fd), "wb1");
+        if(gz == NULL){
+          sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "unable to set up compression of bof file");
+          close(nfd);
+          return -1;
+        }
+        compress = 0;
+      }
+    }
+
+    if(gz){
+      if(gzwrite(gz, buf, rr) != rr){
+        sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "compressed saving of bof file failed");
+        gzclose(gz);
+        close(nfd);
+        return -1;
+      }
+      rr = 0;
+    }
+
     have = 0;
-    do {
+    while(have < rr){
       wr = write(pd->t_fd, buf + have, rr - have);
       switch(wr){
 
@@ -169,9 +489,9 @@ int upload_tbs(struct katcl_line *l, void *data)
 #endif
           break;
       }
-    } while(have < rr);
+    }
 
-    count += rr;
+    count += len;
 
 #if 0
     sync_message_katcl(l, KATCP_LEVEL_INFO, NULL, "uploaded %d bytes", pd->t_rsize);
@@ -182,7 +502,14 @@ int upload_tbs(struct katcl_line *l, void *data)
 
   close(nfd);
 
-  sync_message_katcl(l, KATCP_LEVEL_INFO, UPLOAD_LABEL, "received bof file data of %u bytes", count);
+  if(gz){
+    if(gzclose(gz) != Z_OK){
+      sync_message_katcl(l, KATCP_LEVEL_ERROR, UPLOAD_LABEL, "unable to complete compressed bof file");
+      return -1;
+    }
+  }
+
+  sync_message_katcl(l, KATCP_LEVEL_INFO, UPLOAD_LABEL, "received bof file data of %u bytes%s", count, (pd->t_compress && (gz == NULL)) ? ", kept as compressed by sender" : "");
 
   if(pd->t_expected > 0){
     if(pd->t_expected != count){
@@ -234,7 +561,7 @@ int upload_complete_tbs(struct katcp_dispatch *d, struct katcp_notice *n, void *
   struct tbs_port_data *pd;
   struct katcl_parse *p;
   char *inform, *status;
-  int fd;
+  int fd, result;
   struct bof_state *bs;
 
 #if 0
@@ -274,6 +601,10 @@ int upload_complete_tbs(struct katcp_dispatch *d, struct katcp_notice *n, void *
 
   if(strcmp(status, KATCP_OK) != 0){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "encountered %s on upload", status);
+    if(pd->t_stream){
+      /* the bitstream may have been partially written */
+      status_fpga_tbs(d, TBS_FPGA_DOWN);
+    }
     destroy_port_data_tbs(d, pd);
     return 0;
   }
@@ -288,7 +619,8 @@ int upload_complete_tbs(struct katcp_dispatch *d, struct katcp_notice *n, void *
       return 0;
     }
    
-    if(stop_fpga_tbs(d) < 0){
+    /* when streaming, the fpga was stopped before the upload started */
+    if((pd->t_stream == 0) && (stop_fpga_tbs(d) < 0)){
       destroy_port_data_tbs(d, pd);
       return 0;
     }
@@ -307,7 +639,13 @@ int upload_complete_tbs(struct katcp_dispatch *d, struct katcp_notice *n, void *
       return 0;
     }
 
-    if(start_fpga_tbs(d, bs) < 0){
+    if(pd->t_stream){
+      result = attach_fpga_tbs(d, bs);
+    } else {
+      result = start_fpga_tbs(d, bs);
+    }
+
+    if(result < 0){
       log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to program uploaded bof file");
       close_bof(d, bs);
       destroy_port_data_tbs(d, pd);
@@ -401,8 +739,8 @@ int uploadbof_cmd(struct katcp_dispatch *d, int argc)
   unsigned int port, timeout, expected;
   struct tbs_raw *tr;
   struct katcp_notice *nx;
-  char *name, *buffer;
-  int len, result;
+  char *name, *buffer, *option;
+  int len, result, compress;
 
   dl = template_shared_katcp(d);
   if(dl == NULL){
@@ -417,6 +755,7 @@ int uploadbof_cmd(struct katcp_dispatch *d, int argc)
   expected = 0;
   timeout = 0;
   port = UPLOAD_PORT;
+  compress = 0;
 
   if(argc < 3){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "need a port and file name to save data");
@@ -445,6 +784,14 @@ int uploadbof_cmd(struct katcp_dispatch *d, int argc)
     if(argc > 4){
       timeout = arg_unsigned_long_katcp(d, 4);
       log_message_katcp(d, KATCP_LEVEL_DEBUG, NULL, "user requested a timeout of %us", timeout);
+      if(argc > 5){
+        option = arg_string_katcp(d, 5);
+        if((option == NULL) || strcmp(option, "compress")){
+          log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown storage option %s", option ? option : "<null>");
+          return KATCP_RESULT_INVALID;
+        }
+        compress = 1;
+      }
     }
   }
 
@@ -492,6 +839,8 @@ int uploadbof_cmd(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
+  pd->t_compress = compress;
+
   /* added in the global space dl, so that it completes even if client goes away */
   if(add_notice_katcp(dl, nx, &upload_complete_tbs, pd) < 0){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to register callback for upload completion");
@@ -541,6 +890,8 @@ int upload_cmd(struct katcp_dispatch *d, int argc)
   unsigned int port, timeout, expected;
   struct tbs_raw *tr;
   struct katcp_notice *nx;
+  char *mode, *name, *buffer;
+  int stream, len, result;
 
   dl = template_shared_katcp(d);
   if(dl == NULL){
@@ -577,25 +928,81 @@ int upload_cmd(struct katcp_dispatch *d, int argc)
     }
   }
 
+  stream = 0;
+  name = NULL;
+  buffer = NULL;
+
+  if(argc > 4){
+    mode = arg_string_katcp(d, 4);
+    if(mode == NULL){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to acquire upload mode");
+      return KATCP_RESULT_FAIL;
+    }
+    if(!strcmp(mode, "stream")){
+      stream = 1;
+    } else if(strcmp(mode, "store")){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unknown upload mode %s, expected stream or store", mode);
+      return KATCP_RESULT_INVALID;
+    }
+
+    if(argc > 5){
+      name = arg_string_katcp(d, 5);
+      if(name == NULL){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to acquire file name");
+        return KATCP_RESULT_FAIL;
+      }
+      if(strchr(name, '/') || (name[0] == '.')){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "refusing to upload file containing path information");
+        return KATCP_RESULT_FAIL;
+      }
+
+      len = strlen(name) + strlen(tr->r_bof_dir) + 1;
+      buffer = malloc(len + 1);
+      if(buffer == NULL){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to allocate %d bytes", len + 1);
+        return KATCP_RESULT_FAIL;
+      }
+
+      result = snprintf(buffer, len + 1, "%s/%s", tr->r_bof_dir, name);
+      if(result != len){
+        log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "major logic failure: expected %d from snprintf, got %d", len, result);
+        free(buffer);
+        return KATCP_RESULT_FAIL;
+      }
+    }
+  }
+
   nx = find_notice_katcp(d, TBS_FPGA_CONFIG);
   if(nx){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "another upload already seems in progress, halting this attempt");
+    if(buffer){
+      free(buffer);
+    }
     return KATCP_RESULT_FAIL;
   }
 
   nx = create_notice_katcp(d, TBS_FPGA_CONFIG, 0);
   if(nx == NULL){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to create notification logic to trigger when upload completes");
+    if(buffer){
+      free(buffer);
+    }
     return KATCP_RESULT_FAIL;
   }
 
-  pd = create_port_data_tbs(d, NULL, port, 1, expected, timeout);
+  pd = create_port_data_tbs(d, buffer, port, 1, expected, timeout);
+  if(buffer){
+    free(buffer);
+  }
 
   if (pd == NULL){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "%s: couldn't create port data", __func__);
     return KATCP_RESULT_FAIL;
   }
 
+  pd->t_stream = stream;
+  pd->t_tee = (name != NULL) ? 1 : 0;
+
   /* added in the global space dl, so that it completes even if client goes away */
   if(add_notice_katcp(dl, nx, &upload_complete_tbs, pd) < 0){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to register callback for upload completion");
@@ -617,6 +1024,13 @@ int upload_cmd(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
 
+  /* the child writes the bitstream to the device itself, so release the fpga first */
+  if(stream && (stop_fpga_tbs(d) < 0)){
+    destroy_kurl_katcp(url);
+    destroy_port_data_tbs(NULL, pd);
+    return KATCP_RESULT_FAIL;
+  }
+
   j = run_child_process_tbs(dl, url, &upload_tbs, pd, nx);
   if (j == NULL){
     log_message_katcp(d, KATCP_LEVEL_ERROR, NULL, "unable to run child process");
@@ -625,7 +1039,7 @@ int upload_cmd(struct katcp_dispatch *d, int argc)
     return KATCP_RESULT_FAIL;
   }
       
-  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "awaiting transfer on port %d", pd->t_port);
+  log_message_katcp(d, KATCP_LEVEL_INFO, NULL, "awaiting %s transfer on port %d", stream ? "streamed" : "stored", pd->t_port);
 
   return KATCP_RESULT_OK;
 }
@@ -10,11 +10,14 @@
 #include <sysexits.h>
 
 #include <sys/select.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <math.h>
 
 #include <katcp.h>
 #include <katpriv.h>
@@ -26,6 +29,13 @@
 #define TMON_SENSOR_NAME         ".ntp.synchronised"
 #define TMON_SENSOR_DESCRIPTION  "clock good"
 
+#define TMON_PEER_PREFIX         ".ntp"
+#define TMON_PEER_FILTER             8    /* offsets kept per server to work out jitter */
+#define TMON_PEER_MISSES             4    /* unanswered polls before a server counts as unreachable */
+#define TMON_PEER_RANGE          100.0    /* nominal sensor range in seconds */
+#define TMON_OFFSET_WARN         0.001
+#define TMON_OFFSET_ERROR        0.010
+
 /************************************************************/
 
 #define NTP_MAGIC                   0x1f113123
@@ -98,6 +108,35 @@
 
 #define NTP_MAX_PACKET    (NTP_HEADER + NTP_MAX_DATA)
 
+#define NTP_PORT                          123
+
+/* client mode packets keep leap, version and mode in a single byte */
+#define NTP_CLIENT_LEAPI_SHIFT              6
+#define NTP_CLIENT_VERSION_SHIFT            3
+#define  NTP_MODE_CLIENT                    3
+#define  NTP_MODE_SERVER                    4
+
+#define NTP_STRATUM_MAX                    16
+#define NTP_UNIX_OFFSET           2208988800UL  /* 1900 to 1970 */
+
+struct ntp_remote
+{
+  char *r_name;
+  struct sockaddr_in r_addr;
+
+  struct timeval r_when;
+  uint64_t r_stamp;      /* transmit stamp of the outstanding query, 0 if none */
+  unsigned int r_missed;
+  int r_reachable;
+  int r_sync;
+
+  double r_filter[TMON_PEER_FILTER];
+  unsigned int r_samples;
+  double r_offset;
+  double r_delay;
+  double r_jitter;
+};
+
 struct ntp_state
 {
   unsigned int n_magic;
@@ -105,6 +144,10 @@ struct ntp_state
   unsigned int n_sequence; /* careful, field in packet is only 16 bits */
   int n_sync;
   int n_level;
+
+  int n_peer_fd;
+  struct ntp_remote **n_peers;
+  unsigned int n_peer_count;
 };
 
 struct ntp_peer{
@@ -122,10 +165,28 @@ struct ntp_message{
   uint8_t n_data[NTP_MAX_DATA];
 } __attribute__ ((packed));
 
+struct ntp_client_message{
+  uint8_t c_flags;
+  uint8_t c_stratum;
+  int8_t c_poll;
+  int8_t c_precision;
+  uint32_t c_delay;
+  uint32_t c_dispersion;
+  uint32_t c_refid;
+  uint32_t c_reference[2];
+  uint32_t c_origin[2];
+  uint32_t c_receive[2];
+  uint32_t c_transmit[2];
+}; /* naturally aligned, 48 bytes without packing */
+
+void destroy_peer_ntp(struct ntp_remote *nr);
+
 /*****************************************************************************/
 
 void destroy_ntp(struct katcp_dispatch *d, struct ntp_state *nt)
 {
+  unsigned int i;
+
   if(nt == NULL){
     return;
   }
@@ -139,6 +200,20 @@ void destroy_ntp(struct katcp_dispatch *d, struct ntp_state *nt)
     nt->n_fd = (-1);
   }
 
+  if(nt->n_peer_fd >= 0){
+    close(nt->n_peer_fd);
+    nt->n_peer_fd = (-1);
+  }
+
+  if(nt->n_peers){
+    for(i = 0; i < nt->n_peer_count; i++){
+      destroy_peer_ntp(nt->n_peers[i]);
+    }
+    free(nt->n_peers);
+    nt->n_peers = NULL;
+  }
+  nt->n_peer_count = 0;
+
   free(nt);
 }
 
@@ -156,6 +231,10 @@ struct ntp_state *create_ntp(struct katcp_dispatch *d)
   nt->n_fd = (-1);
   nt->n_sequence = 1;
 
+  nt->n_peer_fd = (-1);
+  nt->n_peers = NULL;
+  nt->n_peer_count = 0;
+
   return nt;
 }
 
@@ -410,6 +489,438 @@ int recv_ntp(struct katcp_dispatch *d, struct ntp_state *nt)
 
 /*****************************************************************************/
 
+/* remote servers are queried in client mode, which needs no control
+ * access on the far side and gives us the four timestamps required to
+ * work out offset and delay. All of them share one unconnected socket,
+ * replies are matched by source and by the transmit stamp echoed back */
+
+void destroy_peer_ntp(struct ntp_remote *nr)
+{
+  if(nr == NULL){
+    return;
+  }
+
+  if(nr->r_name){
+    free(nr->r_name);
+    nr->r_name = NULL;
+  }
+
+  free(nr);
+}
+
+struct ntp_remote *create_peer_ntp(struct katcp_dispatch *d, char *spec)
+{
+  struct ntp_remote *nr;
+  struct hostent *he;
+  char *host, *ptr, *copy;
+  int port;
+
+  copy = strdup(spec);
+  if(copy == NULL){
+    return NULL;
+  }
+
+  /* name=host[:port] or just host, in which case the host doubles as name */
+  ptr = strchr(copy, '=');
+  if(ptr){
+    *ptr = '\0';
+    host = ptr + 1;
+  } else {
+    host = copy;
+  }
+
+  port = NTP_PORT;
+  ptr = strchr(host, ':');
+  if(ptr){
+    *ptr = '\0';
+    port = atoi(ptr + 1);
+  }
+
+  if((copy[0] == '\0') || (host[0] == '\0') || (port <= 0) || (port > 0xffff)){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, TMON_MODULE_NAME, "unable to make sense of ntp server %s", spec);
+    free(copy);
+    return NULL;
+  }
+
+  nr = malloc(sizeof(struct ntp_remote));
+  if(nr == NULL){
+    free(copy);
+    return NULL;
+  }
+
+  nr->r_name = NULL;
+
+  memset(&(nr->r_addr), 0, sizeof(struct sockaddr_in));
+  nr->r_addr.sin_family = AF_INET;
+  nr->r_addr.sin_port = htons(port);
+
+  if(inet_aton(host, &(nr->r_addr.sin_addr)) == 0){
+    he = gethostbyname(host);
+    if((he == NULL) || (he->h_addrtype != AF_INET)){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, TMON_MODULE_NAME, "unable to resolve ntp server %s", host);
+      free(copy);
+      free(nr);
+      return NULL;
+    }
+    memcpy(&(nr->r_addr.sin_addr), he->h_addr_list[0], sizeof(struct in_addr));
+  }
+
+  /* name and host live in the same allocation, name is at its start */
+  nr->r_name = copy;
+
+  nr->r_when.tv_sec = 0;
+  nr->r_when.tv_usec = 0;
+  nr->r_stamp = 0;
+  nr->r_missed = 0;
+  nr->r_reachable = 0;
+  nr->r_sync = 0;
+
+  nr->r_samples = 0;
+  nr->r_offset = 0.0;
+  nr->r_delay = 0.0;
+  nr->r_jitter = 0.0;
+
+  return nr;
+}
+
+int add_peer_ntp(struct katcp_dispatch *d, struct ntp_state *nt, char *spec)
+{
+  struct ntp_remote *nr, **tmp;
+
+  nr = create_peer_ntp(d, spec);
+  if(nr == NULL){
+    return -1;
+  }
+
+  tmp = realloc(nt->n_peers, sizeof(struct ntp_remote *) * (nt->n_peer_count + 1));
+  if(tmp == NULL){
+    destroy_peer_ntp(nr);
+    return -1;
+  }
+
+  nt->n_peers = tmp;
+  nt->n_peers[nt->n_peer_count] = nr;
+  nt->n_peer_count++;
+
+  return 0;
+}
+
+static uint64_t stamp_ntp(struct timeval *tv)
+{
+  uint64_t stamp;
+
+  stamp = ((uint64_t)(tv->tv_sec + NTP_UNIX_OFFSET)) << 32;
+  stamp |= (((uint64_t)(tv->tv_usec)) << 32) / 1000000;
+
+  return stamp;
+}
+
+static double span_ntp(uint64_t later, uint64_t earlier)
+{
+  /* unsigned difference wraps correctly, then reinterpret as 32.32 signed */
+  return ((double)((int64_t)(later - earlier))) / 4294967296.0;
+}
+
+static uint64_t get_stamp_ntp(uint32_t *field)
+{
+  return (((uint64_t)ntohl(field[0])) << 32) | ntohl(field[1]);
+}
+
+static void put_stamp_ntp(uint32_t *field, uint64_t stamp)
+{
+  field[0] = htonl(stamp >> 32);
+  field[1] = htonl(stamp & 0xffffffff);
+}
+
+int setup_peers_ntp(struct katcp_dispatch *d, struct ntp_state *nt)
+{
+  int fd, flags;
+
+  if(nt->n_peer_fd >= 0){
+    return 0;
+  }
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(fd < 0){
+    log_message_katcp(d, KATCP_LEVEL_ERROR, TMON_MODULE_NAME, "unable to create ntp peer socket: %s", strerror(errno));
+    return -1;
+  }
+
+  flags = fcntl(fd, F_GETFL, NULL);
+  if(flags >= 0){
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  }
+
+  nt->n_peer_fd = fd;
+
+  return 0;
+}
+
+void schedule_peers_ntp(struct ntp_state *nt, struct timeval *start, unsigned int period)
+{
+  struct timeval offset;
+  unsigned int i, ms;
+
+  /* spread the queries over the poll period, rather than firing all at once */
+  for(i = 0; i < nt->n_peer_count; i++){
+    ms = (period * i) / nt->n_peer_count;
+    offset.tv_sec = ms / 1000;
+    offset.tv_usec = (ms % 1000) * 1000;
+    add_time_katcp(&(nt->n_peers[i]->r_when), start, &offset);
+  }
+}
+
+static void list_peer_sensor_ntp(struct katcp_dispatch *d, struct ntp_remote *nr, char *suffix, char *description, char *units, int flt)
+{
+  append_string_katcp(d, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#sensor-list");
+  append_args_katcp  (d,                    KATCP_FLAG_STRING, "%s.%s.%s", TMON_PEER_PREFIX, nr->r_name, suffix);
+  append_args_katcp  (d,                    KATCP_FLAG_STRING, "%s %s", description, nr->r_name);
+  append_string_katcp(d,                    KATCP_FLAG_STRING, units);
+  if(flt){
+    append_string_katcp(d,                  KATCP_FLAG_STRING, "float");
+    append_double_katcp(d,                  KATCP_FLAG_DOUBLE, -TMON_PEER_RANGE);
+    append_double_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_DOUBLE, TMON_PEER_RANGE);
+  } else {
+    append_string_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_STRING, "boolean");
+  }
+}
+
+void list_peers_ntp(struct katcp_dispatch *d, struct ntp_state *nt)
+{
+  struct ntp_remote *nr;
+  unsigned int i;
+
+  for(i = 0; i < nt->n_peer_count; i++){
+    nr = nt->n_peers[i];
+    list_peer_sensor_ntp(d, nr, "synchronised", "clock good on", "none", 0);
+    list_peer_sensor_ntp(d, nr, "offset", "local clock offset relative to", "seconds", 1);
+    list_peer_sensor_ntp(d, nr, "jitter", "offset jitter relative to", "seconds", 1);
+    list_peer_sensor_ntp(d, nr, "delay", "round trip delay to", "seconds", 1);
+  }
+}
+
+static void status_peer_sensor_ntp(struct katcp_dispatch *d, struct ntp_remote *nr, struct timeval *now, char *suffix, char *status, int flt, double value)
+{
+  append_string_katcp(d, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#sensor-status");
+  append_args_katcp  (d,                    KATCP_FLAG_STRING, "%ld%03u", now->tv_sec, now->tv_usec / 1000);
+  append_string_katcp(d,                    KATCP_FLAG_STRING, "1");
+  append_args_katcp  (d,                    KATCP_FLAG_STRING, "%s.%s.%s", TMON_PEER_PREFIX, nr->r_name, suffix);
+  append_string_katcp(d,                    KATCP_FLAG_STRING, status);
+  if(flt){
+    append_double_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_DOUBLE, value);
+  } else {
+    append_unsigned_long_katcp(d, KATCP_FLAG_LAST | KATCP_FLAG_ULONG, (unsigned long)value);
+  }
+}
+
+static void report_peer_ntp(struct katcp_dispatch *d, struct ntp_remote *nr, struct timeval *now)
+{
+  double size;
+  char *status;
+
+  if(nr->r_reachable == 0){
+    status_peer_sensor_ntp(d, nr, now, "synchronised", "unreachable", 0, 0);
+    status_peer_sensor_ntp(d, nr, now, "offset", "unreachable", 1, nr->r_offset);
+    status_peer_sensor_ntp(d, nr, now, "jitter", "unreachable", 1, nr->r_jitter);
+    status_peer_sensor_ntp(d, nr, now, "delay", "unreachable", 1, nr->r_delay);
+    return;
+  }
+
+  status_peer_sensor_ntp(d, nr, now, "synchronised", nr->r_sync ? "nominal" : "error", 0, nr->r_sync);
+
+  if(nr->r_samples == 0){
+    /* reachable, but never synchronised, so no offset yet */
+    return;
+  }
+
+  size = (nr->r_offset < 0.0) ? -(nr->r_offset) : nr->r_offset;
+  if(size >= TMON_OFFSET_ERROR){
+    status = "error";
+  } else if(size >= TMON_OFFSET_WARN){
+    status = "warn";
+  } else {
+    status = "nominal";
+  }
+
+  status_peer_sensor_ntp(d, nr, now, "offset", status, 1, nr->r_offset);
+  status_peer_sensor_ntp(d, nr, now, "jitter", "nominal", 1, nr->r_jitter);
+  status_peer_sensor_ntp(d, nr, now, "delay", "nominal", 1, nr->r_delay);
+}
+
+int send_peer_ntp(struct katcp_dispatch *d, struct ntp_state *nt, struct ntp_remote *nr, struct timeval *now)
+{
+  struct ntp_client_message buffer, *cm;
+  int wr;
+
+  if(nr->r_stamp != 0){
+    /* previous query never answered */
+    nr->r_missed++;
+    /* report once, also for servers which have never answered */
+    if(nr->r_missed == TMON_PEER_MISSES){
+      log_message_katcp(d, KATCP_LEVEL_WARN, TMON_MODULE_NAME, "ntp server %s not answering", nr->r_name);
+      nr->r_reachable = 0;
+      nr->r_sync = 0;
+      report_peer_ntp(d, nr, now);
+    }
+  }
+
+  cm = &buffer;
+  memset(cm, 0, sizeof(struct ntp_client_message));
+
+  cm->c_flags = SET_BITS(NTP_LEAPI_ALARM, NTP_CLIENT_LEAPI_SHIFT, NTP_LEAPI_MASK) |
+                SET_BITS(NTP_VERSION_THREE, NTP_CLIENT_VERSION_SHIFT, NTP_VERSION_MASK) |
+                SET_BITS(NTP_MODE_CLIENT, 0, NTP_MODE_MASK);
+
+  /* the transmit stamp doubles as sequence number, the server echoes it */
+  nr->r_stamp = stamp_ntp(now);
+  put_stamp_ntp(cm->c_transmit, nr->r_stamp);
+
+  wr = sendto(nt->n_peer_fd, cm, sizeof(struct ntp_client_message), MSG_NOSIGNAL, (struct sockaddr *)&(nr->r_addr), sizeof(struct sockaddr_in));
+  if(wr < 0){
+    switch(errno){
+      case EAGAIN :
+      case EINTR  :
+      case ENOBUFS :
+        return 0;
+      default :
+        log_message_katcp(d, KATCP_LEVEL_DEBUG, TMON_MODULE_NAME, "unable to send query to %s: %s", nr->r_name, strerror(errno));
+        return -1;
+    }
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "tmon: queried %s\n", nr->r_name);
+#endif
+
+  return 1;
+}
+
+static void filter_peer_ntp(struct ntp_remote *nr, double offset, double delay)
+{
+  unsigned int i, count;
+  double sum, diff;
+
+  /* newest sample always at the front */
+  for(i = TMON_PEER_FILTER - 1; i > 0; i--){
+    nr->r_filter[i] = nr->r_filter[i - 1];
+  }
+  nr->r_filter[0] = offset;
+
+  if(nr->r_samples < TMON_PEER_FILTER){
+    nr->r_samples++;
+  }
+
+  nr->r_offset = offset;
+  nr->r_delay = delay;
+
+  /* rms of the older offsets relative to the latest one, as ntpd does it */
+  count = nr->r_samples - 1;
+  if(count == 0){
+    nr->r_jitter = 0.0;
+    return;
+  }
+
+  sum = 0.0;
+  for(i = 1; i <= count; i++){
+    diff = nr->r_filter[i] - offset;
+    sum += diff * diff;
+  }
+
+  nr->r_jitter = sqrt(sum / count);
+}
+
+int recv_peers_ntp(struct katcp_dispatch *d, struct ntp_state *nt)
+{
+  struct ntp_client_message buffer, *cm;
+  struct sockaddr_in sa;
+  struct ntp_remote *nr;
+  struct timeval now;
+  socklen_t len;
+  uint64_t t1, t2, t3, t4;
+  unsigned int i, mode, leap;
+  int rr, count;
+
+  cm = &buffer;
+  count = 0;
+
+  for(;;){
+    len = sizeof(struct sockaddr_in);
+    rr = recvfrom(nt->n_peer_fd, cm, sizeof(struct ntp_client_message), MSG_DONTWAIT, (struct sockaddr *)&sa, &len);
+    if(rr < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          return count;
+        case ECONNREFUSED :
+          /* icmp from some server without ntp, the timeout deals with it */
+          continue;
+        default :
+          log_message_katcp(d, KATCP_LEVEL_ERROR, TMON_MODULE_NAME, "ntp peer receive failed with %s", strerror(errno));
+          return -1;
+      }
+    }
+
+    gettimeofday(&now, NULL);
+    t4 = stamp_ntp(&now);
+
+    if(rr < sizeof(struct ntp_client_message)){
+      log_message_katcp(d, KATCP_LEVEL_DEBUG, TMON_MODULE_NAME, "ntp peer reply of %d bytes too short", rr);
+      continue;
+    }
+
+    for(i = 0; i < nt->n_peer_count; i++){
+      nr = nt->n_peers[i];
+      if((nr->r_addr.sin_addr.s_addr == sa.sin_addr.s_addr) && (nr->r_addr.sin_port == sa.sin_port)){
+        break;
+      }
+    }
+    if(i >= nt->n_peer_count){
+      log_message_katcp(d, KATCP_LEVEL_DEBUG, TMON_MODULE_NAME, "ignoring ntp reply from unknown source %s", inet_ntoa(sa.sin_addr));
+      continue;
+    }
+
+    t1 = get_stamp_ntp(cm->c_origin);
+    if((nr->r_stamp == 0) || (t1 != nr->r_stamp)){
+      log_message_katcp(d, KATCP_LEVEL_DEBUG, TMON_MODULE_NAME, "stale or duplicate ntp reply from %s", nr->r_name);
+      continue;
+    }
+
+    mode = GET_BITS(cm->c_flags, 0, NTP_MODE_MASK);
+    if(mode != NTP_MODE_SERVER){
+      log_message_katcp(d, KATCP_LEVEL_DEBUG, TMON_MODULE_NAME, "ntp reply from %s has mode %u", nr->r_name, mode);
+      continue;
+    }
+
+    /* answered, even if the answer is that the server is not in sync */
+    nr->r_stamp = 0;
+    nr->r_missed = 0;
+    nr->r_reachable = 1;
+    count++;
+
+    leap = GET_BITS(cm->c_flags, NTP_CLIENT_LEAPI_SHIFT, NTP_LEAPI_MASK);
+    if((leap == NTP_LEAPI_ALARM) || (cm->c_stratum == 0) || (cm->c_stratum >= NTP_STRATUM_MAX)){
+      if(nr->r_sync){
+        log_message_katcp(d, KATCP_LEVEL_WARN, TMON_MODULE_NAME, "ntp server %s is not synchronised (stratum %u)", nr->r_name, cm->c_stratum);
+      }
+      nr->r_sync = 0;
+      report_peer_ntp(d, nr, &now);
+      continue;
+    }
+
+    t2 = get_stamp_ntp(cm->c_receive);
+    t3 = get_stamp_ntp(cm->c_transmit);
+
+    filter_peer_ntp(nr, (span_ntp(t2, t1) + span_ntp(t3, t4)) / 2.0, span_ntp(t4, t1) - span_ntp(t3, t2));
+    nr->r_sync = 1;
+
+    log_message_katcp(d, KATCP_LEVEL_TRACE, TMON_MODULE_NAME, "ntp server %s offset %.6fs delay %.6fs jitter %.6fs", nr->r_name, nr->r_offset, nr->r_delay, nr->r_jitter);
+
+    report_peer_ntp(d, nr, &now);
+  }
+}
+
+/*****************************************************************************/
+
 #if 0
 int recv_ntp_poco(struct katcp_dispatch *d, struct ntp_sensor_poco *nt)
 {
@@ -599,11 +1110,12 @@ int main(int argc, char **argv)
 {
 #define BUFFER 128
   struct ntp_state *nt;
+  struct ntp_remote *nr;
   struct katcp_dispatch *d;
-  int result, previous, current, mfd, rr;
+  int result, previous, current, mfd, rr, i;
   char *level;
-  unsigned int period;
-  struct timeval delta, now, when, template;
+  unsigned int period, k;
+  struct timeval delta, now, when, template, next;
   fd_set fsr;
   char buffer[BUFFER];
 
@@ -640,7 +1152,23 @@ int main(int argc, char **argv)
     }
   }
 
-  log_message_katcp(d, KATCP_LEVEL_INFO, TMON_MODULE_NAME, "polling local ntp server every %dms", period);
+  /* any further parameters are [name=]host[:port] servers to watch */
+  for(i = 3; i < argc; i++){
+    if(add_peer_ntp(d, nt, argv[i]) < 0){
+      log_message_katcp(d, KATCP_LEVEL_ERROR, TMON_MODULE_NAME, "unable to add ntp server %s", argv[i]);
+      write_katcp(d);
+      return EX_USAGE;
+    }
+  }
+
+  if(nt->n_peer_count > 0){
+    if(setup_peers_ntp(d, nt) < 0){
+      write_katcp(d);
+      return EX_OSERR;
+    }
+  }
+
+  log_message_katcp(d, KATCP_LEVEL_INFO, TMON_MODULE_NAME, "polling local ntp server and %u others every %dms", nt->n_peer_count, period);
 
   append_string_katcp(d, KATCP_FLAG_FIRST | KATCP_FLAG_STRING, "#sensor-list");
   append_string_katcp(d,                    KATCP_FLAG_STRING, TMON_SENSOR_NAME);
@@ -648,6 +1176,7 @@ int main(int argc, char **argv)
   append_string_katcp(d,                    KATCP_FLAG_STRING, "none");
   append_string_katcp(d, KATCP_FLAG_LAST  | KATCP_FLAG_STRING, "boolean");
 
+  list_peers_ntp(d, nt);
 
   if(period < TMON_POLL_MIN){
     period = TMON_POLL_MIN;
@@ -656,30 +1185,10 @@ int main(int argc, char **argv)
   template.tv_sec = period / 1000;
   template.tv_usec = (period % 1000) * 1000;
 
-  delta.tv_sec = 0;
-  delta.tv_usec = TMON_POLL_MIN;
-
-#if 0
-  delta.tv_sec = 0;
-  delta.tv_usec = (2 * TMON_POLL_MIN) * 1000;
-
-  result = cmp_time_katcp(&template, &delta);
-  
-  margin.tv_sec = 0;
-  margin.tv_usec = TMON_POLL_MIN * 1000;
-
-  if(result < 0){
-
-    log_message_katcp(d, KATCP_LEVEL_WARN, TMON_MODULE_NAME, "requested poll interval too small, limiting interval to %dms", 2 * TMON_POLL_MIN);
+  gettimeofday(&now, NULL);
+  when = now;
 
-    template.tv_sec = 0;
-    template.tv_usec = TMON_POLL_MIN * 1000;
-  } else {
-    sub_time_katcp(&template, &template, &margin);
-  }
-#endif
-
-  gettimeofday(&when, NULL);
+  schedule_peers_ntp(nt, &now, period);
 
   for(;;){
     
@@ -688,9 +1197,29 @@ int main(int argc, char **argv)
       fprintf(stderr, "tmon: next send time, when is %ld.%06lu\n", when.tv_sec, when.tv_usec);
 #endif
       send_ntp(d, nt);
-      add_time_katcp(&when, &when, &delta);
+      add_time_katcp(&when, &when, &template);
+      if(cmp_time_katcp(&now, &when) >= 0){
+        /* fell behind, do not try to catch up with a burst */
+        add_time_katcp(&when, &now, &template);
+      }
     } 
 
+    next = when;
+
+    for(k = 0; k < nt->n_peer_count; k++){
+      nr = nt->n_peers[k];
+      if(cmp_time_katcp(&now, &(nr->r_when)) >= 0){
+        send_peer_ntp(d, nt, nr, &now);
+        add_time_katcp(&(nr->r_when), &(nr->r_when), &template);
+        if(cmp_time_katcp(&now, &(nr->r_when)) >= 0){
+          add_time_katcp(&(nr->r_when), &now, &template);
+        }
+      }
+      if(cmp_time_katcp(&(nr->r_when), &next) < 0){
+        next = nr->r_when;
+      }
+    }
+
     FD_ZERO(&fsr);
 
     FD_SET(STDIN_FILENO, &fsr);
@@ -703,40 +1232,55 @@ int main(int argc, char **argv)
       }
     }
 
-    delta.tv_sec  = template.tv_sec;
-    delta.tv_usec = template.tv_usec;
+    if(nt->n_peer_fd >= 0){
+      FD_SET(nt->n_peer_fd, &fsr);
+      if(nt->n_peer_fd >= mfd){
+        mfd = nt->n_peer_fd + 1;
+      }
+    }
+
+    if(cmp_time_katcp(&next, &now) > 0){
+      sub_time_katcp(&delta, &next, &now);
+    } else {
+      delta.tv_sec = 0;
+      delta.tv_usec = 0;
+    }
 
     result = select(mfd, &fsr, NULL, NULL, &delta);
 
     gettimeofday(&now, NULL);
 
-    if(nt->n_fd >= 0){
-      if(FD_ISSET(nt->n_fd, &fsr)){
-        current = 0;
-        while((result = recv_ntp(d, nt)) != 0){
-          current = (result > 0) ? 1 : 0;
+    if(result > 0){
+      if(nt->n_fd >= 0){
+        if(FD_ISSET(nt->n_fd, &fsr)){
+          current = 0;
+          while((result = recv_ntp(d, nt)) != 0){
+            current = (result > 0) ? 1 : 0;
+          }
         }
       }
-    }
 
-    if(FD_ISSET(STDIN_FILENO, &fsr)){
-      rr = read(STDIN_FILENO, buffer, BUFFER);
-      if(rr == 0){
-        return EX_OK;
-      }
-      if(rr < 0){
-        switch(errno){
-          case EAGAIN :
-          case EINTR  :
-            break;
-          default : 
-            return EX_OSERR;
+      if(nt->n_peer_fd >= 0){
+        if(FD_ISSET(nt->n_peer_fd, &fsr)){
+          recv_peers_ntp(d, nt);
         }
       }
-    }
 
-    if(flushing_katcp(d)){
-      write_katcp(d);
+      if(FD_ISSET(STDIN_FILENO, &fsr)){
+        rr = read(STDIN_FILENO, buffer, BUFFER);
+        if(rr == 0){
+          return EX_OK;
+        }
+        if(rr < 0){
+          switch(errno){
+            case EAGAIN :
+            case EINTR  :
+              break;
+            default : 
+              return EX_OSERR;
+          }
+        }
+      }
     }
 
     if(current != previous){
@@ -749,6 +1293,10 @@ int main(int argc, char **argv)
       previous = current;
     }
 
+    if(flushing_katcp(d)){
+      write_katcp(d);
+    }
+
   }
 
   destroy_ntp(d, nt);
@@ -757,4 +1305,3 @@ int main(int argc, char **argv)
   return EX_OK;
 #undef BUFFER
 }
-
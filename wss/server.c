@@ -11,19 +11,31 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sysexits.h>
+#include <fcntl.h>
+
+#ifdef KATCP_USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include <openssl/conf.h>
 #include <openssl/engine.h>
 
+#include <zlib.h>
+
 #include "server.h"
 
 #define HTTP_EOL             "\r\n"
 #define READBUFFERSIZE        4096
+#define DEFLATE_LEVEL         6
+#define DEFLATE_TAIL          "\x00\x00\xff\xff"
 
 static volatile int run = 1;
 
+int disconnect_client_ws(struct ws_server *s, struct ws_client *c);
+int send_client_data_ws(struct ws_server *s, struct ws_client *c);
+
 void ws_handle(int signum) 
 {
   run = 0;
@@ -36,7 +48,7 @@ struct ws_frame *crete_ws_frame(uint8_t hdr[], uint8_t msk[], uint64_t payload)
   if (hdr == NULL || 
 }
 #endif
-struct ws_server *create_server_ws(int (*cdfn)(struct ws_client *c))
+struct ws_server *create_server_ws(int (*cdfn)(struct ws_client *c), int (*bkfn)(void *line, int n, void **key))
 {
   struct ws_server *s;
 
@@ -58,6 +70,14 @@ struct ws_server *create_server_ws(int (*cdfn)(struct ws_client *c))
   s->s_br_count= 0;
   s->s_cdfn    = cdfn;
   s->s_tlsctx  = NULL;
+  s->s_efd     = (-1);
+  s->s_bfd     = STDIN_FILENO;
+  s->s_bpoll   = 0;
+  s->s_ib      = NULL;
+  s->s_ib_len  = 0;
+  s->s_bkfn    = bkfn;
+  s->s_benc    = NULL;
+  s->s_bc_count= 0;
 #if 0
   s->s_up_count= 0;
   s->s_sb      = NULL;
@@ -82,11 +102,299 @@ struct ws_client *create_client_ws(int fd, SSL *ssl)
   c->c_state    = C_STATE_NEW;
   c->c_sb       = NULL;
   c->c_sb_len   = 0;
+  c->c_q_head   = 0;
+  c->c_q_count  = 0;
+  c->c_q_done   = 0;
+  c->c_q_dropped= 0;
+  c->c_wb       = NULL;
+  c->c_wb_len   = 0;
+  c->c_wb_done  = 0;
+  c->c_blocked  = 0;
+  c->c_flags    = 0;
+  c->c_deflate  = NULL;
+  c->c_inflate  = NULL;
   c->c_frame    = NULL;
 
   return c;
 }
 
+struct ws_buffer *create_buffer_ws(uint8_t op, void *payload, int n, void *key, int klen)
+{
+  struct ws_buffer *b;
+  uint8_t *p;
+  int hlen, i;
+
+  if (payload == NULL || n < 0)
+    return NULL;
+
+  b = malloc(sizeof(struct ws_buffer));
+  if (b == NULL)
+    return NULL;
+
+  /* server frames go out unmasked, so one copy serves every client */
+  if (n < WSF_PAYLOAD_16)
+    hlen = 2;
+  else if (n <= 0xffff)
+    hlen = 4;
+  else 
+    hlen = 10;
+
+  b->b_data = malloc(hlen + n + ((key != NULL) ? klen : 0));
+  if (b->b_data == NULL){
+    free(b);
+    return NULL;
+  }
+
+  p = b->b_data;
+  p[0] = WSF_FIN | op;
+  
+  if (hlen == 2){
+    p[1] = n;
+  } else if (hlen == 4){
+    p[1] = WSF_PAYLOAD_16;
+    p[2] = (n >> 8) & 0xff;
+    p[3] = n & 0xff;
+  } else {
+    p[1] = WSF_PAYLOAD_64;
+    for (i=0; i<8; i++)
+      p[2+i] = ((uint64_t) n >> (8 * (7 - i))) & 0xff;
+  }
+
+  memcpy(p + hlen, payload, n);
+
+  b->b_len  = hlen + n;
+  b->b_hlen = hlen;
+  b->b_refs = 0;
+
+  /* the key lives in the same allocation, just past the frame */
+  if (key != NULL && klen > 0){
+    b->b_key     = p + b->b_len;
+    b->b_key_len = klen;
+    memcpy(b->b_key, key, klen);
+  } else {
+    b->b_key     = NULL;
+    b->b_key_len = 0;
+  }
+
+  return b;
+}
+
+void release_buffer_ws(struct ws_buffer *b)
+{
+  if (b == NULL)
+    return;
+
+  b->b_refs--;
+  if (b->b_refs > 0)
+    return;
+
+  if (b->b_data)
+    free(b->b_data);
+  free(b);
+}
+
+int queue_client_ws(struct ws_client *c, struct ws_buffer *b)
+{
+  unsigned int i, j, first, at;
+  struct ws_buffer *old;
+
+  if (c == NULL || b == NULL)
+    return -1;
+
+  /* a frame which has started going out can not be touched anymore */
+  first = (c->c_q_done > 0) ? 1 : 0;
+
+  /* a newer update for the same key replaces the one still waiting */
+  if (b->b_key != NULL){
+    for (i=first; i<c->c_q_count; i++){
+      at = (c->c_q_head + i) % WS_QUEUE_MAX;
+      old = c->c_q[at];
+      if ((old->b_key_len == b->b_key_len) && (memcmp(old->b_key, b->b_key, b->b_key_len) == 0)){
+        b->b_refs++;
+        c->c_q[at] = b;
+        release_buffer_ws(old);
+        c->c_q_dropped++;
+        return 0;
+      }
+    }
+  }
+
+  /* slow reader, give up on the oldest frame not yet in flight */
+  if (c->c_q_count >= WS_QUEUE_MAX){
+    if (first >= c->c_q_count)
+      return -1;
+
+    at = (c->c_q_head + first) % WS_QUEUE_MAX;
+    release_buffer_ws(c->c_q[at]);
+
+    for (i=first; i+1<c->c_q_count; i++){
+      at = (c->c_q_head + i) % WS_QUEUE_MAX;
+      j  = (at + 1) % WS_QUEUE_MAX;
+      c->c_q[at] = c->c_q[j];
+    }
+    c->c_q_count--;
+    c->c_q_dropped++;
+  }
+
+  b->b_refs++;
+  c->c_q[(c->c_q_head + c->c_q_count) % WS_QUEUE_MAX] = b;
+  c->c_q_count++;
+
+  return 0;
+}
+
+int enable_deflate_ws(struct ws_client *c, int bits, int reset)
+{
+  z_stream *zd, *zi;
+
+  if (c == NULL)
+    return -1;
+
+  zd = calloc(1, sizeof(z_stream));
+  zi = calloc(1, sizeof(z_stream));
+  if (zd == NULL || zi == NULL){
+    free(zd);
+    free(zi);
+    return -1;
+  }
+
+  /* raw deflate streams, as permessage-deflate (rfc 7692) wants */
+  if (deflateInit2(zd, DEFLATE_LEVEL, Z_DEFLATED, -bits, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+    free(zd);
+    free(zi);
+    return -1;
+  }
+
+  if (inflateInit2(zi, -15) != Z_OK){
+    deflateEnd(zd);
+    free(zd);
+    free(zi);
+    return -1;
+  }
+
+  c->c_deflate = zd;
+  c->c_inflate = zi;
+  c->c_flags  |= WS_CLIENT_DEFLATE;
+  if (reset)
+    c->c_flags |= WS_CLIENT_DEFLATE_RESET;
+
+  return 0;
+}
+
+/* the compression context belongs to one client, so a shared frame
+ * has to be recompressed for each of them */
+struct ws_buffer *deflate_buffer_ws(struct ws_client *c, struct ws_buffer *b)
+{
+  struct ws_buffer *d;
+  z_stream *z;
+  unsigned char *out;
+  unsigned int n, size, len;
+
+  z = c->c_deflate;
+  n = b->b_len - b->b_hlen;
+
+  size = deflateBound(z, n) + 16;
+  out  = malloc(size);
+  if (out == NULL)
+    return NULL;
+
+  z->next_in   = b->b_data + b->b_hlen;
+  z->avail_in  = n;
+  z->next_out  = out;
+  z->avail_out = size;
+
+  if (deflate(z, Z_SYNC_FLUSH) != Z_OK || z->avail_in > 0){
+    free(out);
+    return NULL;
+  }
+
+  len = size - z->avail_out;
+
+  /* the empty block ending a sync flush is implied on the wire */
+  if (len >= 4 && memcmp(out + len - 4, DEFLATE_TAIL, 4) == 0)
+    len -= 4;
+
+  if (c->c_flags & WS_CLIENT_DEFLATE_RESET)
+    deflateReset(z);
+
+  d = create_buffer_ws(WSF_RSV1 | (b->b_data[0] & WSF_OPCODE), out, len, NULL, 0);
+
+  free(out);
+
+  return d;
+}
+
+/* returns the inflated length, -1 on error or -2 if more than max bytes
+ * would come out, a small message can inflate to an enormous one */
+int inflate_client_ws(struct ws_client *c, void *in, int n, int max, void **out)
+{
+  z_stream *z;
+  unsigned char *buf, *tmp;
+  int size, limit, grow, rtn, pass;
+
+  if (c == NULL || c->c_inflate == NULL || in == NULL || out == NULL || max < 0)
+    return -1;
+
+  z = c->c_inflate;
+
+  /* one spare byte, filling it means the message is too large */
+  limit = max + 1;
+
+  size = (n > (limit - 64) / 4) ? limit : (n * 4) + 64;
+  buf  = malloc(size);
+  if (buf == NULL)
+    return -1;
+
+  z->next_out  = buf;
+  z->avail_out = size;
+
+  /* feed the message, then the tail the sender stripped */
+  for (pass = 0; pass < 2; pass++){
+    z->next_in  = (pass == 0) ? in : (unsigned char *) DEFLATE_TAIL;
+    z->avail_in = (pass == 0) ? n : 4;
+
+    while (z->avail_in > 0){
+      if (z->avail_out == 0){
+        if (size >= limit){
+          free(buf);
+          inflateReset(z);
+          return -2;
+        }
+        grow = (size > limit - size) ? limit - size : size;
+        tmp  = realloc(buf, size + grow);
+        if (tmp == NULL){
+          free(buf);
+          inflateReset(z);
+          return -1;
+        }
+        buf          = tmp;
+        z->next_out  = buf + size;
+        z->avail_out = grow;
+        size        += grow;
+      }
+
+      rtn = inflate(z, Z_SYNC_FLUSH);
+      if (rtn != Z_OK && rtn != Z_BUF_ERROR){
+        free(buf);
+        inflateReset(z);
+        return -1;
+      }
+    }
+  }
+
+  /* we asked for client_no_context_takeover */
+  inflateReset(z);
+
+  if (z->avail_out == 0 && size >= limit){
+    free(buf);
+    return -2;
+  }
+
+  *out = buf;
+
+  return size - z->avail_out;
+}
+
 void destroy_client_ws(struct ws_client *c)
 {
   if (c){
@@ -108,6 +416,21 @@ void destroy_client_ws(struct ws_client *c)
     if (c->c_sb != NULL)
       free(c->c_sb);
 #endif
+    while (c->c_q_count > 0){
+      release_buffer_ws(c->c_q[c->c_q_head]);
+      c->c_q_head = (c->c_q_head + 1) % WS_QUEUE_MAX;
+      c->c_q_count--;
+    }
+    if (c->c_wb != NULL)
+      free(c->c_wb);
+    if (c->c_deflate != NULL){
+      deflateEnd(c->c_deflate);
+      free(c->c_deflate);
+    }
+    if (c->c_inflate != NULL){
+      inflateEnd(c->c_inflate);
+      free(c->c_inflate);
+    }
 
     free(c);
   }
@@ -130,6 +453,10 @@ void destroy_server_ws(struct ws_server *s)
     if (s->s_sb)
       free(s->s_sb);
 #endif
+    if (s->s_ib)
+      free(s->s_ib);
+    if (s->s_efd >= 0)
+      close(s->s_efd);
     free(s);
   }
 }
@@ -199,6 +526,48 @@ int register_signals_ws()
 }
 
 
+#ifdef KATCP_USE_EPOLL
+int setup_epoll_ws(struct ws_server *s)
+{
+  struct epoll_event ev;
+
+  s->s_efd = epoll_create(WS_EVENTS);
+  if (s->s_efd < 0){
+#ifdef DEBUG
+    fprintf(stderr,"wss: unable to create epoll instance: %s\n", strerror(errno));
+#endif
+    return -1;
+  }
+
+  /* listener and broadcast input stay level triggered, clients are edge triggered */
+  ev.events   = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(s->s_efd, EPOLL_CTL_ADD, s->s_fd, &ev) < 0){
+#ifdef DEBUG
+    fprintf(stderr,"wss: unable to watch listener: %s\n", strerror(errno));
+#endif
+    return -1;
+  }
+
+  if (s->s_bfd >= 0){
+    ev.events   = EPOLLIN;
+    ev.data.ptr = s;
+    if (epoll_ctl(s->s_efd, EPOLL_CTL_ADD, s->s_bfd, &ev) < 0){
+      if (errno != EPERM){
+#ifdef DEBUG
+        fprintf(stderr,"wss: unable to watch broadcast input: %s\n", strerror(errno));
+#endif
+        return -1;
+      }
+      /* plain files can not be polled, they are always ready */
+      s->s_bpoll = 1;
+    }
+  }
+
+  return 0;
+}
+#endif
+
 int startup_server(struct ws_server *s, char *port)
 {
   struct addrinfo hints;
@@ -267,6 +636,14 @@ int startup_server(struct ws_server *s, char *port)
 
   s->s_hi = s->s_fd;
 
+  /* a burst of reconnects is accepted in one go, so never block in accept */
+  fcntl(s->s_fd, F_SETFL, fcntl(s->s_fd, F_GETFL, 0) | O_NONBLOCK);
+
+#ifdef KATCP_USE_EPOLL
+  if (setup_epoll_ws(s) < 0)
+    return -1;
+#endif
+
 #ifdef DEBUG
   fprintf(stderr,"wss: server pid: %d running on port: %s\n", getpid(), port);
 #endif
@@ -274,6 +651,35 @@ int startup_server(struct ws_server *s, char *port)
   return 0;
 }
 
+int handshake_client_ws(struct ws_client *c)
+{
+  int rtn;
+
+  rtn = SSL_accept(c->c_ssl);
+  if (rtn == 1){
+    c->c_state   = C_STATE_NEW;
+    c->c_blocked = 0;
+#ifdef DEBUG
+    fprintf(stderr, "wss: [%d] tls handshake complete%s\n", c->c_fd, SSL_session_reused(c->c_ssl) ? " (resumed session)" : "");
+#endif
+    return 1;
+  }
+
+  switch (SSL_get_error(c->c_ssl, rtn)){
+    case SSL_ERROR_WANT_WRITE:
+      c->c_blocked = 1;
+      return 0;
+    case SSL_ERROR_WANT_READ:
+      return 0;
+  }
+
+#ifdef DEBUG
+  fprintf(stderr, "wss: [%d] tls handshake failed: %s\n", c->c_fd, ERR_error_string(ERR_get_error(), NULL));
+#endif
+
+  return -1;
+}
+
 int handle_new_client_ws(struct ws_server *s)
 {
   struct sockaddr_in ca;
@@ -281,43 +687,76 @@ int handle_new_client_ws(struct ws_server *s)
   struct ws_client *c;
   int cfd;
   SSL *ssl;
+#ifdef KATCP_USE_EPOLL
+  struct epoll_event ev;
+#endif
 
   if (s == NULL)
     return -1;
 
-  len = sizeof(struct sockaddr_in);
+  for (;;){
+    len = sizeof(struct sockaddr_in);
 
-  cfd = accept(s->s_fd, (struct sockaddr *) &ca, &len);
-  if (cfd < 0) { 
+    cfd = accept(s->s_fd, (struct sockaddr *) &ca, &len);
+    if (cfd < 0) { 
+      switch (errno){
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+        case EINTR:
+          return 0;
+      }
 #ifdef DEBUG
-    fprintf(stderr,"wss: error in accept new client: %s\n", strerror(errno)); 
+      fprintf(stderr,"wss: error in accept new client: %s\n", strerror(errno)); 
 #endif
-    return -1; 
-  }
+      return -1; 
+    }
+
+    /* the tls handshake is driven by the event loop, not waited for here */
+    fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL, 0) | O_NONBLOCK);
   
-  ssl = SSL_new(s->s_tlsctx);
-  if (ssl == NULL){ 
+    ssl = SSL_new(s->s_tlsctx);
+    if (ssl == NULL){ 
 #ifdef DEBUG
-    fprintf(stderr, "wss: SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+      fprintf(stderr, "wss: SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
 #endif
-    return -1;
-  }
+      close(cfd);
+      return -1;
+    }
 
 #ifdef DEBUG
-  fprintf(stderr, "wss: client fd: %d ssl (%p)\n",cfd ,ssl); 
+    fprintf(stderr, "wss: client fd: %d ssl (%p)\n",cfd ,ssl); 
 #endif
 
-  SSL_set_fd(ssl, cfd);
+    SSL_set_fd(ssl, cfd);
 
-  SSL_accept(ssl);
+    c = create_client_ws(cfd, ssl);
+    if (c == NULL){
+      SSL_free(ssl);
+      close(cfd);
+      return -1;
+    }
 
-  c = create_client_ws(cfd, ssl);
-  if (c == NULL)
-    return -1;
+    c->c_state = C_STATE_HANDSHAKE;
 
-  if (add_new_client_ws(s, c) < 0){
-    destroy_client_ws(c);
-    return -1;
+    if (add_new_client_ws(s, c) < 0){
+      close(cfd);
+      destroy_client_ws(c);
+      return -1;
+    }
+
+#ifdef KATCP_USE_EPOLL
+    ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(s->s_efd, EPOLL_CTL_ADD, cfd, &ev) < 0){
+#ifdef DEBUG
+      fprintf(stderr, "wss: unable to watch client: %s\n", strerror(errno));
+#endif
+      disconnect_client_ws(s, c);
+      continue;
+    }
+#endif
   }
 
   return 0;  
@@ -609,6 +1048,7 @@ void dropdata_client_ws(struct ws_client *c)
   }
 }
 
+/* returns 1 if the client has gone away and must not be touched again */
 int get_client_data_ws(struct ws_server *s, struct ws_client *c)
 {
   unsigned char readbuffer[READBUFFERSIZE];
@@ -617,31 +1057,44 @@ int get_client_data_ws(struct ws_server *s, struct ws_client *c)
   if (s == NULL || c == NULL)
     return -1;
 
-  memset(readbuffer, 0, READBUFFERSIZE);
-#if 0
-  recv_bytes = read(c->c_fd, readbuffer, READBUFFERSIZE);
-#endif
-
-  recv_bytes = SSL_read(c->c_ssl, readbuffer, READBUFFERSIZE);
+  if (c->c_state == C_STATE_HANDSHAKE){
+    rtn = handshake_client_ws(c);
+    if (rtn < 0){
+      disconnect_client_ws(s, c);
+      return 1;
+    }
+    if (rtn == 0)
+      return 0;
+  }
 
-  s->s_br_count += recv_bytes;
-  
-  if (recv_bytes < 0){
-#if 0
-    def DEBUG
-    fprintf(stderr, "wss: read error %s\n", strerror(errno)); 
-#endif
+  /* drain the socket, edge triggered readiness is not repeated */
+  for (;;){
+    memset(readbuffer, 0, READBUFFERSIZE);
+
+    recv_bytes = SSL_read(c->c_ssl, readbuffer, READBUFFERSIZE);
+    if (recv_bytes <= 0){
+      switch (SSL_get_error(c->c_ssl, recv_bytes)){
+        case SSL_ERROR_WANT_READ:
+          return 0;
+        case SSL_ERROR_WANT_WRITE:
+          c->c_blocked = 1;
+          return 0;
+        case SSL_ERROR_ZERO_RETURN:
 #ifdef DEBUG
-    fprintf(stderr, "wss: read_error SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
+          fprintf(stderr,"wss: client is leaving\n");
 #endif
-
-    return disconnect_client_ws(s, c);
-  } else if (recv_bytes == 0){
+          break;
+        default:
 #ifdef DEBUG
-    fprintf(stderr,"wss: client is leaving\n");
+          fprintf(stderr, "wss: read_error SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
 #endif
-    return disconnect_client_ws(s, c);
-  } else {
+          break;
+      }
+      disconnect_client_ws(s, c);
+      return 1;
+    }
+
+    s->s_br_count += recv_bytes;
     
     if (populate_client_data_ws(c, readbuffer, recv_bytes) < 0){
 #ifdef DEBUG
@@ -651,10 +1104,65 @@ int get_client_data_ws(struct ws_server *s, struct ws_client *c)
     }
 
     rtn = (*(s->s_cdfn))(c);
+
+    if (c->c_flags & WS_CLIENT_CLOSING){
+      /* give the close frame a chance to go out, then drop the client */
+      send_client_data_ws(s, c);
+      disconnect_client_ws(s, c);
+      return 1;
+    }
     
     if (rtn < 0)
       return -1;
+  }
+
+  return 0;
+}
+
+/* pack as many queued frames as fit into one tls record, rather than
+ * paying for a record and a syscall per small frame */
+int stage_client_ws(struct ws_client *c)
+{
+  struct ws_buffer *b, *d;
+  unsigned int n;
 
+  if (c->c_wb == NULL){
+    c->c_wb = malloc(WS_RECORD_SIZE);
+    if (c->c_wb == NULL)
+      return -1;
+  }
+
+  c->c_wb_len  = 0;
+  c->c_wb_done = 0;
+
+  while (c->c_q_count > 0 && c->c_wb_len < WS_RECORD_SIZE){
+    b = c->c_q[c->c_q_head];
+
+    /* swap the shared frame for a private compressed one just before it goes out */
+    if ((c->c_flags & WS_CLIENT_DEFLATE) && c->c_q_done == 0){
+      d = deflate_buffer_ws(c, b);
+      if (d == NULL)
+        return -1;
+      d->b_refs++;
+      c->c_q[c->c_q_head] = d;
+      release_buffer_ws(b);
+      b = d;
+    }
+
+    n = b->b_len - c->c_q_done;
+    if (n > WS_RECORD_SIZE - c->c_wb_len)
+      n = WS_RECORD_SIZE - c->c_wb_len;
+
+    memcpy(c->c_wb + c->c_wb_len, b->b_data + c->c_q_done, n);
+    c->c_wb_len += n;
+    c->c_q_done += n;
+
+    if (c->c_q_done >= b->b_len){
+      release_buffer_ws(b);
+      c->c_q_head = (c->c_q_head + 1) % WS_QUEUE_MAX;
+      c->c_q_count--;
+      c->c_q_done = 0;
+    }
   }
 
   return 0;
@@ -666,35 +1174,226 @@ int send_client_data_ws(struct ws_server *s, struct ws_client *c)
 
   if (s == NULL || c == NULL)
     return -1;
-  
-  b_wrote = SSL_write(c->c_ssl, c->c_sb, c->c_sb_len);
+
+  if (c->c_state == C_STATE_HANDSHAKE)
+    return (handshake_client_ws(c) < 0) ? -1 : 0;
+
+  c->c_blocked = 0;
+
+  for (;;){
+    /* direct writes (handshake, control replies) go ahead of queued
+     * broadcasts, but never into the middle of a frame */
+    if (c->c_sb_len > 0 && c->c_wb_done >= c->c_wb_len && c->c_q_done == 0){
+      b_wrote = SSL_write(c->c_ssl, c->c_sb, c->c_sb_len);
 
 #ifdef DEBUG
-  fprintf(stderr, "wss: [%d] b_wrote:%d c_sb_len:%d\n", c->c_fd, b_wrote, c->c_sb_len);
+      fprintf(stderr, "wss: [%d] b_wrote:%d c_sb_len:%d\n", c->c_fd, b_wrote, c->c_sb_len);
 #endif
 
-  if (b_wrote <= 0){
+      if (b_wrote == c->c_sb_len){
+        c->c_sb_len = 0;
+      } else if (b_wrote > 0) {
+        c->c_sb_len -= b_wrote;
+    
+        memmove(c->c_sb, c->c_sb + b_wrote, c->c_sb_len);
+
+        c->c_sb = realloc(c->c_sb, c->c_sb_len);
+        if (c->c_sb == NULL)
+          return -1;
+      }
+    } else {
+      /* a staged record has to be retried unchanged until it is out */
+      if (c->c_wb_done >= c->c_wb_len){
+        if (stage_client_ws(c) < 0)
+          return -1;
+        if (c->c_wb_len <= 0)
+          return 0;
+      }
+
+      b_wrote = SSL_write(c->c_ssl, c->c_wb + c->c_wb_done, c->c_wb_len - c->c_wb_done);
+      if (b_wrote > 0)
+        c->c_wb_done += b_wrote;
+    }
+
+    if (b_wrote <= 0){
+      switch (SSL_get_error(c->c_ssl, b_wrote)){
+        case SSL_ERROR_WANT_WRITE:
+        case SSL_ERROR_WANT_READ:
+          c->c_blocked = 1;
+          return 0;
+      }
 #ifdef DEBUG
-    fprintf(stderr, "wss: error ssl_write < 0\n");
+      fprintf(stderr, "wss: error ssl_write < 0\n");
 #endif
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int pending_client_ws(struct ws_client *c)
+{
+  return (c->c_sb_len > 0) || (c->c_q_count > 0) || (c->c_wb_done < c->c_wb_len);
+}
+
+/* after a batch of broadcasts push out whatever the sockets will take */
+void flush_clients_ws(struct ws_server *s)
+{
+  struct ws_client *c;
+  int i;
+
+  for (i=0; i<s->s_c_count; i++){
+    c = s->s_c[i];
+    if (c == NULL || c->c_state != C_STATE_UPGRADED || c->c_blocked || !pending_client_ws(c))
+      continue;
+
+    /* failures are left for the client's own socket events to report */
+    if (send_client_data_ws(s, c) < 0)
+      c->c_blocked = 1;
+  }
+}
+
+int broadcast_ws(struct ws_server *s, void *buf, int n)
+{
+  struct ws_buffer *b, *e, *q;
+  struct ws_client *c;
+  unsigned char bin[READBUFFERSIZE];
+  void *key;
+  int klen, i, len, tried;
+
+  if (s == NULL || buf == NULL)
     return -1;
-  } else if (b_wrote == c->c_sb_len){
 
-    c->c_sb_len = 0;
+  key  = NULL;
+  klen = 0;
 
-  } else if (b_wrote < c->c_sb_len) {
-    c->c_sb_len -= b_wrote;
-    
-    memmove(c->c_sb, c->c_sb + b_wrote, c->c_sb_len);
+  if (s->s_bkfn != NULL){
+    klen = (*(s->s_bkfn))(buf, n, &key);
+    if (klen <= 0)
+      key = NULL;
+  }
 
-    c->c_sb = realloc(c->c_sb, c->c_sb_len);
-    if (c->c_sb == NULL)
-      return -1;
+  b = create_buffer_ws(WSF_OP_TEXT, buf, n, key, klen);
+  if (b == NULL)
+    return -1;
+
+  /* hold a reference of our own while handing it out */
+  b->b_refs++;
+
+  e = NULL;
+  tried = 0;
+
+  for (i=0; i<s->s_c_count; i++){
+    c = s->s_c[i];
+    if (c != NULL && c->c_state == C_STATE_UPGRADED){
+      q = b;
+
+      /* the binary form is also only built once, and only if somebody wants it */
+      if ((c->c_flags & WS_CLIENT_BINARY) && s->s_benc != NULL){
+        if (!tried){
+          tried = 1;
+          len = (*(s->s_benc))(buf, n, bin, sizeof(bin));
+          if (len > 0){
+            e = create_buffer_ws(WSF_OP_BINARY, bin, len, key, klen);
+            if (e != NULL)
+              e->b_refs++;
+          }
+        }
+        if (e != NULL)
+          q = e;
+      }
+
+      /* only drop frames for clients which really can not keep up */
+      if (c->c_q_count >= WS_QUEUE_MAX && !c->c_blocked){
+        if (send_client_data_ws(s, c) < 0)
+          c->c_blocked = 1;
+      }
+      if (queue_client_ws(c, q) < 0){
+#ifdef DEBUG
+        fprintf(stderr, "wss: [%d] unable to queue broadcast\n", c->c_fd);
+#endif
+      }
+    }
   }
-  
+
+  s->s_bc_count++;
+
+  release_buffer_ws(b);
+  if (e != NULL)
+    release_buffer_ws(e);
+
   return 0;
 }
 
+void stop_broadcast_ws(struct ws_server *s)
+{
+#ifdef KATCP_USE_EPOLL
+  struct epoll_event ev;
+
+  if (s->s_efd >= 0 && !s->s_bpoll)
+    epoll_ctl(s->s_efd, EPOLL_CTL_DEL, s->s_bfd, &ev);
+#endif
+
+  s->s_bfd   = (-1);
+  s->s_bpoll = 0;
+}
+
+int get_server_broadcast_ws(struct ws_server *s)
+{
+  char *ptr, *line, *end;
+  int rb, len;
+
+  if (s == NULL)
+    return -1;
+
+  ptr = realloc(s->s_ib, s->s_ib_len + READBUFFERSIZE);
+  if (ptr == NULL)
+    return -1;
+  s->s_ib = ptr;
+
+  rb = read(s->s_bfd, ptr + s->s_ib_len, READBUFFERSIZE);
+  if (rb < 0){
+    switch(errno){
+      case EINTR:
+      case EAGAIN:
+        return 0;
+    }
+#ifdef DEBUG
+    fprintf(stderr, "wss: broadcast read error: %s\n", strerror(errno));
+#endif
+    stop_broadcast_ws(s);
+    return -1;
+  } else if (rb == 0){
+#ifdef DEBUG
+    fprintf(stderr, "wss: end of broadcast input\n");
+#endif
+    stop_broadcast_ws(s);
+    return 0;
+  }
+
+  s->s_ib_len += rb;
+
+  /* every complete line becomes one text frame */
+  line = ptr;
+  end  = ptr + s->s_ib_len;
+  while ((ptr = memchr(line, '\n', end - line)) != NULL){
+    len = ptr - line;
+    if (len > 0 && line[len - 1] == '\r')
+      len--;
+    if (len > 0)
+      broadcast_ws(s, line, len);
+    line = ptr + 1;
+  }
+
+  s->s_ib_len = end - line;
+  if (s->s_ib_len > 0)
+    memmove(s->s_ib, line, s->s_ib_len);
+
+  flush_clients_ws(s);
+
+  return 0;
+}
 
 int socks_io_ws(struct ws_server *s) 
 {
@@ -716,6 +1415,14 @@ int socks_io_ws(struct ws_server *s)
     }
   }
 
+  if (s->s_bfd >= 0 && FD_ISSET(s->s_bfd, &s->s_in)) {
+    if (get_server_broadcast_ws(s) < 0){
+#ifdef DEBUG
+      fprintf(stderr,"wss: error reading broadcast input\n");
+#endif
+    }
+  }
+
   for (i=0; i<s->s_c_count; i++){
     c = s->s_c[i];
     if (c != NULL){
@@ -754,7 +1461,12 @@ void build_socket_set_ws(struct ws_server *s)
   FD_ZERO(&s->s_out);
   FD_SET(s->s_fd, &s->s_in);
   
-  //FD_SET(STDIN_FILENO, &s->insocks);
+  if (s->s_bfd >= 0){
+    FD_SET(s->s_bfd, &s->s_in);
+    if (s->s_bfd > s->s_hi)
+      s->s_hi = s->s_bfd;
+  }
+
   for (i=0; i<s->s_c_count; i++){
     
     c = s->s_c[i];
@@ -769,9 +1481,9 @@ void build_socket_set_ws(struct ws_server *s)
         if (fd > s->s_hi)
           s->s_hi = fd;
         
-        if (c->c_sb_len > 0){
+        if (pending_client_ws(c) || (c->c_state == C_STATE_HANDSHAKE && c->c_blocked)){
 #ifdef DEBUG
-          fprintf(stderr, "wss: must send to [%d] %dbytes\n", c->c_fd, c->c_sb_len);
+          fprintf(stderr, "wss: must send to [%d] %dbytes %u frames\n", c->c_fd, c->c_sb_len, c->c_q_count);
 #endif
           FD_SET(fd, &s->s_out);
         }
@@ -781,6 +1493,80 @@ void build_socket_set_ws(struct ws_server *s)
   }
 }
 
+#ifdef KATCP_USE_EPOLL
+int event_client_ws(struct ws_server *s, struct ws_client *c, uint32_t events)
+{
+  int rtn;
+
+  if (events & EPOLLOUT)
+    c->c_blocked = 0;
+
+  if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) || (c->c_state == C_STATE_HANDSHAKE)){
+    rtn = get_client_data_ws(s, c);
+    if (rtn != 0)
+      return rtn;
+  }
+
+  if (c->c_blocked || !pending_client_ws(c))
+    return 0;
+
+  if (send_client_data_ws(s, c) < 0){
+#ifdef DEBUG
+    fprintf(stderr, "wss: send client data error\n");
+#endif
+    disconnect_client_ws(s, c);
+    return 1;
+  }
+
+  return 0;
+}
+
+int run_loop_ws(struct ws_server *s)
+{
+  struct epoll_event events[WS_EVENTS];
+  sigset_t empty_mask;
+  int i, count;
+
+  sigemptyset(&empty_mask);
+
+  while (run) {
+
+    count = epoll_pwait(s->s_efd, events, WS_EVENTS, s->s_bpoll ? 0 : -1, &empty_mask);
+    if (count < 0){
+      switch(errno){
+        case EINTR:
+        case EAGAIN:
+          continue;
+        default:
+#ifdef DEBUG
+          fprintf(stderr,"wss: epoll wait encountered an error: %s\n", strerror(errno)); 
+#endif
+          return -1;
+      }
+    }
+
+    /* one event per descriptor per wait, so a client freed here is not seen again */
+    for (i=0; i<count; i++){
+      if (events[i].data.ptr == NULL){
+        if (handle_new_client_ws(s) < 0){
+#ifdef DEBUG
+          fprintf(stderr,"wss: error handle new client\n");
+#endif
+        }
+      } else if (events[i].data.ptr == s){
+        get_server_broadcast_ws(s);
+      } else {
+        event_client_ws(s, events[i].data.ptr, events[i].events);
+      }
+    }
+
+    if (s->s_bpoll)
+      get_server_broadcast_ws(s);
+  }
+
+  return 0;
+}
+#else
 int run_loop_ws(struct ws_server *s)
 {
   sigset_t empty_mask;
@@ -820,6 +1606,7 @@ int run_loop_ws(struct ws_server *s)
 
   return 0;
 }
+#endif
 
 int setup_tls_ws(struct ws_server *s)
 {
@@ -839,7 +1626,7 @@ int setup_tls_ws(struct ws_server *s)
   }
 */
 
-  tlsctx = SSL_CTX_new(TLSv1_server_method());
+  tlsctx = SSL_CTX_new(SSLv23_server_method());
   if (tlsctx == NULL){
 #ifdef DEBUG
     fprintf(stderr, "wss: SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
@@ -851,7 +1638,9 @@ int setup_tls_ws(struct ws_server *s)
   fprintf(stderr, "wss: tlsctx (%p)\n", tlsctx);
 #endif
 
-  SSL_CTX_set_options(tlsctx, SSL_OP_SINGLE_DH_USE);
+  SSL_CTX_set_options(tlsctx, SSL_OP_SINGLE_DH_USE | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+  /* shared frames stay put, but c_sb moves when it grows */
+  SSL_CTX_set_mode(tlsctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 /*  if (ERR_peek_error() != 0){
 #ifdef DEBUG
     fprintf(stderr, "wss: SSL error: %s\n", ERR_error_string(ERR_get_error(), NULL));
@@ -875,14 +1664,18 @@ int setup_tls_ws(struct ws_server *s)
     return -1;
   }
 
-  //SSL_CTX_set_session_cache_mode(tlsctx, SSL_SESS_CACHE_OFF);
+  /* browsers refreshing en masse resume sessions (by id or ticket) instead of a full handshake each */
+  SSL_CTX_set_session_id_context(tlsctx, (unsigned char *) WS_SESSION_CONTEXT, strlen(WS_SESSION_CONTEXT));
+  SSL_CTX_set_session_cache_mode(tlsctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(tlsctx, WS_SESSION_CACHE);
+  SSL_CTX_set_timeout(tlsctx, WS_SESSION_TIMEOUT);
   
   s->s_tlsctx = tlsctx;
 
   return 0;
 }
 
-int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), char *port)
+int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), int (*broadcast_key_fn)(void *line, int n, void **key), int (*binary_fn)(void *line, int n, void *out, int size), char *port)
 {
   struct ws_server *s;
   
@@ -893,7 +1686,7 @@ int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), c
     return -1;
   }
 
-  s = create_server_ws(client_data_fn);
+  s = create_server_ws(client_data_fn, broadcast_key_fn);
   if (s == NULL){
 #ifdef DEBUG
     fprintf(stderr, "wss: error could not create server\n");
@@ -901,6 +1694,8 @@ int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), c
     return -1;
   }
 
+  s->s_benc = binary_fn;
+
   if (setup_tls_ws(s) < 0){
 #ifdef DEBUG
     fprintf(stderr,"wss: error in tls setup\n");
@@ -9,14 +9,51 @@
 
 #define C_STATE_NEW       0
 #define C_STATE_UPGRADED  1
+#define C_STATE_HANDSHAKE 2
 
 #define WSF_FIN         0x80
+#define WSF_RSV1        0x40
 #define WSF_OPCODE      0x0f
 #define WSF_MASK        0x80
 #define WSF_PAYLOAD     0x7f
 #define WSF_PAYLOAD_16  0x7e
 #define WSF_PAYLOAD_64  0x7f
 
+#define WSF_OP_CONT     0x00
+#define WSF_OP_TEXT     0x01
+#define WSF_OP_BINARY   0x02
+#define WSF_OP_CLOSE    0x08
+#define WSF_OP_PING     0x09
+#define WSF_OP_PONG     0x0a
+
+#define WS_CLIENT_DEFLATE       0x01
+#define WS_CLIENT_DEFLATE_RESET 0x02
+#define WS_CLIENT_BINARY        0x04
+#define WS_CLIENT_CLOSING       0x08
+
+#define WS_MESSAGE_MAX    (1024 * 1024)
+#define WS_CLOSE_TOO_BIG  1009
+
+#define WS_QUEUE_MAX      64
+#define WS_RECORD_SIZE    16384
+#define WS_EVENTS         64
+
+#define WS_SESSION_CONTEXT "wss"
+#define WS_SESSION_CACHE   1024
+#define WS_SESSION_TIMEOUT 600
+
+/* a frame built once and shared by every client it is queued to */
+struct ws_buffer {
+  uint8_t *b_data;
+  unsigned int b_len;
+  unsigned int b_hlen;
+
+  void *b_key;
+  int b_key_len;
+
+  int b_refs;
+};
+
 struct ws_frame {
   uint8_t hdr[2];
   uint8_t msk[4];
@@ -39,6 +76,21 @@ struct ws_client {
   void *c_sb;
   int c_sb_len;
 
+  struct ws_buffer *c_q[WS_QUEUE_MAX];
+  unsigned int c_q_head;
+  unsigned int c_q_count;
+  unsigned int c_q_done;
+  unsigned long c_q_dropped;
+
+  unsigned char *c_wb;
+  int c_wb_len;
+  int c_wb_done;
+  int c_blocked;
+
+  int c_flags;
+  void *c_deflate;
+  void *c_inflate;
+
   struct ws_frame *c_frame;
 };
 
@@ -56,6 +108,15 @@ struct ws_server {
   unsigned long long s_br_count;
 
   int (*s_cdfn)(struct ws_client *c);
+
+  int s_efd;
+  int s_bfd;
+  int s_bpoll;
+  void *s_ib;
+  int s_ib_len;
+  int (*s_bkfn)(void *line, int n, void **key);
+  int (*s_benc)(void *line, int n, void *out, int size);
+  unsigned long long s_bc_count;
   
   SSL_CTX *s_tlsctx;
 
@@ -68,13 +129,17 @@ struct ws_server {
 };
 
 
-int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), char *port);
+int register_client_handler_server(int (*client_data_fn)(struct ws_client *c), int (*broadcast_key_fn)(void *line, int n, void **key), int (*binary_fn)(void *line, int n, void *out, int size), char *port);
 
 unsigned char *readline_client_ws(struct ws_client *c);
 int readdata_client_ws(struct ws_client *c, void *dest, unsigned int n);
 void dropdata_client_ws(struct ws_client *c);
 
 int write_to_client_ws(struct ws_client *c, void *buf, int n);
+int broadcast_ws(struct ws_server *s, void *buf, int n);
+
+int enable_deflate_ws(struct ws_client *c, int bits, int reset);
+int inflate_client_ws(struct ws_client *c, void *in, int n, int max, void **out);
 
 int upgrade_client_ws(struct ws_client *c);
 
@@ -18,15 +18,24 @@
 
 #define WSSECKEY      "Sec-WebSocket-Key: "
 #define WSSECPROTO    "Sec-WebSocket-Protocol: "
+#define WSSECEXT      "Sec-WebSocket-Extensions: "
 #define WSPROTO       "katcp"
+#define WSPROTOBIN    "katcp-binary"
+#define WSDEFLATE     "permessage-deflate"
 #define WSGUID        "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
-#define SRVHDR        "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Protocol: katcp\r\nSec-WebSocket-Accept: "
+#define SRVHDR        "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Protocol: "
 
-int generate_upgrade_response_ws(struct ws_client *c, char *key)
+#define SENSOR_KIND_STATUS 1
+
+static char *sensor_status_table[] = { "unknown", "nominal", "warn", "error", "failure", "unreachable", "inactive", NULL };
+
+static int deflate_offer = 0;
+
+int generate_upgrade_response_ws(struct ws_client *c, char *key, char *proto, char *ext)
 {
   unsigned char   md_value[EVP_MAX_MD_SIZE];
   unsigned int    md_len;
-  EVP_MD_CTX      mdctx;
+  EVP_MD_CTX      *mdctx;
   BIO             *bmem, *b64;
   BUF_MEM         *bptr;
   char            skey[512], temp[100];
@@ -34,7 +43,7 @@ int generate_upgrade_response_ws(struct ws_client *c, char *key)
 
 //  char srvhdr[] = {  };
 
-  if (c == NULL || key == NULL)
+  if (c == NULL || key == NULL || proto == NULL)
     return -1;
   
   len = snprintf(skey, 512, "%s%s", key, WSGUID);
@@ -43,10 +52,14 @@ int generate_upgrade_response_ws(struct ws_client *c, char *key)
 
   bzero(temp, 100);
 
-  EVP_DigestInit(&mdctx, EVP_sha1());
-  EVP_DigestUpdate(&mdctx, skey, len);
-  EVP_DigestFinal_ex(&mdctx, md_value, &md_len);
-  EVP_MD_CTX_cleanup(&mdctx);
+  mdctx = EVP_MD_CTX_create();
+  if (mdctx == NULL)
+    return -1;
+
+  EVP_DigestInit(mdctx, EVP_sha1());
+  EVP_DigestUpdate(mdctx, skey, len);
+  EVP_DigestFinal_ex(mdctx, md_value, &md_len);
+  EVP_MD_CTX_destroy(mdctx);
   
   b64  = BIO_new(BIO_f_base64());
   if (b64 == NULL){
@@ -85,8 +98,8 @@ def DEBUG
   fprintf(stderr, "wss: server key: <%s> len: %d temp: <%s>\n", skey, len, temp); 
 #endif
 
-  len = snprintf(skey, 512, "%s%s\r\n\r\n", SRVHDR, temp);
-  if (len < 0)
+  len = snprintf(skey, 512, "%s%s\r\n%s%s%sSec-WebSocket-Accept: %s\r\n\r\n", SRVHDR, proto, ext ? WSSECEXT : "", ext ? ext : "", ext ? "\r\n" : "", temp);
+  if (len < 0 || len >= 512)
     return -1;
 
 #ifdef DEBUG
@@ -107,12 +120,88 @@ def DEBUG
   return 0;
 }
 
+static int token_ws(char *ptr, int len, char *name)
+{
+  return (len == strlen(name)) && (strncmp(ptr, name, len) == 0);
+}
+
+/* pick katcp-binary if offered, otherwise plain katcp */
+char *choose_protocol_ws(char *list)
+{
+  char *ptr;
+  int len, plain;
+
+  plain = 0;
+
+  for (ptr = list; *ptr != '\0'; ptr += len){
+    ptr += strspn(ptr, ", \t");
+    len  = strcspn(ptr, ", \t");
+
+    if (token_ws(ptr, len, WSPROTOBIN))
+      return WSPROTOBIN;
+    if (token_ws(ptr, len, WSPROTO))
+      plain = 1;
+  }
+
+  return plain ? WSPROTO : NULL;
+}
+
+/* only the first permessage-deflate offer is considered, declining it
+ * if it carries a parameter we can not honour */
+int negotiate_deflate_ws(char *offer, int *bits, int *reset)
+{
+  char *ptr, *end;
+  int len, value;
+
+  ptr = strstr(offer, WSDEFLATE);
+  if (ptr == NULL)
+    return 0;
+
+  end  = ptr + strcspn(ptr, ",");
+  ptr += strlen(WSDEFLATE);
+
+  *bits  = 15;
+  *reset = 0;
+
+  while (ptr < end){
+    ptr += strspn(ptr, "; \t");
+    if (ptr >= end)
+      break;
+
+    len = strcspn(ptr, "; \t,");
+
+    if (token_ws(ptr, len, "server_no_context_takeover")){
+      *reset = 1;
+    } else if (strncmp(ptr, "server_max_window_bits=", 23) == 0){
+      value = atoi(ptr + 23 + ((ptr[23] == '"') ? 1 : 0));
+      /* zlib can not do a window of 8 bits */
+      if (value < 9 || value > 15)
+        return 0;
+      *bits = value;
+    } else if (!token_ws(ptr, len, "client_no_context_takeover") && strncmp(ptr, "client_max_window_bits", 22)){
+#ifdef DEBUG
+      fprintf(stderr, "wss: declining deflate offer with parameter %.*s\n", len, ptr);
+#endif
+      return 0;
+    }
+
+    ptr += len;
+  }
+
+  return 1;
+}
+
 int parse_http_proto_ws(struct ws_client *c)
 {
-  char *line, *key, *proto;
+  char *line, *key, *proto, *offer, *chosen, *ext;
+  char extbuf[128];
+  int bits, reset, rtn;
 
   key   = NULL;
   proto = NULL;
+  offer = NULL;
+  ext   = NULL;
+  rtn   = (-1);
 
   while ((line = (char*)readline_client_ws(c)) != NULL){
 #ifdef DEBUG
@@ -122,181 +211,237 @@ int parse_http_proto_ws(struct ws_client *c)
       key = strdup(line + strlen(WSSECKEY));
     } else if (strstr((const char*)line, WSSECPROTO) != NULL) {
       proto = strdup(line + strlen(WSSECPROTO));
+    } else if ((offer == NULL) && (strstr((const char*)line, WSSECEXT) != NULL)) {
+      offer = strdup(line + strlen(WSSECEXT));
     }
   }
 
 #ifdef DEBUG 
-  fprintf(stderr, "wss: client PROTO: <%s> KEY <%s>\n", proto, key);
+  fprintf(stderr, "wss: client PROTO: <%s> KEY <%s> EXT <%s>\n", proto, key, offer);
 #endif
   
-  if (key != NULL && proto != NULL && strncmp(proto, WSPROTO, strlen(WSPROTO)) == 0){
-   
-   if (proto != NULL){
-     free(proto);
-     proto = NULL;
-   }
+  chosen = (proto != NULL) ? choose_protocol_ws(proto) : NULL;
+
+  if (key != NULL && chosen != NULL){
+
+    if (strcmp(chosen, WSPROTOBIN) == 0)
+      c->c_flags |= WS_CLIENT_BINARY;
+
+    /* we always ask for client_no_context_takeover, inflating is then stateless */
+    if (deflate_offer && offer != NULL && negotiate_deflate_ws(offer, &bits, &reset) > 0){
+      if (enable_deflate_ws(c, bits, reset) == 0){
+        snprintf(extbuf, sizeof(extbuf), "%s; client_no_context_takeover%s", WSDEFLATE, reset ? "; server_no_context_takeover" : "");
+        if (bits < 15)
+          snprintf(extbuf + strlen(extbuf), sizeof(extbuf) - strlen(extbuf), "; server_max_window_bits=%d", bits);
+        ext = extbuf;
+      }
+    }
 
-   if (generate_upgrade_response_ws(c, key) < 0){
+    if (generate_upgrade_response_ws(c, key, chosen, ext) < 0){
 #ifdef DEBUG
       fprintf(stderr, "wss: error unable to generate response for client %d\n", c->c_fd);
 #endif
-      if (key != NULL){
-        free(key);
-        key = NULL;
-      }
-      return -1;
-    }
-    
-    if (key != NULL) {
-      free(key);
-      key = NULL;
-    }
-    
-    if (upgrade_client_ws(c) < 0){
+    } else if (upgrade_client_ws(c) < 0){
 #ifdef DEBUG
       fprintf(stderr, "wss: client [%d] status not upgraded\n", c->c_fd);
 #endif
-      return -1;
-    }
+    } else {
 #ifdef DEBUG
-    fprintf(stderr, "wss: client [%d] status upgraded\n", c->c_fd);
+      fprintf(stderr, "wss: client [%d] status upgraded protocol %s%s\n", c->c_fd, chosen, ext ? " with deflate" : "");
 #endif
+      rtn = 0;
+    }
   } else {
 #ifdef DEBUG
     fprintf(stderr, "wss: error websocket protocol mismatch\n");
 #endif
-    if (proto != NULL){
-      free(proto);
-      proto = NULL;
-    }
-    if (key != NULL){
-      free(key);
-      key = NULL;
-    }
-    return -1;
   }
 
-  if (proto != NULL){
+  if (proto != NULL)
     free(proto);
-    proto = NULL;
-  }
-  if (key != NULL){
+  if (key != NULL)
     free(key);
-    key = NULL;
-  }
+  if (offer != NULL)
+    free(offer);
    
-  return 0;
+  return rtn;
 }
 
-int parse_websocket_proto_ws(struct ws_client *c)
+/* one websocket message is one katcp message, and one line on stdout */
+void emit_message_ws(unsigned char *msg, int len)
 {
-  int i, len, opcode, shift;
-  uint8_t hdr[2];
-  uint8_t msk[4];
-  uint64_t payload;
-  unsigned char *data;
+  while (len > 0 && (msg[len - 1] == '\n' || msg[len - 1] == '\r'))
+    len--;
 
-  if (c == NULL || c->c_rb == NULL)
-    return -1;
-  
-  shift = 0;
-  len = sizeof(hdr);
-  //hdr = *((uint8_t *) readdata_client_ws(c, len));
-  if (readdata_client_ws(c, &hdr, len) < 0){
-#ifdef DEBUG
-    fprintf(stderr, "wss: error readdata\n");
-#endif
-    return -1;
-  }
+  if (len <= 0)
+    return;
 
+  if (msg[0] != '?' && msg[0] != '#' && msg[0] != '!'){
 #ifdef DEBUG
-  fprintf(stderr, "wss: HDR: 0x%x\n", (uint16_t)*hdr);
+    fprintf(stderr, "wss: dropping message which is not katcp\n");
 #endif
+    return;
+  }
 
-  if (hdr[0] & WSF_FIN){
+  if (memchr(msg, '\n', len) != NULL){
 #ifdef DEBUG
-    fprintf(stderr, "wss: FIN SET\n");
+    fprintf(stderr, "wss: dropping message spanning several lines\n");
 #endif
+    return;
   }
-  
-  opcode = hdr[0] & WSF_OPCODE;
 
-#if 0 
-def DEBUG
-  fprintf(stderr, "wss: HDR: 0x%0x\n", hdr[1]);
-#endif
+  fwrite(msg, 1, len, stdout);
+  fputc('\n', stdout);
+  fflush(stdout);
+}
 
-  if (hdr[1] & WSF_MASK){
-#ifdef DEBUG
-    fprintf(stderr, "wss: MASK SET\n");
-#endif
-  }
+int reply_control_ws(struct ws_client *c, int opcode, unsigned char *payload, int len)
+{
+  unsigned char frame[2 + WSF_PAYLOAD_16];
 
-  payload = hdr[1] & WSF_PAYLOAD;
-   
-#if 1
-  switch (payload){
-    case WSF_PAYLOAD_16:
-#ifdef DEBUG
-      fprintf(stderr, "wss: Extended Payload is 16bits\n");
-#endif
-      //payload = ntohs(*((uint16_t *) readdata_client_ws(c, sizeof(uint16_t))));    
-      if (readdata_client_ws(c, &payload, sizeof(uint16_t)) < 0){
+  /* control frames are never longer than 125 bytes */
+  if (len > WSF_PAYLOAD_16 - 1)
+    len = WSF_PAYLOAD_16 - 1;
+
+  frame[0] = WSF_FIN | opcode;
+  frame[1] = len;
+  if (len > 0)
+    memcpy(frame + 2, payload, len);
+
+  return write_to_client_ws(c, frame, len + 2);
+}
+
+/* close with 1009, the connection is dropped once the frame is out */
+static int too_big_client_ws(struct ws_client *c)
+{
+  unsigned char status[2];
+
+  status[0] = (WS_CLOSE_TOO_BIG >> 8) & 0xff;
+  status[1] = WS_CLOSE_TOO_BIG & 0xff;
+
+  dropdata_client_ws(c);
+  reply_control_ws(c, WSF_OP_CLOSE, status, 2);
+  c->c_flags |= WS_CLIENT_CLOSING;
+
+  return -1;
+}
+
+int parse_websocket_proto_ws(struct ws_client *c)
+{
+  unsigned char *data, *msg, *msk;
+  uint64_t payload;
+  int i, hlen, have, opcode, len;
+  void *inflated;
+
+  if (c == NULL || c->c_rb == NULL)
+    return -1;
+
+  data = c->c_rb;
+  have = c->c_rb_len;
+
+  /* a read may hold several frames, or only part of one */
+  while (have >= 2){
+
+    opcode  = data[0] & WSF_OPCODE;
+    payload = data[1] & WSF_PAYLOAD;
+
+    hlen = 2;
+    if (payload == WSF_PAYLOAD_16)
+      hlen += 2;
+    else if (payload == WSF_PAYLOAD_64)
+      hlen += 8;
+
+    if (!(data[1] & WSF_MASK)){
 #ifdef DEBUG
-        fprintf(stderr, "wss: error readdata\n");
+      fprintf(stderr, "wss: client frame not masked\n");
 #endif
-        return -1;
-      }
-      payload = ntohs(payload);
+      dropdata_client_ws(c);
+      return -1;
+    }
+    hlen += 4;
+
+    if (have < hlen)
       break;
 
-    case WSF_PAYLOAD_64:
-#ifdef DEBUG
-      fprintf(stderr, "wss: Extended Payload is 64bits\n");
-#endif
-      //payload = be64toh(*((uint64_t *) readdata_client_ws(c, sizeof(uint64_t))));    
-      if (readdata_client_ws(c, &payload, sizeof(uint64_t)) < 0){
+    if (payload == WSF_PAYLOAD_16){
+      payload = (data[2] << 8) | data[3];
+    } else if (payload == WSF_PAYLOAD_64){
+      payload = 0;
+      for (i=0; i<8; i++)
+        payload = (payload << 8) | data[2 + i];
+    }
+
+    if (payload > WS_MESSAGE_MAX){
 #ifdef DEBUG
-        fprintf(stderr, "wss: error readdata\n");
+      fprintf(stderr, "wss: client frame of %llu bytes too large\n", (unsigned long long) payload);
 #endif
-        return -1;
-      }
-      payload = be64toh(payload);
+      return too_big_client_ws(c);
+    }
+
+    if (have < hlen + payload)
       break;
-  }
-#endif 
 
-#if 0
-  len = sizeof(uint8_t);
-  msk[0] = *((uint8_t *) readdata_client_ws(c, len));
-  msk[1] = *((uint8_t *) readdata_client_ws(c, len));
-  msk[2] = *((uint8_t *) readdata_client_ws(c, len));
-  msk[3] = *((uint8_t *) readdata_client_ws(c, len));
-#endif
+    msk = data + hlen - 4;
+    msg = data + hlen;
+    for (i=0; i<payload; i++)
+      msg[i] ^= msk[i % 4];
 
-  if (readdata_client_ws(c, msk, sizeof(msk)) < 0){
 #ifdef DEBUG
-    fprintf(stderr, "wss: error readdata\n");
+    fprintf(stderr, "wss: OPCODE 0x%x PAYLOAD: %llu\n", opcode, (unsigned long long) payload);
 #endif
-    return -1;
-  }
 
+    switch (opcode){
+      case WSF_OP_TEXT:
+      case WSF_OP_BINARY:
+        if (!(data[0] & WSF_FIN)){
 #ifdef DEBUG
-  fprintf(stderr, "wss: OPCODE 0x%x PAYLOAD: 0x%x MASKKEY: 0x%x\n", opcode, payload, msk);
+          fprintf(stderr, "wss: fragmented messages not supported\n");
 #endif
-
-  data = (unsigned char *) c->c_rb;
-  for(i=0; i<c->c_rb_len; i++)
-    data[i] ^= msk[i % 4];
-    
+          break;
+        }
+        if ((data[0] & WSF_RSV1) && (c->c_flags & WS_CLIENT_DEFLATE)){
+          len = inflate_client_ws(c, msg, payload, WS_MESSAGE_MAX, &inflated);
+          if (len == -2){
 #ifdef DEBUG
-  for(i=0; i<c->c_rb_len; i++)
-    fprintf(stderr,"byte %d 0x%0x %c\n", i, data[i], data[i]);
+            fprintf(stderr, "wss: client message inflates past %d bytes\n", WS_MESSAGE_MAX);
 #endif
+            return too_big_client_ws(c);
+          }
+          if (len < 0){
+#ifdef DEBUG
+            fprintf(stderr, "wss: unable to inflate client message\n");
+#endif
+            dropdata_client_ws(c);
+            return -1;
+          }
+          emit_message_ws(inflated, len);
+          free(inflated);
+        } else {
+          emit_message_ws(msg, payload);
+        }
+        break;
+
+      case WSF_OP_PING:
+        reply_control_ws(c, WSF_OP_PONG, msg, payload);
+        break;
+
+      case WSF_OP_CLOSE:
+        /* echo the status code, the client then drops the connection */
+        reply_control_ws(c, WSF_OP_CLOSE, msg, (payload > 2) ? 2 : payload);
+        break;
+    }
 
-  fprintf(stdout, "%s\n", readline_client_ws(c));
+    data += hlen + payload;
+    have -= hlen + payload;
+  }
 
-  dropdata_client_ws(c);
+  /* keep a partial frame for the next read */
+  if (have > 0){
+    memmove(c->c_rb, data, have);
+    c->c_rb_len = have;
+  } else {
+    dropdata_client_ws(c);
+  }
 
   return 0;
 }
@@ -321,10 +466,177 @@ int capture_client_data_ws(struct ws_client *c)
   return -1;
 }
 
+/* sensor updates are keyed by sensor name, so a slow dashboard only
+ * ever sees the latest value instead of a backlog of stale ones */
+int sensor_key_ws(void *line, int n, void **key)
+{
+  char *ptr, *end, *start;
+  int field;
+
+  ptr = line;
+  end = ptr + n;
+
+  if ((n < 15) || strncmp(ptr, "#sensor-status ", 15))
+    return 0;
+
+  /* #sensor-status time count name status value */
+  field = 0;
+  start = ptr;
+  while (ptr < end){
+    if (*ptr == ' '){
+      if (field == 3)
+        break;
+      field++;
+      start = ptr + 1;
+    }
+    ptr++;
+  }
+
+  if (field != 3 || ptr <= start)
+    return 0;
+
+  *key = start;
+
+  return ptr - start;
+}
+
+/* compact form of a single #sensor-status update, for katcp-binary clients
+ *   byte  0     kind, SENSOR_KIND_STATUS
+ *   byte  1     status, numbered as in katcp (0 unknown .. 6 inactive)
+ *   bytes 2-9   timestamp in milliseconds, big endian
+ *   byte  10    length of the sensor name
+ *   then the name, followed by the value as text up to the end of the frame
+ * updates carrying several sensors go out as text */
+int sensor_binary_ws(void *line, int n, void *out, int size)
+{
+  char *field[6], *ptr, *end;
+  unsigned char *b;
+  unsigned long long stamp;
+  int count, len[6], i, status, vlen;
+
+  ptr = line;
+  end = ptr + n;
+
+  /* the value is whatever follows the status */
+  for (count = 0; count < 6 && ptr < end; count++){
+    field[count] = ptr;
+    if (count == 5){
+      len[count] = end - ptr;
+    } else {
+      while (ptr < end && *ptr != ' ')
+        ptr++;
+      len[count] = ptr - field[count];
+      ptr++;
+    }
+  }
+
+  if (count < 5 || !token_ws(field[0], len[0], "#sensor-status") || !token_ws(field[2], len[2], "1"))
+    return 0;
+
+  if (count == 5){
+    vlen = 0;
+  } else {
+    vlen = len[5];
+    if (memchr(field[5], ' ', vlen) != NULL)
+      return 0;
+  }
+
+  for (status = 0; sensor_status_table[status] != NULL; status++){
+    if (token_ws(field[4], len[4], sensor_status_table[status]))
+      break;
+  }
+  if (sensor_status_table[status] == NULL)
+    return 0;
+
+  if (len[3] > 255 || (11 + len[3] + vlen) > size)
+    return 0;
+
+  /* version 5 stamps are seconds with a fraction, older ones milliseconds */
+  if (memchr(field[1], '.', len[1]) != NULL || len[1] < 12)
+    stamp = strtod(field[1], NULL) * 1000.0;
+  else 
+    stamp = strtoull(field[1], NULL, 10);
+
+  b = out;
+  b[0] = SENSOR_KIND_STATUS;
+  b[1] = status;
+  for (i=0; i<8; i++)
+    b[2 + i] = (stamp >> (8 * (7 - i))) & 0xff;
+  b[10] = len[3];
+  memcpy(b + 11, field[3], len[3]);
+  if (vlen > 0)
+    memcpy(b + 11 + len[3], field[5], vlen);
+
+  return 11 + len[3] + vlen;
+}
+
+void usage_ws(char *app)
+{
+  printf("usage: %s [options]\n", app);
+  printf("-h          this help\n");
+  printf("-p port     listen on the given port (default %s)\n", PORT);
+  printf("-z          accept permessage-deflate from browsers which offer it\n");
+  printf("\n");
+  printf("lines read on stdin are broadcast, one katcp message per websocket message\n");
+  printf("messages from browsers are written to stdout, one per line\n");
+  printf("browsers asking for the %s subprotocol receive single sensor updates in binary\n", WSPROTOBIN);
+}
 
 int main(int argc, char *argv[]) 
 {
-  return register_client_handler_server(&capture_client_data_ws, PORT);
+  char *app, *port;
+  int i, j, c;
+
+  app  = argv[0];
+  port = PORT;
+  i = j = 1;
+
+  while (i < argc) {
+    if (argv[i][0] == '-') {
+      c = argv[i][j];
+      switch (c) {
+        case 'h' :
+          usage_ws(app);
+          return 0;
+
+        case 'z' :
+          deflate_offer = 1;
+          j++;
+          break;
+
+        case 'p' :
+          j++;
+          if (argv[i][j] == '\0') {
+            j = 0;
+            i++;
+          }
+          if (i >= argc) {
+            fprintf(stderr, "%s: argument needs a parameter\n", app);
+            return 2;
+          }
+          port = argv[i] + j;
+          i++;
+          j = 1;
+          break;
+
+        case '-' :
+          j++;
+          break;
+        case '\0':
+          j = 1;
+          i++;
+          break;
+        default:
+          fprintf(stderr, "%s: unknown option -%c\n", app, argv[i][j]);
+          return 2;
+      }
+    } else {
+      fprintf(stderr, "%s: unexpected argument %s\n", app, argv[i]);
+      return 2;
+    }
+  }
+
+  return register_client_handler_server(&capture_client_data_ws, &sensor_key_ws, &sensor_binary_ws, port);
 }
  
 
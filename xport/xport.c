@@ -46,6 +46,11 @@
 
 #define DEFAULT_TOTAL          300
 #define DEFAULT_TIMEOUT          3
+#define DEFAULT_CONCURRENT      32
+
+#define PHASE_QUEUED             0
+#define PHASE_RUNNING            1
+#define PHASE_DONE               2
 
 #define ADD_READ               0x1
 #define ADD_WRITE              0x2
@@ -80,10 +85,34 @@ struct state{
   unsigned int s_transition;
   unsigned int s_limit;
 
+  int s_phase;
+  int s_code;
+
   struct timeval s_single;
   struct timeval s_total;
 };
 
+/* a sweep runs the same table against many roaches at once, each
+ * roach has its own state and timeouts, but they share the upstream
+ * katcp line and a single select */
+
+struct sweep{
+  struct state **w_vector;
+  unsigned int w_count;
+
+  unsigned int w_next;
+  unsigned int w_active;
+  unsigned int w_limit;
+  unsigned int w_failed;
+
+  struct item *w_table;
+  unsigned int w_size;
+
+  int w_verbose;
+
+  struct katcl_line *w_up;
+};
+
 struct item{
   int (*i_call)(struct state *ss, int tag);
   unsigned int i_ok;
@@ -117,15 +146,13 @@ void destroy_state(struct state *ss)
     close(ss->s_fd);
   }
 
-  if(ss->s_up){
-    destroy_katcl(ss->s_up, 0);
-    ss->s_up = NULL;
-  }
+  /* upstream line belongs to the sweep */
+  ss->s_up = NULL;
 
   free(ss);
 }
 
-struct state *create_state(int fd)
+struct state *create_state(struct katcl_line *up)
 {
   struct state *ss;
 
@@ -156,13 +183,90 @@ struct state *create_state(int fd)
   ss->s_index = 0;
 
   ss->s_transition = ITEM_STAY;
+  ss->s_limit = 0;
+
+  ss->s_phase = PHASE_QUEUED;
+  ss->s_code = ITEM_OK;
+
+  ss->s_up = up;
+
+  return ss;
+}
+
+void destroy_sweep(struct sweep *w)
+{
+  unsigned int i;
 
-  ss->s_up = create_katcl(fd);
-  if(ss->s_up == NULL){
-    destroy_state(ss);
+  if(w == NULL){
+    return;
+  }
+
+  if(w->w_vector){
+    for(i = 0; i < w->w_count; i++){
+      destroy_state(w->w_vector[i]);
+    }
+    free(w->w_vector);
+    w->w_vector = NULL;
+  }
+  w->w_count = 0;
+
+  if(w->w_up){
+    destroy_katcl(w->w_up, 0);
+    w->w_up = NULL;
+  }
+
+  free(w);
+}
+
+struct sweep *create_sweep(int fd)
+{
+  struct sweep *w;
+
+  w = malloc(sizeof(struct sweep));
+  if(w == NULL){
     return NULL;
   }
 
+  w->w_vector = NULL;
+  w->w_count = 0;
+
+  w->w_next = 0;
+  w->w_active = 0;
+  w->w_limit = DEFAULT_CONCURRENT;
+  w->w_failed = 0;
+
+  w->w_table = NULL;
+  w->w_size = 0;
+
+  w->w_verbose = 1;
+
+  w->w_up = create_katcl(fd);
+  if(w->w_up == NULL){
+    destroy_sweep(w);
+    return NULL;
+  }
+
+  return w;
+}
+
+struct state *append_sweep(struct sweep *w)
+{
+  struct state **tmp, *ss;
+
+  tmp = realloc(w->w_vector, sizeof(struct state *) * (w->w_count + 1));
+  if(tmp == NULL){
+    return NULL;
+  }
+  w->w_vector = tmp;
+
+  ss = create_state(w->w_up);
+  if(ss == NULL){
+    return NULL;
+  }
+
+  w->w_vector[w->w_count] = ss;
+  w->w_count++;
+
   return ss;
 }
 
@@ -641,7 +745,9 @@ int decode_ping_item(struct state *ss, int tag)
 
 int reset_item(struct state *ss, int tag)
 {
-  log_message_katcl(ss->s_up, KATCP_LEVEL_TRACE, NAME, "restarting logic for roach %s", ss->s_name);
+  if(ss->s_transition == ITEM_STAY){
+    log_message_katcl(ss->s_up, KATCP_LEVEL_TRACE, NAME, "restarting logic for roach %s", ss->s_name);
+  }
 
   if(ss->s_fd >= 0){
     close(ss->s_fd);
@@ -653,6 +759,12 @@ int reset_item(struct state *ss, int tag)
 
   ss->s_power = POWER_NA;
 
+  /* pause before retrying, otherwise an unreachable roach spins */
+  if(tag > 0){
+    set_timeout(ss, tag, 0, ITEM_OK);
+    return ITEM_STAY;
+  }
+
   return ITEM_OK;
 }
 
@@ -827,14 +939,302 @@ int sleep_item(struct state *ss, int tag)
   return ITEM_OK;
 }
 
+/*********************************************************************/
+/* sweep logic *******************************************************/
+
+void start_state(struct sweep *w, struct state *ss, struct timeval *now)
+{
+  struct timeval delta;
+
+  load_table(ss, w->w_table, w->w_size);
+
+  ss->s_transition = ITEM_STAY;
+  ss->s_code = ITEM_OK;
+  ss->s_max = (-1);
+
+  /* the overall limit only starts counting once the roach gets a slot */
+  if(ss->s_limit > 0){
+    delta.tv_sec = ss->s_limit;
+    delta.tv_usec = 0;
+    add_time_katcp(&(ss->s_total), now, &delta);
+  }
+
+  ss->s_phase = PHASE_RUNNING;
+  w->w_active++;
+
+  log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "starting on roach %s (%u of %u active)", ss->s_name, w->w_active, w->w_limit);
+}
+
+void finish_state(struct sweep *w, struct state *ss)
+{
+  if(ss->s_fd >= 0){
+    close(ss->s_fd);
+    ss->s_fd = (-1);
+  }
+
+  ss->s_max = (-1);
+  ss->s_phase = PHASE_DONE;
+
+  if(w->w_active > 0){
+    w->w_active--;
+  }
+
+  if(ss->s_code == ITEM_FAIL){
+    w->w_failed++;
+    log_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "unable to complete operation on roach %s", ss->s_name);
+  } else {
+    log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "completed operation on roach %s", ss->s_name);
+  }
+}
+
+/* run the current item of a roach once, returns 1 once it is done, 0 to keep going */
+
+int step_state(struct sweep *w, struct state *ss, struct timeval *now)
+{
+  struct item *ix;
+  int code;
+
+  if(ss->s_index >= ss->s_size){
+    return 1;
+  }
+
+  ix = &(ss->s_table[ss->s_index]);
+  code = (*(ix->i_call))(ss, ix->i_tag);
+
+#ifdef DEBUG 
+  fprintf(stderr, "run: roach=%s, state=%u, code=%d\n", ss->s_name, ss->s_index, code);
+#endif
+  if(w->w_verbose > 1){
+    log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "roach=%s, state=%u, code=%d", ss->s_name, ss->s_index, code);
+  }
+
+  switch(code){
+    case ITEM_STAY : 
+      /* do nothing */
+      break;
+    case ITEM_OK : 
+      ss->s_transition = ITEM_STAY;
+      ss->s_index = ix->i_ok;
+      break;
+    case ITEM_FAIL :
+      ss->s_transition = ITEM_STAY;
+      ss->s_index = ix->i_fail;
+      break;
+    case ITEM_ALT : 
+      ss->s_transition = ITEM_STAY;
+      ss->s_index = ix->i_alt;
+      break;
+    default :
+      sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "bad state return code %d", code);
+      return -1;
+  }
+
+  ss->s_code = code;
+
+  if(ss->s_index >= ss->s_size){
+    log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "roach %s entered terminal state with code %d", ss->s_name, code);
+    return 1;
+  }
+
+  if(ss->s_transition != ITEM_STAY){ /* check if there is a per node timeout */
+    if(ss->s_max < 0){
+      init_fd(ss);
+    }
+
+    if(cmp_time_katcp(now, &(ss->s_single)) >= 0){
+      code = ss->s_transition;
+
+      ss->s_transition = ITEM_STAY;
+      ss->s_max = (-1);
+      switch(code){
+        case ITEM_OK : 
+          ss->s_index = ix->i_ok;
+          break;
+        case ITEM_FAIL : 
+          ss->s_index = ix->i_fail;
+          break;
+        case ITEM_ALT : 
+          ss->s_index = ix->i_alt;
+          break;
+        default :
+          sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "logic failure, unreasonable return code %d", code);
+          break;
+      }
+
+      ss->s_code = code;
+
+      log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "timeout occurred for roach %s, transition to %s state %d", ss->s_name, item_names[code], ss->s_index);
+    }
+  } 
+
+  if(ss->s_limit > 0){ /* check if overall timeout has been reached */
+    if(cmp_time_katcp(now, &(ss->s_total)) >= 0){
+      log_message_katcl(ss->s_up, KATCP_LEVEL_WARN, NAME, "operations on roach %s timed out after %u seconds", ss->s_name, ss->s_limit);
+      ss->s_code = ITEM_FAIL;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void earliest_time(struct timeval *target, int *valid, struct timeval *when)
+{
+  if((*valid == 0) || (cmp_time_katcp(when, target) < 0)){
+    target->tv_sec = when->tv_sec;
+    target->tv_usec = when->tv_usec;
+    *valid = 1;
+  }
+}
+
+/* returns 0 once all roaches are done, 1 if upstream went away, negative on internal errors */
+
+int run_sweep(struct sweep *w)
+{
+  struct state *ss;
+  struct timeval now, target, delta;
+  fd_set fsr, fsw;
+  unsigned int i;
+  int fd, max, result, valid, busy;
+
+  for(;;){
+
+    gettimeofday(&now, NULL);
+
+    while((w->w_active < w->w_limit) && (w->w_next < w->w_count)){
+      start_state(w, w->w_vector[w->w_next], &now);
+      w->w_next++;
+    }
+
+    if(w->w_active == 0){
+      return 0;
+    }
+
+    FD_ZERO(&fsr);
+    FD_ZERO(&fsw);
+
+    fd = fileno_katcl(w->w_up);
+    max = fd;
+
+    FD_SET(fd, &fsr);
+    if(flushing_katcl(w->w_up)){
+      FD_SET(fd, &fsw);
+    }
+
+    valid = 0;
+    busy = 0;
+
+    for(i = 0; i < w->w_next; i++){
+      ss = w->w_vector[i];
+      if(ss->s_phase != PHASE_RUNNING){
+        continue;
+      }
+
+      result = step_state(w, ss, &now);
+      if(result < 0){
+        return -1;
+      }
+
+      if(result > 0){
+        finish_state(w, ss);
+        busy = 1; /* a slot has opened, start the next roach without delay */
+        continue;
+      }
+
+      if(ss->s_max < 0){ /* not waiting for anything, run it again at once */
+        busy = 1;
+        continue;
+      }
+
+      if(ss->s_fd >= 0){
+        if(FD_ISSET(ss->s_fd, &(ss->s_fsr))){
+          FD_SET(ss->s_fd, &fsr);
+        }
+        if(FD_ISSET(ss->s_fd, &(ss->s_fsw))){
+          FD_SET(ss->s_fd, &fsw);
+        }
+        if(ss->s_fd > max){
+          max = ss->s_fd;
+        }
+      }
+
+      if(ss->s_transition != ITEM_STAY){
+        earliest_time(&target, &valid, &(ss->s_single));
+      }
+      if(ss->s_limit > 0){
+        earliest_time(&target, &valid, &(ss->s_total));
+      }
+    }
+
+    if(busy){
+      delta.tv_sec = 0;
+      delta.tv_usec = 0;
+      valid = 1;
+    } else if(valid){
+      sub_time_katcp(&delta, &target, &now);
+    }
+
+    result = select(max + 1, &fsr, &fsw, NULL, valid ? &delta : NULL);
+    if(result < 0){
+      switch(errno){
+        case EAGAIN :
+        case EINTR  :
+          continue; /* WARNING */
+        default  :
+          sync_message_katcl(w->w_up, KATCP_LEVEL_ERROR, NAME, "select failed: %s", strerror(errno));
+          return -1;
+      }
+    }
+
+    /* this falls into the housekeeping category */
+    if(FD_ISSET(fd, &fsr)){
+      result = read_katcl(w->w_up);
+
+      /* discard all upstream requests */
+      while(have_katcl(w->w_up) > 0);
+
+      if(result > 0){
+        return 1;
+      }
+    }
+
+    if(FD_ISSET(fd, &fsw)){
+      write_katcl(w->w_up);
+    }
+
+    /* hand each roach the readiness of its own connection */
+    for(i = 0; i < w->w_next; i++){
+      ss = w->w_vector[i];
+      if((ss->s_phase != PHASE_RUNNING) || (ss->s_max < 0)){
+        continue;
+      }
+
+      FD_ZERO(&(ss->s_fsr));
+      FD_ZERO(&(ss->s_fsw));
+
+      if(ss->s_fd >= 0){
+        if(FD_ISSET(ss->s_fd, &fsr)){
+          FD_SET(ss->s_fd, &(ss->s_fsr));
+        }
+        if(FD_ISSET(ss->s_fd, &fsw)){
+          FD_SET(ss->s_fd, &(ss->s_fsw));
+        }
+      }
+
+      ss->s_max = (-1);
+    }
+  }
+}
+
 /*********************************************************************/
 /* main and friends **************************************************/
 
 void usage(char *app)
 {
-  printf("usage: %s [flags] xport\n", app);
+  printf("usage: %s [flags] xport [xport ...]\n", app);
   printf("-h                 this help\n");
-  printf("-t seconds         length of time to retry executing command in case of failure");
+  printf("-t seconds         length of time to retry executing command on each xport in case of failure\n");
+  printf("-c count           maximum number of xports to work on concurrently (default %d)\n", DEFAULT_CONCURRENT);
 
 #if 0
   printf("-v                 increase verbosity\n");
@@ -847,7 +1247,7 @@ void usage(char *app)
 
   printf("return codes:\n");
   printf("0     command completed successfully\n");
-  printf("1     command failed\n");
+  printf("1     command failed on at least one xport\n");
   printf("2     usage problems\n");
   printf("3     network problems\n");
   printf("4     internal errors\n");
@@ -855,7 +1255,7 @@ void usage(char *app)
 
 struct item poweron_table[11] = {
   { setup_network_item,       2,  0,  0,  0 },   /* 0 */
-  { reset_item,               0,  0,  0,  0 },   /* 1 */  
+  { reset_item,               0,  0,  0,  1 },   /* 1 */  
   { complete_network_item,    3,  1,  0,  0 },   /* 2 */ 
   { request_ping_item,        4,  1,  0,  0 },   /* 3 */
   { decode_ping_item,         5,  1,  0,  0 },   /* 4 */
@@ -869,7 +1269,7 @@ struct item poweron_table[11] = {
 
 struct item powerdown_table[9] = {
   { setup_network_item,       2,  0,  0,  0 },   /* 0 */
-  { reset_item,               0,  0,  0,  0 },   /* 1 */  
+  { reset_item,               0,  0,  0,  1 },   /* 1 */  
   { complete_network_item,    3,  1,  0,  0 },   /* 2 */ 
   { request_ping_item,        4,  1,  0,  0 },   /* 3 */
   { decode_ping_item,         5,  1,  0,  0 },   /* 4 */
@@ -881,7 +1281,7 @@ struct item powerdown_table[9] = {
 
 struct item powerquery_table[7] = {
   { setup_network_item,       2,  0,  0,  0 },   /* 0 */
-  { reset_item,               0,  0,  0,  0 },   /* 1 */  
+  { reset_item,               0,  0,  0,  1 },   /* 1 */  
   { complete_network_item,    3,  1,  0,  0 },   /* 2 */ 
   { request_ping_item,        4,  1,  0,  0 },   /* 3 */
   { decode_ping_item,         5,  1,  0,  0 },   /* 4 */
@@ -891,41 +1291,20 @@ struct item powerquery_table[7] = {
 
 int main(int argc, char **argv)
 {
+  struct sweep *w;
   struct state *ss;
-  int i, j, c, fd, verbose, result, run, power, code, valid, timeout;
-#if 0
-  unsigned int value, address;
-#endif
-  struct timeval now, target, delta;
-  int *(call)(struct state *s, int tag);
-  struct item *ix;
+  int i, j, c, verbose, result, power, timeout, concurrent;
+  unsigned int k;
 
-  ss = create_state(STDOUT_FILENO);
-  if(ss == NULL){
+  w = create_sweep(STDOUT_FILENO);
+  if(w == NULL){
     return 4;
   }
 
   timeout = DEFAULT_TOTAL;
+  concurrent = DEFAULT_CONCURRENT;
   power = POWER_ON;
 
-#if 0
-  char *app, *parm, *cmd, *copy, *ptr, *servers;
-  int verbose, result, status, base, info, reply, timeout, pos, flags, show;
-  int xmit, code;
-  unsigned int len;
-  
-  info = 1;
-  reply = 1;
-  i = j = 1;
-  app = argv[0];
-  base = (-1);
-  timeout = 5;
-  pos = (-1);
-  k = NULL;
-  show = 1;
-  parm = NULL;
-#endif
-
   verbose = 1;
   i = j = 1;
 
@@ -953,6 +1332,7 @@ int main(int argc, char **argv)
           j++;
           break;
 
+        case 'c' :
         case 't' :
           j++;
           if (argv[i][j] == '\0') {
@@ -960,11 +1340,14 @@ int main(int argc, char **argv)
             i++;
           }
           if (i >= argc) {
-            sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "timeout needs a parameter");
+            sync_message_katcl(w->w_up, KATCP_LEVEL_ERROR, NAME, "option -%c needs a parameter", c);
             return 2;
           }
 
           switch(c){
+            case 'c' :
+              concurrent = atoi(argv[i] + j);
+              break;
             case 't' :
               timeout = atoi(argv[i] + j);
               break;
@@ -992,214 +1375,79 @@ int main(int argc, char **argv)
           break;
 
         default:
-          sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "unknown option -%c", argv[i][j]);
+          sync_message_katcl(w->w_up, KATCP_LEVEL_ERROR, NAME, "unknown option -%c", argv[i][j]);
           return 2;
       }
     } else {
 
+      ss = append_sweep(w);
+      if(ss == NULL){
+        sync_message_katcl(w->w_up, KATCP_LEVEL_ERROR, NAME, "unable to allocate state for roach %s", argv[i]);
+        return 4;
+      }
+
       if(add_roach(ss, argv[i]) < 0){
-        sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "unable to add roach %s", argv[i]);
+        sync_message_katcl(w->w_up, KATCP_LEVEL_ERROR, NAME, "unable to add roach %s", argv[i]);
         return 4;
       }
       i++;
     }
   }
 
-  ss->s_limit = timeout;
+  if(concurrent <= 0){
+    sync_message_katcl(w->w_up, KATCP_LEVEL_ERROR, NAME, "need to work on at least one xport at a time");
+    return 2;
+  }
+
+  w->w_limit = concurrent;
+  w->w_verbose = verbose;
 
   switch(power){
     case POWER_ON :
-      load_table(ss, poweron_table, 11);
+      w->w_table = poweron_table;
+      w->w_size = 11;
       break;
     case POWER_OFF :
-      load_table(ss, powerdown_table, 9);
+      w->w_table = powerdown_table;
+      w->w_size = 9;
       break;
     case POWER_NA : /* overloading of a macro */
-      load_table(ss, powerquery_table, 7);
+      w->w_table = powerquery_table;
+      w->w_size = 7;
       break;
     default :
-      sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "logic problem - bad power request type");
+      sync_message_katcl(w->w_up, KATCP_LEVEL_ERROR, NAME, "logic problem - bad power request type");
       return 4;
   }
 
-  if(ss->s_name == NULL){
-    sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "need a roach xport to talk to");
+  if(w->w_count == 0){
+    sync_message_katcl(w->w_up, KATCP_LEVEL_ERROR, NAME, "need a roach xport to talk to");
     return 2;
   }
 
-
-  if(ss->s_table == NULL){
-    sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "need a table to be loaded");
-    return 2;
+  for(k = 0; k < w->w_count; k++){
+    w->w_vector[k]->s_limit = timeout;
   }
 
-  gettimeofday(&now, NULL);
-
-  if(ss->s_limit > 0){
-    delta.tv_sec = ss->s_limit;
-    delta.tv_usec = 0;
+  result = run_sweep(w);
+  if(result < 0){
+    return 4;
   }
 
-  add_time_katcp(&(ss->s_total), &now, &delta);
-
-  run = 1;
-  code = ITEM_OK;
-
-  for(run = 1; run > 0; ){
-
-    if(ss->s_index >= ss->s_size){
-      run = 0;
-      continue;
-    }
-
-    ix = &(ss->s_table[ss->s_index]);
-    code = (*(ix->i_call))(ss, ix->i_tag);
-
-#ifdef DEBUG 
-    fprintf(stderr, "run: state=%u, code=%d\n", ss->s_index, code);
-#endif
-    if(verbose > 1){
-      log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "state=%u, code=%d", ss->s_index, code);
-    }
-
-    switch(code){
-      case ITEM_STAY : 
-        /* do nothing */
-        break;
-      case ITEM_OK : 
-        ss->s_transition = ITEM_STAY;
-        ss->s_index = ix->i_ok;
-        break;
-      case ITEM_FAIL :
-        ss->s_transition = ITEM_STAY;
-        ss->s_index = ix->i_fail;
-        break;
-      case ITEM_ALT : 
-        ss->s_transition = ITEM_STAY;
-        ss->s_index = ix->i_alt;
-        break;
-      default :
-        sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "bad state return code %d", code);
-        return 4;
-    }
-
-    if(ss->s_index >= ss->s_size){
-      log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "entered terminal state with code %d", code);
-      run = 0;
-      continue; /* break out of while loop */
+  if(w->w_count > 1){
+    if(w->w_failed > 0){
+      log_message_katcl(w->w_up, KATCP_LEVEL_WARN, NAME, "operation failed on %u of %u roaches", w->w_failed, w->w_count);
+    } else if(result == 0){
+      log_message_katcl(w->w_up, KATCP_LEVEL_INFO, NAME, "operation completed on all %u roaches", w->w_count);
     }
-
-#if 0
-    sleep(1);
-#endif
-
-    gettimeofday(&now, NULL);
-    valid = 0;
-
-    if(ss->s_transition != ITEM_STAY){ /* check if there is a per node timeout */
-      if(ss->s_max < 0){
-        init_fd(ss);
-      }
-
-      if(cmp_time_katcp(&now, &(ss->s_single)) >= 0){
-        code = ss->s_transition;
-
-        ss->s_transition = ITEM_STAY;
-        ss->s_max = (-1);
-        switch(code){
-          case ITEM_OK : 
-            ss->s_index = ix->i_ok;
-            break;
-          case ITEM_FAIL : 
-            ss->s_index = ix->i_fail;
-            break;
-          case ITEM_ALT : 
-            ss->s_index = ix->i_alt;
-            break;
-          default :
-            sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "logic failure, unreasonable return code %d", code);
-            break;
-        }
-
-        log_message_katcl(ss->s_up, KATCP_LEVEL_DEBUG, NAME, "timeout occurred, transition to %s state %d", item_names[code], ss->s_index);
-
-      } else {
-        target.tv_sec = ss->s_single.tv_sec;
-        target.tv_usec = ss->s_single.tv_usec;
-        valid = 1;
-      }
-    } 
-
-    if(ss->s_limit > 0){ /* check if overall timeout has been reached */
-      if(cmp_time_katcp(&now, &(ss->s_total)) >= 0){
-        log_message_katcl(ss->s_up, KATCP_LEVEL_WARN, NAME, "operations timed out after %u seconds", ss->s_limit);
-        code = ITEM_FAIL;
-        run = 0;
-        continue; /* break out of while loop */
-      } else {
-        if((valid == 0) || (cmp_time_katcp(&(ss->s_total), &target) < 0)){
-          target.tv_sec = ss->s_total.tv_sec;
-          target.tv_usec = ss->s_total.tv_usec;
-          valid = 1;
-        }
-      }
-    }
-
-    if(valid){
-      sub_time_katcp(&delta, &target, &now);
-    }
-
-    if(ss->s_max >= 0){ /* are we waiting for io (optionally with timeout) ? */
-      result = select(ss->s_max + 1, &(ss->s_fsr), &(ss->s_fsw), NULL, valid ? &delta : NULL);
-      switch(result){
-        case -1 :
-          switch(errno){
-            case EAGAIN :
-            case EINTR  :
-              continue; /* WARNING */
-            default  :
-              sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "select failed: %s", strerror(errno));
-              return 4;
-          }
-          break;
-#if 0
-        case  0 :
-          sync_message_katcl(ss->s_up, KATCP_LEVEL_ERROR, NAME, "requests timed out despite having no timeout");
-          /* could terminate cleanly here, but ... */
-          return 4;
-#endif
-      }
-
-      /* this falls into the housekeeping category */
-      fd = fileno_katcl(ss->s_up);
-      if(FD_ISSET(fd, &(ss->s_fsr))){
-        result = read_katcl(ss->s_up);
-        if(result > 0){
-          code = ITEM_OK;
-          run = 0; /* end loop, but not immediately */
-        }
-
-        /* discard all upstream requests */
-        while(have_katcl(ss->s_up) > 0);
-      }
-
-      if(FD_ISSET(fd, &(ss->s_fsw))){
-        result = write_katcl(ss->s_up);
-      }
-
-      ss->s_max = (-1);
-    }
-
   }
 
   /* force drain */
-  while(write_katcl(ss->s_up) == 0);
-  destroy_state(ss);
+  while(write_katcl(w->w_up) == 0);
 
-  if(code != ITEM_FAIL){
-    return 0;
-  } else {
-    return 1;
-  }
-}
+  result = (w->w_failed > 0) ? 1 : 0;
 
+  destroy_sweep(w);
+
+  return result;
+}